@@ -0,0 +1,473 @@
+/**
+ * salmon_bench: reproducible microbenchmarks of salmon's core kernels.
+ *
+ * Every benchmark works on synthetic inputs generated from a fixed seed,
+ * so that successive runs (and runs of successive versions) time the same
+ * work.  Each benchmark is repeated --reps times, and the fastest, median
+ * and mean times are reported on the console and, with --output, written
+ * as JSON so that they can be tracked over time.
+ *
+ *     salmon_bench [--filter <substring>] [--reps N] [--threads N] [--output bench.json]
+ *                  [--eqClasses eq_classes.bin]
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+#include "spdlog/spdlog.h"
+
+#include "BinaryEquivalenceClasses.hpp"
+#include "CollapsedEMOptimizer.hpp"
+#include "EquivalenceClassArena.hpp"
+#include "EquivalenceClassBuilder.hpp"
+#include "FragmentLengthDistribution.hpp"
+#include "MultinomialSampler.hpp"
+#include "SalmonMath.hpp"
+#include "SalmonConfig.hpp"
+#include "Transcript.hpp"
+#include "TranscriptGroup.hpp"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct BenchResult {
+    std::string name;
+    std::string params;
+    uint64_t itemsPerRep{0};
+    std::vector<double> secs;
+
+    double minSec() const { return *std::min_element(secs.begin(), secs.end()); }
+    double meanSec() const {
+        double s{0.0};
+        for (auto v : secs) { s += v; }
+        return s / secs.size();
+    }
+    double medianSec() const {
+        auto v = secs;
+        std::sort(v.begin(), v.end());
+        return (v.size() % 2) ? v[v.size() / 2] : 0.5 * (v[v.size() / 2 - 1] + v[v.size() / 2]);
+    }
+};
+
+/**
+ * Runs the benchmarks whose names match the filter, and collects their
+ * results.
+ */
+class BenchRunner {
+    public:
+        BenchRunner(const std::string& filter, uint32_t reps) : filter_(filter), reps_(reps) {}
+
+        /**
+         * Time reps runs of fn (after one untimed warm-up run), each of
+         * which processes itemsPerRep items; setup is called, untimed,
+         * before every run.
+         */
+        void run(const std::string& name, const std::string& params, uint64_t itemsPerRep,
+                 std::function<void()> setup, std::function<void()> fn) {
+            if (!filter_.empty() and name.find(filter_) == std::string::npos) { return; }
+            BenchResult r;
+            r.name = name;
+            r.params = params;
+            r.itemsPerRep = itemsPerRep;
+            setup();
+            fn();
+            for (uint32_t i = 0; i < reps_; ++i) {
+                setup();
+                auto start = Clock::now();
+                fn();
+                r.secs.push_back(std::chrono::duration<double>(Clock::now() - start).count());
+            }
+            std::cerr << name << " [" << params << "]: min " << r.minSec() * 1e3
+                      << " ms, median " << r.medianSec() * 1e3 << " ms, "
+                      << (r.itemsPerRep / r.minSec()) << " items/sec\n";
+            results_.push_back(r);
+        }
+
+        bool writeJSON(const std::string& path, uint32_t numThreads, uint32_t seed) const {
+            std::ofstream out(path);
+            if (!out.good()) { return false; }
+            out << "{\n";
+            out << "    \"salmon_version\": \"" << salmon::version << "\",\n";
+            out << "    \"threads\": " << numThreads << ",\n";
+            out << "    \"seed\": " << seed << ",\n";
+            out << "    \"reps\": " << reps_ << ",\n";
+            out << "    \"benchmarks\": [";
+            for (size_t i = 0; i < results_.size(); ++i) {
+                auto& r = results_[i];
+                out << (i == 0 ? "\n" : ",\n");
+                out << "        {\n";
+                out << "            \"name\": \"" << r.name << "\",\n";
+                out << "            \"params\": \"" << r.params << "\",\n";
+                out << "            \"items_per_rep\": " << r.itemsPerRep << ",\n";
+                out << "            \"min_sec\": " << r.minSec() << ",\n";
+                out << "            \"median_sec\": " << r.medianSec() << ",\n";
+                out << "            \"mean_sec\": " << r.meanSec() << ",\n";
+                out << "            \"items_per_sec\": " << (r.itemsPerRep / r.minSec()) << "\n";
+                out << "        }";
+            }
+            out << (results_.empty() ? "]\n" : "\n    ]\n");
+            out << "}\n";
+            return out.good();
+        }
+
+    private:
+        std::string filter_;
+        uint32_t reps_;
+        std::vector<BenchResult> results_;
+};
+
+/**
+ * Random equivalence class labels over numTranscripts transcripts, with
+ * the skewed size distribution (most classes small, a few large) of real
+ * data: the size of a class is geometric with mean meanSize.  The
+ * transcripts of a label are drawn from a window around a "gene", so that
+ * labels overlap the way the isoforms of a gene do.
+ */
+std::vector<std::vector<uint32_t>> syntheticLabels(size_t numLabels, uint32_t numTranscripts,
+                                                   double meanSize, std::mt19937& gen) {
+    std::geometric_distribution<uint32_t> extra(1.0 / meanSize);
+    std::uniform_int_distribution<uint32_t> gene(0, numTranscripts - 1);
+    std::vector<std::vector<uint32_t>> labels(numLabels);
+    for (auto& l : labels) {
+        uint32_t size = std::min<uint32_t>(1 + extra(gen), 64);
+        uint32_t center = gene(gen);
+        uint32_t lo = (center > 4 * size) ? center - 4 * size : 0;
+        uint32_t hi = std::min(numTranscripts - 1, center + 4 * size);
+        std::uniform_int_distribution<uint32_t> member(lo, hi);
+        while (l.size() < size) {
+            uint32_t t = member(gen);
+            if (std::find(l.begin(), l.end(), t) == l.end()) { l.push_back(t); }
+            if (l.size() == hi - lo + 1) { break; }
+        }
+        std::sort(l.begin(), l.end());
+    }
+    return labels;
+}
+
+std::vector<Transcript> syntheticTranscripts(uint32_t numTranscripts, std::mt19937& gen) {
+    std::uniform_int_distribution<uint32_t> len(300, 5000);
+    std::vector<Transcript> transcripts;
+    transcripts.reserve(numTranscripts);
+    for (uint32_t i = 0; i < numTranscripts; ++i) {
+        transcripts.emplace_back(i, "txp", len(gen));
+        transcripts.back().EffectiveLength = transcripts.back().RefLength;
+    }
+    return transcripts;
+}
+
+/**
+ * The EM and VBEM rounds, over synthetic classes or, if eqClassesPath is
+ * given, over the classes of an eq_classes.bin (written by salmon quant
+ * --dumpEq --dumpEqBinary, or by salmon_simulate).
+ */
+bool benchEM(BenchRunner& runner, uint32_t seed, uint32_t numTranscripts, size_t numClasses,
+             const std::string& eqClassesPath) {
+    std::mt19937 gen(seed);
+    EquivalenceClassArena arena;
+    std::vector<uint64_t> counts;
+    size_t numEntries{0};
+    if (eqClassesPath.empty()) {
+        auto labels = syntheticLabels(numClasses, numTranscripts, 3.0, gen);
+        std::uniform_real_distribution<double> w(0.1, 1.0);
+        std::geometric_distribution<uint64_t> c(0.05);
+        for (auto& l : labels) { numEntries += l.size(); }
+        arena.reserve(labels.size(), numEntries);
+        std::vector<double> weights;
+        for (auto& l : labels) {
+            weights.resize(l.size());
+            double sum{0.0};
+            for (auto& x : weights) { x = w(gen); sum += x; }
+            for (auto& x : weights) { x /= sum; }
+            uint64_t count = 1 + c(gen);
+            arena.addClass(l.begin(), l.end(), weights.begin(), weights.begin(), false, count);
+            counts.push_back(count);
+        }
+    } else {
+        BinaryEqClassReader reader(eqClassesPath);
+        if (!reader.good()) {
+            std::cerr << "could not read the equivalence classes from " << eqClassesPath << '\n';
+            return false;
+        }
+        numTranscripts = reader.numTranscripts();
+        numClasses = reader.numClasses();
+        std::vector<uint32_t> labels;
+        std::vector<float> weights;
+        std::vector<double> uniform;
+        uint64_t count{0};
+        while (reader.next(labels, weights, count)) {
+            if (weights.empty()) {
+                uniform.assign(labels.size(), 1.0 / labels.size());
+                arena.addClass(labels.begin(), labels.end(), uniform.begin(), uniform.begin(), false, count);
+            } else {
+                arena.addClass(labels.begin(), labels.end(), weights.begin(), weights.begin(), false, count);
+            }
+            counts.push_back(count);
+            numEntries += labels.size();
+        }
+        if (!reader.good()) {
+            std::cerr << eqClassesPath << " is truncated\n";
+            return false;
+        }
+    }
+    arena.combinedWeights = arena.weights;
+    auto transcripts = syntheticTranscripts(numTranscripts, gen);
+
+    double totLen{0.0};
+    for (auto& t : transcripts) { totLen += t.EffectiveLength; }
+    std::vector<double> alphas(numTranscripts, 1.0 / numTranscripts);
+    std::vector<double> alphasPrime(numTranscripts, 0.0);
+    std::vector<double> expTheta(numTranscripts, 0.0);
+    auto reset = [&]() -> void { std::fill(alphas.begin(), alphas.end(), 1.0 / numTranscripts); };
+    std::string params = (eqClassesPath.empty() ? std::string() : eqClassesPath + ": ") +
+                         std::to_string(numTranscripts) + " transcripts, " +
+                         std::to_string(numClasses) + " classes, " + std::to_string(numEntries) + " entries";
+
+    const uint32_t rounds{10};
+    runner.run("EMUpdate", params + ", 10 rounds", rounds * numEntries, reset, [&]() -> void {
+        for (uint32_t i = 0; i < rounds; ++i) {
+            salmon::optimizer::emRound(arena, counts, transcripts, alphas, alphasPrime);
+            std::swap(alphas, alphasPrime);
+        }
+    });
+    runner.run("VBEMUpdate", params + ", 10 rounds", rounds * numEntries, reset, [&]() -> void {
+        for (uint32_t i = 0; i < rounds; ++i) {
+            salmon::optimizer::vbemRound(arena, counts, transcripts, 1e-3, totLen, alphas, alphasPrime, expTheta);
+            std::swap(alphas, alphasPrime);
+        }
+    });
+    arena.storeSinglePrecisionWeights();
+    runner.run("EMUpdate (single-precision weights)", params + ", 10 rounds", rounds * numEntries, reset, [&]() -> void {
+        for (uint32_t i = 0; i < rounds; ++i) {
+            salmon::optimizer::emRound(arena, counts, transcripts, alphas, alphasPrime);
+            std::swap(alphas, alphasPrime);
+        }
+    });
+    return true;
+}
+
+/**
+ * Each of numThreads threads adds fragsPerThread fragments, drawn from a
+ * common pool of labels, to a shared builder: directly (as the
+ * non-thread-local path does) and through a LocalEquivalenceClassBuilder
+ * flushed every miniBatch fragments (as processMiniBatch does).
+ */
+void benchAddGroup(BenchRunner& runner, uint32_t seed, uint32_t numThreads,
+                   uint32_t numTranscripts, size_t numLabels, size_t fragsPerThread) {
+    std::mt19937 gen(seed);
+    auto labelTxps = syntheticLabels(numLabels, numTranscripts, 3.0, gen);
+    std::vector<TranscriptGroup> labels;
+    for (auto& l : labelTxps) { labels.emplace_back(l); }
+    // The sequence of labels seen by each thread
+    std::vector<std::vector<uint32_t>> frags(numThreads);
+    std::uniform_int_distribution<uint32_t> pick(0, labels.size() - 1);
+    for (auto& f : frags) {
+        f.resize(fragsPerThread);
+        for (auto& x : f) { x = pick(gen); }
+    }
+
+    auto log = spdlog::get("benchLog");
+    std::unique_ptr<EquivalenceClassBuilder> builder;
+    auto setup = [&]() -> void { builder.reset(new EquivalenceClassBuilder(log)); builder->start(); };
+    std::string params = std::to_string(numThreads) + " threads, " + std::to_string(numLabels) +
+                         " labels, " + std::to_string(fragsPerThread) + " fragments per thread";
+
+    auto runThreads = [&](bool local) -> void {
+        std::vector<std::thread> threads;
+        for (uint32_t t = 0; t < numThreads; ++t) {
+            threads.emplace_back([&, t, local]() -> void {
+                std::vector<double> weights, posWeights;
+                LocalEquivalenceClassBuilder localBuilder(*builder);
+                size_t n{0};
+                for (auto li : frags[t]) {
+                    auto& g = labels[li];
+                    weights.assign(g.txps.size(), 1.0 / g.txps.size());
+                    posWeights.assign(g.txps.size(), 1.0);
+                    if (local) {
+                        localBuilder.addGroup(g, weights, posWeights);
+                        if (++n % 5000 == 0) { localBuilder.flush(); }
+                    } else {
+                        builder->addGroup(g, weights, posWeights);
+                    }
+                }
+            });
+        }
+        for (auto& th : threads) { th.join(); }
+    };
+    runner.run("EquivalenceClassBuilder::addGroup", params, numThreads * fragsPerThread, setup,
+               [&]() -> void { runThreads(false); });
+    runner.run("LocalEquivalenceClassBuilder::addGroup+flush", params, numThreads * fragsPerThread, setup,
+               [&]() -> void { runThreads(true); });
+}
+
+void benchMultinomial(BenchRunner& runner, uint32_t seed) {
+    std::mt19937 gen(seed);
+    for (uint32_t k : {16u, 1024u, 100000u}) {
+        std::vector<double> probs(k);
+        std::uniform_real_distribution<double> u(0.0, 1.0);
+        double sum{0.0};
+        for (auto& p : probs) { p = u(gen); sum += p; }
+        for (auto& p : probs) { p /= sum; }
+        std::vector<uint64_t> sample(k, 0);
+        for (uint32_t n : {10u, 100000u}) {
+            MultinomialSampler ms(seed);
+            uint32_t draws = std::max(1u, 2000000u / (k + n));
+            runner.run("MultinomialSampler", "k = " + std::to_string(k) + ", n = " + std::to_string(n),
+                       static_cast<uint64_t>(draws) * n, [&]() -> void { ms.seed(seed); }, [&]() -> void {
+                for (uint32_t i = 0; i < draws; ++i) { ms(sample.begin(), n, k, probs.begin()); }
+            });
+        }
+    }
+}
+
+void benchFragLengthDist(BenchRunner& runner, uint32_t seed) {
+    std::mt19937 gen(seed);
+    std::normal_distribution<double> lens(200.0, 80.0);
+    const size_t numVals{1000000};
+    std::vector<size_t> vals(numVals);
+    for (auto& v : vals) { v = static_cast<size_t>(std::max(1.0, std::min(999.0, lens(gen)))); }
+
+    std::unique_ptr<FragmentLengthDistribution> fld;
+    auto setup = [&]() -> void { fld.reset(new FragmentLengthDistribution(1.0, 1000, 200, 80, 4, 0.5, 1)); };
+    runner.run("FragmentLengthDistribution::addVal", "1M lengths", numVals, setup, [&]() -> void {
+        for (auto v : vals) { fld->addVal(v, 0.0); }
+    });
+    runner.run("LocalFragmentLengthDistribution::addVal+flush", "1M lengths, flushed every 5000", numVals, setup, [&]() -> void {
+        LocalFragmentLengthDistribution local(*fld);
+        size_t n{0};
+        for (auto v : vals) {
+            local.addVal(v);
+            if (++n % 5000 == 0) { local.flush(0.0); }
+        }
+        local.flush(0.0);
+    });
+    double acc{0.0};
+    runner.run("FragmentLengthDistribution::pmf", "1M lengths", numVals, setup, [&]() -> void {
+        for (auto v : vals) { acc += fld->pmf(v); }
+    });
+    runner.run("CachedFragmentLengthPMF::pmf", "1M lengths", numVals, setup, [&]() -> void {
+        CachedFragmentLengthPMF cached(*fld);
+        cached.refresh();
+        for (auto v : vals) { acc += cached.pmf(v); }
+    });
+    if (std::isnan(acc)) { std::cerr << "(the fragment length pmf was NaN)\n"; }
+}
+
+
+void benchLogMath(BenchRunner& runner, uint32_t seed) {
+    std::mt19937 gen(seed);
+    std::uniform_real_distribution<double> vals(-60.0, 0.0);
+    std::exponential_distribution<double> diffs(0.5);
+    const size_t numVals{1000000};
+    std::vector<double> xs(numVals), ys(numVals), out(numVals);
+    for (size_t i = 0; i < numVals; ++i) {
+        xs[i] = vals(gen);
+        ys[i] = xs[i] - diffs(gen);
+    }
+    double acc{0.0};
+    using namespace salmon::math;
+    runner.run("logAddExact", "1M pairs", numVals, []() -> void {}, [&]() -> void {
+        for (size_t i = 0; i < numVals; ++i) { acc += logAddExact(xs[i], ys[i]); }
+    });
+    runner.run("logAddFast", "1M pairs", numVals, []() -> void {}, [&]() -> void {
+        for (size_t i = 0; i < numVals; ++i) { acc += logAddFast(xs[i], ys[i]); }
+    });
+    runner.run("logSubExact", "1M pairs", numVals, []() -> void {}, [&]() -> void {
+        for (size_t i = 0; i < numVals; ++i) { acc += logSubExact(xs[i], ys[i]); }
+    });
+    runner.run("logSubFast", "1M pairs", numVals, []() -> void {}, [&]() -> void {
+        for (size_t i = 0; i < numVals; ++i) { acc += logSubFast(xs[i], ys[i]); }
+    });
+    runner.run("logAddBatch", "1M pairs", numVals, []() -> void {}, [&]() -> void {
+        logAddBatch(xs.data(), ys.data(), out.data(), numVals);
+    });
+    runner.run("logSumExp", "1M values", numVals, []() -> void {}, [&]() -> void {
+        acc += logSumExp(xs.data(), numVals);
+    });
+    if (std::isnan(acc)) { std::cerr << "(a log-space sum was NaN)\n"; }
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    namespace po = boost::program_options;
+
+    std::string filter;
+    std::string outputPath;
+    std::string eqClassesPath;
+    uint32_t reps{5};
+    uint32_t seed{271828};
+    uint32_t numThreads{std::max(1u, std::thread::hardware_concurrency())};
+    uint32_t numTranscripts{100000};
+    size_t numClasses{500000};
+
+    po::options_description opts("salmon_bench options");
+    opts.add_options()
+    ("help,h", "Produce help message")
+    ("filter", po::value<std::string>(&filter), "Only run the benchmarks whose names contain this string")
+    ("output,o", po::value<std::string>(&outputPath), "Write the results, as JSON, to this file")
+    ("reps", po::value<uint32_t>(&reps)->default_value(reps), "The number of timed runs of each benchmark")
+    ("seed", po::value<uint32_t>(&seed)->default_value(seed), "The seed from which the synthetic inputs are generated")
+    ("threads,p", po::value<uint32_t>(&numThreads)->default_value(numThreads),
+                        "The largest number of threads with which to run the multi-threaded benchmarks")
+    ("numTranscripts", po::value<uint32_t>(&numTranscripts)->default_value(numTranscripts),
+                        "The number of transcripts of the synthetic equivalence classes")
+    ("numClasses", po::value<size_t>(&numClasses)->default_value(numClasses),
+                        "The number of synthetic equivalence classes")
+    ("eqClasses", po::value<std::string>(&eqClassesPath),
+                        "Run the optimizer benchmarks over the classes of this eq_classes.bin (e.g. from "
+                        "salmon_simulate) rather than over synthetic ones")
+    ;
+
+    po::variables_map vm;
+    try {
+        po::store(po::command_line_parser(argc, argv).options(opts).run(), vm);
+        if (vm.count("help")) {
+            std::cout << opts << std::endl;
+            return 0;
+        }
+        po::notify(vm);
+    } catch (po::error& e) {
+        std::cerr << "exception : [" << e.what() << "]. Exiting.\n";
+        std::exit(1);
+    }
+    if (reps == 0) { reps = 1; }
+    if (numTranscripts == 0) { numTranscripts = 1; }
+
+    auto consoleSink = std::make_shared<spdlog::sinks::stderr_sink_mt>();
+    auto log = spdlog::create("benchLog", {consoleSink});
+
+    BenchRunner runner(filter, reps);
+    if (!benchEM(runner, seed, numTranscripts, numClasses, eqClassesPath)) { return 1; }
+    // 1, 2, 4, ... threads, and then all of them
+    std::vector<uint32_t> threadCounts;
+    for (uint32_t t = 1; t < numThreads; t *= 2) { threadCounts.push_back(t); }
+    threadCounts.push_back(numThreads);
+    for (auto t : threadCounts) {
+        benchAddGroup(runner, seed, t, numTranscripts, 200000, 500000);
+    }
+    benchMultinomial(runner, seed);
+    benchFragLengthDist(runner, seed);
+    benchLogMath(runner, seed);
+
+    if (!outputPath.empty()) {
+        if (!runner.writeJSON(outputPath, numThreads, seed)) {
+            log->error("could not write the results to {}", outputPath);
+            return 1;
+        }
+        log->info("wrote the results to {}", outputPath);
+    }
+    return 0;
+}
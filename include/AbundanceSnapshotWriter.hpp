@@ -0,0 +1,245 @@
+#ifndef __ABUNDANCE_SNAPSHOT_WRITER_HPP__
+#define __ABUNDANCE_SNAPSHOT_WRITER_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "spdlog/spdlog.h"
+
+#include "EquivalenceClassBuilder.hpp"
+#include "SalmonMath.hpp"
+#include "Transcript.hpp"
+
+/**
+ * Writes snapshots of the abundance estimates while the reads are still
+ * being mapped (salmon quant --snapshotInterval), e.g. to follow a
+ * real-time sequencing run.  Every interval fragments, the mapping thread
+ * that crosses the mark wakes the snapshot thread, and carries on; that
+ * thread copies the equivalence classes observed so far (see
+ * EquivalenceClassBuilder::snapshot), runs at most maxRounds rounds of the
+ * EM over them, starting from the online estimates (the masses of the
+ * transcripts), and writes the result, in the format of quant.sf, to a
+ * temporary file that it then renames over the snapshot.  A reader of the
+ * snapshot therefore always sees a complete one.  If the snapshot thread
+ * is still busy when the next mark is crossed, that snapshot is skipped
+ * rather than queued.
+ *
+ * The effective lengths are those cached by the transcripts at the time
+ * (the lengths of the transcripts until they've been first updated), so a
+ * snapshot is a quick approximation of the final estimates rather than a
+ * substitute for them.
+ */
+class AbundanceSnapshotWriter {
+    public:
+        // The largest relative change of an abundance (above minAlpha) below which the EM stops early
+        static constexpr double relDiffTolerance = 1e-2;
+        static constexpr double minAlpha = 1e-8;
+
+        AbundanceSnapshotWriter(const boost::filesystem::path& path,
+                                uint64_t interval,
+                                uint32_t maxRounds,
+                                EquivalenceClassBuilder& eqBuilder,
+                                std::vector<Transcript>& transcripts,
+                                std::shared_ptr<spdlog::logger> logger) :
+            path_(path), interval_(std::max(interval, uint64_t(1))), maxRounds_(maxRounds),
+            eqBuilder_(eqBuilder), transcripts_(transcripts), logger_(logger), nextSnapshot_(interval_) {
+            writer_ = std::thread([this]() -> void { this->run_(); });
+        }
+
+        AbundanceSnapshotWriter(const AbundanceSnapshotWriter&) = delete;
+        AbundanceSnapshotWriter& operator=(const AbundanceSnapshotWriter&) = delete;
+
+        ~AbundanceSnapshotWriter() { finish(); }
+
+        /**
+         * Called by the mapping threads after each mini-batch, with the
+         * number of fragments observed so far.
+         */
+        void update(uint64_t numObserved) {
+            uint64_t next = nextSnapshot_.load(std::memory_order_relaxed);
+            if (numObserved < next or
+                !nextSnapshot_.compare_exchange_strong(next, numObserved + interval_)) {
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (pending_) { ++numSkipped_; }
+                pending_ = true;
+                pendingObserved_ = numObserved;
+            }
+            wake_.notify_one();
+        }
+
+        /**
+         * Stop taking snapshots, waiting for the one in progress (if any).
+         * Must be called before the equivalence classes are finished.
+         */
+        void finish() {
+            if (!writer_.joinable()) { return; }
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                done_ = true;
+            }
+            wake_.notify_one();
+            writer_.join();
+        }
+
+        uint64_t numWritten() const { return numWritten_; }
+        uint64_t numSkipped() const { return numSkipped_; }
+
+    private:
+        void run_() {
+            while (true) {
+                uint64_t numObserved{0};
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    wake_.wait(lock, [this]() -> bool { return pending_ or done_; });
+                    if (done_) { return; }
+                    numObserved = pendingObserved_;
+                }
+                auto start = std::chrono::steady_clock::now();
+                size_t numClasses = eqBuilder_.snapshot(labels_, weights_, offsets_, counts_);
+                uint32_t rounds = estimate_();
+                bool written = write_();
+                double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                if (written) {
+                    ++numWritten_;
+                    logger_->info("wrote the abundance snapshot at {} fragments ({} equivalence classes, "
+                                  "{} EM rounds, {:.2f}s)", numObserved, numClasses, rounds, seconds);
+                } else {
+                    logger_->warn("could not write the abundance snapshot {}", path_.string());
+                }
+                std::lock_guard<std::mutex> lock(mutex_);
+                pending_ = false;
+            }
+        }
+
+        /**
+         * Estimate the read counts of the transcripts (into alphas_) from the
+         * copied classes, starting from the online estimates; returns the
+         * number of EM rounds run.
+         */
+        uint32_t estimate_() {
+            size_t numTxps = transcripts_.size();
+            effLens_.resize(numTxps);
+            alphas_.assign(numTxps, 0.0);
+            double totalMass{0.0};
+            for (size_t t = 0; t < numTxps; ++t) {
+                effLens_[t] = std::max(linear_(transcripts_[t].getCachedLogEffectiveLength()), 1.0);
+                alphas_[t] = linear_(transcripts_[t].mass(false));
+                totalMass += alphas_[t];
+            }
+            double totalCount{0.0};
+            for (auto c : counts_) { totalCount += c; }
+            for (auto& a : alphas_) {
+                a = (totalMass > 0.0) ? totalCount * (a / totalMass) : totalCount / numTxps;
+            }
+            if (counts_.empty()) { return 0; }
+
+            // The weights of each class, with the length factor folded in (as combinedWeights)
+            for (size_t c = 0; c < counts_.size(); ++c) {
+                double wsum{0.0};
+                for (size_t i = offsets_[c]; i < offsets_[c + 1]; ++i) {
+                    weights_[i] /= effLens_[labels_[i]];
+                    wsum += weights_[i];
+                }
+                double wnorm = (wsum > 0.0) ? 1.0 / wsum : 0.0;
+                for (size_t i = offsets_[c]; i < offsets_[c + 1]; ++i) { weights_[i] *= wnorm; }
+            }
+
+            uint32_t round{0};
+            while (round < maxRounds_) {
+                nextAlphas_.assign(numTxps, 0.0);
+                for (size_t c = 0; c < counts_.size(); ++c) {
+                    size_t start = offsets_[c];
+                    size_t end = offsets_[c + 1];
+                    if (end - start == 1) {
+                        nextAlphas_[labels_[start]] += counts_[c];
+                        continue;
+                    }
+                    double denom{0.0};
+                    for (size_t i = start; i < end; ++i) { denom += alphas_[labels_[i]] * weights_[i]; }
+                    if (denom <= 0.0) { continue; }
+                    double invDenom = counts_[c] / denom;
+                    for (size_t i = start; i < end; ++i) {
+                        nextAlphas_[labels_[i]] += alphas_[labels_[i]] * weights_[i] * invDenom;
+                    }
+                }
+                ++round;
+                double maxRelDiff{0.0};
+                for (size_t t = 0; t < numTxps; ++t) {
+                    if (nextAlphas_[t] > minAlpha) {
+                        maxRelDiff = std::max(maxRelDiff, std::abs(nextAlphas_[t] - alphas_[t]) / nextAlphas_[t]);
+                    }
+                }
+                std::swap(alphas_, nextAlphas_);
+                if (maxRelDiff < relDiffTolerance) { break; }
+            }
+            return round;
+        }
+
+        // A (logged) mass in linear space; LOG_0 (a transcript without mass) is +inf
+        static double linear_(double logMass) {
+            return (std::abs(logMass) == salmon::math::LOG_0) ? 0.0 : std::exp(logMass);
+        }
+
+        // Write the estimates as quant.sf, to a temporary file renamed over the snapshot
+        bool write_() {
+            double tpmDenom{0.0};
+            for (size_t t = 0; t < alphas_.size(); ++t) { tpmDenom += alphas_[t] / effLens_[t]; }
+            double tpmScale = (tpmDenom > 0.0) ? 1e6 / tpmDenom : 0.0;
+
+            std::string tmpPath = path_.string() + ".tmp";
+            std::FILE* out = std::fopen(tmpPath.c_str(), "w");
+            if (out == nullptr) { return false; }
+            std::fprintf(out, "Name\tLength\tEffectiveLength\tTPM\tNumReads\n");
+            for (size_t t = 0; t < alphas_.size(); ++t) {
+                auto& txp = transcripts_[t];
+                std::fprintf(out, "%s\t%u\t%.3f\t%f\t%.3f\n", txp.RefName.c_str(),
+                             static_cast<uint32_t>(txp.RefLength), effLens_[t],
+                             alphas_[t] / effLens_[t] * tpmScale, alphas_[t]);
+            }
+            bool good = (std::fclose(out) == 0);
+            boost::system::error_code ec;
+            if (good) { boost::filesystem::rename(tmpPath, path_, ec); }
+            return good and !ec;
+        }
+
+        boost::filesystem::path path_;
+        uint64_t interval_;
+        uint32_t maxRounds_;
+        EquivalenceClassBuilder& eqBuilder_;
+        std::vector<Transcript>& transcripts_;
+        std::shared_ptr<spdlog::logger> logger_;
+
+        std::atomic<uint64_t> nextSnapshot_;
+        std::mutex mutex_;
+        std::condition_variable wake_;
+        bool pending_{false};
+        bool done_{false};
+        uint64_t pendingObserved_{0};
+        std::thread writer_;
+        std::atomic<uint64_t> numWritten_{0};
+        std::atomic<uint64_t> numSkipped_{0};
+
+        // The copy of the classes, and the estimates, re-used from one snapshot to the next
+        std::vector<uint32_t> labels_;
+        std::vector<double> weights_;
+        std::vector<uint64_t> offsets_;
+        std::vector<uint64_t> counts_;
+        std::vector<double> effLens_;
+        std::vector<double> alphas_;
+        std::vector<double> nextAlphas_;
+};
+
+#endif // __ABUNDANCE_SNAPSHOT_WRITER_HPP__
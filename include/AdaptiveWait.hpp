@@ -0,0 +1,51 @@
+#ifndef __ADAPTIVE_WAIT_HPP__
+#define __ADAPTIVE_WAIT_HPP__
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+namespace salmon {
+namespace utils {
+
+/**
+ * Wait until pred() holds, where pred typically polls a lock-free queue.
+ * Since the wait is usually short, we first spin, then yield the processor,
+ * and finally sleep for exponentially increasing intervals (of at most
+ * 1ms), so that a long wait (e.g. for the consumers of a full queue) does
+ * not occupy a core that the other threads could use.
+ *
+ * Returns the time spent waiting, in nanoseconds (0 if pred() held
+ * immediately, in which case the clock is never read).
+ */
+template <typename PredT>
+inline uint64_t waitUntil(PredT pred) {
+    if (pred()) { return 0; }
+
+    using Clock = std::chrono::steady_clock;
+    constexpr uint32_t numSpins = 64;
+    constexpr uint32_t numYields = 64;
+    constexpr uint32_t maxSleepUs = 1000;
+
+    auto start = Clock::now();
+    uint32_t attempt{0};
+    uint32_t sleepUs{1};
+    while (!pred()) {
+        ++attempt;
+        if (attempt < numSpins) {
+            continue;
+        } else if (attempt < numSpins + numYields) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(sleepUs));
+            sleepUs = std::min(2 * sleepUs, maxSleepUs);
+        }
+    }
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+}
+
+}
+}
+
+#endif // __ADAPTIVE_WAIT_HPP__
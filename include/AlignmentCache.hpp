@@ -0,0 +1,273 @@
+#ifndef __ALIGNMENT_CACHE_HPP__
+#define __ALIGNMENT_CACHE_HPP__
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/copy.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+
+#include "AdaptiveWait.hpp"
+#include "AlignmentGroup.hpp"
+#include "LibraryFormat.hpp"
+#include "ReadPair.hpp"
+#include "UnpairedRead.hpp"
+#include "concurrentqueue.h"
+
+/**
+ * A compressed cache of the alignment groups processed in one pass over
+ * an alignment file, from which later passes can be driven without
+ * re-reading (and re-decoding) the file.  This is used when there are too
+ * many fragments to keep the decoded alignment groups themselves in memory
+ * (see mappingCacheMemoryLimit).
+ *
+ * Each mini-batch is packed into a block holding, for every alignment
+ * group, its fragments' library formats and orphan status along with
+ * their BAM records (which the alignment and error models read), and the
+ * block is gzip-compressed.  Blocks are kept in memory until their total
+ * size reaches the memory budget; later blocks are appended to a spill
+ * file, which is removed when the cache is destroyed.
+ *
+ * add() may be called concurrently by the quantification threads;
+ * replay() should only be called once all of the blocks have been added.
+ */
+template <typename FragT>
+class AlignmentCache {
+    public:
+        using GroupT = AlignmentGroup<FragT*>;
+
+        AlignmentCache(const boost::filesystem::path& spillPath,
+                       uint64_t memoryBudget,
+                       int compressionLevel = 1) :
+            spillPath_(spillPath), memoryBudget_(memoryBudget),
+            compressionLevel_(compressionLevel) {}
+
+        AlignmentCache(const AlignmentCache&) = delete;
+        AlignmentCache& operator=(const AlignmentCache&) = delete;
+
+        ~AlignmentCache() {
+            if (spillOut_.is_open()) { spillOut_.close(); }
+            if (bytesSpilled_ > 0) {
+                boost::system::error_code ec;
+                boost::filesystem::remove(spillPath_, ec);
+            }
+        }
+
+        /**
+         * Pack and compress the given mini-batch, and add it to the cache.
+         * Returns false if the block could not be written to the spill file.
+         */
+        bool add(std::vector<GroupT*>& groups) {
+            std::string packed;
+            uint32_t numGroups = groups.size();
+            append_(packed, numGroups);
+            for (auto group : groups) {
+                uint32_t numFrags = group->alignments().size();
+                uint8_t unique = group->isUniquelyMapped() ? 1 : 0;
+                append_(packed, numFrags);
+                append_(packed, unique);
+                for (auto frag : group->alignments()) { packFrag_(packed, *frag); }
+            }
+
+            Block block;
+            {
+                boost::iostreams::filtering_ostream out;
+                out.push(boost::iostreams::gzip_compressor(
+                            boost::iostreams::gzip_params(compressionLevel_)));
+                out.push(boost::iostreams::back_inserter(block.data));
+                out.write(packed.data(), packed.size());
+            }
+            block.size = block.data.size();
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            numGroups_ += numGroups;
+            if (bytesInMemory_ + block.size <= memoryBudget_) {
+                bytesInMemory_ += block.size;
+                block.inMemory = true;
+            } else {
+                if (!spillOut_.is_open()) {
+                    spillOut_.open(spillPath_.string(), std::ios_base::out |
+                                   std::ios_base::binary | std::ios_base::trunc);
+                }
+                block.offset = bytesSpilled_;
+                spillOut_.write(block.data.data(), block.size);
+                bytesSpilled_ += block.size;
+                block.data.clear();
+                block.data.shrink_to_fit();
+                good_ = good_ and spillOut_.good();
+            }
+            blocks_.emplace_back(std::move(block));
+            return good_;
+        }
+
+        /**
+         * Rebuild each cached mini-batch, in turn, from fragments and
+         * alignment groups taken from the given pools (waiting for the
+         * consumers to return them when the pools are empty), and pass it
+         * to f, which takes ownership of the vector of groups.
+         */
+        template <typename CallbackT>
+        bool replay(moodycamel::ConcurrentQueue<FragT*>& fragmentQueue,
+                    moodycamel::ConcurrentQueue<GroupT*>& alignmentGroupQueue,
+                    CallbackT f) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!good_) { return false; }
+            std::ifstream spillIn;
+            if (bytesSpilled_ > 0) {
+                spillOut_.flush();
+                spillIn.open(spillPath_.string(), std::ios_base::in | std::ios_base::binary);
+                if (!spillIn.good()) { return false; }
+            }
+
+            std::string compressed;
+            std::string packed;
+            for (auto& block : blocks_) {
+                const char* src = block.data.data();
+                if (!block.inMemory) {
+                    compressed.resize(block.size);
+                    spillIn.seekg(block.offset);
+                    if (!spillIn.read(&compressed[0], block.size)) { return false; }
+                    src = compressed.data();
+                }
+                packed.clear();
+                {
+                    boost::iostreams::filtering_istream in;
+                    in.push(boost::iostreams::gzip_decompressor());
+                    in.push(boost::iostreams::array_source(src, block.size));
+                    boost::iostreams::copy(in, boost::iostreams::back_inserter(packed));
+                }
+
+                const char* p = packed.data();
+                uint32_t numGroups = read_<uint32_t>(p);
+                auto groups = new std::vector<GroupT*>;
+                groups->reserve(numGroups);
+                for (uint32_t g = 0; g < numGroups; ++g) {
+                    uint32_t numFrags = read_<uint32_t>(p);
+                    uint8_t unique = read_<uint8_t>(p);
+                    GroupT* group{nullptr};
+                    salmon::utils::waitUntil([&alignmentGroupQueue, &group]() -> bool {
+                        return alignmentGroupQueue.try_dequeue(group);
+                    });
+                    group->clearAlignments();
+                    group->isUniquelyMapped() = (unique == 1);
+                    for (uint32_t i = 0; i < numFrags; ++i) {
+                        FragT* frag{nullptr};
+                        salmon::utils::waitUntil([&fragmentQueue, &frag]() -> bool {
+                            return fragmentQueue.try_dequeue(frag);
+                        });
+                        unpackFrag_(p, *frag);
+                        group->addAlignment(frag);
+                    }
+                    groups->push_back(group);
+                }
+                f(groups);
+            }
+            return true;
+        }
+
+        size_t numBlocks() const { return blocks_.size(); }
+        uint64_t numGroups() const { return numGroups_; }
+        uint64_t bytesInMemory() const { return bytesInMemory_; }
+        uint64_t bytesSpilled() const { return bytesSpilled_; }
+
+    private:
+        struct Block {
+            bool inMemory{false};
+            // The position of this block in the spill file (if it isn't in memory)
+            uint64_t offset{0};
+            uint64_t size{0};
+            std::string data;
+        };
+
+        template <typename T>
+        static inline void append_(std::string& buf, const T& v) {
+            buf.append(reinterpret_cast<const char*>(&v), sizeof(T));
+        }
+
+        template <typename T>
+        static inline T read_(const char*& p) {
+            T v;
+            std::memcpy(&v, p, sizeof(T));
+            p += sizeof(T);
+            return v;
+        }
+
+        /**
+         * A BAM record is stored as its length followed by the bytes of the
+         * bam_seq_t, i.e. the alloc and blk_size fields and the raw record
+         * (whose length is blk_size).
+         */
+        static inline void packRecord_(std::string& buf, const bam_seq_t* b) {
+            uint32_t n = std::min(b->alloc,
+                                  static_cast<uint32_t>(2 * sizeof(uint32_t) + b->blk_size));
+            append_(buf, n);
+            buf.append(reinterpret_cast<const char*>(b), n);
+        }
+
+        /**
+         * Copy a record written by packRecord_ into b, growing b if
+         * necessary.  b->alloc is kept equal to the size of b's allocation,
+         * as the staden routines that fill in a record expect.
+         */
+        static inline void unpackRecord_(const char*& p, bam_seq_t*& b) {
+            uint32_t n = read_<uint32_t>(p);
+            uint32_t capacity = b->alloc;
+            if (capacity < n) {
+                b = reinterpret_cast<bam_seq_t*>(std::realloc(b, n));
+                capacity = n;
+            }
+            std::memcpy(b, p, n);
+            b->alloc = capacity;
+            p += n;
+        }
+
+        static inline void packFrag_(std::string& buf, ReadPair& frag) {
+            uint8_t orphanStatus = static_cast<uint8_t>(frag.orphanStatus);
+            append_(buf, frag.libFmt.formatID());
+            append_(buf, orphanStatus);
+            packRecord_(buf, frag.read1);
+            if (frag.isPaired()) { packRecord_(buf, frag.read2); }
+        }
+
+        static inline void unpackFrag_(const char*& p, ReadPair& frag) {
+            frag.libFmt = LibraryFormat::formatFromID(read_<uint8_t>(p));
+            frag.orphanStatus = static_cast<salmon::utils::OrphanStatus>(read_<uint8_t>(p));
+            frag.logProb = salmon::math::LOG_0;
+            unpackRecord_(p, frag.read1);
+            if (frag.isPaired()) { unpackRecord_(p, frag.read2); }
+        }
+
+        static inline void packFrag_(std::string& buf, UnpairedRead& frag) {
+            append_(buf, frag.libFmt.formatID());
+            packRecord_(buf, frag.read);
+        }
+
+        static inline void unpackFrag_(const char*& p, UnpairedRead& frag) {
+            frag.libFmt = LibraryFormat::formatFromID(read_<uint8_t>(p));
+            frag.logProb = salmon::math::LOG_0;
+            unpackRecord_(p, frag.read);
+        }
+
+        boost::filesystem::path spillPath_;
+        uint64_t memoryBudget_;
+        int compressionLevel_;
+        std::mutex mutex_;
+        std::vector<Block> blocks_;
+        std::ofstream spillOut_;
+        bool good_{true};
+        uint64_t numGroups_{0};
+        uint64_t bytesInMemory_{0};
+        uint64_t bytesSpilled_{0};
+};
+
+#endif //__ALIGNMENT_CACHE_HPP__
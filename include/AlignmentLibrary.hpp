@@ -18,11 +18,15 @@ extern "C" {
 #include "FragmentLengthDistribution.hpp"
 #include "FragmentStartPositionDistribution.hpp"
 #include "AlignmentGroup.hpp"
+#include "AlignmentCache.hpp"
 #include "ErrorModel.hpp"
 #include "AlignmentModel.hpp"
 #include "FASTAParser.hpp"
+#include "CRAMReference.hpp"
+#include "PackedSequenceStore.hpp"
 #include "concurrentqueue.h"
 #include "EquivalenceClassBuilder.hpp"
+#include "StageTimings.hpp"
 #include "SpinLock.hpp" // RapMap's with try_lock
 #include "ReadKmerDist.hpp"
 
@@ -30,6 +34,7 @@ extern "C" {
 #include <boost/filesystem.hpp>
 
 // Standard includes
+#include <algorithm>
 #include <vector>
 #include <memory>
 #include <functional>
@@ -59,7 +64,7 @@ class AlignmentLibrary {
         transcripts_(std::vector<Transcript>()),
     	fragStartDists_(5),
         seqBiasModel_(1.0),
-    	eqBuilder_(salmonOpts.jointLog),
+    	eqBuilder_(salmonOpts.jointLog, salmonOpts.eqClassReserve),
         quantificationPasses_(0),
         expectedBias_(constExprPow(4, readBias_.getK()), 1.0),
         expectedGC_(101, 1.0),
@@ -76,6 +81,13 @@ class AlignmentLibrary {
                 }
             }
 
+            if (salmonOpts.eqClassSpillClasses > 0 and
+                !eqBuilder_.enableSpill(salmonOpts.outputDirectory / "eq_spill", salmonOpts.eqClassSpillClasses)) {
+                salmonOpts.jointLog->error("Could not create the directory {} for the spilled equivalence classes",
+                                         (salmonOpts.outputDirectory / "eq_spill").string());
+                std::exit(1);
+            }
+            if (!salmonOpts.umiTag.empty()) { eqBuilder_.enableUMIDeduplication(salmonOpts.umiCollapse); }
 
             // Make sure the transcript file exists.
             if (!bfs::exists(transcriptFile_)) {
@@ -89,7 +101,16 @@ class AlignmentLibrary {
             size_t numParseThreads = salmonOpts.numParseThreads;
             std::cerr << "parseThreads = " << numParseThreads << "\n";
             bq = std::unique_ptr<BAMQueue<FragT>>(new BAMQueue<FragT>(alnFiles, libFmt_, numParseThreads,
-                                                                      salmonOpts.mappingCacheMemoryLimit));
+                                                                      salmonOpts.mappingCacheMemoryLimit,
+                                                                      salmonOpts.pipelineBAMParsing,
+                                                                      salmonOpts.coordinateSorted,
+                                                                      &stageTimings_,
+                                                                      salmonOpts.alignmentPoolSize,
+                                                                      salmonOpts.readaheadBytes,
+                                                                      BAMQueue<FragT>::requiredFields(
+                                                                          salmonOpts.useErrorModel,
+                                                                          !salmonOpts.umiTag.empty() or salmonOpts.coordinateSorted,
+                                                                          salmonOpts.sampleOutput)));
 
             std::cerr << "Checking that provided alignment files have consistent headers . . . ";
             if (! salmon::utils::headersAreConsistent(bq->headers()) ) {
@@ -111,9 +132,34 @@ class AlignmentLibrary {
 
             FASTAParser fp(transcriptFile.string());
 
+            // CRAM records are decoded against the sequences loaded here
+            bool haveCRAM = std::any_of(alnFiles.begin(), alnFiles.end(),
+                    [](const bfs::path& p) -> bool { return p.extension() == ".cram"; });
+            if (haveCRAM) {
+                std::vector<std::string> names;
+                std::vector<uint64_t> lengths;
+                for (auto& txp : transcripts_) {
+                    names.push_back(txp.RefName);
+                    lengths.push_back(txp.RefLength);
+                }
+                cramRef_.reset(new CRAMReference(salmonOpts.outputDirectory / "cram_reference.fa",
+                                                 names, lengths));
+            }
+
             fmt::print(stderr, "Populating targets from aln = {}, fasta = {} . . .",
                        alnFiles.front(), transcriptFile_);
-            fp.populateTargets(transcripts_);
+            fp.populateTargets(transcripts_, packedSequences_,
+                               salmonOpts.biasCorrect or salmonOpts.gcBiasCorrect,
+                               salmonOpts.numThreads, cramRef_.get());
+            if (cramRef_) {
+                if (cramRef_->finish()) {
+                    bq->setCRAMReference(cramRef_->path().string());
+                } else {
+                    salmonOpts.jointLog->warn("Some of the targets of the CRAM input weren't found in {}; "
+                                              "the CRAM reference will be looked up as usual", transcriptFile_.string());
+                    cramRef_.reset();
+                }
+            }
 	    for (auto& txp : transcripts_) {
 		    // Length classes taken from
 		    // ======
@@ -136,6 +182,10 @@ class AlignmentLibrary {
 	    }
             fmt::print(stderr, "done\n");
 
+            // Move the state updated during quantification out of the
+            // transcripts, into dense arrays
+            hotState_ = bindTranscriptHotState(transcripts_);
+
             // Create the cluster forest for this set of transcripts
             clusters_.reset(new ClusterForest(transcripts_.size(), transcripts_));
 
@@ -166,6 +216,28 @@ class AlignmentLibrary {
         return eqBuilder_;
     }
 
+    StageTimings& stageTimings() { return stageTimings_; }
+    const StageTimings& stageTimings() const { return stageTimings_; }
+
+    /**
+     * True if an alignment file isn't a regular file (e.g. an aligner's
+     * output piped in), and so can only be read once.
+     */
+    bool isStreamed() const {
+        for (auto& alignmentFile : alignmentFiles_) {
+            if (!boost::filesystem::is_regular_file(alignmentFile)) { return true; }
+        }
+        return false;
+    }
+
+    /**
+     * The compact cache of the alignments of a streamed input, kept (by
+     * quantifyLibrary) once the input has been read, from which they can
+     * be read again (by the sampler); nullptr if there isn't one.
+     */
+    AlignmentCache<FragT>* alignmentCache() { return alignmentCache_.get(); }
+    void keepAlignmentCache(std::unique_ptr<AlignmentCache<FragT>> cache) { alignmentCache_ = std::move(cache); }
+
     void updateTranscriptLengthsAtomic(std::atomic<bool>& done) {
         if (sl_.try_lock()) {
             if (!done) {
@@ -195,6 +267,7 @@ class AlignmentLibrary {
 
     std::vector<Transcript>& transcripts() { return transcripts_; }
     const std::vector<Transcript>& transcripts() const { return transcripts_; }
+    TranscriptHotState& transcriptHotState() { return *hotState_; }
 
     inline bool getAlignmentGroup(AlignmentGroup<FragT>*& ag) { return bq->getAlignmentGroup(ag); }
 
@@ -218,8 +291,7 @@ class AlignmentLibrary {
         return seqBiasModel_;
     }
 
-//    inline tbb::concurrent_queue<FragT*>& fragmentQueue() {
-    inline tbb::concurrent_queue<FragT*>& fragmentQueue() {
+    inline moodycamel::ConcurrentQueue<FragT*>& fragmentQueue() {
         return bq->getFragmentQueue();
     }
 
@@ -244,13 +316,7 @@ class AlignmentLibrary {
 
     template <typename FilterT>
     bool reset(bool incPasses=true, FilterT filter=nullptr, bool onlyProcessAmbiguousAlignments=false) {
-        namespace bfs = boost::filesystem;
-
-        for (auto& alignmentFile : alignmentFiles_) {
-            if (!bfs::is_regular_file(alignmentFile)) {
-                return false;
-            }
-        }
+        if (isStreamed()) { return false; }
 
         bq->reset();
         bq->start(filter, onlyProcessAmbiguousAlignments);
@@ -322,6 +388,11 @@ class AlignmentLibrary {
      * fragment library.
      */
     LibraryFormat libFmt_;
+    /**
+     * The 2-bit packed sequences of the targets, which the
+     * transcripts refer to (so it must outlive them).
+     */
+    PackedSequenceStore packedSequences_;
     /**
      * The targets (transcripts) to be quantified.
      */
@@ -331,7 +402,10 @@ class AlignmentLibrary {
      * will be read.
      */
     //std::unique_ptr<t_pool, std::function<void(t_pool*)>> threadPool_;
+    // The reference of CRAM input (which the queue's files read from)
+    std::unique_ptr<CRAMReference> cramRef_{nullptr};
     std::unique_ptr<BAMQueue<FragT>> bq;
+    std::unique_ptr<AlignmentCache<FragT>> alignmentCache_{nullptr};
 
     SequenceBiasModel seqBiasModel_;
 
@@ -342,6 +416,8 @@ class AlignmentLibrary {
      * in the same cluster.
      */
     std::unique_ptr<ClusterForest> clusters_;
+    // The per-transcript state updated during quantification (see TranscriptHotState)
+    std::unique_ptr<TranscriptHotState> hotState_;
 
     /**
       * The emperical fragment start position distribution
@@ -364,6 +440,8 @@ class AlignmentLibrary {
     size_t quantificationPasses_;
     SpinLock sl_;
     EquivalenceClassBuilder eqBuilder_;
+    // Where the time of this run was spent
+    StageTimings stageTimings_;
 
     /** GC-fragment bias things **/
     // One bin for each percentage GC content
@@ -10,6 +10,7 @@
 
 #include "tbb/concurrent_vector.h"
 #include "AtomicMatrix.hpp"
+#include "AtomicMatrixStage.hpp"
 
 extern "C" {
 #include "io_lib/scram.h"
@@ -28,11 +29,28 @@ public:
     bool burnedIn();
     void burnedIn(bool burnedIn);
 
+    /**
+     * A single thread's private accumulation of updates to the model, which
+     * are merged into the shared model by flush() (see
+     * AtomicMatrixStage.hpp).
+     */
+    class Stage {
+        public:
+            Stage(AlignmentModel& model) :
+                left_(model.transitionProbsLeft_), right_(model.transitionProbsRight_) {}
+            void flush() { left_.flush(); right_.flush(); }
+        private:
+            friend class AlignmentModel;
+            AtomicMatrixStage<double> left_;
+            AtomicMatrixStage<double> right_;
+    };
+
     /**
     *  For unpaired reads, update the error model to account
-    *  for errors we've observed in this read pair.
+    *  for errors we've observed in this read pair.  If a stage
+    *  is given, the update is made to it rather than to the model.
     */
-    void update(const UnpairedRead&, Transcript& ref, double p, double mass);
+    void update(const UnpairedRead&, Transcript& ref, double p, double mass, Stage* stage = nullptr);
 
     /**
       * Compute the log-likelihood of the observed unpaired alignment given the
@@ -44,7 +62,7 @@ public:
     *  For paired-end reads, update the error model to account
     *  for errors we've observed in this read pair.
     */
-    void update(const ReadPair&, Transcript& ref, double p, double mass);
+    void update(const ReadPair&, Transcript& ref, double p, double mass, Stage* stage = nullptr);
 
     /**
      * Compute the log-likelihood of the observed paire-end alignment given the
@@ -52,6 +70,13 @@ public:
      */
     double logLikelihood(const ReadPair&, Transcript& ref);
 
+    /**
+     * Whether logLikelihood() of the alignment would be more than LOG_0,
+     * i.e. whether its reads start within ref; this is the check made before
+     * the CIGAR string is walked, without the walk.
+     */
+    bool startsWithinTranscript(const UnpairedRead&, Transcript& ref);
+    bool startsWithinTranscript(const ReadPair&, Transcript& ref);
 
     bool hasIndel(UnpairedRead& r);
     bool hasIndel(ReadPair & r);
@@ -89,10 +114,23 @@ private:
      * These functions, which work directly on bam_seq_t* types, drive the
      * update() and logLikelihood() methods above.
      */
-    void update(bam_seq_t* read, Transcript& ref, double p, double mass, std::vector<AtomicMatrix<double>>& mismatchProfile);
+    void update(bam_seq_t* read, Transcript& ref, double p, double mass, std::vector<AtomicMatrix<double>>& mismatchProfile,
+                AtomicMatrixStage<double>* stage);
     double logLikelihood(bam_seq_t* read, Transcript& ref, std::vector<AtomicMatrix<double>>& mismatchProfile);
+    bool startsWithinTranscript(bam_seq_t* read, Transcript& ref);
     bool hasIndel(bam_seq_t* r);
 
+    /**
+     * Walk the alignment of read (starting at position readIdx of the read
+     * and transcriptIdx of ref) and call f(readPosBin, prevStateIdx,
+     * curStateIdx) for each transition of the alignment model.  Returns
+     * false if the CIGAR string refers to positions beyond the end of the
+     * read or the reference.
+     */
+    template <typename CallbackT>
+    bool walkTransitions_(bam_seq_t* read, Transcript& ref, size_t readIdx,
+                          size_t transcriptIdx, const char* caller, CallbackT f);
+
     // NOTE: Do these need to be concurrent_vectors as before?
     // Store the mismatch probability tables for the left and right reads
     std::vector<AtomicMatrix<double>> transitionProbsLeft_;
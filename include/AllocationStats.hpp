@@ -0,0 +1,100 @@
+#ifndef __ALLOCATION_STATS_HPP__
+#define __ALLOCATION_STATS_HPP__
+
+/**
+ * Counts of the heap allocations (operator new) made in each scope of the
+ * run, e.g. "parsing", "processMiniBatch" or "addGroup", written to
+ * aux/alloc_stats.json.  The counting replaces the global operator new and
+ * delete (see AllocationStats.cpp), and is compiled in only when
+ * SALMON_ENABLE_ALLOC_STATS is defined (cmake -DENABLE_ALLOC_STATS=ON);
+ * otherwise SALMON_ALLOC_SCOPE expands to nothing.
+ *
+ * Usage:
+ *     {
+ *         SALMON_ALLOC_SCOPE("addGroup");
+ *         ...
+ *     }
+ *
+ * or, for a scope that ends before its block does,
+ *     SALMON_ALLOC_BEGIN(parseScope, "parsing");
+ *     ...
+ *     SALMON_ALLOC_END(parseScope);
+ *
+ * An allocation is counted in the innermost scope open on the allocating
+ * thread (so the counts of "processMiniBatch" exclude those of the
+ * "addGroup" scopes within it); allocations outside of every scope are
+ * counted as "other".  The name of a scope must be a string literal.
+ */
+#ifdef SALMON_ENABLE_ALLOC_STATS
+
+#include <cstddef>
+#include <string>
+
+namespace salmon {
+namespace alloc {
+
+constexpr size_t maxCategories = 32;
+
+// The index of the category with the given name, registered on first use
+size_t categoryIndex(const char* name);
+
+// Set the category of the current thread, returning the previous one
+size_t setCategory(size_t category);
+
+/**
+ * Counts the allocations of the current thread in a category over its
+ * lifetime.
+ */
+class Scope {
+    public:
+        explicit Scope(size_t category) : prev_(setCategory(category)) {}
+        ~Scope() { end(); }
+        // End the scope before the end of the block
+        void end() {
+            if (open_) { setCategory(prev_); }
+            open_ = false;
+        }
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    private:
+        size_t prev_;
+        bool open_{true};
+};
+
+/**
+ * Write, for each category, the number of allocations and of bytes
+ * allocated, and the number of deallocations (by the threads in the
+ * category), summed over all of the threads.
+ */
+bool writeStats(const std::string& path);
+
+} // namespace alloc
+} // namespace salmon
+
+#define SALMON_ALLOC_CONCAT_(a, b) a##b
+#define SALMON_ALLOC_NAME_(line) SALMON_ALLOC_CONCAT_(salmonAllocScope_, line)
+#define SALMON_ALLOC_CATEGORY_(name) \
+        []() -> size_t { static const size_t i = ::salmon::alloc::categoryIndex(name); return i; }()
+#define SALMON_ALLOC_SCOPE(name) ::salmon::alloc::Scope SALMON_ALLOC_NAME_(__LINE__)(SALMON_ALLOC_CATEGORY_(name))
+#define SALMON_ALLOC_BEGIN(var, name) ::salmon::alloc::Scope var(SALMON_ALLOC_CATEGORY_(name))
+#define SALMON_ALLOC_END(var) var.end()
+#define SALMON_ALLOC_STATS_ENABLED 1
+
+#else // !SALMON_ENABLE_ALLOC_STATS
+
+#include <string>
+
+namespace salmon {
+namespace alloc {
+inline bool writeStats(const std::string&) { return true; }
+} // namespace alloc
+} // namespace salmon
+
+#define SALMON_ALLOC_SCOPE(name) do {} while (0)
+#define SALMON_ALLOC_BEGIN(var, name) do {} while (0)
+#define SALMON_ALLOC_END(var) do {} while (0)
+#define SALMON_ALLOC_STATS_ENABLED 0
+
+#endif // SALMON_ENABLE_ALLOC_STATS
+
+#endif // __ALLOCATION_STATS_HPP__
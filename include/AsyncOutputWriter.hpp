@@ -0,0 +1,80 @@
+#ifndef __ASYNC_OUTPUT_WRITER_HPP__
+#define __ASYNC_OUTPUT_WRITER_HPP__
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "spdlog/spdlog.h"
+#include "tbb/concurrent_queue.h"
+
+/**
+ * Runs output tasks (e.g. writing the equivalence classes, or formatting
+ * quant.sf) on a single background thread, in the order in which they were
+ * submitted, so that they overlap with the computation that follows them
+ * on the main thread (the optimizer, or the bootstraps).  A task must only
+ * read state that the main thread no longer modifies, or a snapshot of it.
+ */
+class AsyncOutputWriter {
+    public:
+        using Task = std::function<bool()>;
+
+        AsyncOutputWriter(std::shared_ptr<spdlog::logger> logger) : logger_(logger) {
+            worker_ = std::thread([this]() -> void { this->run_(); });
+        }
+
+        ~AsyncOutputWriter() { finish(); }
+
+        /**
+         * Queue a task; `name` identifies it in the log if it fails.
+         */
+        void submit(const std::string& name, Task task) {
+            queue_.push(new NamedTask{name, std::move(task)});
+        }
+
+        /**
+         * Wait for all of the submitted tasks to finish, and stop the
+         * thread.  Returns false if any task failed.
+         */
+        bool finish() {
+            if (worker_.joinable()) {
+                queue_.push(nullptr);
+                worker_.join();
+            }
+            return numFailed_ == 0;
+        }
+
+    private:
+        struct NamedTask {
+            std::string name;
+            Task task;
+        };
+
+        void run_() {
+            NamedTask* t{nullptr};
+            while (true) {
+                queue_.pop(t);
+                if (t == nullptr) { break; }
+                bool ok{false};
+                try {
+                    ok = t->task();
+                } catch (std::exception& e) {
+                    logger_->error("output task [{}] threw: {}", t->name, e.what());
+                }
+                if (!ok) {
+                    logger_->error("output task [{}] failed", t->name);
+                    ++numFailed_;
+                }
+                delete t;
+            }
+        }
+
+        std::shared_ptr<spdlog::logger> logger_;
+        tbb::concurrent_bounded_queue<NamedTask*> queue_;
+        std::thread worker_;
+        // Only modified by the worker thread, and read once it has joined
+        size_t numFailed_{0};
+};
+
+#endif // __ASYNC_OUTPUT_WRITER_HPP__
@@ -45,6 +45,23 @@ public:
         }
     }
 
+    /**
+     * Add amt to the sum of the given row; together with
+     * incrementUnnormalized, this allows many increments of a row to update
+     * its sum only once.
+     */
+    void incrementRowSum(size_t rowInd, T amt) {
+        using salmon::math::logAdd;
+        T oldVal = rowsums_[rowInd];
+        T retVal = oldVal;
+        T newVal = logSpace_ ? logAdd(oldVal, amt) : oldVal + amt;
+        do {
+            oldVal = retVal;
+            newVal = logSpace_ ? logAdd(oldVal, amt) : oldVal + amt;
+            retVal = rowsums_[rowInd].compare_and_swap(newVal, oldVal);
+        } while (retVal != oldVal);
+    }
+
     void computeRowSums() {
         for (size_t rowInd = 0; rowInd < nRow_; ++rowInd) {
             T rowSum = salmon::math::LOG_0;
@@ -98,6 +115,9 @@ public:
         }
     }
 
+    size_t nRow() const { return nRow_; }
+    size_t nCol() const { return nCol_; }
+
     T operator()(size_t rowInd, size_t colInd, bool normalized = true) {
         size_t k = rowInd * nCol_ + colInd;
         if (logSpace_) {
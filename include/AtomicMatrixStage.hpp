@@ -0,0 +1,81 @@
+#ifndef ATOMIC_MATRIX_STAGE
+#define ATOMIC_MATRIX_STAGE
+
+#include <cstdint>
+#include <vector>
+
+#include "AtomicMatrix.hpp"
+#include "SalmonMath.hpp"
+
+/**
+ * A thread's private staging area for the updates to a set of (log-space)
+ * AtomicMatrix objects of the same shape, e.g. the per-read-position-bin
+ * profiles of a model.  Increments are accumulated here without any atomic
+ * operations, and are merged into the shared matrices by flush(), which
+ * performs one atomic update per modified cell and per modified row sum,
+ * rather than one per increment.
+ *
+ * A stage must only be used by a single thread.  Updates that haven't been
+ * flushed are not visible to readers of the shared matrices.
+ */
+template <typename T>
+class AtomicMatrixStage {
+    public:
+        AtomicMatrixStage(std::vector<AtomicMatrix<T>>& shared) :
+            shared_(shared),
+            nRow_(shared.empty() ? 0 : shared.front().nRow()),
+            nCol_(shared.empty() ? 0 : shared.front().nCol()),
+            cells_(shared.size() * nRow_ * nCol_, salmon::math::LOG_0),
+            rowSums_(shared.size() * nRow_, salmon::math::LOG_0) {}
+
+        AtomicMatrixStage(const AtomicMatrixStage&) = delete;
+        AtomicMatrixStage& operator=(const AtomicMatrixStage&) = delete;
+
+        ~AtomicMatrixStage() { flush(); }
+
+        /**
+         * Add amt (in log space) to cell (rowInd, colInd) of matrix matInd,
+         * but not to the sum of its row (see incrementRowSum).
+         */
+        inline void incrementUnnormalized(size_t matInd, size_t rowInd, size_t colInd, T amt) {
+            size_t k = (matInd * nRow_ + rowInd) * nCol_ + colInd;
+            if (cells_[k] == salmon::math::LOG_0) { touchedCells_.push_back(k); }
+            cells_[k] = salmon::math::logAdd(cells_[k], amt);
+        }
+
+        inline void incrementRowSum(size_t matInd, size_t rowInd, T amt) {
+            size_t k = matInd * nRow_ + rowInd;
+            if (rowSums_[k] == salmon::math::LOG_0) { touchedRows_.push_back(k); }
+            rowSums_[k] = salmon::math::logAdd(rowSums_[k], amt);
+        }
+
+        /**
+         * Merge the staged updates into the shared matrices, and clear them.
+         */
+        void flush() {
+            size_t cellsPerMatrix = nRow_ * nCol_;
+            for (auto k : touchedCells_) {
+                size_t m = k / cellsPerMatrix;
+                size_t rem = k % cellsPerMatrix;
+                shared_[m].incrementUnnormalized(rem / nCol_, rem % nCol_, cells_[k]);
+                cells_[k] = salmon::math::LOG_0;
+            }
+            for (auto k : touchedRows_) {
+                shared_[k / nRow_].incrementRowSum(k % nRow_, rowSums_[k]);
+                rowSums_[k] = salmon::math::LOG_0;
+            }
+            touchedCells_.clear();
+            touchedRows_.clear();
+        }
+
+    private:
+        std::vector<AtomicMatrix<T>>& shared_;
+        size_t nRow_;
+        size_t nCol_;
+        std::vector<T> cells_;
+        std::vector<T> rowSums_;
+        std::vector<size_t> touchedCells_;
+        std::vector<size_t> touchedRows_;
+};
+
+#endif // ATOMIC_MATRIX_STAGE
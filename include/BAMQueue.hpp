@@ -13,6 +13,8 @@
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <string>
+#include <unordered_map>
 
 #include <boost/timer/timer.hpp>
 #include <boost/filesystem.hpp>
@@ -25,6 +27,11 @@
 #include "spdlog/spdlog.h"
 #include "concurrentqueue.h"
 #include "readerwriterqueue.h"
+#include "SlabAllocator.hpp"
+#include "AdaptiveWait.hpp"
+#include "StageTimings.hpp"
+#include "ReadaheadFile.hpp"
+#include "xxhash.h"
 
 extern "C" {
 #include "io_lib/scram.h"
@@ -44,6 +51,18 @@ struct AlignmentFile {
     scram_fd* fp;
     SAM_hdr* header;
     uint32_t numParseThreads;
+    // Reads the file ahead of the parser while it's open (--readahead)
+    std::shared_ptr<ReadaheadPipe> readahead;
+};
+
+/**
+  * Hashes read names (e.g. to group the alignments of coordinate-sorted
+  * input by read).
+  */
+struct ReadNameHasher_ {
+    size_t operator()(const std::string& s) const {
+        return static_cast<size_t>(XXH64(s.data(), s.size(), 0));
+    }
 };
 
 /**
@@ -57,13 +76,40 @@ template <typename FragT>
 class BAMQueue {
 public:
   BAMQueue(std::vector<boost::filesystem::path>& fnames, LibraryFormat& libFmt,
-           uint32_t numParseThreads, uint32_t cacheSize);
+           uint32_t numParseThreads, uint32_t cacheSize, bool pipelineParsing = false,
+           bool coordinateSorted = false, StageTimings* stageTimings = nullptr,
+           uint32_t poolSize = 2000000, uint64_t readaheadBytes = 0,
+           int requiredFields = 0);
   ~BAMQueue();
+
+  /**
+   * The fields (as the SAM_* flags of CRAM_OPT_REQUIRED_FIELDS) that the
+   * records of CRAM input need to be decoded with: the name, flags,
+   * positions and sequence (whose length places the reads), plus the CIGAR
+   * and qualities for the error model, and the aux tags if they're read
+   * (the UMIs, or the NH tags of coordinate-sorted input).  The sampled
+   * output writes whole records, so it needs every field (0).
+   */
+  static int requiredFields(bool errorModel, bool auxTags, bool wholeRecords) {
+      if (wholeRecords) { return 0; }
+      int fields = SAM_QNAME | SAM_FLAG | SAM_RNAME | SAM_POS | SAM_MAPQ |
+                   SAM_RNEXT | SAM_PNEXT | SAM_TLEN | SAM_SEQ;
+      if (errorModel) { fields |= SAM_CIGAR | SAM_QUAL; }
+      if (auxTags) { fields |= SAM_AUX; }
+      return fields;
+  }
   void forceEndParsing();
 
   SAM_hdr* header();
   SAM_hdr* safeHeader();
 
+  /**
+   * Decode the records of CRAM input against the (indexed) FASTA file
+   * path, rather than the reference that io_lib would look up.  This must
+   * be called before start().
+   */
+  void setCRAMReference(const std::string& path);
+
   std::vector<SAM_hdr*> headers();
 
   template <typename FilterT>
@@ -79,8 +125,14 @@ public:
 
   void reset();
 
-  tbb::concurrent_queue<FragT*>& getFragmentQueue();
-  //moodycamel::ConcurrentQueue<FragT*>& getFragmentQueue();
+  /** Sample the occupancy of the queue of parsed alignment groups and of
+   * the pool of free ones into the StageTimings (if there are any); this
+   * is cheap (the sizes are approximate), and is meant to be called
+   * periodically by the consumer.
+   */
+  void sampleQueueDepths();
+
+  moodycamel::ConcurrentQueue<FragT*>& getFragmentQueue();
 
   //tbb::concurrent_bounded_queue<AlignmentGroup<FragT*>*>& getAlignmentGroupQueue();
   moodycamel::ConcurrentQueue<AlignmentGroup<FragT*>*>& getAlignmentGroupQueue();
@@ -93,6 +145,32 @@ private:
   template <typename FilterT>
   void fillQueue_(FilterT, bool);
 
+  /** If parsing is pipelined, decode (and pair) the records into batches
+   * of fragments on a separate thread, from which fillQueue_ assembles
+   * the alignment groups.
+   */
+  template <typename FilterT>
+  void decodeFrags_(FilterT);
+  /** Get the next fragment decoded by decodeFrags_ */
+  inline bool nextDecodedFrag_(FragT*& f);
+
+  /** If the input is sorted by coordinate, pair the mates and group the
+   * alignments of each read by name, rather than expecting them to be
+   * adjacent in the file.
+   */
+  template <typename FilterT>
+  void fillQueueRegrouped_(FilterT, bool);
+  /** Overload of nextRegroupedFrag_ for paired-end reads (pairs mates
+   * that aren't adjacent) */
+  template <typename FilterT>
+  inline bool nextRegroupedFrag_(ReadPair*& rpair, FilterT filt);
+  /** Overload of nextRegroupedFrag_ for single-end reads */
+  template <typename FilterT>
+  inline bool nextRegroupedFrag_(UnpairedRead*& sread, FilterT filt);
+  inline FragT* regroupedFreeFrag_();
+  /** Read the next record, moving on to the next file as necessary */
+  inline bool nextRecord_(bam_seq_t*& b);
+
   /** Overload of getFrag_ for paired-end reads */
   template <typename FilterT>
   inline bool getFrag_(ReadPair& rpair, FilterT filt);
@@ -109,6 +187,14 @@ private:
 
   std::vector<AlignmentFile>::iterator currFile_;
   scram_fd* fp_ = nullptr;
+  // Open file (through a ReadaheadPipe, if readaheadBytes_ > 0), and close it
+  scram_fd* openFile_(AlignmentFile& file);
+  void closeFile_(AlignmentFile& file);
+  uint64_t readaheadBytes_{0};
+  // The fields that CRAM records are decoded with (0 for all of them)
+  int requiredFields_{0};
+  // The reference that CRAM records are decoded against (if not empty)
+  std::string cramReference_;
   SAM_hdr* hdr_ = nullptr;
 
   //htsFile* fp_ = nullptr;
@@ -116,12 +202,25 @@ private:
   size_t numUnaligned_;
   size_t numMappedReads_;
   size_t numUniquelyMappedReads_;
-  tbb::concurrent_queue<FragT*> fragmentQueue_;
-  //moodycamel::ConcurrentQueue<FragT*> fragmentQueue_;
+  moodycamel::ConcurrentQueue<FragT*> fragmentQueue_;
 
   //tbb::concurrent_bounded_queue<AlignmentGroup<FragT*>*> alnGroupPool_;
   moodycamel::ConcurrentQueue<AlignmentGroup<FragT*>*> alnGroupPool_;
 
+  // All of the fragments and alignment groups are allocated from these,
+  // and are recycled through fragmentQueue_ and alnGroupPool_ (so that
+  // the buffers of their bam_seq_t records are re-used, too)
+  SlabAllocator<FragT> fragAllocator_;
+  SlabAllocator<AlignmentGroup<FragT*>> alnGroupAllocator_;
+  // The pools are allocated lazily, in chunks of poolChunkSize_, up to
+  // poolCapacity_ alignment groups (the fragments grow with them)
+  static constexpr size_t poolChunkSize_ = 65536;
+  uint32_t poolCapacity_{0};
+
+  // A free alignment group, from the pool or newly allocated (if the pool
+  // hasn't reached its capacity); false if there is none
+  inline bool freeAlnGroup_(AlignmentGroup<FragT*>*& group);
+
   //tbb::concurrent_bounded_queue<AlignmentGroup<FragT*>*> alnGroupQueue_;
   moodycamel::ReaderWriterQueue<AlignmentGroup<FragT*>*> alnGroupQueue_;
 
@@ -132,6 +231,33 @@ private:
   volatile bool doneParsing_;
   volatile bool exhaustedAlnGroupPool_;
   std::unique_ptr<std::thread> parsingThread_;
+
+  // The batches of fragments passed from decodeFrags_ to fillQueue_
+  // (if parsing is pipelined)
+  bool pipelineParsing_;
+  static constexpr size_t decodedBatchSize_ = 1024;
+  moodycamel::ReaderWriterQueue<std::vector<FragT*>*> decodedBatches_;
+  std::atomic<bool> doneDecoding_{false};
+  std::unique_ptr<std::thread> decodingThread_;
+  std::vector<FragT*>* currBatch_{nullptr};
+  size_t currBatchPos_{0};
+
+  // If the input is coordinate-sorted, the records whose mates haven't
+  // been seen yet, by read name
+  bool coordinateSorted_;
+  std::unordered_map<std::string, std::vector<FragT*>, ReadNameHasher_> pendingMates_;
+
+  // If given, the time spent waiting on the queues is added to these
+  StageTimings* stageTimings_;
+  // The time the parser has spent waiting for free fragments and alignment
+  // groups (or for room in alnGroupQueue_) in the current round
+  std::atomic<uint64_t> poolWaitNs_{0};
+
+  inline void addPoolWait_(uint64_t ns) {
+      if (ns == 0) { return; }
+      poolWaitNs_ += ns;
+      if (stageTimings_ != nullptr) { stageTimings_->poolWaitNs += ns; }
+  }
   std::shared_ptr<spdlog::logger> logger_;
 
   size_t batchNum_;
@@ -1,41 +1,59 @@
 #include "BAMQueue.hpp"
 #include "IOUtils.hpp"
+#include "AllocationStats.hpp"
+#include "xxhash.h"
 #include <boost/config.hpp> // for BOOST_LIKELY/BOOST_UNLIKELY
+#include <algorithm>
 #include <chrono>
 
 template <typename FragT>
 BAMQueue<FragT>::BAMQueue(std::vector<boost::filesystem::path>& fnames, LibraryFormat& libFmt,
-                          uint32_t numParseThreads, uint32_t cacheSize):
+                          uint32_t numParseThreads, uint32_t cacheSize,
+                          bool pipelineParsing, bool coordinateSorted,
+                          StageTimings* stageTimings, uint32_t poolSize, uint64_t readaheadBytes,
+                          int requiredFields):
     files_(std::vector<AlignmentFile>()),
     libFmt_(libFmt), totalAlignments_(0),
     numUnaligned_(0), numMappedReads_(0), 
     numUniquelyMappedReads_(0),
-    //fragmentQueue_(2000000),
-    alnGroupPool_(2000000),
-    alnGroupQueue_(1000000),
+    fragmentQueue_(std::min(static_cast<size_t>(poolSize), size_t(poolChunkSize_))),
+    alnGroupPool_(std::min(static_cast<size_t>(poolSize), size_t(poolChunkSize_))),
+    fragAllocator_(poolChunkSize_),
+    alnGroupAllocator_(poolChunkSize_),
+    alnGroupQueue_(poolSize / 2),
     doneParsing_(false),
-    exhaustedAlnGroupPool_(false) {
+    exhaustedAlnGroupPool_(false),
+    // The alignment groups are assembled in fillQueueRegrouped_ (on a
+    // single thread) if the input is coordinate-sorted
+    pipelineParsing_(pipelineParsing and !coordinateSorted),
+    decodedBatches_(64),
+    coordinateSorted_(coordinateSorted),
+    stageTimings_(stageTimings),
+    readaheadBytes_(readaheadBytes),
+    requiredFields_(requiredFields) {
         namespace bfs = boost::filesystem;
 
         logger_ = spdlog::get("jointLog");
 
-        uint32_t localCacheSize = std::max(uint32_t{2000000}, cacheSize);
-        uint32_t capacity{localCacheSize};
-        for (size_t i = 0; i < capacity; ++i) {
-            // avoid r-value ref until we figure out what's
-            // up with TBB 4.3
-            auto* fragPtr = new FragT;
-            fragmentQueue_.push(fragPtr);
-        }
-
-        size_t groupCapacity = localCacheSize;
-        //alnGroupPool_.set_capacity(groupCapacity);
-        for (size_t i = 0; i < groupCapacity; ++i) {
-            // avoid r-value ref until we figure out what's
-            // up with TBB 4.3
-            auto* agrpPtr = new AlignmentGroup<FragT*>; 
-            alnGroupPool_.enqueue(agrpPtr);
-        }
+        // The pools of fragments and alignment groups start with a single
+        // chunk each (enqueued in bulk), and grow by chunks, as the parser
+        // runs out of free ones, up to poolCapacity_ groups
+        poolCapacity_ = std::max(poolSize, cacheSize);
+        size_t initialPoolSize = std::min(static_cast<size_t>(poolCapacity_), size_t(poolChunkSize_));
+        std::vector<FragT*> frags;
+        fragAllocator_.allocateSlab(initialPoolSize, [&frags](FragT* slab, size_t n) -> void {
+                frags.reserve(n);
+                for (size_t i = 0; i < n; ++i) { frags.push_back(slab + i); }
+        });
+        fragmentQueue_.enqueue_bulk(frags.begin(), frags.size());
+
+        std::vector<AlignmentGroup<FragT*>*> groups;
+        alnGroupAllocator_.allocateSlab(initialPoolSize,
+                [&groups](AlignmentGroup<FragT*>* slab, size_t n) -> void {
+                groups.reserve(n);
+                for (size_t i = 0; i < n; ++i) { groups.push_back(slab + i); }
+        });
+        alnGroupPool_.enqueue_bulk(groups.begin(), groups.size());
 
         bool firstFile = true;
         for (auto& fname : fnames) {
@@ -52,21 +70,19 @@ BAMQueue<FragT>::BAMQueue(std::vector<boost::filesystem::path>& fnames, LibraryF
             if (fname.extension() == ".bam") {
                 readMode_ = "rb";
             }
-            auto* fp = scram_open(fname.c_str(), readMode_.c_str());
+            files_.push_back({fname, readMode_, nullptr, nullptr, numParseThreads});
+            auto& file = files_.back();
+            auto* fp = openFile_(file);
             // If this is the first file, then we'll be parsing it soon.
             // set the number of parse threads.
             if (firstFile) {
                 scram_set_option(fp, CRAM_OPT_NTHREADS, numParseThreads);
             }
-            auto* header = scram_get_header(fp);
-            sam_hdr_incr_ref(header);
+            file.header = scram_get_header(fp);
+            sam_hdr_incr_ref(file.header);
             // If this isn't the first file, then close it.
             // We'll open it again when we need it.
-            if (!firstFile) {
-                scram_close(fp);
-                fp = nullptr;
-            }
-            files_.push_back({fname, readMode_, fp, header, numParseThreads});
+            if (!firstFile) { closeFile_(file); }
             firstFile = false;
         }
 }
@@ -79,7 +95,7 @@ void BAMQueue<FragT>::reset() {
       fmt::print(stderr, "{} ", file.fileName);
       // make sure that all of the current files are closed
       if (file.fp != nullptr) {
-          scram_close(file.fp);
+          closeFile_(file);
           // but make sure we still have a reference to the header!
           if (file.header == nullptr or file.header->ref_count <= 0) {
               fmt::MemoryWriter errstr;
@@ -93,7 +109,7 @@ void BAMQueue<FragT>::reset() {
 
   // re-open the first file
   auto& file = files_.front();
-  file.fp = scram_open(file.fileName.c_str(), file.readMode.c_str());
+  file.fp = openFile_(file);
 
   // If we couldn't open the file, then report this and exit.
   if (file.fp == NULL) {
@@ -113,6 +129,46 @@ void BAMQueue<FragT>::reset() {
   batchNum_ = 0;
 }
 
+template <typename FragT>
+scram_fd* BAMQueue<FragT>::openFile_(AlignmentFile& file) {
+    std::string path = file.fileName.string();
+    if (readaheadBytes_ > 0) {
+        file.readahead = std::make_shared<ReadaheadPipe>(path, readaheadBytes_,
+                                                         stageTimings_ ? &stageTimings_->ioWaitNs : nullptr);
+        path = file.readahead->path();
+    }
+    file.fp = scram_open(path.c_str(), file.readMode.c_str());
+    // Skip decoding the fields of CRAM records that won't be read (and
+    // the MD / NM tags, which are never read); BAM records are read whole,
+    // with their fields decoded by the accessors as they're used
+    if (file.fp != nullptr and requiredFields_ != 0 and file.fileName.extension() == ".cram") {
+        scram_set_option(file.fp, CRAM_OPT_REQUIRED_FIELDS, requiredFields_);
+        scram_set_option(file.fp, CRAM_OPT_DECODE_MD, 0);
+    }
+    if (file.fp != nullptr and !cramReference_.empty() and file.fileName.extension() == ".cram") {
+        scram_set_option(file.fp, CRAM_OPT_REFERENCE, cramReference_.c_str());
+    }
+    return file.fp;
+}
+
+template <typename FragT>
+void BAMQueue<FragT>::setCRAMReference(const std::string& path) {
+    cramReference_ = path;
+    // The first file was left open (with its header read) by the constructor
+    for (auto& file : files_) {
+        if (file.fp != nullptr and file.fileName.extension() == ".cram") {
+            scram_set_option(file.fp, CRAM_OPT_REFERENCE, cramReference_.c_str());
+        }
+    }
+}
+
+template <typename FragT>
+void BAMQueue<FragT>::closeFile_(AlignmentFile& file) {
+    scram_close(file.fp);
+    file.fp = nullptr;
+    file.readahead.reset();
+}
+
 template <typename FragT>
 BAMQueue<FragT>::~BAMQueue() {
     fmt::print(stderr, "\nFreeing memory used by read queue . . . ");
@@ -122,10 +178,7 @@ BAMQueue<FragT>::~BAMQueue() {
     for (auto& file : files_) {
         fmt::print(stderr, "{} ", file.fileName);
         // make sure that all of the current files are closed
-        if (file.fp != nullptr) {
-            scram_close(file.fp);
-            file.fp = nullptr;
-       }
+        if (file.fp != nullptr) { closeFile_(file); }
        // free the remaining reference to the header
        if (file.header == nullptr or file.header->ref_count <= 0) {
             fmt::MemoryWriter errstr;
@@ -140,22 +193,8 @@ BAMQueue<FragT>::~BAMQueue() {
     }
 
     fmt::print(stderr, "\nClosed all files . . . ");
-    // Free the structure holding all of the reads
-    FragT* frag;
-    //while (!fragmentQueue_.empty()) { 
-    while (fragmentQueue_.try_pop(frag)) { 
-        delete frag;
-        frag = nullptr;
-    }
-    //}
-    fmt::print(stderr, "\nEmptied frag queue. . . ");
-
-    AlignmentGroup<FragT*>* grp;
-    //while(!alnGroupPool_.empty()) { alnGroupPool_.pop(grp); delete grp; grp = nullptr; }
-    while(alnGroupPool_.try_dequeue(grp)) { delete grp; grp = nullptr; }
-    fmt::print(stderr, "\nEmptied Alignemnt Group Pool. . ");
-    while(alnGroupQueue_.try_dequeue(grp)) { delete grp; grp = nullptr; }
-    fmt::print(stderr, "\nEmptied Alignment Group Queue. . . ");
+    // The fragments and alignment groups themselves are freed (along with
+    // their slabs) by the allocators
     fmt::print(stderr, "done\n");
 }
 
@@ -181,32 +220,38 @@ inline bool tryToGetWork(moodycamel::ReaderWriterQueue<AlignmentGroup<FragT*>*>&
 
 template <typename FragT>
 inline bool BAMQueue<FragT>::getAlignmentGroup(AlignmentGroup<FragT*>*& group) {
-    while (!doneParsing_) {
-        while (alnGroupQueue_.try_dequeue(group)) {
-            return true;
-        }
-/*
-#if not defined(__APPLE__)
-{
-            std::unique_lock<std::mutex> l(agMutex_);
-            workAvailable_.wait(l, [&group, this]() { 
-                                    return this->alnGroupQueue_.try_dequeue(group) or this->doneParsing_; 
-                                });
-            return !doneParsing_;
-}
-#endif
-    }
-*/
-    }
+    bool foundGroup{false};
+    uint64_t waitedNs = salmon::utils::waitUntil([this, &group, &foundGroup]() -> bool {
+            foundGroup = this->alnGroupQueue_.try_dequeue(group);
+            return foundGroup or this->doneParsing_;
+    });
+    if (waitedNs > 0 and stageTimings_ != nullptr) { stageTimings_->parseWaitNs += waitedNs; }
+    if (foundGroup) { return true; }
+
+    // Parsing is done; drain whatever is left
+    return alnGroupQueue_.try_dequeue(group);
+}
+
+template <typename FragT>
+void BAMQueue<FragT>::forceEndParsing() { doneParsing_ = true; }
 
-    while (alnGroupQueue_.try_dequeue(group)) {
+template <typename FragT>
+inline bool BAMQueue<FragT>::freeAlnGroup_(AlignmentGroup<FragT*>*& group) {
+    if (alnGroupPool_.try_dequeue(group)) { return true; }
+    // Grow the pool (by the allocator's chunks) until it reaches its capacity
+    if (alnGroupAllocator_.numAllocated() < poolCapacity_) {
+        group = alnGroupAllocator_.allocate();
         return true;
     }
     return false;
 }
 
 template <typename FragT>
-void BAMQueue<FragT>::forceEndParsing() { doneParsing_ = true; }
+void BAMQueue<FragT>::sampleQueueDepths() {
+    if (stageTimings_ == nullptr) { return; }
+    stageTimings_->alnGroupQueueDepth.sample(alnGroupQueue_.size_approx());
+    stageTimings_->alnGroupPoolDepth.sample(alnGroupPool_.size_approx());
+}
 
 template <typename FragT>
 SAM_hdr* BAMQueue<FragT>::header() { return files_.front().header; } 
@@ -225,13 +270,13 @@ template <typename FilterT>
 void BAMQueue<FragT>::start(FilterT filt, bool onlyProcessAmbiguousAlignments) {
     // Start the parsing thread that will fill the queue
     parsingThread_.reset(new std::thread([this, filt, onlyProcessAmbiguousAlignments]()-> void {
+            SALMON_ALLOC_SCOPE("parsing");
             this->fillQueue_(filt, onlyProcessAmbiguousAlignments);
     }));
 }
 
 template <typename FragT>
-tbb::concurrent_queue<FragT*>& BAMQueue<FragT>::getFragmentQueue() {
-//moodycamel::ConcurrentQueue<FragT*>& BAMQueue<FragT>::getFragmentQueue() {
+moodycamel::ConcurrentQueue<FragT*>& BAMQueue<FragT>::getFragmentQueue() {
     return fragmentQueue_;
 }
 
@@ -277,6 +322,16 @@ inline bool sameReadName_<ReadPair>(const char* qname1, const char* qname2, cons
     return checkProperPairedNames_(qname1, qname2, nameLen);
 }
 
+/**
+* Hash the name of the fragment's read (ignoring any /1 or /2 suffix), so
+* that the alignments of different reads can usually be told apart without
+* comparing the names themselves.
+*/
+template <typename T>
+inline void hashReadName_(T& frag) {
+    frag.nameHash = XXH64(frag.getName(), frag.getNameLength(), 0);
+}
+
 enum class AlignmentType : uint8_t {
     UnmappedOrphan = 0,
     MappedOrphan = 1,
@@ -377,6 +432,7 @@ inline bool BAMQueue<FragT>::getFrag_(ReadPair& rpair, FilterT filt) {
                         salmon::utils::OrphanStatus::LeftOrphan :
                         salmon::utils::OrphanStatus::RightOrphan;
                     rpair.logProb = salmon::math::LOG_0;
+                    hashReadName_(rpair);
                     return true;
                     // === end of MappedOrphan case
                 case AlignmentType::MappedDiscordantPair:
@@ -413,14 +469,13 @@ inline bool BAMQueue<FragT>::getFrag_(ReadPair& rpair, FilterT filt) {
         // anyway. Figure out what the right thing is to do here.
         if (!didRead1 or !didRead2) { 
             // close the current file
-            scram_close(currFile_->fp);
-            currFile_->fp = nullptr;
+            closeFile_(*currFile_);
             // increment the file iterator
             currFile_++;
             // If this is the last file, then we're done
             if (currFile_ == files_.end()) { return false; }
             // Otherwise, start parsing the next file.
-            fp_ = scram_open(currFile_->fileName.c_str(), currFile_->readMode.c_str());
+            fp_ = openFile_(*currFile_);
             hdr_ = currFile_->header;
             continue;
         }
@@ -524,6 +579,7 @@ inline bool BAMQueue<FragT>::getFrag_(ReadPair& rpair, FilterT filt) {
         ++totalAlignments_;
     }
     rpair.logProb = salmon::math::LOG_0;
+    hashReadName_(rpair);
     return true;
 }
 
@@ -537,13 +593,12 @@ inline bool BAMQueue<FragT>::getFrag_(UnpairedRead& sread, FilterT filt) {
         // If we didn't get a read, then we've exhausted this file
         if (!didRead) { 
             // close the current file
-            scram_close(currFile_->fp);
-            currFile_->fp = nullptr;
+            closeFile_(*currFile_);
             currFile_++;
             // If this is the last file, then we're done
             if (currFile_ == files_.end()) { return false; }
             // Otherwise, start parsing the next file.
-            fp_ = scram_open(currFile_->fileName.c_str(), currFile_->readMode.c_str());
+            fp_ = openFile_(*currFile_);
             hdr_ = currFile_->header;
             continue;
         }
@@ -565,6 +620,7 @@ inline bool BAMQueue<FragT>::getFrag_(UnpairedRead& sread, FilterT filt) {
     }
 
     sread.logProb = salmon::math::LOG_0;
+    hashReadName_(sread);
     return true;
 }
 
@@ -585,36 +641,116 @@ size_t BAMQueue<FragT>::numUniquelyMappedFragments(){
 }
 
 
+template <typename FragT>
+template <typename FilterT>
+void BAMQueue<FragT>::decodeFrags_(FilterT filt) {
+    std::vector<FragT*>* batch = new std::vector<FragT*>;
+    batch->reserve(decodedBatchSize_);
+
+    FragT* f{nullptr};
+    auto getFreeFrag = [this, &f]() -> void {
+        if (fragmentQueue_.try_dequeue(f)) { return; }
+        if (!exhaustedAlnGroupPool_) {
+            f = fragAllocator_.allocate();
+            return;
+        }
+        addPoolWait_(salmon::utils::waitUntil([this, &f]() -> bool {
+                    return this->fragmentQueue_.try_dequeue(f);
+        }));
+    };
+
+    getFreeFrag();
+    while (getFrag_(*f, filt)) {
+        batch->push_back(f);
+        f = nullptr;
+        if (batch->size() >= decodedBatchSize_) {
+            decodedBatches_.enqueue(batch);
+            batch = new std::vector<FragT*>;
+            batch->reserve(decodedBatchSize_);
+        }
+        getFreeFrag();
+    }
+    if (f != nullptr) { fragmentQueue_.enqueue(f); f = nullptr; }
+
+    if (batch->size() > 0) {
+        decodedBatches_.enqueue(batch);
+    } else {
+        delete batch;
+    }
+    doneDecoding_ = true;
+}
+
+template <typename FragT>
+inline bool BAMQueue<FragT>::nextDecodedFrag_(FragT*& f) {
+    while (currBatch_ == nullptr or currBatchPos_ >= currBatch_->size()) {
+        if (currBatch_ != nullptr) {
+            delete currBatch_;
+            currBatch_ = nullptr;
+        }
+        bool gotBatch{false};
+        salmon::utils::waitUntil([this, &gotBatch]() -> bool {
+                // Check if decoding is done *before* looking for the next
+                // batch, so that we can't miss one that is enqueued in between
+                bool done = this->doneDecoding_;
+                gotBatch = this->decodedBatches_.try_dequeue(this->currBatch_);
+                return gotBatch or done;
+        });
+        if (!gotBatch) { return false; }
+        currBatchPos_ = 0;
+    }
+    f = (*currBatch_)[currBatchPos_++];
+    return true;
+}
+
 template <typename FragT>
 template <typename FilterT>
 void BAMQueue<FragT>::fillQueue_(FilterT filt, bool onlyProcessAmbiguousAlignments) {
+    if (coordinateSorted_) {
+        fillQueueRegrouped_(filt, onlyProcessAmbiguousAlignments);
+        return;
+    }
     size_t n{0};
     size_t numFragAlloc{0};
     AlignmentGroup<FragT*>* alngroup;
-    //alnGroupPool_.pop(alngroup);
-    while (!alnGroupPool_.try_dequeue(alngroup));
+    poolWaitNs_ = 0;
+    addPoolWait_(salmon::utils::waitUntil([this, &alngroup]() -> bool {
+                return this->freeAlnGroup_(alngroup);
+    }));
     bool notified{false};
 
     currFile_ = files_.begin();
     fp_ = currFile_->fp;
     hdr_ = currFile_->header;
 
-    FragT* f;
-    if (!fragmentQueue_.try_pop(f)) {
-        f = new FragT;
+    FragT* f{nullptr};
+    if (pipelineParsing_) {
+        doneDecoding_ = false;
+        decodingThread_.reset(new std::thread([this, filt]() -> void {
+                    SALMON_ALLOC_SCOPE("parsing");
+                    this->decodeFrags_(filt);
+        }));
+    } else if (!fragmentQueue_.try_dequeue(f)) {
+        f = fragAllocator_.allocate();
     }
+    // Get the next fragment, either from the decoding thread or by parsing
+    // it here
+    auto nextFrag = [this, &f, filt]() -> bool {
+        return pipelineParsing_ ? nextDecodedFrag_(f) : getFrag_(*f, filt);
+    };
 
     uint32_t prevLen{1};
+    uint64_t prevNameHash{0};
     char* prevReadName = new char[255];
     bool readAlignsUniquely{false};
     int32_t prevTranscriptId{std::numeric_limits<int32_t>::min()};
 
-    while(getFrag_(*f, filt)) {
+    while(nextFrag()) {
 
         char* readName = f->getName();
         uint32_t currLen = f->getNameLength();
-        // if this is a new read
-        if ( (currLen != prevLen) or
+        // if this is a new read (the names are only compared if their
+        // lengths and hashes match)
+        if ( (currLen != prevLen) or (f->nameHash != prevNameHash) or
             !sameReadName_<UnpairedRead>(readName, prevReadName, currLen) ) {
 
             if (alngroup->size() > 0) {
@@ -625,21 +761,24 @@ void BAMQueue<FragT>::fillQueue_(FilterT filt, bool onlyProcessAmbiguousAlignmen
                 if (onlyProcessAmbiguousAlignments and 
                         readAlignsUniquely) {
                    // return the fragments
-                   for (auto aln : alngroup->alignments()) {
-                       fragmentQueue_.push(aln); aln = nullptr;
-                   }
+                   fragmentQueue_.enqueue_bulk(alngroup->alignments().begin(),
+                                               alngroup->alignments().size());
                    // clear the alignments vector
                    alngroup->alignments().clear();
                    // continue to use this alignment group
                    numUniquelyMappedReads_++;
                 } else {
                     // push the align group
-                    while(!alnGroupQueue_.try_enqueue(alngroup));
+                    addPoolWait_(salmon::utils::waitUntil([this, &alngroup]() -> bool {
+                                return this->alnGroupQueue_.try_enqueue(alngroup);
+                    }));
                     alngroup = nullptr;
-                    if (!alnGroupPool_.try_dequeue(alngroup)) {  
+                    if (!freeAlnGroup_(alngroup)) {
                         exhaustedAlnGroupPool_ = true;
-                        //alnGroupPool_.pop(alngroup);
-                        while(!alnGroupPool_.try_dequeue(alngroup));
+                        if (stageTimings_ != nullptr) { ++stageTimings_->poolExhaustedEvents; }
+                        addPoolWait_(salmon::utils::waitUntil([this, &alngroup]() -> bool {
+                                    return this->alnGroupPool_.try_dequeue(alngroup);
+                        }));
                     }
                 }
             }
@@ -650,6 +789,7 @@ void BAMQueue<FragT>::fillQueue_(FilterT filt, bool onlyProcessAmbiguousAlignmen
             alngroup->addAlignment(f);
             memcpy(prevReadName, readName, currLen);
             prevLen = currLen;
+            prevNameHash = f->nameHash;
             prevTranscriptId = f->transcriptID();
             f = nullptr;
             numMappedReads_++;
@@ -665,11 +805,16 @@ void BAMQueue<FragT>::fillQueue_(FilterT filt, bool onlyProcessAmbiguousAlignmen
             f = nullptr;
        }
 
-        while (!fragmentQueue_.try_pop(f)) {
+        // (If parsing is pipelined, the decoding thread gets the free
+        // fragments)
+        if (!pipelineParsing_ and !fragmentQueue_.try_dequeue(f)) {
             if (!exhaustedAlnGroupPool_) {
-                f = new FragT;
+                f = fragAllocator_.allocate();
                 ++numFragAlloc;
-                break;
+            } else {
+                addPoolWait_(salmon::utils::waitUntil([this, &f]() -> bool {
+                            return this->fragmentQueue_.try_dequeue(f);
+                }));
             }
         }
 
@@ -683,7 +828,11 @@ void BAMQueue<FragT>::fillQueue_(FilterT filt, bool onlyProcessAmbiguousAlignmen
 
     // If we popped a fragment structure off the queue, but didn't add it 
     // to an alignment group, then reclaim it here
-    if (f != nullptr) { fragmentQueue_.push(f); f = nullptr; }
+    if (f != nullptr) { fragmentQueue_.enqueue(f); f = nullptr; }
+    if (decodingThread_) {
+        decodingThread_->join();
+        decodingThread_.reset();
+    }
 
     // If the last alignment group is non-empty, then send 
     // it off to be processed.
@@ -695,16 +844,17 @@ void BAMQueue<FragT>::fillQueue_(FilterT filt, bool onlyProcessAmbiguousAlignmen
         if (onlyProcessAmbiguousAlignments and 
                 readAlignsUniquely) {
             // return the fragments
-            for (auto aln : alngroup->alignments()) {
-                fragmentQueue_.push(aln); aln = nullptr;
-            }
+            fragmentQueue_.enqueue_bulk(alngroup->alignments().begin(),
+                                        alngroup->alignments().size());
             // clear the alignments vector
             alngroup->alignments().clear();
             // return the alignment group itself 
             alnGroupPool_.enqueue(alngroup);
             numUniquelyMappedReads_++;
         } else {
-            while(!alnGroupQueue_.try_enqueue(alngroup));
+            addPoolWait_(salmon::utils::waitUntil([this, &alngroup]() -> bool {
+                        return this->alnGroupQueue_.try_enqueue(alngroup);
+            }));
             alngroup = nullptr;
         }
     } else { // otherwise, reclaim the alignment group structure here
@@ -713,6 +863,8 @@ void BAMQueue<FragT>::fillQueue_(FilterT filt, bool onlyProcessAmbiguousAlignmen
     }
 
     delete [] prevReadName;
+    logger_->info("The BAM parser spent {:.2f} seconds of this round waiting for free fragments and "
+                  "alignment groups", poolWaitNs_ * 1e-9);
     // We're at the end of the list of input files
     // and we're done parsing (for now).
     currFile_ = files_.end();
@@ -722,6 +874,259 @@ void BAMQueue<FragT>::fillQueue_(FilterT filt, bool onlyProcessAmbiguousAlignmen
     return;
 }
 
+template <typename FragT>
+inline bool BAMQueue<FragT>::nextRecord_(bam_seq_t*& b) {
+    while (scram_get_seq(fp_, &b) < 0) {
+        // close the current file, and move on to the next one (if any)
+        closeFile_(*currFile_);
+        currFile_++;
+        if (currFile_ == files_.end()) { return false; }
+        fp_ = openFile_(*currFile_);
+        hdr_ = currFile_->header;
+    }
+    return true;
+}
+
+/**
+* The number of alignments reported for this read (its NH tag), or 0 if
+* the record doesn't say.
+*/
+inline uint32_t numReportedAlignments_(bam_seq_t* b) {
+    char key[] = "NH";
+    char* nh = bam_aux_find(b, key);
+    if (nh == nullptr) { return 0; }
+    int32_t n = bam_aux_i(reinterpret_cast<uint8_t*>(nh));
+    return (n > 0) ? static_cast<uint32_t>(n) : 0;
+}
+
+inline bam_seq_t* firstRecord_(ReadPair& f) { return f.read1; }
+inline bam_seq_t* firstRecord_(UnpairedRead& f) { return f.read; }
+
+template <typename FragT>
+inline FragT* BAMQueue<FragT>::regroupedFreeFrag_() {
+    // Since the pending mates and groups hold on to fragments, waiting for
+    // the consumers to return some could deadlock; allocate new ones instead.
+    FragT* f{nullptr};
+    if (!fragmentQueue_.try_dequeue(f)) { f = fragAllocator_.allocate(); }
+    return f;
+}
+
+template <typename FragT>
+template <typename FilterT>
+inline bool BAMQueue<FragT>::nextRegroupedFrag_(ReadPair*& rpair, FilterT filt) {
+    auto& pendingMates = pendingMates_;
+    auto finishOrphan = [](ReadPair* r) -> void {
+        bool isFwd = !(bam_strand(r->read1));
+        r->libFmt = salmon::utils::hitType(bam_pos(r->read1), isFwd);
+        r->orphanStatus = (bam_flag(r->read1) & BAM_FREAD1) ?
+            salmon::utils::OrphanStatus::LeftOrphan :
+            salmon::utils::OrphanStatus::RightOrphan;
+        r->logProb = salmon::math::LOG_0;
+        hashReadName_(*r);
+    };
+
+    rpair = regroupedFreeFrag_();
+    while (nextRecord_(rpair->read1)) {
+        bam_seq_t* rec = rpair->read1;
+        switch (getPairedAlignmentType_(rec)) {
+            case AlignmentType::UnmappedOrphan:
+                ++numUnaligned_;
+                ++totalAlignments_;
+                if (filt != nullptr) {
+                    rpair->orphanStatus = salmon::utils::OrphanStatus::LeftOrphan;
+                    filt->processFrag(rpair);
+                }
+                break;
+            case AlignmentType::UnmappedPair:
+                // Count (and filter) each unmapped pair once, by its first read
+                if (bam_flag(rec) & BAM_FREAD1) {
+                    ++numUnaligned_;
+                    ++totalAlignments_;
+                    if (filt != nullptr) {
+                        rpair->orphanStatus = salmon::utils::OrphanStatus::LeftOrphan;
+                        filt->processFrag(rpair);
+                    }
+                }
+                break;
+            case AlignmentType::MappedOrphan:
+                ++totalAlignments_;
+                finishOrphan(rpair);
+                return true;
+            case AlignmentType::MappedConcordantPair:
+                {
+                    std::string name(bam_name(rec), getPairedNameLen(rec));
+                    auto& candidates = pendingMates[name];
+                    auto mateIt = std::find_if(candidates.begin(), candidates.end(),
+                            [rec](ReadPair* p) -> bool {
+                                bam_seq_t* m = p->read1;
+                                return bam_ref(m) == bam_ref(rec) and
+                                       bam_pos(m) == bam_mate_pos(rec) and
+                                       bam_mate_pos(m) == bam_pos(rec) and
+                                       ((bam_flag(m) & BAM_FREAD1) != (bam_flag(rec) & BAM_FREAD1));
+                            });
+                    // The mate hasn't been seen yet; hold on to this record
+                    // until it is.
+                    if (mateIt == candidates.end()) {
+                        candidates.push_back(rpair);
+                        rpair = regroupedFreeFrag_();
+                        break;
+                    }
+
+                    ReadPair* mate = *mateIt;
+                    candidates.erase(mateIt);
+                    if (candidates.empty()) { pendingMates.erase(name); }
+                    std::swap(mate->read2, rpair->read1);
+                    fragmentQueue_.enqueue(rpair);
+                    rpair = mate;
+                    if (bam_flag(rpair->read1) & BAM_FREAD2) {
+                        std::swap(rpair->read1, rpair->read2);
+                    }
+                    bool isFwd1 = !(bam_flag(rpair->read1) & BAM_FREVERSE);
+                    bool isFwd2 = !(bam_flag(rpair->read2) & BAM_FREVERSE);
+                    rpair->libFmt = salmon::utils::hitType(bam_pos(rpair->read1), isFwd1,
+                                                           bam_pos(rpair->read2), isFwd2);
+                    rpair->orphanStatus = salmon::utils::OrphanStatus::Paired;
+                    rpair->logProb = salmon::math::LOG_0;
+                    hashReadName_(*rpair);
+                    ++totalAlignments_;
+                    return true;
+                }
+            default:
+                break;
+        }
+    }
+    fragmentQueue_.enqueue(rpair);
+    rpair = nullptr;
+
+    // The input is exhausted; any mates that are still waiting for their
+    // partner (e.g. because it was filtered from the file) become orphans.
+    while (!pendingMates.empty()) {
+        auto it = pendingMates.begin();
+        if (it->second.empty()) {
+            pendingMates.erase(it);
+            continue;
+        }
+        rpair = it->second.back();
+        it->second.pop_back();
+        ++totalAlignments_;
+        finishOrphan(rpair);
+        return true;
+    }
+    return false;
+}
+
+template <typename FragT>
+template <typename FilterT>
+inline bool BAMQueue<FragT>::nextRegroupedFrag_(UnpairedRead*& sread, FilterT filt) {
+    sread = regroupedFreeFrag_();
+    while (nextRecord_(sread->read)) {
+        ++totalAlignments_;
+        if (!(bam_flag(sread->read) & BAM_FDUP) and
+            !(bam_flag(sread->read) & BAM_FQCFAIL) and
+            !(bam_flag(sread->read) & BAM_FUNMAP) and
+            sread->transcriptID() >= 0) {
+            sread->logProb = salmon::math::LOG_0;
+            hashReadName_(*sread);
+            return true;
+        }
+        if (filt != nullptr) {
+            filt->processFrag(sread);
+        }
+        ++numUnaligned_;
+    }
+    fragmentQueue_.enqueue(sread);
+    sread = nullptr;
+    return false;
+}
+
+/**
+* Used (instead of the grouping in fillQueue_) when the input is sorted by
+* coordinate, so that the alignments of a read, and the two ends of a
+* pair, are generally not adjacent in the file.  The mates are paired by
+* nextRegroupedFrag_, and the fragments are collected, by read name, into
+* pending alignment groups; a group is sent off as soon as it holds as many
+* alignments as the read's NH tag reports, and any groups that remain (e.g.
+* because the aligner doesn't write NH) are sent off once the input is
+* exhausted.
+*/
+template <typename FragT>
+template <typename FilterT>
+void BAMQueue<FragT>::fillQueueRegrouped_(FilterT filt, bool onlyProcessAmbiguousAlignments) {
+    struct PendingGroup {
+        AlignmentGroup<FragT*>* group;
+        uint32_t expected;
+        int32_t firstTranscriptId;
+        bool uniquelyMapped;
+    };
+    std::unordered_map<std::string, PendingGroup, ReadNameHasher_> pendingGroups;
+    bool warnedNoNH{false};
+
+    auto emit = [this, onlyProcessAmbiguousAlignments](PendingGroup& pg) -> void {
+        ++numMappedReads_;
+        if (pg.uniquelyMapped) { ++numUniquelyMappedReads_; }
+        if (onlyProcessAmbiguousAlignments and pg.uniquelyMapped) {
+            fragmentQueue_.enqueue_bulk(pg.group->alignments().begin(),
+                                        pg.group->alignments().size());
+            pg.group->alignments().clear();
+            alnGroupPool_.enqueue(pg.group);
+        } else {
+            auto* group = pg.group;
+            addPoolWait_(salmon::utils::waitUntil([this, group]() -> bool {
+                        return this->alnGroupQueue_.try_enqueue(group);
+            }));
+        }
+        pg.group = nullptr;
+    };
+
+    poolWaitNs_ = 0;
+    currFile_ = files_.begin();
+    fp_ = currFile_->fp;
+    hdr_ = currFile_->header;
+
+    FragT* f{nullptr};
+    while (nextRegroupedFrag_(f, filt)) {
+        std::string name(f->getName(), f->getNameLength());
+        auto it = pendingGroups.find(name);
+        if (it == pendingGroups.end()) {
+            AlignmentGroup<FragT*>* group{nullptr};
+            if (!alnGroupPool_.try_dequeue(group)) {
+                group = alnGroupAllocator_.allocate();
+                if (stageTimings_ != nullptr) { ++stageTimings_->poolExhaustedEvents; }
+            }
+            group->clearAlignments();
+            uint32_t expected = numReportedAlignments_(firstRecord_(*f));
+            if (expected == 0 and !warnedNoNH) {
+                logger_->warn("Some of the alignment records have no NH tag; the alignments of these "
+                              "reads will be held in memory until the end of the input");
+                warnedNoNH = true;
+            }
+            it = pendingGroups.emplace(std::move(name),
+                    PendingGroup{group, expected, f->transcriptID(), true}).first;
+        }
+        auto& pg = it->second;
+        if (pg.uniquelyMapped and f->transcriptID() != pg.firstTranscriptId) {
+            pg.uniquelyMapped = false;
+        }
+        pg.group->addAlignment(f);
+        f = nullptr;
+        if (pg.expected > 0 and pg.group->size() >= pg.expected) {
+            emit(pg);
+            pendingGroups.erase(it);
+        }
+    }
+
+    for (auto& kv : pendingGroups) { emit(kv.second); }
+    pendingGroups.clear();
+    pendingMates_.clear();
+
+    logger_->info("The BAM parser spent {:.2f} seconds of this round waiting for free fragments and "
+                  "alignment groups", poolWaitNs_ * 1e-9);
+    currFile_ = files_.end();
+    fp_ = nullptr;
+    hdr_ = nullptr;
+    doneParsing_ = true;
+}
+
 ///////// Proper BAM parsing graveyard
 
 /* 
@@ -29,51 +29,35 @@ static void smem_aux_destroy(smem_aux_t *a)
     free(a);
 }
 
-static void mem_collect_intv(const SalmonOpts& sopt, const mem_opt_t *opt, SalmonIndex* sidx, int len, const uint8_t *seq, smem_aux_t *a)
+/**
+ * The auxiliary k-mer index (k-mer -> BWT interval) from which the SMEM
+ * searches are started, skipping the first k extensions of each; nullptr
+ * if the index has none, or if its k-mers are longer than the minimum seed
+ * length (so that the shorter seeds would be missed).
+ */
+static inline KmerIntervalMap* usableAuxIndex(SalmonIndex* sidx, const mem_opt_t* opt)
+{
+    if (!sidx->hasAuxKmerIndex()) { return nullptr; }
+    KmerIntervalMap& auxIdx = sidx->auxIndex();
+    return (static_cast<int>(auxIdx.k()) <= opt->min_seed_len) ? &auxIdx : nullptr;
+}
+
+// True if none of the k bases starting at seq is ambiguous (so that they can be looked up as a k-mer)
+static inline bool isUnambiguousKmer(const uint8_t* seq, int k)
+{
+    for (int i = 0; i < k; ++i) { if (seq[i] > 3) { return false; } }
+    return true;
+}
+
+// The passes of mem_collect_intv after the first (SMEM-finding) one, which
+// add to the SMEMs in a->mem
+static void mem_collect_extra_intv(const SalmonOpts& sopt, const mem_opt_t *opt, SalmonIndex* sidx, int len, const uint8_t *seq, smem_aux_t *a)
 {
     const bwt_t* bwt = sidx->bwaIndex()->bwt;
     int i, k, x = 0, old_n;
     int start_width = (opt->flag & MEM_F_SELF_OVLP)? 2 : 1;
     int split_len = (int)(opt->min_seed_len * opt->split_factor + .499);
-    a->mem.n = 0;
-
-    // first pass: find all SMEMs
-    if (sidx->hasAuxKmerIndex()) {
-        KmerIntervalMap& auxIdx = sidx->auxIndex();
-        uint32_t klen = auxIdx.k();
-        while (x < len) {
-            if (seq[x] < 4) {
-                // Make sure there are at least k bases left
-                if (len - x < klen) { x = len; continue; }
-                // search for this key in the auxiliary index
-                KmerKey kmer(const_cast<uint8_t*>(&(seq[x])), klen);
-                auto it = auxIdx.find(kmer);
-                // if we can't find it, move to the next key
-                if (it == auxIdx.end()) { ++x; continue; }
-                // otherwise, start the search using the initial interval @it->second from the hash
-                int xb = x;
-                x = bwautils::bwt_smem1_with_kmer(bwt, len, seq, x, start_width, it->second, &a->mem1, a->tmpv);
-                for (i = 0; i < a->mem1.n; ++i) {
-                    bwtintv_t *p = &a->mem1.a[i];
-                    int slen = (uint32_t)p->info - (p->info>>32); // seed length
-                    if (slen >= opt->min_seed_len)
-                        kv_push(bwtintv_t, a->mem, *p);
-                }
-            } else ++x;
-        }
-    } else {
-        while (x < len) {
-            if (seq[x] < 4) {
-                x = bwt_smem1(bwt, len, seq, x, start_width, &a->mem1, a->tmpv);
-                for (i = 0; i < a->mem1.n; ++i) {
-                    bwtintv_t *p = &a->mem1.a[i];
-                    int slen = (uint32_t)p->info - (p->info>>32); // seed length
-                    if (slen >= opt->min_seed_len)
-                        kv_push(bwtintv_t, a->mem, *p);
-                }
-            } else ++x;
-        }
-    }
+    KmerIntervalMap* auxIdx = usableAuxIndex(sidx, opt);
 
     // For sensitive / extra-sensitive mode only
     if (sopt.sensitive or sopt.extraSeedPass) {
@@ -84,8 +68,24 @@ static void mem_collect_intv(const SalmonOpts& sopt, const mem_opt_t *opt, Salmo
             int start = p->info>>32, end = (int32_t)p->info;
             if (end - start < split_len || p->x[2] > opt->split_width) continue;
 
-            //int idx = (start + end) >> 1;
-            bwt_smem1(bwt, len, seq, (start + end)>>1, p->x[2]+1, &a->mem1, a->tmpv);
+            int mid = (start + end) >> 1;
+            // Start from the interval of the k-mer at mid, if it's still wide
+            // enough to be extended (otherwise the search stops within its k bases)
+            bool fromKmer{false};
+            if (auxIdx) {
+                int klen = static_cast<int>(auxIdx->k());
+                if (len - mid >= klen and isUnambiguousKmer(&(seq[mid]), klen)) {
+                    KmerKey kmer(const_cast<uint8_t*>(&(seq[mid])), klen);
+                    const bwtintv_t* kmerIntv = auxIdx->lookup(kmer);
+                    if (kmerIntv and kmerIntv->x[2] >= p->x[2] + 1) {
+                        bwautils::bwt_smem1_with_kmer(bwt, len, seq, mid, p->x[2]+1, *kmerIntv, &a->mem1, a->tmpv);
+                        fromKmer = true;
+                    }
+                }
+            }
+            if (!fromKmer) {
+                bwt_smem1(bwt, len, seq, mid, p->x[2]+1, &a->mem1, a->tmpv);
+            }
             for (i = 0; i < a->mem1.n; ++i)
                 if ((uint32_t)a->mem1.a[i].info - (a->mem1.a[i].info>>32) >= opt->min_seed_len)
                     kv_push(bwtintv_t, a->mem, a->mem1.a[i]);
@@ -114,6 +114,57 @@ static void mem_collect_intv(const SalmonOpts& sopt, const mem_opt_t *opt, Salmo
     // ks_introsort(mem_intv, a->mem.n, a->mem.a);
 }
 
+static void mem_collect_intv(const SalmonOpts& sopt, const mem_opt_t *opt, SalmonIndex* sidx, int len, const uint8_t *seq, smem_aux_t *a)
+{
+    const bwt_t* bwt = sidx->bwaIndex()->bwt;
+    int i, x = 0;
+    int start_width = (opt->flag & MEM_F_SELF_OVLP)? 2 : 1;
+    a->mem.n = 0;
+
+    // first pass: find all SMEMs
+    if (KmerIntervalMap* auxIdxPtr = usableAuxIndex(sidx, opt)) {
+        KmerIntervalMap& auxIdx = *auxIdxPtr;
+        int klen = static_cast<int>(auxIdx.k());
+        while (x < len) {
+            if (seq[x] < 4) {
+                // Make sure there are at least k bases left
+                if (len - x < klen) { x = len; continue; }
+                // A k-mer with an ambiguous base can't be looked up (nor can
+                // any seed starting here reach k bases)
+                if (!isUnambiguousKmer(&(seq[x]), klen)) { ++x; continue; }
+                // search for this key in the auxiliary index
+                KmerKey kmer(const_cast<uint8_t*>(&(seq[x])), klen);
+                const bwtintv_t* kmerIntv = auxIdx.lookup(kmer);
+                // if we can't find it, move to the next key
+                if (!kmerIntv) { ++x; continue; }
+                // otherwise, start the search using the initial interval @kmerIntv from the hash
+                int xb = x;
+                x = bwautils::bwt_smem1_with_kmer(bwt, len, seq, x, start_width, *kmerIntv, &a->mem1, a->tmpv);
+                for (i = 0; i < a->mem1.n; ++i) {
+                    bwtintv_t *p = &a->mem1.a[i];
+                    int slen = (uint32_t)p->info - (p->info>>32); // seed length
+                    if (slen >= opt->min_seed_len)
+                        kv_push(bwtintv_t, a->mem, *p);
+                }
+            } else ++x;
+        }
+    } else {
+        while (x < len) {
+            if (seq[x] < 4) {
+                x = bwt_smem1(bwt, len, seq, x, start_width, &a->mem1, a->tmpv);
+                for (i = 0; i < a->mem1.n; ++i) {
+                    bwtintv_t *p = &a->mem1.a[i];
+                    int slen = (uint32_t)p->info - (p->info>>32); // seed length
+                    if (slen >= opt->min_seed_len)
+                        kv_push(bwtintv_t, a->mem, *p);
+                }
+            } else ++x;
+        }
+    }
+
+    mem_collect_extra_intv(sopt, opt, sidx, len, seq, a);
+}
+
 
 /******* END OF STUFF THAT IS STATIC IN BWAMEM THAT WE NEED HERE --- Just re-define it *************/
 
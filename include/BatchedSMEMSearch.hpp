@@ -0,0 +1,313 @@
+#ifndef __BATCHED_SMEM_SEARCH_HPP__
+#define __BATCHED_SMEM_SEARCH_HPP__
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "BWAUtils.hpp"
+#include "KmerIntervalMap.hpp"
+
+extern unsigned char nst_nt4_table[256];
+
+namespace bwautils {
+
+/**
+ * The reads of a mini-batch (each mate of a pair is a read of its own),
+ * encoded for the BWT (nst_nt4_table), with the SMEMs that
+ * BatchedSMEMSearch found for each.
+ */
+class SMEMBatch {
+    public:
+        void clear() { numReads_ = 0; }
+
+        void addRead(const std::string& seq) {
+            if (numReads_ == reads_.size()) {
+                reads_.emplace_back();
+                mems_.emplace_back();
+            }
+            auto& r = reads_[numReads_];
+            r.resize(seq.size());
+            for (size_t i = 0; i < seq.size(); ++i) {
+                r[i] = nst_nt4_table[static_cast<uint8_t>(seq[i])];
+            }
+            mems_[numReads_].clear();
+            ++numReads_;
+        }
+
+        size_t size() const { return numReads_; }
+        const uint8_t* read(size_t i) const { return reads_[i].data(); }
+        int readLength(size_t i) const { return static_cast<int>(reads_[i].size()); }
+        std::vector<bwtintv_t>& mems(size_t i) { return mems_[i]; }
+        const std::vector<bwtintv_t>& mems(size_t i) const { return mems_[i]; }
+
+    private:
+        // Kept (with their capacity) from one mini-batch to the next
+        std::vector<std::vector<uint8_t>> reads_;
+        std::vector<std::vector<bwtintv_t>> mems_;
+        size_t numReads_{0};
+};
+
+/**
+ * The first (SMEM-finding) pass of mem_collect_intv over the reads of a
+ * mini-batch at once (salmon quant --smemBatch).  Each backward or forward
+ * extension (bwt_extend) reads the occurrence blocks of the two ends of an
+ * interval, which are practically never in the cache; searching one read at
+ * a time, every extension waits for them.  Here the search of each read is
+ * a state machine that stops before each extension, having prefetched the
+ * blocks that it will read, and the searches of up to width reads are
+ * advanced in turn; by the time a read's turn comes again, its blocks have
+ * (likely) arrived.
+ *
+ * The SMEMs found (and their order) are exactly those of bwt_smem1 (or of
+ * bwt_smem1_with_kmer, with an auxiliary k-mer index) called in a loop over
+ * each read, as in mem_collect_intv.
+ */
+class BatchedSMEMSearch {
+    public:
+        BatchedSMEMSearch(const bwt_t* bwt, KmerIntervalMap* auxIndex, int minSeedLen,
+                          int startWidth, size_t width) :
+            bwt_(bwt), auxIndex_(auxIndex), minSeedLen_(minSeedLen),
+            minIntv_(std::max(startWidth, 1)), slots_(std::max(width, size_t(1))) {}
+
+        /** Find the SMEMs (of at least minSeedLen) of each read of batch. */
+        void search(SMEMBatch& batch) {
+            size_t next{0};
+            size_t numActive{0};
+            // Start the first searches
+            for (auto& s : slots_) {
+                s.active = false;
+                while (next < batch.size() and !s.active) { s.active = start_(s, batch, next++); }
+                if (s.active) { ++numActive; }
+            }
+            // Advance each search by one extension in turn; a slot whose read
+            // is done takes the next one
+            while (numActive > 0) {
+                for (auto& s : slots_) {
+                    if (!s.active or run_(s)) { continue; }
+                    s.active = false;
+                    while (next < batch.size() and !s.active) { s.active = start_(s, batch, next++); }
+                    if (!s.active) { --numActive; }
+                }
+            }
+        }
+
+    private:
+        enum class Phase : uint8_t {
+            NextSearch, Forward, ForwardExtended, EndForward,
+            BackwardRow, BackwardNext, BackwardExtended, Done };
+
+        struct ReadState {
+            bool active{false};
+            Phase phase{Phase::Done};
+            const uint8_t* q{nullptr};
+            int len{0};
+            int x{0}; // where the current SMEM search starts
+            int i{0}; // the position of the forward or backward extension
+            size_t j{0}; // the interval (of prev) being extended backward
+            int c{0}; // the base of the backward extension (-1 at the start or at an ambiguous base)
+            int ret{0}; // where the next SMEM search starts
+            bwtintv_t ik;
+            bwtintv_t ok[4];
+            std::vector<bwtintv_t> prev;
+            std::vector<bwtintv_t> curr;
+            std::vector<bwtintv_t> mem1;
+            std::vector<bwtintv_t>* out{nullptr};
+        };
+
+        // Start the search of read r in s; false if the read has nothing to look up
+        bool start_(ReadState& s, SMEMBatch& batch, size_t r) {
+            s.q = batch.read(r);
+            s.len = batch.readLength(r);
+            s.out = &batch.mems(r);
+            s.x = 0;
+            s.phase = Phase::NextSearch;
+            return run_(s);
+        }
+
+        // Issue the prefetches for the extension of the interval starting at k
+        inline void prefetch_(bwtint_t k, bwtint_t size) const {
+            bwtint_t l = k + size;
+            if (k != static_cast<bwtint_t>(-1)) {
+                k -= (k >= bwt_->primary);
+                const uint32_t* p = bwt_occ_intv(bwt_, k);
+                __builtin_prefetch(p);
+                __builtin_prefetch(p + 15);
+            }
+            if (l != static_cast<bwtint_t>(-1)) {
+                l -= (l >= bwt_->primary);
+                const uint32_t* p = bwt_occ_intv(bwt_, l);
+                __builtin_prefetch(p);
+                __builtin_prefetch(p + 15);
+            }
+        }
+
+        // The start of the next SMEM search of s (see mem_collect_intv); false if there is none
+        bool nextSearch_(ReadState& s) {
+            while (s.x < s.len) {
+                if (s.q[s.x] > 3) { ++s.x; continue; }
+                if (auxIndex_) {
+                    int klen = static_cast<int>(auxIndex_->k());
+                    if (s.len - s.x < klen) { s.x = s.len; continue; }
+                    if (!unambiguous_(s.q + s.x, klen)) { ++s.x; continue; }
+                    KmerKey kmer(const_cast<uint8_t*>(s.q + s.x), klen);
+                    const bwtintv_t* kmerIntv = auxIndex_->lookup(kmer);
+                    if (!kmerIntv) { ++s.x; continue; }
+                    // As in bwt_smem1_with_kmer
+                    int k = static_cast<int>(kmerIntv->info);
+                    s.ik.x[0] = kmerIntv->x[0];
+                    s.ik.x[1] = kmerIntv->x[1];
+                    s.ik.x[2] = kmerIntv->x[2];
+                    s.ik.info = s.x + k;
+                    s.i = s.x + k;
+                } else {
+                    bwt_set_intv(bwt_, s.q[s.x], s.ik);
+                    s.ik.info = s.x + 1;
+                    s.i = s.x + 1;
+                }
+                s.curr.clear();
+                s.mem1.clear();
+                return true;
+            }
+            return false;
+        }
+
+        static bool unambiguous_(const uint8_t* q, int k) {
+            for (int i = 0; i < k; ++i) { if (q[i] > 3) { return false; } }
+            return true;
+        }
+
+        // The SMEM search of s is complete; keep its long enough SMEMs
+        void finishSearch_(ReadState& s) {
+            std::reverse(s.mem1.begin(), s.mem1.end());
+            for (auto& m : s.mem1) {
+                int slen = static_cast<uint32_t>(m.info) - (m.info >> 32);
+                if (slen >= minSeedLen_) { s.out->push_back(m); }
+            }
+            s.x = s.ret;
+        }
+
+        // The step of the backward search of bwt_smem1a, once prev[j] has been extended (if c >= 0)
+        void backwardStep_(ReadState& s) {
+            const bwtintv_t& p = s.prev[s.j];
+            if (s.c < 0 or s.ok[s.c].x[2] < static_cast<bwtint_t>(minIntv_)) {
+                // Keep the hit if it reaches the beginning, or an ambiguous base, or
+                // can't be extended; unless it's contained in a longer one
+                if (s.curr.empty() and
+                    (s.mem1.empty() or static_cast<uint64_t>(s.i + 1) < (s.mem1.back().info >> 32))) {
+                    bwtintv_t ik = p;
+                    ik.info |= static_cast<uint64_t>(s.i + 1) << 32;
+                    s.mem1.push_back(ik);
+                }
+            } else if (s.curr.empty() or s.ok[s.c].x[2] != s.curr.back().x[2]) {
+                s.ok[s.c].info = p.info;
+                s.curr.push_back(s.ok[s.c]);
+            }
+        }
+
+        /**
+         * Advance the search of s: apply the extension it stopped before (if
+         * any), and continue until the next one, whose blocks are prefetched.
+         * Returns false once the read is done.
+         */
+        bool run_(ReadState& s) {
+            while (true) {
+                switch (s.phase) {
+                    case Phase::NextSearch:
+                        if (!nextSearch_(s)) {
+                            s.phase = Phase::Done;
+                            return false;
+                        }
+                        s.phase = Phase::Forward;
+                        break;
+                    case Phase::Forward:
+                        if (s.i >= s.len) {
+                            s.curr.push_back(s.ik);
+                            s.phase = Phase::EndForward;
+                        } else if (s.q[s.i] < 4) {
+                            prefetch_(s.ik.x[1] - 1, s.ik.x[2]);
+                            s.phase = Phase::ForwardExtended;
+                            return true;
+                        } else {
+                            // Always stop at an ambiguous base
+                            s.curr.push_back(s.ik);
+                            s.phase = Phase::EndForward;
+                        }
+                        break;
+                    case Phase::ForwardExtended: {
+                        bwt_extend(bwt_, &s.ik, s.ok, 0);
+                        int c = 3 - s.q[s.i];
+                        s.phase = Phase::Forward;
+                        if (s.ok[c].x[2] != s.ik.x[2]) {
+                            s.curr.push_back(s.ik);
+                            if (s.ok[c].x[2] < static_cast<bwtint_t>(minIntv_)) {
+                                s.phase = Phase::EndForward;
+                                break;
+                            }
+                        }
+                        s.ik = s.ok[c];
+                        s.ik.info = s.i + 1;
+                        ++s.i;
+                        break;
+                    }
+                    case Phase::EndForward:
+                        // s.t. the smaller intervals (longer matches) come first
+                        std::reverse(s.curr.begin(), s.curr.end());
+                        s.ret = static_cast<int>(s.curr.front().info);
+                        std::swap(s.prev, s.curr);
+                        s.i = s.x - 1;
+                        s.phase = Phase::BackwardRow;
+                        break;
+                    case Phase::BackwardRow:
+                        if (s.i < -1) {
+                            finishSearch_(s);
+                            s.phase = Phase::NextSearch;
+                            break;
+                        }
+                        s.c = (s.i < 0) ? -1 : (s.q[s.i] < 4 ? s.q[s.i] : -1);
+                        s.curr.clear();
+                        s.j = 0;
+                        s.phase = Phase::BackwardNext;
+                        break;
+                    case Phase::BackwardNext:
+                        if (s.j >= s.prev.size()) {
+                            if (s.curr.empty()) {
+                                finishSearch_(s);
+                                s.phase = Phase::NextSearch;
+                            } else {
+                                std::swap(s.prev, s.curr);
+                                --s.i;
+                                s.phase = Phase::BackwardRow;
+                            }
+                        } else if (s.c >= 0) {
+                            prefetch_(s.prev[s.j].x[0] - 1, s.prev[s.j].x[2]);
+                            s.phase = Phase::BackwardExtended;
+                            return true;
+                        } else {
+                            backwardStep_(s);
+                            ++s.j;
+                        }
+                        break;
+                    case Phase::BackwardExtended:
+                        bwt_extend(bwt_, &s.prev[s.j], s.ok, 1);
+                        backwardStep_(s);
+                        ++s.j;
+                        s.phase = Phase::BackwardNext;
+                        break;
+                    case Phase::Done:
+                        return false;
+                }
+            }
+        }
+
+        const bwt_t* bwt_;
+        KmerIntervalMap* auxIndex_;
+        int minSeedLen_;
+        int minIntv_;
+        std::vector<ReadState> slots_;
+};
+
+} // namespace bwautils
+
+#endif // __BATCHED_SMEM_SEARCH_HPP__
@@ -0,0 +1,109 @@
+#ifndef BIAS_SAMPLE_RESERVOIR_HPP
+#define BIAS_SAMPLE_RESERVOIR_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+/**
+ * A uniform random sample, of (at most) a fixed size, of the k-mer contexts
+ * of the fragments seen during the first pass over the reads, from which
+ * the read-side sequence-bias distribution (ReadExperiment::readBias) is
+ * trained.  Taking the first N fragments instead would train the model on
+ * whatever the start of the read files holds (e.g. the first tiles of a
+ * flow cell).
+ *
+ * Each fragment is given a random key, and the reservoir keeps the samples
+ * with the smallest keys (i.e. bottom-k sampling), so the reservoirs of
+ * different mapping threads can be merged into a sample of the union of
+ * their fragments.  Each mapping thread fills its own reservoir, with only
+ * a key draw and a comparison per fragment unless the fragment enters the
+ * reservoir; the thread reservoirs are merged into the experiment's
+ * reservoir when the threads finish.  A thread's reservoir may be smaller
+ * than the merged one (see ReadExperiment), in which case the merged sample
+ * is exact unless a single thread held more than its capacity of the final
+ * sample.
+ */
+class BiasSampleReservoir {
+    public:
+        BiasSampleReservoir(size_t capacity = 0, uint64_t seed = 0) :
+            capacity_(capacity), state_(seed) {}
+
+        BiasSampleReservoir(const BiasSampleReservoir&) = delete;
+        BiasSampleReservoir& operator=(const BiasSampleReservoir&) = delete;
+
+        void reset(size_t capacity) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            capacity_ = capacity;
+            samples_.clear();
+        }
+
+        /**
+         * Draw the key of the next fragment; returns true if the fragment
+         * would enter the reservoir, in which case its k-mer context should
+         * be computed and passed to add().
+         */
+        inline bool admit() {
+            key_ = nextKey_();
+            return capacity_ > 0 and (samples_.size() < capacity_ or key_ < samples_.front().key);
+        }
+
+        // Add the k-mer context of the fragment most recently admitted.
+        inline void add(uint32_t kmer) { insert_(Sample{key_, kmer}); }
+
+        /**
+         * Move the samples of other into this reservoir (keeping the
+         * samples with the smallest keys).  Thread-safe with respect to
+         * other calls of merge().
+         */
+        void merge(BiasSampleReservoir& other) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (auto& s : other.samples_) { insert_(s); }
+            other.samples_.clear();
+        }
+
+        template <typename CallbackT>
+        void forEachSample(CallbackT f) const {
+            for (auto& s : samples_) { f(s.kmer); }
+        }
+
+        size_t size() const { return samples_.size(); }
+        size_t capacity() const { return capacity_; }
+        void clear() { samples_.clear(); }
+
+    private:
+        struct Sample {
+            uint64_t key;
+            uint32_t kmer;
+            bool operator<(const Sample& o) const { return key < o.key; }
+        };
+
+        // samples_ is a max-heap on the key
+        inline void insert_(const Sample& s) {
+            if (samples_.size() < capacity_) {
+                samples_.push_back(s);
+                std::push_heap(samples_.begin(), samples_.end());
+            } else if (capacity_ > 0 and s.key < samples_.front().key) {
+                std::pop_heap(samples_.begin(), samples_.end());
+                samples_.back() = s;
+                std::push_heap(samples_.begin(), samples_.end());
+            }
+        }
+
+        // splitmix64
+        inline uint64_t nextKey_() {
+            uint64_t z = (state_ += 0x9E3779B97F4A7C15ULL);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            return z ^ (z >> 31);
+        }
+
+        size_t capacity_;
+        uint64_t state_;
+        uint64_t key_{0};
+        std::vector<Sample> samples_;
+        std::mutex mutex_;
+};
+
+#endif // BIAS_SAMPLE_RESERVOIR_HPP
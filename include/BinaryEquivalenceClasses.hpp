@@ -0,0 +1,257 @@
+#ifndef __BINARY_EQUIVALENCE_CLASSES_HPP__
+#define __BINARY_EQUIVALENCE_CLASSES_HPP__
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/copy.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
+#include <boost/iostreams/device/file.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+
+/**
+ * A compact binary form of the equivalence classes written by --dumpEq
+ * (eq_classes.bin).  The file consists of an (uncompressed)
+ * BinaryEqClassHeader, followed by the body, which is gzip-compressed if
+ * the header's COMPRESSED flag is set.  The body holds
+ *
+ *   for each transcript: varint name length, name
+ *   for each class:      varint label size,
+ *                        the labels, as varint (zig-zag) differences from
+ *                        the previous label of the class (the first from 0),
+ *                        if HAS_WEIGHTS, a float weight for each label,
+ *                        varint count
+ *
+ * The varints are LEB128 (7 bits per byte, least significant group
+ * first); the weights are in native byte order.  Since the labels of a
+ * class are sorted, their differences are small and mostly take a single
+ * byte.
+ *
+ * If the LABEL_IDS flag is set (--eqLabelDict), each class has, in place
+ * of its labels, the varint id of its label in an EqLabelDictionary,
+ * followed by the varint label size.
+ */
+struct BinaryEqClassHeader {
+    static constexpr uint32_t magicNumber = 0x42514553; // "SEQB"
+    static constexpr uint32_t currentVersion = 1;
+    enum Flags : uint32_t { COMPRESSED = 1, HAS_WEIGHTS = 2, LABEL_IDS = 4 };
+
+    uint32_t magic{magicNumber};
+    uint32_t version{currentVersion};
+    uint32_t flags{0};
+    uint32_t reserved{0};
+    uint64_t numTranscripts{0};
+    uint64_t numClasses{0};
+};
+
+/**
+ * Encodes the classes, one at a time, into an in-memory body, and writes
+ * the file once all of them have been added.
+ */
+class BinaryEqClassWriter {
+    public:
+        /**
+         * A compressionLevel of 0 writes the body uncompressed; otherwise,
+         * it is the gzip level with which the body is compressed.
+         */
+        BinaryEqClassWriter(const std::vector<std::string>& names, bool hasWeights,
+                            int compressionLevel = 1, bool labelIds = false) : compressionLevel_(compressionLevel) {
+            header_.numTranscripts = names.size();
+            header_.flags = (hasWeights ? BinaryEqClassHeader::HAS_WEIGHTS : 0) |
+                            ((compressionLevel > 0) ? BinaryEqClassHeader::COMPRESSED : 0) |
+                            (labelIds ? BinaryEqClassHeader::LABEL_IDS : 0);
+            for (auto& n : names) {
+                putVarint_(n.size());
+                body_.insert(body_.end(), n.begin(), n.end());
+            }
+        }
+
+        /**
+         * Add a class with the given (sorted) labels, weights (ignored
+         * unless the file has weights) and count.
+         */
+        template <typename LabelT, typename WeightIt>
+        void add(const LabelT& labels, WeightIt weightIt, uint64_t count) {
+            putVarint_(labels.size());
+            int64_t prev{0};
+            for (auto l : labels) {
+                int64_t diff = static_cast<int64_t>(l) - prev;
+                putVarint_((static_cast<uint64_t>(diff) << 1) ^ static_cast<uint64_t>(diff >> 63));
+                prev = l;
+            }
+            putWeightsAndCount_(labels.size(), weightIt, count);
+        }
+
+        /**
+         * Add a class whose label (of size labelSize) has the given id
+         * (for a writer made with labelIds).
+         */
+        template <typename WeightIt>
+        void addLabelId(uint64_t labelId, size_t labelSize, WeightIt weightIt, uint64_t count) {
+            putVarint_(labelId);
+            putVarint_(labelSize);
+            putWeightsAndCount_(labelSize, weightIt, count);
+        }
+
+        bool write(const boost::filesystem::path& path) {
+            std::ofstream out(path.string(), std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+            if (!out.good()) { return false; }
+            out.write(reinterpret_cast<const char*>(&header_), sizeof(header_));
+            if (header_.flags & BinaryEqClassHeader::COMPRESSED) {
+                boost::iostreams::filtering_ostream bodyOut;
+                bodyOut.push(boost::iostreams::gzip_compressor(
+                            boost::iostreams::gzip_params(compressionLevel_)));
+                bodyOut.push(out);
+                bodyOut.write(body_.data(), body_.size());
+            } else {
+                out.write(body_.data(), body_.size());
+            }
+            return out.good();
+        }
+
+        size_t numClasses() const { return header_.numClasses; }
+
+    private:
+        template <typename WeightIt>
+        void putWeightsAndCount_(size_t size, WeightIt weightIt, uint64_t count) {
+            if (header_.flags & BinaryEqClassHeader::HAS_WEIGHTS) {
+                for (size_t i = 0; i < size; ++i, ++weightIt) {
+                    float w = static_cast<float>(*weightIt);
+                    auto bytes = reinterpret_cast<const char*>(&w);
+                    body_.insert(body_.end(), bytes, bytes + sizeof(w));
+                }
+            }
+            putVarint_(count);
+            ++header_.numClasses;
+        }
+
+        inline void putVarint_(uint64_t v) {
+            while (v >= 0x80) {
+                body_.push_back(static_cast<char>((v & 0x7F) | 0x80));
+                v >>= 7;
+            }
+            body_.push_back(static_cast<char>(v));
+        }
+
+        BinaryEqClassHeader header_;
+        int compressionLevel_;
+        std::vector<char> body_;
+};
+
+/**
+ * Reads a file written by a BinaryEqClassWriter.  The body is loaded (and
+ * decompressed) at once; the classes are then decoded in order by next().
+ */
+class BinaryEqClassReader {
+    public:
+        explicit BinaryEqClassReader(const boost::filesystem::path& path) {
+            std::ifstream in(path.string(), std::ios_base::in | std::ios_base::binary);
+            if (!in.good()) { return; }
+            in.read(reinterpret_cast<char*>(&header_), sizeof(header_));
+            if (!in.good() or header_.magic != BinaryEqClassHeader::magicNumber or
+                header_.version != BinaryEqClassHeader::currentVersion) { return; }
+            try {
+                boost::iostreams::filtering_istream bodyIn;
+                if (header_.flags & BinaryEqClassHeader::COMPRESSED) {
+                    bodyIn.push(boost::iostreams::gzip_decompressor());
+                }
+                bodyIn.push(in);
+                boost::iostreams::copy(bodyIn, boost::iostreams::back_inserter(body_));
+            } catch (std::exception&) {
+                return;
+            }
+            pos_ = 0;
+            uint64_t len{0};
+            for (uint64_t i = 0; i < header_.numTranscripts; ++i) {
+                if (!getVarint_(len) or pos_ + len > body_.size()) { return; }
+                names_.emplace_back(body_.data() + pos_, len);
+                pos_ += len;
+            }
+            good_ = true;
+        }
+
+        bool good() const { return good_; }
+        bool hasWeights() const { return header_.flags & BinaryEqClassHeader::HAS_WEIGHTS; }
+        bool hasLabelIds() const { return header_.flags & BinaryEqClassHeader::LABEL_IDS; }
+        size_t numTranscripts() const { return header_.numTranscripts; }
+        size_t numClasses() const { return header_.numClasses; }
+        const std::vector<std::string>& transcriptNames() const { return names_; }
+
+        /**
+         * Decode the next class into labels, weights (left empty if the
+         * file has no weights) and count; returns false once all of the
+         * classes have been read, or if the file is truncated (or has
+         * label ids rather than labels).
+         */
+        bool next(std::vector<uint32_t>& labels, std::vector<float>& weights, uint64_t& count) {
+            labels.clear();
+            weights.clear();
+            if (hasLabelIds()) { return fail_(); }
+            if (!good_ or classesRead_ >= header_.numClasses) { return false; }
+            uint64_t size{0};
+            if (!getVarint_(size)) { return fail_(); }
+            int64_t prev{0};
+            for (uint64_t i = 0; i < size; ++i) {
+                uint64_t z{0};
+                if (!getVarint_(z)) { return fail_(); }
+                int64_t diff = static_cast<int64_t>(z >> 1) ^ -static_cast<int64_t>(z & 1);
+                prev += diff;
+                labels.push_back(static_cast<uint32_t>(prev));
+            }
+            return getWeightsAndCount_(size, weights, count);
+        }
+
+        /**
+         * As next, for a file with label ids.
+         */
+        bool nextLabelId(uint64_t& labelId, std::vector<float>& weights, uint64_t& count) {
+            weights.clear();
+            if (!hasLabelIds()) { return fail_(); }
+            if (!good_ or classesRead_ >= header_.numClasses) { return false; }
+            uint64_t size{0};
+            if (!getVarint_(labelId) or !getVarint_(size)) { return fail_(); }
+            return getWeightsAndCount_(size, weights, count);
+        }
+
+    private:
+        bool getWeightsAndCount_(uint64_t size, std::vector<float>& weights, uint64_t& count) {
+            if (hasWeights()) {
+                if (pos_ + size * sizeof(float) > body_.size()) { return fail_(); }
+                weights.resize(size);
+                std::memcpy(weights.data(), body_.data() + pos_, size * sizeof(float));
+                pos_ += size * sizeof(float);
+            }
+            if (!getVarint_(count)) { return fail_(); }
+            ++classesRead_;
+            return true;
+        }
+
+        inline bool getVarint_(uint64_t& v) {
+            v = 0;
+            for (uint32_t shift = 0; shift < 64 and pos_ < body_.size(); shift += 7) {
+                uint8_t b = static_cast<uint8_t>(body_[pos_++]);
+                v |= static_cast<uint64_t>(b & 0x7F) << shift;
+                if (!(b & 0x80)) { return true; }
+            }
+            return false;
+        }
+
+        bool fail_() {
+            good_ = false;
+            return false;
+        }
+
+        BinaryEqClassHeader header_;
+        std::vector<char> body_;
+        size_t pos_{0};
+        std::vector<std::string> names_;
+        uint64_t classesRead_{0};
+        bool good_{false};
+};
+
+#endif //__BINARY_EQUIVALENCE_CLASSES_HPP__
@@ -0,0 +1,149 @@
+#ifndef __BINARY_QUANT_HPP__
+#define __BINARY_QUANT_HPP__
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+
+/**
+ * A binary, columnar copy of quant.sf (quant.bin), which can be read by
+ * memory-mapping it rather than by parsing text.  The file consists of
+ *
+ *   BinaryQuantHeader
+ *   uint64_t name offsets (numTranscripts + 1 of them, relative to namesOffset)
+ *   the names, concatenated (without terminators)
+ *   zero padding, up to a multiple of 8 bytes
+ *   double Length[numTranscripts]
+ *   double EffectiveLength[numTranscripts]
+ *   double TPM[numTranscripts]
+ *   double NumReads[numTranscripts]
+ *
+ * in the native byte order, with the transcripts in the order of quant.sf.
+ * Every section (and so every column) starts at a multiple of 8 bytes, so
+ * the columns can be used in place.
+ */
+struct BinaryQuantHeader {
+    static constexpr uint32_t magicNumber = 0x42515353; // "SSQB"
+    static constexpr uint32_t currentVersion = 1;
+    static constexpr uint32_t numColumns = 4;
+    enum Column : uint32_t { LENGTH = 0, EFFECTIVE_LENGTH = 1, TPM = 2, NUM_READS = 3 };
+
+    uint32_t magic{magicNumber};
+    uint32_t version{currentVersion};
+    uint64_t numTranscripts{0};
+    // The offsets (from the start of the file) of the sections
+    uint64_t nameOffsetsOffset{0};
+    uint64_t namesOffset{0};
+    uint64_t columnsOffset{0};
+    // The size of the whole file
+    uint64_t fileSize{0};
+};
+
+/**
+ * Accumulates the rows of quant.sf, and writes them in the binary layout.
+ */
+class BinaryQuantWriter {
+    public:
+        explicit BinaryQuantWriter(size_t numTranscripts = 0) {
+            names_.reserve(numTranscripts);
+            for (auto& c : columns_) { c.reserve(numTranscripts); }
+        }
+
+        void add(const std::string& name, double length, double effLength,
+                 double tpm, double numReads) {
+            names_.push_back(name);
+            columns_[BinaryQuantHeader::LENGTH].push_back(length);
+            columns_[BinaryQuantHeader::EFFECTIVE_LENGTH].push_back(effLength);
+            columns_[BinaryQuantHeader::TPM].push_back(tpm);
+            columns_[BinaryQuantHeader::NUM_READS].push_back(numReads);
+        }
+
+        bool write(const boost::filesystem::path& path) const {
+            BinaryQuantHeader header;
+            uint64_t n = names_.size();
+            header.numTranscripts = n;
+            std::vector<uint64_t> nameOffsets(n + 1, 0);
+            for (size_t i = 0; i < n; ++i) {
+                nameOffsets[i + 1] = nameOffsets[i] + names_[i].size();
+            }
+            header.nameOffsetsOffset = sizeof(BinaryQuantHeader);
+            header.namesOffset = header.nameOffsetsOffset + nameOffsets.size() * sizeof(uint64_t);
+            uint64_t namesEnd = header.namesOffset + nameOffsets.back();
+            header.columnsOffset = (namesEnd + 7) & ~uint64_t(7);
+            header.fileSize = header.columnsOffset + BinaryQuantHeader::numColumns * n * sizeof(double);
+
+            std::ofstream out(path.string(), std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+            if (!out.good()) { return false; }
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            out.write(reinterpret_cast<const char*>(nameOffsets.data()), nameOffsets.size() * sizeof(uint64_t));
+            for (auto& name : names_) { out.write(name.data(), name.size()); }
+            const char padding[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+            out.write(padding, header.columnsOffset - namesEnd);
+            for (auto& c : columns_) {
+                out.write(reinterpret_cast<const char*>(c.data()), c.size() * sizeof(double));
+            }
+            return out.good();
+        }
+
+    private:
+        std::vector<std::string> names_;
+        std::vector<double> columns_[BinaryQuantHeader::numColumns];
+};
+
+/**
+ * Read-only access, through a memory mapping, to a file written by a
+ * BinaryQuantWriter; nothing is copied or parsed.
+ */
+class BinaryQuantReader {
+    public:
+        explicit BinaryQuantReader(const boost::filesystem::path& path) {
+            file_.open(path.string());
+            if (!file_.is_open() or file_.size() < sizeof(BinaryQuantHeader)) { return; }
+            std::memcpy(&header_, file_.data(), sizeof(header_));
+            if (header_.magic != BinaryQuantHeader::magicNumber or
+                header_.version != BinaryQuantHeader::currentVersion or
+                header_.fileSize != file_.size()) { return; }
+            uint64_t n = header_.numTranscripts;
+            if (header_.namesOffset != header_.nameOffsetsOffset + (n + 1) * sizeof(uint64_t) or
+                header_.columnsOffset % 8 != 0 or
+                header_.fileSize != header_.columnsOffset + BinaryQuantHeader::numColumns * n * sizeof(double)) {
+                return;
+            }
+            nameOffsets_ = reinterpret_cast<const uint64_t*>(file_.data() + header_.nameOffsetsOffset);
+            names_ = file_.data() + header_.namesOffset;
+            columns_ = reinterpret_cast<const double*>(file_.data() + header_.columnsOffset);
+            good_ = (header_.namesOffset + nameOffsets_[n] <= header_.columnsOffset);
+        }
+
+        bool good() const { return good_; }
+        size_t numTranscripts() const { return header_.numTranscripts; }
+
+        // The name of transcript i is the nameLength(i) bytes at nameData(i)
+        const char* nameData(size_t i) const { return names_ + nameOffsets_[i]; }
+        size_t nameLength(size_t i) const { return nameOffsets_[i + 1] - nameOffsets_[i]; }
+        std::string name(size_t i) const { return std::string(nameData(i), nameLength(i)); }
+
+        // The columns, each of numTranscripts() values
+        const double* column(BinaryQuantHeader::Column c) const {
+            return columns_ + c * header_.numTranscripts;
+        }
+        const double* lengths() const { return column(BinaryQuantHeader::LENGTH); }
+        const double* effectiveLengths() const { return column(BinaryQuantHeader::EFFECTIVE_LENGTH); }
+        const double* tpms() const { return column(BinaryQuantHeader::TPM); }
+        const double* numReads() const { return column(BinaryQuantHeader::NUM_READS); }
+
+    private:
+        boost::iostreams::mapped_file_source file_;
+        BinaryQuantHeader header_;
+        const uint64_t* nameOffsets_{nullptr};
+        const char* names_{nullptr};
+        const double* columns_{nullptr};
+        bool good_{false};
+};
+
+#endif //__BINARY_QUANT_HPP__
@@ -0,0 +1,143 @@
+#ifndef __BOOTSTRAP_CHECKPOINT_HPP__
+#define __BOOTSTRAP_CHECKPOINT_HPP__
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+
+/**
+ * Records each finished bootstrap replicate, with its index, so that a run
+ * that is interrupted (e.g. on a preempted node) can be resumed without
+ * redrawing them (salmon quant --checkpoint / --resume).  Since every
+ * replicate is drawn from a stream of its own index (see
+ * salmon::utils::streamSeed), a resumed run skips the recorded indices and
+ * draws the others (with the same --seed) exactly as they would have been
+ * drawn.
+ *
+ * The file is a header (magic, version, number of transcripts) followed by
+ * a record per replicate: its index, its number of non-zero abundances, and
+ * a (uint32 transcript, double abundance) pair for each.  Each record is
+ * flushed as it's written; an incomplete last record (from an interrupted
+ * write) is dropped when the file is restored.
+ */
+class BootstrapCheckpoint {
+    public:
+        BootstrapCheckpoint(const boost::filesystem::path& path, size_t numTranscripts,
+                            uint32_t numBootstraps) :
+            path_(path), numTranscripts_(numTranscripts), done_(numBootstraps, 0) {}
+
+        ~BootstrapCheckpoint() {
+            if (file_) { std::fclose(file_); }
+        }
+
+        BootstrapCheckpoint(const BootstrapCheckpoint&) = delete;
+        BootstrapCheckpoint& operator=(const BootstrapCheckpoint&) = delete;
+
+        /**
+         * Read the replicates recorded by an earlier run, passing each to
+         * writeBootstrap and marking its index as done; returns the number
+         * restored.  It must be called (if at all) before open().
+         */
+        size_t restore(std::function<bool(const std::vector<double>&)>& writeBootstrap) {
+            std::FILE* in = std::fopen(path_.string().c_str(), "rb");
+            if (!in) { return 0; }
+            size_t numRestored{0};
+            long validEnd{0};
+            Header h;
+            if (std::fread(&h, sizeof(h), 1, in) == 1 and h.magic == Header::magicNumber and
+                h.version == Header::currentVersion and h.numTranscripts == numTranscripts_) {
+                validEnd = std::ftell(in);
+                std::vector<double> alphas(numTranscripts_, 0.0);
+                uint32_t id{0};
+                uint32_t nnz{0};
+                Entry e;
+                while (std::fread(&id, sizeof(id), 1, in) == 1 and
+                       std::fread(&nnz, sizeof(nnz), 1, in) == 1) {
+                    std::fill(alphas.begin(), alphas.end(), 0.0);
+                    uint32_t i{0};
+                    for (; i < nnz and std::fread(&e, sizeof(e), 1, in) == 1; ++i) {
+                        if (e.transcript < numTranscripts_) { alphas[e.transcript] = e.abundance; }
+                    }
+                    if (i < nnz) { break; }
+                    validEnd = std::ftell(in);
+                    if (id < done_.size() and !done_[id]) {
+                        done_[id] = 1;
+                        writeBootstrap(alphas);
+                        ++numRestored;
+                    }
+                }
+            }
+            std::fclose(in);
+            // Drop the incomplete record, if there is one, so that new
+            // records are appended after the last complete one
+            if (validEnd > 0 and ::truncate(path_.string().c_str(), validEnd) == 0) {
+                haveHeader_ = true;
+            }
+            return numRestored;
+        }
+
+        /** Open the file for the new records; false if it can't be written. */
+        bool open() {
+            file_ = std::fopen(path_.string().c_str(), haveHeader_ ? "ab" : "wb");
+            if (!file_) { return false; }
+            if (!haveHeader_) {
+                Header h;
+                h.numTranscripts = numTranscripts_;
+                std::fwrite(&h, sizeof(h), 1, file_);
+                std::fflush(file_);
+            }
+            return true;
+        }
+
+        /** True if replicate id was restored from the file (and so needn't be drawn). */
+        inline bool isDone(uint32_t id) const { return id < done_.size() and done_[id]; }
+
+        /** The number of replicates restored from the file. */
+        size_t numRestored() const { return std::count(done_.begin(), done_.end(), 1); }
+
+        /** Record the (final) abundances of replicate id. */
+        void record(uint32_t id, const std::vector<double>& alphas) {
+            if (!file_) { return; }
+            std::vector<Entry> entries;
+            for (size_t i = 0; i < alphas.size(); ++i) {
+                if (alphas[i] != 0.0) { entries.push_back(Entry{static_cast<uint32_t>(i), alphas[i]}); }
+            }
+            std::lock_guard<std::mutex> l(mutex_);
+            uint32_t nnz = static_cast<uint32_t>(entries.size());
+            std::fwrite(&id, sizeof(id), 1, file_);
+            std::fwrite(&nnz, sizeof(nnz), 1, file_);
+            std::fwrite(entries.data(), sizeof(Entry), entries.size(), file_);
+            std::fflush(file_);
+        }
+
+    private:
+        struct Header {
+            static constexpr uint32_t magicNumber = 0x4b434253; // "SBCK"
+            static constexpr uint32_t currentVersion = 1;
+            uint32_t magic{magicNumber};
+            uint32_t version{currentVersion};
+            uint64_t numTranscripts{0};
+        };
+#pragma pack(push, 1)
+        struct Entry {
+            uint32_t transcript;
+            double abundance;
+        };
+#pragma pack(pop)
+
+        boost::filesystem::path path_;
+        size_t numTranscripts_;
+        std::vector<uint8_t> done_;
+        bool haveHeader_{false};
+        std::FILE* file_{nullptr};
+        std::mutex mutex_;
+};
+
+#endif // __BOOTSTRAP_CHECKPOINT_HPP__
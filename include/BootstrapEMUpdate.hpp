@@ -0,0 +1,232 @@
+#ifndef __BOOTSTRAP_EM_UPDATE_HPP__
+#define __BOOTSTRAP_EM_UPDATE_HPP__
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "EquivalenceClassArena.hpp"
+#include "SalmonUtils.hpp"
+
+/**
+ * The serial EM updates with which the bootstrap replicates (and the
+ * rounds of salmon::optimizer::emRound) are computed, one replicate at a
+ * time or R at once; kept apart from CollapsedEMOptimizer.cpp so that the
+ * two can be checked against each other (tests/BootstrapEMTests.cpp).
+ */
+namespace salmon {
+namespace optimizer {
+
+// Below this, the total weight of a class is taken as 0 (intelligently
+// chosen value adopted from
+// https://github.com/pachterlab/kallisto/blob/master/src/EMAlgorithm.h#L18)
+constexpr double minEQClassWeight = std::numeric_limits<double>::denorm_min();
+
+/**
+ * The classes of an arena split by the size of their labels.  A class of a
+ * single transcript adds exactly its count to that transcript in every
+ * round of the EM or VBEM, whatever the abundances, so the counts of these
+ * classes are summed per transcript once (by setCounts, for each set of
+ * counts), added to the output of each round as a dense vector, and the
+ * rounds only iterate over the classes of several transcripts.  If
+ * onlyValid, the classes marked invalid are in neither list.
+ */
+struct SingletonClasses {
+    SingletonClasses(const EquivalenceClassArena& eqArena, bool onlyValid) {
+        for (size_t eqID = 0; eqID < eqArena.numClasses(); ++eqID) {
+            if (onlyValid and !eqArena.valid[eqID]) { continue; }
+            if (eqArena.classSize(eqID) > 1) {
+                multiClasses.push_back(eqID);
+            } else {
+                singleClasses.push_back(eqID);
+            }
+        }
+    }
+
+    /**
+     * Sum the counts of the single-transcript classes per transcript, for R
+     * sets of counts interleaved by class (counts[eqID * R + r]); the sums
+     * are interleaved by transcript (uniqueCounts[tid * R + r]).
+     */
+    void setCounts(const EquivalenceClassArena& eqArena, const uint64_t* counts,
+                   size_t numTxps, size_t R = 1) {
+        uniqueCounts.assign(numTxps * R, 0.0);
+        for (auto eqID : singleClasses) {
+            double* u = uniqueCounts.data() + eqArena.labels[eqArena.offsets[eqID]] * R;
+            const uint64_t* c = counts + eqID * R;
+            for (size_t r = 0; r < R; ++r) { u[r] += c[r]; }
+        }
+    }
+
+    /**
+     * Index the entries of the multi-transcript classes by transcript, each
+     * transcript's in the order of the arena, so that their contributions
+     * to an EM update can be summed in a fixed order (--deterministic).
+     */
+    void indexEntries(const EquivalenceClassArena& eqArena, size_t numTxps) {
+        txpEntryOffsets.assign(numTxps + 1, 0);
+        for (auto eqID : multiClasses) {
+            for (size_t i = eqArena.offsets[eqID]; i < eqArena.offsets[eqID + 1]; ++i) {
+                ++txpEntryOffsets[eqArena.labels[i] + 1];
+            }
+        }
+        for (size_t t = 0; t < numTxps; ++t) { txpEntryOffsets[t + 1] += txpEntryOffsets[t]; }
+        txpEntries.resize(txpEntryOffsets.back());
+        std::vector<uint64_t> next(txpEntryOffsets.begin(), txpEntryOffsets.end() - 1);
+        for (auto eqID : multiClasses) {
+            for (size_t i = eqArena.offsets[eqID]; i < eqArena.offsets[eqID + 1]; ++i) {
+                txpEntries[next[eqArena.labels[i]]++] = i;
+            }
+        }
+    }
+
+    std::vector<uint32_t> multiClasses;
+    std::vector<uint32_t> singleClasses;
+    std::vector<double> uniqueCounts;
+    // The entries of transcript t are txpEntries[txpEntryOffsets[t] .. txpEntryOffsets[t + 1]) (if indexed)
+    std::vector<uint64_t> txpEntryOffsets;
+    std::vector<uint64_t> txpEntries;
+};
+
+/**
+ * Single-threaded EM-update routine for use in bootstrapping.  The
+ * classes are read directly from the (flat) equivalence class arena;
+ * only the counts differ between bootstrap samples.
+ */
+template <typename WeightT, typename VecT>
+void EMUpdate_(
+        const EquivalenceClassArena& eqArena,
+        const WeightT* auxs,
+        const std::vector<uint64_t>& txpGroupCounts,
+        const SingletonClasses& split,
+        const VecT& alphaIn,
+        VecT& alphaOut) {
+
+    assert(alphaIn.size() == alphaOut.size());
+
+    const uint64_t* offsets = eqArena.offsets.data();
+    const uint32_t* labels = eqArena.labels.data();
+
+    // The single-transcript classes give their transcripts their full counts
+    const double* uniqueCounts = split.uniqueCounts.data();
+    for (size_t tid = 0; tid < alphaOut.size(); ++tid) {
+        salmon::utils::incLoop(alphaOut[tid], uniqueCounts[tid]);
+    }
+
+    for (auto eqID : split.multiClasses) {
+        uint64_t count = txpGroupCounts[eqID];
+        // classes that were not sampled (or are invalid) contribute nothing
+        if (count == 0) { continue; }
+        // for each transcript in this class
+        size_t start = offsets[eqID];
+        size_t end = offsets[eqID + 1];
+
+        double denom = 0.0;
+        for (size_t i = start; i < end; ++i) {
+            auto tid = labels[i];
+            auto aux = auxs[i];
+            double v = alphaIn[tid] * aux;
+            denom += v;
+        }
+
+        if (denom <= minEQClassWeight) {
+            // tgroup.setValid(false);
+        } else {
+            double invDenom = count / denom;
+            for (size_t i = start; i < end; ++i) {
+                auto tid = labels[i];
+                auto aux = auxs[i];
+                double v = alphaIn[tid] * aux;
+                if (!std::isnan(v)) {
+                    salmon::utils::incLoop(alphaOut[tid], v * invDenom);
+                }
+            }
+        }
+    }
+}
+
+// Read the class weights at the precision in which the arena stores them
+template <typename VecT>
+void EMUpdate_(
+        const EquivalenceClassArena& eqArena,
+        const std::vector<uint64_t>& txpGroupCounts,
+        const SingletonClasses& split,
+        const VecT& alphaIn,
+        VecT& alphaOut) {
+    if (eqArena.hasSinglePrecisionWeights()) {
+        EMUpdate_(eqArena, eqArena.singlePrecisionWeights.data(), txpGroupCounts,
+                  split, alphaIn, alphaOut);
+    } else {
+        EMUpdate_(eqArena, eqArena.combinedWeights.data(), txpGroupCounts,
+                  split, alphaIn, alphaOut);
+    }
+}
+
+/**
+ * Single-threaded EM update of R bootstrap replicates at once.  The counts
+ * of the replicates are interleaved by class (counts[eqID * R + r]), and
+ * their abundances by transcript (alphaIn[tid * R + r]), so that each class
+ * label and weight is loaded once per round for all R replicates, and the
+ * inner loops over the replicates are contiguous.
+ */
+template <typename WeightT>
+void batchEMUpdate_(
+        const EquivalenceClassArena& eqArena,
+        const WeightT* auxs,
+        const std::vector<uint64_t>& counts,
+        const SingletonClasses& split,
+        size_t R,
+        const std::vector<double>& alphaIn,
+        std::vector<double>& alphaOut,
+        std::vector<double>& denoms) {
+
+    assert(alphaIn.size() == alphaOut.size());
+
+    const uint64_t* offsets = eqArena.offsets.data();
+    const uint32_t* labels = eqArena.labels.data();
+    const double* in = alphaIn.data();
+    double* out = alphaOut.data();
+    double* denom = denoms.data();
+
+    // The single-transcript classes give their transcripts their full counts
+    // (split.uniqueCounts is interleaved as alphaOut)
+    const double* uniqueCounts = split.uniqueCounts.data();
+    for (size_t j = 0; j < alphaOut.size(); ++j) { out[j] += uniqueCounts[j]; }
+
+    for (auto eqID : split.multiClasses) {
+        const uint64_t* classCounts = counts.data() + eqID * R;
+        // classes that were not sampled (or are invalid) in any replicate
+        // contribute nothing
+        uint64_t totalCount{0};
+        for (size_t r = 0; r < R; ++r) { totalCount += classCounts[r]; }
+        if (totalCount == 0) { continue; }
+
+        size_t start = offsets[eqID];
+        size_t end = offsets[eqID + 1];
+        std::fill(denom, denom + R, 0.0);
+        for (size_t i = start; i < end; ++i) {
+            const double* a = in + labels[i] * R;
+            double aux = auxs[i];
+            for (size_t r = 0; r < R; ++r) { denom[r] += a[r] * aux; }
+        }
+        // The per-replicate scale of the contributions
+        for (size_t r = 0; r < R; ++r) {
+            denom[r] = (denom[r] > minEQClassWeight) ? classCounts[r] / denom[r] : 0.0;
+        }
+        for (size_t i = start; i < end; ++i) {
+            size_t offset = labels[i] * R;
+            const double* a = in + offset;
+            double* o = out + offset;
+            double aux = auxs[i];
+            for (size_t r = 0; r < R; ++r) { o[r] += a[r] * aux * denom[r]; }
+        }
+    }
+}
+
+} // namespace optimizer
+} // namespace salmon
+
+#endif // __BOOTSTRAP_EM_UPDATE_HPP__
@@ -0,0 +1,115 @@
+#ifndef __CRAM_REFERENCE_HPP__
+#define __CRAM_REFERENCE_HPP__
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+
+/**
+ * The reference from which the records of CRAM input are decoded (in
+ * alignment mode), made from the transcript sequences as they're loaded
+ * from --targets, so that io_lib never has to look them up (by MD5, through
+ * REF_PATH / REF_CACHE, or remotely) container by container.  io_lib reads
+ * references from an indexed FASTA file, so the sequences are written to
+ * one, with each sequence on a single line; since the offsets of the
+ * sequences then follow from the names and lengths of the transcripts (of
+ * the alignment header), the file and its index are laid out up front, and
+ * each sequence is written at its offset by whichever thread loads it.
+ * The sequences are written exactly as they appear in --targets, since the
+ * records are encoded as differences from them.  The files are removed
+ * when the reference is destroyed.
+ */
+class CRAMReference {
+    public:
+        CRAMReference(const boost::filesystem::path& path,
+                      const std::vector<std::string>& names,
+                      const std::vector<uint64_t>& lengths) :
+            path_(path), lengths_(lengths), offsets_(names.size(), 0), added_(0) {
+            std::FILE* fai = std::fopen(faiPath_().c_str(), "w");
+            fd_ = ::open(path_.string().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fai == nullptr or fd_ < 0) {
+                if (fai) { std::fclose(fai); }
+                return;
+            }
+            uint64_t offset{0};
+            std::string header;
+            bool good{true};
+            for (size_t i = 0; i < names.size() and good; ++i) {
+                header = ">" + names[i] + "\n";
+                good = (::pwrite(fd_, header.data(), header.size(), offset) ==
+                        static_cast<ssize_t>(header.size()));
+                offset += header.size();
+                offsets_[i] = offset;
+                // name, length, offset, bases per line and bytes per line
+                std::fprintf(fai, "%s\t%llu\t%llu\t%llu\t%llu\n", names[i].c_str(),
+                             static_cast<unsigned long long>(lengths[i]),
+                             static_cast<unsigned long long>(offset),
+                             static_cast<unsigned long long>(lengths[i]),
+                             static_cast<unsigned long long>(lengths[i] + 1));
+                offset += lengths[i];
+                good = good and (::pwrite(fd_, "\n", 1, offset) == 1);
+                offset += 1;
+            }
+            good = (std::fclose(fai) == 0) and good;
+            if (!good) {
+                ::close(fd_);
+                fd_ = -1;
+            }
+        }
+
+        CRAMReference(const CRAMReference&) = delete;
+        CRAMReference& operator=(const CRAMReference&) = delete;
+
+        ~CRAMReference() {
+            if (fd_ >= 0) { ::close(fd_); }
+            boost::system::error_code ec;
+            boost::filesystem::remove(path_, ec);
+            boost::filesystem::remove(faiPath_(), ec);
+        }
+
+        /**
+         * Write the sequence of transcript id; it's ignored (and the
+         * reference is unusable) if its length isn't that of the header.
+         * Safe to call from several threads at once.
+         */
+        void add(size_t id, const std::string& seq) {
+            if (fd_ < 0 or id >= lengths_.size() or seq.size() != lengths_[id]) { return; }
+            if (::pwrite(fd_, seq.data(), seq.size(), offsets_[id]) == static_cast<ssize_t>(seq.size())) {
+                ++added_;
+            }
+        }
+
+        /**
+         * Close the file; true if every transcript's sequence was written
+         * (if not, io_lib falls back on its own lookups).
+         */
+        bool finish() {
+            if (fd_ < 0) { return false; }
+            bool closed = (::close(fd_) == 0);
+            fd_ = -1;
+            complete_ = closed and (added_ == lengths_.size());
+            return complete_;
+        }
+
+        bool complete() const { return complete_; }
+        const boost::filesystem::path& path() const { return path_; }
+
+    private:
+        std::string faiPath_() const { return path_.string() + ".fai"; }
+
+        boost::filesystem::path path_;
+        std::vector<uint64_t> lengths_;
+        std::vector<uint64_t> offsets_;
+        std::atomic<size_t> added_;
+        int fd_{-1};
+        bool complete_{false};
+};
+
+#endif // __CRAM_REFERENCE_HPP__
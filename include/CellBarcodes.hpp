@@ -0,0 +1,141 @@
+#ifndef __CELL_BARCODES_HPP__
+#define __CELL_BARCODES_HPP__
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/functional/hash.hpp>
+
+namespace salmon {
+namespace cells {
+
+/**
+ * The position of a tag (the cell barcode or the UMI) in the barcode read:
+ * bases [start, end] (1-based, inclusive), as given on the command line
+ * ("1-16").  Tags are at most 32 bases, so that they pack into a uint64_t.
+ */
+struct TagGeometry {
+    uint32_t start{0};
+    uint32_t end{0};
+
+    uint32_t length() const { return end - start + 1; }
+
+    /**
+     * Parse a "START-END" range; returns false (with a message in err) if
+     * it isn't one.
+     */
+    bool parse(const std::string& spec, std::string& err) {
+        auto dash = spec.find('-');
+        try {
+            if (dash == std::string::npos) { throw std::invalid_argument(spec); }
+            start = static_cast<uint32_t>(std::stoul(spec.substr(0, dash)));
+            end = static_cast<uint32_t>(std::stoul(spec.substr(dash + 1)));
+        } catch (std::exception&) {
+            err = "\"" + spec + "\" is not a range START-END of read positions";
+            return false;
+        }
+        if (start == 0 or end < start) {
+            err = "\"" + spec + "\" is not a range START-END (with 1 <= START <= END) of read positions";
+            return false;
+        }
+        if (length() > 32) {
+            err = "\"" + spec + "\" spans more than 32 bases";
+            return false;
+        }
+        return true;
+    }
+
+    bool overlaps(const TagGeometry& o) const { return start <= o.end and o.start <= end; }
+};
+
+/**
+ * Pack the bases of read at geometry g into code, 2 bits per base.  Returns
+ * false if the read is too short, or the tag holds a base other than
+ * A, C, G or T (whose reads can't be assigned).
+ */
+inline bool encodeTag(const std::string& read, const TagGeometry& g, uint64_t& code) {
+    if (read.size() < g.end) { return false; }
+    code = 0;
+    for (size_t i = g.start - 1; i < g.end; ++i) {
+        uint64_t c;
+        switch (read[i]) {
+            case 'A': case 'a': c = 0; break;
+            case 'C': case 'c': c = 1; break;
+            case 'G': case 'g': c = 2; break;
+            case 'T': case 't': c = 3; break;
+            default: return false;
+        }
+        code = (code << 2) | c;
+    }
+    return true;
+}
+
+inline std::string decodeTag(uint64_t code, uint32_t length) {
+    static const char bases[] = {'A', 'C', 'G', 'T'};
+    std::string tag(length, 'A');
+    for (size_t i = 0; i < length; ++i) {
+        tag[length - 1 - i] = bases[code & 0x3];
+        code >>= 2;
+    }
+    return tag;
+}
+
+/**
+ * An equivalence class of one cell: the cell's (encoded) barcode and the
+ * sorted transcripts of the class.
+ */
+struct CellClassKey {
+    uint64_t cell;
+    std::vector<uint32_t> label;
+
+    bool operator==(const CellClassKey& o) const { return cell == o.cell and label == o.label; }
+};
+
+struct CellClassKeyHasher {
+    size_t operator()(const CellClassKey& k) const {
+        size_t seed = boost::hash_range(k.label.begin(), k.label.end());
+        boost::hash_combine(seed, k.cell);
+        return seed;
+    }
+};
+
+/**
+ * The number of fragments in each (cell, equivalence class).  Each mapping
+ * thread fills a table of its own, without synchronization, and the tables
+ * are merged once mapping is done.
+ */
+class CellClassTable {
+    public:
+        void add(uint64_t cell, const std::vector<uint32_t>& label) {
+            key_.cell = cell;
+            key_.label = label;
+            ++counts_[key_];
+        }
+
+        void merge(CellClassTable& other) {
+            if (counts_.empty()) {
+                counts_.swap(other.counts_);
+                return;
+            }
+            for (auto& kv : other.counts_) { counts_[kv.first] += kv.second; }
+            other.counts_.clear();
+        }
+
+        size_t size() const { return counts_.size(); }
+
+        const std::unordered_map<CellClassKey, uint64_t, CellClassKeyHasher>& counts() const { return counts_; }
+
+    private:
+        std::unordered_map<CellClassKey, uint64_t, CellClassKeyHasher> counts_;
+        // Reused by add(), so that the label isn't allocated for classes already in the table
+        CellClassKey key_;
+};
+
+} // namespace cells
+} // namespace salmon
+
+#endif // __CELL_BARCODES_HPP__
@@ -2,156 +2,198 @@
 #define __CLUSTER_FOREST_HPP__
 
 
-#include <boost/pending/disjoint_sets.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "tbb/atomic.h"
 
 #include "Transcript.hpp"
 #include "TranscriptCluster.hpp"
-#include "SalmonSpinLock.hpp"
-
-#include <unordered_set>
-#include <vector>
-#include <mutex>
-
-/** A forest of transcript clusters */
+#include "SalmonMath.hpp"
+#include "SalmonUtils.hpp"
+
+/**
+ * A forest of transcript clusters: the transcripts linked by the
+ * multi-mapping fragments, and the number and mass of the fragments of
+ * each cluster.
+ *
+ * Every thread merges and updates the clusters for each of its fragments,
+ * so the forest takes no locks.  The disjoint sets are a lock-free
+ * union-find (a CAS on the parent of a root to link it, and path halving
+ * in find).  Rather than keeping the count and mass of each cluster at its
+ * root, which would have to be merged when the root is linked under
+ * another, the count and mass of a fragment are added to the transcript
+ * through which it was assigned to the cluster; those of a cluster are the
+ * sums over its members, which getClusters computes once the fragments
+ * have been processed.
+ */
 class ClusterForest {
 public:
     ClusterForest(size_t numTranscripts, std::vector<Transcript>& refs) :
-        rank_(std::vector<size_t>(numTranscripts, 0)),
-        parent_(std::vector<size_t>(numTranscripts, 0)),
-        disjointSets_(&rank_[0], &parent_[0]),
+        numTranscripts_(numTranscripts),
+        parent_(new std::atomic<uint32_t>[numTranscripts]),
+        counts_(new std::atomic<uint64_t>[numTranscripts]),
+        logMasses_(new tbb::atomic<double>[numTranscripts]),
         clusters_(std::vector<TranscriptCluster>(numTranscripts))
     {
         // Initially make a unique set for each transcript
         for(size_t tnum = 0; tnum < numTranscripts; ++tnum) {
-            disjointSets_.make_set(tnum);
-            clusters_[tnum].members_.push_front(tnum);
-            clusters_[tnum].addMass(refs[tnum].mass());
+            parent_[tnum].store(static_cast<uint32_t>(tnum), std::memory_order_relaxed);
+            counts_[tnum].store(0, std::memory_order_relaxed);
+            logMasses_[tnum].store(refs[tnum].mass());
         }
     }
 
     template <typename FragT>
     void mergeClusters(typename std::vector<FragT>::iterator start,
                        typename std::vector<FragT>::iterator finish) {
-        // Use a lock_guard to ensure this is a locked (and exception-safe) operation
-#if defined __APPLE__
-        spin_lock::scoped_lock sl(clusterMutex_);
-#else
-        std::lock_guard<std::mutex> lock(clusterMutex_);
-#endif
-        size_t firstCluster, otherCluster;
         auto firstTranscriptID = start->transcriptID();
         ++start;
-
-        for (auto it = start; it != finish; ++it) {
-            firstCluster = disjointSets_.find_set(firstTranscriptID);
-            otherCluster = disjointSets_.find_set(it->transcriptID());
-            if (otherCluster != firstCluster)  {
-                disjointSets_.link(firstCluster, otherCluster);
-                auto parentClust = disjointSets_.find_set(it->transcriptID());
-                auto childClust = (parentClust == firstCluster)  ? otherCluster : firstCluster;
-                if (parentClust == firstCluster or parentClust == otherCluster) {
-                    clusters_[parentClust].merge(clusters_[childClust]);
-                    clusters_[childClust].deactivate();
-                } else { std::cerr << "DANGER\n"; }
-            }
-        }
+        for (auto it = start; it != finish; ++it) { unite(firstTranscriptID, it->transcriptID()); }
     }
 
 
     template <typename FragT>
     void mergeClusters(typename std::vector<FragT*>::iterator start,
                        typename std::vector<FragT*>::iterator finish) {
-        // Use a lock_guard to ensure this is a locked (and exception-safe) operation
-#if defined __APPLE__
-        spin_lock::scoped_lock sl(clusterMutex_);
-#else
-        std::lock_guard<std::mutex> lock(clusterMutex_);
-#endif
-
         auto firstTranscriptID = (*start)->transcriptID();
-        decltype(firstTranscriptID) firstCluster, otherCluster;
         ++start;
+        for (auto it = start; it != finish; ++it) { unite(firstTranscriptID, (*it)->transcriptID()); }
+    }
 
-        for (auto it = start; it != finish; ++it) {
-            firstCluster = disjointSets_.find_set(firstTranscriptID);
-            otherCluster = disjointSets_.find_set((*it)->transcriptID());
-            if (otherCluster != firstCluster)  {
-                disjointSets_.link(firstCluster, otherCluster);
-                auto parentClust = disjointSets_.find_set((*it)->transcriptID());
-                auto childClust = (parentClust == firstCluster)  ? otherCluster : firstCluster;
-                if (parentClust == firstCluster or parentClust == otherCluster) {
-                    clusters_[parentClust].merge(clusters_[childClust]);
-                    clusters_[childClust].deactivate();
-                } else { std::cerr << "DANGER\n"; }
-            }
+    void updateCluster(size_t memberTranscript, size_t newCount, double logNewMass, bool updateCount) {
+        if (updateCount) {
+            counts_[memberTranscript].fetch_add(newCount, std::memory_order_relaxed);
         }
+        salmon::utils::incLoopLog(logMasses_[memberTranscript], logNewMass);
     }
 
-
-    /*
-    void mergeClusters(AlignmentBatch<ReadPair>::iterator start, AlignmentBatch<ReadPair>::iterator finish) {
-        // Use a lock_guard to ensure this is a locked (and exception-safe) operation
-        std::lock_guard<std::mutex> lock(clusterMutex_);
-        size_t firstCluster, otherCluster;
-        auto firstTranscriptID = start->read1->core.tid;
-        ++start;
-
-        for (auto it = start; it != finish; ++it) {
-            firstCluster = disjointSets_.find_set(firstTranscriptID);
-            otherCluster = disjointSets_.find_set(it->read1->core.tid);
-            if (otherCluster != firstCluster)  {
-                disjointSets_.link(firstCluster, otherCluster);
-                auto parentClust = disjointSets_.find_set(it->read1->core.tid);
-                auto childClust = (parentClust == firstCluster)  ? otherCluster : firstCluster;
-                if (parentClust == firstCluster or parentClust == otherCluster) {
-                    clusters_[parentClust].merge(clusters_[childClust]);
-                    clusters_[childClust].deactivate();
-                } else { std::cerr << "DANGER\n"; }
-            }
+    /**
+     * The representative of the cluster of transcript x.  Concurrent
+     * unions may link the returned root under another before this returns.
+     */
+    inline uint32_t find(uint32_t x) {
+        while (true) {
+            uint32_t p = parent_[x].load(std::memory_order_acquire);
+            if (p == x) { return x; }
+            uint32_t gp = parent_[p].load(std::memory_order_acquire);
+            // Path halving; if this fails, another thread has changed x's parent
+            if (p != gp) { parent_[x].compare_exchange_weak(p, gp, std::memory_order_release, std::memory_order_relaxed); }
+            x = gp;
         }
     }
-*/
-    void updateCluster(size_t memberTranscript, size_t newCount, double logNewMass, bool updateCount) {
-        // Use a lock_guard to ensure this is a locked (and exception-safe) operation
-#if defined __APPLE__
-        spin_lock::scoped_lock sl(clusterMutex_);
-#else
-        std::lock_guard<std::mutex> lock(clusterMutex_);
-#endif
-        auto clusterID = disjointSets_.find_set(memberTranscript);
-        auto& cluster = clusters_[clusterID];
-        if (updateCount) {
-            cluster.incrementCount(newCount);
+
+    /**
+     * Merge the clusters of transcripts a and b.  The root with the smaller
+     * index is linked under the other, so that the links can never form
+     * a cycle.
+     */
+    void unite(uint32_t a, uint32_t b) {
+        while (true) {
+            uint32_t ra = find(a);
+            uint32_t rb = find(b);
+            if (ra == rb) { return; }
+            if (ra > rb) { std::swap(ra, rb); }
+            uint32_t expected = ra;
+            // Succeeds only if ra is still a root
+            if (parent_[ra].compare_exchange_strong(expected, rb, std::memory_order_acq_rel)) { return; }
         }
-        cluster.addMass(logNewMass);
     }
 
+    /**
+     * The merges and updates of one thread during a mini-batch, applied to
+     * the forest at once by flush() (--threadLocalTranscriptUpdates).  The
+     * repeated merges of a mini-batch (e.g. of the fragments of a highly
+     * expressed gene family) are applied once, and the updates are summed per
+     * transcript; all of the updates of a mini-batch share its forgetting
+     * mass, so a transcript's k updates add log(k) + logForgettingMass.
+     */
+    class LocalBatch {
+        public:
+            explicit LocalBatch(ClusterForest& forest) : forest_(&forest) {}
+
+            template <typename IterT, typename GetIDT>
+            void mergeClusters(IterT start, IterT finish, GetIDT getID) {
+                auto first = static_cast<uint32_t>(getID(*start));
+                for (++start; start != finish; ++start) {
+                    auto other = static_cast<uint32_t>(getID(*start));
+                    if (other == first) { continue; }
+                    auto edge = std::make_pair(std::min(first, other), std::max(first, other));
+                    if (edges_.empty() or edges_.back() != edge) { edges_.push_back(edge); }
+                }
+            }
+
+            void updateCluster(size_t memberTranscript, size_t newCount, bool updateCount) {
+                updates_.emplace_back(static_cast<uint32_t>(memberTranscript),
+                                      updateCount ? static_cast<uint32_t>(newCount) : 0);
+            }
+
+            void flush(double logForgettingMass) {
+                std::sort(edges_.begin(), edges_.end());
+                edges_.erase(std::unique(edges_.begin(), edges_.end()), edges_.end());
+                for (auto& e : edges_) { forest_->unite(e.first, e.second); }
+                edges_.clear();
+
+                std::sort(updates_.begin(), updates_.end());
+                for (size_t i = 0; i < updates_.size();) {
+                    size_t j = i;
+                    uint64_t count{0};
+                    while (j < updates_.size() and updates_[j].first == updates_[i].first) {
+                        count += updates_[j].second;
+                        ++j;
+                    }
+                    double logMass = logForgettingMass + std::log(static_cast<double>(j - i));
+                    forest_->updateCluster(updates_[i].first, count, logMass, count > 0);
+                    i = j;
+                }
+                updates_.clear();
+            }
+
+        private:
+            ClusterForest* forest_;
+            std::vector<std::pair<uint32_t, uint32_t>> edges_;
+            // (transcript, count) of each update
+            std::vector<std::pair<uint32_t, uint32_t>> updates_;
+    };
+
+    /**
+     * The clusters, with their members, counts and masses.  This must not
+     * be called while the clusters are being merged or updated.
+     */
     std::vector<TranscriptCluster*> getClusters() {
         std::vector<TranscriptCluster*> clusters;
-        std::unordered_set<size_t> observedReps;
-        for (size_t i = 0; i < clusters_.size(); ++i) {
-            auto rep = disjointSets_.find_set(i);
-            if (observedReps.find(rep) == observedReps.end()) {
-                if (!clusters_[rep].isActive()) {
-                    std::cerr << "returning a non-active cluster!\n";
-                    std::exit(1);
-                }
-                clusters.push_back(&clusters_[rep]);
-                observedReps.insert(rep);
+        for (size_t i = 0; i < numTranscripts_; ++i) {
+            auto& c = clusters_[i];
+            c.members_.clear();
+            c.count_ = 0;
+            c.logMass_ = salmon::math::LOG_0;
+            c.active_ = false;
+        }
+        for (size_t i = 0; i < numTranscripts_; ++i) {
+            auto rep = find(static_cast<uint32_t>(i));
+            auto& c = clusters_[rep];
+            if (!c.active_) {
+                c.active_ = true;
+                clusters.push_back(&c);
             }
+            c.members_.push_back(i);
+            c.count_ += static_cast<double>(counts_[i].load(std::memory_order_relaxed));
+            c.logMass_ = salmon::math::logAdd(c.logMass_, logMasses_[i].load());
         }
         return clusters;
     }
 private:
-    std::vector<size_t> rank_;
-    std::vector<size_t> parent_;
-    boost::disjoint_sets<size_t*, size_t*> disjointSets_;
+    size_t numTranscripts_;
+    std::unique_ptr<std::atomic<uint32_t>[]> parent_;
+    // The count and (log) mass of the fragments assigned through each transcript
+    std::unique_ptr<std::atomic<uint64_t>[]> counts_;
+    std::unique_ptr<tbb::atomic<double>[]> logMasses_;
     std::vector<TranscriptCluster> clusters_;
-    #if defined __APPLE__
-    spin_lock clusterMutex_;
-    #else
-    std::mutex clusterMutex_;
-    #endif
 };
 
 #endif // __CLUSTER_FOREST_HPP__
@@ -5,15 +5,16 @@
 #include <functional>
 
 #include "tbb/atomic.h"
-#include "tbb/task_scheduler_init.h"
 
 #include "ReadExperiment.hpp"
 #include "SalmonOpts.hpp"
+#include "Communicator.hpp"
 
 #include "cuckoohash_map.hh"
 #include "Eigen/Dense"
 
 class BootstrapWriter;
+class EquivalenceClassArena;
 
 class CollapsedEMOptimizer {
     public:
@@ -34,6 +35,79 @@ class CollapsedEMOptimizer {
                 std::function<bool(const std::vector<double>&)>& writeBootstrap,
                 double relDiffTolerance,
                 uint32_t maxIter);
+
+        /**
+         * The EM (--geneLevelOnly) over classes whose labels are genes
+         * (see EquivalenceClassBuilder::projectToGenes), geneIDs[t] being
+         * the gene of transcript t.  The effective length of each gene is
+         * the mean of those of its transcripts, weighted by their online
+         * estimates.  The estimate of each gene is then split among its
+         * transcripts in the same proportions, so the estimates of the
+         * transcripts only mean something when summed to their genes.
+         */
+        bool optimizeGenes(ReadExperiment& readExp,
+                           SalmonOpts& sopt,
+                           const std::vector<uint32_t>& geneIDs,
+                           const std::vector<std::string>& geneNames,
+                           double tolerance = 0.01,
+                           uint32_t maxIter = 1000);
+
+    private:
+        // The body of optimize, run in the shared task arena
+        template <typename ExpT>
+        bool optimize_(ExpT& readExp,
+                       SalmonOpts& sopt,
+                       double tolerance,
+                       uint32_t maxIter);
 };
 
+namespace salmon {
+namespace optimizer {
+
+/**
+ * A single (serial) round of the EM and VBEM updates with which the
+ * bootstrap and Gibbs replicates are estimated, given the count of each
+ * class; these are exposed so that the kernels can be benchmarked
+ * (salmon_bench).
+ */
+void emRound(const EquivalenceClassArena& eqArena,
+             const std::vector<uint64_t>& counts,
+             std::vector<Transcript>& transcripts,
+             const std::vector<double>& alphaIn,
+             std::vector<double>& alphaOut);
+
+void vbemRound(const EquivalenceClassArena& eqArena,
+               const std::vector<uint64_t>& counts,
+               std::vector<Transcript>& transcripts,
+               double priorAlpha,
+               double totLen,
+               const std::vector<double>& alphaIn,
+               std::vector<double>& alphaOut,
+               std::vector<double>& expTheta);
+
+/**
+ * The EM (or, if useVBEM, the VBEM) over equivalence classes that are
+ * partitioned across the ranks of comm: each rank holds only its own
+ * classes (localArena, with their counts), and the full abundance vector.
+ * Every iteration, each rank computes its partial update with emRound /
+ * vbemRound, and the partial updates are summed across the ranks
+ * (allreduce); all of the ranks then hold the same estimates, and so make
+ * the same convergence decision.
+ *
+ * alphas holds the initial estimates (the same on every rank) and, on
+ * return, the final ones; returns the number of iterations.
+ */
+uint32_t distributedEM(salmon::dist::Communicator& comm,
+                       const EquivalenceClassArena& localArena,
+                       const std::vector<uint64_t>& localCounts,
+                       std::vector<Transcript>& transcripts,
+                       bool useVBEM,
+                       double priorAlpha,
+                       double relDiffTolerance,
+                       uint32_t maxIter,
+                       std::vector<double>& alphas);
+
+} // namespace optimizer
+} // namespace salmon
+
 #endif // COLLAPSED_EM_OPTIMIZER_HPP
@@ -5,7 +5,6 @@
 #include <functional>
 
 #include "tbb/atomic.h"
-#include "tbb/task_scheduler_init.h"
 
 #include "SalmonOpts.hpp"
 
@@ -24,6 +23,14 @@ class CollapsedGibbsSampler {
                       SalmonOpts& sopt,
                       std::function<bool(const std::vector<int>&)>& writeBootstrap,
                       uint32_t numSamples = 500);
+
+    private:
+        // The body of sample, run in the shared task arena
+        template <typename ExpT>
+        bool sample_(ExpT& readExp,
+                     SalmonOpts& sopt,
+                     std::function<bool(const std::vector<int>&)>& writeBootstrap,
+                     uint32_t numSamples);
 };
 
 #endif // COLLAPSED_EM_OPTIMIZER_HPP
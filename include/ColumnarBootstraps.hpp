@@ -0,0 +1,246 @@
+#ifndef __COLUMNAR_BOOTSTRAPS_HPP__
+#define __COLUMNAR_BOOTSTRAPS_HPP__
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/copy.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+
+/**
+ * A transcript-major ("columnar") layout of the bootstrap (or Gibbs)
+ * replicates, which lets the replicates of a few transcripts be read
+ * without decompressing those of all the others.  The file consists of
+ *
+ *   ColumnarBootstrapHeader
+ *   uint64_t chunk offsets (numChunks + 1 of them; the last is the file size)
+ *   chunk 0, chunk 1, ...
+ *
+ * where chunk c holds the replicates of the transcripts
+ * [c * transcriptsPerChunk, (c + 1) * transcriptsPerChunk), as an
+ * independently gzip-compressed array of (transcript, replicate) values,
+ * with all of the replicates of a transcript stored contiguously (in the
+ * order in which they were drawn).
+ */
+struct ColumnarBootstrapHeader {
+    static constexpr uint32_t magicNumber = 0x43534253; // "SBSC"
+    static constexpr uint32_t currentVersion = 1;
+    enum class ValueType : uint32_t { DOUBLE = 0, INT32 = 1 };
+
+    uint32_t magic{magicNumber};
+    uint32_t version{currentVersion};
+    uint32_t valueType{0};
+    uint32_t valueSize{0};
+    uint64_t numTranscripts{0};
+    uint64_t numReplicates{0};
+    uint64_t transcriptsPerChunk{0};
+    uint64_t numChunks{0};
+};
+
+/**
+ * Collects the replicates as they are drawn, and writes them in the
+ * columnar layout once they are all available.  Since the file is
+ * transcript-major, the replicates are held in memory until then.
+ */
+class ColumnarBootstrapWriter {
+    public:
+        ColumnarBootstrapWriter(const boost::filesystem::path& path,
+                                size_t numTranscripts,
+                                size_t transcriptsPerChunk = 1024,
+                                int compressionLevel = 6) :
+            path_(path), compressionLevel_(compressionLevel) {
+            header_.numTranscripts = numTranscripts;
+            header_.transcriptsPerChunk = (transcriptsPerChunk > 0) ? transcriptsPerChunk : 1;
+        }
+
+        template <typename T>
+        bool add(const std::vector<T>& sample) {
+            static_assert(std::is_same<T, double>::value or std::is_same<T, int>::value,
+                          "replicates must be of type double or int");
+            std::lock_guard<std::mutex> lock(mutex_);
+            uint32_t valueType = static_cast<uint32_t>(std::is_same<T, double>::value ?
+                                                      ColumnarBootstrapHeader::ValueType::DOUBLE :
+                                                      ColumnarBootstrapHeader::ValueType::INT32);
+            if (header_.numReplicates == 0) {
+                header_.valueType = valueType;
+                header_.valueSize = sizeof(T);
+            } else if (header_.valueType != valueType) {
+                return false;
+            }
+            if (sample.size() != header_.numTranscripts) { return false; }
+            auto bytes = reinterpret_cast<const char*>(sample.data());
+            replicates_.insert(replicates_.end(), bytes, bytes + sample.size() * sizeof(T));
+            ++header_.numReplicates;
+            return true;
+        }
+
+        /**
+         * Transpose the replicates into chunks, and write the file.
+         */
+        bool write() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            size_t numTxps = header_.numTranscripts;
+            size_t numReps = header_.numReplicates;
+            size_t valueSize = header_.valueSize;
+            size_t perChunk = header_.transcriptsPerChunk;
+            header_.numChunks = (numTxps + perChunk - 1) / perChunk;
+
+            std::ofstream out(path_.string(), std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+            if (!out.good()) { return false; }
+            out.write(reinterpret_cast<const char*>(&header_), sizeof(header_));
+            // The offsets are filled in once the chunks have been written
+            std::vector<uint64_t> offsets(header_.numChunks + 1, 0);
+            auto offsetPos = out.tellp();
+            out.write(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(uint64_t));
+
+            std::vector<char> chunk;
+            for (size_t c = 0; c < header_.numChunks; ++c) {
+                size_t first = c * perChunk;
+                size_t last = std::min(numTxps, first + perChunk);
+                chunk.resize((last - first) * numReps * valueSize);
+                char* dest = chunk.data();
+                for (size_t t = first; t < last; ++t) {
+                    for (size_t r = 0; r < numReps; ++r) {
+                        std::memcpy(dest, &replicates_[(r * numTxps + t) * valueSize], valueSize);
+                        dest += valueSize;
+                    }
+                }
+
+                std::string compressed;
+                {
+                    boost::iostreams::filtering_ostream chunkOut;
+                    chunkOut.push(boost::iostreams::gzip_compressor(
+                                boost::iostreams::gzip_params(compressionLevel_)));
+                    chunkOut.push(boost::iostreams::back_inserter(compressed));
+                    chunkOut.write(chunk.data(), chunk.size());
+                }
+                offsets[c] = static_cast<uint64_t>(out.tellp());
+                out.write(compressed.data(), compressed.size());
+            }
+            offsets[header_.numChunks] = static_cast<uint64_t>(out.tellp());
+            out.seekp(offsetPos);
+            out.write(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(uint64_t));
+            return out.good();
+        }
+
+        size_t numReplicates() const { return header_.numReplicates; }
+
+    private:
+        boost::filesystem::path path_;
+        int compressionLevel_;
+        ColumnarBootstrapHeader header_;
+        // The replicates, in the order in which they were added
+        std::vector<char> replicates_;
+        std::mutex mutex_;
+};
+
+/**
+ * Random access to the replicates of a file written by a
+ * ColumnarBootstrapWriter.  The file is memory-mapped, and only the chunks
+ * that overlap the requested transcripts are decompressed.
+ */
+class ColumnarBootstrapReader {
+    public:
+        ColumnarBootstrapReader(const boost::filesystem::path& path) {
+            file_.open(path.string());
+            if (!file_.is_open() or file_.size() < sizeof(ColumnarBootstrapHeader)) { return; }
+            std::memcpy(&header_, file_.data(), sizeof(header_));
+            if (header_.magic != ColumnarBootstrapHeader::magicNumber or
+                header_.version != ColumnarBootstrapHeader::currentVersion) { return; }
+            size_t tableSize = (header_.numChunks + 1) * sizeof(uint64_t);
+            if (file_.size() < sizeof(header_) + tableSize) { return; }
+            offsets_.resize(header_.numChunks + 1);
+            std::memcpy(offsets_.data(), file_.data() + sizeof(header_), tableSize);
+            good_ = (offsets_.back() == file_.size());
+        }
+
+        bool good() const { return good_; }
+        size_t numTranscripts() const { return header_.numTranscripts; }
+        size_t numReplicates() const { return header_.numReplicates; }
+        bool isInteger() const {
+            return header_.valueType == static_cast<uint32_t>(ColumnarBootstrapHeader::ValueType::INT32);
+        }
+
+        /**
+         * Fill `values` with the replicates of transcripts [first, last);
+         * the replicates of transcript first + i are
+         * values[i * numReplicates(), (i + 1) * numReplicates()).  The
+         * values are converted to double if they were stored as integers.
+         */
+        bool transcriptSlice(size_t first, size_t last, std::vector<double>& values) {
+            if (!good_ or first > last or last > header_.numTranscripts) { return false; }
+            size_t numReps = header_.numReplicates;
+            size_t perChunk = header_.transcriptsPerChunk;
+            values.resize((last - first) * numReps);
+            if (first == last) { return true; }
+
+            for (size_t c = first / perChunk; c <= (last - 1) / perChunk; ++c) {
+                if (!decompressChunk_(c)) { return false; }
+                size_t chunkFirst = c * perChunk;
+                size_t sliceFirst = std::max(first, chunkFirst);
+                size_t sliceLast = std::min(last, chunkFirst + perChunk);
+                for (size_t t = sliceFirst; t < sliceLast; ++t) {
+                    const char* src = chunk_.data() + (t - chunkFirst) * numReps * header_.valueSize;
+                    double* dest = values.data() + (t - first) * numReps;
+                    for (size_t r = 0; r < numReps; ++r) {
+                        dest[r] = value_(src + r * header_.valueSize);
+                    }
+                }
+            }
+            return true;
+        }
+
+    private:
+        inline double value_(const char* src) const {
+            if (isInteger()) {
+                int32_t v;
+                std::memcpy(&v, src, sizeof(v));
+                return static_cast<double>(v);
+            }
+            double v;
+            std::memcpy(&v, src, sizeof(v));
+            return v;
+        }
+
+        bool decompressChunk_(size_t c) {
+            if (c == cachedChunk_) { return true; }
+            uint64_t begin = offsets_[c];
+            uint64_t end = offsets_[c + 1];
+            if (begin > end or end > file_.size()) { return false; }
+
+            chunk_.clear();
+            boost::iostreams::filtering_istream in;
+            in.push(boost::iostreams::gzip_decompressor());
+            in.push(boost::iostreams::array_source(file_.data() + begin, end - begin));
+            boost::iostreams::copy(in, boost::iostreams::back_inserter(chunk_));
+
+            size_t chunkFirst = c * header_.transcriptsPerChunk;
+            size_t numTxps = std::min(static_cast<size_t>(header_.transcriptsPerChunk),
+                                      static_cast<size_t>(header_.numTranscripts - chunkFirst));
+            if (chunk_.size() != numTxps * header_.numReplicates * header_.valueSize) { return false; }
+            cachedChunk_ = c;
+            return true;
+        }
+
+        boost::iostreams::mapped_file_source file_;
+        ColumnarBootstrapHeader header_;
+        std::vector<uint64_t> offsets_;
+        bool good_{false};
+        // The most-recently decompressed chunk
+        std::vector<char> chunk_;
+        size_t cachedChunk_{std::numeric_limits<size_t>::max()};
+};
+
+#endif //__COLUMNAR_BOOTSTRAPS_HPP__
@@ -0,0 +1,78 @@
+#ifndef __COMMUNICATOR_HPP__
+#define __COMMUNICATOR_HPP__
+
+#include <cstddef>
+#include <cstdint>
+
+#ifdef SALMON_ENABLE_MPI
+#include <mpi.h>
+#endif
+
+namespace salmon {
+namespace dist {
+
+/**
+ * The collective operations with which the ranks of a distributed run of
+ * the optimizer (see salmon::optimizer::distributedEM) exchange their
+ * partial results.  LocalCommunicator is the single-rank case; with
+ * -DENABLE_MPI=ON, MPICommunicator runs over MPI_COMM_WORLD.  Any other
+ * message-passing layer can be used by implementing this interface.
+ */
+class Communicator {
+    public:
+        virtual ~Communicator() {}
+        virtual int rank() const = 0;
+        virtual int size() const = 0;
+        // Replace x[0, n) on every rank by its elementwise sum over the ranks
+        virtual void allreduceSum(double* x, size_t n) = 0;
+        virtual void allreduceSum(uint64_t* x, size_t n) = 0;
+};
+
+class LocalCommunicator : public Communicator {
+    public:
+        int rank() const override { return 0; }
+        int size() const override { return 1; }
+        void allreduceSum(double*, size_t) override {}
+        void allreduceSum(uint64_t*, size_t) override {}
+};
+
+#ifdef SALMON_ENABLE_MPI
+/**
+ * A Communicator over MPI_COMM_WORLD.  MPI must have been initialized
+ * (MPI_Init) before one is constructed.  The vectors are reduced in
+ * pieces of at most 2^30 elements, since MPI counts are ints.
+ */
+class MPICommunicator : public Communicator {
+    public:
+        MPICommunicator() {
+            MPI_Comm_rank(MPI_COMM_WORLD, &rank_);
+            MPI_Comm_size(MPI_COMM_WORLD, &size_);
+        }
+        int rank() const override { return rank_; }
+        int size() const override { return size_; }
+
+        void allreduceSum(double* x, size_t n) override {
+            for (size_t i = 0; i < n; i += maxCount_) {
+                int count = static_cast<int>((n - i < maxCount_) ? n - i : maxCount_);
+                MPI_Allreduce(MPI_IN_PLACE, x + i, count, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+            }
+        }
+
+        void allreduceSum(uint64_t* x, size_t n) override {
+            for (size_t i = 0; i < n; i += maxCount_) {
+                int count = static_cast<int>((n - i < maxCount_) ? n - i : maxCount_);
+                MPI_Allreduce(MPI_IN_PLACE, x + i, count, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+            }
+        }
+
+    private:
+        static constexpr size_t maxCount_ = size_t(1) << 30;
+        int rank_{0};
+        int size_{1};
+};
+#endif // SALMON_ENABLE_MPI
+
+} // namespace dist
+} // namespace salmon
+
+#endif // __COMMUNICATOR_HPP__
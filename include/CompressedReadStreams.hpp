@@ -0,0 +1,444 @@
+#ifndef __COMPRESSED_READ_STREAMS_HPP__
+#define __COMPRESSED_READ_STREAMS_HPP__
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <istream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <boost/iostreams/categories.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/iostreams/filter/bzip2.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/operations.hpp>
+#include <boost/iostreams/device/file.hpp>
+#include <boost/iostreams/stream.hpp>
+
+#include <bzlib.h>
+#ifdef SALMON_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include <sys/stat.h>
+
+/**
+ * Read streams over zstd- and bzip2-compressed FASTA / FASTQ files, for the
+ * read parser, which decompress them on several threads when the file is
+ * made of independent pieces:
+ *
+ *  - a zstd file of several frames (as written by zstd's seekable format,
+ *    or by compressing the reads in pieces, e.g. zstd -T0 --rsyncable or
+ *    pzstd), each frame being decoded by its own thread;
+ *  - a bzip2 file of several concatenated streams (as written by pbzip2),
+ *    each stream (of one 900k block) being decoded by its own thread.
+ *
+ * Other files of these formats are decompressed as they are read, on the
+ * parser's thread.  zstd support needs libzstd at build time
+ * (SALMON_HAVE_ZSTD).
+ */
+namespace salmon {
+namespace io {
+
+/**
+ * A (boost iostreams) source that hands out the decompressed contents of
+ * the chunks of a mapped file in order, while decompressing up to
+ * 2 * numThreads of the chunks after the one being read, on numThreads
+ * threads.
+ */
+class ChunkedDecompressor {
+    public:
+        using Chunk = std::pair<size_t, size_t>; // [begin, end) in the file
+        using DecodeFn = std::function<void(const char* data, size_t len, std::string& out)>;
+
+        ChunkedDecompressor(std::shared_ptr<boost::iostreams::mapped_file_source> file,
+                            std::vector<Chunk> chunks, DecodeFn decode, uint32_t numThreads) :
+            file_(file), chunks_(std::move(chunks)), decode_(decode),
+            window_(2 * std::max(numThreads, uint32_t(1))) {
+            for (uint32_t t = 0; t < std::max(numThreads, uint32_t(1)); ++t) {
+                workers_.emplace_back([this]() -> void { work_(); });
+            }
+        }
+
+        ~ChunkedDecompressor() {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+            }
+            cond_.notify_all();
+            for (auto& t : workers_) { t.join(); }
+        }
+
+        std::streamsize read(char* s, std::streamsize n) {
+            while (pos_ == current_.size()) {
+                std::unique_lock<std::mutex> lock(mutex_);
+                if (consumed_ == chunks_.size()) { return -1; }
+                cond_.wait(lock, [this]() -> bool { return !error_.empty() or decoded_.count(consumed_) > 0; });
+                if (!error_.empty()) { throw std::runtime_error(error_); }
+                current_ = std::move(decoded_[consumed_]);
+                decoded_.erase(consumed_);
+                ++consumed_;
+                pos_ = 0;
+                lock.unlock();
+                cond_.notify_all();
+            }
+            std::streamsize m = std::min(n, static_cast<std::streamsize>(current_.size() - pos_));
+            std::memcpy(s, current_.data() + pos_, m);
+            pos_ += m;
+            return m;
+        }
+
+    private:
+        void work_() {
+            std::string out;
+            while (true) {
+                size_t i{0};
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    cond_.wait(lock, [this]() -> bool {
+                        return stop_ or next_ == chunks_.size() or next_ < consumed_ + window_;
+                    });
+                    if (stop_ or next_ == chunks_.size()) { return; }
+                    i = next_++;
+                }
+                out.clear();
+                try {
+                    decode_(file_->data() + chunks_[i].first, chunks_[i].second - chunks_[i].first, out);
+                } catch (std::exception& e) {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    error_ = e.what();
+                    cond_.notify_all();
+                    return;
+                }
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    decoded_[i] = std::move(out);
+                }
+                cond_.notify_all();
+            }
+        }
+
+        std::shared_ptr<boost::iostreams::mapped_file_source> file_;
+        std::vector<Chunk> chunks_;
+        DecodeFn decode_;
+        size_t window_;
+
+        std::mutex mutex_;
+        std::condition_variable cond_;
+        size_t next_{0};      // the next chunk to decode
+        size_t consumed_{0};  // the chunks handed out so far
+        std::map<size_t, std::string> decoded_;
+        std::string error_;
+        bool stop_{false};
+        std::vector<std::thread> workers_;
+
+        std::string current_;
+        size_t pos_{0};
+};
+
+// The copyable source (by which boost iostreams holds it) of a ChunkedDecompressor
+class ChunkedSource {
+    public:
+        typedef char char_type;
+        typedef boost::iostreams::source_tag category;
+
+        explicit ChunkedSource(std::shared_ptr<ChunkedDecompressor> impl) : impl_(impl) {}
+        std::streamsize read(char* s, std::streamsize n) { return impl_->read(s, n); }
+
+    private:
+        std::shared_ptr<ChunkedDecompressor> impl_;
+};
+
+// Decompress all of the bzip2 stream(s) in [data, data + len) into out
+inline void bzip2Decode(const char* data, size_t len, std::string& out) {
+    size_t pos{0};
+    char buf[1 << 16];
+    while (pos < len) {
+        bz_stream strm;
+        std::memset(&strm, 0, sizeof(strm));
+        if (BZ2_bzDecompressInit(&strm, 0, 0) != BZ_OK) { throw std::runtime_error("bzip2: out of memory"); }
+        strm.next_in = const_cast<char*>(data + pos);
+        strm.avail_in = static_cast<unsigned int>(len - pos);
+        int ret{BZ_OK};
+        while (ret == BZ_OK) {
+            strm.next_out = buf;
+            strm.avail_out = sizeof(buf);
+            ret = BZ2_bzDecompress(&strm);
+            out.append(buf, sizeof(buf) - strm.avail_out);
+        }
+        pos = len - strm.avail_in;
+        BZ2_bzDecompressEnd(&strm);
+        if (ret != BZ_STREAM_END) { throw std::runtime_error("bzip2: corrupt or truncated input"); }
+    }
+}
+
+/**
+ * The starts of the streams of a bzip2 file: "BZh", the block size, and
+ * the magic of a (first) block, at a byte boundary.
+ */
+inline std::vector<size_t> bzip2StreamStarts(const char* data, size_t len) {
+    static const unsigned char blockMagic[] = {0x31, 0x41, 0x59, 0x26, 0x53, 0x59};
+    std::vector<size_t> starts;
+    for (size_t i = 0; i + 10 <= len; ++i) {
+        const char* p = static_cast<const char*>(std::memchr(data + i, 'B', len - i - 9));
+        if (p == nullptr) { break; }
+        i = p - data;
+        if (p[1] == 'Z' and p[2] == 'h' and p[3] >= '1' and p[3] <= '9' and
+            std::memcmp(p + 4, blockMagic, sizeof(blockMagic)) == 0) {
+            starts.push_back(i);
+        }
+    }
+    return starts;
+}
+
+#ifdef SALMON_HAVE_ZSTD
+// Decompress all of the zstd frame(s) in [data, data + len) into out
+inline void zstdDecode(const char* data, size_t len, std::string& out) {
+    std::unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx*)> dctx(ZSTD_createDCtx(), ZSTD_freeDCtx);
+    std::vector<char> buf(ZSTD_DStreamOutSize());
+    ZSTD_inBuffer in{data, len, 0};
+    while (in.pos < in.size) {
+        ZSTD_outBuffer outBuf{buf.data(), buf.size(), 0};
+        size_t ret = ZSTD_decompressStream(dctx.get(), &outBuf, &in);
+        if (ZSTD_isError(ret)) { throw std::runtime_error(std::string("zstd: ") + ZSTD_getErrorName(ret)); }
+        out.append(buf.data(), outBuf.pos);
+    }
+}
+
+// A source decompressing a zstd file as it's read, on the reading thread
+class ZstdSource {
+    public:
+        typedef char char_type;
+        typedef boost::iostreams::source_tag category;
+
+        explicit ZstdSource(std::shared_ptr<boost::iostreams::mapped_file_source> file) :
+            file_(file), dctx_(ZSTD_createDCtx(), ZSTD_freeDCtx), in_{file->data(), file->size(), 0} {}
+
+        std::streamsize read(char* s, std::streamsize n) {
+            if (in_.pos == in_.size) { return -1; }
+            ZSTD_outBuffer out{s, static_cast<size_t>(n), 0};
+            while (out.pos == 0 and in_.pos < in_.size) {
+                size_t ret = ZSTD_decompressStream(dctx_.get(), &out, &in_);
+                if (ZSTD_isError(ret)) { throw std::runtime_error(std::string("zstd: ") + ZSTD_getErrorName(ret)); }
+            }
+            return (out.pos > 0) ? static_cast<std::streamsize>(out.pos) : -1;
+        }
+
+    private:
+        std::shared_ptr<boost::iostreams::mapped_file_source> file_;
+        std::shared_ptr<ZSTD_DCtx> dctx_;
+        ZSTD_inBuffer in_;
+};
+#endif
+
+/**
+ * A source that hands out prefix (the first bytes of src, already read from
+ * it to sniff its format) and then the rest of src, so that a file can be
+ * sniffed through the one source it's read by, which, for a pipe (e.g.
+ * /dev/stdin or <(zcat ...)), is the only one that sees its bytes.
+ */
+template <typename SourceT>
+class PrefixedSource {
+    public:
+        typedef char char_type;
+        typedef boost::iostreams::source_tag category;
+
+        PrefixedSource(const std::string& prefix, const SourceT& src) :
+            prefix_(std::make_shared<std::string>(prefix)), pos_(std::make_shared<size_t>(0)), src_(src) {}
+
+        std::streamsize read(char* s, std::streamsize n) {
+            size_t left = prefix_->size() - *pos_;
+            if (left > 0) {
+                size_t k = std::min(left, static_cast<size_t>(n));
+                std::memcpy(s, prefix_->data() + *pos_, k);
+                *pos_ += k;
+                return static_cast<std::streamsize>(k);
+            }
+            return src_.read(s, n);
+        }
+
+    private:
+        std::shared_ptr<std::string> prefix_;
+        std::shared_ptr<size_t> pos_;
+        SourceT src_;
+};
+
+// Read (up to) the first n bytes of src, for sniffing; fewer only at its end
+template <typename SourceT>
+std::string readPrefix(SourceT& src, size_t n) {
+    std::string prefix(n, '\0');
+    size_t got{0};
+    while (got < n) {
+        std::streamsize r = src.read(&prefix[got], static_cast<std::streamsize>(n - got));
+        if (r <= 0) { break; }
+        got += static_cast<size_t>(r);
+    }
+    prefix.resize(got);
+    return prefix;
+}
+
+enum class ReadCompression { NONE, GZIP, BZIP2, ZSTD };
+
+// The compression of a file, from (up to) its first 4 bytes
+inline ReadCompression compressionOf(const std::string& magic) {
+    auto m = [&magic](size_t i) -> unsigned { return (i < magic.size()) ? static_cast<unsigned char>(magic[i]) : 0x100; };
+    if (m(0) == 0x1f and m(1) == 0x8b) { return ReadCompression::GZIP; }
+    if (m(0) == 'B' and m(1) == 'Z' and m(2) == 'h') { return ReadCompression::BZIP2; }
+    // A zstd frame, or a skippable frame (with which the seekable format may start)
+    if ((m(0) == 0x28 and m(1) == 0xb5 and m(2) == 0x2f and m(3) == 0xfd) or
+        (m(0) < 0x100 and (m(0) & 0xf0) == 0x50 and m(1) == 0x2a and m(2) == 0x4d and m(3) == 0x18)) {
+        return ReadCompression::ZSTD;
+    }
+    return ReadCompression::NONE;
+}
+
+#ifdef SALMON_HAVE_ZSTD
+// A filter decompressing a zstd stream as it's read (e.g. from a pipe, which can't be mapped)
+class ZstdInputFilter {
+    public:
+        typedef char char_type;
+        typedef boost::iostreams::multichar_input_filter_tag category;
+
+        ZstdInputFilter() : state_(std::make_shared<State_>()) {}
+
+        template <typename Source>
+        std::streamsize read(Source& src, char* s, std::streamsize n) {
+            auto& st = *state_;
+            ZSTD_outBuffer out{s, static_cast<size_t>(n), 0};
+            while (out.pos == 0) {
+                if (st.in.pos == st.in.size and !st.eof) {
+                    std::streamsize r = boost::iostreams::read(src, st.buf.data(), st.buf.size());
+                    if (r > 0) {
+                        st.in = ZSTD_inBuffer{st.buf.data(), static_cast<size_t>(r), 0};
+                    } else {
+                        st.eof = true;
+                    }
+                }
+                // At the end of the input, this still drains what the context holds
+                size_t ret = ZSTD_decompressStream(st.dctx.get(), &out, &st.in);
+                if (ZSTD_isError(ret)) { throw std::runtime_error(std::string("zstd: ") + ZSTD_getErrorName(ret)); }
+                if (st.eof and st.in.pos == st.in.size and out.pos == 0) { break; }
+            }
+            return (out.pos > 0) ? static_cast<std::streamsize>(out.pos) : -1;
+        }
+
+    private:
+        struct State_ {
+            State_() : dctx(ZSTD_createDCtx(), ZSTD_freeDCtx), buf(ZSTD_DStreamInSize()), in{nullptr, 0, 0} {}
+            std::shared_ptr<ZSTD_DCtx> dctx;
+            std::vector<char> buf;
+            ZSTD_inBuffer in;
+            bool eof{false};
+        };
+        std::shared_ptr<State_> state_;
+};
+#endif
+
+/**
+ * A stream over the decompressed contents of the zstd- or bzip2-compressed
+ * (regular) file at path, which is mapped, and decompressed on up to
+ * numThreads threads (see above).  Throws if it's in zstd format, but
+ * salmon was built without libzstd.
+ */
+inline std::unique_ptr<std::istream> openCompressedReadStream(const char* path, ReadCompression compression,
+                                                              uint32_t numThreads) {
+    namespace bio = boost::iostreams;
+    bool isBzip2 = (compression == ReadCompression::BZIP2);
+
+    auto file = std::make_shared<bio::mapped_file_source>(path);
+    const char* data = file->data();
+    size_t len = file->size();
+    std::vector<ChunkedDecompressor::Chunk> chunks;
+
+    if (isBzip2) {
+        auto starts = bzip2StreamStarts(data, len);
+        for (size_t i = 0; i < starts.size(); ++i) {
+            chunks.emplace_back(starts[i], (i + 1 < starts.size()) ? starts[i + 1] : len);
+        }
+        if (chunks.size() < 2 or numThreads < 2) {
+            std::unique_ptr<bio::filtering_istream> in(new bio::filtering_istream);
+            in->push(bio::bzip2_decompressor());
+            in->push(bio::file_source(path, std::ios::in | std::ios::binary));
+            return std::unique_ptr<std::istream>(in.release());
+        }
+        auto impl = std::make_shared<ChunkedDecompressor>(file, std::move(chunks), bzip2Decode, numThreads);
+        return std::unique_ptr<std::istream>(new bio::stream<ChunkedSource>(ChunkedSource(impl)));
+    }
+
+#ifdef SALMON_HAVE_ZSTD
+    // Each frame is decoded whole, so only files of (many) small frames are
+    // decoded in parallel
+    constexpr size_t maxParallelFrameBytes = size_t(16) << 20;
+    bool parallel = (numThreads >= 2);
+    for (size_t pos = 0; pos < len;) {
+        size_t n = ZSTD_findFrameCompressedSize(data + pos, len - pos);
+        if (ZSTD_isError(n)) {
+            throw std::runtime_error(std::string(path) + " is not a valid zstd file (" + ZSTD_getErrorName(n) + ")");
+        }
+        parallel = parallel and n <= maxParallelFrameBytes;
+        chunks.emplace_back(pos, pos + n);
+        pos += n;
+    }
+    if (chunks.size() < 2 or !parallel) {
+        return std::unique_ptr<std::istream>(new bio::stream<ZstdSource>(ZstdSource(file)));
+    }
+    auto impl = std::make_shared<ChunkedDecompressor>(file, std::move(chunks), zstdDecode, numThreads);
+    return std::unique_ptr<std::istream>(new bio::stream<ChunkedSource>(ChunkedSource(impl)));
+#else
+    throw std::runtime_error(std::string(path) + " is zstd-compressed, but this salmon was built without zstd support");
+#endif
+}
+
+/**
+ * A stream over the contents of the file at path, read through source
+ * (opened on it), and decompressed if it's gzipped, zstd- or
+ * bzip2-compressed.  The format is sniffed from the first bytes of source
+ * itself, which are handed back to the stream, so that a pipe (e.g.
+ * /dev/stdin or <(zcat ...)) loses none of them.  A regular zstd or bzip2
+ * file is mapped, and may be decompressed on up to numThreads threads (see
+ * openCompressedReadStream); other files are decompressed as they're
+ * read.
+ */
+template <typename SourceT>
+std::unique_ptr<std::istream> openReadStream(const char* path, SourceT source, uint32_t numThreads,
+                                             std::streamsize bufferSize) {
+    namespace bio = boost::iostreams;
+    std::string magic = readPrefix(source, 4);
+    auto compression = compressionOf(magic);
+    struct stat st;
+    bool regular = ::stat(path, &st) == 0 and S_ISREG(st.st_mode);
+    if (regular and (compression == ReadCompression::BZIP2 or compression == ReadCompression::ZSTD)) {
+        return openCompressedReadStream(path, compression, numThreads);
+    }
+    std::unique_ptr<bio::filtering_istream> in(new bio::filtering_istream);
+    switch (compression) {
+        case ReadCompression::GZIP: in->push(bio::gzip_decompressor()); break;
+        case ReadCompression::BZIP2: in->push(bio::bzip2_decompressor()); break;
+        case ReadCompression::ZSTD:
+#ifdef SALMON_HAVE_ZSTD
+            in->push(ZstdInputFilter());
+            break;
+#else
+            throw std::runtime_error(std::string(path) + " is zstd-compressed, but this salmon was built without zstd support");
+#endif
+        case ReadCompression::NONE: break;
+    }
+    in->push(PrefixedSource<SourceT>(magic, source), bufferSize);
+    return std::unique_ptr<std::istream>(in.release());
+}
+
+}
+}
+
+#endif // __COMPRESSED_READ_STREAMS_HPP__
@@ -0,0 +1,68 @@
+#ifndef __DUPLICATE_TRANSCRIPTS_HPP__
+#define __DUPLICATE_TRANSCRIPTS_HPP__
+
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+/**
+ * The transcripts left out of a quasi index built with --collapseDuplicates
+ * because their sequence is identical to that of a transcript kept in it
+ * (the representative, the first of them in the input).  They're recorded
+ * in the index directory, in duplicate_transcripts.tsv, as
+ *
+ *     RetainedTxp <TAB> DuplicateTxp
+ *
+ * one line per duplicate, so that quant can report them again
+ * (--expandDuplicates).
+ */
+class DuplicateTranscripts {
+    public:
+        static const char* fileName() { return "duplicate_transcripts.tsv"; }
+
+        void add(const std::string& retained, const std::string& duplicate) {
+            duplicates_[retained].push_back(duplicate);
+            ++numDuplicates_;
+        }
+
+        bool write(const boost::filesystem::path& indexDir) const {
+            std::ofstream out((indexDir / fileName()).string());
+            out << "RetainedTxp\tDuplicateTxp\n";
+            for (auto& kv : duplicates_) {
+                for (auto& d : kv.second) { out << kv.first << '\t' << d << '\n'; }
+            }
+            return out.good();
+        }
+
+        // Read the duplicates of the index in indexDir (there are none if it has no table)
+        bool load(const boost::filesystem::path& indexDir) {
+            std::ifstream in((indexDir / fileName()).string());
+            if (!in.good()) { return false; }
+            std::string line;
+            std::getline(in, line); // header
+            while (std::getline(in, line)) {
+                auto tab = line.find('\t');
+                if (tab == std::string::npos) { continue; }
+                add(line.substr(0, tab), line.substr(tab + 1));
+            }
+            return true;
+        }
+
+        // The duplicates of the transcript named retained (or nullptr if it has none)
+        const std::vector<std::string>* duplicatesOf(const std::string& retained) const {
+            auto it = duplicates_.find(retained);
+            return (it == duplicates_.end()) ? nullptr : &it->second;
+        }
+
+        size_t numDuplicates() const { return numDuplicates_; }
+        bool empty() const { return numDuplicates_ == 0; }
+
+    private:
+        std::unordered_map<std::string, std::vector<std::string>> duplicates_;
+        size_t numDuplicates_{0};
+};
+
+#endif // __DUPLICATE_TRANSCRIPTS_HPP__
@@ -0,0 +1,97 @@
+#ifndef __EM_DEVICE_HPP__
+#define __EM_DEVICE_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "EquivalenceClassArena.hpp"
+
+namespace salmon {
+namespace gpu {
+
+/**
+ * The EM (and VBEM) rounds over the flat equivalence classes of an
+ * EquivalenceClassArena, run on a CUDA device (salmon quant --gpu, with
+ * salmon built with -DENABLE_CUDA=ON).  The labels, weights and counts are
+ * copied to the device once, and all of the rounds up to convergence (or
+ * the next re-computation of the effective lengths) run there, including
+ * the convergence test; only the final abundances come back.
+ *
+ * R bootstrap replicates can be optimized together (optimizeBatch), with
+ * their counts and abundances interleaved as in the CPU batch EM
+ * (counts[eqID * R + r], alphas[tid * R + r]), each with its own
+ * convergence test.
+ *
+ * Without CUDA, available() is false, and the optimizer runs on the CPU.
+ */
+class EMDevice {
+    public:
+        // Whether there is a device to run on (if not, why not, in reason)
+        static bool available(std::string& reason);
+
+        /**
+         * Copy the labels and combined weights of the classes of arena (if
+         * onlyValid, of its valid classes only) to the device, for
+         * abundance vectors of numTxps transcripts.
+         */
+        EMDevice(const EquivalenceClassArena& arena, size_t numTxps, bool onlyValid);
+        ~EMDevice();
+
+        EMDevice(const EMDevice&) = delete;
+        EMDevice& operator=(const EMDevice&) = delete;
+
+        // Copy the combined weights of the arena again (once they've changed)
+        void updateWeights(const EquivalenceClassArena& arena);
+
+        /**
+         * Run the (VB)EM rounds itNum, itNum + 1, ... from alphas, with the
+         * counts of the arena, until round endIt, or until the estimates
+         * have converged (no estimate above alphaCheckCutoff changed,
+         * relatively, by more than relDiffTolerance) after round minIter.
+         * Returns the number of the next round; alphas holds the estimates,
+         * and maxRelDiff the largest relative change of the last round.
+         */
+        size_t optimize(bool useVBEM, double priorAlpha,
+                        size_t itNum, size_t endIt, size_t minIter,
+                        double alphaCheckCutoff, double relDiffTolerance,
+                        std::vector<double>& alphas, double& maxRelDiff);
+
+        /**
+         * Run the EM on R sets of counts (of all of the classes of the
+         * arena, interleaved by class) from alphas (interleaved by
+         * transcript) until each has converged after minIter rounds, or
+         * maxIter rounds have been run.
+         */
+        void optimizeBatch(const uint64_t* counts, size_t R, size_t minIter, size_t maxIter,
+                           double alphaCheckCutoff, double relDiffTolerance,
+                           std::vector<double>& alphas);
+
+    private:
+        struct Buffers;
+        std::unique_ptr<Buffers> buffers_;
+        size_t numTxps_;
+};
+
+#ifndef SALMON_ENABLE_CUDA
+struct EMDevice::Buffers {};
+
+inline bool EMDevice::available(std::string& reason) {
+    reason = "salmon was built without CUDA support (-DENABLE_CUDA=ON)";
+    return false;
+}
+inline EMDevice::EMDevice(const EquivalenceClassArena&, size_t numTxps, bool) : numTxps_(numTxps) {}
+inline EMDevice::~EMDevice() {}
+inline void EMDevice::updateWeights(const EquivalenceClassArena&) {}
+inline size_t EMDevice::optimize(bool, double, size_t itNum, size_t, size_t, double, double,
+                                 std::vector<double>&, double&) { return itNum; }
+inline void EMDevice::optimizeBatch(const uint64_t*, size_t, size_t, size_t, double, double,
+                                    std::vector<double>&) {}
+#endif
+
+} // namespace gpu
+} // namespace salmon
+
+#endif // __EM_DEVICE_HPP__
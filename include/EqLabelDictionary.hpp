@@ -0,0 +1,259 @@
+#ifndef __EQ_LABEL_DICTIONARY_HPP__
+#define __EQ_LABEL_DICTIONARY_HPP__
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/functional/hash.hpp>
+
+/**
+ * A dictionary of equivalence class labels (--eqLabelDict), shared by all
+ * of the samples quantified against an index, that gives each label a
+ * 64-bit id; the classes of each sample are then written as (label id,
+ * weights, count), so that the classes of different samples are merged by
+ * joining on the ids.
+ *
+ * The dictionary is an append-only file
+ *
+ *   magic[8] version:u32 reserved:u32 numTranscripts:u64
+ *   (size:u32 tids:u32[size]) * (# labels)
+ *
+ * in host byte order, and the id of a label is the offset of its record in
+ * the file, so ids never change once given out.  The file is mapped, and
+ * indexed (by the hash of each label) when it's opened; the records that
+ * other processes append later are indexed when this one next has to add
+ * a label of its own.  Appends are serialized across processes by an
+ * exclusive lock (flock) on the file, under which the appending process
+ * first catches up with the records added since it last looked (so a
+ * label is never added twice) and drops any partial record left by a
+ * process that died mid-append.  A dictionary object is not to be shared
+ * by threads.
+ */
+class EqLabelDictionary {
+    public:
+        static constexpr uint32_t version = 1;
+        // The id that no label has
+        static uint64_t noId() { return std::numeric_limits<uint64_t>::max(); }
+
+        EqLabelDictionary() = default;
+        EqLabelDictionary(const EqLabelDictionary&) = delete;
+        EqLabelDictionary& operator=(const EqLabelDictionary&) = delete;
+
+        ~EqLabelDictionary() {
+            unmap_();
+            if (fd_ >= 0) { ::close(fd_); }
+        }
+
+        /**
+         * Open (creating it if need be) the dictionary at path, for an index
+         * of numTranscripts transcripts.  Returns false (with a message in
+         * err) if it can't be, or if it's for an index of a different size.
+         */
+        bool open(const boost::filesystem::path& path, uint64_t numTranscripts, std::string& err) {
+            path_ = path.string();
+            fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT, 0644);
+            if (fd_ < 0) {
+                err = "could not open " + path_;
+                return false;
+            }
+            FileLock_ lock(fd_);
+            struct stat st;
+            if (::fstat(fd_, &st) != 0) {
+                err = "could not stat " + path_;
+                return false;
+            }
+            if (st.st_size == 0) {
+                char header[headerBytes_];
+                std::memset(header, 0, headerBytes_);
+                std::memcpy(header, magic_(), magicBytes_);
+                uint32_t v = version;
+                std::memcpy(header + magicBytes_, &v, sizeof(v));
+                std::memcpy(header + magicBytes_ + 8, &numTranscripts, sizeof(numTranscripts));
+                if (::pwrite(fd_, header, headerBytes_, 0) != static_cast<ssize_t>(headerBytes_)) {
+                    err = "could not write " + path_;
+                    return false;
+                }
+            }
+            if (!catchUp_(err)) { return false; }
+            uint64_t dictTranscripts{0};
+            std::memcpy(&dictTranscripts, data_ + magicBytes_ + 8, sizeof(dictTranscripts));
+            if (dictTranscripts != numTranscripts) {
+                err = path_ + " holds the labels of an index with " + std::to_string(dictTranscripts) +
+                      " transcripts, not " + std::to_string(numTranscripts);
+                return false;
+            }
+            return true;
+        }
+
+        /**
+         * Fill ids with the id of each of labels (pointers to objects with
+         * data() and size(), as TranscriptLabel), adding those that aren't
+         * in the dictionary yet.  The labels must be distinct.
+         */
+        template <typename LabelT>
+        bool intern(const std::vector<const LabelT*>& labels, std::vector<uint64_t>& ids, std::string& err) {
+            ids.assign(labels.size(), noId());
+            std::vector<size_t> missing;
+            for (size_t i = 0; i < labels.size(); ++i) {
+                ids[i] = find_(labels[i]->data(), labels[i]->size());
+                if (ids[i] == noId()) { missing.push_back(i); }
+            }
+            numAdded_ = 0;
+            if (missing.empty()) { return true; }
+
+            FileLock_ lock(fd_);
+            if (!catchUp_(err)) { return false; }
+            uint64_t end = indexedEnd_;
+            std::string records;
+            for (auto i : missing) {
+                auto& l = *labels[i];
+                ids[i] = find_(l.data(), l.size());
+                if (ids[i] != noId()) { continue; }
+                ids[i] = end + records.size();
+                uint32_t size = static_cast<uint32_t>(l.size());
+                records.append(reinterpret_cast<const char*>(&size), sizeof(size));
+                records.append(reinterpret_cast<const char*>(l.data()), l.size() * sizeof(uint32_t));
+                ++numAdded_;
+            }
+            if (records.empty()) { return true; }
+            if (::pwrite(fd_, records.data(), records.size(), end) != static_cast<ssize_t>(records.size())) {
+                // Whatever part of the records was written is dropped by the next catchUp_
+                err = "could not append to " + path_;
+                return false;
+            }
+            return catchUp_(err);
+        }
+
+        /**
+         * The label with the given id (empty if there is none).
+         */
+        std::vector<uint32_t> label(uint64_t id) const {
+            std::vector<uint32_t> tids;
+            if (id < headerBytes_ or id + sizeof(uint32_t) > indexedEnd_) { return tids; }
+            uint32_t size{0};
+            std::memcpy(&size, data_ + id, sizeof(size));
+            if (id + sizeof(uint32_t) * (size + 1) > indexedEnd_) { return tids; }
+            tids.resize(size);
+            std::memcpy(tids.data(), data_ + id + sizeof(uint32_t), size * sizeof(uint32_t));
+            return tids;
+        }
+
+        // The number of labels in the dictionary (as of the last time it was indexed)
+        size_t size() const { return numLabels_; }
+        // The number of labels added by the last call to intern
+        size_t numAdded() const { return numAdded_; }
+
+    private:
+        // An exclusive lock on the file, for as long as it's in scope
+        class FileLock_ {
+            public:
+                explicit FileLock_(int fd) : fd_(fd) { while (::flock(fd_, LOCK_EX) != 0 and errno == EINTR) {} }
+                ~FileLock_() { ::flock(fd_, LOCK_UN); }
+            private:
+                int fd_;
+        };
+
+        static size_t hash_(const uint32_t* tids, size_t size) { return boost::hash_range(tids, tids + size); }
+
+        uint64_t find_(const uint32_t* tids, size_t size) const {
+            auto range = index_.equal_range(hash_(tids, size));
+            for (auto it = range.first; it != range.second; ++it) {
+                uint32_t recSize{0};
+                std::memcpy(&recSize, data_ + it->second, sizeof(recSize));
+                if (recSize == size and
+                    std::memcmp(data_ + it->second + sizeof(uint32_t), tids, size * sizeof(uint32_t)) == 0) {
+                    return it->second;
+                }
+            }
+            return noId();
+        }
+
+        /**
+         * Map the file as it is now, and index the records added since it
+         * was last indexed.  Must be called with the file locked.
+         */
+        bool catchUp_(std::string& err) {
+            struct stat st;
+            if (::fstat(fd_, &st) != 0) {
+                err = "could not stat " + path_;
+                return false;
+            }
+            uint64_t fileSize = static_cast<uint64_t>(st.st_size);
+            if (fileSize < headerBytes_) {
+                err = path_ + " is not an equivalence class label dictionary";
+                return false;
+            }
+            if (fileSize != mappedSize_) {
+                unmap_();
+                void* addr = ::mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd_, 0);
+                if (addr == MAP_FAILED) {
+                    err = "could not map " + path_;
+                    return false;
+                }
+                data_ = static_cast<const char*>(addr);
+                mappedSize_ = fileSize;
+            }
+            if (indexedEnd_ == 0) {
+                uint32_t v{0};
+                std::memcpy(&v, data_ + magicBytes_, sizeof(v));
+                if (std::memcmp(data_, magic_(), magicBytes_) != 0 or v != version) {
+                    err = path_ + " is not a (version " + std::to_string(version) +
+                          ") equivalence class label dictionary";
+                    return false;
+                }
+                indexedEnd_ = headerBytes_;
+            }
+            uint64_t pos = indexedEnd_;
+            while (pos + sizeof(uint32_t) <= mappedSize_) {
+                uint32_t size{0};
+                std::memcpy(&size, data_ + pos, sizeof(size));
+                uint64_t recBytes = sizeof(uint32_t) * (uint64_t(size) + 1);
+                if (pos + recBytes > mappedSize_) { break; }
+                const uint32_t* tids = reinterpret_cast<const uint32_t*>(data_ + pos + sizeof(uint32_t));
+                index_.emplace(hash_(tids, size), pos);
+                ++numLabels_;
+                pos += recBytes;
+            }
+            indexedEnd_ = pos;
+            // A partial record at the end was left by a process that died while appending it
+            if (indexedEnd_ < mappedSize_ and ::ftruncate(fd_, indexedEnd_) != 0) {
+                err = "could not truncate the partial record at the end of " + path_;
+                return false;
+            }
+            return true;
+        }
+
+        void unmap_() {
+            if (data_) { ::munmap(const_cast<char*>(data_), mappedSize_); }
+            data_ = nullptr;
+            mappedSize_ = 0;
+        }
+
+        // The 8 bytes (with its terminator) that start the file
+        static const char* magic_() { return "SLMEQLD"; }
+        static constexpr size_t magicBytes_ = 8;
+        static constexpr size_t headerBytes_ = magicBytes_ + 4 + 4 + 8;
+
+        std::string path_;
+        int fd_{-1};
+        const char* data_{nullptr};
+        uint64_t mappedSize_{0};
+        uint64_t indexedEnd_{0};
+        size_t numLabels_{0};
+        size_t numAdded_{0};
+        std::unordered_multimap<size_t, uint64_t> index_;
+};
+
+#endif // __EQ_LABEL_DICTIONARY_HPP__
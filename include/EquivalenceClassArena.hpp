@@ -0,0 +1,165 @@
+#ifndef EQUIVALENCE_CLASS_ARENA_HPP
+#define EQUIVALENCE_CLASS_ARENA_HPP
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#include "MemoryPlacement.hpp"
+
+/**
+ * A struct-of-arrays representation of a finished set of equivalence
+ * classes.  Rather than holding a separate label vector and separate
+ * weight vectors for every class, the labels and weights of all classes
+ * are laid out back-to-back in a few large buffers.  The members of class
+ * `i` occupy the half-open range [offsets[i], offsets[i+1]) of `labels`,
+ * `weights`, `posWeights` and `combinedWeights`.
+ *
+ * The buffers are sized exactly once (in reserve()), so filling the arena
+ * performs a constant number of allocations regardless of the number of
+ * equivalence classes, and the inference routines can simply stream over
+ * contiguous memory.
+ */
+class EquivalenceClassArena {
+    public:
+        EquivalenceClassArena() : offsets(1, 0) {}
+
+        /**
+         * Allocate space for `numClassesIn` classes having a total of
+         * `numEntries` transcripts among all of their labels.
+         */
+        void reserve(size_t numClassesIn, size_t numEntries) {
+            offsets.reserve(numClassesIn + 1);
+            counts.reserve(numClassesIn);
+            valid.reserve(numClassesIn);
+            hasPosWeights.reserve(numClassesIn);
+            labels.reserve(numEntries);
+            weights.reserve(numEntries);
+            posWeights.reserve(numEntries);
+            combinedWeights.reserve(numEntries);
+        }
+
+        /**
+         * Append a class with the label given by [txpBegin, txpEnd).  The
+         * auxiliary weights are copied from `weightIt`, and the positional
+         * weights from `posWeightIt` if `havePosWeights` is true (otherwise
+         * they are set to 0 and must be filled in by the caller).
+         */
+        template <typename TxpIt, typename WeightIt, typename PosWeightIt>
+        void addClass(TxpIt txpBegin, TxpIt txpEnd,
+                      WeightIt weightIt, PosWeightIt posWeightIt,
+                      bool havePosWeights, uint64_t count) {
+            for (auto it = txpBegin; it != txpEnd; ++it, ++weightIt) {
+                labels.push_back(*it);
+                weights.push_back(*weightIt);
+                if (havePosWeights) {
+                    posWeights.push_back(*posWeightIt);
+                    ++posWeightIt;
+                } else {
+                    posWeights.push_back(0.0);
+                }
+                combinedWeights.push_back(0.0);
+            }
+            offsets.push_back(labels.size());
+            counts.push_back(count);
+            valid.push_back(1);
+            hasPosWeights.push_back(havePosWeights ? 1 : 0);
+        }
+
+        void clear() {
+            std::vector<uint64_t>(1, 0).swap(offsets);
+            std::vector<uint64_t>().swap(counts);
+            std::vector<uint8_t>().swap(valid);
+            std::vector<uint8_t>().swap(hasPosWeights);
+            std::vector<uint32_t>().swap(labels);
+            std::vector<double>().swap(weights);
+            std::vector<double>().swap(posWeights);
+            std::vector<double>().swap(combinedWeights);
+            std::vector<float>().swap(singlePrecisionWeights);
+        }
+
+        /**
+         * Store a single-precision copy of combinedWeights, which the
+         * inference kernels will read in place of the double-precision
+         * weights (halving the bytes moved per round); the kernels still
+         * accumulate in double precision.  This must be called again
+         * whenever combinedWeights changes.
+         */
+        void storeSinglePrecisionWeights() {
+            singlePrecisionWeights.assign(combinedWeights.begin(), combinedWeights.end());
+        }
+
+        void releaseSinglePrecisionWeights() {
+            std::vector<float>().swap(singlePrecisionWeights);
+        }
+
+        inline bool hasSinglePrecisionWeights() const {
+            return !singlePrecisionWeights.empty();
+        }
+
+        /**
+         * Ask for the (large) per-entry buffers to be backed by transparent
+         * huge pages; returns the number of buffers for which the request
+         * was accepted.
+         */
+        size_t adviseHugePages() const {
+            size_t numAdvised{0};
+            numAdvised += salmon::utils::adviseHugePages(offsets) ? 1 : 0;
+            numAdvised += salmon::utils::adviseHugePages(labels) ? 1 : 0;
+            numAdvised += salmon::utils::adviseHugePages(weights) ? 1 : 0;
+            numAdvised += salmon::utils::adviseHugePages(posWeights) ? 1 : 0;
+            numAdvised += salmon::utils::adviseHugePages(combinedWeights) ? 1 : 0;
+            numAdvised += salmon::utils::adviseHugePages(singlePrecisionWeights) ? 1 : 0;
+            return numAdvised;
+        }
+
+        /**
+         * The (sorted) ids of the transcripts, among the first
+         * numTranscripts, that appear in the label of at least one valid
+         * class.  Only these transcripts can be assigned fragments, so the
+         * per-transcript work of the optimizer can be restricted to them.
+         */
+        std::vector<uint32_t> activeTranscripts(size_t numTranscripts) const {
+            std::vector<uint8_t> present(numTranscripts, 0);
+            for (size_t eqID = 0; eqID < numClasses(); ++eqID) {
+                if (!valid[eqID]) { continue; }
+                for (size_t i = offsets[eqID]; i < offsets[eqID + 1]; ++i) {
+                    present[labels[i]] = 1;
+                }
+            }
+            std::vector<uint32_t> active;
+            for (size_t t = 0; t < numTranscripts; ++t) {
+                if (present[t]) { active.push_back(t); }
+            }
+            return active;
+        }
+
+        inline size_t numClasses() const { return counts.size(); }
+        inline size_t numEntries() const { return labels.size(); }
+        inline size_t classSize(size_t eqID) const {
+            return offsets[eqID + 1] - offsets[eqID];
+        }
+
+        // offsets[i] is the index of the first entry of class i; there
+        // are numClasses() + 1 offsets.
+        std::vector<uint64_t> offsets;
+        // The number of fragments in each class.
+        std::vector<uint64_t> counts;
+        // Non-zero if the class should be considered during inference.
+        std::vector<uint8_t> valid;
+        // Non-zero if positional weights were recorded for the class.
+        std::vector<uint8_t> hasPosWeights;
+        // The concatenated labels of all classes.
+        std::vector<uint32_t> labels;
+        // The auxiliary (alignment) weights of each entry.
+        std::vector<double> weights;
+        // The positional weights of each entry.
+        std::vector<double> posWeights;
+        // The combined auxiliary and position weights.  These
+        // are filled in by the inference algorithm.
+        std::vector<double> combinedWeights;
+        // If non-empty, a single-precision copy of combinedWeights.
+        std::vector<float> singlePrecisionWeights;
+};
+
+#endif // EQUIVALENCE_CLASS_ARENA_HPP
@@ -1,6 +1,7 @@
 #ifndef EQUIVALENCE_CLASS_BUILDER_HPP
 #define EQUIVALENCE_CLASS_BUILDER_HPP
 
+#include <algorithm>
 #include <unordered_map>
 #include <vector>
 #include <thread>
@@ -10,10 +11,18 @@
 // Logger includes
 #include "spdlog/spdlog.h"
 
+#include "tbb/blocked_range.h"
+#include "tbb/parallel_for.h"
+#include "tbb/spin_rw_mutex.h"
+
 #include "cuckoohash_map.hh"
 #include "concurrentqueue.h"
 #include "SalmonUtils.hpp"
 #include "TranscriptGroup.hpp"
+#include "EquivalenceClassArena.hpp"
+#include "EquivalenceClassMerge.hpp"
+#include "EquivalenceClassSpill.hpp"
+#include "UMIDeduplicator.hpp"
 
 
 struct TGValue {
@@ -56,47 +65,240 @@ struct TGValue {
     mutable std::vector<tbb::atomic<double>> weights;
     mutable std::vector<tbb::atomic<double>> posWeights;
 
-    // The combined auxiliary and position weights.  These
-    // are filled in by the inference algorithm.
+    // The combined auxiliary and position weights.  Once the
+    // builder is finished, the weights of every class live in
+    // the EquivalenceClassArena, and these vectors are empty.
     mutable std::vector<double> combinedWeights;
     std::atomic<uint64_t> count{0};
 };
 
 class EquivalenceClassBuilder {
     public:
-        EquivalenceClassBuilder(std::shared_ptr<spdlog::logger> loggerIn) :
+        EquivalenceClassBuilder(std::shared_ptr<spdlog::logger> loggerIn, size_t reserveClasses = 1000000) :
 		logger_(loggerIn) {
-            countMap_.reserve(1000000);
+            countMap_.reserve(reserveClasses);
         }
 
         ~EquivalenceClassBuilder() {}
 
         void start() { active_ = true; }
 
+        // The number of classes observed so far (which may be read while they're being added;
+        // those spilled to disk aren't counted until finish())
+        size_t numClasses() const { return countVec_.empty() ? countMap_.size() : countVec_.size(); }
+
+        /**
+         * Copy the classes observed so far, while they're still being added
+         * (see AbundanceSnapshotWriter): the transcripts of class i are
+         * labels[offsets[i], offsets[i+1]), with the (normalized) auxiliary
+         * weights in weights, and counts[i] fragments.  The table is locked
+         * only for as long as the copy takes; the classes spilled to disk
+         * aren't included.  Returns the number of classes copied.
+         */
+        size_t snapshot(std::vector<uint32_t>& labels,
+                        std::vector<double>& weights,
+                        std::vector<uint64_t>& offsets,
+                        std::vector<uint64_t>& counts) {
+            labels.clear();
+            weights.clear();
+            offsets.assign(1, 0);
+            counts.clear();
+            if (!active_ or !countVec_.empty()) { return 0; }
+            auto lt = countMap_.lock_table();
+            for (auto& kv : lt) {
+                auto& v = kv.second;
+                uint64_t count = v.count.load();
+                if (count == 0) { continue; }
+                auto& txps = kv.first.txps;
+                double sumOfAux{0.0};
+                for (auto& w : v.weights) { sumOfAux += w.load(); }
+                double norm = (sumOfAux > 0.0) ? 1.0 / sumOfAux : 0.0;
+                for (size_t i = 0; i < txps.size(); ++i) {
+                    labels.push_back(txps[i]);
+                    weights.push_back(v.weights[i].load() * norm);
+                }
+                offsets.push_back(labels.size());
+                counts.push_back(count);
+            }
+            return counts.size();
+        }
+
+        /**
+         * Spill the classes of the table to runs in dir (see
+         * EquivalenceClassSpill) whenever it holds maxClasses of them, and
+         * merge the runs in finish(); false if dir can't be created.
+         */
+        bool enableSpill(const boost::filesystem::path& dir, size_t maxClasses) {
+            spill_.reset(new EquivalenceClassSpill(dir));
+            spillClasses_ = std::max(maxClasses, size_t(1));
+            if (!spill_->create()) {
+                spill_.reset();
+                return false;
+            }
+            return true;
+        }
+
+        /**
+         * Count the molecules, rather than the fragments, of each class:
+         * the fragments recorded with addUMI() are deduplicated by UMI
+         * (see UMIDeduplicator) when the classes are finished.  The
+         * weights of a class are still summed over all of its fragments.
+         */
+        void enableUMIDeduplication(bool collapseOneEdit) {
+            umis_.reset(new UMIDeduplicator(collapseOneEdit));
+        }
+
+        bool deduplicatesUMIs() const { return umis_ != nullptr; }
+
+        /**
+         * Collapse the classes to genes (--geneLevelOnly): the label of
+         * every class added from now on is replaced by the (sorted,
+         * distinct) genes of its transcripts, geneIDs[t] being the gene of
+         * transcript t, and the weights of the transcripts of each gene
+         * are summed.  The classes whose transcripts come from the same
+         * genes are thereby merged, leaving far fewer (and shorter) ones.
+         */
+        void projectToGenes(std::vector<uint32_t> geneIDs) { geneIDs_ = std::move(geneIDs); }
+
+        bool projectsToGenes() const { return !geneIDs_.empty(); }
+
+        // Record the UMI (if hasUMI) of a fragment added to the class g
+        inline void addUMI(const TranscriptGroup& g, bool hasUMI, uint64_t umi) {
+            umis_->add(g.hash, hasUMI, umi);
+        }
+
         bool finish() {
             active_ = false;
             size_t totalCount{0};
-            auto lt = countMap_.lock_table();
-            for (auto& kv : lt) {
-                kv.second.normalizeAux();
-                totalCount += kv.second.count;
-                countVec_.push_back(kv);
+            if (spill_ and spill_->numRuns() > 0) {
+                finishSpilled_(totalCount);
+            } else {
+                finishTable_(totalCount);
             }
+            spill_.reset();
+            bool deduplicated = (umis_ != nullptr);
+            umis_.reset();
+            // Nothing reads the table once countVec_ is built; release it
+            // (and its buckets) rather than keep a second copy of the labels
+            countMap_.clear();
+            countMap_.reserve(0);
 
     	    logger_->info("Computed {} rich equivalence classes "
 			  "for further processing", countVec_.size());
-            logger_->info("Counted {} total reads in the equivalence classes ",
-                    totalCount);
+            logger_->info("Counted {} total {} in the equivalence classes ",
+                    totalCount, deduplicated ? "molecules (distinct UMIs)" : "reads");
             return true;
         }
 
-        inline void addGroup(TranscriptGroup&& g,
+        /**
+         * Merge the classes whose weights are within tolerance of each
+         * other, and fold those of fewer than minCount fragments into their
+         * nearest neighbours (see salmon::eqclass::ClassMerger), rebuilding
+         * the arena and eqVec(); only valid after finish().  Returns the
+         * number of classes removed.
+         */
+        size_t mergeSimilarClasses(double tolerance, uint64_t minCount) {
+            size_t numBefore = arena_.numClasses();
+            salmon::eqclass::ClassMerger merger(tolerance, minCount);
+            arena_ = merger.merge(arena_);
+            std::vector<std::pair<const TranscriptGroup, TGValue>>().swap(countVec_);
+            countVec_.reserve(arena_.numClasses());
+            std::vector<double> noWeights;
+            std::vector<uint32_t> label;
+            for (size_t i = 0; i < arena_.numClasses(); ++i) {
+                label.assign(arena_.labels.begin() + arena_.offsets[i],
+                             arena_.labels.begin() + arena_.offsets[i + 1]);
+                countVec_.emplace_back(TranscriptGroup(label), TGValue(noWeights, noWeights, arena_.counts[i]));
+            }
+            size_t numRemoved = numBefore - arena_.numClasses();
+            logger_->info("Merged similar equivalence classes: {} of {} remain",
+                          arena_.numClasses(), numBefore);
+            return numRemoved;
+        }
+
+        inline void addGroup(const TranscriptGroup& g,
                              std::vector<double>& weights,
 			     std::vector<double>& posWeights) {
+            addGroup(g, weights, posWeights, 1);
+        }
+
+        /**
+         * Add `count` observations of the label `g` at once.  The
+         * `weights` and `posWeights` are the *summed* weights of
+         * those observations.  This is used to merge the contents
+         * of a thread-local builder into the global table.
+         */
+        inline void addGroup(const TranscriptGroup& g,
+                             std::vector<double>& weights,
+			     std::vector<double>& posWeights,
+                             uint64_t count) {
+            if (!geneIDs_.empty()) {
+                // The label (and weights) of each thread are projected in
+                // its own scratch space
+                static thread_local GeneProjection p;
+                project_(g, weights, posWeights, p);
+                addGroup_(p.group, p.weights, p.posWeights, count);
+                return;
+            }
+            addGroup_(g, weights, posWeights, count);
+        }
+
+        std::vector<std::pair<const TranscriptGroup, TGValue>>& eqVec() {
+            return countVec_;
+        }
+
+        /**
+         * The flattened labels and weights of the equivalence classes;
+         * the i-th class of the arena corresponds to eqVec()[i].  Only
+         * valid after finish() has been called.
+         */
+        EquivalenceClassArena& eqArena() {
+            return arena_;
+        }
+
+    private:
+        struct GeneProjection {
+            std::vector<std::pair<uint32_t, uint32_t>> genes;
+            std::vector<uint32_t> label;
+            TranscriptGroup group;
+            std::vector<double> weights;
+            std::vector<double> posWeights;
+        };
+
+        // The gene-level label and (summed) weights of the class g, into p
+        void project_(const TranscriptGroup& g,
+                      const std::vector<double>& weights,
+                      const std::vector<double>& posWeights,
+                      GeneProjection& p) {
+            bool havePosWeights = (weights.size() == posWeights.size());
+            p.genes.clear();
+            for (uint32_t i = 0; i < g.txps.size(); ++i) {
+                p.genes.emplace_back(geneIDs_[g.txps[i]], i);
+            }
+            std::sort(p.genes.begin(), p.genes.end());
+            p.label.clear();
+            p.weights.clear();
+            p.posWeights.clear();
+            for (auto& gi : p.genes) {
+                if (p.label.empty() or p.label.back() != gi.first) {
+                    p.label.push_back(gi.first);
+                    p.weights.push_back(0.0);
+                    if (havePosWeights) { p.posWeights.push_back(0.0); }
+                }
+                p.weights.back() += weights[gi.second];
+                if (havePosWeights) { p.posWeights.back() += posWeights[gi.second]; }
+            }
+            p.group.assign(p.label);
+        }
 
-            auto upfn = [&weights, &posWeights](TGValue& x) -> void {
+        inline void addGroup_(const TranscriptGroup& g,
+                              std::vector<double>& weights,
+                              std::vector<double>& posWeights,
+                              uint64_t count) {
+
+            auto upfn = [&weights, &posWeights, count](TGValue& x) -> void {
                 // update the count
-                x.count++;
+                x.count += count;
                 // update the weights
 
 		// If we have positional weights
@@ -112,19 +314,228 @@ class EquivalenceClassBuilder {
 		  }
 		}
             };
-            TGValue v(weights, posWeights, 1);
-            countMap_.upsert(g, upfn, v);
+            if (!spill_) {
+                insert_(g, weights, posWeights, count, upfn);
+                return;
+            }
+            // A spill empties the table, so it waits for the insertions in
+            // progress, and they for it
+            {
+                tbb::spin_rw_mutex::scoped_lock lock(spillMutex_, false);
+                insert_(g, weights, posWeights, count, upfn);
+            }
+            if (countMap_.size() >= spillClasses_) { spillTable_(); }
         }
 
-        std::vector<std::pair<const TranscriptGroup, TGValue>>& eqVec() {
-            return countVec_;
+        template <typename UpdateFn>
+        inline void insert_(const TranscriptGroup& g,
+                            std::vector<double>& weights,
+                            std::vector<double>& posWeights,
+                            uint64_t count, UpdateFn& upfn) {
+            // Most labels have been seen before, so first try a plain
+            // update; this avoids building a new TGValue for every call.
+            if (!countMap_.update_fn(g, upfn)) {
+                TGValue v(weights, posWeights, count);
+                countMap_.upsert(g, upfn, v);
+            }
+        }
+
+        // Move the classes of the table into the arena and countVec_
+        void finishTable_(size_t& totalCount) {
+            auto lt = countMap_.lock_table();
+
+            std::vector<std::pair<const TranscriptGroup, TGValue>*> classes;
+            size_t numEntries{0};
+            for (auto& kv : lt) {
+                classes.push_back(&kv);
+                numEntries += kv.first.txps.size();
+            }
+            arena_.reserve(classes.size(), numEntries);
+            countVec_.reserve(classes.size());
+
+            // Each class is normalized (and deduplicated) independently of the others
+            UMIDeduplicator* umis = umis_.get();
+            tbb::parallel_for(tbb::blocked_range<size_t>(0, classes.size()),
+                    [&classes, umis](const tbb::blocked_range<size_t>& r) -> void {
+                        for (size_t i = r.begin(); i != r.end(); ++i) {
+                            auto& v = classes[i]->second;
+                            v.normalizeAux();
+                            if (umis) { v.count = umis->numMolecules(classes[i]->first.hash, v.count); }
+                        }
+                    });
+
+            // The weights of each class are moved into the flat arena,
+            // and freed from the table right away, so that they're never
+            // held twice; the entries of countVec_ keep only the label
+            // and the count (the labels are the table's keys, which are
+            // const, so they're copied).
+            std::vector<double> noWeights;
+            for (auto kvp : classes) {
+                auto& v = kvp->second;
+                totalCount += v.count;
+                bool hasPosWeights = (v.posWeights.size() == v.weights.size());
+                arena_.addClass(kvp->first.txps.begin(), kvp->first.txps.end(),
+                                v.weights.begin(), v.posWeights.begin(),
+                                hasPosWeights, v.count);
+                countVec_.emplace_back(kvp->first, TGValue(noWeights, noWeights, v.count));
+                std::vector<tbb::atomic<double>>().swap(v.weights);
+                std::vector<tbb::atomic<double>>().swap(v.posWeights);
+                std::vector<double>().swap(v.combinedWeights);
+            }
+        }
+
+        // Write the classes of the table to a new run, and empty it
+        void writeRun_() {
+            {
+                auto lt = countMap_.lock_table();
+                std::vector<const std::pair<const TranscriptGroup, TGValue>*> classes;
+                for (auto& kv : lt) { classes.push_back(&kv); }
+                std::sort(classes.begin(), classes.end(),
+                          [](const std::pair<const TranscriptGroup, TGValue>* a,
+                             const std::pair<const TranscriptGroup, TGValue>* b) -> bool {
+                              if (a->first.hash != b->first.hash) { return a->first.hash < b->first.hash; }
+                              return std::lexicographical_compare(a->first.txps.begin(), a->first.txps.end(),
+                                                                  b->first.txps.begin(), b->first.txps.end());
+                          });
+                bool written = spill_->writeRun(classes,
+                        [](const std::pair<const TranscriptGroup, TGValue>* kv,
+                           EquivalenceClassSpill::Record& r) -> void {
+                            r.hash = kv->first.hash;
+                            r.label.assign(kv->first.txps.begin(), kv->first.txps.end());
+                            r.count = kv->second.count;
+                            r.weights.assign(kv->second.weights.begin(), kv->second.weights.end());
+                            r.posWeights.assign(kv->second.posWeights.begin(), kv->second.posWeights.end());
+                        });
+                if (!written) {
+                    logger_->error("Could not write the equivalence classes to {}",
+                                   spill_->directory().string());
+                    std::exit(1);
+                }
+                logger_->info("Spilled {} equivalence classes to disk (run {})",
+                              classes.size(), spill_->numRuns());
+            }
+            countMap_.clear();
+        }
+
+        void spillTable_() {
+            tbb::spin_rw_mutex::scoped_lock lock(spillMutex_, true);
+            // Another thread may have spilled the table while this one waited
+            if (countMap_.size() < spillClasses_) { return; }
+            writeRun_();
+        }
+
+        // Spill what's left of the table, and merge the runs into the arena and countVec_
+        void finishSpilled_(size_t& totalCount) {
+            if (countMap_.size() > 0) { writeRun_(); }
+            std::vector<double> noWeights;
+            bool merged = spill_->merge([&](EquivalenceClassSpill::Record& r) -> void {
+                // As TGValue::normalizeAux
+                double sumOfAux{0.0};
+                for (auto w : r.weights) { sumOfAux += w; }
+                double norm = 1.0 / sumOfAux;
+                for (auto& w : r.weights) { w *= norm; }
+                bool hasPosWeights = (r.posWeights.size() == r.weights.size());
+                if (hasPosWeights) {
+                    double posNorm = 1.0 / r.count;
+                    for (auto& w : r.posWeights) { w *= posNorm; }
+                }
+                if (umis_) { r.count = umis_->numMolecules(r.hash, r.count); }
+                totalCount += r.count;
+                arena_.addClass(r.label.begin(), r.label.end(), r.weights.begin(), r.posWeights.begin(),
+                                hasPosWeights, r.count);
+                countVec_.emplace_back(TranscriptGroup(r.label, r.hash), TGValue(noWeights, noWeights, r.count));
+            });
+            if (!merged) {
+                logger_->error("Could not read the equivalence classes spilled to {}",
+                               spill_->directory().string());
+                std::exit(1);
+            }
+            logger_->info("Merged {} spilled equivalence classes from {} runs",
+                          spill_->numSpilledClasses(), spill_->numRuns());
         }
 
-    private:
         std::atomic<bool> active_;
 	    cuckoohash_map<TranscriptGroup, TGValue, TranscriptGroupHasher> countMap_;
         std::vector<std::pair<const TranscriptGroup, TGValue>> countVec_;
+        EquivalenceClassArena arena_;
     	std::shared_ptr<spdlog::logger> logger_;
+        // The runs of classes spilled to disk (unless none are)
+        std::unique_ptr<EquivalenceClassSpill> spill_{nullptr};
+        size_t spillClasses_{0};
+        tbb::spin_rw_mutex spillMutex_;
+        // The UMIs of the classes, if they're deduplicated
+        std::unique_ptr<UMIDeduplicator> umis_{nullptr};
+        // If non-empty, the gene of each transcript, to which the labels are projected
+        std::vector<uint32_t> geneIDs_;
+};
+
+/**
+ * The value type of the thread-local table; since it is only touched
+ * by a single thread, it needs no atomics.
+ */
+struct LocalTGValue {
+    std::vector<double> weights;
+    std::vector<double> posWeights;
+    uint64_t count{0};
+};
+
+/**
+ * A per-thread equivalence class table.  Labels are accumulated here
+ * without any synchronization, and the table is periodically merged
+ * (e.g. once per mini-batch) into the shared EquivalenceClassBuilder
+ * by calling flush().  Since merging simply sums the counts and the
+ * weights, the final equivalence classes are the same as those
+ * obtained by adding each fragment to the global builder directly.
+ */
+class LocalEquivalenceClassBuilder {
+    public:
+        LocalEquivalenceClassBuilder(EquivalenceClassBuilder& globalIn) :
+            global_(globalIn) {}
+
+        ~LocalEquivalenceClassBuilder() { flush(); }
+
+        inline void addGroup(const TranscriptGroup& g,
+                             std::vector<double>& weights,
+                             std::vector<double>& posWeights) {
+            auto it = countMap_.find(g);
+            if (it == countMap_.end()) {
+                LocalTGValue v;
+                v.weights.assign(weights.begin(), weights.end());
+                v.posWeights.assign(posWeights.begin(), posWeights.end());
+                v.count = 1;
+                countMap_.emplace(g, std::move(v));
+            } else {
+                auto& x = it->second;
+                ++x.count;
+                for (size_t i = 0; i < x.weights.size(); ++i) {
+                    x.weights[i] += weights[i];
+                }
+                // If we have positional weights
+                if (weights.size() == posWeights.size()) {
+                    for (size_t i = 0; i < x.posWeights.size(); ++i) {
+                        x.posWeights[i] += posWeights[i];
+                    }
+                }
+            }
+        }
+
+        /**
+         * Merge all of the locally accumulated labels into the global
+         * builder and clear the local table.
+         */
+        void flush() {
+            for (auto& kv : countMap_) {
+                auto& v = kv.second;
+                global_.addGroup(kv.first, v.weights, v.posWeights, v.count);
+            }
+            countMap_.clear();
+        }
+
+        size_t size() const { return countMap_.size(); }
+
+    private:
+        EquivalenceClassBuilder& global_;
+        std::unordered_map<TranscriptGroup, LocalTGValue, TranscriptGroupHasher> countMap_;
 };
 
 #endif // EQUIVALENCE_CLASS_BUILDER_HPP
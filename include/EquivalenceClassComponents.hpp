@@ -0,0 +1,32 @@
+#ifndef EQUIVALENCE_CLASS_COMPONENTS_HPP
+#define EQUIVALENCE_CLASS_COMPONENTS_HPP
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#include "EquivalenceClassArena.hpp"
+
+/**
+ * The connected components of the graph in which two transcripts are
+ * adjacent if they appear together in a (valid) equivalence class.  The
+ * classes and transcripts of component `c` are
+ * classes[classOffsets[c], classOffsets[c+1]) and
+ * txps[txpOffsets[c], txpOffsets[c+1]).  The components are ordered by
+ * decreasing size (total label length), so that the largest ones are
+ * started first when they are processed in parallel.
+ */
+struct EqClassComponents {
+    std::vector<uint32_t> classes;
+    std::vector<size_t> classOffsets;
+    std::vector<uint32_t> txps;
+    std::vector<size_t> txpOffsets;
+
+    inline size_t numComponents() const { return classOffsets.size() - 1; }
+};
+
+// The components of the valid classes of eqArena over numTranscripts transcripts
+EqClassComponents buildEqClassComponents(const EquivalenceClassArena& eqArena,
+                                         size_t numTranscripts);
+
+#endif // EQUIVALENCE_CLASS_COMPONENTS_HPP
@@ -0,0 +1,214 @@
+#ifndef EQUIVALENCE_CLASS_MERGE_HPP
+#define EQUIVALENCE_CLASS_MERGE_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <boost/functional/hash.hpp>
+
+#include "EquivalenceClassArena.hpp"
+
+namespace salmon {
+namespace eqclass {
+
+/**
+ * Merge the rich equivalence classes of an arena whose (normalized)
+ * auxiliary weight vectors are within `tolerance` of each other, in L1
+ * distance over the union of their labels; a middle ground between the
+ * rich classes and --noRichEqClasses, which drops the weights altogether.
+ *
+ * Every class holds a distinct label, so classes can only be within the
+ * tolerance when the transcripts by which their labels differ carry little
+ * weight.  The candidates for merging are hence the classes with the same
+ * "core": the transcripts whose weight is at least the tolerance.  Each
+ * class joins the first cluster of its core (of the first maxCandidates)
+ * whose mean weights are within the tolerance of its own, or else starts
+ * a cluster.  A cluster's label is the union of those of its classes (so
+ * no transcript loses any fragment it could be assigned), its count their
+ * sum, and its weights (and positional weights) their count-weighted mean.
+ *
+ * Then, if minCount > 0, each cluster with fewer fragments is folded into
+ * its nearest cluster (in L1 distance) among those with the same dominant
+ * (highest-weight) transcript, if it has any.
+ *
+ * Only classes with the same kind of weights (positional or not) merge.
+ */
+class ClassMerger {
+    public:
+        static constexpr size_t maxCandidates = 64;
+
+        ClassMerger(double tolerance, uint64_t minCount) :
+            tolerance_(tolerance), minCount_(minCount) {}
+
+        EquivalenceClassArena merge(const EquivalenceClassArena& in) {
+            clusters_.clear();
+            byCore_.clear();
+            std::vector<uint32_t> core;
+            for (size_t eqID = 0; eqID < in.numClasses(); ++eqID) {
+                if (!in.valid[eqID]) { continue; }
+                Cluster c = fromClass_(in, eqID);
+                core.clear();
+                for (size_t i = 0; i < c.label.size(); ++i) {
+                    if (c.weights[i] >= tolerance_ * c.count) { core.push_back(c.label[i]); }
+                }
+                core.push_back(c.hasPosWeights ? 1 : 0);
+                auto& candidates = byCore_[core];
+                bool merged{false};
+                for (size_t k = 0; k < candidates.size() and k < maxCandidates; ++k) {
+                    auto& other = clusters_[candidates[k]];
+                    if (distance_(c, other) <= tolerance_) {
+                        absorb_(other, c);
+                        merged = true;
+                        break;
+                    }
+                }
+                if (!merged) {
+                    candidates.push_back(clusters_.size());
+                    clusters_.push_back(std::move(c));
+                }
+            }
+            if (minCount_ > 0) { foldRare_(); }
+
+            EquivalenceClassArena out;
+            size_t numEntries{0};
+            size_t numClasses{0};
+            for (auto& c : clusters_) {
+                if (c.count == 0) { continue; }
+                numEntries += c.label.size();
+                ++numClasses;
+            }
+            out.reserve(numClasses, numEntries);
+            for (auto& c : clusters_) {
+                if (c.count == 0) { continue; }
+                double norm = 1.0 / c.count;
+                for (auto& w : c.weights) { w *= norm; }
+                for (auto& w : c.posWeights) { w *= norm; }
+                out.addClass(c.label.begin(), c.label.end(), c.weights.begin(), c.posWeights.begin(),
+                             c.hasPosWeights, c.count);
+            }
+            return out;
+        }
+
+    private:
+        // The count-weighted sums of the weights of the classes of a cluster
+        struct Cluster {
+            std::vector<uint32_t> label;
+            std::vector<double> weights;
+            std::vector<double> posWeights;
+            bool hasPosWeights{false};
+            uint64_t count{0};
+        };
+
+        static Cluster fromClass_(const EquivalenceClassArena& in, size_t eqID) {
+            Cluster c;
+            size_t start = in.offsets[eqID];
+            size_t end = in.offsets[eqID + 1];
+            c.count = in.counts[eqID];
+            c.hasPosWeights = in.hasPosWeights[eqID];
+            double wsum{0.0};
+            for (size_t i = start; i < end; ++i) { wsum += in.weights[i]; }
+            double wnorm = (wsum > 0.0) ? 1.0 / wsum : 0.0;
+            for (size_t i = start; i < end; ++i) {
+                c.label.push_back(in.labels[i]);
+                c.weights.push_back(in.weights[i] * wnorm * c.count);
+                if (c.hasPosWeights) { c.posWeights.push_back(in.posWeights[i] * c.count); }
+            }
+            return c;
+        }
+
+        // The L1 distance between the mean weights of a and b
+        static double distance_(const Cluster& a, const Cluster& b) {
+            double na = 1.0 / a.count;
+            double nb = 1.0 / b.count;
+            double d{0.0};
+            size_t i{0}, j{0};
+            while (i < a.label.size() or j < b.label.size()) {
+                if (j == b.label.size() or (i < a.label.size() and a.label[i] < b.label[j])) {
+                    d += a.weights[i++] * na;
+                } else if (i == a.label.size() or b.label[j] < a.label[i]) {
+                    d += b.weights[j++] * nb;
+                } else {
+                    d += std::abs(a.weights[i++] * na - b.weights[j++] * nb);
+                }
+            }
+            return d;
+        }
+
+        // Add the classes of c to into (leaving c empty)
+        static void absorb_(Cluster& into, Cluster& c) {
+            Cluster m;
+            m.hasPosWeights = into.hasPosWeights;
+            m.count = into.count + c.count;
+            size_t i{0}, j{0};
+            auto take = [&m](const Cluster& x, size_t k) -> void {
+                m.label.push_back(x.label[k]);
+                m.weights.push_back(x.weights[k]);
+                if (m.hasPosWeights) { m.posWeights.push_back(x.posWeights[k]); }
+            };
+            while (i < into.label.size() or j < c.label.size()) {
+                if (j == c.label.size() or (i < into.label.size() and into.label[i] < c.label[j])) {
+                    take(into, i++);
+                } else if (i == into.label.size() or c.label[j] < into.label[i]) {
+                    take(c, j++);
+                } else {
+                    take(into, i);
+                    m.weights.back() += c.weights[j];
+                    if (m.hasPosWeights) { m.posWeights.back() += c.posWeights[j]; }
+                    ++i;
+                    ++j;
+                }
+            }
+            into = std::move(m);
+            c = Cluster();
+        }
+
+        static uint32_t dominant_(const Cluster& c) {
+            return c.label[std::max_element(c.weights.begin(), c.weights.end()) - c.weights.begin()];
+        }
+
+        void foldRare_() {
+            std::unordered_map<uint64_t, std::vector<size_t>> byDominant;
+            for (size_t k = 0; k < clusters_.size(); ++k) {
+                auto& c = clusters_[k];
+                if (c.count == 0) { continue; }
+                uint64_t key = (static_cast<uint64_t>(dominant_(c)) << 1) | (c.hasPosWeights ? 1 : 0);
+                byDominant[key].push_back(k);
+            }
+            for (auto& kv : byDominant) {
+                auto& members = kv.second;
+                if (members.size() < 2) { continue; }
+                for (auto k : members) {
+                    auto& c = clusters_[k];
+                    if (c.count == 0 or c.count >= minCount_) { continue; }
+                    size_t nearest = clusters_.size();
+                    double best{0.0};
+                    size_t numSeen{0};
+                    for (auto o : members) {
+                        if (o == k or clusters_[o].count == 0) { continue; }
+                        if (++numSeen > maxCandidates) { break; }
+                        double d = distance_(c, clusters_[o]);
+                        if (nearest == clusters_.size() or d < best) {
+                            nearest = o;
+                            best = d;
+                        }
+                    }
+                    if (nearest != clusters_.size()) { absorb_(clusters_[nearest], c); }
+                }
+            }
+        }
+
+        double tolerance_;
+        uint64_t minCount_;
+        std::vector<Cluster> clusters_;
+        std::unordered_map<std::vector<uint32_t>, std::vector<size_t>,
+                           boost::hash<std::vector<uint32_t>>> byCore_;
+};
+
+}
+}
+
+#endif // EQUIVALENCE_CLASS_MERGE_HPP
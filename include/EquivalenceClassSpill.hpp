@@ -0,0 +1,194 @@
+#ifndef __EQUIVALENCE_CLASS_SPILL_HPP__
+#define __EQUIVALENCE_CLASS_SPILL_HPP__
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+/**
+ * The runs of equivalence classes that an EquivalenceClassBuilder spills to
+ * disk once its table holds too many classes (salmon quant --eqClassSpill),
+ * so that references with a huge number of distinct classes (e.g.
+ * metagenomic or pan-transcriptome ones) don't need room for all of them
+ * in the concurrent table at once.  Each run holds the classes of the table
+ * when it was spilled, sorted by (label hash, label), with their summed
+ * counts and weights; merge() reads the runs back k-way in that order, and
+ * sums the counts and weights of the classes that appear in several runs
+ * (taking the positional weights of a run that has none as zeros).
+ *
+ * A run is a sequence of records of
+ *
+ *   uint64 hash, uint32 label size n, uint8 has positional weights,
+ *   n uint32 labels, uint64 count, n double weights,
+ *   (if it has positional weights) n double positional weights
+ *
+ * The runs (and their directory) are removed when the spill is destroyed.
+ */
+class EquivalenceClassSpill {
+    public:
+        struct Record {
+            uint64_t hash{0};
+            std::vector<uint32_t> label;
+            uint64_t count{0};
+            std::vector<double> weights;
+            std::vector<double> posWeights;
+
+            bool operator<(const Record& o) const {
+                return hash < o.hash or (hash == o.hash and label < o.label);
+            }
+            bool sameClass(const Record& o) const { return hash == o.hash and label == o.label; }
+        };
+
+        explicit EquivalenceClassSpill(const boost::filesystem::path& dir) : dir_(dir) {}
+
+        ~EquivalenceClassSpill() {
+            boost::system::error_code ec;
+            for (auto& r : runs_) { boost::filesystem::remove(r, ec); }
+            boost::filesystem::remove(dir_, ec);
+        }
+
+        // Create the directory of the runs; false if it can't be
+        bool create() {
+            boost::system::error_code ec;
+            boost::filesystem::create_directories(dir_, ec);
+            return !ec;
+        }
+
+        const boost::filesystem::path& directory() const { return dir_; }
+        size_t numRuns() const { return runs_.size(); }
+        uint64_t numSpilledClasses() const { return numSpilled_; }
+
+        /**
+         * Write a run of classes (pointers to the (label, value) pairs of
+         * the builder's table, sorted by (hash, label)), through
+         * recordOf(pair, record), which fills a record from a pair; the
+         * classes are written one at a time, rather than copied first.
+         * false if the run couldn't be written.
+         */
+        template <typename PairPtr, typename RecordFn>
+        bool writeRun(const std::vector<PairPtr>& classes, RecordFn recordOf) {
+            auto path = dir_ / ("run_" + std::to_string(runs_.size()) + ".bin");
+            std::ofstream out(path.string(), std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+            if (!out.good()) { return false; }
+            Record r;
+            for (auto kv : classes) {
+                recordOf(kv, r);
+                write_(out, r);
+            }
+            out.close();
+            if (!out.good()) { return false; }
+            runs_.push_back(path);
+            numSpilled_ += classes.size();
+            return true;
+        }
+
+        /**
+         * Call onClass(record) for each distinct class of the runs, in
+         * (hash, label) order, with the counts and weights of all of its
+         * occurrences summed.  false if a run couldn't be read.
+         */
+        template <typename ClassFn>
+        bool merge(ClassFn onClass) {
+            std::vector<std::unique_ptr<std::ifstream>> ins;
+            std::vector<Record> heads(runs_.size());
+            // The runs with a record left, the one with the smallest on top
+            auto greater = [&heads](size_t a, size_t b) -> bool { return heads[b] < heads[a]; };
+            std::priority_queue<size_t, std::vector<size_t>, decltype(greater)> pending(greater);
+            for (size_t i = 0; i < runs_.size(); ++i) {
+                ins.emplace_back(new std::ifstream(runs_[i].string(), std::ios_base::in | std::ios_base::binary));
+                if (!ins.back()->good()) { return false; }
+                if (read_(*ins.back(), heads[i])) { pending.push(i); }
+            }
+
+            Record acc;
+            bool haveAcc{false};
+            while (!pending.empty()) {
+                size_t i = pending.top();
+                pending.pop();
+                Record& r = heads[i];
+                if (haveAcc and acc.sameClass(r)) {
+                    acc.count += r.count;
+                    for (size_t j = 0; j < acc.weights.size(); ++j) { acc.weights[j] += r.weights[j]; }
+                    // An occurrence without positional weights counts as
+                    // zero weights, rather than dropping those of the others
+                    if (acc.posWeights.empty()) {
+                        std::swap(acc.posWeights, r.posWeights);
+                    } else if (!r.posWeights.empty()) {
+                        for (size_t j = 0; j < acc.posWeights.size(); ++j) { acc.posWeights[j] += r.posWeights[j]; }
+                    }
+                } else {
+                    if (haveAcc) { onClass(acc); }
+                    std::swap(acc, r);
+                    haveAcc = true;
+                }
+                if (read_(*ins[i], heads[i])) {
+                    pending.push(i);
+                } else if (ins[i]->bad()) {
+                    return false;
+                }
+            }
+            if (haveAcc) { onClass(acc); }
+            return true;
+        }
+
+    private:
+        template <typename T>
+        static void put_(std::ofstream& out, const T& v) {
+            out.write(reinterpret_cast<const char*>(&v), sizeof(v));
+        }
+
+        template <typename T>
+        static bool get_(std::ifstream& in, T& v) {
+            return static_cast<bool>(in.read(reinterpret_cast<char*>(&v), sizeof(v)));
+        }
+
+        static void write_(std::ofstream& out, const Record& r) {
+            uint32_t n = static_cast<uint32_t>(r.label.size());
+            uint8_t hasPos = (r.posWeights.size() == n) ? 1 : 0;
+            put_(out, r.hash);
+            put_(out, n);
+            put_(out, hasPos);
+            out.write(reinterpret_cast<const char*>(r.label.data()), n * sizeof(uint32_t));
+            put_(out, r.count);
+            out.write(reinterpret_cast<const char*>(r.weights.data()), n * sizeof(double));
+            if (hasPos) { out.write(reinterpret_cast<const char*>(r.posWeights.data()), n * sizeof(double)); }
+        }
+
+        // The next record of a run; false at its end, or (with badbit set) at a truncated record
+        static bool read_(std::ifstream& in, Record& r) {
+            uint32_t n{0};
+            uint8_t hasPos{0};
+            if (!get_(in, r.hash)) {
+                if (in.gcount() != 0) { in.setstate(std::ios_base::badbit); }
+                return false;
+            }
+            if (!get_(in, n) or !get_(in, hasPos)) {
+                in.setstate(std::ios_base::badbit);
+                return false;
+            }
+            r.label.resize(n);
+            r.weights.resize(n);
+            r.posWeights.resize(hasPos ? n : 0);
+            in.read(reinterpret_cast<char*>(r.label.data()), n * sizeof(uint32_t));
+            get_(in, r.count);
+            in.read(reinterpret_cast<char*>(r.weights.data()), n * sizeof(double));
+            if (hasPos) { in.read(reinterpret_cast<char*>(r.posWeights.data()), n * sizeof(double)); }
+            if (!in) {
+                in.setstate(std::ios_base::badbit);
+                return false;
+            }
+            return true;
+        }
+
+        boost::filesystem::path dir_;
+        std::vector<boost::filesystem::path> runs_;
+        uint64_t numSpilled_{0};
+};
+
+#endif // __EQUIVALENCE_CLASS_SPILL_HPP__
@@ -1,14 +1,26 @@
 #ifndef FASTA_PARSER
 #define FASTA_PARSER
 
+#include <cstdint>
+#include <string>
 #include <vector>
 
 class Transcript;
+class PackedSequenceStore;
+class CRAMReference;
 
 class FASTAParser {
 public:
     FASTAParser(const std::string& fname);
-    void populateTargets(std::vector<Transcript>& transcripts);
+    // The models read the sequences from packedStore; a character copy of
+    // each is only kept (for the sequence-specific bias model) if keepSequences.
+    // The records are processed by numThreads threads.  If given cramRef,
+    // each sequence is also written (as is) to it.
+    void populateTargets(std::vector<Transcript>& transcripts,
+                         PackedSequenceStore& packedStore,
+                         bool keepSequences = true,
+                         uint32_t numThreads = 1,
+                         CRAMReference* cramRef = nullptr);
 private:
     std::string fname_;
 };
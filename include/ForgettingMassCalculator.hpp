@@ -1,57 +1,55 @@
 #ifndef __FORGETTING_MASS_CALCULATOR__
 #define __FORGETTING_MASS_CALCULATOR__
 
-#include "SalmonSpinLock.hpp"
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
 #include "SalmonMath.hpp"
 #include "spdlog/spdlog.h"
 
+/**
+ * The forgetting mass schedule of the online phase: the log(forgetting
+ * mass), and its cumulative sum, at each mini-batch timestep.
+ *
+ * Every mapping / quantification thread takes a timestep at the start of
+ * each of its mini-batches, so this must not serialize them.  The timestep
+ * is an atomic counter, and the schedule is a table of fixed-size chunks
+ * that are computed (under a mutex, once per chunk) when the first
+ * timestep beyond the computed ones is taken; a chunk, once published, is
+ * never modified or moved, so the table is read without any locks.
+ */
 class ForgettingMassCalculator {
     public:
     ForgettingMassCalculator(double forgettingFactor = 0.65) :
-        batchNum_(0), forgettingFactor_(forgettingFactor),
-        logForgettingMass_(salmon::math::LOG_1),
-        logForgettingMasses_({}),
-        cumulativeLogForgettingMasses_({}){}
+        batchNum_(0), forgettingFactor_(forgettingFactor), numComputed_(0),
+        chunks_(new std::atomic<Chunk*>[maxChunks_]) {
+        for (size_t i = 0; i < maxChunks_; ++i) { chunks_[i].store(nullptr, std::memory_order_relaxed); }
+    }
+
+    ~ForgettingMassCalculator() {
+        for (size_t i = 0; i < maxChunks_; ++i) { delete chunks_[i].load(std::memory_order_relaxed); }
+    }
 
     ForgettingMassCalculator(const ForgettingMassCalculator&) = delete;
-    ForgettingMassCalculator(ForgettingMassCalculator&&) = default;
-    ForgettingMassCalculator& operator=(ForgettingMassCalculator&&) = default;
     ForgettingMassCalculator& operator=(const ForgettingMassCalculator&) = delete;
 
     /** Precompute the log(forgetting mass) and cumulative log(forgetting mass)
       * for the first numMiniBatches batches / timesteps.
       */
     bool prefill(uint64_t numMiniBatches) {
-        logForgettingMasses_.reserve(numMiniBatches);
-        cumulativeLogForgettingMasses_.reserve(numMiniBatches);
-
-        double fm = salmon::math::LOG_1;
-        logForgettingMasses_.push_back(fm);
-        cumulativeLogForgettingMasses_.push_back(fm);
-
-        for (size_t i = 2; i < numMiniBatches-1; ++i) {
-             fm += forgettingFactor_ * std::log(static_cast<double>(i-1)) -
-                std::log(std::pow(static_cast<double>(i), forgettingFactor_) - 1);
-            logForgettingMasses_.push_back(fm);
-            // fill in cumulative mass
-            cumulativeLogForgettingMasses_.push_back(
-                    salmon::math::logAdd(cumulativeLogForgettingMasses_.back(), fm));
-        }
+        if (numMiniBatches > 0) { ensureComputed_(numMiniBatches - 1); }
         return true;
     }
 
+    // The log(forgetting mass) of the next timestep
     double operator()() {
-#if defined __APPLE__
-        spin_lock::scoped_lock sl(ffMutex_);
-#else
-        std::lock_guard<std::mutex> lock(ffMutex_);
-#endif
-        ++batchNum_;
-        if (batchNum_ > 1) {
-            logForgettingMass_ += forgettingFactor_ * std::log(static_cast<double>(batchNum_-1)) -
-                std::log(std::pow(static_cast<double>(batchNum_), forgettingFactor_) - 1);
-        }
-        return logForgettingMass_;
+        double logForgettingMass{salmon::math::LOG_1};
+        uint64_t timestep{0};
+        getLogMassAndTimestep(logForgettingMass, timestep);
+        return logForgettingMass;
     }
 
 
@@ -62,77 +60,98 @@ class ForgettingMassCalculator {
       *  then do it now.
       */
     void getLogMassAndTimestep(double& logForgettingMass, uint64_t& currentMinibatchTimestep) {
-#if defined __APPLE__
-        spin_lock::scoped_lock sl(ffMutex_);
-#else
-        std::lock_guard<std::mutex> lock(ffMutex_);
-#endif
-        if (batchNum_ < logForgettingMasses_.size()) {
-            currentMinibatchTimestep = batchNum_;
-            logForgettingMass = logForgettingMasses_[batchNum_];
-            ++batchNum_;
-        } else {
-            double fm = logForgettingMasses_.back() + forgettingFactor_ *
-                    std::log(static_cast<double>(batchNum_-1)) -
-                    std::log(std::pow(static_cast<double>(batchNum_), forgettingFactor_) - 1);
-
-            logForgettingMasses_.push_back(fm);
-            cumulativeLogForgettingMasses_.push_back(
-                    salmon::math::logAdd(cumulativeLogForgettingMasses_.back(), fm));
-
-            currentMinibatchTimestep = batchNum_;
-            logForgettingMass = logForgettingMasses_[batchNum_];
-            ++batchNum_;
-        }
+        currentMinibatchTimestep = batchNum_.fetch_add(1, std::memory_order_relaxed);
+        ensureComputed_(currentMinibatchTimestep);
+        logForgettingMass = chunk_(currentMinibatchTimestep).logMass[currentMinibatchTimestep & chunkMask_];
     }
 
-    // Retrieve the log(forgetting mass) at a particular timestep.  This
-    // function assumes that the forgetting mass has already been computed
-    // for this timestep --- otherwise, this will result in a fatal error.
+    // Retrieve the log(forgetting mass) at a particular timestep (computing
+    // the schedule up to it, if it hasn't been already).
     double logMassAt(uint64_t timestep) {
-        if (timestep < logForgettingMasses_.size()) {
-            return logForgettingMasses_[timestep];
-        } else {
-            spdlog::get("jointLog")->error("Requested forgetting mass for timestep {} "
-                                      "where it has not yet been computed.  This "
-                                      "likely means that the ForgettingMassCalculator "
-                                      "class was being used incorrectly!  Please "
-                                      "report this crash on GitHub!\n", timestep);
-            std::exit(1);
-            return salmon::math::LOG_0;
-        }
+        ensureComputed_(timestep);
+        return chunk_(timestep).logMass[timestep & chunkMask_];
     }
 
-    // Retrieve the cumulative log(forgetting mass) at a particular timestep.
-    // This function assumes that the forgetting mass has already been computed
-    // for this timestep --- otherwise, this will result in a fatal error.
+    // Retrieve the cumulative log(forgetting mass) at a particular timestep
+    // (computing the schedule up to it, if it hasn't been already).
     double cumulativeLogMassAt(uint64_t timestep) {
-        if (timestep < cumulativeLogForgettingMasses_.size()) {
-            return cumulativeLogForgettingMasses_[timestep];
-        } else {
-            spdlog::get("jointLog")->error("Requested cumulative forgetting mass for timestep {} "
-                                      "where it has not yet been computed.  This "
-                                      "likely means that the ForgettingMassCalculator "
-                                      "class was being used incorrectly!  Please "
-                                      "report this crash on GitHub!\n", timestep);
-            std::exit(1);
-            return salmon::math::LOG_0;
-        }
+        ensureComputed_(timestep);
+        return chunk_(timestep).cumulativeLogMass[timestep & chunkMask_];
     }
 
-    uint64_t getCurrentTimestep() { return batchNum_; }
+    uint64_t getCurrentTimestep() { return batchNum_.load(std::memory_order_relaxed); }
 
     private:
-        uint64_t batchNum_;
+        static constexpr size_t chunkBits_ = 16;
+        static constexpr uint64_t chunkSize_ = uint64_t(1) << chunkBits_;
+        static constexpr uint64_t chunkMask_ = chunkSize_ - 1;
+        // Enough for 2^32 mini-batches
+        static constexpr size_t maxChunks_ = size_t(1) << (32 - chunkBits_);
+
+        struct Chunk {
+            double logMass[chunkSize_];
+            double cumulativeLogMass[chunkSize_];
+        };
+
+        inline const Chunk& chunk_(uint64_t timestep) const {
+            return *chunks_[timestep >> chunkBits_].load(std::memory_order_relaxed);
+        }
+
+        /**
+         * Make sure the schedule is computed up to (and including) the given
+         * timestep; this takes the lock only when it isn't.
+         */
+        inline void ensureComputed_(uint64_t timestep) {
+            if (timestep < numComputed_.load(std::memory_order_acquire)) { return; }
+            extend_(timestep);
+        }
+
+        void extend_(uint64_t timestep) {
+            std::lock_guard<std::mutex> lock(extendMutex_);
+            uint64_t n = numComputed_.load(std::memory_order_relaxed);
+            if (timestep < n) { return; }
+            if ((timestep >> chunkBits_) >= maxChunks_) {
+                spdlog::get("jointLog")->error("Requested forgetting mass for timestep {}, beyond "
+                                               "the largest supported timestep ({}).  Please "
+                                               "report this crash on GitHub!\n",
+                                               timestep, maxChunks_ * chunkSize_ - 1);
+                std::exit(1);
+            }
+            // Compute whole chunks, up to the one holding timestep
+            uint64_t end = ((timestep >> chunkBits_) + 1) << chunkBits_;
+            for (uint64_t t = n; t < end; ++t) {
+                if ((t & chunkMask_) == 0) {
+                    chunks_[t >> chunkBits_].store(new Chunk, std::memory_order_relaxed);
+                }
+                Chunk& c = *chunks_[t >> chunkBits_].load(std::memory_order_relaxed);
+                if (t == 0) {
+                    c.logMass[0] = salmon::math::LOG_1;
+                    c.cumulativeLogMass[0] = salmon::math::LOG_1;
+                    continue;
+                }
+                // The mass of timestep t, in terms of that of timestep t - 1
+                double i = static_cast<double>(t + 1);
+                double fm = lastLogMass_ + forgettingFactor_ * std::log(i - 1) -
+                    std::log(std::pow(i, forgettingFactor_) - 1);
+                c.logMass[t & chunkMask_] = fm;
+                c.cumulativeLogMass[t & chunkMask_] = salmon::math::logAdd(lastCumulativeLogMass_, fm);
+                lastLogMass_ = fm;
+                lastCumulativeLogMass_ = c.cumulativeLogMass[t & chunkMask_];
+            }
+            // Publish the new entries (and chunks) to the readers
+            numComputed_.store(end, std::memory_order_release);
+        }
+
+        std::atomic<uint64_t> batchNum_;
         double forgettingFactor_;
-        double logForgettingMass_;
-        std::vector<double> logForgettingMasses_;
-        std::vector<double> cumulativeLogForgettingMasses_;
-#if defined __APPLE__
-        spin_lock ffMutex_;
-#else
-        std::mutex ffMutex_;
-#endif
+        std::atomic<uint64_t> numComputed_;
+        // The table of chunks (512KiB of pointers) is on the heap, so that
+        // the calculator can live on a thread's stack
+        std::unique_ptr<std::atomic<Chunk*>[]> chunks_;
+        // The last entry computed (guarded by extendMutex_)
+        double lastLogMass_{salmon::math::LOG_1};
+        double lastCumulativeLogMass_{salmon::math::LOG_1};
+        std::mutex extendMutex_;
 };
 
 #endif //__FORGETTING_MASS_CALCULATOR__
@@ -14,7 +14,7 @@
 #include <atomic>
 #include <vector>
 #include <string>
-#include <mutex>
+#include <cstdint>
 
 /**
  * The LengthDistribution class keeps track of the observed length distribution.
@@ -33,12 +33,20 @@ class FragmentLengthDistribution {
    */
     std::vector<tbb::atomic<double>> hist_;
 
-   /**
-   * A private vector that stores the observed (logged) mass for each length.
+  /**
+   * A Fenwick (binary indexed) tree over the masses of hist_, in linear
+   * space (relative to exp(logScale_)), so that both adding mass to a bin
+   * and the cumulative mass up to a bin take O(log n) updates / reads.
+   * Node j (1-based) holds the mass of the bins [j - (j & -j), j).  The
+   * cmf is thus always that of the current histogram, while it's updated.
+   */
+    std::vector<tbb::atomic<double>> tree_;
+  /**
+   * The (logged) mass to which the linear masses of tree_ are relative
+   * (the pseudo-count mass), which keeps them well within the range of a
+   * double.
    */
-    std::vector<double> cachedCMF_;
-    volatile bool haveCachedCMF_;
-    std::mutex fldMut_;
+    double logScale_;
 
   /**
    * A private double that stores the total observed (logged) mass.
@@ -57,6 +65,16 @@ class FragmentLengthDistribution {
    * A size for internal binning of the lengths in the distribution.
    */
   size_t binSize_;
+  /**
+   * The number of updates made to the distribution; used by
+   * CachedFragmentLengthPMF to tell whether its table is stale.
+   */
+  std::atomic<uint64_t> version_;
+
+  // Add the (linear) mass to bin i of tree_
+  void treeAdd_(size_t i, double mass);
+  // The (linear) mass of the bins [0, i]
+  double treePrefix_(size_t i) const;
 
 public:
   /**
@@ -99,28 +117,40 @@ public:
    * @param mass a double for the mass (logged) to add.
    */
   void addVal(size_t len, double mass);
+  /**
+   * A member function that updates the distribution based on a batch of
+   * length observations, all having the same mass.  The (kernel-smoothed)
+   * mass of the batch is first accumulated in `binMass`, so that each bin of
+   * the shared histogram, and the total and sum, are updated only once.
+   * @param lens the distinct observed lengths.
+   * @param counts the number of times each length was observed (indexed by length).
+   * @param mass a double for the mass (logged) of each observation.
+   * @param binMass a scratch vector used to accumulate the mass of the batch.
+   */
+  void addVals(const std::vector<size_t>& lens,
+               const std::vector<uint32_t>& counts,
+               double mass,
+               std::vector<double>& binMass);
   /**
    * An accessor for the (logged) probability of a given length.
    * @param len an integer for the length to return the probability of.
    * @return (logged) probability of observing the given length.
    */
   double pmf(size_t len) const;
+  /**
+   * The number of updates (calls to addVal or addVals that added mass) made
+   * to the distribution so far.
+   */
+  uint64_t version() const { return version_.load(std::memory_order_relaxed); }
   /**
    * A member function that returns a (logged) cumulative mass for a given
-   * length.
+   * length.  This reads O(log n) nodes of the Fenwick tree, and may be
+   * called while the distribution is being updated.
    * @param len an integer for the length to return the cmf value of.
    * @return (Logged) cmf value of length.
    */
   double cmf(size_t len) const;
 
-  /**
-    * A member function that caches the cumulative mass function into
-    * a vector.  This should be called (once), when the fld will no
-    * longer be updated.  It will make future calls to cmf(len)
-    * much faster.
-    */
-  void cacheCMF();
-
   /**
    * A member function that returns a vector containing the (logged) cumulative
    * mass function *for the bins*.
@@ -136,6 +166,23 @@ public:
    */
   void dumpPMF(std::vector<double>& pmfOut, size_t& minV, size_t& maxV) const;
 
+  /**
+   * The (logged) mass of each bin (including the pseudo-counts), from which
+   * the distribution can be rebuilt by addLogMasses (e.g. by salmon infer,
+   * from the state written by salmon quant --mapOnly).
+   */
+  std::vector<double> logMasses() const;
+  /**
+   * Add the (logged) masses of the bins of another distribution having the
+   * same bins, whose minimum observed bin was minBin.  This must not be
+   * called while other threads are updating the distribution.
+   */
+  void addLogMasses(const std::vector<double>& logMasses, size_t minBin);
+  /**
+   * The smallest bin into which an observation has fallen (the largest bin
+   * if there have been none).
+   */
+  size_t minBin() const { return min_; }
   /**
    * An accessor for the (logged) observation mass (including pseudo-counts).
    * @return Total observation mass.
@@ -159,4 +206,95 @@ public:
   //void append_output(std::ofstream& outfile, std::string length_type) const;
 };
 
+/**
+ * Stages the fragment lengths observed by a single thread, so that they can
+ * be added to the shared FragmentLengthDistribution all at once (e.g. at the
+ * end of each mini-batch) rather than one atomic update per fragment.  All
+ * of the lengths staged between two calls to flush() must have the same mass.
+ */
+class LocalFragmentLengthDistribution {
+public:
+  LocalFragmentLengthDistribution(FragmentLengthDistribution& global) :
+      global_(global),
+      maxLen_(global.maxVal()),
+      counts_(global.maxVal() + 1, 0) {}
+
+  /**
+   * Stage an observation of length `len`.
+   */
+  inline void addVal(size_t len) {
+    if (len > maxLen_) { len = maxLen_; }
+    if (counts_[len]++ == 0) { lens_.push_back(len); }
+  }
+
+  /**
+   * Add the staged observations, each with (logged) mass `mass`, to the
+   * shared distribution, and clear them.
+   */
+  inline void flush(double mass) {
+    if (lens_.empty()) { return; }
+    global_.addVals(lens_, counts_, mass, binMass_);
+    for (auto len : lens_) { counts_[len] = 0; }
+    lens_.clear();
+  }
+
+private:
+  FragmentLengthDistribution& global_;
+  size_t maxLen_;
+  std::vector<uint32_t> counts_;
+  std::vector<size_t> lens_;
+  std::vector<double> binMass_;
+};
+
+/**
+ * A per-thread table of the (logged) probability of each fragment length,
+ * so that the fragment-length term of an alignment is a single array load
+ * rather than an atomic load of the bin and of the total mass.  The table
+ * is checked against the version of the shared distribution every
+ * refreshInterval calls to refresh() (one per mini-batch), and rebuilt
+ * only if the distribution has changed since it was built; the
+ * probabilities used by a thread may therefore trail the shared
+ * distribution by a few mini-batches.
+ */
+class CachedFragmentLengthPMF {
+public:
+  static constexpr uint32_t refreshInterval = 16;
+
+  CachedFragmentLengthPMF(FragmentLengthDistribution& global) :
+      global_(global),
+      maxLen_(global.maxVal()) {}
+
+  /**
+   * Called at the start of each mini-batch; the first call always builds
+   * the table.
+   */
+  inline void refresh() {
+    if (!logPMF_.empty() and ++batchesSinceCheck_ < refreshInterval) { return; }
+    batchesSinceCheck_ = 0;
+    uint64_t version = global_.version();
+    if (!logPMF_.empty() and version == version_) { return; }
+    version_ = version;
+    logPMF_.resize(maxLen_ + 1);
+    for (size_t len = 0; len <= maxLen_; ++len) {
+      logPMF_[len] = global_.pmf(len);
+    }
+  }
+
+  /**
+   * The (logged) probability of a fragment of length len, as of the last
+   * rebuild of the table; lengths beyond the maximum are clamped to it, as
+   * in FragmentLengthDistribution::pmf.
+   */
+  inline double pmf(size_t len) const {
+    return logPMF_[(len > maxLen_) ? maxLen_ : len];
+  }
+
+private:
+  FragmentLengthDistribution& global_;
+  size_t maxLen_;
+  uint64_t version_{0};
+  uint32_t batchesSinceCheck_{0};
+  std::vector<double> logPMF_;
+};
+
 #endif
@@ -0,0 +1,120 @@
+#ifndef FRAGMENT_SCRATCH_HPP
+#define FRAGMENT_SCRATCH_HPP
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+#include "TranscriptGroup.hpp"
+#include "EquivalenceClassBuilder.hpp"
+#include "FragmentLengthDistribution.hpp"
+#include "StageTimings.hpp"
+#include "LocalTranscriptUpdates.hpp"
+#include "UniqueFragmentCounts.hpp"
+#include "ReadLibrary.hpp"
+
+/**
+ * Per-thread buffers used while computing the assignment probabilities
+ * of each fragment in processMiniBatch.  One of these is created by each
+ * mapping thread and handed to every mini-batch it processes.  The buffers
+ * are cleared, rather than re-allocated, for each fragment, so once they
+ * have grown to hold the largest alignment group seen, processing a
+ * fragment performs no heap allocation.
+ */
+class FragmentScratch {
+    public:
+        FragmentScratch(EquivalenceClassBuilder& eqBuilder,
+                        FragmentLengthDistribution& fragLengthDist,
+                        StageTimings& stageTimings) :
+            localEqBuilder(eqBuilder),
+            localFragLengthDist(fragLengthDist),
+            fragLengthPMF(fragLengthDist),
+            timings(stageTimings) {}
+
+        /**
+         * Reset the per-fragment buffers (keeping their capacity).
+         */
+        inline void clear() {
+            txpIDs.clear();
+            auxProbs.clear();
+            posProbs.clear();
+            logProbs.clear();
+            observedTranscripts.clear();
+        }
+
+        /**
+         * Record that `transcriptID` was observed for the current fragment,
+         * and return true if this is the first time it has been observed.
+         * The observed ids are kept in a small sorted vector; since the
+         * alignments of a fragment are visited in order of transcript id,
+         * this is almost always a single comparison and an append.
+         */
+        inline bool markObserved(uint32_t transcriptID) {
+            if (observedTranscripts.empty() or
+                observedTranscripts.back() < transcriptID) {
+                observedTranscripts.push_back(transcriptID);
+                return true;
+            }
+            auto it = std::lower_bound(observedTranscripts.begin(),
+                                       observedTranscripts.end(),
+                                       transcriptID);
+            if (it != observedTranscripts.end() and *it == transcriptID) {
+                return false;
+            }
+            observedTranscripts.insert(it, transcriptID);
+            return true;
+        }
+
+        /**
+         * Return the equivalence class label consisting of the current
+         * contents of `txpIDs`; the storage of the label is re-used
+         * between fragments.
+         */
+        inline const TranscriptGroup& eqLabel() {
+            eqKey.assign(txpIDs);
+            return eqKey;
+        }
+
+        // The equivalence class information for the current fragment
+        std::vector<uint32_t> txpIDs;
+        std::vector<double> auxProbs;
+        std::vector<double> posProbs;
+        // The (unnormalized) log-probabilities of the non-zero
+        // probability alignments of the current fragment
+        std::vector<double> logProbs;
+        // The (sorted) transcripts to which the current fragment maps
+        std::vector<uint32_t> observedTranscripts;
+        // The equivalence classes of the current mini-batch, if
+        // they are being accumulated thread-locally
+        LocalEquivalenceClassBuilder localEqBuilder;
+        // The fragment lengths observed in the current mini-batch; these
+        // are added to the shared distribution at the end of the mini-batch
+        LocalFragmentLengthDistribution localFragLengthDist;
+        // This thread's table of the fragment length probabilities
+        CachedFragmentLengthPMF fragLengthPMF;
+        // The transcript mass and count updates of the current mini-batch,
+        // if they are being accumulated thread-locally
+        LocalTranscriptUpdates transcriptUpdates;
+        // The equivalence classes of the uniquely mapping fragments of the
+        // current mini-batch (see UniqueFragmentCounts)
+        UniqueFragmentCounts uniqueCounts;
+        // The time this thread has spent in each stage
+        LocalStageTimings timings;
+        // The library formats of the fragments this thread has assigned
+        // in the initial round; added to the read library's when the
+        // thread is done with it
+        LocalLibTypeCounts libTypeCounts;
+        // If true, the fragments of the current mini-batch are not added
+        // to the equivalence classes; they have been written to the
+        // mapping cache, and will be added when it is replayed (--singlePass)
+        bool deferEqClasses{false};
+        // If true, the fragments of the current mini-batch are *only*
+        // added to the equivalence classes (they are being replayed from
+        // the mapping cache, and have already updated everything else)
+        bool eqClassesOnly{false};
+
+    private:
+        TranscriptGroup eqKey;
+};
+
+#endif // FRAGMENT_SCRATCH_HPP
@@ -28,6 +28,14 @@ class FragmentStartPositionDistribution {
    */
   std::vector<tbb::atomic<double>> pmf_;
   std::vector<tbb::atomic<double>> cmf_;
+  /**
+   * The (normalized) pmf and cmf of the bins in linear space, which are
+   * filled in by update(); once the distribution has been updated, the
+   * CDF is evaluated from these, with a single multiply-add, rather than
+   * with a logAdd of the logged values.
+   */
+  std::vector<double> pmfLinear_;
+  std::vector<double> cmfLinear_;
   /**
    * A private double that stores the total observed (logged) mass.
    */
@@ -94,6 +102,14 @@ public:
 
   // Evaluate the CDF between two points
   double evalCDF(int32_t hitPos, uint32_t txpLen);
+
+  /**
+   * Evaluate the (non-logged) CDF at hitPos[i] of a transcript of length
+   * txpLens[i], for each of the n transcripts, into cdfs[i].  Once the
+   * distribution has been updated, this is a branch-free lookup for each
+   * transcript, with no logs or exps.
+   */
+  void evalLinearCDFs(size_t n, const int32_t* hitPos, const uint32_t* txpLens, double* cdfs);
   // Update the distribution (compute the CDF) and
   // set isUpdated_;
   void update();
@@ -10,9 +10,13 @@
 #include <boost/iostreams/device/file.hpp>
 #include <boost/iostreams/filter/gzip.hpp>
 
+#include "AsyncOutputWriter.hpp"
 #include "SalmonSpinLock.hpp"
 #include "SalmonOpts.hpp"
 #include "ReadExperiment.hpp"
+#include "ParallelBootstrapWriter.hpp"
+#include "SampleSummary.hpp"
+#include "ColumnarBootstraps.hpp"
 
 class GZipWriter {
   public:
@@ -32,19 +36,54 @@ class GZipWriter {
     const std::string& tstring  = "now"  // the start time of the run
 	);
 
+    /**
+     * Write aux/meta_info.json.  writeMeta does so itself unless the number
+     * of bootstraps is adaptive, in which case it's called once they're
+     * drawn (with opts.numBootstraps the number drawn).
+     */
+    template <typename ExpT>
+    bool writeMetaInfo(
+      const SalmonOpts& opts,
+      const ExpT& experiment,
+      const std::string& tstring);
+
+    /**
+     * Write quant.sf (and quant.bin, if requested).  If `async` is given,
+     * the abundances are computed here, but they are formatted and written
+     * by the writer's thread (in which case the result only reports
+     * whether the task was queued).
+     */
     template <typename ExpT>
     bool writeAbundances(
       const SalmonOpts& sopt,
-      ExpT& readExp);
+      ExpT& readExp,
+      AsyncOutputWriter* async = nullptr);
 
     template <typename T>
     bool writeBootstrap(const std::vector<T>& abund);
 
+    /**
+     * Write out everything that is pending once all of the bootstrap (or
+     * Gibbs) replicates have been passed to writeBootstrap.
+     */
+    bool finishBootstraps();
+
    private:
      boost::filesystem::path path_;
      boost::filesystem::path bsPath_;
      std::shared_ptr<spdlog::logger> logger_;
      std::unique_ptr<boost::iostreams::filtering_ostream> bsStream_{nullptr};
+     // If there are bootstrap compression workers, the replicates are
+     // written through this rather than bsStream_
+     std::unique_ptr<ParallelBootstrapWriter> bsWriter_{nullptr};
+     int bsCompressionLevel_{6};
+     // The summaries of the replicates, if requested, and whether the
+     // replicates themselves are written
+     std::unique_ptr<SampleSummary> bsSummary_{nullptr};
+     std::vector<std::string> bsNames_;
+     // The transcript-major copy of the replicates, if requested
+     std::unique_ptr<ColumnarBootstrapWriter> bsColumns_{nullptr};
+     bool writeReplicates_{true};
 // only one writer thread at a time
 #if defined __APPLE__
         spin_lock writeMutex_;
@@ -52,6 +91,7 @@ class GZipWriter {
         std::mutex writeMutex_;
 #endif
         std::atomic<uint32_t> numBootstrapsWritten_{0};
+        size_t numFLDSamples_{0};
 };
 
 #endif //__GZIP_WRITER_HPP__
@@ -0,0 +1,243 @@
+#ifndef __INDEX_CHECKSUMS_HPP__
+#define __INDEX_CHECKSUMS_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <boost/filesystem.hpp>
+
+#include "cereal/archives/json.hpp"
+#include "cereal/types/map.hpp"
+#include "cereal/types/string.hpp"
+#include "spdlog/spdlog.h"
+#include "spdlog/details/format.h"
+
+#include "xxhash.h"
+
+namespace salmon {
+namespace utils {
+
+/**
+ * The checksum of an index component is the xxhash64 of the xxhash64s of
+ * its consecutive chunks (of chunkSize bytes, the last of which may be
+ * short), so that the chunks of even a single (large) component, such as
+ * the suffix array, can be hashed in parallel.  The checksums of all of the
+ * components of an index, including those of its extensions, are recorded
+ * in checksums.json at the top of the index directory.
+ */
+class IndexChecksums {
+    public:
+        static constexpr uint64_t chunkSize = uint64_t(1) << 26;
+
+        static boost::filesystem::path checksumPath(const boost::filesystem::path& indexDir) {
+            return indexDir / "checksums.json";
+        }
+
+        /**
+         * Compute the checksums of the components of the index in indexDir
+         * and record them in its checksums.json.
+         */
+        static bool write(const boost::filesystem::path& indexDir,
+                          std::shared_ptr<spdlog::logger>& log) {
+            std::map<std::string, std::string> sums;
+            if (!compute_(indexDir, components_(indexDir), sums)) {
+                log->error("couldn't compute the checksums of the index {}", indexDir.string());
+                return false;
+            }
+            uint64_t cs{chunkSize};
+            std::ofstream ofs(checksumPath(indexDir).string());
+            {
+                cereal::JSONOutputArchive oarchive(ofs);
+                oarchive(cereal::make_nvp("chunkSize", cs),
+                         cereal::make_nvp("xxhash64", sums));
+            }
+            ofs.close();
+            log->info("recorded the checksums of {} index components", sums.size());
+            return true;
+        }
+
+        /**
+         * Check the components of the index in indexDir against the
+         * checksums recorded when it was built, reading them (all at once)
+         * through read-only mappings.  Returns false, after logging the
+         * offending components, if any component is missing or doesn't
+         * match.  An index without recorded checksums (e.g. one built by an
+         * older salmon) cannot be verified; this is reported, but isn't an
+         * error.
+         */
+        static bool verify(const boost::filesystem::path& indexDir,
+                           std::shared_ptr<spdlog::logger>& log) {
+            namespace bfs = boost::filesystem;
+            using Clock = std::chrono::steady_clock;
+            auto start = Clock::now();
+            bfs::path sumPath = checksumPath(indexDir);
+            if (!bfs::exists(sumPath)) {
+                log->warn("The index {} has no recorded checksums ({} is missing); it can't be "
+                          "verified", indexDir.string(), sumPath.string());
+                return true;
+            }
+            std::map<std::string, std::string> expected;
+            uint64_t cs{0};
+            {
+                std::ifstream ifs(sumPath.string());
+                cereal::JSONInputArchive iarchive(ifs);
+                iarchive(cereal::make_nvp("chunkSize", cs),
+                         cereal::make_nvp("xxhash64", expected));
+            }
+            if (cs != chunkSize) {
+                log->warn("The checksums of the index {} were computed with a different chunk size; "
+                          "they can't be verified", indexDir.string());
+                return true;
+            }
+
+            std::vector<std::string> names;
+            bool ok{true};
+            for (auto& kv : expected) {
+                if (!bfs::is_regular_file(indexDir / kv.first)) {
+                    log->error("The index component {} is missing", (indexDir / kv.first).string());
+                    ok = false;
+                } else {
+                    names.push_back(kv.first);
+                }
+            }
+            for (auto& name : components_(indexDir)) {
+                if (expected.find(name) == expected.end()) {
+                    log->warn("The index component {} has no recorded checksum, and won't be verified",
+                              (indexDir / name).string());
+                }
+            }
+
+            std::map<std::string, std::string> observed;
+            if (!compute_(indexDir, names, observed)) {
+                log->error("couldn't read the components of the index {}", indexDir.string());
+                return false;
+            }
+            uint64_t numBytes{0};
+            for (auto& name : names) {
+                numBytes += bfs::file_size(indexDir / name);
+                if (observed[name] != expected[name]) {
+                    log->error("The index component {} is corrupt (its checksum is {}, but {} was "
+                               "recorded when the index was built)",
+                               (indexDir / name).string(), observed[name], expected[name]);
+                    ok = false;
+                }
+            }
+            std::chrono::duration<double> elapsed = Clock::now() - start;
+            if (ok) {
+                log->info("verified the checksums of {} index components ({:.1f} MB) in {:.2f} s",
+                          names.size(), numBytes / (1024.0 * 1024.0), elapsed.count());
+            }
+            return ok;
+        }
+
+    private:
+        /**
+         * The (relative paths of the) files of the index; the logs, which
+         * are rewritten by every build, and the checksums themselves are
+         * not components.
+         */
+        static std::vector<std::string> components_(const boost::filesystem::path& indexDir) {
+            namespace bfs = boost::filesystem;
+            std::vector<std::string> names;
+            std::string prefix = indexDir.string();
+            if (prefix.back() != '/') { prefix.push_back('/'); }
+            for (bfs::recursive_directory_iterator it(indexDir), end; it != end; ++it) {
+                if (!bfs::is_regular_file(it->status())) { continue; }
+                auto& p = it->path();
+                std::string name = p.string().substr(prefix.size());
+                if (p.extension() == ".log" or name == "checksums.json") { continue; }
+                names.push_back(name);
+            }
+            std::sort(names.begin(), names.end());
+            return names;
+        }
+
+        struct Component_ {
+            int fd{-1};
+            uint64_t size{0};
+            const char* data{nullptr};
+            // The index of this component's first chunk among all chunks
+            size_t firstChunk{0};
+        };
+
+        static bool compute_(const boost::filesystem::path& indexDir,
+                             const std::vector<std::string>& names,
+                             std::map<std::string, std::string>& sums) {
+            std::vector<Component_> comps(names.size());
+            std::vector<size_t> chunkOwner;
+            bool ok{true};
+            for (size_t i = 0; i < names.size(); ++i) {
+                auto& c = comps[i];
+                c.fd = ::open((indexDir / names[i]).string().c_str(), O_RDONLY);
+                struct stat st;
+                if (c.fd < 0 or ::fstat(c.fd, &st) != 0) { ok = false; break; }
+                c.size = st.st_size;
+                if (c.size > 0) {
+                    void* p = ::mmap(nullptr, c.size, PROT_READ, MAP_PRIVATE, c.fd, 0);
+                    if (p == MAP_FAILED) { ok = false; break; }
+                    ::madvise(p, c.size, MADV_SEQUENTIAL);
+                    c.data = static_cast<const char*>(p);
+                }
+                c.firstChunk = chunkOwner.size();
+                size_t numChunks = (c.size + chunkSize - 1) / chunkSize;
+                chunkOwner.insert(chunkOwner.end(), numChunks, i);
+            }
+
+            if (ok) {
+                // Hash all of the chunks of all of the components in parallel.
+                // The threads are our own (rather than TBB's), and are gone
+                // once this returns, since salmon serve and salmon quant
+                // --batch verify the index before they fork their jobs, and
+                // a TBB worker pool doesn't survive a fork.
+                std::vector<uint64_t> chunkSums(chunkOwner.size(), 0);
+                std::atomic<size_t> nextChunk{0};
+                auto hashChunks = [&]() -> void {
+                    for (size_t j = nextChunk++; j < chunkOwner.size(); j = nextChunk++) {
+                        auto& c = comps[chunkOwner[j]];
+                        uint64_t offset = (j - c.firstChunk) * chunkSize;
+                        uint64_t len = std::min(chunkSize, c.size - offset);
+                        chunkSums[j] = XXH64(c.data + offset, len, 0);
+                    }
+                };
+                size_t numThreads = std::min(static_cast<size_t>(std::max(1u, std::thread::hardware_concurrency())),
+                                             std::max(chunkOwner.size(), size_t(1)));
+                std::vector<std::thread> threads;
+                for (size_t t = 1; t < numThreads; ++t) { threads.emplace_back(hashChunks); }
+                hashChunks();
+                for (auto& t : threads) { t.join(); }
+                for (size_t i = 0; i < names.size(); ++i) {
+                    auto& c = comps[i];
+                    size_t numChunks = (c.size + chunkSize - 1) / chunkSize;
+                    uint64_t sum = XXH64(chunkSums.data() + c.firstChunk,
+                                         numChunks * sizeof(uint64_t), c.size);
+                    fmt::MemoryWriter hex;
+                    hex.write("{:016x}", sum);
+                    sums[names[i]] = hex.str();
+                }
+            }
+
+            for (auto& c : comps) {
+                if (c.data) { ::munmap(const_cast<char*>(c.data), c.size); }
+                if (c.fd >= 0) { ::close(c.fd); }
+            }
+            return ok;
+        }
+};
+
+}
+}
+
+#endif // __INDEX_CHECKSUMS_HPP__
@@ -0,0 +1,106 @@
+#ifndef __INDEX_WARMUP_HPP__
+#define __INDEX_WARMUP_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <boost/filesystem.hpp>
+
+namespace salmon {
+namespace utils {
+
+// The element type of mincore's residency vector (char on macOS and the BSDs)
+#if defined(__linux__)
+using MincoreVecT = unsigned char;
+#else
+using MincoreVecT = char;
+#endif
+
+struct IndexWarmupStats {
+    size_t numFiles{0};
+    uint64_t numBytes{0};
+    // The bytes of the files that were already in the page cache beforehand
+    uint64_t numResidentBytes{0};
+    double seconds{0.0};
+};
+
+/**
+ * Bring the files of the index in indexDir into the page cache, so that the
+ * jobs which later load it read from memory rather than fault the pages in
+ * one by one from a cold disk (or a network file system).  Each file is
+ * mapped, advised with MADV_WILLNEED (so the kernel reads ahead), and its
+ * pages are then touched by numThreads threads, each taking an interleaved
+ * share of them, which keeps many reads in flight on devices that need
+ * them to reach their bandwidth.  Returns false (with a message in err) if
+ * a file could not be opened or mapped.
+ */
+inline bool warmIndexFiles(const boost::filesystem::path& indexDir, uint32_t numThreads,
+                           IndexWarmupStats& stats, std::string& err) {
+    namespace bfs = boost::filesystem;
+    using Clock = std::chrono::steady_clock;
+    auto start = Clock::now();
+
+    numThreads = std::max(numThreads, uint32_t(1));
+    size_t pageSize = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    std::vector<MincoreVecT> residency;
+
+    for (bfs::recursive_directory_iterator it(indexDir), end; it != end; ++it) {
+        if (!bfs::is_regular_file(it->status())) { continue; }
+        std::string path = it->path().string();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) { err = "could not open " + path; return false; }
+        struct stat st;
+        if (::fstat(fd, &st) != 0) { ::close(fd); err = "could not stat " + path; return false; }
+        size_t size = static_cast<size_t>(st.st_size);
+        ++stats.numFiles;
+        if (size == 0) { ::close(fd); continue; }
+
+        void* addr = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED) { err = "could not map " + path; return false; }
+        stats.numBytes += size;
+
+        size_t numPages = (size + pageSize - 1) / pageSize;
+        residency.assign(numPages, 0);
+        if (::mincore(addr, size, residency.data()) == 0) {
+            size_t numResident = std::count_if(residency.begin(), residency.end(),
+                                               [](MincoreVecT r) { return (r & 1) != 0; });
+            stats.numResidentBytes += std::min(numResident * pageSize, size);
+        }
+#if defined(MADV_WILLNEED)
+        ::madvise(addr, size, MADV_WILLNEED);
+#endif
+
+        const volatile char* bytes = static_cast<const volatile char*>(addr);
+        std::atomic<uint64_t> checksum{0};
+        std::vector<std::thread> touchers;
+        for (uint32_t t = 0; t < numThreads; ++t) {
+            touchers.emplace_back([&, t]() -> void {
+                uint64_t sum{0};
+                for (size_t p = t; p < numPages; p += numThreads) { sum += bytes[p * pageSize]; }
+                checksum += sum;
+            });
+        }
+        for (auto& t : touchers) { t.join(); }
+        ::munmap(addr, size);
+    }
+
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+    stats.seconds = elapsed.count();
+    return true;
+}
+
+}
+}
+
+#endif // __INDEX_WARMUP_HPP__
@@ -0,0 +1,94 @@
+#ifndef __INFERENCE_PIPELINE_HPP__
+#define __INFERENCE_PIPELINE_HPP__
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "blockingconcurrentqueue.h"
+
+/**
+ * Decouples the mapping of the fragments from the online inference on them
+ * (--inferenceThreads).  The mapping threads fill mini-batches and submit()
+ * them; a separate set of inference threads take them from the work queue,
+ * update the abundances, the auxiliary models and the equivalence classes
+ * from them, and put the buffers back in the pool.
+ *
+ * The pool holds a fixed number of buffers, allocated up front, which is
+ * what bounds the queue: a mapping thread that acquire()s a buffer when
+ * all of them are waiting to be (or are being) processed blocks until an
+ * inference thread releases one.  Both queues are lock-free.
+ */
+template <typename BatchT>
+class InferencePipeline {
+    public:
+        // Each buffer of the pool is made by makeBuffer()
+        InferencePipeline(size_t numBuffers, const std::function<std::unique_ptr<BatchT>()>& makeBuffer) {
+            buffers_.reserve(numBuffers);
+            for (size_t i = 0; i < numBuffers; ++i) {
+                buffers_.push_back(makeBuffer());
+                free_.enqueue(buffers_.back().get());
+            }
+        }
+
+        ~InferencePipeline() { finish(); }
+
+        // Start numWorkers inference threads; each runs worker(workerID), which
+        // should call consume() to process the batches
+        void start(uint32_t numWorkers, const std::function<void(uint32_t)>& worker) {
+            for (uint32_t w = 0; w < numWorkers; ++w) {
+                workers_.emplace_back(worker, w);
+            }
+        }
+
+        // A free buffer to fill (waits for one if there are none)
+        BatchT* acquire() {
+            BatchT* batch{nullptr};
+            if (!free_.try_dequeue(batch)) {
+                ++numStalls_;
+                free_.wait_dequeue(batch);
+            }
+            return batch;
+        }
+
+        void submit(BatchT* batch) { work_.enqueue(batch); }
+
+        // Apply process to each submitted batch (returning its buffer to the
+        // pool afterwards) until finish() is called and the queue is drained
+        template <typename ProcessT>
+        void consume(ProcessT&& process) {
+            BatchT* batch{nullptr};
+            while (true) {
+                work_.wait_dequeue(batch);
+                if (batch == nullptr) { break; }
+                process(*batch);
+                free_.enqueue(batch);
+            }
+        }
+
+        // Called once all of the batches have been submitted: wait for the
+        // inference threads to process them and exit
+        void finish() {
+            if (workers_.empty()) { return; }
+            for (size_t w = 0; w < workers_.size(); ++w) { work_.enqueue(nullptr); }
+            for (auto& t : workers_) { t.join(); }
+            workers_.clear();
+        }
+
+        std::vector<std::thread>& threads() { return workers_; }
+
+        // The number of times a mapping thread had to wait for a free buffer
+        uint64_t numStalls() const { return numStalls_; }
+
+    private:
+        std::vector<std::unique_ptr<BatchT>> buffers_;
+        moodycamel::BlockingConcurrentQueue<BatchT*> free_;
+        moodycamel::BlockingConcurrentQueue<BatchT*> work_;
+        std::vector<std::thread> workers_;
+        std::atomic<uint64_t> numStalls_{0};
+};
+
+#endif // __INFERENCE_PIPELINE_HPP__
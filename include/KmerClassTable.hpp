@@ -0,0 +1,169 @@
+#ifndef __KMER_CLASS_TABLE_HPP__
+#define __KMER_CLASS_TABLE_HPP__
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <boost/functional/hash.hpp>
+
+#include "tbb/enumerable_thread_specific.h"
+#include "tbb/parallel_for.h"
+#include "tbb/parallel_sort.h"
+#include "tbb/blocked_range.h"
+
+#include "RollingKmerIndex.hpp"
+
+/**
+ * The canonical (the smaller of the forward and the reverse-complement
+ * encoding) 2-bit code of a k-mer (k <= 31), maintained as the window
+ * slides along a sequence one base at a time.  A window that holds a base
+ * other than A, C, G, T (or U) is not valid().
+ */
+class CanonicalKmerRoller {
+    public:
+        explicit CanonicalKmerRoller(uint32_t k) :
+            k_(k), mask_((uint64_t(1) << (2 * k)) - 1), rcShift_(2 * (k - 1)) {}
+
+        inline void reset() {
+            fw_ = 0;
+            rc_ = 0;
+            numValid_ = 0;
+        }
+
+        inline void push(char c) {
+            uint64_t code = RollingKmerIndex::encode(c);
+            uint64_t b = code & 0x3;
+            fw_ = ((fw_ << 2) | b) & mask_;
+            rc_ = (rc_ >> 2) | ((3 - b) << rcShift_);
+            numValid_ = (code < 4) ? numValid_ + 1 : 0;
+        }
+
+        inline bool valid() const { return numValid_ >= k_; }
+        inline uint64_t canonical() const { return std::min(fw_, rc_); }
+
+    private:
+        uint32_t k_;
+        uint64_t mask_;
+        uint32_t rcShift_;
+        uint64_t fw_{0};
+        uint64_t rc_{0};
+        uint32_t numValid_{0};
+};
+
+/**
+ * The k-mer classes of a set of transcripts: the k-mers that occur in
+ * exactly the same transcripts form a class, and the table maps each
+ * (canonical) k-mer to its class, and each class to its (sorted)
+ * transcripts.  The classes play the role of the equivalence classes of
+ * the mapping-based modes, with k-mers in place of fragments.
+ *
+ * The k-mers are split into numPartitions partitions by a hash, and each
+ * partition is built in turn (over all of the transcripts, in parallel),
+ * so that only one partition's (k-mer, transcript) pairs are held at a
+ * time.  A partition keeps its k-mers sorted, with their classes alongside;
+ * a lookup is a binary search in the k-mer's partition.
+ */
+class KmerClassTable {
+    public:
+        static constexpr uint32_t numPartitions = 16;
+        static constexpr uint32_t noClass = std::numeric_limits<uint32_t>::max();
+
+        // The sequence (and its length) of transcript i
+        using SequenceSource = std::function<std::pair<const char*, size_t>(size_t i)>;
+
+        explicit KmerClassTable(uint32_t k) : k_(k) {}
+
+        void build(size_t numTxps, const SequenceSource& txpSeq) {
+            using KmerTxp = std::pair<uint64_t, uint32_t>;
+            std::unordered_map<std::vector<uint32_t>, uint32_t,
+                               boost::hash<std::vector<uint32_t>>> classIDs;
+            classOffsets_.assign(1, 0);
+            classLabels_.clear();
+
+            for (uint32_t p = 0; p < numPartitions; ++p) {
+                tbb::enumerable_thread_specific<std::vector<KmerTxp>> localPairs;
+                tbb::parallel_for(tbb::blocked_range<size_t>(0, numTxps),
+                                  [&](const tbb::blocked_range<size_t>& r) -> void {
+                    auto& pairs = localPairs.local();
+                    CanonicalKmerRoller roller(k_);
+                    for (size_t t = r.begin(); t != r.end(); ++t) {
+                        auto seq = txpSeq(t);
+                        roller.reset();
+                        for (size_t i = 0; i < seq.second; ++i) {
+                            roller.push(seq.first[i]);
+                            if (roller.valid() and partition(roller.canonical()) == p) {
+                                pairs.emplace_back(roller.canonical(), static_cast<uint32_t>(t));
+                            }
+                        }
+                    }
+                });
+                std::vector<KmerTxp> pairs;
+                for (auto& l : localPairs) {
+                    pairs.insert(pairs.end(), l.begin(), l.end());
+                    std::vector<KmerTxp>().swap(l);
+                }
+                tbb::parallel_sort(pairs.begin(), pairs.end());
+
+                auto& kmers = kmers_[p];
+                auto& classes = classes_[p];
+                kmers.clear();
+                classes.clear();
+                std::vector<uint32_t> label;
+                for (size_t i = 0; i < pairs.size();) {
+                    uint64_t kmer = pairs[i].first;
+                    label.clear();
+                    for (; i < pairs.size() and pairs[i].first == kmer; ++i) {
+                        if (label.empty() or label.back() != pairs[i].second) { label.push_back(pairs[i].second); }
+                    }
+                    auto it = classIDs.find(label);
+                    if (it == classIDs.end()) {
+                        it = classIDs.emplace(label, static_cast<uint32_t>(classOffsets_.size() - 1)).first;
+                        classLabels_.insert(classLabels_.end(), label.begin(), label.end());
+                        classOffsets_.push_back(classLabels_.size());
+                    }
+                    kmers.push_back(kmer);
+                    classes.push_back(it->second);
+                }
+                kmers.shrink_to_fit();
+                classes.shrink_to_fit();
+            }
+        }
+
+        // The class of the canonical k-mer kmer, or noClass if no transcript has it
+        inline uint32_t classOf(uint64_t kmer) const {
+            auto& kmers = kmers_[partition(kmer)];
+            auto it = std::lower_bound(kmers.begin(), kmers.end(), kmer);
+            if (it == kmers.end() or *it != kmer) { return noClass; }
+            return classes_[partition(kmer)][it - kmers.begin()];
+        }
+
+        size_t numClasses() const { return classOffsets_.size() - 1; }
+        size_t numKmers() const {
+            size_t n{0};
+            for (auto& k : kmers_) { n += k.size(); }
+            return n;
+        }
+        uint32_t k() const { return k_; }
+
+        // The transcripts of class c are [labelsBegin(c), labelsEnd(c))
+        const uint32_t* labelsBegin(size_t c) const { return classLabels_.data() + classOffsets_[c]; }
+        const uint32_t* labelsEnd(size_t c) const { return classLabels_.data() + classOffsets_[c + 1]; }
+
+    private:
+        static inline uint32_t partition(uint64_t kmer) {
+            return static_cast<uint32_t>((kmer * 0x9E3779B97F4A7C15ULL) >> 60);
+        }
+
+        uint32_t k_;
+        std::vector<uint64_t> kmers_[numPartitions];
+        std::vector<uint32_t> classes_[numPartitions];
+        std::vector<uint64_t> classOffsets_;
+        std::vector<uint32_t> classLabels_;
+};
+
+#endif // __KMER_CLASS_TABLE_HPP__
@@ -5,8 +5,16 @@ extern "C" {
 #include "bwt.h"
 }
 
+#include <cstring>
 #include <fstream>
+#include <limits>
 #include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <jellyfish/mer_dna.hpp>
 
@@ -65,6 +73,18 @@ void save(Archive& archive, const bwtintv_t& interval) {
 /**
  *  This class provides an efficent hash-map from 
  *  k-mers to BWT intervals.
+ *
+ *  Besides the (cereal) serialization of the map itself, the map can be
+ *  saved as (and looked up in place from) a mapped, open-addressed table
+ *
+ *    magic[8] version:u32 k:u32 numSlots:u64 numKmers:u64
+ *    (key:u64 x0:u64 x1:u64 x2:u64 info:u64) * numSlots
+ *
+ *  in host byte order, where numSlots is a power of two, a k-mer is in the
+ *  first free slot (key = -1) at or after (cyclically) the slot given by
+ *  the low bits of the hash of its key, and the key of a k-mer is its
+ *  2k-bit encoding.  All of the processes that use the index then share the
+ *  table through the page cache, rather than each building its own map.
  */
 class KmerIntervalMap {
     public:
@@ -79,25 +99,80 @@ class KmerIntervalMap {
     private:
         std::unordered_map<KmerKey, bwtintv_t, KmerHasher> map_;
 
+        struct MappedSlot_ {
+            uint64_t key;
+            bwtintv_t interval;
+        };
+        static_assert(sizeof(bwtintv_t) == 4 * sizeof(uint64_t), "unexpected bwtintv_t layout");
+
+        // The 8 bytes (with its terminator) that start the mapped table
+        static const char* mappedMagic_() { return "SLMAUXK"; }
+        static constexpr size_t mappedHeaderBytes_ = 32;
+        static constexpr uint32_t mappedVersion_ = 1;
+        static uint64_t emptyKey_() { return std::numeric_limits<uint64_t>::max(); }
+        static uint64_t slotOf_(uint64_t key, uint64_t mask) {
+            return XXH64(&key, sizeof(key), 0) & mask;
+        }
+
+        void* mapped_{nullptr};
+        size_t mappedBytes_{0};
+        const MappedSlot_* slots_{nullptr};
+        uint64_t slotMask_{0};
+        uint64_t numMapped_{0};
+
+        void unmap_() {
+            if (mapped_) { ::munmap(mapped_, mappedBytes_); }
+            mapped_ = nullptr;
+            slots_ = nullptr;
+            mappedBytes_ = 0;
+            numMapped_ = 0;
+        }
+
+        // Answer the lookups from the table in data, if it's a valid one for the current k
+        bool useTable_(const char* data, size_t bytes) {
+            if (bytes < mappedHeaderBytes_) { return false; }
+            uint32_t versionAndK[2];
+            uint64_t counts[2];
+            std::memcpy(versionAndK, data + 8, sizeof(versionAndK));
+            std::memcpy(counts, data + 16, sizeof(counts));
+            uint64_t numSlots = counts[0];
+            bool valid = (std::memcmp(data, mappedMagic_(), 8) == 0) and versionAndK[0] == mappedVersion_ and
+                         versionAndK[1] == JFMer::k() and numSlots > 0 and (numSlots & (numSlots - 1)) == 0 and
+                         counts[1] < numSlots and
+                         bytes == mappedHeaderBytes_ + numSlots * sizeof(MappedSlot_);
+            if (!valid) { return false; }
+            slots_ = reinterpret_cast<const MappedSlot_*>(data + mappedHeaderBytes_);
+            slotMask_ = numSlots - 1;
+            numMapped_ = counts[1];
+            return true;
+        }
+
     public:
+    KmerIntervalMap() = default;
+    KmerIntervalMap(const KmerIntervalMap&) = delete;
+    KmerIntervalMap& operator=(const KmerIntervalMap&) = delete;
+    ~KmerIntervalMap() { unmap_(); }
+
     void setK(unsigned int k) { JFMer::k(k); }
     uint32_t k() { return JFMer::k(); }
 
-    bool hasKmer(KmerKey& k) {
-        return map_.find(k) != map_.end();
-    }
-
-    decltype(map_)::iterator find(const KmerKey& k) {
-        return map_.find(k);
-    }
-    decltype(map_)::iterator find(KmerKey&& k) {
-        return map_.find(k);
-    }
-
-    decltype(map_)::iterator end() {
-        return map_.end();
+    /**
+     * The interval of k-mer k, or nullptr if it isn't in the map (whether
+     * the map was built or loaded, or is mapped).
+     */
+    const bwtintv_t* lookup(const KmerKey& k) const {
+        if (slots_) {
+            uint64_t key = k.mer_.get_bits(0, 2*k.mer_.k());
+            for (uint64_t i = slotOf_(key, slotMask_); ; i = (i + 1) & slotMask_) {
+                if (slots_[i].key == key) { return &(slots_[i].interval); }
+                if (slots_[i].key == emptyKey_()) { return nullptr; }
+            }
+        }
+        auto it = map_.find(k);
+        return (it == map_.end()) ? nullptr : &(it->second);
     }
 
+    bool hasKmer(const KmerKey& k) const { return lookup(k) != nullptr; }
 
     bwtintv_t& operator[](const KmerKey& k) {
         return map_[k];
@@ -106,7 +181,7 @@ class KmerIntervalMap {
         return map_[k];
     }
     
-    decltype(map_)::size_type size() { return map_.size(); }
+    size_t size() const { return slots_ ? numMapped_ : map_.size(); }
 
     void save(boost::filesystem::path indexPath) {
         std::ofstream ofs(indexPath.string(), std::ios::binary);
@@ -126,6 +201,78 @@ class KmerIntervalMap {
         ifs.close();
     }
 
+    /**
+     * Save the (built or loaded) map as a table that can be mapped by
+     * loadMapped.
+     */
+    bool saveMapped(boost::filesystem::path tablePath) {
+        uint64_t numSlots{1};
+        // Keep the table at most half full
+        while (numSlots < 2 * map_.size()) { numSlots <<= 1; }
+        uint64_t mask = numSlots - 1;
+        std::vector<MappedSlot_> slots(numSlots);
+        for (auto& s : slots) { s.key = emptyKey_(); }
+        for (auto& kv : map_) {
+            uint64_t key = kv.first.mer_.get_bits(0, 2*kv.first.mer_.k());
+            uint64_t i = slotOf_(key, mask);
+            while (slots[i].key != emptyKey_()) { i = (i + 1) & mask; }
+            slots[i].key = key;
+            slots[i].interval = kv.second;
+        }
+
+        char header[mappedHeaderBytes_];
+        std::memset(header, 0, sizeof(header));
+        std::memcpy(header, mappedMagic_(), 8);
+        uint32_t versionAndK[2] = {mappedVersion_, k()};
+        uint64_t counts[2] = {numSlots, static_cast<uint64_t>(map_.size())};
+        std::memcpy(header + 8, versionAndK, sizeof(versionAndK));
+        std::memcpy(header + 16, counts, sizeof(counts));
+        std::ofstream ofs(tablePath.string(), std::ios::binary | std::ios::trunc);
+        ofs.write(header, sizeof(header));
+        ofs.write(reinterpret_cast<const char*>(slots.data()), slots.size() * sizeof(MappedSlot_));
+        ofs.close();
+        return !ofs.fail();
+    }
+
+    /**
+     * Map the table at tablePath (written by saveMapped), which then
+     * answers lookups in place of the map.  Returns false if it can't be
+     * mapped, or wasn't written for the current k.
+     */
+    bool loadMapped(boost::filesystem::path tablePath) {
+        unmap_();
+        int fd = ::open(tablePath.string().c_str(), O_RDONLY);
+        if (fd < 0) { return false; }
+        struct stat st;
+        if (::fstat(fd, &st) != 0 or static_cast<size_t>(st.st_size) < mappedHeaderBytes_) {
+            ::close(fd);
+            return false;
+        }
+        size_t bytes = static_cast<size_t>(st.st_size);
+        void* addr = ::mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED) { return false; }
+        if (!useTable_(static_cast<const char*>(addr), bytes)) {
+            ::munmap(addr, bytes);
+            return false;
+        }
+        mapped_ = addr;
+        mappedBytes_ = bytes;
+        return true;
+    }
+
+    /**
+     * As loadMapped, but using a table (written by saveMapped) that is
+     * already in memory, e.g. in a shared index segment, and must outlive
+     * the map.
+     */
+    bool useMapped(const char* data, size_t bytes) {
+        unmap_();
+        return useTable_(data, bytes);
+    }
+
+    bool isMapped() const { return slots_ != nullptr; }
+
 };
 
 #endif // __KMER_INTERVAL_MAP_HPP__
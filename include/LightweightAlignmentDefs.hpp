@@ -3,7 +3,11 @@
 
 
 #include "BWAMemStaticFuncs.hpp"
+#include "BatchedSMEMSearch.hpp"
+#include "SimdDispatch.hpp"
 #include "RapMapUtils.hpp"
+#include "ReadTrimmer.hpp"
+#include "UnmappedNameWriter.hpp"
 
 class SMEMAlignment {
     public:
@@ -543,17 +547,51 @@ void processMiniBatch(
         std::atomic<uint64_t>& numAssignedFragments,
         std::default_random_engine& randEng,
         bool initialRound,
-        std::atomic<bool>& burnedIn
+        std::atomic<bool>& burnedIn,
+        FragmentScratch& scratch
         );
 
+// An occurrence of a seed (MEM) of a read in a transcript
+struct SeedMatch {
+    uint32_t targetID;
+    uint32_t order; // the index of the occurrence, in the order in which they were found
+    uint32_t hitLoc;
+    uint32_t queryStart;
+    uint32_t length;
+    uint32_t readLen;
+    bool isRev;
+};
+
+/**
+ * Collect the hits of a read, one per transcript, sorted by transcript.
+ * The occurrences of its seeds are gathered in a flat list first, and then
+ * grouped by transcript in a single pass, rather than each being looked up
+ * among the hits found so far (which is quadratic in the number of
+ * transcripts for multi-mapping reads).
+ *
+ * If firstPassMems is given, they are the SMEMs of the read, found (by
+ * BatchedSMEMSearch) with the rest of its mini-batch, and only the later
+ * passes of mem_collect_intv are run here.
+ */
 template <typename CoverageCalculator>
 inline void collectHitsForRead(SalmonIndex* sidx, const bwtintv_v* a, smem_aux_t* auxHits,
                         mem_opt_t* memOptions, const SalmonOpts& salmonOpts, const uint8_t* read, uint32_t readLen,
-                        std::vector<CoverageCalculator>& hits) {
+                        std::vector<CoverageCalculator>& hits,
+                        const std::vector<bwtintv_t>* firstPassMems = nullptr) {
                         //std::unordered_map<uint64_t, CoverageCalculator>& hits) {
 
     bwaidx_t* idx = sidx->bwaIndex();
-    mem_collect_intv(salmonOpts, memOptions, sidx, readLen, read, auxHits);
+    // The occurrences of the seeds, as they're found; kept (with their
+    // capacity) from one read to the next
+    static thread_local std::vector<SeedMatch> matches;
+    matches.clear();
+    if (firstPassMems) {
+        auxHits->mem.n = 0;
+        for (auto& m : *firstPassMems) { kv_push(bwtintv_t, auxHits->mem, m); }
+        mem_collect_extra_intv(salmonOpts, memOptions, sidx, readLen, read, auxHits);
+    } else {
+        mem_collect_intv(salmonOpts, memOptions, sidx, readLen, read, auxHits);
+    }
 
     // For each MEM
     int firstSeedLen{-1};
@@ -608,8 +646,8 @@ inline void collectHitsForRead(SalmonIndex* sidx, const bwtintv_v* a, smem_aux_t
                 endPos = temp;
             }
             // Get the ID of the reference sequence in which it occurs
-            refID = refIDStart = bns_pos2rid(idx->bns, startPos);
-            refIDEnd = bns_pos2rid(idx->bns, endPos);
+            refID = refIDStart = sidx->refID(startPos);
+            refIDEnd = sidx->refID(endPos, refIDStart);
 
             if (refID < 0) { continue; } // bridging multiple reference sequences or the forward-reverse boundary;
 
@@ -693,7 +731,7 @@ inline void collectHitsForRead(SalmonIndex* sidx, const bwtintv_v* a, smem_aux_t
                         //std::cerr << "\t\t t1 (hitLoc: " << hitLoc << ") (of length " << tlen << ") has larger hit --- new hit length = " << len1 << "; starts at pos " << queryStart << " in the read (votePos will be " << votePos << ")\n";
                     } else {
                         slen = len2;
-                        refID = bns_pos2rid(idx->bns, endPos);
+                        refID = refIDEnd;
                         tlen = idx->bns->anns[refID].len;
                         hitLoc = len2;
                         rlen = hitLoc + queryStart;
@@ -704,30 +742,30 @@ inline void collectHitsForRead(SalmonIndex* sidx, const bwtintv_v* a, smem_aux_t
 
             }
 
-            auto hitIt = std::find_if(hits.begin(), hits.end(), [refID](CoverageCalculator& c) -> bool { return c.targetID == refID; });
-            if (isRev) {
-                if (hitIt == hits.end()) {
-                    CoverageCalculator hit;
-                    hit.targetID = refID;
-                    hit.addFragMatchRC(hitLoc, queryStart, slen, rlen);
-                    hits.emplace_back(hit);
-                } else {
-                    hitIt->addFragMatchRC(hitLoc, queryStart , slen, rlen);
-                    //hits[refID].addFragMatchRC(hitLoc, queryStart , slen, rlen);
-                }
-            } else {
-                if (hitIt == hits.end()) {
-                    CoverageCalculator hit;
-                    hit.targetID = refID;
-                    hit.addFragMatch(hitLoc, queryStart, slen);
-                    hits.emplace_back(hit);
-                } else {
-                    hitIt->addFragMatch(hitLoc, queryStart , slen);
-                    //hits[refID].addFragMatch(hitLoc, queryStart, slen);
-                }
-            }
+            matches.push_back({static_cast<uint32_t>(refID), static_cast<uint32_t>(matches.size()),
+                               static_cast<uint32_t>(hitLoc), static_cast<uint32_t>(queryStart),
+                               static_cast<uint32_t>(slen), rlen, static_cast<bool>(isRev)});
         } // for k
     }
+
+    // Group the matches by transcript (keeping the order in which they were
+    // found within each), and add each group to a hit of its own
+    std::sort(matches.begin(), matches.end(),
+              [](const SeedMatch& m1, const SeedMatch& m2) -> bool {
+                  return (m1.targetID < m2.targetID) or
+                         (m1.targetID == m2.targetID and m1.order < m2.order);
+              });
+    for (auto& m : matches) {
+        if (hits.empty() or hits.back().targetID != m.targetID) {
+            hits.emplace_back();
+            hits.back().targetID = m.targetID;
+        }
+        if (m.isRev) {
+            hits.back().addFragMatchRC(m.hitLoc, m.queryStart, m.length, m.readLen);
+        } else {
+            hits.back().addFragMatch(m.hitLoc, m.queryStart, m.length);
+        }
+    }
 }
 
 inline bool consistentNames(header_sequence_qual& r) {
@@ -783,6 +821,33 @@ inline bool nearEndOfTranscript(
     return (hitPos <= cutoff or std::abs(static_cast<int32_t>(txp.RefLength) - hitPos) <= cutoff);
 }
 
+// Add the reads of a fragment (both mates, in order, of a pair) to an SMEM batch
+inline void addToSMEMBatch(bwautils::SMEMBatch& batch, std::pair<header_sequence_qual, header_sequence_qual>& frag) {
+    batch.addRead(frag.first.seq);
+    batch.addRead(frag.second.seq);
+}
+
+inline void addToSMEMBatch(bwautils::SMEMBatch& batch, header_sequence_qual& frag) {
+    batch.addRead(frag.seq);
+}
+
+// The header of (the first read of) a fragment
+inline const std::string& fragmentHeader(std::pair<header_sequence_qual, header_sequence_qual>& frag) {
+    return frag.first.header;
+}
+
+inline const std::string& fragmentHeader(header_sequence_qual& frag) { return frag.header; }
+
+// Whether a fragment (each of its reads) is too short to contain a seed
+inline bool tooShortToSeed(std::pair<header_sequence_qual, header_sequence_qual>& frag, int minSeedLen) {
+    return static_cast<int>(frag.first.seq.size()) < minSeedLen and
+           static_cast<int>(frag.second.seq.size()) < minSeedLen;
+}
+
+inline bool tooShortToSeed(header_sequence_qual& frag, int minSeedLen) {
+    return static_cast<int>(frag.seq.size()) < minSeedLen;
+}
+
 template <typename CoverageCalculator>
 inline void getHitsForFragment(std::pair<header_sequence_qual, header_sequence_qual>& frag,
                         SalmonIndex* sidx,
@@ -796,7 +861,9 @@ inline void getHitsForFragment(std::pair<header_sequence_qual, header_sequence_q
                         uint64_t& upperBoundHits,
                         AlignmentGroup<SMEMAlignment>& hitList,
                         uint64_t& hitListCount,
-                        std::vector<Transcript>& transcripts) {
+                        std::vector<Transcript>& transcripts,
+                        const bwautils::SMEMBatch* smemBatch = nullptr,
+                        size_t batchIndex = 0) {
 
     //std::unordered_map<uint64_t, CoverageCalculator> leftHits;
     //std::unordered_map<uint64_t, CoverageCalculator> rightHits;
@@ -833,7 +900,13 @@ inline void getHitsForFragment(std::pair<header_sequence_qual, header_sequence_q
     */
 
     //---------- End 1 ----------------------//
-    {
+    // (the mates of a pair are consecutive reads of the SMEM batch, if there is one)
+    if (smemBatch) {
+        leftReadLength = smemBatch->readLength(2 * batchIndex);
+        collectHitsForRead(sidx, a, auxHits, memOptions, salmonOpts,
+                           smemBatch->read(2 * batchIndex), leftReadLength,
+                           leftHits, &smemBatch->mems(2 * batchIndex));
+    } else {
         std::string readStr   = frag.first.seq;
         uint32_t readLen      = readStr.size();
 
@@ -852,7 +925,12 @@ inline void getHitsForFragment(std::pair<header_sequence_qual, header_sequence_q
     }
 
     //---------- End 2 ----------------------//
-    {
+    if (smemBatch) {
+        rightReadLength = smemBatch->readLength(2 * batchIndex + 1);
+        collectHitsForRead(sidx, a, auxHits, memOptions, salmonOpts,
+                           smemBatch->read(2 * batchIndex + 1), rightReadLength,
+                           rightHits, &smemBatch->mems(2 * batchIndex + 1));
+    } else {
         std::string readStr   = frag.second.seq;
         uint32_t readLen      = readStr.size();
 
@@ -904,34 +982,28 @@ inline void getHitsForFragment(std::pair<header_sequence_qual, header_sequence_q
     jointHits.reserve(minHitList.size());
 
     // vector-based code
-    // Sort the left and right hits
-    std::sort(leftHits.begin(), leftHits.end(),
-              [](const CoverageCalculator& c1, const CoverageCalculator& c2) -> bool {
-                return c1.targetID < c2.targetID;
-               });
-    std::sort(rightHits.begin(), rightHits.end(),
-              [](const CoverageCalculator& c1, const CoverageCalculator& c2) -> bool {
-                return c1.targetID < c2.targetID;
-               });
+    // (collectHitsForRead returns the left and right hits sorted by transcript)
     // Take the intersection of these two hit lists
-    // Adopted from : http://en.cppreference.com/w/cpp/algorithm/set_intersection
     {
-        auto leftIt = leftHits.begin();
-        auto leftEnd = leftHits.end();
-        auto rightIt = rightHits.begin();
-        auto rightEnd = rightHits.end();
-        while (leftIt != leftEnd && rightIt != rightEnd) {
-            if (leftIt->targetID < rightIt->targetID) {
-                ++leftIt;
-            } else {
-                if (!(rightIt->targetID < leftIt->targetID)) {
-                    jointHits.push_back({leftIt->targetID,
-                                         static_cast<size_t>(std::distance(leftHits.begin(), leftIt)),
-                                         static_cast<size_t>(std::distance(rightHits.begin(), rightIt))});
-                    ++leftIt;
-                }
-                ++rightIt;
-            }
+        static thread_local std::vector<uint32_t> leftIDs;
+        static thread_local std::vector<uint32_t> rightIDs;
+        static thread_local std::vector<uint32_t> leftMatches;
+        static thread_local std::vector<uint32_t> rightMatches;
+        leftIDs.clear();
+        rightIDs.clear();
+        for (auto& h : leftHits) { leftIDs.push_back(h.targetID); }
+        for (auto& h : rightHits) { rightIDs.push_back(h.targetID); }
+        // The intersection kernel for the widest instruction set of this CPU
+        size_t maxMatches = std::min(leftIDs.size(), rightIDs.size());
+        if (leftMatches.size() < maxMatches) {
+            leftMatches.resize(maxMatches);
+            rightMatches.resize(maxMatches);
+        }
+        size_t numMatches = salmon::simd::kernels().intersectSorted(
+                leftIDs.data(), leftIDs.size(), rightIDs.data(), rightIDs.size(),
+                leftMatches.data(), rightMatches.data());
+        for (size_t m = 0; m < numMatches; ++m) {
+            jointHits.push_back({leftHits[leftMatches[m]].targetID, leftMatches[m], rightMatches[m]});
         }
     }
     // End vector-based code
@@ -1207,7 +1279,9 @@ inline void getHitsForFragment(jellyfish::header_sequence_qual& frag,
                         uint64_t& upperBoundHits,
                         AlignmentGroup<SMEMAlignment>& hitList,
                         uint64_t& hitListCount,
-                        std::vector<Transcript>& transcripts) {
+                        std::vector<Transcript>& transcripts,
+                        const bwautils::SMEMBatch* smemBatch = nullptr,
+                        size_t batchIndex = 0) {
 
     uint64_t leftHitCount{0};
 
@@ -1219,7 +1293,12 @@ inline void getHitsForFragment(jellyfish::header_sequence_qual& frag,
     uint32_t readLength{0};
 
     //---------- get hits ----------------------//
-    {
+    if (smemBatch) {
+        readLength = smemBatch->readLength(batchIndex);
+        collectHitsForRead(sidx, a, auxHits, memOptions, salmonOpts,
+                           smemBatch->read(batchIndex), readLength,
+                           hits, &smemBatch->mems(batchIndex));
+    } else {
         std::string readStr   = frag.seq;
         uint32_t readLen      = frag.seq.size();
 
@@ -1390,7 +1469,6 @@ void processReadsMEM(ParserT* parser,
   // Create a random uniform distribution
   std::default_random_engine eng(rd());
 
-  uint64_t prevObservedFrags{1};
   uint64_t leftHitCount{0};
   uint64_t hitListCount{0};
 
@@ -1399,6 +1477,29 @@ void processReadsMEM(ParserT* parser,
   const bwtintv_v *a = nullptr;
   smem_aux_t* auxHits = smem_aux_init();
 
+  // If requested, the SMEMs of each mini-batch are found for all of its
+  // reads at once, with their BWT accesses interleaved
+  std::unique_ptr<bwautils::BatchedSMEMSearch> smemSearch{nullptr};
+  bwautils::SMEMBatch smemBatch;
+  if (salmonOpts.smemBatchWidth > 0) {
+      smemSearch.reset(new bwautils::BatchedSMEMSearch(
+                  sidx->bwaIndex()->bwt,
+                  usableAuxIndex(sidx, memOptions),
+                  memOptions->min_seed_len, (memOptions->flag & MEM_F_SELF_OVLP) ? 2 : 1,
+                  salmonOpts.smemBatchWidth));
+  }
+
+  // Re-usable buffers for processing the fragments of each mini-batch
+  FragmentScratch scratch(readExp.equivalenceClassBuilder(), fragLengthDist, readExp.stageTimings());
+  // Trims the reads before they're mapped (--trimAdapters, --trimQuality, --trimPolyA)
+  ReadTrimmer* trimmer = salmonOpts.readTrimmer.get();
+  ReadTrimStats trimStats;
+  // If the names of the unmapped fragments are being written (--writeUnmappedNames), this
+  // thread's names; they're only written in the first pass over the reads
+  std::unique_ptr<UnmappedNameBuffer> unmappedNames(
+          (initialRound and salmonOpts.unmappedNameWriter) ?
+          new UnmappedNameBuffer(salmonOpts.unmappedNameWriter.get()) : nullptr);
+
   auto expectedLibType = rl.format();
 
   uint64_t firstTimestepOfRound = fmCalc.getCurrentTimestep();
@@ -1418,6 +1519,16 @@ void processReadsMEM(ParserT* parser,
         std::exit(1);
     }
 
+    if (trimmer) {
+        for (size_t i = 0; i < j->nb_filled; ++i) { trimmer->trim(j->data[i], trimStats); }
+    }
+
+    if (smemSearch) {
+        smemBatch.clear();
+        for (size_t i = 0; i < j->nb_filled; ++i) { addToSMEMBatch(smemBatch, j->data[i]); }
+        smemSearch->search(smemBatch);
+    }
+
     for(size_t i = 0; i < j->nb_filled; ++i) { // For all the read in this batch
         localUpperBoundHits = 0;
 
@@ -1430,42 +1541,31 @@ void processReadsMEM(ParserT* parser,
                                                coverageThresh,
                                                localUpperBoundHits,
                                                hitList, hitListCount,
-                                               transcripts);
+                                               transcripts,
+                                               smemSearch ? &smemBatch : nullptr, i);
         if (initialRound) {
             upperBoundHits += localUpperBoundHits;
         }
 
         // If the read mapped to > maxReadOccs places, discard it
-        if (hitList.size() > salmonOpts.maxReadOccs ) { hitList.alignments().clear(); }
+        bool tooManyHits = hitList.size() > salmonOpts.maxReadOccs;
+        if (tooManyHits) { hitList.alignments().clear(); }
+        if (unmappedNames and hitList.size() == 0) {
+            unmappedNames->add(fragmentHeader(j->data[i]),
+                               tooShortToSeed(j->data[i], memOptions->min_seed_len) ? UnmappedNameWriter::tooShort :
+                               tooManyHits ? UnmappedNameWriter::tooManyHits : UnmappedNameWriter::unmapped);
+        }
         validHits += hitList.size();
         locRead++;
         ++numObservedFragments;
-        if (numObservedFragments % 50000 == 0) {
-    	    iomutex.lock();
-            const char RESET_COLOR[] = "\x1b[0m";
-            char green[] = "\x1b[30m";
-            green[3] = '0' + static_cast<char>(fmt::GREEN);
-            char red[] = "\x1b[30m";
-            red[3] = '0' + static_cast<char>(fmt::RED);
-            if (initialRound) {
-                fmt::print(stderr, "\033[A\r\r{}processed{} {} {}fragments{}\n", green, red, numObservedFragments, green, RESET_COLOR);
-                fmt::print(stderr, "hits: {}; hits per frag:  {}",
-                           validHits,
-                           validHits / static_cast<float>(prevObservedFrags));
-            } else {
-                fmt::print(stderr, "\r\r{}processed{} {} {}fragments{}", green, red, numObservedFragments, green, RESET_COLOR);
-            }
-    	    iomutex.unlock();
-        }
-
-
     } // end for i < j->nb_filled
 
-    prevObservedFrags = numObservedFragments;
     AlnGroupVecRange<SMEMAlignment> hitLists = boost::make_iterator_range(structureVec.begin(), structureVec.begin() + rangeSize);
     processMiniBatch<SMEMAlignment>(readExp, fmCalc,firstTimestepOfRound, rl, salmonOpts, hitLists, transcripts, clusterForest,
-                     fragLengthDist, observedGCParams, numAssignedFragments, eng, initialRound, burnedIn);
+                     fragLengthDist, observedGCParams, numAssignedFragments, eng, initialRound, burnedIn, scratch);
   }
+  scratch.libTypeCounts.flush(rl);
+  if (trimmer) { trimmer->addStats(trimStats); }
   smem_aux_destroy(auxHits);
   smem_itr_destroy(itr);
 }
@@ -0,0 +1,88 @@
+#ifndef __LOCAL_TRANSCRIPT_UPDATES_HPP__
+#define __LOCAL_TRANSCRIPT_UPDATES_HPP__
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "SalmonMath.hpp"
+#include "Transcript.hpp"
+
+/**
+ * The updates of one thread to the (online) masses, unique counts and
+ * total counts of the transcripts during a mini-batch.  Rather than each
+ * fragment updating the shared Transcript objects (with an atomic log-add
+ * loop per alignment), the updates are summed here, per transcript, and
+ * folded into the transcripts once at the end of the mini-batch
+ * (--threadLocalTranscriptUpdates).  All of the fragments of a mini-batch
+ * share the same forgetting mass, so it is applied once, when flushing:
+ * the masses are summed in linear space (a mini-batch's sums, of
+ * probabilities, can't overflow), and converted to log space once per
+ * transcript, rather than log-added once per alignment.
+ *
+ * Transcripts with many fragments in a mini-batch are then updated once,
+ * by each thread, rather than once per fragment; the cost is that the
+ * fragments of a mini-batch don't see each other's masses.
+ */
+class LocalTranscriptUpdates {
+    public:
+        explicit LocalTranscriptUpdates(size_t numTranscripts = 0) :
+            slot_(numTranscripts, uint32_t(noSlot_)) {}
+
+        // Add (the linear-space) mass to the transcript
+        inline void addMass(uint32_t transcriptID, double mass) { entry_(transcriptID).mass += mass; }
+        inline void addUniqueCount(uint32_t transcriptID, uint32_t n) { entry_(transcriptID).uniqueCount += n; }
+        inline void addTotalCount(uint32_t transcriptID, uint32_t n) { entry_(transcriptID).totalCount += n; }
+
+        bool empty() const { return entries_.empty(); }
+
+        /**
+         * Add the updates (with the masses scaled by logForgettingMass) to
+         * the transcripts, and clear them.  If timestep is given, it's
+         * recorded as the last timestep of each transcript that gained mass.
+         */
+        void flush(std::vector<Transcript>& transcripts, double logForgettingMass,
+                   uint64_t timestep = noTimestep) {
+            for (auto& e : entries_) {
+                auto& t = transcripts[e.transcriptID];
+                if (e.mass > 0.0) {
+                    t.addMass(logForgettingMass + std::log(e.mass));
+                    if (timestep != noTimestep) { t.setLastTimestepUpdated(timestep); }
+                }
+                if (e.uniqueCount > 0) { t.addUniqueCount(e.uniqueCount); }
+                if (e.totalCount > 0) { t.addTotalCount(e.totalCount); }
+                slot_[e.transcriptID] = noSlot_;
+            }
+            entries_.clear();
+        }
+
+        static constexpr uint64_t noTimestep = std::numeric_limits<uint64_t>::max();
+
+    private:
+        struct Entry {
+            uint32_t transcriptID;
+            uint32_t uniqueCount;
+            uint32_t totalCount;
+            double mass;
+        };
+
+        static constexpr uint32_t noSlot_ = std::numeric_limits<uint32_t>::max();
+
+        inline Entry& entry_(uint32_t transcriptID) {
+            if (transcriptID >= slot_.size()) { slot_.resize(transcriptID + 1, uint32_t(noSlot_)); }
+            uint32_t s = slot_[transcriptID];
+            if (s == noSlot_) {
+                s = static_cast<uint32_t>(entries_.size());
+                slot_[transcriptID] = s;
+                entries_.push_back(Entry{transcriptID, 0, 0, 0.0});
+            }
+            return entries_[s];
+        }
+
+        // The index in entries_ of the updates of each transcript (or noSlot_)
+        std::vector<uint32_t> slot_;
+        std::vector<Entry> entries_;
+};
+
+#endif // __LOCAL_TRANSCRIPT_UPDATES_HPP__
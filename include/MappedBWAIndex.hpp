@@ -0,0 +1,269 @@
+#ifndef __MAPPED_BWA_INDEX_HPP__
+#define __MAPPED_BWA_INDEX_HPP__
+
+extern "C" {
+#include "bwa.h"
+#include "bwt.h"
+}
+
+#include "SharedIndexSegment.hpp"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * Loads the FMD (BWA) index with its BWT, suffix array samples and packed
+ * text mapped from the index files, rather than read into the heap, so
+ * that all of the quant runs on a machine that use the index share a
+ * single copy of it in the page cache.  The BWT (after its 40-byte
+ * header) and the packed text are used in place, as BWA writes them; the
+ * suffix array samples are rewritten by salmon index into bwaidx.sa.mm,
+ * whose layout is
+ *
+ *   magic[8] version:u32 reserved:u32 primary:u64 seqLen:u64
+ *   saIntv:u64 numSA:u64 reserved:u64[2]
+ *   sa:u64[numSA]   (sa[0] = -1, as bwt_restore_sa sets it)
+ *
+ * in host byte order, so that the array can be used in place as well.  The
+ * reference annotations (bns) are small, and are loaded by BWA as usual.
+ * The files can also be used from a shared index segment (see
+ * SharedIndexSegment) holding them, rather than mapped.
+ */
+class MappedBWAIndex {
+    public:
+        static const char* saSuffix() { return ".sa.mm"; }
+
+        MappedBWAIndex() = default;
+        MappedBWAIndex(const MappedBWAIndex&) = delete;
+        MappedBWAIndex& operator=(const MappedBWAIndex&) = delete;
+
+        ~MappedBWAIndex() { unmapAll_(); }
+
+        /**
+         * Write the suffix array samples of the index with the given
+         * prefix (from prefix.sa) in the mappable layout.
+         */
+        static bool writeSA(const std::string& prefix, std::string& err) {
+            std::ifstream in(prefix + ".sa", std::ios::binary);
+            if (!in.good()) {
+                err = "could not open " + prefix + ".sa";
+                return false;
+            }
+            // primary, L2[1..4], saIntv, seqLen
+            uint64_t saHeader[7];
+            in.read(reinterpret_cast<char*>(saHeader), sizeof(saHeader));
+            uint64_t saIntv = saHeader[5];
+            uint64_t seqLen = saHeader[6];
+            if (!in.good() or saIntv == 0) {
+                err = prefix + ".sa is truncated";
+                return false;
+            }
+            uint64_t header[headerWords_] = {0};
+            std::memcpy(header, magic_(), magicBytes_);
+            uint32_t versionAndReserved[2] = {version_, 0};
+            std::memcpy(&header[1], versionAndReserved, sizeof(versionAndReserved));
+            header[2] = saHeader[0];
+            header[3] = seqLen;
+            header[4] = saIntv;
+            header[5] = (seqLen + saIntv) / saIntv;
+
+            std::string outPath = prefix + saSuffix();
+            std::ofstream out(outPath, std::ios::binary | std::ios::trunc);
+            out.write(reinterpret_cast<const char*>(header), sizeof(header));
+            uint64_t first = static_cast<uint64_t>(-1);
+            out.write(reinterpret_cast<const char*>(&first), sizeof(first));
+            std::vector<char> buf(1 << 22);
+            uint64_t remaining = (header[5] - 1) * sizeof(uint64_t);
+            while (remaining > 0 and in.good()) {
+                size_t n = static_cast<size_t>(std::min<uint64_t>(remaining, buf.size()));
+                in.read(buf.data(), n);
+                out.write(buf.data(), in.gcount());
+                remaining -= static_cast<uint64_t>(in.gcount());
+            }
+            out.close();
+            if (remaining > 0 or out.fail()) {
+                err = "could not write " + outPath;
+                return false;
+            }
+            return true;
+        }
+
+        static bool hasMappableSA(const std::string& prefix) {
+            struct stat st;
+            return ::stat((prefix + saSuffix()).c_str(), &st) == 0;
+        }
+
+        /**
+         * Load the index with the given prefix, mapping its BWT, suffix
+         * array and packed text.  Returns nullptr (with a message in err) if
+         * any of them can't be mapped.  If segment is given, the files are
+         * used from it, and it must outlive the index.  The index must be
+         * passed to release before it's destroyed with bwa_idx_destroy.
+         */
+        bwaidx_t* load(const std::string& prefix, std::string& err,
+                       const SharedIndexSegment* segment = nullptr) {
+            segment_ = segment;
+            bwaidx_t* idx = bwa_idx_load(prefix.c_str(), BWA_IDX_BNS);
+            if (idx == nullptr) {
+                err = "could not load the reference annotations of " + prefix;
+                return nullptr;
+            }
+            loaded_ = idx;
+            idx->bwt = static_cast<bwt_t*>(std::calloc(1, sizeof(bwt_t)));
+            if (!mapBWT_(prefix + ".bwt", idx->bwt, err) or !mapSA_(prefix + saSuffix(), idx->bwt, err) or
+                !mapPac_(prefix + ".pac", idx, err)) {
+                release(idx);
+                bwa_idx_destroy(idx);
+                return nullptr;
+            }
+            return idx;
+        }
+
+        /**
+         * Detach the mapped arrays from idx, so that bwa_idx_destroy
+         * doesn't free them, and unmap them.  An index this didn't load
+         * (e.g. one read into the heap by bwa_idx_load) is left alone, so
+         * that bwa_idx_destroy frees its arrays.
+         */
+        void release(bwaidx_t* idx) {
+            if (idx == nullptr or idx != loaded_) { return; }
+            if (idx->bwt) {
+                idx->bwt->bwt = nullptr;
+                idx->bwt->sa = nullptr;
+            }
+            idx->pac = nullptr;
+            unmapAll_();
+            loaded_ = nullptr;
+        }
+
+        // The number of bytes of the index that are mapped
+        uint64_t mappedBytes() const {
+            uint64_t n{0};
+            for (auto& r : regions_) { n += r.size; }
+            return n;
+        }
+
+    private:
+        struct Region_ {
+            void* addr;
+            size_t size;
+        };
+
+        const char* map_(const std::string& path, size_t& size, std::string& err) {
+            if (segment_) {
+                const char* data = segment_->find(path.substr(path.find_last_of('/') + 1), size);
+                if (data == nullptr) { err = path + " is not in the shared index segment " + segment_->name(); }
+                return data;
+            }
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                err = "could not open " + path;
+                return nullptr;
+            }
+            struct stat st;
+            if (::fstat(fd, &st) != 0 or st.st_size == 0) {
+                ::close(fd);
+                err = "could not stat " + path;
+                return nullptr;
+            }
+            size = static_cast<size_t>(st.st_size);
+            void* addr = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (addr == MAP_FAILED) {
+                err = "could not map " + path;
+                return nullptr;
+            }
+            regions_.push_back({addr, size});
+            return static_cast<const char*>(addr);
+        }
+
+        // As bwt_restore_bwt, but leaving the BWT in the file
+        bool mapBWT_(const std::string& path, bwt_t* bwt, std::string& err) {
+            size_t size{0};
+            const char* data = map_(path, size, err);
+            if (data == nullptr) { return false; }
+            if (size < bwtHeaderBytes_) {
+                err = path + " is truncated";
+                return false;
+            }
+            std::memcpy(&bwt->primary, data, sizeof(bwtint_t));
+            std::memcpy(bwt->L2 + 1, data + sizeof(bwtint_t), 4 * sizeof(bwtint_t));
+            bwt->bwt_size = (size - bwtHeaderBytes_) >> 2;
+            bwt->bwt = reinterpret_cast<uint32_t*>(const_cast<char*>(data + bwtHeaderBytes_));
+            bwt->seq_len = bwt->L2[4];
+            bwt_gen_cnt_table(bwt);
+            return true;
+        }
+
+        // As bwt_restore_sa, from the mappable layout
+        bool mapSA_(const std::string& path, bwt_t* bwt, std::string& err) {
+            size_t size{0};
+            const char* data = map_(path, size, err);
+            if (data == nullptr) { return false; }
+            uint64_t header[headerWords_];
+            if (size < sizeof(header)) {
+                err = path + " is truncated";
+                return false;
+            }
+            std::memcpy(header, data, sizeof(header));
+            uint32_t fileVersion{0};
+            std::memcpy(&fileVersion, &header[1], sizeof(fileVersion));
+            if (std::memcmp(data, magic_(), magicBytes_) != 0 or fileVersion != version_) {
+                err = path + " is not a (version " + std::to_string(version_) + ") suffix array file";
+                return false;
+            }
+            if (header[2] != bwt->primary or header[3] != bwt->seq_len) {
+                err = path + " doesn't match the BWT of the index";
+                return false;
+            }
+            if (header[4] == 0 or size != sizeof(header) + header[5] * sizeof(bwtint_t)) {
+                err = path + " is truncated";
+                return false;
+            }
+            bwt->sa_intv = static_cast<int>(header[4]);
+            bwt->n_sa = header[5];
+            bwt->sa = reinterpret_cast<bwtint_t*>(const_cast<char*>(data + sizeof(header)));
+            return true;
+        }
+
+        bool mapPac_(const std::string& path, bwaidx_t* idx, std::string& err) {
+            size_t size{0};
+            const char* data = map_(path, size, err);
+            if (data == nullptr) { return false; }
+            if (size < static_cast<size_t>(idx->bns->l_pac / 4 + 1)) {
+                err = path + " is truncated";
+                return false;
+            }
+            idx->pac = reinterpret_cast<uint8_t*>(const_cast<char*>(data));
+            return true;
+        }
+
+        void unmapAll_() {
+            for (auto& r : regions_) { ::munmap(r.addr, r.size); }
+            regions_.clear();
+        }
+
+        // The 8 bytes (with its terminator) that start the file
+        static const char* magic_() { return "SLMBWSA"; }
+        static constexpr size_t magicBytes_ = 8;
+        static constexpr uint32_t version_ = 1;
+        static constexpr size_t headerWords_ = 8;
+        // primary and L2[1..4]
+        static constexpr size_t bwtHeaderBytes_ = 5 * sizeof(bwtint_t);
+
+        std::vector<Region_> regions_;
+        const SharedIndexSegment* segment_{nullptr};
+        // The index whose arrays are mapped (or in the segment), if any
+        bwaidx_t* loaded_{nullptr};
+};
+
+#endif // __MAPPED_BWA_INDEX_HPP__
@@ -0,0 +1,232 @@
+#ifndef __MAPPED_FASTQ_READER_HPP__
+#define __MAPPED_FASTQ_READER_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <boost/iostreams/device/mapped_file.hpp>
+
+#include "tbb/blocked_range.h"
+#include "tbb/parallel_for.h"
+
+namespace salmon {
+namespace io {
+
+/**
+ * Paired, uncompressed (4-line) FASTQ files, memory-mapped and split into
+ * ranges of whole records that are parsed independently, so that as many
+ * threads as there are ranges can parse the reads at once (where the
+ * stream parser reads each pair of files on a single thread).
+ *
+ * A file is split at about every targetRangeBytes bytes, at the start of
+ * the next record: a line starting with '@' whose second-next line starts
+ * with '+' (which a quality line starting with '@' never is).  The records
+ * of each range are counted (in parallel), which gives the index of the
+ * first record of each range; the second mates' file is then split at the
+ * records of the same indices as the first's, so that each range of the
+ * first file is paired with the range holding the same mates.
+ *
+ * If a file isn't 4-line FASTQ (a record is wrapped over several lines),
+ * ok() is false, and the files should be read by the stream parser.
+ */
+class MappedFastqPairReader {
+    public:
+        // The records [begin1, end1) of the first mates' file, and the same
+        // records' mates [begin2, end2)
+        struct Range {
+            const char* begin1{nullptr};
+            const char* end1{nullptr};
+            const char* begin2{nullptr};
+            const char* end2{nullptr};
+        };
+
+        // An uncompressed FASTQ file which can be mapped: a regular file
+        // (not a pipe) that starts with '@'
+        static bool isMappable(const char* path) {
+            struct stat st;
+            if (stat(path, &st) != 0 or !S_ISREG(st.st_mode) or st.st_size == 0) { return false; }
+            char c{0};
+            std::ifstream probe(path, std::ios::in | std::ios::binary);
+            probe.read(&c, 1);
+            return c == '@';
+        }
+
+        // The pairs of files (first, second mates) to map
+        MappedFastqPairReader(const std::vector<std::pair<std::string, std::string>>& filePairs,
+                              size_t targetRangeBytes = size_t(8) << 20) {
+            for (auto& fp : filePairs) {
+                auto f1 = map_(fp.first);
+                auto f2 = map_(fp.second);
+                auto starts1 = recordStarts_(*f1, targetRangeBytes);
+                auto starts2 = recordStarts_(*f2, targetRangeBytes);
+                auto counts1 = countRecords_(*f1, starts1);
+                auto counts2 = countRecords_(*f2, starts2);
+                if (!ok_) { return; }
+                if (counts1.back() != counts2.back()) {
+                    throw std::runtime_error(fp.first + " and " + fp.second + " hold different numbers of reads (" +
+                                             std::to_string(counts1.back()) + " and " +
+                                             std::to_string(counts2.back()) + ")");
+                }
+                // The starts, in the second file, of the mates of the records at starts1
+                std::vector<size_t> mateStarts(starts1.size());
+                tbb::parallel_for(tbb::blocked_range<size_t>(0, starts1.size()),
+                                  [&](const tbb::blocked_range<size_t>& r) -> void {
+                    for (size_t k = r.begin(); k != r.end(); ++k) {
+                        size_t j = std::upper_bound(counts2.begin(), counts2.end(), counts1[k]) - counts2.begin() - 1;
+                        j = std::min(j, starts2.size() - 1);
+                        mateStarts[k] = skipRecords_(*f2, starts2[j], counts1[k] - counts2[j]);
+                    }
+                });
+                const char* d1 = f1->data();
+                const char* d2 = f2->data();
+                for (size_t k = 0; k + 1 < starts1.size(); ++k) {
+                    if (starts1[k] == starts1[k + 1]) { continue; }
+                    Range r;
+                    r.begin1 = d1 + starts1[k];
+                    r.end1 = d1 + starts1[k + 1];
+                    r.begin2 = d2 + mateStarts[k];
+                    r.end2 = d2 + mateStarts[k + 1];
+                    ranges_.push_back(r);
+                }
+                files_.push_back(f1);
+                files_.push_back(f2);
+            }
+        }
+
+        bool ok() const { return ok_; }
+        size_t numRanges() const { return ranges_.size(); }
+
+        // The next range to parse (safe to call from several threads); false once there are none left
+        bool nextRange(Range& r) {
+            size_t i = next_++;
+            if (i >= ranges_.size()) { return false; }
+            r = ranges_[i];
+            return true;
+        }
+
+        /**
+         * Parse the record at pos (before end) into rec (with string
+         * members header, seq and qual), and move pos past it.  The fields
+         * are assigned straight from the mapped file, which copies them
+         * into the capacity the record already has.
+         */
+        template <typename RecordT>
+        static void parseRecord(const char*& pos, const char* end, RecordT& rec) {
+            const char* header = pos;
+            const char* seq = lineEnd_(header, end) + 1;
+            const char* plus = lineEnd_(seq, end) + 1;
+            const char* qual = lineEnd_(plus, end) + 1;
+            const char* next = lineEnd_(qual, end) + 1;
+            if (*header != '@' or plus >= end or *plus != '+') {
+                throw std::runtime_error("Invalid fastq file: header missing");
+            }
+            size_t seqLen = (plus - 1) - seq;
+            size_t qualLen = (std::min(next, end + 1) - 1) - qual;
+            if (seqLen != qualLen) { throw std::runtime_error("Invalid fastq file: wrong number of quals"); }
+            rec.header.assign(header + 1, (seq - 1) - (header + 1));
+            rec.seq.assign(seq, seqLen);
+            rec.qual.assign(qual, qualLen);
+            pos = std::min(next, end);
+        }
+
+    private:
+        using MappedFile = boost::iostreams::mapped_file_source;
+
+        std::shared_ptr<MappedFile> map_(const std::string& path) {
+            auto f = std::make_shared<MappedFile>(path);
+            // The ranges are read front to back, and each byte once
+            madvise(const_cast<char*>(f->data()), f->size(), MADV_SEQUENTIAL);
+            return f;
+        }
+
+        // The end of the line starting at p (its '\n', or end)
+        static inline const char* lineEnd_(const char* p, const char* end) {
+            if (p >= end) { return end; }
+            const char* nl = static_cast<const char*>(std::memchr(p, '\n', end - p));
+            return nl ? nl : end;
+        }
+
+        // The start of the first record at or after pos
+        static size_t recordStart_(const MappedFile& f, size_t pos) {
+            const char* data = f.data();
+            const char* end = data + f.size();
+            const char* p = data + pos;
+            if (pos > 0 and data[pos - 1] != '\n') { p = lineEnd_(p, end) + 1; }
+            while (p < end) {
+                const char* seq = lineEnd_(p, end) + 1;
+                const char* plus = lineEnd_(seq, end) + 1;
+                if (*p == '@' and plus < end and *plus == '+') { return p - data; }
+                p = seq;
+            }
+            return f.size();
+        }
+
+        // The starts of the ranges of f, and its size
+        static std::vector<size_t> recordStarts_(const MappedFile& f, size_t targetRangeBytes) {
+            size_t n = std::max(size_t(1), f.size() / std::max(targetRangeBytes, size_t(1)));
+            std::vector<size_t> starts(n + 1);
+            tbb::parallel_for(tbb::blocked_range<size_t>(1, n), [&](const tbb::blocked_range<size_t>& r) -> void {
+                for (size_t k = r.begin(); k != r.end(); ++k) { starts[k] = recordStart_(f, k * (f.size() / n)); }
+            });
+            starts[0] = 0;
+            starts[n] = f.size();
+            return starts;
+        }
+
+        /**
+         * The indices of the first records of the ranges (and the number of
+         * records, last), clearing ok_ if a range isn't made of 4-line
+         * records.
+         */
+        std::vector<size_t> countRecords_(const MappedFile& f, const std::vector<size_t>& starts) {
+            const char* data = f.data();
+            std::vector<size_t> counts(starts.size(), 0);
+            std::atomic<bool> valid{true};
+            tbb::parallel_for(tbb::blocked_range<size_t>(0, starts.size() - 1),
+                              [&](const tbb::blocked_range<size_t>& r) -> void {
+                for (size_t k = r.begin(); k != r.end(); ++k) {
+                    const char* p = data + starts[k];
+                    const char* end = data + starts[k + 1];
+                    size_t lines{0};
+                    while (p < end) {
+                        p = lineEnd_(p, end) + 1;
+                        ++lines;
+                    }
+                    if (lines % 4 != 0) { valid = false; }
+                    counts[k + 1] = lines / 4;
+                }
+            });
+            for (size_t k = 1; k < counts.size(); ++k) { counts[k] += counts[k - 1]; }
+            ok_ = ok_ and valid;
+            return counts;
+        }
+
+        // The start of the record numRecords records after the one at pos
+        static size_t skipRecords_(const MappedFile& f, size_t pos, size_t numRecords) {
+            const char* p = f.data() + pos;
+            const char* end = f.data() + f.size();
+            for (size_t l = 0; l < 4 * numRecords and p < end; ++l) { p = lineEnd_(p, end) + 1; }
+            return std::min(p, end) - f.data();
+        }
+
+        std::vector<std::shared_ptr<MappedFile>> files_;
+        std::vector<Range> ranges_;
+        std::atomic<size_t> next_{0};
+        bool ok_{true};
+};
+
+}
+}
+
+#endif // __MAPPED_FASTQ_READER_HPP__
@@ -0,0 +1,240 @@
+#ifndef MAPPING_CACHE_HPP
+#define MAPPING_CACHE_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <functional>
+#include <type_traits>
+
+#include <boost/filesystem.hpp>
+
+#include "LibraryFormat.hpp"
+
+/**
+ * The packed (16-byte) record of a single quasi-mapping.  This holds
+ * everything that is needed to re-run the assignment of a fragment (in
+ * processMiniBatch) without re-mapping it.  The fragment length saturates
+ * at 0xFFFF, far beyond the longest fragment that the length distribution
+ * models; the strands, mate status and library format are packed into
+ * flags as
+ *
+ *   bit 0: fwd, bit 1: mateIsFwd, bits 2-3: mateStatus, bits 4-9: formatID
+ */
+struct PackedHit {
+    uint32_t tid;
+    int32_t pos;
+    int32_t matePos;
+    uint16_t fragLen;
+    uint16_t flags;
+
+    template <typename AlnT>
+    static PackedHit pack(const AlnT& h) {
+        PackedHit c;
+        c.tid = h.tid;
+        c.pos = h.pos;
+        c.matePos = h.matePos;
+        c.fragLen = static_cast<uint16_t>(std::min(static_cast<uint32_t>(h.fragLen), uint32_t(0xFFFF)));
+        c.flags = static_cast<uint16_t>((h.fwd ? 0x1 : 0x0) | (h.mateIsFwd ? 0x2 : 0x0) |
+                                        ((static_cast<uint16_t>(h.mateStatus) & 0x3) << 2) |
+                                        ((h.format.formatID() & 0x3F) << 4));
+        return c;
+    }
+
+    template <typename AlnT>
+    void unpack(AlnT& h) const {
+        using MateStatusT = decltype(h.mateStatus);
+        h.tid = tid;
+        h.pos = pos;
+        h.matePos = matePos;
+        h.fragLen = fragLen;
+        h.fwd = flags & 0x1;
+        h.mateIsFwd = flags & 0x2;
+        h.mateStatus = static_cast<MateStatusT>((flags >> 2) & 0x3);
+        h.isPaired = (h.mateStatus == MateStatusT::PAIRED_END_PAIRED);
+        h.format = LibraryFormat::formatFromID((flags >> 4) & 0x3F);
+    }
+};
+static_assert(sizeof(PackedHit) == 16, "PackedHit should be 16 bytes");
+
+/**
+ * Writes the mappings of each mini-batch processed by a single mapping
+ * thread to a binary file.  The file starts with
+ *
+ *   [uint32_t flags]
+ *
+ * (bit 0: the names of the fragments are stored), and then each mini-batch
+ * is stored as
+ *
+ *   [uint32_t # observed fragments][uint32_t # mapped fragments]
+ *   [uint32_t # mappings] * (# mapped fragments)
+ *   [PackedHit] * (total # mappings)
+ *   ([uint32_t name length][name]) * (# mapped fragments)   (if names are stored)
+ *
+ * so that it's read back with a few reads into buffers that are reused from
+ * one mini-batch to the next.  Fragments without any mappings are not
+ * written, but are accounted for in the number of observed fragments.  The
+ * names are only kept when something (--writePosteriors) needs to identify
+ * the fragments once the cache is replayed.
+ */
+class MappingCacheWriter {
+    public:
+        static constexpr uint32_t storesNames = 0x1;
+
+        MappingCacheWriter(const boost::filesystem::path& path, bool withNames = false) :
+            out_(path.string(), std::ios::out | std::ios::binary | std::ios::trunc),
+            withNames_(withNames) {
+            uint32_t flags{0};
+            if (withNames_) { flags |= storesNames; }
+            out_.write(reinterpret_cast<const char*>(&flags), sizeof(flags));
+        }
+
+        bool good() const { return out_.good(); }
+
+        /**
+         * Write the mappings of the fragments in [begin, end); nameOf(i)
+         * gives the header of the (first read of the) i-th of them, and is
+         * only called if the names are stored.
+         */
+        template <typename GroupIt, typename NameFn>
+        void writeMiniBatch(GroupIt begin, GroupIt end, uint32_t numObserved, NameFn nameOf) {
+            counts_.clear();
+            hits_.clear();
+            names_.clear();
+            size_t i{0};
+            for (auto it = begin; it != end; ++it, ++i) {
+                auto& alns = it->alignments();
+                if (alns.size() == 0) { continue; }
+                counts_.push_back(alns.size());
+                for (auto& h : alns) { hits_.push_back(PackedHit::pack(h)); }
+                if (withNames_) { appendName_(nameOf(i)); }
+            }
+            uint32_t numMapped = counts_.size();
+            out_.write(reinterpret_cast<const char*>(&numObserved), sizeof(numObserved));
+            out_.write(reinterpret_cast<const char*>(&numMapped), sizeof(numMapped));
+            out_.write(reinterpret_cast<const char*>(counts_.data()), counts_.size() * sizeof(uint32_t));
+            out_.write(reinterpret_cast<const char*>(hits_.data()), hits_.size() * sizeof(PackedHit));
+            if (withNames_) { out_.write(names_.data(), names_.size()); }
+        }
+
+        template <typename GroupIt>
+        void writeMiniBatch(GroupIt begin, GroupIt end, uint32_t numObserved) {
+            writeMiniBatch(begin, end, numObserved, [](size_t) -> std::string { return std::string(); });
+        }
+
+        void close() { out_.close(); }
+
+    private:
+        // The read name, up to the first whitespace, without a /1 or /2 suffix
+        void appendName_(const std::string& header) {
+            size_t end = header.find_first_of(" \t");
+            if (end == std::string::npos) { end = header.size(); }
+            if (end >= 2 and header[end - 2] == '/' and (header[end - 1] == '1' or header[end - 1] == '2')) {
+                end -= 2;
+            }
+            uint32_t len = end;
+            names_.append(reinterpret_cast<const char*>(&len), sizeof(len));
+            names_.append(header, 0, end);
+        }
+
+        std::ofstream out_;
+        bool withNames_;
+        std::vector<uint32_t> counts_;
+        std::vector<PackedHit> hits_;
+        std::string names_;
+};
+
+/**
+ * Streams back the mini-batches written by a MappingCacheWriter.
+ */
+class MappingCacheReader {
+    public:
+        MappingCacheReader(const boost::filesystem::path& path) :
+            in_(path.string(), std::ios::in | std::ios::binary) {
+            uint32_t flags{0};
+            in_.read(reinterpret_cast<char*>(&flags), sizeof(flags));
+            hasNames_ = (flags & MappingCacheWriter::storesNames) != 0;
+        }
+
+        bool good() const { return in_.good(); }
+
+        // Whether the names of the fragments were stored with their mappings
+        bool hasNames() const { return hasNames_; }
+
+        /**
+         * The names of the mapped fragments of the last mini-batch read (in
+         * the order of their groups), if they were stored.
+         */
+        const std::vector<std::string>& names() const { return names_; }
+
+        /**
+         * Fill the first `numMapped` entries of `groups` with the next
+         * mini-batch from the cache.  Returns false once the cache is
+         * exhausted.
+         */
+        template <typename GroupVecT>
+        bool readMiniBatch(GroupVecT& groups, uint32_t& numObserved, uint32_t& numMapped) {
+            if (!in_.read(reinterpret_cast<char*>(&numObserved), sizeof(numObserved))) {
+                return false;
+            }
+            in_.read(reinterpret_cast<char*>(&numMapped), sizeof(numMapped));
+            if (numMapped > groups.size()) { groups.resize(numMapped); }
+
+            counts_.resize(numMapped);
+            in_.read(reinterpret_cast<char*>(counts_.data()), numMapped * sizeof(uint32_t));
+            size_t numHits{0};
+            for (auto c : counts_) { numHits += c; }
+            hits_.resize(numHits);
+            in_.read(reinterpret_cast<char*>(hits_.data()), numHits * sizeof(PackedHit));
+
+            const PackedHit* hit = hits_.data();
+            for (uint32_t g = 0; g < numMapped; ++g) {
+                auto& group = groups[g];
+                group.clearAlignments();
+                auto& alns = group.alignments();
+                alns.resize(counts_[g]);
+                for (auto& h : alns) { (hit++)->unpack(h); }
+            }
+
+            if (hasNames_) {
+                names_.resize(numMapped);
+                for (auto& name : names_) {
+                    uint32_t len{0};
+                    in_.read(reinterpret_cast<char*>(&len), sizeof(len));
+                    name.resize(len);
+                    if (len > 0) { in_.read(&name[0], len); }
+                }
+            }
+            return in_.good();
+        }
+
+    private:
+        std::ifstream in_;
+        bool hasNames_{false};
+        std::vector<uint32_t> counts_;
+        std::vector<PackedHit> hits_;
+        std::vector<std::string> names_;
+};
+
+namespace salmon {
+namespace utils {
+
+/**
+ * The mapping cache file written by thread `threadIdx` for the read
+ * library whose files are given by `readFiles`.
+ */
+inline boost::filesystem::path mappingCachePath(
+        const boost::filesystem::path& outputDirectory,
+        const std::string& readFiles,
+        size_t threadIdx) {
+    auto libHash = std::hash<std::string>()(readFiles);
+    return outputDirectory / "mapping_cache" /
+           (std::to_string(libHash) + "_" + std::to_string(threadIdx) + ".bin");
+}
+
+}
+}
+
+#endif // MAPPING_CACHE_HPP
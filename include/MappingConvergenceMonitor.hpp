@@ -0,0 +1,142 @@
+#ifndef __MAPPING_CONVERGENCE_MONITOR_HPP__
+#define __MAPPING_CONVERGENCE_MONITOR_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+/**
+ * Decides when the mapping pass can stop before the end of the input
+ * (salmon quant --stopOnConvergence, --maxFragments).  Every checkInterval
+ * fragments, one of the mapping threads compares the online abundance
+ * estimates (the normalized masses of the transcripts) with those of the
+ * previous check, and the number of equivalence classes with its previous
+ * value.  Once both the total variation distance between the estimates and
+ * the relative growth of the number of classes have stayed below the
+ * tolerance for numStableChecks consecutive checks (after burn-in), more
+ * fragments would hardly change the estimates, and mapping stops.  With
+ * maxFragments, it stops after that many fragments regardless.
+ *
+ * Once stopped, the fragments still to be read can be counted, without
+ * being mapped (--extrapolate), so that the estimated counts can be scaled
+ * to the depth of the whole library (see extrapolationFactor).
+ */
+class MappingConvergenceMonitor {
+    public:
+        static constexpr uint32_t numStableChecks = 3;
+
+        MappingConvergenceMonitor(bool stopOnConvergence, double tolerance, uint64_t checkInterval,
+                                  uint64_t maxFragments, bool countSkipped) :
+            stopOnConvergence_(stopOnConvergence), tolerance_(tolerance),
+            checkInterval_(std::max(checkInterval, uint64_t(1))), maxFragments_(maxFragments),
+            countSkipped_(countSkipped), nextCheck_(checkInterval_) {}
+
+        MappingConvergenceMonitor(const MappingConvergenceMonitor&) = delete;
+        MappingConvergenceMonitor& operator=(const MappingConvergenceMonitor&) = delete;
+
+        /**
+         * Called by the mapping threads after each mini-batch, with the
+         * number of fragments observed so far; returns true once mapping
+         * should stop.  Only one thread at a time runs a check, and the
+         * others carry on mapping rather than wait for it.
+         */
+        template <typename TranscriptVecT>
+        bool update(uint64_t numObserved, bool burnedIn, TranscriptVecT& transcripts, size_t numClasses) {
+            if (stopped_.load(std::memory_order_relaxed)) { return true; }
+            if (maxFragments_ > 0 and numObserved >= maxFragments_) {
+                stop_(numObserved, false);
+                return true;
+            }
+            if (!stopOnConvergence_ or numObserved < nextCheck_.load(std::memory_order_relaxed)) {
+                return false;
+            }
+            std::unique_lock<std::mutex> l(mutex_, std::try_to_lock);
+            if (!l.owns_lock() or numObserved < nextCheck_) { return stopped_; }
+            nextCheck_ = numObserved + checkInterval_;
+
+            current_.resize(transcripts.size());
+            double total{0.0};
+            for (size_t i = 0; i < transcripts.size(); ++i) {
+                // The masses are logged; a transcript without any is at LOG_0 (-inf)
+                current_[i] = std::exp(transcripts[i].mass(false));
+                total += current_[i];
+            }
+            if (total <= 0.0) { return false; }
+            for (auto& a : current_) { a /= total; }
+
+            if (previous_.size() == current_.size()) {
+                double distance{0.0};
+                for (size_t i = 0; i < current_.size(); ++i) { distance += std::abs(current_[i] - previous_[i]); }
+                lastDistance_ = 0.5 * distance;
+                lastClassGrowth_ = (numClasses > 0) ?
+                    static_cast<double>(numClasses - std::min(numClasses, prevNumClasses_)) / numClasses : 1.0;
+                bool stable = (lastDistance_ < tolerance_ and lastClassGrowth_ < tolerance_);
+                numStable_ = stable ? numStable_ + 1 : 0;
+            }
+            std::swap(previous_, current_);
+            prevNumClasses_ = numClasses;
+
+            if (burnedIn and numStable_ >= numStableChecks) {
+                stop_(numObserved, true);
+                return true;
+            }
+            return false;
+        }
+
+        bool stopped() const { return stopped_.load(std::memory_order_relaxed); }
+        // True if mapping stopped because the estimates converged (rather than at maxFragments)
+        bool converged() const { return converged_; }
+        uint64_t numFragmentsAtStop() const { return numAtStop_; }
+        // The total variation distance, and the relative growth of the number of
+        // equivalence classes, at the most recent check
+        double lastDistance() const { return lastDistance_; }
+        double lastClassGrowth() const { return lastClassGrowth_; }
+
+        // Whether the fragments read after mapping stopped are counted (rather than the input abandoned)
+        bool countSkipped() const { return countSkipped_; }
+        void addSkipped(uint64_t n) { numSkipped_ += n; }
+        uint64_t numSkipped() const { return numSkipped_; }
+
+        /**
+         * The factor by which the counts estimated from the mapped fragments
+         * are scaled to the depth of the whole input: (mapped + skipped) /
+         * mapped.  It's 1 unless the skipped fragments were counted.
+         */
+        double extrapolationFactor(uint64_t numObserved) const {
+            if (!countSkipped_ or numObserved == 0) { return 1.0; }
+            return static_cast<double>(numObserved + numSkipped_) / numObserved;
+        }
+
+    private:
+        void stop_(uint64_t numObserved, bool converged) {
+            bool expected{false};
+            if (stopped_.compare_exchange_strong(expected, true)) {
+                numAtStop_ = numObserved;
+                converged_ = converged;
+            }
+        }
+
+        bool stopOnConvergence_;
+        double tolerance_;
+        uint64_t checkInterval_;
+        uint64_t maxFragments_;
+        bool countSkipped_;
+        std::atomic<uint64_t> nextCheck_;
+        std::atomic<bool> stopped_{false};
+        bool converged_{false};
+        uint64_t numAtStop_{0};
+        std::atomic<uint64_t> numSkipped_{0};
+
+        std::mutex mutex_;
+        std::vector<double> previous_;
+        std::vector<double> current_;
+        size_t prevNumClasses_{0};
+        uint32_t numStable_{0};
+        double lastDistance_{1.0};
+        double lastClassGrowth_{1.0};
+};
+
+#endif // __MAPPING_CONVERGENCE_MONITOR_HPP__
@@ -0,0 +1,215 @@
+#ifndef __MAPPING_SAM_WRITER_HPP__
+#define __MAPPING_SAM_WRITER_HPP__
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "spdlog/spdlog.h"
+#include "spdlog/details/format.h"
+
+#include "RapMapUtils.hpp"
+#include "SalmonConfig.hpp"
+#include "Transcript.hpp"
+
+/**
+ * The SAM file to which the quasi-mappings are written (--writeMappings).
+ * The mapping threads format their records into their own
+ * MappingSAMBuffers, which hand them to the writer in large blocks, so the
+ * file is only locked once per block rather than once per record.
+ */
+class MappingSAMWriter {
+    public:
+        /**
+         * Write to the file at path, or to stdout if path is "-".
+         */
+        explicit MappingSAMWriter(const std::string& path) {
+            if (path == "-") {
+                out_ = &std::cout;
+            } else {
+                file_.reset(new std::ofstream(path, std::ios_base::out | std::ios_base::trunc));
+                out_ = file_.get();
+            }
+        }
+
+        bool good() const { return out_->good(); }
+
+        void writeHeader(const std::vector<Transcript>& transcripts, const std::string& commandLine) {
+            fmt::MemoryWriter h;
+            h << "@HD\tVN:1.0\tSO:unknown\n";
+            for (auto& t : transcripts) {
+                h << "@SQ\tSN:" << t.RefName << "\tLN:" << t.RefLength << '\n';
+            }
+            h << "@PG\tID:salmon\tPN:salmon\tVN:" << salmon::version << "\tCL:" << commandLine << '\n';
+            write(h);
+        }
+
+        // Append the records in buf, and clear it
+        void write(fmt::MemoryWriter& buf) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            out_->write(buf.data(), buf.size());
+            buf.clear();
+        }
+
+        void flush() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            out_->flush();
+        }
+
+    private:
+        std::unique_ptr<std::ofstream> file_;
+        std::ostream* out_{nullptr};
+        std::mutex mutex_;
+};
+
+/**
+ * A mapping thread's buffer of formatted SAM records.  Each mapping
+ * becomes a record (two, for a properly-paired fragment) whose CIGAR
+ * string is a match over the whole read, soft-clipped where the read
+ * overhangs the transcript; every mapping of a fragment but the first is
+ * marked as secondary.
+ */
+class MappingSAMBuffer {
+    public:
+        static constexpr size_t flushSize = 1 << 20;
+
+        explicit MappingSAMBuffer(MappingSAMWriter* writer) : writer_(writer) {}
+        ~MappingSAMBuffer() { flush(); }
+
+        template <typename ReadPairT>
+        void addPaired(const ReadPairT& r,
+                       const std::vector<QuasiAlignment>& hits,
+                       const std::vector<Transcript>& transcripts) {
+            using rapmap::utils::MateStatus;
+            if (hits.empty()) { return; }
+            auto leftName = readName_(r.first.header);
+            auto rightName = readName_(r.second.header);
+            bool primary{true};
+            for (auto& h : hits) {
+                auto& t = transcripts[h.tid];
+                uint32_t secondary = primary ? 0 : 0x100;
+                primary = false;
+                switch (h.mateStatus) {
+                    case MateStatus::PAIRED_END_PAIRED: {
+                        int32_t tlen = static_cast<int32_t>(h.fragLen);
+                        bool leftFirst = h.pos <= h.matePos;
+                        uint32_t leftFlag = 0x1 | 0x2 | 0x40 | secondary |
+                            (h.fwd ? 0 : 0x10) | (h.mateIsFwd ? 0 : 0x20);
+                        uint32_t rightFlag = 0x1 | 0x2 | 0x80 | secondary |
+                            (h.mateIsFwd ? 0 : 0x10) | (h.fwd ? 0 : 0x20);
+                        record_(leftName, leftFlag, t, h.pos, h.fwd, r.first.seq, r.first.qual,
+                                h.matePos, leftFirst ? tlen : -tlen);
+                        record_(rightName, rightFlag, t, h.matePos, h.mateIsFwd, r.second.seq, r.second.qual,
+                                h.pos, leftFirst ? -tlen : tlen);
+                        break;
+                    }
+                    case MateStatus::PAIRED_END_LEFT:
+                        record_(leftName, 0x1 | 0x8 | 0x40 | secondary | (h.fwd ? 0 : 0x10),
+                                t, h.pos, h.fwd, r.first.seq, r.first.qual, noMate_, 0);
+                        break;
+                    case MateStatus::PAIRED_END_RIGHT:
+                        record_(rightName, 0x1 | 0x8 | 0x80 | secondary | (h.fwd ? 0 : 0x10),
+                                t, h.pos, h.fwd, r.second.seq, r.second.qual, noMate_, 0);
+                        break;
+                    default:
+                        break;
+                }
+            }
+            if (buf_.size() >= flushSize) { flush(); }
+        }
+
+        template <typename ReadT>
+        void addSingle(const ReadT& r,
+                       const std::vector<QuasiAlignment>& hits,
+                       const std::vector<Transcript>& transcripts) {
+            if (hits.empty()) { return; }
+            auto name = readName_(r.header);
+            bool primary{true};
+            for (auto& h : hits) {
+                uint32_t flag = (primary ? 0 : 0x100) | (h.fwd ? 0 : 0x10);
+                primary = false;
+                record_(name, flag, transcripts[h.tid], h.pos, h.fwd, r.seq, r.qual, noMate_, 0);
+            }
+            if (buf_.size() >= flushSize) { flush(); }
+        }
+
+        void flush() {
+            if (writer_ and buf_.size() > 0) { writer_->write(buf_); }
+        }
+
+    private:
+        // The read name, up to the first whitespace, without a /1 or /2 suffix
+        static std::string readName_(const std::string& header) {
+            size_t end = header.find_first_of(" \t");
+            if (end == std::string::npos) { end = header.size(); }
+            if (end >= 2 and header[end - 2] == '/' and (header[end - 1] == '1' or header[end - 1] == '2')) {
+                end -= 2;
+            }
+            return header.substr(0, end);
+        }
+
+        static constexpr int32_t noMate_ = std::numeric_limits<int32_t>::min();
+
+        // A matePos of noMate_ means that the read has no (mapped) mate
+        void record_(const std::string& name, uint32_t flag, const Transcript& t,
+                     int32_t pos, bool fwd, const std::string& seq, const std::string& qual,
+                     int32_t matePos, int32_t tlen) {
+            int32_t readLen = static_cast<int32_t>(seq.size());
+            int32_t refLen = static_cast<int32_t>(t.RefLength);
+            // Soft-clip the bases that hang off either end of the transcript
+            int32_t clipStart = (pos < 0) ? std::min(-pos, readLen) : 0;
+            int32_t clipEnd = std::max(0, std::min(readLen - clipStart, pos + readLen - refLen));
+            int32_t matched = readLen - clipStart - clipEnd;
+
+            buf_ << name << '\t' << flag << '\t' << t.RefName << '\t' << (std::max(pos, 0) + 1) << "\t255\t";
+            if (matched <= 0) {
+                buf_ << '*';
+            } else {
+                if (clipStart > 0) { buf_ << clipStart << 'S'; }
+                buf_ << matched << 'M';
+                if (clipEnd > 0) { buf_ << clipEnd << 'S'; }
+            }
+            if (matePos != noMate_) {
+                buf_ << "\t=\t" << (std::max(matePos, 0) + 1) << '\t' << tlen << '\t';
+            } else {
+                buf_ << "\t*\t0\t0\t";
+            }
+            if (fwd) {
+                buf_ << seq << '\t';
+                buf_ << (qual.empty() ? std::string("*") : qual);
+            } else {
+                rc_.resize(seq.size());
+                for (size_t i = 0; i < seq.size(); ++i) { rc_[seq.size() - 1 - i] = complement_(seq[i]); }
+                buf_ << rc_ << '\t';
+                if (qual.empty()) {
+                    buf_ << '*';
+                } else {
+                    rc_.assign(qual.rbegin(), qual.rend());
+                    buf_ << rc_;
+                }
+            }
+            buf_ << '\n';
+        }
+
+        static inline char complement_(char c) {
+            switch (c) {
+                case 'A': case 'a': return 'T';
+                case 'C': case 'c': return 'G';
+                case 'G': case 'g': return 'C';
+                case 'T': case 't': case 'U': case 'u': return 'A';
+                default: return 'N';
+            }
+        }
+
+        MappingSAMWriter* writer_;
+        fmt::MemoryWriter buf_;
+        std::string rc_;
+};
+
+#endif // __MAPPING_SAM_WRITER_HPP__
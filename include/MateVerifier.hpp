@@ -0,0 +1,126 @@
+#ifndef __MATE_VERIFIER_HPP__
+#define __MATE_VERIFIER_HPP__
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "RapMapUtils.hpp"
+
+/**
+ * Checks the right mate of a pair directly against the transcripts that
+ * the left mate hit, rather than searching the whole index for it (salmon
+ * quant --mateVerify).  For each left hit, the mate, in the orientation
+ * opposite to the left mate's, is looked for in the window of the
+ * transcript within --fldMax of the hit: three anchor k-mers of the mate
+ * (at its start, middle and end) are found by direct comparison, and a
+ * placement is accepted if at least two of them agree on where the mate
+ * starts.
+ *
+ * Only if every left hit is verified are the verified hits used; otherwise
+ * the mate is searched for as usual.  Either way, the intersection of the
+ * mates' hits (which is a subset of the left hits) then holds all of the
+ * left hits, so the pair gets the same transcripts as it would have.
+ */
+class MateVerifier {
+    public:
+        MateVerifier(uint32_t k, size_t maxFragLen) :
+            k_(static_cast<int32_t>(k)), maxFragLen_(static_cast<int32_t>(maxFragLen)) {}
+
+        /**
+         * Verify mate against each of leftHits, filling mateHits with its
+         * placements; false (with mateHits cleared) unless all of them were
+         * verified.
+         */
+        template <typename HitT, typename TranscriptVecT>
+        bool verify(const std::vector<HitT>& leftHits, int32_t leftReadLen, const std::string& mate,
+                    TranscriptVecT& transcripts, std::vector<HitT>& mateHits) {
+            mateHits.clear();
+            int32_t mateLen = static_cast<int32_t>(mate.size());
+            if (leftHits.empty() or mateLen < k_) { return false; }
+
+            revComp_.resize(mate.size());
+            for (int32_t i = 0; i < mateLen; ++i) { revComp_[mateLen - 1 - i] = complement_(mate[i]); }
+
+            for (auto& h : leftHits) {
+                auto& txp = transcripts[h.tid];
+                const char* tseq = txp.Sequence();
+                if (tseq == nullptr) { mateHits.clear(); return false; }
+                int32_t tlen = static_cast<int32_t>(txp.RefLength);
+                int32_t winStart = std::max(int32_t(0), h.pos - maxFragLen_);
+                int32_t winEnd = std::min(tlen, h.pos + leftReadLen + maxFragLen_);
+
+                // The mate is on the strand opposite to the left mate
+                bool mateFwd = !h.fwd;
+                const std::string& oriented = mateFwd ? mate : revComp_;
+                int32_t matePos{0};
+                if (!place_(oriented, tseq, winStart, winEnd, matePos)) {
+                    mateHits.clear();
+                    return false;
+                }
+                mateHits.push_back(h);
+                auto& m = mateHits.back();
+                m.pos = matePos;
+                m.fwd = mateFwd;
+                m.readLen = static_cast<uint32_t>(mateLen);
+                m.mateStatus = rapmap::utils::MateStatus::PAIRED_END_RIGHT;
+            }
+            return true;
+        }
+
+    private:
+        static char complement_(char c) {
+            switch (c) {
+                case 'A': case 'a': return 'T';
+                case 'C': case 'c': return 'G';
+                case 'G': case 'g': return 'C';
+                case 'T': case 't': return 'A';
+                default: return 'N';
+            }
+        }
+
+        // Whether the k-mer of seq at offset o matches the transcript at position p (within the window)
+        bool anchorAt_(const std::string& seq, int32_t o, const char* tseq, int32_t p, int32_t winEnd) const {
+            if (p < 0 or p + k_ > winEnd) { return false; }
+            return std::memcmp(seq.data() + o, tseq + p, k_) == 0;
+        }
+
+        /**
+         * Find where seq starts in the window [winStart, winEnd) of the
+         * transcript tseq, from its anchors; false if no two agree.
+         */
+        bool place_(const std::string& seq, const char* tseq, int32_t winStart, int32_t winEnd, int32_t& pos) const {
+            if (winEnd - winStart < k_) { return false; }
+            int32_t len = static_cast<int32_t>(seq.size());
+            int32_t anchors[3] = {0, (len - k_) / 2, len - k_};
+            // Any two agreeing anchors include the first or the second, so
+            // only their occurrences need to be searched for
+            for (int32_t a = 0; a < 2; ++a) {
+                const char* kmer = seq.data() + anchors[a];
+                const char* wbegin = tseq + winStart;
+                const char* wend = tseq + winEnd;
+                for (const char* it = std::search(wbegin, wend, kmer, kmer + k_); it != wend;
+                     it = std::search(it + 1, wend, kmer, kmer + k_)) {
+                    int32_t start = static_cast<int32_t>(it - tseq) - anchors[a];
+                    uint32_t support{1};
+                    for (int32_t b = a + 1; b < 3; ++b) {
+                        if (anchors[b] != anchors[a] and
+                            anchorAt_(seq, anchors[b], tseq, start + anchors[b], winEnd)) { ++support; }
+                    }
+                    if (support >= 2) {
+                        pos = start;
+                        return true;
+                    }
+                }
+            }
+            return false;
+        }
+
+        int32_t k_;
+        int32_t maxFragLen_;
+        std::string revComp_;
+};
+
+#endif // __MATE_VERIFIER_HPP__
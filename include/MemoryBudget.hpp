@@ -0,0 +1,163 @@
+#ifndef __MEMORY_BUDGET_HPP__
+#define __MEMORY_BUDGET_HPP__
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <limits>
+#include <string>
+
+#include <boost/filesystem.hpp>
+
+#include "spdlog/spdlog.h"
+
+/**
+ * Sizes the largest of salmon's buffers from a single budget of bytes
+ * (salmon quant --maxMemory), rather than from their separate defaults, so
+ * that the peak resident size of a run can be predicted (e.g. to pack jobs
+ * onto a node).  The index (measured by the size of its files) and a fixed
+ * amount of scratch space per thread come off the top; what remains is
+ * split between the buffered reads of the parser's jobs, the initial
+ * reservation of the equivalence class map, and the cached fragments:
+ * those of the mapping cache in quasi-mapping mode or, in alignment mode,
+ * those of the BAM parser's pools and of the alignment cache, which share
+ * the same share between them.  No buffer is ever sized
+ * beyond its default, so a budget can only shrink them.
+ *
+ * The per-item sizes are estimates (of a typical read, class or cached
+ * fragment with its overhead), so the plan bounds the footprint of these
+ * buffers, not that of the whole process exactly.
+ */
+class MemoryBudget {
+    public:
+        // Estimates of the bytes taken by each item of the buffers being sized
+        static constexpr uint64_t bytesPerThread = 64ULL << 20; // a mapping thread's scratch (hits, local builders)
+        static constexpr uint64_t bytesPerBufferedRead = 1024; // a parsed read (header, sequence, qualities)
+        static constexpr uint64_t bytesPerEqClass = 256; // a class's labels, weights and hash map entry
+        static constexpr uint64_t bytesPerCachedFragment = 512; // a cached alignment group with its alignments
+
+        // The defaults that the budget scales down
+        static constexpr uint32_t defaultJobsPerThread = 4;
+        static constexpr size_t defaultEqClassReserve = 1000000;
+        static constexpr uint32_t defaultAlignmentPoolSize = 2000000;
+        static constexpr uint64_t defaultAlignmentCacheBytes = 1ULL << 30;
+
+        struct Plan {
+            uint64_t indexBytes{0};
+            uint64_t threadBytes{0};
+            uint32_t numParserJobs{0};
+            size_t eqClassReserve{defaultEqClassReserve};
+            uint32_t mappingCacheFragments{0};
+            uint32_t alignmentPoolSize{defaultAlignmentPoolSize};
+            uint64_t alignmentCacheBytes{defaultAlignmentCacheBytes};
+            bool overBudget{false}; // the index and the threads alone exceed the budget
+        };
+
+        /**
+         * Parse a size in bytes, with an optional K, M, G or T suffix (powers
+         * of 1024); false if it isn't one.
+         */
+        static bool parseBytes(const std::string& str, uint64_t& bytes) {
+            if (str.empty()) { return false; }
+            size_t end{0};
+            uint64_t value{0};
+            try {
+                value = std::stoull(str, &end);
+            } catch (...) {
+                return false;
+            }
+            if (end == str.size()) {
+                bytes = value;
+                return true;
+            }
+            if (end + 1 != str.size() and !(end + 2 == str.size() and std::toupper(str[end + 1]) == 'B')) {
+                return false;
+            }
+            uint32_t shift{0};
+            switch (std::toupper(str[end])) {
+                case 'K': shift = 10; break;
+                case 'M': shift = 20; break;
+                case 'G': shift = 30; break;
+                case 'T': shift = 40; break;
+                default: return false;
+            }
+            // A size that doesn't fit in 64 bits isn't one
+            if (value > (std::numeric_limits<uint64_t>::max() >> shift)) { return false; }
+            bytes = value << shift;
+            return true;
+        }
+
+        // The total size of the files of the index (and of its extensions)
+        static uint64_t indexBytes(const boost::filesystem::path& indexDir) {
+            namespace bfs = boost::filesystem;
+            uint64_t total{0};
+            boost::system::error_code ec;
+            for (bfs::recursive_directory_iterator it(indexDir, ec), end; !ec and it != end; it.increment(ec)) {
+                if (bfs::is_regular_file(it->status())) {
+                    uint64_t size = bfs::file_size(it->path(), ec);
+                    if (!ec) { total += size; }
+                    ec.clear();
+                }
+            }
+            return total;
+        }
+
+        /**
+         * The plan of the buffers for a budget of budgetBytes, given the size
+         * of the index, the number of threads, the number of reads in a
+         * parser job (counting both mates of a pair), and the default size
+         * of the mapping cache (in fragments).
+         */
+        static Plan plan(uint64_t budgetBytes, uint64_t indexSize, uint32_t numThreads,
+                         uint64_t readsPerJob, uint32_t defaultCacheFragments) {
+            Plan p;
+            numThreads = std::max(numThreads, uint32_t(1));
+            p.indexBytes = indexSize;
+            p.threadBytes = bytesPerThread * numThreads;
+            uint64_t fixed = p.indexBytes + p.threadBytes;
+            p.overBudget = (fixed >= budgetBytes);
+            uint64_t remaining = p.overBudget ? 0 : budgetBytes - fixed;
+
+            // 10% for the parser's jobs (at least one more than there are
+            // threads, so that none waits for the parser), 30% for the
+            // equivalence classes and 60% for the cached fragments.  Only
+            // one mode runs at once, so the mapping cache (quasi-mapping)
+            // has all of the last share, while the pools and the alignment
+            // cache (alignment mode), which are used together, have half each.
+            uint64_t jobBytes = std::max(readsPerJob, uint64_t(1)) * bytesPerBufferedRead;
+            uint64_t maxJobs = defaultJobsPerThread * static_cast<uint64_t>(numThreads);
+            p.numParserJobs = static_cast<uint32_t>(
+                    std::max(uint64_t(numThreads) + 1, std::min(maxJobs, (remaining / 10) / jobBytes)));
+            p.eqClassReserve = static_cast<size_t>(
+                    std::max(uint64_t(10000), std::min(uint64_t(defaultEqClassReserve),
+                                                       (3 * remaining / 10) / bytesPerEqClass)));
+            uint64_t cacheBytes = 6 * remaining / 10;
+            p.mappingCacheFragments = static_cast<uint32_t>(
+                    std::max(uint64_t(100000), std::min(uint64_t(defaultCacheFragments),
+                                                        cacheBytes / bytesPerCachedFragment)));
+            p.alignmentPoolSize = static_cast<uint32_t>(
+                    std::max(uint64_t(100000), std::min(uint64_t(defaultAlignmentPoolSize),
+                                                        (cacheBytes / 2) / bytesPerCachedFragment)));
+            // The (compact) alignment cache holds the same fragments, in bytes
+            p.alignmentCacheBytes = std::max(uint64_t(64) << 20,
+                                             std::min(uint64_t(defaultAlignmentCacheBytes), cacheBytes / 2));
+            return p;
+        }
+
+        // Log the plan for a budget of budgetBytes
+        static void report(const Plan& p, uint64_t budgetBytes, spdlog::logger* log) {
+            auto mib = [](uint64_t b) -> double { return static_cast<double>(b) / (1 << 20); };
+            log->info("memory budget of {:.1f} MiB: index {:.1f} MiB, thread scratch {:.1f} MiB, "
+                      "{} parser jobs, {} equivalence classes reserved, {} cached fragments "
+                      "({:.1f} MiB of alignment cache), {} pooled alignment groups",
+                      mib(budgetBytes), mib(p.indexBytes), mib(p.threadBytes), p.numParserJobs,
+                      p.eqClassReserve, p.mappingCacheFragments, mib(p.alignmentCacheBytes),
+                      p.alignmentPoolSize);
+            if (p.overBudget) {
+                log->warn("the index and the per-thread scratch space alone exceed the memory budget; "
+                          "every buffer is at its minimum");
+            }
+        }
+};
+
+#endif // __MEMORY_BUDGET_HPP__
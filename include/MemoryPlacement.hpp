@@ -0,0 +1,104 @@
+#ifndef __MEMORY_PLACEMENT_HPP__
+#define __MEMORY_PLACEMENT_HPP__
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+namespace salmon {
+namespace utils {
+
+/**
+ * Ask the kernel to back the (whole) pages of [p, p + bytes) with
+ * transparent huge pages, which reduces the TLB misses of random probes
+ * into large arrays (e.g. the suffix array).  This is only a hint; it
+ * returns false if it was rejected, and does nothing on systems without
+ * MADV_HUGEPAGE.
+ */
+inline bool adviseHugePages(const void* p, size_t bytes) {
+#if defined(MADV_HUGEPAGE)
+    uintptr_t pageSize = static_cast<uintptr_t>(::sysconf(_SC_PAGESIZE));
+    uintptr_t begin = reinterpret_cast<uintptr_t>(p);
+    uintptr_t end = begin + bytes;
+    begin = (begin + pageSize - 1) & ~(pageSize - 1);
+    end &= ~(pageSize - 1);
+    if (end <= begin) { return false; }
+    return ::madvise(reinterpret_cast<void*>(begin), end - begin, MADV_HUGEPAGE) == 0;
+#else
+    return false;
+#endif
+}
+
+template <typename T>
+inline bool adviseHugePages(const std::vector<T>& v) {
+    return adviseHugePages(v.data(), v.size() * sizeof(T));
+}
+
+/**
+ * Interleave the pages that this process allocates from now on across all
+ * of the online NUMA nodes, so that a structure which every thread probes
+ * at random (the index) does not live entirely on one socket.  Returns
+ * false if the policy could not be set (e.g. on a single-node machine or a
+ * kernel without NUMA support).
+ */
+inline bool interleaveMemoryAcrossNodes() {
+#if defined(__linux__) && defined(SYS_set_mempolicy)
+    // The online nodes are listed as ranges, e.g. "0-1" or "0,2-3"
+    std::ifstream onlineFile("/sys/devices/system/node/online");
+    std::string online;
+    if (!(onlineFile >> online)) { return false; }
+    constexpr size_t maxNodes = 64;
+    unsigned long mask{0};
+    size_t numNodes{0};
+    size_t pos{0};
+    while (pos < online.size()) {
+        size_t next = online.find(',', pos);
+        if (next == std::string::npos) { next = online.size(); }
+        std::string range = online.substr(pos, next - pos);
+        size_t dash = range.find('-');
+        unsigned long first = std::stoul(range.substr(0, dash));
+        unsigned long last = (dash == std::string::npos) ? first : std::stoul(range.substr(dash + 1));
+        for (unsigned long n = first; n <= last and n < maxNodes; ++n) {
+            mask |= (1UL << n);
+            ++numNodes;
+        }
+        pos = next + 1;
+    }
+    if (numNodes < 2) { return false; }
+    constexpr int mpolInterleave = 3; // MPOL_INTERLEAVE in <numaif.h>
+    return ::syscall(SYS_set_mempolicy, mpolInterleave, &mask, maxNodes + 1) == 0;
+#else
+    return false;
+#endif
+}
+
+/**
+ * Pin the i-th of the given threads to the (firstCPU + i)-th CPU (modulo
+ * the number of CPUs), so that the worker threads neither migrate between
+ * sockets nor share a core while others are idle.
+ */
+inline void pinThreads(std::vector<std::thread>& threads, size_t firstCPU = 0) {
+#if defined(__linux__)
+    size_t numCPUs = std::thread::hardware_concurrency();
+    if (numCPUs == 0) { return; }
+    for (size_t i = 0; i < threads.size(); ++i) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET((firstCPU + i) % numCPUs, &cpus);
+        pthread_setaffinity_np(threads[i].native_handle(), sizeof(cpu_set_t), &cpus);
+    }
+#endif
+}
+
+}
+}
+
+#endif // __MEMORY_PLACEMENT_HPP__
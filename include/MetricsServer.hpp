@@ -0,0 +1,277 @@
+#ifndef __METRICS_SERVER_HPP__
+#define __METRICS_SERVER_HPP__
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include <unistd.h>
+
+#include <boost/asio.hpp>
+
+#include "RunProfiler.hpp"
+
+namespace salmon {
+namespace metrics {
+
+/**
+ * The live operational metrics of a run (--metricsPort), rendered in the
+ * Prometheus text exposition format.  A metric's value is either set by
+ * the code that owns it (e.g. the EM's iteration, once per round), or
+ * sampled when the metrics are scraped, by a function registered with
+ * sample() (e.g. from the atomic fragment counters of the mapping threads),
+ * so that the hot paths never touch the registry.  A sampled metric keeps
+ * its last value once its registration is dropped, so the counters of the
+ * mapping pass are still reported while the optimizer runs.
+ *
+ * Rates (fragments per second) are left to the scraper (rate() of the
+ * counters).  The phase of the run is that of the profiler (the open
+ * RunProfiler phases), and the memory is that of the whole process.
+ */
+class Registry {
+    public:
+        enum class Type { Counter, Gauge };
+
+        // Keeps a sampled metric sampled for as long as it is held
+        using Registration = std::shared_ptr<void>;
+
+        explicit Registry(std::shared_ptr<RunProfiler> profiler) : profiler_(profiler) {
+            define_("salmon_fragments_observed_total", Type::Counter, "Fragments (reads or read pairs) observed");
+            define_("salmon_fragments_mapped_total", Type::Counter, "Fragments mapped (or aligned) to a transcript");
+            define_("salmon_mapping_rate", Type::Gauge, "Fraction of the observed fragments that were mapped");
+            define_("salmon_aln_group_queue_depth", Type::Gauge,
+                    "Parsed alignment groups waiting to be batched (alignment mode)");
+            define_("salmon_aln_group_pool_depth", Type::Gauge,
+                    "Free alignment groups available to the parser (alignment mode)");
+            define_("salmon_work_queue_depth", Type::Gauge,
+                    "Mini-batches waiting for a quantification thread (alignment mode)");
+            define_("salmon_em_iteration", Type::Gauge, "Rounds of the offline optimization (EM / VBEM) so far");
+            define_("salmon_em_max_rel_diff", Type::Gauge,
+                    "Largest relative change of an abundance in the last round of the offline optimization");
+            define_("salmon_bootstraps_requested", Type::Gauge, "Bootstrap replicates to draw");
+            define_("salmon_bootstraps_completed_total", Type::Counter, "Bootstrap replicates drawn");
+        }
+
+        Registry(const Registry&) = delete;
+        Registry& operator=(const Registry&) = delete;
+
+        void set(const std::string& name, double value) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            metrics_[name].value = value;
+        }
+
+        void add(const std::string& name, double delta) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            metrics_[name].value += delta;
+        }
+
+        /**
+         * Sample the metric name by calling f whenever the metrics are
+         * scraped, until the returned registration is dropped.  f is called
+         * from the server's thread, and must only read what is safe to read
+         * concurrently (e.g. atomics).
+         */
+        Registration sample(const std::string& name, std::function<double()> f) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                metrics_[name].sampler = f;
+            }
+            return Registration(nullptr, [this, name](void*) -> void {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto& m = metrics_[name];
+                if (m.sampler) { m.value = m.sampler(); }
+                m.sampler = nullptr;
+            });
+        }
+
+        // The metrics, in the Prometheus text exposition format (version 0.0.4)
+        std::string render() {
+            std::ostringstream out;
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (auto& kv : metrics_) {
+                auto& m = kv.second;
+                write_(out, kv.first, m.type, m.help, m.sampler ? m.sampler() : m.value);
+            }
+            write_(out, "salmon_resident_bytes", Type::Gauge, "Resident set size of the process",
+                   currentRSSBytes());
+            write_(out, "salmon_peak_resident_bytes", Type::Gauge, "Peak resident set size of the process",
+                   RunProfiler::peakRSSBytes());
+            std::string phase = profiler_ ? profiler_->currentPhase() : std::string();
+            out << "# HELP salmon_phase The phase of the run (its nested profiler phases)\n"
+                << "# TYPE salmon_phase gauge\n"
+                << "salmon_phase{phase=\"" << escape_(phase) << "\"} 1\n";
+            return out.str();
+        }
+
+        // The resident set size of the process now (0 where it can't be read)
+        static uint64_t currentRSSBytes() {
+            std::ifstream statm("/proc/self/statm");
+            uint64_t size{0}, resident{0};
+            if (!(statm >> size >> resident)) { return 0; }
+            return resident * static_cast<uint64_t>(::sysconf(_SC_PAGESIZE));
+        }
+
+    private:
+        struct Metric {
+            Type type{Type::Gauge};
+            std::string help;
+            double value{0.0};
+            std::function<double()> sampler;
+        };
+
+        void define_(const std::string& name, Type type, const std::string& help) {
+            auto& m = metrics_[name];
+            m.type = type;
+            m.help = help;
+        }
+
+        static void write_(std::ostringstream& out, const std::string& name, Type type,
+                           const std::string& help, double value) {
+            if (!help.empty()) { out << "# HELP " << name << " " << help << "\n"; }
+            out << "# TYPE " << name << " " << (type == Type::Counter ? "counter" : "gauge") << "\n";
+            out << name << " ";
+            if (std::isnan(value)) {
+                out << "NaN";
+            } else if (std::isinf(value)) {
+                out << (value > 0 ? "+Inf" : "-Inf");
+            } else {
+                char buf[32];
+                std::snprintf(buf, sizeof(buf), "%.15g", value);
+                out << buf;
+            }
+            out << "\n";
+        }
+
+        static std::string escape_(const std::string& s) {
+            std::string e;
+            for (char c : s) {
+                if (c == '"' or c == '\\') { e.push_back('\\'); }
+                if (c == '\n') { e += "\\n"; continue; }
+                e.push_back(c);
+            }
+            return e;
+        }
+
+        std::shared_ptr<RunProfiler> profiler_;
+        std::map<std::string, Metric> metrics_;
+        std::mutex mutex_;
+};
+
+/**
+ * Serves the metrics of a Registry over HTTP, at GET /metrics, from a
+ * thread of its own (boost::asio, as the VersionChecker uses).  Each
+ * connection is answered once and closed, and one that hasn't been
+ * answered within connectionSeconds() (a client that connects but never
+ * sends its request, or never reads the reply) is closed then.  The
+ * constructor throws a boost::system::system_error if the address can't
+ * be bound.
+ */
+class Server {
+    public:
+        Server(std::shared_ptr<Registry> registry, const std::string& address, uint16_t port) :
+            registry_(registry), acceptor_(io_) {
+            using boost::asio::ip::tcp;
+            tcp::endpoint endpoint(boost::asio::ip::address::from_string(address), port);
+            acceptor_.open(endpoint.protocol());
+            acceptor_.set_option(tcp::acceptor::reuse_address(true));
+            acceptor_.bind(endpoint);
+            acceptor_.listen();
+            accept_();
+            thread_ = std::thread([this]() -> void { io_.run(); });
+        }
+
+        ~Server() {
+            io_.stop();
+            thread_.join();
+        }
+
+        Server(const Server&) = delete;
+        Server& operator=(const Server&) = delete;
+
+        // The port on which the server listens (the one chosen, if 0 was given)
+        uint16_t port() const { return acceptor_.local_endpoint().port(); }
+
+    private:
+        // How long a connection may take to be answered
+        static long connectionSeconds() { return 10; }
+
+        struct Connection {
+            explicit Connection(boost::asio::io_service& io) :
+                socket(io), request(maxRequestBytes), deadline(io) {}
+            static constexpr size_t maxRequestBytes = 8192;
+            boost::asio::ip::tcp::socket socket;
+            boost::asio::streambuf request;
+            std::string response;
+            boost::asio::deadline_timer deadline;
+
+            void close() {
+                boost::system::error_code ignored;
+                deadline.cancel(ignored);
+                socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+                socket.close(ignored);
+            }
+        };
+
+        void accept_() {
+            auto conn = std::make_shared<Connection>(io_);
+            acceptor_.async_accept(conn->socket, [this, conn](const boost::system::error_code& err) -> void {
+                if (err == boost::asio::error::operation_aborted) { return; }
+                if (!err) { serve_(conn); }
+                accept_();
+            });
+        }
+
+        void serve_(std::shared_ptr<Connection> conn) {
+            // Closing the socket at the deadline ends the pending read or write
+            conn->deadline.expires_from_now(boost::posix_time::seconds(connectionSeconds()));
+            conn->deadline.async_wait([conn](const boost::system::error_code& err) -> void {
+                if (err != boost::asio::error::operation_aborted) { conn->close(); }
+            });
+            boost::asio::async_read_until(conn->socket, conn->request, "\r\n\r\n",
+                [this, conn](const boost::system::error_code& err, size_t) -> void {
+                    if (err) {
+                        conn->close();
+                        return;
+                    }
+                    std::istream in(&conn->request);
+                    std::string method, target;
+                    in >> method >> target;
+                    target = target.substr(0, target.find('?'));
+                    if (method != "GET") {
+                        conn->response = reply_("405 Method Not Allowed", "text/plain", "Only GET is supported\n");
+                    } else if (target != "/metrics") {
+                        conn->response = reply_("404 Not Found", "text/plain", "The metrics are at /metrics\n");
+                    } else {
+                        conn->response = reply_("200 OK", "text/plain; version=0.0.4", registry_->render());
+                    }
+                    boost::asio::async_write(conn->socket, boost::asio::buffer(conn->response),
+                        [conn](const boost::system::error_code&, size_t) -> void { conn->close(); });
+                });
+        }
+
+        static std::string reply_(const std::string& status, const std::string& contentType,
+                                  const std::string& body) {
+            return "HTTP/1.1 " + status + "\r\n"
+                   "Content-Type: " + contentType + "\r\n"
+                   "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                   "Connection: close\r\n\r\n" + body;
+        }
+
+        std::shared_ptr<Registry> registry_;
+        boost::asio::io_service io_;
+        boost::asio::ip::tcp::acceptor acceptor_;
+        std::thread thread_;
+};
+
+}
+}
+
+#endif // __METRICS_SERVER_HPP__
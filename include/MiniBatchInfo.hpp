@@ -20,19 +20,17 @@ class MiniBatchInfo {
         std::vector<AlnGroupT*>* alignments;
         double logForgettingMass;
 
+        /**
+         * Return the fragments and alignment groups of this mini-batch to
+         * their pools; each group's fragments are returned in bulk.
+         */
         template <typename FragT>
-        void release(tbb::concurrent_queue<FragT*>& fragmentQueue,
+        void release(moodycamel::ConcurrentQueue<FragT*>& fragmentQueue,
                      moodycamel::ConcurrentQueue<AlnGroupT*>& alignmentGroupQueue){
                     // tbb::concurrent_bounded_queue<AlnGroupT*>& alignmentGroupQueue){
             size_t ng{0};
             for (auto& alnGroup : *alignments) {
-                //fragmentQueue.enqueue_bulk(alnGroup->alignments().begin(), alnGroup->alignments().size());
-
-                for (auto aln : alnGroup->alignments()) {
-                   fragmentQueue.push(aln);
-                    aln = nullptr;
-                }
-
+                fragmentQueue.enqueue_bulk(alnGroup->alignments().begin(), alnGroup->alignments().size());
                 alnGroup->alignments().clear();
                 //alignmentGroupQueue.push(alnGroup);
                 //alnGroup = nullptr;
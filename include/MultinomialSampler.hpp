@@ -4,12 +4,82 @@
 #include <random>
 #include <vector>
 #include <algorithm>
+#include <utility>
 
+/**
+ * A fixed distribution over (possibly millions of) categories, laid out
+ * for drawing many multinomial samples from it by binomial splitting (see
+ * MultinomialSampler).  The categories are grouped into blocks of
+ * blockSize, and a complete binary tree holds the total probability of
+ * the blocks below each of its nodes, so a sample of n trials costs one
+ * binomial draw per node that receives trials, rather than a pass over
+ * every category.  The conditional probabilities are ratios of these
+ * subtree masses, so (unlike a long chain of conditional binomials) they
+ * don't accumulate the rounding error of subtracting from the remaining
+ * mass.  The tree is read-only once built, so a single one can be shared
+ * by the samplers of any number of threads.
+ */
+class MultinomialSplitTree {
+    public:
+        static constexpr uint32_t blockSize = 64;
+
+        explicit MultinomialSplitTree(std::vector<double> probs) : probs_(std::move(probs)) {
+            size_t numBlocks = (probs_.size() + blockSize - 1) / blockSize;
+            size_ = 1;
+            while (size_ < numBlocks) { size_ <<= 1; }
+            mass_.assign(2 * size_, 0.0);
+            for (size_t i = 0; i < probs_.size(); ++i) { mass_[size_ + i / blockSize] += probs_[i]; }
+            for (size_t i = size_ - 1; i > 0; --i) { mass_[i] = mass_[2 * i] + mass_[2 * i + 1]; }
+        }
+
+        size_t numCategories() const { return probs_.size(); }
+        double totalMass() const { return mass_[1]; }
+
+    private:
+        friend class MultinomialSampler;
+
+        std::vector<double> probs_;
+        // mass_[i] is the probability below node i (whose children are
+        // 2i and 2i + 1); block j is the leaf size_ + j
+        std::vector<double> mass_;
+        size_t size_{1};
+};
+
+/**
+ * Draws multinomial samples.  Each sampler owns its random number
+ * generator and its scratch space (which only grows), so a sampler should
+ * be used by a single thread, and drawing a sample performs no heap
+ * allocation once the scratch space has grown to the largest k seen.
+ *
+ * If the number of trials is small relative to the number of categories,
+ * each trial is drawn from the cumulative distribution.  Otherwise, the
+ * counts are drawn as a sequence of conditional binomials, which requires
+ * k (rather than n) random draws.
+ */
 class MultinomialSampler {
     public:
         MultinomialSampler(std::random_device& rd) :
             gen_(rd()), u01_(0.0, 1.0) {}
 
+        MultinomialSampler(uint32_t seed) :
+            gen_(seed), u01_(0.0, 1.0) {}
+
+        /**
+         * Restart the random number stream of this sampler from `seed`.
+         */
+        void seed(uint32_t seed) {
+            gen_.seed(seed);
+            u01_.reset();
+            binom_.reset();
+        }
+
+        /**
+         * Draw n trials among the k categories whose probabilities start
+         * at probsBegin, adding the counts to [sampleBegin, sampleBegin + k)
+         * (which is zeroed first if clearCounts is true).  If the
+         * probabilities sum to less than 1, the remaining mass is that of
+         * an implicit category whose trials are discarded.
+         */
         void operator()(
                 std::vector<uint64_t>::iterator sampleBegin,
                 uint32_t n,
@@ -17,8 +87,7 @@ class MultinomialSampler {
                 std::vector<double>::iterator probsBegin,
                 bool clearCounts = true) {
             uint32_t i, j;
-            double u, sum;
-            std::vector<double> z(k+1, 0.0);
+            double u;
 
             if (clearCounts) {
                 for (i = 0; i < k; i++) {
@@ -26,11 +95,15 @@ class MultinomialSampler {
                 }
             }
 
-            z[0] = 0;
+            if (n > minBinomialTrialsPerCategory_ * k) {
+                sampleConditionalBinomials_(sampleBegin, n, k, probsBegin);
+                return;
+            }
+
+            if (z_.size() < k + 1) { z_.resize(k + 1); }
+            z_[0] = 0;
             for (i = 1; i <= k; i++) {
-                sum = 0;
-                for (j = 0; j < i; j++) sum+= *(probsBegin + j);
-                z[i] = sum;
+                z_[i] = z_[i-1] + *(probsBegin + (i - 1));
             }
 
             // If k is small (<= 100), linear search is usually faster
@@ -39,20 +112,21 @@ class MultinomialSampler {
                     u = u01_(gen_);
 
                     for (i = 0; i < k; i++) {
-                        if ((z[i] < u) && (u <= z[i+1])) {
+                        if ((z_[i] < u) && (u <= z_[i+1])) {
                             (*(sampleBegin + i))++;
                             break;
                         }
                     }
                 }
             } else { // k is large enough to warrant binary search
+                auto zEnd = z_.begin() + k;
                 for (j = 0; j < n; j++) {
                     u = u01_(gen_);
 
                     // Find the offset of the element to increment
-                    auto it = std::lower_bound(z.begin(), z.end()-1, u);
+                    auto it = std::lower_bound(z_.begin(), zEnd, u);
                     size_t offset = static_cast<size_t>(
-                            std::distance(z.begin(), it));
+                            std::distance(z_.begin(), it));
 
                     if (*it > u and offset > 0) {
                         offset -= 1;
@@ -64,10 +138,118 @@ class MultinomialSampler {
         }
 
 
+        /**
+         * Draw n trials from the distribution of tree, setting the counts
+         * of [sampleBegin, sampleBegin + tree.numCategories()) (or adding to
+         * them, if clearCounts is false).  As above, if the probabilities
+         * sum to less than 1, the trials of the remaining mass are
+         * discarded.
+         */
+        void operator()(
+                std::vector<uint64_t>::iterator sampleBegin,
+                uint32_t n,
+                const MultinomialSplitTree& tree,
+                bool clearCounts = true) {
+            if (clearCounts) {
+                std::fill(sampleBegin, sampleBegin + tree.numCategories(), 0);
+            }
+            double total = tree.totalMass();
+            if (total <= 0.0) { return; }
+            uint32_t kept = (total >= 1.0) ? n : binomial_(n, total);
+            split_(sampleBegin, kept, tree, 1);
+        }
+
     private:
+        inline uint32_t binomial_(uint32_t n, double p) {
+            if (n == 0 or p <= 0.0) { return 0; }
+            if (p >= 1.0) { return n; }
+            return binom_(gen_, BinomialT::param_type(n, p));
+        }
+
+        // Divide the m trials of node between its children, down to the blocks
+        void split_(std::vector<uint64_t>::iterator sampleBegin, uint32_t m,
+                    const MultinomialSplitTree& tree, size_t node) {
+            if (m == 0) { return; }
+            if (node >= tree.size_) {
+                sampleBlock_(sampleBegin, m, tree, node - tree.size_);
+                return;
+            }
+            double left = tree.mass_[2 * node];
+            double both = left + tree.mass_[2 * node + 1];
+            uint32_t c = binomial_(m, (both > 0.0) ? left / both : 1.0);
+            split_(sampleBegin, c, tree, 2 * node);
+            split_(sampleBegin, m - c, tree, 2 * node + 1);
+        }
+
+        // Place the m trials of block j among its categories
+        void sampleBlock_(std::vector<uint64_t>::iterator sampleBegin, uint32_t m,
+                          const MultinomialSplitTree& tree, size_t j) {
+            size_t begin = j * MultinomialSplitTree::blockSize;
+            size_t end = std::min(tree.probs_.size(), begin + MultinomialSplitTree::blockSize);
+            double blockMass = tree.mass_[tree.size_ + j];
+            const double* p = tree.probs_.data();
+            if (m <= minBinomialTrialsPerCategory_ * 2) {
+                // Few trials; walk the block's cumulative distribution for each
+                for (uint32_t t = 0; t < m; ++t) {
+                    double u = u01_(gen_) * blockMass;
+                    size_t last{begin};
+                    size_t i{begin};
+                    for (; i < end; ++i) {
+                        if (p[i] <= 0.0) { continue; }
+                        last = i;
+                        if (u < p[i]) { break; }
+                        u -= p[i];
+                    }
+                    // Rounding can leave u past the end; the trial goes to the last category with mass
+                    ++(*(sampleBegin + ((i < end) ? i : last)));
+                }
+                return;
+            }
+            double remainingMass = blockMass;
+            for (size_t i = begin; i < end and m > 0; ++i) {
+                if (p[i] <= 0.0) { continue; }
+                uint32_t c = (remainingMass > p[i]) ? binomial_(m, p[i] / remainingMass) : m;
+                *(sampleBegin + i) += c;
+                m -= c;
+                remainingMass -= p[i];
+            }
+        }
+
+        /**
+         * The count of category i is binomial, given the number of trials
+         * not assigned to categories 0 .. i-1, with probability
+         * p_i / (1 - (p_0 + ... + p_{i-1})).
+         */
+        void sampleConditionalBinomials_(
+                std::vector<uint64_t>::iterator sampleBegin,
+                uint32_t n,
+                uint32_t k,
+                std::vector<double>::iterator probsBegin) {
+            uint32_t remainingTrials = n;
+            double remainingMass = 1.0;
+            for (uint32_t i = 0; i < k and remainingTrials > 0; ++i) {
+                double p = *(probsBegin + i);
+                if (p <= 0.0) { continue; }
+                double condP = (remainingMass > p) ? (p / remainingMass) : 1.0;
+                uint32_t c = (condP >= 1.0) ? remainingTrials :
+                    binom_(gen_, BinomialT::param_type(remainingTrials, condP));
+                *(sampleBegin + i) += c;
+                remainingTrials -= c;
+                remainingMass -= p;
+            }
+        }
+
+        using BinomialT = std::binomial_distribution<uint32_t>;
+
+        // Use the conditional binomial method if there are more than this
+        // many trials per category
+        static constexpr uint32_t minBinomialTrialsPerCategory_ = 4;
+
         std::mt19937 gen_;
         std::uniform_real_distribution<> u01_;
+        BinomialT binom_;
+        // The cumulative distribution of the current probabilities
+        std::vector<double> z_;
 };
 
 #endif //_MULTINOMIAL_SAMPLER_HPP_
-
@@ -2,6 +2,7 @@
 #define __OUTPUT_UNMAPPED_FILTER_HPP__
 
 #include <iostream>
+#include <vector>
 #include <tbb/concurrent_queue.h>
 #include "UnpairedRead.hpp"
 #include "ReadPair.hpp"
@@ -9,11 +10,22 @@
 template <typename FragT>
 class OutputUnmappedFilter {
     public:
-        OutputUnmappedFilter(tbb::concurrent_bounded_queue<FragT*>* outQueue) :
-        outQueue_(outQueue), qlen_(0) {
+        // The copies of the unmapped reads are passed to outQueue in batches of batchSize
+        OutputUnmappedFilter(tbb::concurrent_bounded_queue<std::vector<FragT*>*>* outQueue,
+                             size_t batchSize = 1024) :
+        outQueue_(outQueue), qlen_(0), batchSize_(batchSize) {
             memset(&qname_[0], 0, 255);
         }
 
+        ~OutputUnmappedFilter() { delete batch_; }
+
+        // Pass the current batch (if it holds anything) to the output queue
+        inline void flush() {
+            if (batch_ == nullptr or batch_->empty()) { return; }
+            outQueue_->push(batch_);
+            batch_ = nullptr;
+        }
+
         inline void processFrag(FragT* f) {
             bool distinctRead{true};
 
@@ -28,8 +40,12 @@ class OutputUnmappedFilter {
             // than pass it to the output queue and update the name of the
             // most recently observed read.
             if (distinctRead) {
-                auto* alnCpy = f->clone();
-                outQueue_->push(alnCpy);
+                if (batch_ == nullptr) {
+                    batch_ = new std::vector<FragT*>;
+                    batch_->reserve(batchSize_);
+                }
+                batch_->push_back(f->clone());
+                if (batch_->size() >= batchSize_) { flush(); }
                 qlen_ = newLen;
                 memcpy(&qname_[0], f->getName(), qlen_);
             }
@@ -38,9 +54,11 @@ class OutputUnmappedFilter {
         }
 
     private:
-        tbb::concurrent_bounded_queue<FragT*>* outQueue_ = nullptr;
+        tbb::concurrent_bounded_queue<std::vector<FragT*>*>* outQueue_ = nullptr;
         char qname_[255];
         uint32_t qlen_;
+        size_t batchSize_;
+        std::vector<FragT*>* batch_{nullptr};
 };
 
 #endif // __OUTPUT_UNMAPPED_FILTER_HPP__
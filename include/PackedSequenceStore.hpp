@@ -0,0 +1,91 @@
+#ifndef __PACKED_SEQUENCE_STORE_HPP__
+#define __PACKED_SEQUENCE_STORE_HPP__
+
+#include <cstdint>
+#include <vector>
+
+/**
+ * The sequences of all of the transcripts, packed at 2 bits per base
+ * (A = 0, C = 1, G = 2, T = 3) into a single array of 64-bit words.  A
+ * transcript refers to its sequence by its offset in the store (see
+ * Transcript::setPackedSequence), so that the alignment, error and bias
+ * models all read the same copy of the reference.
+ *
+ * Within a word, the first base is held in the most significant bits, so
+ * that a k-mer (k <= 32) can be extracted with at most two word reads and
+ * a few shifts.  Bases other than A, C, G and T are stored as A, which is
+ * how the models have always treated them (see samToTwoBit).
+ *
+ * The store must not be modified while it is being read; the sequences
+ * are typically all added when the transcripts are loaded.
+ */
+class PackedSequenceStore {
+    public:
+        static constexpr uint32_t basesPerWord = 32;
+
+        PackedSequenceStore() : words_(1, 0) {}
+
+        PackedSequenceStore(const PackedSequenceStore&) = delete;
+        PackedSequenceStore& operator=(const PackedSequenceStore&) = delete;
+
+        /**
+         * Append the len bases of seq, and return the offset of its first
+         * base in the store.
+         */
+        uint64_t addSequence(const char* seq, uint64_t len) {
+            uint64_t offset = numBases_;
+            // Every base is followed by at least one (padding) word, so that
+            // kmerAt() never reads past the end of words_.
+            words_.resize((numBases_ + len) / basesPerWord + 2, 0);
+            for (uint64_t i = 0; i < len; ++i) {
+                uint64_t pos = numBases_ + i;
+                words_[pos / basesPerWord] |=
+                    static_cast<uint64_t>(encode(seq[i])) << shift_(pos);
+            }
+            numBases_ += len;
+            return offset;
+        }
+
+        /**
+         * The 2-bit code of the base at position pos; positions past the
+         * end of the store are reported as A.
+         */
+        inline uint8_t baseAt(uint64_t pos) const {
+            if (pos >= numBases_) { return 0; }
+            return (words_[pos / basesPerWord] >> shift_(pos)) & 0x3;
+        }
+
+        /**
+         * The k bases (1 <= k <= 32) starting at pos, with the first base
+         * in the most significant of the low 2k bits.
+         */
+        inline uint64_t kmerAt(uint64_t pos, uint32_t k) const {
+            uint64_t w = pos / basesPerWord;
+            uint32_t o = 2 * (pos % basesPerWord);
+            uint64_t hi = words_[w] << o;
+            if (o > 0) { hi |= words_[w + 1] >> (64 - o); }
+            return hi >> (64 - 2 * k);
+        }
+
+        uint64_t numBases() const { return numBases_; }
+        uint64_t sizeInBytes() const { return words_.size() * sizeof(uint64_t); }
+
+        static inline uint8_t encode(char c) {
+            switch (c) {
+                case 'C': case 'c': return 1;
+                case 'G': case 'g': return 2;
+                case 'T': case 't': case 'U': case 'u': return 3;
+                default: return 0;
+            }
+        }
+
+    private:
+        static inline uint32_t shift_(uint64_t pos) {
+            return 62 - 2 * (pos % basesPerWord);
+        }
+
+        std::vector<uint64_t> words_;
+        uint64_t numBases_{0};
+};
+
+#endif //__PACKED_SEQUENCE_STORE_HPP__
@@ -1,6 +1,7 @@
 #ifndef __PAIR_SEQUENCE_PARSER_HPP__
 #define __PAIR_SEQUENCE_PARSER_HPP__
 
+#include <atomic>
 #include <string>
 #include <memory>
 #include <utility>
@@ -9,10 +10,23 @@
 #include <mutex>
 #include <fstream>
 
+#include <sys/stat.h>
+
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/device/file.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+
 #include <jellyfish/err.hpp>
 #include <jellyfish/cooperative_pool2.hpp>
 #include <jellyfish/cpp_array.hpp>
 
+#include "CompressedReadStreams.hpp"
+#include "MappedFastqReader.hpp"
+#include "ReadaheadFile.hpp"
+
+#include "io_lib/scram.h"
+#include "io_lib/os.h"
+
 struct header_sequence_qual {
   std::string header;
   std::string seq;
@@ -23,46 +37,119 @@ struct sequence_list {
   std::vector<std::pair<header_sequence_qual, header_sequence_qual> > data;
 };
 
+/// An unaligned BAM (by its extension) or CRAM (by its magic) file. Only
+/// a regular file is probed for the magic: probing a pipe (/dev/stdin,
+/// <(...)) would take its first bytes from the reader that follows, so a
+/// piped CRAM must come through a FIFO whose name ends in .cram.
+inline bool is_sam_read_file(const char* path) {
+  std::string p(path);
+  auto dot = p.find_last_of('.');
+  std::string ext = (dot == std::string::npos) ? std::string() : p.substr(dot);
+  for(auto& c : ext) c = ::tolower(c);
+  if(ext == ".bam" || ext == ".ubam" || ext == ".cram")
+    return true;
+  struct stat st;
+  if(::stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+    return false;
+  char magic[4] = {0, 0, 0, 0};
+  std::ifstream probe(path, std::ios::in | std::ios::binary);
+  probe.read(magic, 4);
+  return std::string(magic, 4) == "CRAM";
+}
+
 template<typename PathIterator>
 class pair_sequence_parser : public jellyfish::cooperative_pool2<pair_sequence_parser<PathIterator>, sequence_list> {
   typedef jellyfish::cooperative_pool2<pair_sequence_parser<PathIterator>, sequence_list> super;
   typedef std::unique_ptr<std::istream> stream_type;
-  enum file_type { DONE_TYPE, FASTA_TYPE, FASTQ_TYPE, ERROR_TYPE };
+  static constexpr std::streamsize stream_buffer_size = 1 << 16;
+  enum file_type { DONE_TYPE, FASTA_TYPE, FASTQ_TYPE, SAM_TYPE, MAPPED_TYPE, ERROR_TYPE };
 
   struct stream_status {
     file_type   type;
     std::string buffer;
     stream_type stream1;
     stream_type stream2;
+    // An unaligned BAM / CRAM file holding both mates, and its current record
+    scram_fd*   sam;
+    bam_seq_t*  record;
+    // The rest of the range of the mapped files being parsed
+    salmon::io::MappedFastqPairReader::Range range;
+    // Reads the BAM / CRAM file ahead of io_lib
+    std::unique_ptr<ReadaheadPipe> sam_readahead;
 
-    stream_status() : type(DONE_TYPE) { }
+    stream_status() : type(DONE_TYPE), sam(nullptr), record(nullptr) { }
+    ~stream_status() {
+      if(sam) scram_close(sam);
+      if(record) free(record);
+    }
   };
   jellyfish::cpp_array<stream_status> streams_;
   PathIterator                        path_begin_, path_end_;
   std::mutex                          path_mutex_;
+  uint32_t                            decode_threads_;
+  uint64_t                            readahead_bytes_;
+  std::atomic<uint64_t>*              io_wait_ns_;
+  std::unique_ptr<salmon::io::MappedFastqPairReader> mapped_;
 
 public:
   /// Size is the number of buffers to keep around. It should be
   /// larger than the number of thread expected to read from this
   /// class. nb_sequences is the number of sequences to read into a
   /// buffer. 'begin' and 'end' are iterators to a range of istream.
+  /// An unaligned BAM or CRAM file, and a zstd or bzip2 file made of
+  /// several frames / streams, is decoded by decode_threads threads.
+  /// If all of the files are uncompressed FASTQ files (see
+  /// all_mappable()), they're mapped and split into ranges of records,
+  /// which the max_producers producers parse in parallel, unless
+  /// readahead_bytes > 0: then each file is read that far ahead of its
+  /// parser by an I/O thread (see ReadaheadFile.hpp), and the time spent
+  /// waiting for it is added to *io_wait_ns.
   pair_sequence_parser(uint32_t size, uint32_t nb_sequences,
                        uint32_t max_producers,
-                       PathIterator path_begin, PathIterator path_end) :
+                       PathIterator path_begin, PathIterator path_end,
+                       uint32_t decode_threads = 1,
+                       uint64_t readahead_bytes = 0,
+                       std::atomic<uint64_t>* io_wait_ns = nullptr) :
     super(max_producers, size),
     streams_(max_producers),
-    path_begin_(path_begin), path_end_(path_end)
+    path_begin_(path_begin), path_end_(path_end),
+    decode_threads_(decode_threads),
+    readahead_bytes_(readahead_bytes),
+    io_wait_ns_(io_wait_ns)
   {
     for(auto it = super::element_begin(); it != super::element_end(); ++it) {
       it->nb_filled = 0;
       it->data.resize(nb_sequences);
     }
+    if(readahead_bytes_ == 0 && all_mappable(path_begin, path_end)) {
+      std::vector<std::pair<std::string, std::string> > pairs;
+      for(auto it = path_begin; it + 1 < path_end; it += 2)
+        pairs.emplace_back(*it, *(it + 1));
+      mapped_.reset(new salmon::io::MappedFastqPairReader(pairs));
+      // Not 4-line FASTQ; read the files as streams
+      if(!mapped_->ok())
+        mapped_.reset();
+    }
     for(uint32_t i = 0; i < max_producers; ++i) {
       streams_.init(i);
-      open_next_files(streams_[i]);
+      if(mapped_)
+        next_range(streams_[i]);
+      else
+        open_next_files(streams_[i]);
     }
   }
 
+  /// True if the files in [path_begin, path_end) are pairs of regular,
+  /// uncompressed FASTQ files, which can be mapped and parsed in parallel
+  static bool all_mappable(PathIterator path_begin, PathIterator path_end) {
+    if(path_begin == path_end || (path_end - path_begin) % 2 != 0)
+      return false;
+    for(auto it = path_begin; it != path_end; ++it)
+      if(!salmon::io::MappedFastqPairReader::isMappable(*it))
+        return false;
+    return true;
+  }
+
   inline bool produce(uint32_t i, sequence_list& buff) {
     stream_status& st = streams_[i];
 
@@ -73,6 +160,16 @@ public:
     case FASTQ_TYPE:
       read_fastq(st, buff);
       break;
+    case SAM_TYPE:
+      if(read_sam(st, buff))
+        return false;
+      open_next_files(st);
+      return false;
+    case MAPPED_TYPE:
+      read_mapped(st, buff);
+      if(st.range.begin1 == st.range.end1)
+        next_range(st);
+      return false;
     case DONE_TYPE:
     case ERROR_TYPE:
       return true;
@@ -96,9 +193,27 @@ protected:
     }
   }
 
+  /// Open the file at `path`, transparently decompressing it if it is
+  /// gzipped, zstd- or bzip2-compressed. Each pair of files is owned by a
+  /// single producer, so the decompression of different pairs proceeds in
+  /// parallel (and that of one zstd / bzip2 file may, see
+  /// CompressedReadStreams.hpp).
+  stream_type open_stream(const char* path) {
+    if(readahead_bytes_ > 0)
+      return salmon::io::openReadStream(path, ReadaheadSource(path, readahead_bytes_, io_wait_ns_),
+                                        decode_threads_, stream_buffer_size);
+    return salmon::io::openReadStream(path, boost::iostreams::file_source(path, std::ios::in | std::ios::binary),
+                                      decode_threads_, stream_buffer_size);
+  }
+
   void open_next_files(stream_status& st) {
     st.stream1.reset();
     st.stream2.reset();
+    if(st.sam) {
+      scram_close(st.sam);
+      st.sam = nullptr;
+    }
+    st.sam_readahead.reset();
     const char *p1 = 0, *p2 = 0;
     {
       std::lock_guard<std::mutex> lck(path_mutex_);
@@ -116,8 +231,29 @@ protected:
       st.type = DONE_TYPE;
       return;
     }
-    st.stream1.reset(new std::ifstream(p1));
-    st.stream2.reset(new std::ifstream(p2));
+    // Both mates of an unaligned BAM / CRAM are in the one file, which is
+    // given as both the first and the second mates' file (-1 x.bam -2 x.bam)
+    if(is_sam_read_file(p1)) {
+      if(std::string(p1) != p2)
+        throw std::runtime_error("An unaligned BAM / CRAM file holds both mates; pass the same file to -1 and -2");
+      std::string path(p1);
+      bool bam = path.size() > 4 && (path.compare(path.size() - 4, 4, ".bam") == 0 ||
+                                     (path.size() > 5 && path.compare(path.size() - 5, 5, ".ubam") == 0));
+      if(readahead_bytes_ > 0) {
+        st.sam_readahead.reset(new ReadaheadPipe(p1, readahead_bytes_, io_wait_ns_));
+        st.sam = scram_open(st.sam_readahead->path().c_str(), bam ? "rb" : "r");
+      } else {
+        st.sam = scram_open(p1, bam ? "rb" : "r");
+      }
+      if(!st.sam)
+        throw std::runtime_error(std::string("Could not open ") + p1);
+      if(decode_threads_ > 1)
+        scram_set_option(st.sam, CRAM_OPT_NTHREADS, decode_threads_);
+      st.type = SAM_TYPE;
+      return;
+    }
+    st.stream1 = open_stream(p1);
+    st.stream2 = open_stream(p2);
     if(!*st.stream1 || !*st.stream2) {
       st.type = DONE_TYPE;
       return;
@@ -139,10 +275,14 @@ protected:
   void read_fasta_one_sequence(std::istream& is, std::string& tmp, header_sequence_qual& hsq) {
     is.get(); // Skip '>'
     std::getline(is, hsq.header);
+    // Read the first (usually only) line of the sequence directly into
+    // the record; only subsequent lines go through `tmp`.
     hsq.seq.clear();
+    if(is.peek() != '>' && is.peek() != EOF)
+      std::getline(is, hsq.seq);
     while(is.peek() != '>' && is.peek() != EOF) {
-      std::getline(is, tmp); // Wish there was an easy way to combine the
-      hsq.seq.append(tmp);             // two lines avoiding copying
+      std::getline(is, tmp);
+      hsq.seq.append(tmp);
     }
   }
 
@@ -159,15 +299,21 @@ protected:
   void read_fastq_one_sequence(std::istream& is, std::string& tmp, header_sequence_qual& hsq) {
     is.get(); // Skip '@'
     std::getline(is, hsq.header);
+    // Read the first (usually only) line of the sequence and quality
+    // directly into the record; only subsequent lines go through `tmp`.
     hsq.seq.clear();
+    if(is.peek() != '+' && is.peek() != EOF)
+      std::getline(is, hsq.seq);
     while(is.peek() != '+' && is.peek() != EOF) {
-      std::getline(is, tmp); // Wish there was an easy way to combine the
-      hsq.seq.append(tmp);             // two lines avoiding copying
+      std::getline(is, tmp);
+      hsq.seq.append(tmp);
     }
     if(!is.good())
       throw std::runtime_error("Truncated fastq file");
     is.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
     hsq.qual.clear();
+    if(is.good())
+      std::getline(is, hsq.qual);
     while(hsq.qual.size() < hsq.seq.size() && is.good()) {
       std::getline(is, tmp);
       hsq.qual.append(tmp);
@@ -179,6 +325,93 @@ protected:
 
   }
 
+  /// Decode the sequence (and qualities, if it has them) of a BAM record;
+  /// a record stored reverse-complemented is turned back around.
+  static void decode_record(bam_seq_t* rec, header_sequence_qual& hsq) {
+    static const char bases[] = "=ACMGRSVTWYHKDBN";
+    static const char complement[] = "=TGKCYSBAWRDMHVN";
+    int32_t len = bam_seq_len(rec);
+    uint8_t* seq = reinterpret_cast<uint8_t*>(bam_seq(rec));
+    uint8_t* qual = reinterpret_cast<uint8_t*>(bam_seq(rec)) + (len + 1) / 2;
+    bool reverse = (bam_flag(rec) & BAM_FREVERSE) != 0;
+    hsq.header.assign(bam_name(rec), bam_name_len(rec) > 0 ? bam_name_len(rec) - 1 : 0);
+    hsq.seq.resize(len);
+    for(int32_t i = 0; i < len; ++i) {
+      uint8_t b = bam_seqi(seq, i);
+      if(reverse) hsq.seq[len - 1 - i] = complement[b];
+      else        hsq.seq[i] = bases[b];
+    }
+    // Missing qualities are stored as 0xff
+    if(len > 0 && qual[0] != 0xff) {
+      hsq.qual.resize(len);
+      for(int32_t i = 0; i < len; ++i)
+        hsq.qual[reverse ? len - 1 - i : i] = static_cast<char>(qual[i] + 33);
+    } else {
+      hsq.qual.clear();
+    }
+  }
+
+  /// Fill buff with the pairs of an unaligned BAM / CRAM, in which the
+  /// mates of a pair are consecutive records (flagged READ1 and READ2);
+  /// secondary and supplementary records are skipped.  False at the end
+  /// of the file.
+  bool read_sam(stream_status& st, sequence_list& buff) {
+    constexpr uint32_t skip_flags = BAM_FSECONDARY | 0x800; // 0x800: supplementary
+    size_t&      nb_filled = buff.nb_filled;
+    const size_t data_size = buff.data.size();
+    nb_filled = 0;
+    while(nb_filled < data_size) {
+      auto& pair = buff.data[nb_filled];
+      bool have1 = false, have2 = false;
+      while(!(have1 && have2)) {
+        if(scram_get_seq(st.sam, &st.record) < 0) {
+          if(have1 || have2)
+            throw std::runtime_error("Truncated unaligned BAM / CRAM: the last pair is missing a mate");
+          return nb_filled > 0;
+        }
+        uint32_t flag = bam_flag(st.record);
+        if(flag & skip_flags)
+          continue;
+        if(!(flag & BAM_FPAIRED))
+          throw std::runtime_error("The unaligned BAM / CRAM holds unpaired reads; it can't be read as paired-end");
+        if(flag & BAM_FREAD1) {
+          if(have1) throw std::runtime_error("Unaligned BAM / CRAM: two first mates in a row; are the mates collated?");
+          decode_record(st.record, pair.first);
+          have1 = true;
+        } else {
+          if(have2) throw std::runtime_error("Unaligned BAM / CRAM: two second mates in a row; are the mates collated?");
+          decode_record(st.record, pair.second);
+          have2 = true;
+        }
+      }
+      // As for aligned BAM (see BAMQueue), the mates must have the same name
+      if(pair.first.header != pair.second.header)
+        throw std::runtime_error("Unaligned BAM / CRAM: the mates " + pair.first.header + " and " +
+                                 pair.second.header + " have different names; are the mates collated?");
+      ++nb_filled;
+    }
+    return true;
+  }
+
+  /// Take the next range of the mapped files (or be done)
+  void next_range(stream_status& st) {
+    st.type = mapped_->nextRange(st.range) ? MAPPED_TYPE : DONE_TYPE;
+  }
+
+  void read_mapped(stream_status& st, sequence_list& buff) {
+    typedef salmon::io::MappedFastqPairReader reader;
+    size_t&      nb_filled = buff.nb_filled;
+    const size_t data_size = buff.data.size();
+    auto&        r         = st.range;
+
+    for(nb_filled = 0; nb_filled < data_size && r.begin1 < r.end1; ++nb_filled) {
+      if(r.begin2 >= r.end2)
+        throw std::runtime_error("Paired fastq files out of sync");
+      reader::parseRecord(r.begin1, r.end1, buff.data[nb_filled].first);
+      reader::parseRecord(r.begin2, r.end2, buff.data[nb_filled].second);
+    }
+  }
+
   void read_fastq(stream_status& st, sequence_list& buff) {
     size_t&      nb_filled = buff.nb_filled;
     const size_t data_size = buff.data.size();
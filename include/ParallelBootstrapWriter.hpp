@@ -0,0 +1,154 @@
+#ifndef __PARALLEL_BOOTSTRAP_WRITER_HPP__
+#define __PARALLEL_BOOTSTRAP_WRITER_HPP__
+
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "spdlog/spdlog.h"
+#include "tbb/concurrent_queue.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+
+/**
+ * Compresses bootstrap (or Gibbs) replicates on a pool of worker threads.
+ * Each replicate is compressed into its own gzip member, and the members
+ * are appended to the output file in the order in which the replicates
+ * were submitted; since a sequence of gzip members is itself a valid gzip
+ * file, the output decompresses to exactly the stream that a single
+ * compressor would have produced.
+ *
+ * The threads producing replicates only copy them into a bounded queue,
+ * so they block only if the compression workers fall behind.  The stream
+ * is checked after each member is appended; once a write has failed, no
+ * more members are written, and push() and finish() return false.
+ */
+class ParallelBootstrapWriter {
+    public:
+        ParallelBootstrapWriter(const boost::filesystem::path& path,
+                                uint32_t numWorkers,
+                                int compressionLevel,
+                                std::shared_ptr<spdlog::logger> logger) :
+            ofile_(path.string(), std::ios_base::out | std::ios_base::binary | std::ios_base::trunc),
+            compressionLevel_(compressionLevel),
+            logger_(logger) {
+            numWorkers = (numWorkers > 0) ? numWorkers : 1;
+            queue_.set_capacity(2 * numWorkers);
+            for (uint32_t i = 0; i < numWorkers; ++i) {
+                workers_.emplace_back([this]() -> void { this->compressReplicates_(); });
+            }
+        }
+
+        ~ParallelBootstrapWriter() { finish(); }
+
+        bool good() const { return ofile_.good(); }
+
+        /**
+         * Queue `num` elements of `elSize` bytes, starting at `data`, as the
+         * next replicate.  Returns false if the writing of an earlier
+         * replicate has failed.
+         */
+        bool push(const char* data, size_t elSize, size_t num) {
+            if (failed_) { return false; }
+            Replicate* r = new Replicate;
+            r->bytes.assign(data, data + elSize * num);
+            r->seq = nextSeq_++;
+            queue_.push(r);
+            return true;
+        }
+
+        /**
+         * Wait for all of the queued replicates to be written, and close the
+         * file.  Returns false if any of them couldn't be written.
+         */
+        bool finish() {
+            if (workers_.empty()) { return !failed_; }
+            for (size_t i = 0; i < workers_.size(); ++i) {
+                queue_.push(nullptr);
+            }
+            for (auto& t : workers_) { t.join(); }
+            workers_.clear();
+            ofile_.close();
+            if (ofile_.fail()) { fail_("could not finish writing the bootstraps"); }
+            if (failed_) { return false; }
+            logger_->info("wrote {} bootstraps", numWritten_);
+            return true;
+        }
+
+    private:
+        struct Replicate {
+            uint64_t seq;
+            std::vector<char> bytes;
+        };
+
+        void compressReplicates_() {
+            Replicate* r{nullptr};
+            while (true) {
+                queue_.pop(r);
+                if (r == nullptr) { break; }
+
+                std::string member;
+                {
+                    boost::iostreams::filtering_ostream out;
+                    out.push(boost::iostreams::gzip_compressor(
+                                boost::iostreams::gzip_params(compressionLevel_)));
+                    out.push(boost::iostreams::back_inserter(member));
+                    out.write(r->bytes.data(), r->bytes.size());
+                }
+                uint64_t seq = r->seq;
+                delete r;
+                writeInOrder_(seq, std::move(member));
+            }
+        }
+
+        /**
+         * Append the member of replicate `seq` once all of the replicates
+         * before it have been appended.
+         */
+        void writeInOrder_(uint64_t seq, std::string&& member) {
+            std::lock_guard<std::mutex> lock(writeMutex_);
+            pending_[seq] = std::move(member);
+            auto it = pending_.begin();
+            while (it != pending_.end() and it->first == nextToWrite_) {
+                if (!failed_) {
+                    ofile_.write(it->second.data(), it->second.size());
+                    if (ofile_.good()) {
+                        ++numWritten_;
+                    } else {
+                        fail_("could not write bootstrap " + std::to_string(nextToWrite_));
+                    }
+                }
+                ++nextToWrite_;
+                it = pending_.erase(it);
+            }
+        }
+
+        void fail_(const std::string& msg) {
+            if (!failed_.exchange(true)) { logger_->error("{}", msg); }
+        }
+
+        std::ofstream ofile_;
+        int compressionLevel_;
+        std::shared_ptr<spdlog::logger> logger_;
+        tbb::concurrent_bounded_queue<Replicate*> queue_;
+        std::vector<std::thread> workers_;
+        std::atomic<uint64_t> nextSeq_{0};
+
+        // Compressed members that are waiting for an earlier replicate
+        std::mutex writeMutex_;
+        std::map<uint64_t, std::string> pending_;
+        uint64_t nextToWrite_{0};
+        uint64_t numWritten_{0};
+        std::atomic<bool> failed_{false};
+};
+
+#endif //__PARALLEL_BOOTSTRAP_WRITER_HPP__
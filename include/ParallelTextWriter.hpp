@@ -0,0 +1,123 @@
+#ifndef __PARALLEL_TEXT_WRITER_HPP__
+#define __PARALLEL_TEXT_WRITER_HPP__
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include <boost/filesystem.hpp>
+
+#include "tbb/blocked_range.h"
+#include "tbb/parallel_for.h"
+
+#include "spdlog/spdlog.h"
+
+/**
+ * Writes the rows of a large text output (quant.sf, eq_classes.txt,
+ * quant.genes.sf) with the formatting spread over the threads: the rows
+ * are cut into chunks of chunkRows(), the chunks of each wave of
+ * chunksPerWave() are formatted in parallel, each into its own buffer, and
+ * the buffers of a wave are then written, in order, with a single
+ * (gathering) write, so the file is exactly what formatting the rows one
+ * after another would give.  Formatting a wave at a time bounds the memory
+ * held by the buffers, however many rows there are.
+ *
+ * The rows are formatted by formatRow(i, w), which appends row i to the
+ * fmt::MemoryWriter w, and may be called from any thread (so it must only
+ * read shared state).
+ */
+class ParallelTextWriter {
+    public:
+        static size_t chunkRows() { return 1 << 14; }
+        static size_t chunksPerWave() { return 64; }
+
+        explicit ParallelTextWriter(const boost::filesystem::path& path) : path_(path.string()) {
+            fd_ = ::open(path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        }
+
+        ParallelTextWriter(const ParallelTextWriter&) = delete;
+        ParallelTextWriter& operator=(const ParallelTextWriter&) = delete;
+
+        ~ParallelTextWriter() { close(); }
+
+        bool good() const { return fd_ >= 0 and !failed_; }
+
+        // Write s (e.g. the header) as is
+        void write(const std::string& s) {
+            iovec v{const_cast<char*>(s.data()), s.size()};
+            writeAll_(&v, 1);
+        }
+
+        template <typename FormatRowT>
+        void writeRows(size_t numRows, FormatRowT formatRow) {
+            size_t numChunks = (numRows + chunkRows() - 1) / chunkRows();
+            std::vector<fmt::MemoryWriter> chunks(std::min(numChunks, chunksPerWave()));
+            std::vector<iovec> iov(chunks.size());
+            for (size_t firstChunk = 0; firstChunk < numChunks and good(); firstChunk += chunksPerWave()) {
+                size_t waveChunks = std::min(chunksPerWave(), numChunks - firstChunk);
+                tbb::parallel_for(tbb::blocked_range<size_t>(0, waveChunks, 1),
+                    [&](const tbb::blocked_range<size_t>& r) -> void {
+                        for (size_t c = r.begin(); c < r.end(); ++c) {
+                            auto& w = chunks[c];
+                            w.clear();
+                            size_t start = (firstChunk + c) * chunkRows();
+                            size_t end = std::min(start + chunkRows(), numRows);
+                            for (size_t i = start; i < end; ++i) { formatRow(i, w); }
+                        }
+                    });
+                for (size_t c = 0; c < waveChunks; ++c) {
+                    iov[c].iov_base = const_cast<char*>(chunks[c].data());
+                    iov[c].iov_len = chunks[c].size();
+                }
+                writeAll_(iov.data(), waveChunks);
+            }
+        }
+
+        // Close the file; false if any of it couldn't be written
+        bool close() {
+            if (fd_ >= 0) {
+                failed_ = (::close(fd_) != 0) or failed_;
+                fd_ = -1;
+                closed_ = true;
+            }
+            return closed_ and !failed_;
+        }
+
+    private:
+        // Write all of the buffers, in order, resuming after partial writes
+        void writeAll_(iovec* iov, size_t n) {
+            while (n > 0 and good()) {
+                int batch = static_cast<int>(std::min(n, static_cast<size_t>(IOV_MAX)));
+                ssize_t written = ::writev(fd_, iov, batch);
+                if (written < 0) {
+                    if (errno == EINTR) { continue; }
+                    failed_ = true;
+                    return;
+                }
+                size_t left = static_cast<size_t>(written);
+                while (n > 0 and left >= iov->iov_len) {
+                    left -= iov->iov_len;
+                    ++iov;
+                    --n;
+                }
+                if (n > 0) {
+                    iov->iov_base = static_cast<char*>(iov->iov_base) + left;
+                    iov->iov_len -= left;
+                }
+            }
+        }
+
+        std::string path_;
+        int fd_{-1};
+        bool failed_{false};
+        bool closed_{false};
+};
+
+#endif // __PARALLEL_TEXT_WRITER_HPP__
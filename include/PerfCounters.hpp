@@ -0,0 +1,282 @@
+#ifndef __PERF_COUNTERS_HPP__
+#define __PERF_COUNTERS_HPP__
+
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "tbb/task_scheduler_observer.h"
+
+/**
+ * Hardware performance counts: the cycles, the instructions, and the
+ * last-level cache and data TLB (read) misses.
+ */
+struct PerfCounts {
+    static constexpr size_t numEvents = 4;
+    static const char* eventName(size_t i) {
+        static const char* names[] = {"cycles", "instructions", "llc_misses", "dtlb_misses"};
+        return names[i];
+    }
+
+    uint64_t values[numEvents] = {0, 0, 0, 0};
+
+    PerfCounts& operator+=(const PerfCounts& o) {
+        for (size_t i = 0; i < numEvents; ++i) { values[i] += o.values[i]; }
+        return *this;
+    }
+    PerfCounts operator-(const PerfCounts& o) const {
+        PerfCounts d;
+        for (size_t i = 0; i < numEvents; ++i) {
+            d.values[i] = (values[i] >= o.values[i]) ? values[i] - o.values[i] : 0;
+        }
+        return d;
+    }
+    bool empty() const { return values[0] == 0 and values[1] == 0; }
+
+    void writeJSON(std::ostream& out) const {
+        out << '{';
+        for (size_t i = 0; i < numEvents; ++i) {
+            out << '"' << eventName(i) << "\": " << values[i] << ", ";
+        }
+        out << "\"ipc\": " << (values[0] > 0 ? static_cast<double>(values[1]) / values[0] : 0.0) << '}';
+    }
+};
+
+/**
+ * The counters of a single thread, opened (with perf_event_open) as one
+ * group, so that they are read together with a single read().  The
+ * counters only count the thread that opened them, but they can be read
+ * from any thread.  Events the CPU (or kernel) doesn't support read as 0.
+ */
+class PerfCounterGroup {
+    public:
+        PerfCounterGroup() {
+#if defined(__linux__)
+            const uint64_t cacheReadMiss = (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            const uint32_t types[PerfCounts::numEvents] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+                                                           PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE};
+            const uint64_t configs[PerfCounts::numEvents] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                                             PERF_COUNT_HW_CACHE_LL | cacheReadMiss,
+                                                             PERF_COUNT_HW_CACHE_DTLB | cacheReadMiss};
+            for (size_t i = 0; i < PerfCounts::numEvents; ++i) {
+                struct perf_event_attr pe;
+                std::memset(&pe, 0, sizeof(pe));
+                pe.size = sizeof(pe);
+                pe.type = types[i];
+                pe.config = configs[i];
+                pe.disabled = (leader_ < 0) ? 1 : 0;
+                pe.exclude_kernel = 1;
+                pe.exclude_hv = 1;
+                pe.read_format = PERF_FORMAT_GROUP;
+                int fd = static_cast<int>(::syscall(__NR_perf_event_open, &pe, 0, -1, leader_, 0));
+                if (fd < 0) {
+                    // Without cycles there's no group at all
+                    if (leader_ < 0) { return; }
+                    continue;
+                }
+                if (leader_ < 0) { leader_ = fd; }
+                fds_.push_back(fd);
+                slots_.push_back(i);
+            }
+            ::ioctl(leader_, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ::ioctl(leader_, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+        }
+
+        ~PerfCounterGroup() {
+#if defined(__linux__)
+            for (auto fd : fds_) { ::close(fd); }
+#endif
+        }
+
+        PerfCounterGroup(const PerfCounterGroup&) = delete;
+        PerfCounterGroup& operator=(const PerfCounterGroup&) = delete;
+
+        bool good() const { return leader_ >= 0; }
+
+        bool read(PerfCounts& counts) const {
+            if (leader_ < 0) { return false; }
+#if defined(__linux__)
+            uint64_t buf[1 + PerfCounts::numEvents];
+            if (::read(leader_, buf, sizeof(buf)) < static_cast<ssize_t>(sizeof(uint64_t) * (1 + fds_.size()))) {
+                return false;
+            }
+            for (size_t i = 0; i < slots_.size() and i < buf[0]; ++i) { counts.values[slots_[i]] = buf[1 + i]; }
+            return true;
+#else
+            return false;
+#endif
+        }
+
+    private:
+        int leader_{-1};
+        std::vector<int> fds_;
+        std::vector<size_t> slots_; // the PerfCounts slot of each opened counter
+};
+
+/**
+ * The hardware counters of a run (--perfCounters).  Every thread that
+ * takes part in the run opens its own counter group: the mapping and
+ * quantification threads when they first enter a Region, and the TBB
+ * worker threads when they join the scheduler.
+ *
+ * Counts are attributed in two ways:
+ *  - to the Regions (e.g. "mapping", "processMiniBatch") of the thread
+ *    that executes them, by reading the thread's counters on entry and
+ *    exit; and
+ *  - to the phases of the RunProfiler, by reading the counters of all of
+ *    the threads when a phase begins and ends (snapshot / countsSince).
+ *
+ * Each thread's counts are kept separately, so that imbalance between the
+ * threads is visible.
+ */
+class HardwareCounters : public tbb::task_scheduler_observer {
+    public:
+        HardwareCounters() {
+            available_ = threadGroup_() != nullptr;
+            if (available_) { observe(true); }
+        }
+
+        ~HardwareCounters() {
+            if (available_) { observe(false); }
+        }
+
+        // False if the counters couldn't be opened (e.g. perf_event_paranoid forbids it)
+        bool available() const { return available_; }
+
+        void on_scheduler_entry(bool) override { threadGroup_(); }
+
+        /**
+         * Attributes the counts of the current thread, over its lifetime,
+         * to the region with the given name (a string literal); a null
+         * HardwareCounters records nothing.
+         */
+        class Region {
+            public:
+                Region(HardwareCounters* hw, const char* name) : hw_(hw), name_(name) {
+                    if (hw_) {
+                        group_ = hw_->threadGroup_();
+                        if (!group_ or !group_->read(start_)) { hw_ = nullptr; }
+                    }
+                }
+                ~Region() { end(); }
+                // End the region before the end of the scope
+                void end() {
+                    PerfCounts now;
+                    if (hw_ and group_->read(now)) { hw_->addRegion_(name_, slot_(), now - start_); }
+                    hw_ = nullptr;
+                }
+            private:
+                size_t slot_() const { return hw_->threadSlot_(group_); }
+                HardwareCounters* hw_;
+                const char* name_;
+                PerfCounterGroup* group_{nullptr};
+                PerfCounts start_;
+        };
+
+        // The current counts of every thread (indexed by thread slot)
+        std::vector<PerfCounts> snapshot() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            std::vector<PerfCounts> counts(groups_.size());
+            for (size_t i = 0; i < groups_.size(); ++i) { groups_[i]->read(counts[i]); }
+            return counts;
+        }
+
+        /**
+         * The per-thread counts between the snapshot start and now; the
+         * threads that opened their counters since then count from 0.
+         */
+        std::vector<PerfCounts> countsSince(const std::vector<PerfCounts>& start) {
+            auto now = snapshot();
+            for (size_t i = 0; i < now.size(); ++i) {
+                if (i < start.size()) { now[i] = now[i] - start[i]; }
+            }
+            return now;
+        }
+
+        static void writeThreadCounts(std::ostream& out, const std::vector<PerfCounts>& counts,
+                                      const std::string& pad) {
+            PerfCounts total;
+            for (auto& c : counts) { total += c; }
+            out << pad << "\"hardware_counters\": ";
+            total.writeJSON(out);
+            out << ",\n" << pad << "\"hardware_counters_by_thread\": [";
+            bool first{true};
+            for (size_t i = 0; i < counts.size(); ++i) {
+                if (counts[i].empty()) { continue; }
+                out << (first ? "" : ", ") << "{\"thread\": " << i << ", \"counts\": ";
+                counts[i].writeJSON(out);
+                out << '}';
+                first = false;
+            }
+            out << ']';
+        }
+
+        // Write the counts of the regions, as a member of a JSON object
+        void writeRegions(std::ostream& out, const std::string& pad) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            bool first{true};
+            out << pad << "\"hardware_counter_regions\": [";
+            for (auto& kv : regions_) {
+                out << (first ? "\n" : ",\n") << pad << "    {\n";
+                out << pad << "        \"name\": \"" << kv.first << "\",\n";
+                writeThreadCounts(out, kv.second, pad + "        ");
+                out << '\n' << pad << "    }";
+                first = false;
+            }
+            out << (first ? "]" : "\n" + pad + "]");
+        }
+
+    private:
+        // The counter group of the calling thread, opened on first use
+        PerfCounterGroup* threadGroup_() {
+            static thread_local HardwareCounters* owner{nullptr};
+            static thread_local PerfCounterGroup* group{nullptr};
+            if (owner != this) {
+                owner = this;
+                std::unique_ptr<PerfCounterGroup> g(new PerfCounterGroup);
+                if (!g->good()) {
+                    group = nullptr;
+                    return nullptr;
+                }
+                std::lock_guard<std::mutex> lock(mutex_);
+                groups_.push_back(std::move(g));
+                group = groups_.back().get();
+            }
+            return group;
+        }
+
+        size_t threadSlot_(const PerfCounterGroup* g) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (size_t i = 0; i < groups_.size(); ++i) {
+                if (groups_[i].get() == g) { return i; }
+            }
+            return 0;
+        }
+
+        void addRegion_(const char* name, size_t slot, const PerfCounts& delta) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto& counts = regions_[name];
+            if (counts.size() <= slot) { counts.resize(slot + 1); }
+            counts[slot] += delta;
+        }
+
+        bool available_{false};
+        std::mutex mutex_;
+        std::vector<std::unique_ptr<PerfCounterGroup>> groups_;
+        std::map<std::string, std::vector<PerfCounts>> regions_;
+};
+
+#endif // __PERF_COUNTERS_HPP__
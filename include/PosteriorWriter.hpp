@@ -0,0 +1,154 @@
+#ifndef __POSTERIOR_WRITER_HPP__
+#define __POSTERIOR_WRITER_HPP__
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+
+/**
+ * The file of the posterior assignment probabilities of the mapped
+ * fragments (--writePosteriors).  It's a sequence of gzip members (so,
+ * itself a gzip file), each of which is compressed independently by the
+ * thread that filled it.  The first member holds the header
+ *
+ *   magic[8] version:u32 numTranscripts:u32
+ *   (nameLen:u32 name[nameLen]) * numTranscripts
+ *
+ * and each of the others a block of fragments
+ *
+ *   numFragments:u32
+ *   (nameLen:varint name[nameLen] n:varint (tidDelta:varint prob:u16) * n) * numFragments
+ *
+ * Each fragment is identified by its name (that of its first read, up to
+ * the first whitespace and without a /1 or /2 suffix), since neither the
+ * blocks nor the fragments within them are in the order of the input: the
+ * blocks are written as the threads fill them, each from the mapping cache
+ * of one or more mapping threads.  The (ids of the) transcripts of a
+ * fragment are in increasing order, each stored as the difference from the
+ * one before it (the first as is), and each probability is quantised to
+ * prob / 65535; the transcripts to which a fragment's probability rounds to
+ * 0 are left out.  The integers are in
+ * host byte order, and the varints are LEB128 (7 bits per byte, low bits
+ * first).
+ */
+class PosteriorWriter {
+    public:
+        static const char* magic() { return "SLMPOST"; }
+        static constexpr uint32_t version = 2;
+        static constexpr uint32_t probScale = 0xFFFF;
+
+        explicit PosteriorWriter(const boost::filesystem::path& path) :
+            ofile_(path.string(), std::ios_base::out | std::ios_base::binary | std::ios_base::trunc) {}
+
+        bool good() const { return ofile_.good(); }
+
+        void writeHeader(const std::vector<std::string>& names) {
+            std::string header(magic(), 8);
+            append_(header, version);
+            append_(header, static_cast<uint32_t>(names.size()));
+            for (auto& n : names) {
+                append_(header, static_cast<uint32_t>(n.size()));
+                header += n;
+            }
+            writeMember(header);
+        }
+
+        /**
+         * Compress bytes (on the calling thread) and append them to the
+         * file as a gzip member.
+         */
+        void writeMember(const std::string& bytes) {
+            std::string member;
+            {
+                boost::iostreams::filtering_ostream out;
+                out.push(boost::iostreams::gzip_compressor());
+                out.push(boost::iostreams::back_inserter(member));
+                out.write(bytes.data(), bytes.size());
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            ofile_.write(member.data(), member.size());
+        }
+
+        void close() { ofile_.close(); }
+
+    private:
+        template <typename T>
+        static void append_(std::string& s, T v) { s.append(reinterpret_cast<const char*>(&v), sizeof(T)); }
+
+        std::ofstream ofile_;
+        std::mutex mutex_;
+};
+
+/**
+ * A thread's block of fragments, which it hands to the writer once it has
+ * grown past flushSize.
+ */
+class PosteriorBlock {
+    public:
+        static constexpr size_t flushSize = 1 << 22;
+
+        explicit PosteriorBlock(PosteriorWriter* writer) : writer_(writer) { clear_(); }
+        ~PosteriorBlock() { flush(); }
+
+        /**
+         * Add the fragment with the given name, whose (distinct) transcripts
+         * tids, in increasing order, have the (normalized) posterior
+         * probabilities probs.
+         */
+        void add(const std::string& name, const std::vector<uint32_t>& tids, const std::vector<double>& probs) {
+            quantised_.clear();
+            for (size_t i = 0; i < tids.size(); ++i) {
+                uint32_t q = static_cast<uint32_t>(std::lround(probs[i] * PosteriorWriter::probScale));
+                if (q > 0) { quantised_.emplace_back(tids[i], static_cast<uint16_t>(q)); }
+            }
+            appendVarint_(name.size());
+            buf_ += name;
+            appendVarint_(quantised_.size());
+            uint32_t prev{0};
+            for (auto& tq : quantised_) {
+                appendVarint_(tq.first - prev);
+                prev = tq.first;
+                buf_.append(reinterpret_cast<const char*>(&tq.second), sizeof(uint16_t));
+            }
+            ++numFragments_;
+            if (buf_.size() >= flushSize) { flush(); }
+        }
+
+        void flush() {
+            if (numFragments_ == 0) { return; }
+            std::memcpy(&buf_[0], &numFragments_, sizeof(uint32_t));
+            writer_->writeMember(buf_);
+            clear_();
+        }
+
+    private:
+        void clear_() {
+            buf_.assign(sizeof(uint32_t), '\0');
+            numFragments_ = 0;
+        }
+
+        void appendVarint_(uint64_t v) {
+            while (v >= 0x80) {
+                buf_ += static_cast<char>((v & 0x7F) | 0x80);
+                v >>= 7;
+            }
+            buf_ += static_cast<char>(v);
+        }
+
+        PosteriorWriter* writer_;
+        std::string buf_;
+        uint32_t numFragments_{0};
+        std::vector<std::pair<uint32_t, uint16_t>> quantised_;
+};
+
+#endif // __POSTERIOR_WRITER_HPP__
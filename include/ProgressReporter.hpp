@@ -0,0 +1,68 @@
+#ifndef __PROGRESS_REPORTER_HPP__
+#define __PROGRESS_REPORTER_HPP__
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+/**
+ * Prints the progress of the mapping threads from a thread of its own, so
+ * that the workers never write to the terminal (or wait on the lock of
+ * whichever worker is).  The counter is sampled every interval, and the
+ * progress is printed when it has advanced by at least minStep since the
+ * last print; so it is printed at most once per interval, and no more
+ * often than every minStep fragments.
+ *
+ * The reporter is stopped (a last report is printed) when it's destroyed.
+ */
+class ProgressReporter {
+    public:
+        using PrintFunc = std::function<void(uint64_t)>;
+
+        ProgressReporter(const std::atomic<uint64_t>& counter, uint64_t minStep,
+                         std::chrono::milliseconds interval, PrintFunc print) :
+            counter_(counter), minStep_(minStep), interval_(interval), print_(print),
+            reporter_(&ProgressReporter::run_, this) {}
+
+        ~ProgressReporter() {
+            {
+                std::lock_guard<std::mutex> l(mutex_);
+                stop_ = true;
+            }
+            stopped_.notify_all();
+            reporter_.join();
+        }
+
+        ProgressReporter(const ProgressReporter&) = delete;
+        ProgressReporter& operator=(const ProgressReporter&) = delete;
+
+    private:
+        void run_() {
+            uint64_t lastReported{0};
+            std::unique_lock<std::mutex> l(mutex_);
+            while (!stop_) {
+                stopped_.wait_for(l, interval_, [this]() { return stop_; });
+                uint64_t n = counter_.load(std::memory_order_relaxed);
+                if (n >= lastReported + minStep_ or (stop_ and n > lastReported)) {
+                    print_(n);
+                    lastReported = n;
+                }
+            }
+        }
+
+        const std::atomic<uint64_t>& counter_;
+        uint64_t minStep_;
+        std::chrono::milliseconds interval_;
+        PrintFunc print_;
+        bool stop_{false};
+        std::mutex mutex_;
+        std::condition_variable stopped_;
+        // Declared last, so that it starts once the rest is initialized
+        std::thread reporter_;
+};
+
+#endif // __PROGRESS_REPORTER_HPP__
@@ -0,0 +1,103 @@
+#ifndef __QUANT_THREAD_CONTROLLER_HPP__
+#define __QUANT_THREAD_CONTROLLER_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+/**
+ * Balances the threads of alignment mode between decoding the BAM input and
+ * quantifying the fragments, at runtime (--adaptiveThreads).
+ *
+ * The decompression threads of io_lib are fixed once a file is opened, and
+ * only use the CPU while there is input to decode.  So rather than moving
+ * threads out of that pool, the quantification pool is started with a
+ * worker for every thread (the quantification and the parse threads), of
+ * which only a target number are active; the others park between
+ * mini-batches.  The reader samples the number of mini-batches waiting to
+ * be quantified: if the workers keep up with the parser (the queue is
+ * empty) then a worker is parked, which leaves its core to the decoders,
+ * and if mini-batches back up then a parked worker is woken.
+ */
+class QuantThreadController {
+    public:
+        QuantThreadController(uint32_t minActive, uint32_t maxActive, uint32_t initialActive) :
+            minActive_(std::max(uint32_t(1), minActive)),
+            maxActive_(std::max(minActive_, maxActive)),
+            active_(std::min(std::max(initialActive, minActive_), maxActive_)) {}
+
+        /**
+         * Called by each worker before it takes a mini-batch; blocks while
+         * the worker is parked.
+         */
+        void waitUntilActive(uint32_t workerIndex) {
+            if (workerIndex < active_.load(std::memory_order_relaxed)) { return; }
+            std::unique_lock<std::mutex> l(mutex_);
+            changed_.wait(l, [this, workerIndex]() {
+                return released_ or workerIndex < active_.load(std::memory_order_relaxed);
+            });
+        }
+
+        /**
+         * Called periodically by the reader with the number of mini-batches
+         * waiting to be quantified.  The target changes by at most one worker
+         * per call, and only after the same verdict on consecutive samples.
+         */
+        void update(size_t numWaitingBatches) {
+            uint32_t active = active_.load(std::memory_order_relaxed);
+            int verdict{0};
+            if (numWaitingBatches == 0) {
+                verdict = -1;
+            } else if (numWaitingBatches > active) {
+                verdict = 1;
+            }
+            streak_ = (verdict != 0 and verdict == lastVerdict_) ? streak_ + 1 : 0;
+            lastVerdict_ = verdict;
+            if (streak_ < requiredStreak_) { return; }
+            streak_ = 0;
+
+            uint32_t target = active;
+            if (verdict < 0 and active > minActive_) { target = active - 1; }
+            if (verdict > 0 and active < maxActive_) { target = active + 1; }
+            if (target == active) { return; }
+            {
+                std::lock_guard<std::mutex> l(mutex_);
+                active_.store(target, std::memory_order_relaxed);
+            }
+            ++numAdjustments_;
+            if (target > active) { changed_.notify_all(); }
+        }
+
+        /** Wake every parked worker (e.g. to drain the queue once the input
+         * has been read) */
+        void release() {
+            {
+                std::lock_guard<std::mutex> l(mutex_);
+                released_ = true;
+            }
+            changed_.notify_all();
+        }
+
+        uint32_t numActive() const { return active_.load(std::memory_order_relaxed); }
+        uint32_t maxActive() const { return maxActive_; }
+        size_t numAdjustments() const { return numAdjustments_; }
+
+    private:
+        static constexpr uint32_t requiredStreak_ = 4;
+
+        uint32_t minActive_;
+        uint32_t maxActive_;
+        std::atomic<uint32_t> active_;
+        bool released_{false};
+        std::mutex mutex_;
+        std::condition_variable changed_;
+
+        // Only touched by the reader (in update)
+        int lastVerdict_{0};
+        uint32_t streak_{0};
+        size_t numAdjustments_{0};
+};
+
+#endif // __QUANT_THREAD_CONTROLLER_HPP__
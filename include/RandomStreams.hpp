@@ -0,0 +1,65 @@
+#ifndef RANDOM_STREAMS_HPP
+#define RANDOM_STREAMS_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <random>
+
+#include "SalmonOpts.hpp"
+
+namespace salmon {
+namespace utils {
+
+/**
+ * The consumers of random numbers; each has its own family of streams, so
+ * that (e.g.) adding a bootstrap replicate does not change the numbers
+ * seen by the Gibbs sampler.
+ */
+enum class RandomStream : uint64_t {
+    MAPPING = 1,    // the online assignment (or sampling) of fragments, per worker thread
+    BOOTSTRAP = 2,  // the multinomial resampling, per bootstrap replicate
+    GIBBS = 3,      // the sampler, per Gibbs chain
+    FLD_SAMPLES = 4 // the samples of the fragment length distribution
+};
+
+/**
+ * One step of the SplitMix64 generator; this is used to turn (seed, stream,
+ * index) triples into well-separated seeds for independent generators.
+ */
+inline uint64_t splitMix64(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+/**
+ * The seed of the `index`-th generator of the given stream.  If the user
+ * provided a --seed, this is a deterministic function of it; otherwise it
+ * is drawn from std::random_device.
+ */
+inline uint32_t streamSeed(const SalmonOpts& sopt, RandomStream stream, uint64_t index) {
+    if (!sopt.haveSeed) {
+        std::random_device rd;
+        return rd();
+    }
+    uint64_t s = splitMix64(sopt.seed);
+    s = splitMix64(s ^ static_cast<uint64_t>(stream));
+    s = splitMix64(s ^ index);
+    return static_cast<uint32_t>(s ^ (s >> 32));
+}
+
+/**
+ * The index of the next mapping thread to request a stream of random
+ * numbers.  The mapping threads are not tied to a fixed subset of the
+ * reads, so this only guarantees that each thread gets its own stream.
+ */
+inline uint64_t nextMappingStreamIndex() {
+    static std::atomic<uint64_t> nextIndex{0};
+    return nextIndex++;
+}
+
+}
+}
+
+#endif // RANDOM_STREAMS_HPP
@@ -19,9 +19,13 @@ extern "C" {
 #include "SalmonIndex.hpp"
 #include "SalmonUtils.hpp"
 #include "EquivalenceClassBuilder.hpp"
+#include "StageTimings.hpp"
 #include "SpinLock.hpp" // RapMap's with try_lock
 #include "UtilityFunctions.hpp"
 #include "ReadKmerDist.hpp"
+#include "BiasSampleReservoir.hpp"
+#include "TranscriptBiasTables.hpp"
+#include "RunExit.hpp"
 
 // Logger includes
 #include "spdlog/spdlog.h"
@@ -31,6 +35,10 @@ extern "C" {
 #include <boost/range/irange.hpp>
 
 // Standard includes
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <thread>
 #include <vector>
 #include <memory>
 #include <fstream>
@@ -47,25 +55,41 @@ class ReadExperiment {
 
     public:
 
+    /**
+     * If sharedIndex is provided (and loaded), it is used, read-only, in
+     * place of loading the index in indexDirectory; this lets a long-running
+     * process (see salmon serve) quantify many samples against one copy of
+     * the index.
+     */
     ReadExperiment(std::vector<ReadLibrary>& readLibraries,
                    //const boost::filesystem::path& transcriptFile,
                    const boost::filesystem::path& indexDirectory,
-		           SalmonOpts& sopt) :
+		           SalmonOpts& sopt,
+                   std::shared_ptr<SalmonIndex> sharedIndex = nullptr) :
         readLibraries_(readLibraries),
         //transcriptFile_(transcriptFile),
         transcripts_(std::vector<Transcript>()),
         totalAssignedFragments_(0),
         fragStartDists_(5),
         seqBiasModel_(1.0),
-	eqBuilder_(sopt.jointLog),
+	eqBuilder_(sopt.jointLog, sopt.eqClassReserve),
         expectedBias_(constExprPow(4, readBias_.getK()), 1.0),
         expectedGC_(101, 0.0),
-        observedGC_(101, 1e-5) {
+        observedGC_(101, observedGCPseudoMass()) {
             namespace bfs = boost::filesystem;
 
             // Make sure the read libraries are valid.
             for (auto& rl : readLibraries_) { rl.checkValid(); }
 
+            if (sopt.biasCorrect) { biasSamples_.reset(std::max(sopt.numBiasSamples.load(), 0)); }
+
+            if (sopt.eqClassSpillClasses > 0 and
+                !eqBuilder_.enableSpill(sopt.outputDirectory / "eq_spill", sopt.eqClassSpillClasses)) {
+                sopt.jointLog->error("Could not create the directory {} for the spilled equivalence classes",
+                                   (sopt.outputDirectory / "eq_spill").string());
+                salmon::utils::exitRun(1);
+            }
+
             size_t maxFragLen = sopt.fragLenDistMax;
             size_t meanFragLen = sopt.fragLenDistPriorMean;
             size_t fragLenStd = sopt.fragLenDistPriorSD;
@@ -86,23 +110,44 @@ class ReadExperiment {
             }
             */
 
-            // ==== Figure out the index type
-            boost::filesystem::path versionPath = indexDirectory / "versionInfo.json";
-            SalmonIndexVersionInfo versionInfo;
-            versionInfo.load(versionPath);
-            if (versionInfo.indexVersion() == 0) {
-                fmt::MemoryWriter infostr;
-                infostr << "Error: The index version file " << versionPath.string()
-                    << " doesn't seem to exist.  Please try re-building the salmon "
-                    "index.";
-                throw std::invalid_argument(infostr.str());
+            if (sharedIndex and sharedIndex->loaded()) {
+                salmonIndex_ = sharedIndex;
+            } else {
+                // ==== Figure out the index type
+                boost::filesystem::path versionPath = indexDirectory / "versionInfo.json";
+                SalmonIndexVersionInfo versionInfo;
+                versionInfo.load(versionPath);
+                if (versionInfo.indexVersion() == 0) {
+                    fmt::MemoryWriter infostr;
+                    infostr << "Error: The index version file " << versionPath.string()
+                        << " doesn't seem to exist.  Please try re-building the salmon "
+                        "index.";
+                    throw std::invalid_argument(infostr.str());
+                }
+                // Check index version compatibility here
+                auto indexType = versionInfo.indexType();
+                // ==== Figure out the index type
+
+                salmonIndex_.reset(new SalmonIndex(sopt.jointLog, indexType));
+                if (!sopt.shmIndex.empty()) { salmonIndex_->useSharedSegment(sopt.shmIndex); }
+                salmonIndex_->load(indexDirectory);
             }
-            // Check index version compatibility here
-            auto indexType = versionInfo.indexType();
-            // ==== Figure out the index type
 
-            salmonIndex_.reset(new SalmonIndex(sopt.jointLog, indexType));
-            salmonIndex_->load(indexDirectory);
+            if (sopt.hugePages) { salmonIndex_->adviseHugePages(); }
+
+            // The transcript-side tables of the bias models, if they were
+            // precomputed when the (quasi) index was built
+            if (salmonIndex_->indexType() == SalmonIndexType::QUASI and
+                (sopt.biasCorrect or sopt.gcBiasCorrect)) {
+                std::string err;
+                biasTables_.reset(new TranscriptBiasTables);
+                if (!biasTables_->open(indexDirectory, err)) {
+                    if (!err.empty()) {
+                        sopt.jointLog->warn("Not using the precomputed bias tables: {}", err);
+                    }
+                    biasTables_.reset();
+                }
+            }
 
 	    // Now we'll have either an FMD-based index or a QUASI index
 	    // dispatch on the correct type.
@@ -124,11 +169,15 @@ class ReadExperiment {
                 }
                 break;
             case SalmonIndexType::FMD:
-                loadTranscriptsFromFMD();
+                loadTranscriptsFromFMD(sopt);
                 break;
 	    }
 
 
+            // Move the state updated during quantification out of the
+            // transcripts, into dense arrays
+            hotState_ = bindTranscriptHotState(transcripts_);
+
             // Create the cluster forest for this set of transcripts
             clusters_.reset(new ClusterForest(transcripts_.size(), transcripts_));
         }
@@ -137,8 +186,12 @@ class ReadExperiment {
         return eqBuilder_;
     }
 
+    StageTimings& stageTimings() { return stageTimings_; }
+    const StageTimings& stageTimings() const { return stageTimings_; }
+
     std::vector<Transcript>& transcripts() { return transcripts_; }
     const std::vector<Transcript>& transcripts() const { return transcripts_; }
+    TranscriptHotState& transcriptHotState() { return *hotState_; }
 
     void updateTranscriptLengthsAtomic(std::atomic<bool>& done) {
         if (sl_.try_lock()) {
@@ -181,6 +234,7 @@ class ReadExperiment {
     void updateShortFrags(salmon::utils::ShortFragStats& fs) { 
         sl_.lock();
         shortFragStats_.numTooShort += fs.numTooShort; 
+        shortFragStats_.numTooManyHits += fs.numTooManyHits;
         shortFragStats_.shortest = (fs.shortest < shortFragStats_.shortest) ? fs.shortest : shortFragStats_.shortest; 
         sl_.unlock();
     }
@@ -201,15 +255,90 @@ class ReadExperiment {
 
     SalmonIndex* getIndex() { return salmonIndex_.get(); }
 
+    /**
+     * Drop this experiment's reference to the index, once the mapping pass
+     * is done (salmon quant --releaseIndex); the optimizer, bootstraps and
+     * Gibbs sampler only need the equivalence classes and the transcripts.
+     * The transcripts of a quasi index borrow their sequences from its
+     * text, so the sequences are copied into a single buffer of their own
+     * first, if sequence-specific bias correction still needs them (the GC
+     * content was already computed, when they were loaded), and dropped
+     * otherwise, or if their k-mers were precomputed (see
+     * TranscriptBiasTables).  Returns the number of bytes of sequence kept.
+     */
+    size_t releaseIndex(const SalmonOpts& sopt) {
+        if (!salmonIndex_) { return 0; }
+        size_t numBytes{0};
+        if (salmonIndex_->indexType() == SalmonIndexType::QUASI) {
+            bool keepSequences = sopt.biasCorrect and !biasTables_;
+            if (keepSequences) {
+                for (auto& t : transcripts_) { numBytes += t.Sequence() ? t.RefLength : 0; }
+                transcriptSeqs_.reset(new char[numBytes]);
+            }
+            size_t offset{0};
+            for (auto& t : transcripts_) {
+                const char* seq = t.Sequence();
+                if (keepSequences and seq) {
+                    std::memcpy(transcriptSeqs_.get() + offset, seq, t.RefLength);
+                    t.setSequenceBorrowed(transcriptSeqs_.get() + offset);
+                    offset += t.RefLength;
+                } else {
+                    t.setSequenceBorrowed(nullptr);
+                }
+            }
+        }
+        salmonIndex_.reset();
+        return numBytes;
+    }
+
     template <typename QuasiIndexT>
     void loadTranscriptsFromQuasi(QuasiIndexT* idx_, const SalmonOpts& sopt) {
 	    size_t numRecords = idx_->txpNames.size();
 
 	    fmt::print(stderr, "Index contained {} targets\n", numRecords);
+	    if (biasTables_ and !biasTablesMatch_(idx_)) {
+		    sopt.jointLog->warn("The precomputed bias tables of the index don't match its transcripts "
+		                        "(rebuild them with salmon index --biasTables); not using them");
+		    biasTables_.reset();
+	    }
+	    addTranscriptsFromQuasi(idx_, sopt);
+	    // The transcripts of the extensions of the index (if any) are
+	    // numbered after those of the index itself
+	    for (auto& ext : salmonIndex_->quasiExtensions(idx_)) {
+		    fmt::print(stderr, "Index extension contained {} targets\n", ext->txpNames.size());
+		    addTranscriptsFromQuasi(ext.get(), sopt);
+	    }
+    }
+
+    // Whether the bias tables cover the transcripts of the index (and its extensions), in order
+    template <typename QuasiIndexT>
+    bool biasTablesMatch_(QuasiIndexT* idx_) {
+	    if (biasTables_->k() != readBias_.getK()) { return false; }
+	    uint64_t id{0};
+	    auto matches = [this, &id](QuasiIndexT* idx) -> bool {
+		    for (size_t i = 0; i < idx->txpLens.size(); ++i, ++id) {
+			    if (id >= biasTables_->numTranscripts() or
+			        biasTables_->length(id) != static_cast<uint64_t>(idx->txpLens[i])) {
+				    return false;
+			    }
+		    }
+		    return true;
+	    };
+	    if (!matches(idx_)) { return false; }
+	    for (auto& ext : salmonIndex_->quasiExtensions(idx_)) {
+		    if (!matches(ext.get())) { return false; }
+	    }
+	    return id == biasTables_->numTranscripts();
+    }
+
+    template <typename QuasiIndexT>
+    void addTranscriptsFromQuasi(QuasiIndexT* idx_, const SalmonOpts& sopt) {
+	    size_t numRecords = idx_->txpNames.size();
+	    size_t firstID = transcripts_.size();
 	    //transcripts_.resize(numRecords);
 	    double alpha = 0.005;
 	    for (auto i : boost::irange(size_t(0), numRecords)) {
-		    uint32_t id = i;
+		    uint32_t id = firstID + i;
 		    const char* name = idx_->txpNames[i].c_str();
 		    uint32_t len = idx_->txpLens[i];
 		    // copy over the length, then we're done.
@@ -218,9 +347,16 @@ class ReadExperiment {
 		    // The transcript sequence
 		    //auto txpSeq = idx_->seq.substr(idx_->txpOffsets[i], len);
 
-		    // Set the transcript sequence
+		    // Set the transcript sequence, and its precomputed GC counts and
+		    // k-mer indices, if there are any (the GC counts are only used
+		    // when they're not sampled)
+		    bool tableGC = biasTables_ and sopt.gcBiasCorrect and sopt.gcSampFactor == 1;
 		    txp.setSequenceBorrowed(idx_->seq.c_str() + idx_->txpOffsets[i],
-                                    sopt.gcBiasCorrect, sopt.gcSampFactor);
+                                    sopt.gcBiasCorrect and !tableGC, sopt.gcSampFactor);
+		    if (biasTables_) {
+			    txp.setBiasTables(tableGC ? biasTables_->gcCounts(id) : nullptr,
+			                      sopt.biasCorrect ? biasTables_->kmers(id) : nullptr);
+		    }
 		    // Length classes taken from
 		    // ======
 		    // Roberts, Adam, et al.
@@ -243,7 +379,12 @@ class ReadExperiment {
 	    // ====== Done loading the transcripts from file
     }
 
-    void loadTranscriptsFromFMD() {
+    /**
+     * The transcripts of an FMD index.  Their sequences are decoded from
+     * the index's packed text only if one of the bias models needs them
+     * (the mapping reads the index itself); a no-bias run keeps none.
+     */
+    void loadTranscriptsFromFMD(const SalmonOpts& sopt) {
 	    bwaidx_t* idx_ = salmonIndex_->bwaIndex();
 	    size_t numRecords = idx_->bns->n_seqs;
 	    std::vector<Transcript> transcripts_tmp;
@@ -271,35 +412,32 @@ class ReadExperiment {
 	    nucTab[0] = 'A'; nucTab[1] = 'C'; nucTab[2] = 'G'; nucTab[3] = 'T';
 	    for (size_t i = 4; i < 256; ++i) { nucTab[i] = 'N'; }
 
+        bool keepSequences = sopt.biasCorrect or sopt.gcBiasCorrect;
         size_t tnum = 0;
 	    // Load the transcript sequence from file
 	    for (auto& t : transcripts_tmp) {
 		    transcripts_.emplace_back(t.id, t.RefName.c_str(), t.RefLength, alpha);
+            auto& txp = transcripts_.back();
 		    /* from BWA */
 		    uint8_t* rseq = nullptr;
-		    int64_t tstart, tend, compLen, l_pac = idx_->bns->l_pac;
-		    tstart  = idx_->bns->anns[t.id].offset;
-		    tend = tstart + t.RefLength;
-		    rseq = bns_get_seq(l_pac, idx_->pac, tstart, tend, &compLen);
-		    if (compLen != t.RefLength) {
-			    fmt::print(stderr,
-					    "For transcript {}, stored length ({}) != computed length ({}) --- index may be corrupt. exiting\n",
-					    t.RefName, compLen, t.RefLength);
-			    std::exit(1);
-		    }
-		    std::string seq(t.RefLength, ' ');
-		    if (rseq != 0) {
-			    for (int64_t i = 0; i < compLen; ++i) { seq[i] = nucTab[rseq[i]]; }
+		    if (keepSequences) {
+		        int64_t tstart, tend, compLen, l_pac = idx_->bns->l_pac;
+		        tstart  = idx_->bns->anns[t.id].offset;
+		        tend = tstart + t.RefLength;
+		        rseq = bns_get_seq(l_pac, idx_->pac, tstart, tend, &compLen);
+		        if (compLen != t.RefLength) {
+			        fmt::print(stderr,
+					        "For transcript {}, stored length ({}) != computed length ({}) --- index may be corrupt. exiting\n",
+					        t.RefName, compLen, t.RefLength);
+			        salmon::utils::exitRun(1);
+		        }
+		        // Decode the sequence straight into the transcript's own copy
+		        char* seqCopy = new char[t.RefLength + 1];
+		        for (int64_t i = 0; i < compLen; ++i) { seqCopy[i] = (rseq != 0) ? nucTab[rseq[i]] : ' '; }
+		        seqCopy[t.RefLength] = '\0';
+		        txp.setSequenceOwned(seqCopy, sopt.gcBiasCorrect, sopt.gcSampFactor);
 		    }
 
-            auto& txp = transcripts_.back();
-
-            // allocate space for the new copy
-            char* seqCopy = new char[seq.length()+1];
-            std::strcpy(seqCopy, seq.c_str());
-            txp.setSequenceOwned(seqCopy);
-		    txp.setSAMSequenceOwned(salmon::stringtools::encodeSequenceInSAM(seq.c_str(), t.RefLength));
-
 		    // Length classes taken from
 		    // ======
 		    // Roberts, Adam, et al.
@@ -341,14 +479,55 @@ class ReadExperiment {
     }
 
 
+    /**
+     * Process each of the read libraries with processReadLibrary, which is
+     * given the library, the number of threads to map it with, and the
+     * first of those threads (its threads are [firstThread, firstThread +
+     * numThreads) of the numThreads in all).  The libraries are processed
+     * one after another, with all of the threads, unless
+     * sopt.concurrentLibraries is set; then up to numThreads libraries
+     * are processed at once, each by its own slice of the threads, and a
+     * slice that finishes its library moves on to the next one (the
+     * largest first), so the threads aren't left idle while the parser of
+     * each of many small libraries fills and drains.
+     */
     template <typename CallbackT>
     bool processReads(const uint32_t& numThreads, const SalmonOpts& sopt, CallbackT& processReadLibrary) {
         std::atomic<bool> burnedIn{totalAssignedFragments_ + numAssignedFragments_ > sopt.numBurninFrags};
-        for (auto& rl : readLibraries_) {
-            processReadLibrary(rl, salmonIndex_.get(), transcripts_, clusterForest(),
-                               *(fragLengthDist_.get()), numAssignedFragments_,
-                               numThreads, burnedIn);
+        size_t numSlices = sopt.concurrentLibraries ?
+            std::min(readLibraries_.size(), static_cast<size_t>(numThreads)) : 1;
+        if (numSlices <= 1) {
+            for (auto& rl : readLibraries_) {
+                processReadLibrary(rl, salmonIndex_.get(), transcripts_, clusterForest(),
+                                   *(fragLengthDist_.get()), numAssignedFragments_,
+                                   numThreads, 0, burnedIn);
+            }
+            return true;
+        }
+
+        std::vector<std::pair<uint64_t, size_t>> bySize;
+        for (size_t i = 0; i < readLibraries_.size(); ++i) {
+            bySize.emplace_back(readLibraries_[i].inputBytes(), i);
         }
+        std::stable_sort(bySize.begin(), bySize.end(),
+                         [](const std::pair<uint64_t, size_t>& a, const std::pair<uint64_t, size_t>& b) -> bool {
+                             return a.first > b.first;
+                         });
+        std::atomic<size_t> next{0};
+        std::vector<std::thread> slices;
+        size_t firstThread{0};
+        for (size_t s = 0; s < numSlices; ++s) {
+            size_t sliceThreads = numThreads / numSlices + ((s < numThreads % numSlices) ? 1 : 0);
+            slices.emplace_back([&, firstThread, sliceThreads]() -> void {
+                for (size_t j = next++; j < bySize.size(); j = next++) {
+                    processReadLibrary(readLibraries_[bySize[j].second], salmonIndex_.get(), transcripts_,
+                                       clusterForest(), *(fragLengthDist_.get()), numAssignedFragments_,
+                                       sliceThreads, firstThread, burnedIn);
+                }
+            });
+            firstThread += sliceThreads;
+        }
+        for (auto& t : slices) { t.join(); }
         return true;
     }
 
@@ -582,6 +761,9 @@ class ReadExperiment {
         return expectedGC_;
     }
 
+    // The mass with which each bin of observedGC() starts
+    static double observedGCPseudoMass() { return 1e-5; }
+
     const std::vector<double>& observedGC() const {
         return observedGC_;
     }
@@ -593,6 +775,23 @@ class ReadExperiment {
     ReadKmerDist<6, std::atomic<uint32_t>>& readBias() { return readBias_; }
     const ReadKmerDist<6, std::atomic<uint32_t>>& readBias() const { return readBias_; }
 
+    /**
+     * The sample of fragment k-mer contexts from which readBias() is
+     * trained; the mapping threads merge their own samples into it.
+     */
+    BiasSampleReservoir& biasSamples() { return biasSamples_; }
+
+    /**
+     * Add the sampled k-mer contexts to readBias(), and empty the sample;
+     * returns the number of samples added.
+     */
+    size_t trainReadBiasFromSamples() {
+        size_t numSamples = biasSamples_.size();
+        biasSamples_.forEachSample([this](uint32_t kmer) -> void { readBias_.counts[kmer]++; });
+        biasSamples_.clear();
+        return numSamples;
+    }
+
     private:
     /**
      * The file from which the alignments will be read.
@@ -612,7 +811,11 @@ class ReadExperiment {
     /**
      * The index we've built on the set of transcripts.
      */
-    std::unique_ptr<SalmonIndex> salmonIndex_{nullptr};
+    std::shared_ptr<SalmonIndex> salmonIndex_{nullptr};
+    // The transcript sequences, once the (quasi) index is released (see releaseIndex)
+    std::unique_ptr<char[]> transcriptSeqs_{nullptr};
+    // The precomputed transcript-side tables of the bias models (if any)
+    std::unique_ptr<TranscriptBiasTables> biasTables_{nullptr};
     //bwaidx_t *idx_{nullptr};
     /**
      * The cluster forest maintains the dynamic relationship
@@ -621,6 +824,8 @@ class ReadExperiment {
      * in the same cluster.
      */
     std::unique_ptr<ClusterForest> clusters_;
+    // The per-transcript state updated during quantification (see TranscriptHotState)
+    std::unique_ptr<TranscriptHotState> hotState_;
     /**
       *
       *
@@ -644,6 +849,8 @@ class ReadExperiment {
     SpinLock sl_;
     std::unique_ptr<FragmentLengthDistribution> fragLengthDist_;
     EquivalenceClassBuilder eqBuilder_;
+    // Where the time of this run was spent
+    StageTimings stageTimings_;
 
     /** GC-fragment bias things **/
     // One bin for each percentage GC content
@@ -656,6 +863,7 @@ class ReadExperiment {
     // need atomic counters.
     ReadKmerDist<6, std::atomic<uint32_t>> readBias_;
     std::vector<double> expectedBias_;
+    BiasSampleReservoir biasSamples_;
 };
 
 #endif // EXPERIMENT_HPP
@@ -0,0 +1,110 @@
+#ifndef __READ_HIT_CACHE_HPP__
+#define __READ_HIT_CACHE_HPP__
+
+#include <cstdint>
+#include <iterator>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "xxhash.h"
+
+/**
+ * A bounded cache of the hits of recently mapped read sequences, so that
+ * the duplicates of a read (of which highly duplicated libraries, e.g.
+ * amplicon, low-input or 3' tag libraries, have many) are not mapped again
+ * (salmon quant --readHitCache).  Each mapping thread has its own, so it's
+ * never locked.  An entry is keyed by the read's sequence and its mate
+ * status (the hits of the left and right mates of a pair differ), and
+ * holds the hits that the mapper collected for it; once the cache is full,
+ * the least recently used entry is evicted.
+ *
+ * The sequences are kept, and compared on a lookup, so that a collision
+ * of their hashes can't give a read the hits of another.  Only the mapping
+ * is skipped: a duplicate is still a fragment of its own, and is counted as
+ * one in the equivalence classes.
+ */
+template <typename HitT>
+class ReadHitCache {
+    public:
+        explicit ReadHitCache(size_t capacity) : capacity_(capacity) {
+            index_.reserve(capacity);
+        }
+
+        /**
+         * If seq (with mate status status) is cached, copy its hits to hits,
+         * set found to whether the mapper found any, and return true.
+         */
+        bool find(const std::string& seq, uint8_t status, std::vector<HitT>& hits, bool& found) {
+            ++numLookups_;
+            uint64_t h = hash_(seq, status);
+            auto it = index_.find(h);
+            if (it == index_.end()) { return false; }
+            auto entry = it->second;
+            if (entry->status != status or entry->seq != seq) { return false; }
+            // This entry is now the most recently used
+            entries_.splice(entries_.begin(), entries_, entry);
+            hits = entry->hits;
+            found = entry->found;
+            ++numHits_;
+            return true;
+        }
+
+        /** Cache the hits of seq, evicting the least recently used entry if the cache is full. */
+        void insert(const std::string& seq, uint8_t status, const std::vector<HitT>& hits, bool found) {
+            if (capacity_ == 0) { return; }
+            uint64_t h = hash_(seq, status);
+            auto it = index_.find(h);
+            if (it != index_.end()) {
+                // Replace the entry of a colliding sequence
+                auto entry = it->second;
+                entry->seq = seq;
+                entry->status = status;
+                entry->hits = hits;
+                entry->found = found;
+                entries_.splice(entries_.begin(), entries_, entry);
+                return;
+            }
+            if (entries_.size() >= capacity_) {
+                // Re-use the least recently used entry (and its buffers)
+                auto last = std::prev(entries_.end());
+                index_.erase(last->hash);
+                entries_.splice(entries_.begin(), entries_, last);
+            } else {
+                entries_.emplace_front();
+            }
+            auto& e = entries_.front();
+            e.hash = h;
+            e.seq = seq;
+            e.status = status;
+            e.hits = hits;
+            e.found = found;
+            index_[h] = entries_.begin();
+        }
+
+        size_t size() const { return entries_.size(); }
+        uint64_t numLookups() const { return numLookups_; }
+        uint64_t numHits() const { return numHits_; }
+
+    private:
+        struct Entry {
+            uint64_t hash{0};
+            std::string seq;
+            uint8_t status{0};
+            bool found{false};
+            std::vector<HitT> hits;
+        };
+
+        static uint64_t hash_(const std::string& seq, uint8_t status) {
+            return XXH64(seq.data(), seq.size(), status);
+        }
+
+        size_t capacity_;
+        std::list<Entry> entries_;
+        std::unordered_map<uint64_t, typename std::list<Entry>::iterator> index_;
+        uint64_t numLookups_{0};
+        uint64_t numHits_{0};
+};
+
+#endif // __READ_HIT_CACHE_HPP__
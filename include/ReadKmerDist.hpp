@@ -9,6 +9,7 @@
 #include <cstdint>
 #include "UtilityFunctions.hpp"
 #include "SalmonUtils.hpp"
+#include "RollingKmerIndex.hpp"
 
 template <uint32_t K, typename CountT = uint32_t>
 class ReadKmerDist {
@@ -34,6 +35,16 @@ class ReadKmerDist {
     // The underlying transcript is from [start, end)
     inline bool update(const char* start, const char *p, const char *end,
 	salmon::utils::Direction dir) {
+      uint32_t idx{0};
+      if (!contextIndex(start, p, end, dir, idx)) { return false; }
+      counts[idx]++;
+      return true;
+    }
+
+    // compute (in idx) the index of the k-mer context of the hit at position
+    // p, without counting it.  The underlying transcript is from [start, end)
+    inline bool contextIndex(const char* start, const char *p, const char *end,
+	salmon::utils::Direction dir, uint32_t& idx) {
       using salmon::utils::Direction;
       int posBeforeHit = 2;
       // This is 4 insted of 3, b/c the last
@@ -49,9 +60,9 @@ class ReadKmerDist {
 	      p -= posBeforeHit;
 	      // If the read matches in the forward direction, we take
 	      // the RC sequence.
-	      auto idx = indexForKmer(p, K, Direction::FORWARD);
-	      if (idx >= counts.size()) { return false; }
-	      counts[idx]++;
+	      RollingKmerIndex kmer(K);
+	      if (!kmer.set(p)) { return false; }
+	      idx = kmer.fw();
 	      success = true;
 	    }
 	  }
@@ -61,9 +72,9 @@ class ReadKmerDist {
 	    if ((p - start) >= posAfterHit and
 		((p - posAfterHit + K) < end) ) {
 	      p -= posAfterHit;
-	      auto idx = indexForKmer(p, K, Direction::REVERSE_COMPLEMENT);
-	      if (idx >= counts.size()) { return false; }
-	      counts[idx]++;
+	      RollingKmerIndex kmer(K);
+	      if (!kmer.set(p)) { return false; }
+	      idx = kmer.rc();
 	      success = true;
 	    }
 	  }
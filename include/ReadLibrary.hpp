@@ -1,6 +1,9 @@
 #ifndef READ_LIBRARY_HPP
 #define READ_LIBRARY_HPP
 
+#include <array>
+#include <atomic>
+#include <cstdint>
 #include <vector>
 #include <exception>
 #include <set>
@@ -122,6 +125,27 @@ public:
         return true;
     }
 
+    // The total size of the read files (not counting those that aren't regular files)
+    uint64_t inputBytes() {
+        uint64_t n{0};
+        auto addSizes = [&n](const std::vector<std::string>& files) -> void {
+            for (auto& f : files) {
+                boost::system::error_code ec;
+                if (boost::filesystem::is_regular_file(f, ec)) {
+                    auto size = boost::filesystem::file_size(f, ec);
+                    if (!ec) { n += size; }
+                }
+            }
+        };
+        if (isPairedEnd()) {
+            addSizes(mateOneFilenames_);
+            addSizes(mateTwoFilenames_);
+        } else {
+            addSizes(unmatedFilenames_);
+        }
+        return n;
+    }
+
     std::string readFilesAsString() {
         std::stringstream sstr;
         if (isPairedEnd()) {
@@ -235,4 +259,32 @@ private:
     std::vector<std::atomic<uint64_t>> libTypeCounts_;
 };
 
+/**
+ * A mapping thread's tally of the library formats of the fragments it has
+ * assigned during the initial round, added to those of its ReadLibrary once
+ * the thread is done with the library (rather than after each mini-batch),
+ * so that the threads don't contend for the (atomic) shared counts.  It is
+ * padded to its own cache lines.
+ */
+class alignas(64) LocalLibTypeCounts {
+public:
+    LocalLibTypeCounts() { counts_.fill(0); }
+
+    inline void observe(const LibraryFormat& fmt) { ++counts_[fmt.formatID()]; }
+
+    /**
+     * Add the local counts to those of rl, and reset them.
+     */
+    void flush(ReadLibrary& rl) {
+        auto& shared = rl.libTypeCounts();
+        for (size_t i = 0; i < counts_.size(); ++i) {
+            if (counts_[i] > 0) { shared[i] += counts_[i]; }
+        }
+        counts_.fill(0);
+    }
+
+private:
+    std::array<uint64_t, LibraryFormat::maxLibTypeID() + 1> counts_;
+};
+
 #endif // READ_LIBRARY_HPP
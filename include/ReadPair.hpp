@@ -15,6 +15,9 @@ struct ReadPair {
     salmon::utils::OrphanStatus orphanStatus;
     double logProb;
     LibraryFormat libFmt{ReadType::PAIRED_END, ReadOrientation::NONE, ReadStrandedness::U};
+    // A hash of the read name (without any /1 or /2 suffix), set by the
+    // BAMQueue when the record is decoded; used to group alignments by read.
+    uint64_t nameHash{0};
 
     ReadPair():
         read1(staden::utils::bam_init()),
@@ -33,6 +36,7 @@ struct ReadPair {
         std::swap(read1, other.read1);
         std::swap(read2, other.read2);
         libFmt = other.libFmt;
+        nameHash = other.nameHash;
     }
 
     ReadPair& operator=(ReadPair&& other) {
@@ -41,6 +45,7 @@ struct ReadPair {
         std::swap(read1, other.read1);
         std::swap(read2, other.read2);
         libFmt = other.libFmt;
+        nameHash = other.nameHash;
         return *this;
     }
 
@@ -0,0 +1,204 @@
+#ifndef __READ_TRIMMER_HPP__
+#define __READ_TRIMMER_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * The reads trimmed by one mapping thread, which it adds to the totals of
+ * the ReadTrimmer once it's done.
+ */
+struct ReadTrimStats {
+    uint64_t numReads{0};
+    uint64_t numTrimmed{0};
+    uint64_t qualityBases{0};
+    uint64_t adapterBases{0};
+    uint64_t polyABases{0};
+};
+
+/**
+ * Trims the reads in place, as they come from the parser and before they
+ * are mapped (salmon quant --trimAdapters, --trimQuality, --trimPolyA), so
+ * that they needn't be trimmed (and re-compressed) by a separate tool
+ * first.  In this order, a read's
+ *
+ *  - 3' end is cut at the first window of --trimWindow bases whose mean
+ *    (phred) quality is below --trimQuality;
+ *  - 3' adapter is removed: the read is cut at the leftmost position from
+ *    which it matches the start of one of the adapters (over at least
+ *    minOverlap bases, with at most one mismatch per 10 bases), so that
+ *    partial adapters at the very end are removed too;
+ *  - trailing poly-A tail and leading poly-T head of at least --trimPolyA
+ *    bases are removed.
+ *
+ * The adapter is compared eight bases at a time, with the mismatches of a
+ * word counted from the XOR of the words (see mismatches_).
+ */
+class ReadTrimmer {
+    public:
+        ReadTrimmer(const std::vector<std::string>& adapters, uint32_t minQuality, uint32_t window,
+                    uint32_t minPolyA, uint32_t minOverlap = 3, double maxErrorRate = 0.1) :
+            minQuality_(minQuality), window_(std::max(window, uint32_t(1))), minPolyA_(minPolyA),
+            minOverlap_(std::max(minOverlap, uint32_t(1))), maxErrorRate_(maxErrorRate) {
+            for (auto& a : adapters) { adapters_.push_back(adapterSequence(a)); }
+        }
+
+        /**
+         * The sequence of the adapter named (case-insensitively) illumina,
+         * nextera or smallrna, or else name itself, in upper case.
+         */
+        static std::string adapterSequence(const std::string& name) {
+            std::string upper(name);
+            std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+            if (upper == "ILLUMINA") { return "AGATCGGAAGAGC"; }
+            if (upper == "NEXTERA") { return "CTGTCTCTTATACACATCT"; }
+            if (upper == "SMALLRNA") { return "TGGAATTCTCGG"; }
+            return upper;
+        }
+
+        // Both mates of a pair are trimmed the same way
+        template <typename ReadT>
+        void trim(std::pair<ReadT, ReadT>& pair, ReadTrimStats& stats) const {
+            trim(pair.first, stats);
+            trim(pair.second, stats);
+        }
+
+        // A read (with the seq and qual of the parser's records)
+        template <typename ReadT>
+        void trim(ReadT& read, ReadTrimStats& stats) const {
+            trim(read.seq, read.qual, stats);
+        }
+
+        // Trim seq (and qual, if it holds the qualities of seq)
+        void trim(std::string& seq, std::string& qual, ReadTrimStats& stats) const {
+            ++stats.numReads;
+            size_t origLen = seq.size();
+            bool haveQual = (qual.size() == seq.size());
+
+            if (minQuality_ > 0 and haveQual) {
+                size_t end = qualityEnd_(qual);
+                stats.qualityBases += seq.size() - end;
+                seq.resize(end);
+                qual.resize(end);
+            }
+            if (!adapters_.empty()) {
+                size_t end = adapterEnd_(seq);
+                stats.adapterBases += seq.size() - end;
+                seq.resize(end);
+                if (haveQual) { qual.resize(end); }
+            }
+            if (minPolyA_ > 0) {
+                size_t end = seq.size();
+                while (end > 0 and seq[end - 1] == 'A') { --end; }
+                if (seq.size() - end >= minPolyA_) {
+                    stats.polyABases += seq.size() - end;
+                    seq.resize(end);
+                    if (haveQual) { qual.resize(end); }
+                }
+                size_t begin = 0;
+                while (begin < seq.size() and seq[begin] == 'T') { ++begin; }
+                if (begin >= minPolyA_) {
+                    stats.polyABases += begin;
+                    seq.erase(0, begin);
+                    if (haveQual) { qual.erase(0, begin); }
+                }
+            }
+            stats.numTrimmed += (seq.size() != origLen);
+        }
+
+        void addStats(const ReadTrimStats& stats) {
+            numReads_ += stats.numReads;
+            numTrimmed_ += stats.numTrimmed;
+            qualityBases_ += stats.qualityBases;
+            adapterBases_ += stats.adapterBases;
+            polyABases_ += stats.polyABases;
+        }
+
+        ReadTrimStats stats() const {
+            ReadTrimStats s;
+            s.numReads = numReads_;
+            s.numTrimmed = numTrimmed_;
+            s.qualityBases = qualityBases_;
+            s.adapterBases = adapterBases_;
+            s.polyABases = polyABases_;
+            return s;
+        }
+
+    private:
+        // The length of the prefix of a read with qualities qual that is kept
+        size_t qualityEnd_(const std::string& qual) const {
+            size_t n = qual.size();
+            if (n < window_) { return n; }
+            int64_t threshold = static_cast<int64_t>(minQuality_ + qualityOffset_) * window_;
+            int64_t sum{0};
+            for (size_t i = 0; i < window_; ++i) { sum += static_cast<unsigned char>(qual[i]); }
+            for (size_t i = 0;; ++i) {
+                if (sum < threshold) { return i; }
+                if (i + window_ >= n) { return n; }
+                sum += static_cast<int64_t>(static_cast<unsigned char>(qual[i + window_])) -
+                       static_cast<unsigned char>(qual[i]);
+            }
+        }
+
+        // The length of the read seq without its adapter
+        size_t adapterEnd_(const std::string& seq) const {
+            size_t n = seq.size();
+            size_t end = n;
+            for (auto& adapter : adapters_) {
+                for (size_t p = 0; p + minOverlap_ <= end; ++p) {
+                    size_t overlap = std::min(n - p, adapter.size());
+                    uint32_t maxMismatches = static_cast<uint32_t>(maxErrorRate_ * overlap);
+                    if (mismatches_(seq.data() + p, adapter.data(), overlap, maxMismatches) <= maxMismatches) {
+                        end = p;
+                        break;
+                    }
+                }
+            }
+            return end;
+        }
+
+        /**
+         * The number of mismatches between a and b over n bytes (or some
+         * number greater than maxMismatches, once they're that many).  Each
+         * byte of the XOR of two words that is non-zero gets its high bit
+         * set, and those bits are counted.
+         */
+        static inline uint32_t mismatches_(const char* a, const char* b, size_t n, uint32_t maxMismatches) {
+            constexpr uint64_t low7 = 0x7f7f7f7f7f7f7f7fULL;
+            constexpr uint64_t high = 0x8080808080808080ULL;
+            uint32_t mm{0};
+            size_t i = 0;
+            for (; i + 8 <= n; i += 8) {
+                uint64_t x, y;
+                std::memcpy(&x, a + i, 8);
+                std::memcpy(&y, b + i, 8);
+                uint64_t d = x ^ y;
+                mm += __builtin_popcountll((((d & low7) + low7) | d) & high);
+                if (mm > maxMismatches) { return mm; }
+            }
+            for (; i < n; ++i) { mm += (a[i] != b[i]); }
+            return mm;
+        }
+
+        static constexpr uint32_t qualityOffset_ = 33;
+
+        std::vector<std::string> adapters_;
+        uint32_t minQuality_;
+        uint32_t window_;
+        uint32_t minPolyA_;
+        uint32_t minOverlap_;
+        double maxErrorRate_;
+
+        std::atomic<uint64_t> numReads_{0};
+        std::atomic<uint64_t> numTrimmed_{0};
+        std::atomic<uint64_t> qualityBases_{0};
+        std::atomic<uint64_t> adapterBases_{0};
+        std::atomic<uint64_t> polyABases_{0};
+};
+
+#endif // __READ_TRIMMER_HPP__
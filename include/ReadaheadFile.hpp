@@ -0,0 +1,227 @@
+#ifndef __READAHEAD_FILE_HPP__
+#define __READAHEAD_FILE_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <boost/iostreams/categories.hpp>
+
+/**
+ * Reads a file ahead of its consumer (--readahead), for inputs on
+ * network storage (NFS, Lustre), where a read may now and then take far
+ * longer than it takes to parse (and decompress) the data already read.
+ * An I/O thread reads the file sequentially, in blocks of blockBytes, into
+ * a ring of bufferBytes / blockBytes blocks (at least two), so that the
+ * consumer only waits for the storage when the I/O thread falls behind by
+ * the whole ring.  The time the consumer spends waiting is added to
+ * *waitNs.
+ */
+class ReadaheadFile {
+    public:
+        ReadaheadFile(const std::string& path, uint64_t bufferBytes, std::atomic<uint64_t>* waitNs = nullptr,
+                      size_t blockBytes = size_t(4) << 20) :
+            path_(path), blockBytes_(blockBytes),
+            numBlocks_(std::max(uint64_t(2), bufferBytes / blockBytes)), waitNs_(waitNs) {
+            fd_ = ::open(path.c_str(), O_RDONLY);
+            if (fd_ < 0) { throw std::runtime_error("Could not open " + path + ": " + std::strerror(errno)); }
+#ifdef POSIX_FADV_SEQUENTIAL
+            posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+            reader_ = std::thread([this]() -> void { readAhead_(); });
+        }
+
+        ~ReadaheadFile() {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+            }
+            cond_.notify_all();
+            reader_.join();
+            ::close(fd_);
+        }
+
+        std::streamsize read(char* s, std::streamsize n) {
+            while (pos_ == current_.size()) {
+                std::unique_lock<std::mutex> lock(mutex_);
+                if (!current_.empty()) {
+                    free_.push_back(std::move(current_));
+                    current_.clear();
+                    pos_ = 0;
+                    cond_.notify_all();
+                }
+                if (filled_.empty() and !done_) {
+                    auto start = std::chrono::steady_clock::now();
+                    cond_.wait(lock, [this]() -> bool { return !filled_.empty() or done_; });
+                    if (waitNs_) {
+                        *waitNs_ += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                        std::chrono::steady_clock::now() - start).count();
+                    }
+                }
+                if (filled_.empty()) {
+                    if (!error_.empty()) { throw std::runtime_error(error_); }
+                    return -1;
+                }
+                current_ = std::move(filled_.front());
+                filled_.pop_front();
+            }
+            std::streamsize m = std::min(n, static_cast<std::streamsize>(current_.size() - pos_));
+            std::memcpy(s, current_.data() + pos_, m);
+            pos_ += m;
+            return m;
+        }
+
+    private:
+        void readAhead_() {
+            size_t numAllocated{0};
+            while (true) {
+                std::vector<char> block;
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    cond_.wait(lock, [this, numAllocated]() -> bool {
+                        return stop_ or !free_.empty() or numAllocated < numBlocks_;
+                    });
+                    if (stop_) { break; }
+                    if (!free_.empty()) {
+                        block = std::move(free_.back());
+                        free_.pop_back();
+                    } else {
+                        ++numAllocated;
+                    }
+                }
+                block.resize(blockBytes_);
+                size_t len{0};
+                while (len < blockBytes_) {
+                    ssize_t r = ::read(fd_, block.data() + len, blockBytes_ - len);
+                    if (r < 0 and errno == EINTR) { continue; }
+                    if (r < 0) {
+                        std::lock_guard<std::mutex> lock(mutex_);
+                        error_ = "Error reading " + path_ + ": " + std::strerror(errno);
+                        len = 0;
+                        break;
+                    }
+                    if (r == 0) { break; }
+                    len += r;
+                }
+                block.resize(len);
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (len > 0) { filled_.push_back(std::move(block)); }
+                if (len < blockBytes_) {
+                    done_ = true;
+                    cond_.notify_all();
+                    break;
+                }
+                cond_.notify_all();
+            }
+        }
+
+        std::string path_;
+        size_t blockBytes_;
+        size_t numBlocks_;
+        std::atomic<uint64_t>* waitNs_;
+        int fd_{-1};
+
+        std::mutex mutex_;
+        std::condition_variable cond_;
+        std::deque<std::vector<char>> filled_;
+        std::vector<std::vector<char>> free_;
+        bool done_{false};
+        bool stop_{false};
+        std::string error_;
+        std::thread reader_;
+
+        // The block being consumed
+        std::vector<char> current_;
+        size_t pos_{0};
+};
+
+// The copyable (boost iostreams) source by which a ReadaheadFile is read
+class ReadaheadSource {
+    public:
+        typedef char char_type;
+        typedef boost::iostreams::source_tag category;
+
+        ReadaheadSource(const std::string& path, uint64_t bufferBytes, std::atomic<uint64_t>* waitNs) :
+            impl_(std::make_shared<ReadaheadFile>(path, bufferBytes, waitNs)) {}
+        std::streamsize read(char* s, std::streamsize n) { return impl_->read(s, n); }
+
+    private:
+        std::shared_ptr<ReadaheadFile> impl_;
+};
+
+/**
+ * A ReadaheadFile fed into a pipe, for the readers that open a file by its
+ * path themselves (io_lib's scram_open, for BAM / CRAM input), which open
+ * path() instead.  The pipe must be closed by its reader before this is
+ * destroyed.
+ */
+class ReadaheadPipe {
+    public:
+        ReadaheadPipe(const std::string& path, uint64_t bufferBytes, std::atomic<uint64_t>* waitNs) :
+            file_(path, bufferBytes, waitNs) {
+            int fds[2];
+            if (::pipe(fds) != 0) { throw std::runtime_error(std::string("Could not create a pipe: ") + std::strerror(errno)); }
+            readFd_ = fds[0];
+            writeFd_ = fds[1];
+            path_ = "/dev/fd/" + std::to_string(readFd_);
+            feeder_ = std::thread([this]() -> void { feed_(); });
+        }
+
+        ~ReadaheadPipe() {
+            // Once no one has the pipe open for reading, the feeder's writes fail
+            ::close(readFd_);
+            feeder_.join();
+        }
+
+        const std::string& path() const { return path_; }
+
+    private:
+        void feed_() {
+            // A reader that stops early makes the writes fail with EPIPE,
+            // rather than raising SIGPIPE (for this thread)
+            sigset_t mask;
+            sigemptyset(&mask);
+            sigaddset(&mask, SIGPIPE);
+            pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+            std::vector<char> buf(size_t(1) << 16);
+            try {
+                std::streamsize n;
+                while ((n = file_.read(buf.data(), buf.size())) > 0) {
+                    for (std::streamsize off = 0; off < n;) {
+                        ssize_t w = ::write(writeFd_, buf.data() + off, n - off);
+                        if (w < 0 and errno == EINTR) { continue; }
+                        if (w < 0) { n = -1; break; }
+                        off += w;
+                    }
+                    if (n < 0) { break; }
+                }
+            } catch (std::exception& e) {
+                // The reader sees the file end early
+                std::cerr << "\n" << e.what() << "\n";
+            }
+            ::close(writeFd_);
+        }
+
+        ReadaheadFile file_;
+        int readFd_{-1};
+        int writeFd_{-1};
+        std::string path_;
+        std::thread feeder_;
+};
+
+#endif // __READAHEAD_FILE_HPP__
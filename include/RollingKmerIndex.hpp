@@ -0,0 +1,119 @@
+#ifndef ROLLING_KMER_INDEX_HPP
+#define ROLLING_KMER_INDEX_HPP
+
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+/**
+ * The indices (as computed by indexForKmer) of the forward and the
+ * reverse-complement strand of a k-mer (k <= 16), maintained as the k-mer
+ * window slides along a sequence one base at a time.  Both indices are
+ * updated by push() with a single table lookup and a few shifts, without
+ * branching on the base or on the strand.  A window that holds a base other
+ * than A, C, G, T (or U) is not valid().
+ *
+ * indicesOf() computes the indices of all of the windows of a sequence at
+ * once, updating every window with each of its k bases in turn, so that the
+ * inner loop (over the windows) has no dependencies from one iteration to
+ * the next, and can be vectorized.
+ */
+class RollingKmerIndex {
+    public:
+        static constexpr uint32_t invalidIndex = std::numeric_limits<uint32_t>::max();
+
+        explicit RollingKmerIndex(uint32_t k) :
+            k_(k), mask_((k >= 16) ? 0xFFFFFFFF : ((uint32_t(1) << (2 * k)) - 1)),
+            rcShift_(2 * (k - 1)) {}
+
+        inline void reset() {
+            fw_ = 0;
+            rc_ = 0;
+            numValid_ = 0;
+        }
+
+        // Slide the window one base to the right, taking in c
+        inline void push(char c) {
+            uint32_t code = encode(c);
+            uint32_t b = code & 0x3;
+            fw_ = ((fw_ << 2) | b) & mask_;
+            rc_ = (rc_ >> 2) | ((3 - b) << rcShift_);
+            numValid_ = (code < 4) ? numValid_ + 1 : 0;
+        }
+
+        // Set the window to the k bases starting at s
+        inline bool set(const char* s) {
+            reset();
+            for (uint32_t i = 0; i < k_; ++i) { push(s[i]); }
+            return valid();
+        }
+
+        inline bool valid() const { return numValid_ >= k_; }
+        inline uint32_t fw() const { return fw_; }
+        inline uint32_t rc() const { return rc_; }
+
+        /**
+         * Fill fw[i] and rc[i] with the indices of the k-mer starting at
+         * s[i], for each of the len - k + 1 k-mers of s; the indices of a
+         * k-mer that isn't valid are set to invalidIndex.
+         */
+        static void indicesOf(const char* s, size_t len, uint32_t k,
+                              std::vector<uint32_t>& fw, std::vector<uint32_t>& rc) {
+            size_t n = (len >= k) ? len - k + 1 : 0;
+            fw.assign(n, 0);
+            rc.assign(n, 0);
+            if (n == 0) { return; }
+            std::vector<uint32_t> codes(len);
+            for (size_t i = 0; i < len; ++i) { codes[i] = encode(s[i]); }
+
+            std::vector<uint32_t> invalid(n, 0);
+            uint32_t* f = fw.data();
+            uint32_t* r = rc.data();
+            uint32_t* bad = invalid.data();
+            for (uint32_t j = 0; j < k; ++j) {
+                const uint32_t* c = codes.data() + j;
+                uint32_t shift = 2 * j;
+                for (size_t i = 0; i < n; ++i) {
+                    uint32_t b = c[i] & 0x3;
+                    f[i] = (f[i] << 2) | b;
+                    r[i] |= (3 - b) << shift;
+                    bad[i] |= c[i] >> 2;
+                }
+            }
+            for (size_t i = 0; i < n; ++i) {
+                if (bad[i]) {
+                    f[i] = invalidIndex;
+                    r[i] = invalidIndex;
+                }
+            }
+        }
+
+        // The 2-bit code of c, or 4 if c is not a nucleotide
+        static inline uint32_t encode(char c) {
+            return codes_()[static_cast<uint8_t>(c)];
+        }
+
+    private:
+        static const std::array<uint8_t, 256>& codes_() {
+            static const std::array<uint8_t, 256> codes = []() -> std::array<uint8_t, 256> {
+                std::array<uint8_t, 256> t;
+                t.fill(4);
+                t['A'] = t['a'] = 0;
+                t['C'] = t['c'] = 1;
+                t['G'] = t['g'] = 2;
+                t['T'] = t['t'] = t['U'] = t['u'] = 3;
+                return t;
+            }();
+            return codes;
+        }
+
+        uint32_t k_;
+        uint32_t mask_;
+        uint32_t rcShift_;
+        uint32_t fw_{0};
+        uint32_t rc_{0};
+        uint32_t numValid_{0};
+};
+
+#endif // ROLLING_KMER_INDEX_HPP
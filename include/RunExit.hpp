@@ -0,0 +1,41 @@
+#ifndef __RUN_EXIT_HPP__
+#define __RUN_EXIT_HPP__
+
+#include <cstdlib>
+
+namespace salmon {
+namespace utils {
+
+/**
+ * Thrown by exitRun in place of ending the process, when the run belongs to
+ * a host that asked for it (the Quantifier of SalmonAPI.hpp).  It doesn't
+ * derive from std::exception, so that the catch (std::exception&) blocks of
+ * salmon quant let it through to the host.
+ */
+struct RunExit {
+    int status;
+};
+
+/**
+ * Whether exitRun, on this thread, throws a RunExit rather than calling
+ * std::exit; only set by a host for the duration of a run.
+ */
+inline bool& throwOnExit() {
+    static thread_local bool throwOnExit_{false};
+    return throwOnExit_;
+}
+
+/**
+ * End the run with the given exit status: end the process (as salmon quant
+ * always has), or, for a run hosted in process, return the status to the
+ * host by way of a RunExit.
+ */
+[[noreturn]] inline void exitRun(int status) {
+    if (throwOnExit()) { throw RunExit{status}; }
+    std::exit(status);
+}
+
+}
+}
+
+#endif // __RUN_EXIT_HPP__
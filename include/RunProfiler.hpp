@@ -0,0 +1,217 @@
+#ifndef __RUN_PROFILER_HPP__
+#define __RUN_PROFILER_HPP__
+
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/timer/timer.hpp>
+
+#include "PerfCounters.hpp"
+
+/**
+ * Records the wall-clock time, the CPU time (of the whole process, over
+ * all threads) and the peak resident set size of each phase of a run
+ * (--profile), and writes them to aux/profile.json.  Phases nest: a phase
+ * begun while another is open becomes its child.  Phases are meant to be
+ * begun and ended by the main thread; the phases of worker threads would
+ * interleave arbitrarily.  With the hardware counters enabled
+ * (--perfCounters), each phase also records the cycles, instructions and
+ * cache / TLB misses of every thread over its span.
+ */
+class RunProfiler {
+    public:
+        RunProfiler() { timer_.start(); }
+
+        /**
+         * Record the hardware counters of the phases, and of the regions of
+         * the worker threads; returns false if the counters aren't available
+         * on this system.
+         */
+        bool enableHardwareCounters() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            hw_.reset(new HardwareCounters);
+            if (!hw_->available()) { hw_.reset(); }
+            return hw_ != nullptr;
+        }
+
+        // The hardware counters, or nullptr if they aren't enabled
+        HardwareCounters* hardwareCounters() { return hw_.get(); }
+
+        /**
+         * Begin a phase, as a child of the innermost open phase.
+         */
+        void begin(const std::string& name) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            Record r;
+            r.name = name;
+            r.parent = open_.empty() ? -1 : static_cast<int64_t>(open_.back());
+            r.start = timer_.elapsed();
+            if (hw_) { r.hwStart = hw_->snapshot(); }
+            if (r.parent >= 0) { records_[r.parent].children.push_back(records_.size()); }
+            open_.push_back(records_.size());
+            records_.push_back(r);
+        }
+
+        // End the innermost open phase
+        void end() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (open_.empty()) { return; }
+            auto& r = records_[open_.back()];
+            r.end = timer_.elapsed();
+            r.peakRSSBytes = peakRSSBytes();
+            if (hw_) { r.hwCounts = hw_->countsSince(r.hwStart); }
+            r.done = true;
+            open_.pop_back();
+        }
+
+        // Record a named total of the run (e.g. a time spent waiting), written alongside the phases
+        void setValue(const std::string& name, double value) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            values_[name] = value;
+        }
+
+        // The names of the open phases, outermost first, joined by '/' ("" if none is open)
+        std::string currentPhase() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            std::string path;
+            for (auto i : open_) {
+                if (!path.empty()) { path.push_back('/'); }
+                path += records_[i].name;
+            }
+            return path;
+        }
+
+        /**
+         * Begins a phase of the profiler (if there is one) on construction,
+         * and ends it on destruction.
+         */
+        class Phase {
+            public:
+                Phase(RunProfiler* profiler, const std::string& name) : profiler_(profiler) {
+                    if (profiler_) { profiler_->begin(name); }
+                }
+                ~Phase() { end(); }
+                // End the phase before the end of the scope
+                void end() {
+                    if (profiler_) { profiler_->end(); }
+                    profiler_ = nullptr;
+                }
+            private:
+                RunProfiler* profiler_;
+        };
+
+        /**
+         * Write the phases (and the totals for the run so far) as JSON; a
+         * phase that is still open is reported up to now.
+         */
+        bool write(const boost::filesystem::path& path) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto now = timer_.elapsed();
+            std::ofstream out(path.string());
+            if (!out.good()) { return false; }
+            out << "{\n";
+            out << "    \"wall_sec\": " << seconds_(now.wall) << ",\n";
+            out << "    \"cpu_user_sec\": " << seconds_(now.user) << ",\n";
+            out << "    \"cpu_system_sec\": " << seconds_(now.system) << ",\n";
+            out << "    \"peak_rss_bytes\": " << peakRSSBytes() << ",\n";
+            for (auto& v : values_) {
+                out << "    \"" << escape_(v.first) << "\": " << v.second << ",\n";
+            }
+            if (hw_) {
+                hw_->writeRegions(out, "    ");
+                out << ",\n";
+            }
+            out << "    \"phases\": [";
+            bool first{true};
+            for (size_t i = 0; i < records_.size(); ++i) {
+                if (records_[i].parent < 0) {
+                    out << (first ? "\n" : ",\n");
+                    writeRecord_(out, i, 2, now);
+                    first = false;
+                }
+            }
+            out << (first ? "]\n" : "\n    ]\n");
+            out << "}\n";
+            return out.good();
+        }
+
+        // The peak resident set size of the process so far
+        static uint64_t peakRSSBytes() {
+            struct rusage usage;
+            if (getrusage(RUSAGE_SELF, &usage) != 0) { return 0; }
+#if defined(__APPLE__)
+            return static_cast<uint64_t>(usage.ru_maxrss);
+#else
+            return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+        }
+
+    private:
+        struct Record {
+            std::string name;
+            int64_t parent{-1};
+            boost::timer::cpu_times start;
+            boost::timer::cpu_times end;
+            uint64_t peakRSSBytes{0};
+            bool done{false};
+            std::vector<size_t> children;
+            std::vector<PerfCounts> hwStart;
+            std::vector<PerfCounts> hwCounts;
+        };
+
+        static double seconds_(boost::timer::nanosecond_type ns) { return ns * 1e-9; }
+
+        void writeRecord_(std::ofstream& out, size_t i, size_t depth,
+                          const boost::timer::cpu_times& now) {
+            auto& r = records_[i];
+            auto& end = r.done ? r.end : now;
+            std::string pad(4 * depth, ' ');
+            out << pad << "{\n";
+            out << pad << "    \"name\": \"" << escape_(r.name) << "\",\n";
+            out << pad << "    \"start_sec\": " << seconds_(r.start.wall) << ",\n";
+            out << pad << "    \"wall_sec\": " << seconds_(end.wall - r.start.wall) << ",\n";
+            out << pad << "    \"cpu_user_sec\": " << seconds_(end.user - r.start.user) << ",\n";
+            out << pad << "    \"cpu_system_sec\": " << seconds_(end.system - r.start.system) << ",\n";
+            out << pad << "    \"peak_rss_bytes\": " << (r.done ? r.peakRSSBytes : peakRSSBytes());
+            if (hw_) {
+                out << ",\n";
+                HardwareCounters::writeThreadCounts(out, r.done ? r.hwCounts : hw_->countsSince(r.hwStart),
+                                                    pad + "    ");
+            }
+            if (!r.children.empty()) {
+                out << ",\n" << pad << "    \"phases\": [\n";
+                for (size_t c = 0; c < r.children.size(); ++c) {
+                    if (c > 0) { out << ",\n"; }
+                    writeRecord_(out, r.children[c], depth + 2, now);
+                }
+                out << "\n" << pad << "    ]";
+            }
+            out << "\n" << pad << "}";
+        }
+
+        static std::string escape_(const std::string& s) {
+            std::string e;
+            for (char c : s) {
+                if (c == '"' or c == '\\') { e.push_back('\\'); }
+                e.push_back(c);
+            }
+            return e;
+        }
+
+        boost::timer::cpu_timer timer_;
+        std::vector<Record> records_;
+        std::vector<size_t> open_;
+        std::map<std::string, double> values_;
+        std::unique_ptr<HardwareCounters> hw_;
+        std::mutex mutex_;
+};
+
+#endif // __RUN_PROFILER_HPP__
@@ -0,0 +1,142 @@
+#ifndef __SALMON_API_HPP__
+#define __SALMON_API_HPP__
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+class SalmonIndex;
+class ReadExperiment;
+struct SalmonOpts;
+
+namespace spdlog {
+class logger;
+}
+
+namespace salmon {
+namespace api {
+
+/**
+ * The in-process interface to salmon quant, for services that embed salmon
+ * (link against the salmon_api library) rather than spawn it.  A Quantifier
+ * loads an index once and keeps it for any number of runs, and each run
+ * returns its abundances, equivalence classes and bootstrap (or Gibbs)
+ * replicates as arrays, rather than writing them to quant.sf, eq_classes.txt
+ * and bootstraps.gz to be parsed again.
+ *
+ *   salmon::api::Quantifier q("/data/index");
+ *   salmon::api::ReadBuffers reads;
+ *   reads.mates1.push_back(fastq1);
+ *   reads.mates2.push_back(fastq2);
+ *   salmon::api::QuantResult res;
+ *   int ret = q.quantify({"-l", "A", "-p", "8", "--numBootstraps", "30", "-o", "/tmp/s1"}, reads, res);
+ *
+ * The arguments are those of salmon quant, except for --index, which is the
+ * Quantifier's.  The output directory still receives the logs and the small
+ * metadata files (cmd_info.json, the aux directory, libFormatCounts.txt and
+ * libParams); --dumpEq, --writeMappings etc. keep their meaning.  Runs of
+ * one process must not overlap (salmon's loggers are global).  A run that
+ * salmon quant would end with an error (invalid arguments, unreadable input,
+ * ...) returns the exit status salmon quant would have had instead; only an
+ * error in one of the mapping threads still ends the process.
+ */
+
+/**
+ * The reads of a run, held in memory.  Each buffer is the text of a FASTA or
+ * FASTQ file (uncompressed); the i-th buffers of mates1 and mates2 are the
+ * two ends of the same fragments.  The buffers are streamed to the mapping
+ * threads through named pipes (made in the temporary directory for the run,
+ * and removed after it), so they are read once, as the reads of any FIFO are.
+ */
+struct ReadBuffers {
+    std::vector<std::string> mates1;
+    std::vector<std::string> mates2;
+    std::vector<std::string> unmated;
+};
+
+/**
+ * The equivalence classes of a run, in the layout of EquivalenceClassArena:
+ * the transcripts (and their conditional probability weights) of class i are
+ * entries [offsets[i], offsets[i + 1]) of labels (and weights).
+ */
+struct EquivalenceClasses {
+    std::vector<uint64_t> offsets;
+    std::vector<uint32_t> labels;
+    std::vector<double> weights;
+    std::vector<uint64_t> counts;
+};
+
+/**
+ * The output of a run; the i-th entry of each per-transcript array is the
+ * i-th transcript of the index (the i-th row of quant.sf).
+ */
+struct QuantResult {
+    std::vector<std::string> names;
+    std::vector<uint32_t> lengths;
+    std::vector<double> effectiveLengths;
+    std::vector<double> tpm;
+    std::vector<double> numReads;
+    EquivalenceClasses eqClasses;
+    // One replicate (of the estimated counts) per entry, if any were requested
+    std::vector<std::vector<double>> bootstraps;
+    uint64_t numObservedFragments{0};
+    uint64_t numMappedFragments{0};
+};
+
+class Quantifier {
+    public:
+        /**
+         * Load the index in indexDir (after checking it against its
+         * recorded checksums, if verify is true); throws
+         * std::runtime_error if it can't be loaded.
+         */
+        explicit Quantifier(const std::string& indexDir, bool verify = false);
+        ~Quantifier();
+
+        Quantifier(const Quantifier&) = delete;
+        Quantifier& operator=(const Quantifier&) = delete;
+
+        /**
+         * Quantify the reads given by the arguments (-1/-2/-r) and fill in
+         * result; returns the exit status salmon quant would have.
+         */
+        int quantify(const std::vector<std::string>& args, QuantResult& result);
+
+        /**
+         * Quantify the reads in the buffers (the arguments must not give
+         * any read files) and fill in result.
+         */
+        int quantify(const std::vector<std::string>& args, const ReadBuffers& reads,
+                     QuantResult& result);
+
+        /**
+         * Run salmon quant on the arguments, writing its usual output files
+         * (quant.sf etc.), but with the loaded index and without a process
+         * of its own.
+         */
+        int run(const std::vector<std::string>& args);
+
+        std::shared_ptr<SalmonIndex> index() { return index_; }
+
+    private:
+        int run_(const std::vector<std::string>& args, QuantResult* result);
+
+        std::string indexDir_;
+        std::shared_ptr<spdlog::logger> log_;
+        std::shared_ptr<SalmonIndex> index_;
+};
+
+namespace detail {
+/**
+ * Copy the abundances (as written to quant.sf) and the equivalence classes
+ * of a finished run to result; called by salmon quant when it runs for a
+ * Quantifier.
+ */
+void collectResults(const SalmonOpts& sopt, ReadExperiment& experiment, QuantResult& result);
+}
+
+} // namespace api
+} // namespace salmon
+
+#endif // __SALMON_API_HPP__
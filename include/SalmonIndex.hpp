@@ -8,11 +8,24 @@ extern "C" {
 #include "utils.h"
 }
 
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
 #include <memory>
+#include <thread>
+#include <vector>
 
 #include <boost/filesystem.hpp>
 #include <boost/range/irange.hpp>
 
+#include "tbb/blocked_range.h"
+#include "tbb/concurrent_unordered_map.h"
+#include "tbb/parallel_for.h"
+
 #include "spdlog/spdlog.h"
 #include "cereal/archives/json.hpp"
 #include "cereal/types/vector.hpp"
@@ -24,6 +37,9 @@ extern "C" {
 #include "SalmonConfig.hpp"
 #include "SalmonIndexVersionInfo.hpp"
 #include "KmerIntervalMap.hpp"
+#include "MappedBWAIndex.hpp"
+#include "SharedIndexSegment.hpp"
+#include "MemoryPlacement.hpp"
 
 extern "C" {
 int bwa_index(int argc, char* argv[]);
@@ -46,9 +62,20 @@ class SalmonIndex{
                 loaded_(false), versionInfo_(0, false, 0, indexType), logger_(logger) {}
 
             ~SalmonIndex() {
-                if (idx_) { bwa_idx_destroy(idx_); }
+                if (idx_) {
+                    mappedIdx_.release(idx_);
+                    bwa_idx_destroy(idx_);
+                }
             }
 
+            /**
+             * Load the mappable components of the (FMD) index through the
+             * shared index segment called name (see SharedIndexSegment),
+             * rather than mapping them from the files; must be called
+             * before load.
+             */
+            void useSharedSegment(const std::string& name) { shmName_ = name; }
+
             void load(const boost::filesystem::path& indexDir) {
                 namespace bfs = boost::filesystem;
 
@@ -93,35 +120,64 @@ class SalmonIndex{
                        size_t numRecords = idx_->bns->n_seqs;
                        { // Load transcripts from file
                           logger_->info("Index contained {} targets; streaming through them", numRecords);
-                          for (auto i : boost::irange(size_t(0), numRecords)) {
-                              char* name = idx_->bns->anns[i].name;
-                              uint32_t len = idx_->bns->anns[i].len;
-                              uint8_t* rseq = nullptr;
-                              int64_t tstart, tend, compLen, l_pac = idx_->bns->l_pac;
-                              tstart  = idx_->bns->anns[i].offset;
-                              tend = tstart + len;
-                              rseq = bns_get_seq(l_pac, idx_->pac, tstart, tend, &compLen);
-                              if (compLen != len) {
-                                  fmt::print(stderr,
-                                          "For transcript {}, stored length ({}) != computed length ({}) --- index may be corrupt. exiting\n",
-                                          name, compLen, len);
-                                  std::exit(1);
+                          // Decode the transcripts (in parallel)
+                          std::vector<uint8_t*> seqs(numRecords, nullptr);
+                          std::atomic<bool> lengthMismatch{false};
+                          tbb::parallel_for(tbb::blocked_range<size_t>(0, numRecords),
+                            [&](const tbb::blocked_range<size_t>& r) -> void {
+                              for (size_t i = r.begin(); i < r.end(); ++i) {
+                                  uint32_t len = idx_->bns->anns[i].len;
+                                  int64_t tstart, tend, compLen, l_pac = idx_->bns->l_pac;
+                                  tstart  = idx_->bns->anns[i].offset;
+                                  tend = tstart + len;
+                                  seqs[i] = bns_get_seq(l_pac, idx_->pac, tstart, tend, &compLen);
+                                  if (compLen != len) {
+                                      fmt::print(stderr,
+                                              "For transcript {}, stored length ({}) != computed length ({}) --- index may be corrupt. exiting\n",
+                                              idx_->bns->anns[i].name, compLen, len);
+                                      lengthMismatch = true;
+                                  }
                               }
-                              if (len < k) { continue; }
-                              for (uint32_t s = 0; s < len - k + 1; ++s) {
-                                  bwtintv_t resInterval;
-                                  KmerKey key(&(rseq[s]), k);
-                                  if (!auxIdx_.hasKmer(key)) {
-                                      bool foundInterval = bwautils::getIntervalForKmer(idx_->bwt, k, &(rseq[s]), resInterval);
-                                      // If we found the interval for this k-mer
-                                      if (foundInterval) {
-                                          // If the interval for this k-mer isn't already in the hash
-                                          // then put it in the hash
-                                          auxIdx_[key] = resInterval;
-                                      }
+                          });
+                          if (lengthMismatch) { std::exit(1); }
+
+                          // Collect the distinct k-mers, each with (a pointer to) one of
+                          // its occurrences.  Since any occurrence of a k-mer has the
+                          // same BWT interval, this finds the same intervals as looking
+                          // up the k-mers of each transcript in turn.
+                          using CandidateMap = tbb::concurrent_unordered_map<KmerKey, const uint8_t*,
+                                                                             KmerIntervalMap::KmerHasher>;
+                          CandidateMap candidates;
+                          tbb::parallel_for(tbb::blocked_range<size_t>(0, numRecords),
+                            [&](const tbb::blocked_range<size_t>& r) -> void {
+                              for (size_t i = r.begin(); i < r.end(); ++i) {
+                                  uint32_t len = idx_->bns->anns[i].len;
+                                  if (len < k) { continue; }
+                                  for (uint32_t s = 0; s < len - k + 1; ++s) {
+                                      candidates.insert(std::make_pair(KmerKey(&(seqs[i][s]), k),
+                                                                       static_cast<const uint8_t*>(&(seqs[i][s]))));
                                   }
                               }
+                          });
+
+                          // Look up the interval of each distinct k-mer (in parallel)
+                          std::vector<std::pair<KmerKey, const uint8_t*>> kmers(candidates.begin(), candidates.end());
+                          candidates.clear();
+                          std::vector<bwtintv_t> intervals(kmers.size());
+                          std::vector<uint8_t> found(kmers.size(), 0);
+                          tbb::parallel_for(tbb::blocked_range<size_t>(0, kmers.size()),
+                            [&](const tbb::blocked_range<size_t>& r) -> void {
+                              for (size_t i = r.begin(); i < r.end(); ++i) {
+                                  found[i] = bwautils::getIntervalForKmer(idx_->bwt, k, kmers[i].second,
+                                                                          intervals[i]) ? 1 : 0;
+                              }
+                          });
+                          for (size_t i = 0; i < kmers.size(); ++i) {
+                              // If we found the interval for this k-mer, put it in the hash
+                              if (found[i]) { auxIdx_[kmers[i].first] = intervals[i]; }
                           }
+
+                          for (auto seq : seqs) { free(seq); }
                           // Since we have the de-coded reference sequences, we no longer need
                           // the encoded sequences, so free them.
                           free(idx_->pac); idx_->pac = nullptr;
@@ -130,6 +186,10 @@ class SalmonIndex{
 
                        bfs::path auxIndexFile = indexDir / "aux.idx";
                        auxIdx_.save(auxIndexFile);
+                       if (!auxIdx_.saveMapped(indexDir / "aux.mm")) {
+                           logger_->warn("Couldn't write the mappable auxiliary index; "
+                                         "it will be loaded from {} instead", auxIndexFile);
+                       }
                        return true;
             }
 
@@ -161,7 +221,79 @@ class SalmonIndex{
             RapMapSAIndex<int32_t, PerfectHash<int32_t>>* quasiIndexPerfectHash32() { return quasiIndexPerfectHash32_.get(); }
             RapMapSAIndex<int64_t, PerfectHash<int64_t>>* quasiIndexPerfectHash64() { return quasiIndexPerfectHash64_.get(); }
 
+            /**
+             * The extensions of a quasi index (see salmon index --extend),
+             * which must be of the same type as the index; the transcripts
+             * of each extension are numbered after those of the index and of
+             * the extensions before it.  The argument only selects the type.
+             */
+            const std::vector<std::unique_ptr<RapMapSAIndex<int32_t, DenseHash<int32_t>>>>&
+                quasiExtensions(RapMapSAIndex<int32_t, DenseHash<int32_t>>*) { return quasiExtensions32_; }
+            const std::vector<std::unique_ptr<RapMapSAIndex<int64_t, DenseHash<int64_t>>>>&
+                quasiExtensions(RapMapSAIndex<int64_t, DenseHash<int64_t>>*) { return quasiExtensions64_; }
+            const std::vector<std::unique_ptr<RapMapSAIndex<int32_t, PerfectHash<int32_t>>>>&
+                quasiExtensions(RapMapSAIndex<int32_t, PerfectHash<int32_t>>*) { return quasiExtensionsPerfectHash32_; }
+            const std::vector<std::unique_ptr<RapMapSAIndex<int64_t, PerfectHash<int64_t>>>>&
+                quasiExtensions(RapMapSAIndex<int64_t, PerfectHash<int64_t>>*) { return quasiExtensionsPerfectHash64_; }
+
+            /**
+             * The directories holding the extensions of the quasi index in
+             * indexDir, in the order in which they were added.
+             */
+            static std::vector<boost::filesystem::path> quasiExtensionDirs(const boost::filesystem::path& indexDir) {
+                namespace bfs = boost::filesystem;
+                std::vector<bfs::path> dirs;
+                bfs::path extRoot = indexDir / "extensions";
+                if (!bfs::is_directory(extRoot)) { return dirs; }
+                for (bfs::directory_iterator it(extRoot), end; it != end; ++it) {
+                    if (bfs::is_directory(it->status())) { dirs.push_back(it->path()); }
+                }
+                // The extensions are named ext_000, ext_001, ...
+                std::sort(dirs.begin(), dirs.end());
+                return dirs;
+            }
+
+            /**
+             * Ask for the suffix arrays and text of the loaded quasi index
+             * (and its extensions) to be backed by transparent huge pages.
+             */
+            void adviseHugePages() {
+                if (versionInfo_.indexType() != SalmonIndexType::QUASI) { return; }
+                if (largeQuasi_) {
+                    if (perfectHashQuasi_) {
+                        adviseHugePages_(quasiIndexPerfectHash64_.get(), quasiExtensionsPerfectHash64_);
+                    } else {
+                        adviseHugePages_(quasiIndex64_.get(), quasiExtensions64_);
+                    }
+                } else {
+                    if (perfectHashQuasi_) {
+                        adviseHugePages_(quasiIndexPerfectHash32_.get(), quasiExtensionsPerfectHash32_);
+                    } else {
+                        adviseHugePages_(quasiIndex32_.get(), quasiExtensions32_);
+                    }
+                }
+            }
+
             bool hasAuxKmerIndex() { return versionInfo_.hasAuxKmerIndex(); }
+
+            /**
+             * The reference sequence (of the FMD index) containing position pos
+             * of the packed forward text, or -1 if there is none; the same as
+             * bns_pos2rid, but searching a contiguous copy of the offsets
+             * rather than striding through the annotations.  If pos is known
+             * to be near a position of reference guess (e.g. the other end of
+             * a seed), that is checked first.
+             */
+            inline int32_t refID(int64_t pos, int32_t guess = -1) const {
+                if (pos < 0 or pos >= idx_->bns->l_pac or refOffsets_.empty()) { return -1; }
+                int32_t n = static_cast<int32_t>(refOffsets_.size());
+                if (guess >= 0 and guess < n and pos >= refOffsets_[guess] and
+                    (guess + 1 == n or pos < refOffsets_[guess + 1])) {
+                    return guess;
+                }
+                auto it = std::upper_bound(refOffsets_.begin(), refOffsets_.end(), pos);
+                return static_cast<int32_t>(std::distance(refOffsets_.begin(), it)) - 1;
+            }
             KmerIntervalMap& auxIndex() { return auxIdx_; }
 
             SalmonIndexType indexType() { return versionInfo_.indexType(); }
@@ -205,6 +337,13 @@ class SalmonIndex{
                     const_cast<char*>(bwaArgVec[5].c_str()) };
                 int bwaArgc = 6;
                 int ret = bwa_index(bwaArgc, bwaArgv);
+                if (ret == 0) {
+                    // Lay out the suffix array samples so that quant can map them
+                    std::string err;
+                    if (!MappedBWAIndex::writeSA((indexDir / "bwaidx").string(), err)) {
+                        logger_->warn("{}; the index will be read into memory by quant", err);
+                    }
+                }
 
                 bool buildAux = (k > 0);
                 if (buildAux) {
@@ -251,12 +390,20 @@ class SalmonIndex{
 
           bool loadFMDIndex_(const boost::filesystem::path& indexDir) {
               namespace bfs = boost::filesystem;
+              if (!shmName_.empty()) { attachSharedSegment_(indexDir); }
               if (versionInfo_.hasAuxKmerIndex()) {
                   // Read the aux index
                   logger_->info("Loading auxiliary index");
                   bfs::path auxIdxFile = indexDir / "aux.idx";
                   auxIdx_.setK(versionInfo_.auxKmerLength());
-                  auxIdx_.load(auxIdxFile);
+                  // Share the mappable table, if the index has one, with the other processes using it
+                  bfs::path auxTableFile = indexDir / "aux.mm";
+                  size_t auxTableBytes{0};
+                  const char* auxTable = shmSegment_ ? shmSegment_->find("aux.mm", auxTableBytes) : nullptr;
+                  if (!(auxTable and auxIdx_.useMapped(auxTable, auxTableBytes)) and
+                      !(bfs::exists(auxTableFile) and auxIdx_.loadMapped(auxTableFile))) {
+                      auxIdx_.load(auxIdxFile);
+                  }
                   logger_->info("Auxiliary index contained {} k-mers", auxIdx_.size());
                   logger_->info("done");
               }
@@ -265,20 +412,161 @@ class SalmonIndex{
               // Read the actual BWA index
               { // mem-based
                   boost::filesystem::path indexPath = indexDir / "bwaidx";
-                  //if ((idx_ = bwa_idx_load(indexPath.string().c_str(), BWA_IDX_BWT|BWA_IDX_BNS|BWA_IDX_PAC)) == 0) {
-                  if ((idx_ = bwa_idx_load(indexPath.string().c_str(), BWA_IDX_ALL)) == 0) {
+                  // Map the BWT, suffix array and text, so that concurrent runs share them
+                  // through the page cache; indices built before the mappable suffix
+                  // array was written are read into memory
+                  if (shmSegment_) {
+                      std::string err;
+                      if ((idx_ = mappedIdx_.load(indexPath.string(), err, shmSegment_.get())) == nullptr) {
+                          logger_->warn("{}; mapping the BWA index from its files", err);
+                      }
+                  }
+                  if (idx_ == nullptr and MappedBWAIndex::hasMappableSA(indexPath.string())) {
+                      std::string err;
+                      if ((idx_ = mappedIdx_.load(indexPath.string(), err)) != nullptr) {
+                          logger_->info("Mapped {} bytes of the BWA index", mappedIdx_.mappedBytes());
+                      } else {
+                          logger_->warn("{}; reading the BWA index into memory", err);
+                      }
+                  }
+                  if (idx_ == nullptr and (idx_ = bwa_idx_load(indexPath.string().c_str(), BWA_IDX_ALL)) == 0) {
                       fmt::print(stderr, "Couldn't open index [{}] --- ", indexPath);
                       fmt::print(stderr, "Please make sure that 'salmon index' has been run successfully\n");
                       std::exit(1);
                   }
               }
+              refOffsets_.resize(idx_->bns->n_seqs);
+              for (int32_t i = 0; i < idx_->bns->n_seqs; ++i) {
+                  refOffsets_[i] = idx_->bns->anns[i].offset;
+              }
               logger_->info("done");
               return true;
           }
 
+          /**
+           * Attach to (loading, if this is the first process to use it) the
+           * shared segment holding the mappable components of the FMD index;
+           * if it can't be used, the index is loaded as usual.
+           */
+          void attachSharedSegment_(const boost::filesystem::path& indexDir) {
+              namespace bfs = boost::filesystem;
+              if (!MappedBWAIndex::hasMappableSA((indexDir / "bwaidx").string())) {
+                  logger_->warn("The index {} predates the mappable suffix array; it can't be shared "
+                                "through {}", indexDir.string(), shmName_);
+                  return;
+              }
+              std::vector<std::string> components{"bwaidx.bwt", std::string("bwaidx") + MappedBWAIndex::saSuffix(),
+                                                  "bwaidx.pac"};
+              if (versionInfo_.hasAuxKmerIndex() and bfs::exists(indexDir / "aux.mm")) {
+                  components.push_back("aux.mm");
+              }
+              auto start = std::chrono::steady_clock::now();
+              std::string err;
+              shmSegment_.reset(new SharedIndexSegment);
+              if (!shmSegment_->attach(shmName_, indexDir, components, err)) {
+                  logger_->warn("Not using the shared index segment: {}", err);
+                  shmSegment_.reset();
+                  return;
+              }
+              std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+              if (shmSegment_->loadedHere()) {
+                  logger_->info("Loaded {} bytes of the index into the shared segment {} ({:.2f} s)",
+                                shmSegment_->bytes(), shmSegment_->name(), elapsed.count());
+              } else {
+                  logger_->info("Attached to the shared index segment {} ({} bytes)",
+                                shmSegment_->name(), shmSegment_->bytes());
+              }
+          }
+
+          /**
+           * Read each of the component files of the quasi index (the suffix
+           * array, the k-mer hash, the transcript information and the text)
+           * on its own thread, so that their I/O overlaps while RapMap's
+           * loader deserializes them, one after another, from the page
+           * cache.  When the index lives on a network file system, the
+           * reads, rather than the deserialization, dominate the load time.
+           * The threads must be joined by the caller.
+           */
+          std::vector<std::thread> prefetchQuasiIndex_(const boost::filesystem::path& indexDir) {
+              namespace bfs = boost::filesystem;
+              std::vector<std::thread> readers;
+              for (bfs::directory_iterator it(indexDir), end; it != end; ++it) {
+                  if (!bfs::is_regular_file(it->status())) { continue; }
+                  auto ext = it->path().extension().string();
+                  if (ext == ".json") { continue; }
+                  bfs::path component = it->path();
+                  readers.emplace_back([this, component]() -> void {
+                      using Clock = std::chrono::steady_clock;
+                      auto start = Clock::now();
+                      int fd = ::open(component.string().c_str(), O_RDONLY);
+                      if (fd < 0) { return; }
+#if defined(POSIX_FADV_SEQUENTIAL)
+                      ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+                      constexpr size_t bufSize = 1 << 22;
+                      std::unique_ptr<char[]> buf(new char[bufSize]);
+                      size_t numBytes{0};
+                      ssize_t n{0};
+                      while ((n = ::read(fd, buf.get(), bufSize)) > 0) { numBytes += n; }
+                      ::close(fd);
+                      std::chrono::duration<double> elapsed = Clock::now() - start;
+                      logger_->info("read index component {} ({:.1f} MB) in {:.2f} s",
+                                    component.filename().string(),
+                                    numBytes / (1024.0 * 1024.0), elapsed.count());
+                  });
+              }
+              return readers;
+          }
+
+          template <typename RapMapIndexT>
+          void adviseHugePages_(RapMapIndexT* idx,
+                                std::vector<std::unique_ptr<RapMapIndexT>>& extensions) {
+              size_t numAdvised{0};
+              auto advise = [&numAdvised](RapMapIndexT* x) -> void {
+                  if (salmon::utils::adviseHugePages(x->SA)) { ++numAdvised; }
+                  if (salmon::utils::adviseHugePages(x->seq.data(), x->seq.size())) { ++numAdvised; }
+              };
+              if (idx) { advise(idx); }
+              for (auto& ext : extensions) { advise(ext.get()); }
+              logger_->info("requested huge pages for {} index arrays", numAdvised);
+          }
+
+          template <typename RapMapIndexT>
+          void loadQuasiExtensions_(const boost::filesystem::path& indexDir,
+                                    std::vector<std::unique_ptr<RapMapIndexT>>& extensions) {
+              for (auto& extDir : quasiExtensionDirs(indexDir)) {
+                  std::string extStr = extDir.string();
+                  if (extStr.back() != '/') { extStr.push_back('/'); }
+                  IndexHeader h;
+                  std::ifstream headerStream(extStr + "header.json");
+                  {
+                    cereal::JSONInputArchive ar(headerStream);
+                    ar(h);
+                  }
+                  headerStream.close();
+                  if (h.bigSA() != largeQuasi_ or h.perfectHash() != perfectHashQuasi_) {
+                      logger_->error("The index extension {} is not of the same type as the index "
+                                     "(64-bit suffix array: {} vs. {}, perfect hash: {} vs. {}); please "
+                                     "merge the extensions with salmon index --compact",
+                                     extStr, h.bigSA(), largeQuasi_, h.perfectHash(), perfectHashQuasi_);
+                      std::exit(1);
+                  }
+                  extensions.emplace_back(new RapMapIndexT);
+                  if (!extensions.back()->load(extStr)) {
+                      logger_->error("Couldn't open index extension [{}]", extStr);
+                      std::exit(1);
+                  }
+                  logger_->info("loaded index extension {} ({} targets)",
+                                extStr, extensions.back()->txpNames.size());
+              }
+          }
+
           bool loadQuasiIndex_(const boost::filesystem::path& indexDir) {
               namespace bfs = boost::filesystem;
+              using Clock = std::chrono::steady_clock;
               logger_->info("Loading Quasi index");
+              auto loadStart = Clock::now();
+              auto readers = prefetchQuasiIndex_(indexDir);
               // Read the actual Quasi index
               { // quasi-based
                   boost::filesystem::path indexPath = indexDir;
@@ -340,7 +628,22 @@ class SalmonIndex{
                     }
                   }
               }
-              logger_->info("done");
+              if (largeQuasi_) {
+                  if (perfectHashQuasi_) {
+                      loadQuasiExtensions_(indexDir, quasiExtensionsPerfectHash64_);
+                  } else {
+                      loadQuasiExtensions_(indexDir, quasiExtensions64_);
+                  }
+              } else {
+                  if (perfectHashQuasi_) {
+                      loadQuasiExtensions_(indexDir, quasiExtensionsPerfectHash32_);
+                  } else {
+                      loadQuasiExtensions_(indexDir, quasiExtensions32_);
+                  }
+              }
+              for (auto& t : readers) { t.join(); }
+              std::chrono::duration<double> loadTime = Clock::now() - loadStart;
+              logger_->info("done (loaded the quasi index in {:.2f} s)", loadTime.count());
               return true;
           }
 
@@ -358,7 +661,20 @@ class SalmonIndex{
           std::unique_ptr<RapMapSAIndex<int32_t, PerfectHash<int32_t>>> quasiIndexPerfectHash32_{nullptr};
           std::unique_ptr<RapMapSAIndex<int64_t, PerfectHash<int64_t>>> quasiIndexPerfectHash64_{nullptr};
 
+          std::vector<std::unique_ptr<RapMapSAIndex<int32_t, DenseHash<int32_t>>>> quasiExtensions32_;
+          std::vector<std::unique_ptr<RapMapSAIndex<int64_t, DenseHash<int64_t>>>> quasiExtensions64_;
+          std::vector<std::unique_ptr<RapMapSAIndex<int32_t, PerfectHash<int32_t>>>> quasiExtensionsPerfectHash32_;
+          std::vector<std::unique_ptr<RapMapSAIndex<int64_t, PerfectHash<int64_t>>>> quasiExtensionsPerfectHash64_;
+
           bwaidx_t *idx_{nullptr};
+          // The name of the shared segment to load the index through, and the segment, if
+          // it's attached (declared before its users, so that it outlives them)
+          std::string shmName_;
+          std::unique_ptr<SharedIndexSegment> shmSegment_{nullptr};
+          // The mapped arrays of idx_, if it was mapped (see MappedBWAIndex)
+          MappedBWAIndex mappedIdx_;
+          // The offset of each reference sequence of the FMD index in the packed text
+          std::vector<int64_t> refOffsets_;
           KmerIntervalMap auxIdx_;
           std::shared_ptr<spdlog::logger> logger_;
 };
@@ -31,6 +31,8 @@
 
 #include <cmath>
 #include <cassert>
+#include <cstddef>
+#include <algorithm>
 
 namespace salmon {
 
@@ -48,7 +50,7 @@ namespace salmon {
         }
 
         // Taken from https://github.com/adarob/eXpress/blob/master/src/main.h
-        inline double logAdd(double x, double y) {
+        inline double logAddExact(double x, double y) {
             if (std::abs(x) == LOG_0) { return y; }
             if (std::abs(y) == LOG_0) { return x; }
             if (y > x) { std::swap(x,y); }
@@ -57,7 +59,7 @@ namespace salmon {
         }
 
         // Taken from https://github.com/adarob/eXpress/blob/master/src/main.h
-        inline double logSub(double x, double y) {
+        inline double logSubExact(double x, double y) {
             if (std::abs(y) == LOG_0) { return x; }
             if (x <= y) {
                 assert(std::fabs(x-y) < 1e-5);
@@ -67,6 +69,146 @@ namespace salmon {
             return diff;
         }
 
+        namespace detail {
+            /**
+             * Tables of log(1 + exp(-d)) and log(1 - exp(-d)) (and of their
+             * derivatives) at every 1/32 of d in [0, 40], from which they
+             * are evaluated by cubic Hermite interpolation.  The absolute
+             * error is below 5e-10 for log(1 + exp(-d)), and below 2e-8 for
+             * log(1 - exp(-d)) with d >= 1 (for smaller d, logSubFast uses
+             * the exact expression).  Both are below 5e-18 beyond d = 40,
+             * where they are taken to be 0.  The tables take 40KB.
+             */
+            struct LogDiffTable {
+                static constexpr double invStep = 32.0;
+                static constexpr double maxDiff = 40.0;
+                static constexpr double minSubDiff = 1.0;
+                static constexpr size_t numNodes = 40 * 32 + 2;
+
+                LogDiffTable() {
+                    for (size_t i = 0; i < numNodes; ++i) {
+                        double d = i / invStep;
+                        double e = std::exp(-d);
+                        add[i] = std::log1p(e);
+                        addDeriv[i] = -e / (1.0 + e);
+                        sub[i] = (i == 0) ? 0.0 : std::log1p(-e);
+                        subDeriv[i] = (i == 0) ? 0.0 : e / (1.0 - e);
+                    }
+                }
+
+                static inline double interpolate(const double* f, const double* df, double d) {
+                    double pos = d * invStep;
+                    size_t i = static_cast<size_t>(pos);
+                    double t = pos - i;
+                    double t2 = t * t;
+                    double t3 = t2 * t;
+                    double h = 1.0 / invStep;
+                    return (2*t3 - 3*t2 + 1) * f[i] + (t3 - 2*t2 + t) * h * df[i] +
+                        (-2*t3 + 3*t2) * f[i+1] + (t3 - t2) * h * df[i+1];
+                }
+
+                static const LogDiffTable& get() {
+                    static const LogDiffTable table;
+                    return table;
+                }
+
+                double add[numNodes];
+                double addDeriv[numNodes];
+                double sub[numNodes];
+                double subDeriv[numNodes];
+            };
+        }
+
+        // logAddExact, with log(1 + exp(y - x)) interpolated from a table
+        inline double logAddFast(double x, double y) {
+            if (std::abs(x) == LOG_0) { return y; }
+            if (std::abs(y) == LOG_0) { return x; }
+            if (y > x) { std::swap(x,y); }
+            double d = x - y;
+            if (d >= detail::LogDiffTable::maxDiff) { return x; }
+            auto& table = detail::LogDiffTable::get();
+            return x + detail::LogDiffTable::interpolate(table.add, table.addDeriv, d);
+        }
+
+        // logSubExact, with log(1 - exp(y - x)) interpolated from a table
+        // (unless y is within 1 of x)
+        inline double logSubFast(double x, double y) {
+            if (std::abs(y) == LOG_0) { return x; }
+            double d = x - y;
+            if (d < detail::LogDiffTable::minSubDiff) { return logSubExact(x, y); }
+            if (d >= detail::LogDiffTable::maxDiff) { return x; }
+            auto& table = detail::LogDiffTable::get();
+            return x + detail::LogDiffTable::interpolate(table.sub, table.subDeriv, d);
+        }
+
+        // The log-space sum and difference used throughout; these are the
+        // table-driven versions if salmon is built with -DFAST_LOG_MATH=ON
+        // (SALMON_FAST_LOG_MATH), and the exact ones otherwise.
+        inline double logAdd(double x, double y) {
+#ifdef SALMON_FAST_LOG_MATH
+            return logAddFast(x, y);
+#else
+            return logAddExact(x, y);
+#endif
+        }
+
+        inline double logSub(double x, double y) {
+#ifdef SALMON_FAST_LOG_MATH
+            return logSubFast(x, y);
+#else
+            return logSubExact(x, y);
+#endif
+        }
+
+        // out[i] = logAdd(x[i], y[i]) for each of the n elements (out may
+        // be x or y).
+        inline void logAddBatch(const double* x, const double* y, double* out, size_t n) {
+            for (size_t i = 0; i < n; ++i) { out[i] = logAdd(x[i], y[i]); }
+        }
+
+        // Returns log(exp(x[0]) + ... + exp(x[n-1])) for the n (finite)
+        // log-space values in x.  This is equivalent to folding the values
+        // with logAdd, but requires only a single std::log; the max and the
+        // sum of exponentials are plain reductions over contiguous memory,
+        // which the compiler is free to vectorize.
+        inline double logSumExp(const double* x, size_t n) {
+            if (n == 0) { return LOG_0; }
+            double maxVal = x[0];
+            for (size_t i = 1; i < n; ++i) { maxVal = std::max(maxVal, x[i]); }
+            double sum{0.0};
+            for (size_t i = 0; i < n; ++i) { sum += std::exp(x[i] - maxVal); }
+            return maxVal + std::log(sum);
+        }
+
+        // The digamma function, psi(x), for x > 0.  The argument is shifted
+        // up to at least 10 with the recurrence psi(x) = psi(x + 1) - 1/x,
+        // and the asymptotic expansion of psi is then used; the error
+        // (relative, or absolute where |psi(x)| < 1) is below ~1e-13.
+        inline double digamma(double x) {
+            double result{0.0};
+            while (x < 10.0) {
+                result -= 1.0 / x;
+                x += 1.0;
+            }
+            double r = 1.0 / x;
+            double r2 = r * r;
+            result += std::log(x) - 0.5 * r -
+                r2 * (1.0/12.0 - r2 * (1.0/120.0 - r2 * (1.0/252.0 -
+                r2 * (1.0/240.0 - r2 * (1.0/132.0)))));
+            return result;
+        }
+
+        // exp(psi(x)) for x > 0.  For x >= 10, the asymptotic expansion of
+        // exp(psi(x)) in 1/x is evaluated directly (requiring neither a log
+        // nor an exp), and is accurate to a relative error below ~1e-11;
+        // otherwise, this is exp(digamma(x)).
+        inline double expDigamma(double x) {
+            if (x < 10.0) { return std::exp(digamma(x)); }
+            double r = 1.0 / x;
+            return x - 0.5 + r * (1.0/24.0 + r * (1.0/48.0 + r * (23.0/5760.0 +
+                r * (-17.0/3840.0 + r * (-10099.0/2903040.0 + r * (2501.0/1161216.0))))));
+        }
+
 
     }
 
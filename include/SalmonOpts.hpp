@@ -7,7 +7,17 @@
 #include "spdlog/spdlog.h"
 
 #include <memory> // for shared_ptr
-
+#include <string>
+#include <vector>
+
+class AbundanceSnapshotWriter;
+class BootstrapCheckpoint;
+class MappingConvergenceMonitor;
+class MappingSAMWriter;
+class ReadTrimmer;
+class RunProfiler;
+class UnmappedNameWriter;
+namespace salmon { namespace metrics { class Registry; } }
 
 /**
   * A structure to hold some common options used
@@ -36,6 +46,30 @@ struct SalmonOpts {
     std::string auxDir; // The directory where auxiliary files will be written.
 
     bool dumpEq; 	     // Dump the equivalence classes and counts to file
+    bool dumpEqBinary{false}; // Dump them in the binary layout of BinaryEquivalenceClasses.hpp rather than as text
+    std::string eqLabelDictPath; // If non-empty, dump them by the ids of their labels in this EqLabelDictionary
+    bool asyncOutput{false}; // Write the equivalence classes and quant.sf on a background thread
+    bool profile{false}; // Record the time and memory of each phase of the run in aux/profile.json
+    bool perfCounters{false}; // Also record the hardware performance counters of the phases and threads
+    std::shared_ptr<RunProfiler> profiler{nullptr}; // The profiler of the run, if profile (or metricsPort) is set
+    uint32_t metricsPort{0}; // Serve the live metrics of the run over HTTP on this port (0 = don't)
+    std::string metricsAddress; // The address on which the metrics are served
+    std::shared_ptr<salmon::metrics::Registry> metrics{nullptr}; // The live metrics of the run, if metricsPort is set
+    bool threadLocalEqClasses; // Accumulate equivalence classes per-thread and merge them once per mini-batch
+    bool threadLocalModelUpdates{false}; // Stage the alignment model updates per-thread and merge them once per mini-batch
+    bool threadLocalTranscriptUpdates{false}; // Sum the transcript mass / count updates per-thread and apply them once per mini-batch
+
+    bool pipelineMiniBatches; // Assign each mini-batch in a TBB task while the next one is being mapped
+    uint32_t numInferenceThreads{0}; // Threads that assign the mapped mini-batches, so that the mapping threads only map
+
+    bool hugePages{false}; // Back the index and equivalence class arrays with transparent huge pages
+    bool numaInterleave{false}; // Interleave the pages of the index (and other data) across the NUMA nodes
+    bool releaseIndex{false}; // Free the index once the mapping pass is done
+    bool pinThreads{false}; // Pin each mapping thread (and each thread of the shared task arena) to its own CPU
+    bool concurrentLibraries{false}; // Map several read libraries at once, each with its own slice of the threads
+
+    bool verifyIndex{false}; // Check the index against its recorded checksums before loading it
+    std::string shmIndex; // Load the (FMD) index once per machine into this named shared-memory segment (or hugetlbfs file)
 
     bool splitSpanningSeeds; // Attempt to split seeds that span multiple transcripts.
 
@@ -70,6 +104,9 @@ struct SalmonOpts {
 
     bool useErrorModel; // Learn and apply the error model when computing the likelihood
                         // of a given alignment.
+    double errorModelSampleRate{1.0}; // The fraction of the single-alignment fragments that train the error model during burn-in
+    std::string umiTag; // The BAM tag of the UMIs by which to deduplicate the equivalence classes (if any)
+    bool umiCollapse{false}; // Merge the UMIs (of a class) one substitution away from a more frequent one
 
     uint32_t numErrorBins; // Number of bins into which each read is divided
                            // when learning and applying the error model.
@@ -88,18 +125,55 @@ struct SalmonOpts {
 
     uint64_t numRequiredFragments; //
 
+    bool stopOnConvergence{false}; // Stop mapping once the online estimates and the equivalence classes converge
+    double convergenceTolerance{1e-3}; // The change in the estimates (and classes) between checks below which they've converged
+    uint64_t convergenceInterval{1000000}; // The number of fragments between convergence checks
+    uint64_t maxFragments{0}; // If non-zero, map at most this many fragments (a subsample of the input)
+    bool extrapolate{false}; // Count the fragments left once mapping stops, and scale the estimates to them
+    std::shared_ptr<MappingConvergenceMonitor> convergenceMonitor{nullptr}; // The monitor of the mapping pass, if it may stop early
+    uint64_t snapshotInterval{0}; // If non-zero, the number of fragments between snapshots of the abundances while mapping
+    uint32_t snapshotEMRounds{100}; // The most rounds of the EM run for each snapshot
+    std::shared_ptr<AbundanceSnapshotWriter> snapshotWriter{nullptr}; // The writer of the snapshots, while mapping, if any
+
     uint32_t gcSampFactor; // The factor by which to down-sample the GC distribution of transcripts
     uint32_t pdfSampFactor; // The factor by which to down-sample the fragment length pmf when
                             // evaluating gc-bias for effective length correction.
 
     bool strictIntersect; // Use strict rather than fuzzy intersection in quasi-mapping
+    uint32_t mateVerifyMaxHits{0}; // Check the right mate against the left mate's hits, if it has at most this many (0 = never)
     bool useMassBanking; // DEPRECATED
 
     bool sensitive; // Perform splitting of long SMEMs into MEMs
 
     bool extraSeedPass; // Perform extra pass trying to find seeds to cover the read
 
-    bool disableMappingCache; // Don't write mapping results to temporary mapping cache file
+    uint32_t smemBatchWidth{0}; // If non-zero, find the SMEMs (FMD index) of this many reads at once, interleaving their BWT accesses
+
+    bool useMappingCache; // Write quasi-mappings to the mapping cache, and replay them in later passes
+
+    uint32_t readHitCacheSize{0}; // The number of read sequences whose hits each mapping thread caches (0 disables it)
+
+    std::string mappingOutputPath; // If non-empty, write the quasi-mappings to this SAM file ("-" for stdout)
+    std::shared_ptr<MappingSAMWriter> mappingWriter{nullptr}; // The writer of the quasi-mappings, if any
+    bool writePosteriors{false}; // Write the posterior assignment probabilities of the fragments to aux/posteriors.gz
+    bool writeUnmappedNames{false}; // Write the names of the fragments that weren't mapped to aux/unmapped_names.gz
+    std::shared_ptr<UnmappedNameWriter> unmappedNameWriter{nullptr}; // The writer of those names, if any
+    std::vector<std::string> trimAdapters; // The 3' adapters to trim from the reads before mapping them
+    uint32_t trimQuality{0}; // Cut the reads at the first window whose mean quality is below this (0 = don't)
+    uint32_t trimWindow{4}; // The width of the quality-trimming window
+    uint32_t trimPolyA{0}; // Trim poly-A tails (and poly-T heads) at least this long (0 = don't)
+    std::shared_ptr<ReadTrimmer> readTrimmer{nullptr}; // The trimmer of the reads, if any trimming was asked for
+
+    bool singlePass{false}; // Never re-read the reads; replay the pre-burn-in mappings from the mapping cache instead
+    bool mapOnly{false}; // Stop after the mapping pass, and write its state (see ShardState.hpp) to <output>/shard
+    bool onlineOnly{false}; // Report the online estimates of the mapping pass, without building the equivalence classes or running the EM
+    bool geneLevelOnly{false}; // Collapse the equivalence classes to genes (given --geneMap) and run the EM over the genes
+    std::string inferStatePath; // If set, estimate the abundances from the state in this directory rather than mapping reads
+    std::string extendStatePath; // If set, add the reads to the state (see --saveState) in this directory, and quantify them together
+    bool saveState{false}; // Write the state of the run, with its estimates, to <output>/shard
+    bool checkpoint{false}; // Checkpoint the mapping pass and each bootstrap replicate to <output>/checkpoint
+    bool resume{false}; // Resume from the checkpoints (in <output>/checkpoint) of an interrupted run
+    std::shared_ptr<BootstrapCheckpoint> bootstrapCheckpoint{nullptr}; // The record of finished replicates, if checkpointing
 
     boost::filesystem::path outputDirectory; // Quant output directory
 
@@ -107,13 +181,53 @@ struct SalmonOpts {
 
     bool useVBOpt; // Use Variational Bayesian EM instead of "regular" EM in the batch passes
 
+    bool useSQUAREM; // Accelerate the (non-VB) EM in the batch passes with SQUAREM
+
+    bool threadLocalEMBuffers; // Accumulate the parallel EM updates in per-thread buffers rather than atomically
+    bool deterministic{false}; // Make the offline estimates independent of the number of threads (fixed-order reductions)
+
+    bool componentEM; // Run the (non-VB) EM independently on each connected component of the eq. class graph
+
+    bool activeSetEM; // Drop the transcripts of (near) zero abundance from most of the (non-VB) EM rounds
+
+    bool mixedPrecisionEM; // Store the eq. class weights used by the EM / VBEM in single precision
+
+    bool useGPU{false}; // Run the EM / VBEM rounds and the bootstrap replicates on a CUDA device
+
+    std::string initialAbundanceFile; // A quant.sf from a previous run used to initialize the optimizer
+
+    bool bootstrapFromPointEstimate; // Start each bootstrap replicate from the point estimate rather than uniformly
+
+    double biasUpdateTolerance; // Relative change in weight below which a transcript's bias contribution is not re-computed
+
+    bool asyncBiasUpdate{false}; // Recompute the effective lengths in the background while the EM rounds continue
+
     bool useQuasi; // Are we using the quasi-mapping based index or not.
 
     bool sampleOutput; // Sample alignments according to posterior estimates of transcript abundance.
     bool sampleUnaligned; // Pass along un-aligned reads in the sampling.
 
     uint32_t numGibbsSamples; // Number of rounds of Gibbs sampling to perform
-    uint32_t numBootstraps; // Number of bootstrap samples to draw
+    uint32_t numGibbsChains; // Number of independent Gibbs chains to run in parallel (0 = one per thread)
+    uint32_t gibbsBurnin; // Number of rounds discarded at the start of each Gibbs chain
+    uint32_t gibbsThinningFactor; // Number of rounds of each Gibbs chain per recorded sample
+    uint32_t numBootstraps; // Number of bootstrap samples to draw (once drawn adaptively, the number drawn)
+    bool adaptiveBootstraps{false}; // Stop drawing bootstraps once the variances of the expressed transcripts settle
+    uint32_t minBootstraps{20}; // The fewest adaptive bootstraps drawn
+    double bootstrapVarianceTolerance{0.05}; // The relative change in variance below which adaptive bootstraps stop
+    uint32_t maxBootstraps{0}; // The --numBootstraps requested, with --adaptiveBootstraps
+
+    uint32_t bootstrapBatchSize; // Number of bootstrap replicates optimized together by each thread
+    uint32_t numBootstrapWriters; // Number of threads compressing bootstrap replicates (0 = compress on the sampling threads)
+    int bootstrapCompressionLevel; // gzip compression level of the bootstrap replicates
+    bool summarizeSamples; // Write per-transcript summaries of the bootstrap / Gibbs replicates
+    bool noSampleReplicates; // Don't write bootstraps.gz (if the replicates are summarized or written in columns)
+    bool columnarBootstraps; // Also write the replicates in the transcript-major layout of ColumnarBootstraps.hpp
+    bool binaryQuant{false}; // Also write the abundances to quant.bin, in the layout of BinaryQuant.hpp
+    bool expandDuplicates{false}; // Report the transcripts collapsed at index build (see DuplicateTranscripts.hpp) in quant.sf
+
+    bool haveSeed{false}; // True if the user provided a seed for the random number generators
+    uint64_t seed{0}; // The seed from which the streams of random numbers are derived (see RandomStreams.hpp)
 
     bool alnMode{false};     // true if we're in alignment based mode, false otherwise
     bool biasCorrect{false}; // Perform sequence-specific bias correction
@@ -132,9 +246,22 @@ struct SalmonOpts {
 
     // Related to caching and threading
     uint32_t mappingCacheMemoryLimit;
+    bool noCompactAlignmentCache{false}; // Re-read the alignment file, rather than using an AlignmentCache, when it is too large to keep in memory
+    uint64_t alignmentCacheMemoryBytes{1073741824}; // Bytes of the AlignmentCache kept in memory before it spills to disk
+    uint64_t maxMemory{0}; // The budget (in bytes) from which the buffers below are sized (0 = their defaults)
+    uint32_t numParserJobs{0}; // The number of jobs (mini-batches of reads) the parser fills ahead (0 = 4 per thread)
+    size_t eqClassReserve{1000000}; // The number of equivalence classes reserved for up front
+    size_t eqClassSpillClasses{0}; // Spill the equivalence classes to disk whenever the table holds this many (0 = never)
+    double eqClassMergeTolerance{0.0}; // Merge the rich classes whose normalized weights are within this L1 distance (0 = never)
+    uint64_t minEqClassCount{0}; // Fold the classes of fewer fragments into their nearest neighbours (0 = never)
+    uint32_t alignmentPoolSize{2000000}; // The number of fragments (and alignment groups) the BAM parser preallocates
+    uint64_t readaheadBytes{0}; // The bytes of each input file read ahead of its parser by an I/O thread (0 = none)
     uint32_t numThreads;
     uint32_t numQuantThreads;
+    bool adaptiveThreads{false}; // Rebalance the threads between parsing and quantification at runtime (alignment mode)
     uint32_t numParseThreads;
+    bool pipelineBAMParsing{false}; // Decode the BAM records and assemble the alignment groups on separate threads
+    bool coordinateSorted{false}; // The alignment files are sorted by coordinate rather than grouped by read
 };
 
 #endif // SALMON_OPTS_HPP
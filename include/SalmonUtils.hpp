@@ -34,6 +34,7 @@ extern "C" {
 class ReadExperiment;
 class LibraryFormat;
 class FragmentLengthDistribution;
+class Transcript;
 
 namespace salmon{
 namespace utils {
@@ -49,6 +50,8 @@ using MateStatus = rapmap::utils::MateStatus;
 struct ShortFragStats {
     size_t numTooShort{0};
     size_t shortest{std::numeric_limits<size_t>::max()};
+    // The fragments discarded for mapping to more than --maxReadOcc places
+    size_t numTooManyHits{0};
 };
 
 // An enum class for direction to avoid potential errors
@@ -95,12 +98,47 @@ TranscriptGeneMap readTranscriptToGeneMap( std::ifstream &ifile );
 
 TranscriptGeneMap transcriptToGeneMapFromFasta( const std::string& transcriptsFile );
 
+/**
+ * State carried between the successive calls of updateEffectiveLengths
+ * made during a single optimization.  The expected (transcriptome-wide)
+ * bias distributions are linear in the weight (alpha / effective length)
+ * of each transcript, so rather than being recomputed from scratch, they
+ * are updated by the change in the contribution of each transcript whose
+ * weight changed.  Transcripts whose weight changed by a relative amount
+ * of at most `relTolerance` are not re-scanned, and keep their previous
+ * contribution (a tolerance of 0 gives the same result as a full update).
+ */
+struct EffectiveLengthCache {
+    EffectiveLengthCache(double relToleranceIn) : relTolerance(relToleranceIn) {}
+
+    double relTolerance;
+    // The weight with which each transcript contributes to the distributions
+    std::vector<double> weights;
+    // The current expected sequence-specific and GC distributions
+    std::vector<double> expectSeq;
+    std::vector<double> expectGC;
+};
+
+// The expected (transcriptome-wide) sequence-specific and GC bias distributions
+struct ExpectedBiasDists {
+    std::vector<double> seq;
+    std::vector<double> gc;
+};
+
+/**
+ * Recompute the bias-corrected effective lengths for the abundances alphas.
+ * The expected bias distributions they're computed from are stored in
+ * expectedOut if it's given (so that a computation whose result may be
+ * dropped leaves readExp as it was), and otherwise in readExp.
+ */
 template <typename AbundanceVecT, typename ReadExpT>
 Eigen::VectorXd updateEffectiveLengths(
         SalmonOpts& sopt,
         ReadExpT& readExp,
         Eigen::VectorXd& effLensIn,
-        AbundanceVecT& alphas);
+        AbundanceVecT& alphas,
+        EffectiveLengthCache* cache = nullptr,
+        ExpectedBiasDists* expectedOut = nullptr);
 
 /*
  * Use atomic compare-and-swap to update val to
@@ -146,13 +184,59 @@ inline void incLoop(tbb::atomic<double>& val, double inc) {
 
 void aggregateEstimatesToGeneLevel(TranscriptGeneMap& tgm, boost::filesystem::path& inputPath);
 
-std::vector<int32_t> samplesFromLogPMF(FragmentLengthDistribution* fld, int32_t numSamples);
+/**
+ * Read the given column of a quant.sf file (written by a previous run)
+ * into `values`, keyed by transcript name.  Returns false, with a message
+ * (naming the file and, for a malformed value, the line) in err, if the
+ * file can not be read, has no such column, or has a value in it that
+ * isn't a finite number.
+ */
+bool readQuantColumn(const boost::filesystem::path& quantFile, const std::string& column,
+                     std::unordered_map<std::string, double>& values, std::string& err);
+
+// readQuantColumn for the NumReads column
+bool readNumReads(const boost::filesystem::path& quantFile,
+                  std::unordered_map<std::string, double>& numReads, std::string& err);
+
+std::vector<int32_t> samplesFromLogPMF(FragmentLengthDistribution* fld, int32_t numSamples,
+                                       uint32_t seed);
 
 // NOTE: Throws an invalid_argument exception of the quant or quant_bias_corrected files do
 // not exist!
 void generateGeneLevelEstimates(boost::filesystem::path& geneMapPath,
                                 boost::filesystem::path& estDir);
 
+/**
+ * Aggregate the abundances of `transcripts`, as written to quant.sf by
+ * GZipWriter::writeAbundances (from their projectedCounts and
+ * EffectiveLength, and numMappedFrags), to the gene level, and write them
+ * to outputPath; quant.sf itself is not re-read.  Transcripts missing
+ * from the map are reported as their own genes.
+ */
+void aggregateEstimatesToGeneLevel(TranscriptGeneMap& tgm,
+                                   const std::vector<Transcript>& transcripts,
+                                   double numMappedFrags,
+                                   const boost::filesystem::path& outputPath);
+
+/**
+ * As above, but from the in-memory abundances of the transcripts, which
+ * are written to estDir/quant.genes.sf.
+ */
+void generateGeneLevelEstimates(boost::filesystem::path& geneMapPath,
+                                boost::filesystem::path& estDir,
+                                const std::vector<Transcript>& transcripts,
+                                double numMappedFrags);
+
+/**
+ * The gene of each transcript under the map at geneMapPath (a GTF file or
+ * a two-column transcript / gene table), as an index into geneNames,
+ * which is filled with the names of the genes of the transcripts (only).
+ * Transcripts missing from the map are their own genes.
+ */
+std::vector<uint32_t> transcriptGeneIDs(boost::filesystem::path& geneMapPath,
+                                        const std::vector<Transcript>& transcripts,
+                                        std::vector<std::string>& geneNames);
+
     enum class OrphanStatus: uint8_t { LeftOrphan = 0, RightOrphan = 1, Paired = 2 };
 
     bool headersAreConsistent(SAM_hdr* h1, SAM_hdr* h2);
@@ -184,6 +268,44 @@ void generateGeneLevelEstimates(boost::filesystem::path& geneMapPath,
     bool compatibleHit(const LibraryFormat expected, int32_t start, bool isForward, MateStatus ms);
     bool compatibleHit(const LibraryFormat expected, const LibraryFormat observed);
 
+    /**
+     * logAlignFormatProb for a fixed expected library format and
+     * incompatPrior, precomputed for each (mate status, strand) of a
+     * single-end read or orphan, and for each observed format of a mapped
+     * pair, so that scoring an alignment costs a single load rather than
+     * the branches of compatibleHit (the start position never matters).
+     */
+    class AlignFormatProbs {
+        public:
+            AlignFormatProbs(const LibraryFormat& expected, double incompatPrior) {
+                std::fill(single_, single_ + numSingleSlots_, incompatPrior);
+                for (auto ms : {MateStatus::SINGLE_END, MateStatus::PAIRED_END_LEFT, MateStatus::PAIRED_END_RIGHT}) {
+                    for (bool fwd : {false, true}) {
+                        single_[singleSlot_(ms, fwd)] =
+                            compatibleHit(expected, 0, fwd, ms) ? salmon::math::LOG_1 : incompatPrior;
+                    }
+                }
+                for (size_t id = 0; id <= LibraryFormat::maxLibTypeID(); ++id) {
+                    auto observed = LibraryFormat::formatFromID(static_cast<uint8_t>(id));
+                    paired_[id] = compatibleHit(expected, observed) ? salmon::math::LOG_1 : incompatPrior;
+                }
+            }
+
+            inline double operator()(const LibraryFormat& observed, bool isForward, MateStatus ms) const {
+                return (ms == MateStatus::PAIRED_END_PAIRED) ?
+                    paired_[observed.formatID()] : single_[singleSlot_(ms, isForward)];
+            }
+
+        private:
+            static constexpr size_t numSingleSlots_ = 8;
+            static inline size_t singleSlot_(MateStatus ms, bool isForward) {
+                return ((static_cast<size_t>(ms) & 0x3) << 1) | (isForward ? 1 : 0);
+            }
+
+            double single_[numSingleSlots_];
+            double paired_[LibraryFormat::maxLibTypeID() + 1];
+    };
+
     std::ostream& operator<<(std::ostream& os, OrphanStatus s);
     /**
     *  Given the information about the position and strand from which a paired-end
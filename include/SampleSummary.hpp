@@ -0,0 +1,87 @@
+#ifndef __SAMPLE_SUMMARY_HPP__
+#define __SAMPLE_SUMMARY_HPP__
+
+#include <cstdint>
+#include <fstream>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "TDigest.hpp"
+
+/**
+ * Per-transcript summaries of the bootstrap (or Gibbs) replicates, which
+ * are updated as each replicate is drawn, so that the replicates
+ * themselves need not be kept.  The mean and variance are accumulated with
+ * Welford's method, and the quantiles are estimated from a t-digest.
+ * Replicates may be added concurrently from several threads.
+ */
+class SampleSummary {
+    public:
+        // Without quantiles, only the mean and variance are accumulated
+        SampleSummary(size_t numTranscripts, bool withQuantiles = true) :
+            mean_(numTranscripts, 0.0),
+            m2_(numTranscripts, 0.0),
+            digests_(withQuantiles ? numTranscripts : 0) {}
+
+        template <typename T>
+        void add(const std::vector<T>& sample) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++numSamples_;
+            double n = static_cast<double>(numSamples_);
+            size_t numTxps = std::min(sample.size(), mean_.size());
+            for (size_t i = 0; i < numTxps; ++i) {
+                double x = static_cast<double>(sample[i]);
+                double delta = x - mean_[i];
+                mean_[i] += delta / n;
+                m2_[i] += delta * (x - mean_[i]);
+                if (!digests_.empty()) { digests_[i].add(x); }
+            }
+        }
+
+        uint64_t numSamples() const { return numSamples_; }
+        double mean(size_t i) const { return mean_[i]; }
+        double variance(size_t i) const {
+            return (numSamples_ > 1) ? m2_[i] / (numSamples_ - 1) : 0.0;
+        }
+
+        /**
+         * Write the summaries as a tab-separated file with one row per
+         * transcript: the name, mean, (sample) variance and the estimated
+         * quantiles of the replicates.
+         */
+        bool write(const boost::filesystem::path& path,
+                   const std::vector<std::string>& names) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            std::ofstream out(path.string());
+            if (!out.good()) { return false; }
+            out.precision(std::numeric_limits<double>::digits10);
+
+            const std::vector<double> quantiles{0.025, 0.25, 0.5, 0.75, 0.975};
+            out << "Name\tMean\tVariance";
+            for (auto q : quantiles) { out << "\tQ" << q * 100.0; }
+            out << '\n';
+
+            for (size_t i = 0; i < mean_.size(); ++i) {
+                out << ((i < names.size()) ? names[i] : std::to_string(i)) << '\t'
+                    << mean_[i] << '\t' << variance(i);
+                for (auto q : quantiles) {
+                    out << '\t' << (digests_.empty() ? 0.0 : digests_[i].quantile(q));
+                }
+                out << '\n';
+            }
+            return out.good();
+        }
+
+    private:
+        std::mutex mutex_;
+        uint64_t numSamples_{0};
+        std::vector<double> mean_;
+        std::vector<double> m2_;
+        std::vector<TDigest> digests_;
+};
+
+#endif //__SAMPLE_SUMMARY_HPP__
@@ -55,6 +55,7 @@ extern "C" {
 #include "SalmonConfig.hpp"
 #include "SalmonOpts.hpp"
 #include "OutputUnmappedFilter.hpp"
+#include "RandomStreams.hpp"
 
 namespace salmon {
     namespace sampler {
@@ -71,8 +72,10 @@ namespace salmon {
         template <typename FragT>
             using MiniBatchQueue = tbb::concurrent_queue<MiniBatchInfo<FragT>*>;
 
+        // The sampled alignments are passed to the writer in batches (one per
+        // mini-batch of each sampler), rather than one at a time
         template <typename FragT>
-            using OutputQueue = tbb::concurrent_bounded_queue<FragT*>;
+            using OutputQueue = tbb::concurrent_bounded_queue<std::vector<FragT*>*>;
 
         template <typename FragT>
         void sampleMiniBatch(AlignmentLibrary<FragT>& alnLib,
@@ -86,12 +89,12 @@ namespace salmon {
                     std::atomic<size_t>& processedReads,
                     OutputQueue<FragT>& outputQueue) {
 
-                // Seed with a real random value, if available
-                std::random_device rd;
                 auto log = spdlog::get("jointLog");
 
-                // Create a random uniform distribution
-                std::default_random_engine eng(rd());
+                // Each worker has its own stream of random numbers
+                std::default_random_engine eng(salmon::utils::streamSeed(
+                            salmonOpts, salmon::utils::RandomStream::MAPPING,
+                            salmon::utils::nextMappingStreamIndex()));
                 std::uniform_real_distribution<> uni(0.0, 1.0 + std::numeric_limits<double>::min());
 
                 using salmon::math::LOG_0;
@@ -110,6 +113,7 @@ namespace salmon {
                     alnLib.fragmentStartPositionDistributions();
 
                 const auto expectedLibraryFormat = alnLib.format();
+                salmon::utils::AlignFormatProbs formatProbs(expectedLibraryFormat, salmonOpts.incompatPrior);
 
                 std::chrono::microseconds sleepTime(1);
                 MiniBatchInfo<AlignmentGroup<FragT*>>* miniBatch = nullptr;
@@ -131,6 +135,10 @@ namespace salmon {
                         using HitIDVector = std::vector<size_t>;
                         using HitProbVector = std::vector<double>;
 
+                        // The copies of the alignments sampled from this mini-batch
+                        auto* outBatch = new std::vector<FragT*>;
+                        outBatch->reserve(alignmentGroups.size());
+
                         std::unordered_map<TranscriptID, std::vector<FragT*>> hitList;
                         // Each alignment group corresponds to all of the potential
                         // mapping locations of a multi-mapping read
@@ -188,12 +196,7 @@ namespace salmon {
 
                                     double logAlignCompatProb =
                                         (salmonOpts.useReadCompat) ?
-                                        (salmon::utils::logAlignFormatProb(
-                                                  aln->libFormat(),
-                                                  expectedLibraryFormat,
-                                                  aln->pos(),
-                                                  aln->fwd(), aln->mateStatus(), salmonOpts.incompatPrior)
-                                        ) : LOG_1;
+                                        formatProbs(aln->libFormat(), aln->fwd(), aln->mateStatus()) : LOG_1;
 
                                     // Adjustment to the likelihood due to the
                                     // error model
@@ -237,10 +240,7 @@ namespace salmon {
 
 
                                 if (transcriptUnique) {
-                                    // avoid r-value ref until we figure out what's
-                                    // up with TBB 4.3
-                                    auto* alnPtr = alnGroup->alignments().front()->clone();
-                                    outputQueue.push(alnPtr);
+                                    outBatch->push_back(alnGroup->alignments().front()->clone());
                                 } else { // read maps to multiple transcripts
                                     double r = uni(eng);
                                     double currentMass{0.0};
@@ -253,10 +253,7 @@ namespace salmon {
                                         massInc = std::exp(aln->logProb);
                                         if (currentMass <= r and currentMass + massInc > r) {
                                             // Write out this read
-                                            // avoid r-value ref until we figure out what's
-                                            // up with TBB 4.3
-                                           auto* alnPtr = aln->clone();
-                                            outputQueue.push(alnPtr);
+                                            outBatch->push_back(aln->clone());
                                             currentMass += massInc;
                                             choseAlignment = true;
                                             break;
@@ -273,6 +270,11 @@ namespace salmon {
                             } // end read group
                         }// end timer
 
+                        if (outBatch->empty()) {
+                            delete outBatch;
+                        } else {
+                            outputQueue.push(outBatch);
+                        }
                         miniBatch->release(fragmentQueue, alignmentGroupQueue);
                         delete miniBatch;
                         --activeBatches;
@@ -315,8 +317,8 @@ namespace salmon {
                 /**
                 * Output queue
                 */
-                volatile bool consumedAllInput{false};
-                size_t defaultCapacity = 2000000;
+                // (in batches, of about a mini-batch of alignments each)
+                size_t defaultCapacity = 2000;
                 OutputQueue<FragT> outQueue;
                 outQueue.set_capacity(defaultCapacity);
 
@@ -326,8 +328,17 @@ namespace salmon {
                     outFilt.reset(new OutputUnmappedFilter<FragT>(&outQueue));
                 }
 
+                // A streamed input is read back from the alignments cached
+                // as it was quantified (see quantifyLibrary); that cache
+                // doesn't hold the unaligned reads
+                AlignmentCache<FragT>* streamedCache = alnLib.isStreamed() ? alnLib.alignmentCache() : nullptr;
+                if (streamedCache and sampleUnaligned) {
+                    log->warn("The alignments were streamed, so the unaligned reads can't be written "
+                              "to the sampled output");
+                }
+
                 // Reset our reader to the beginning
-                if (!alnLib.reset(false, outFilt.get())) {
+                if (!streamedCache and !alnLib.reset(false, outFilt.get())) {
                     fmt::print(stderr,
                             "\n\n======== WARNING ========\n"
                             "A provided alignment file "
@@ -362,13 +373,18 @@ namespace salmon {
                             std::ref(outQueue));
                 }
 
+                // BGZF compression of the output is usually the bottleneck,
+                // so give it as many threads as the samplers.
+                int numCompressionThreads = std::max(3, static_cast<int>(salmonOpts.numQuantThreads));
                 std::thread outputThread(
-                        [&consumedAllInput, &alnLib, &outQueue, &log, sampleFilePath] () -> void {
+                        [&alnLib, &outQueue, &log, sampleFilePath, numCompressionThreads] () -> void {
 
                             scram_fd* bf = scram_open(sampleFilePath.c_str(), "wb");
-                            scram_set_option(bf, CRAM_OPT_NTHREADS, 3);
-                            scram_set_header(bf, alnLib.header());
-                            scram_write_header(bf);
+                            if (bf != nullptr) {
+                                scram_set_option(bf, CRAM_OPT_NTHREADS, numCompressionThreads);
+                                scram_set_header(bf, alnLib.header());
+                                scram_write_header(bf);
+                            }
                             if (bf == nullptr) {
                                 fmt::MemoryWriter errstr;
                                 errstr << ioutils::SET_RED << "ERROR: "
@@ -379,31 +395,30 @@ namespace salmon {
                                 std::exit(-1);
                             }
 
-                            FragT* aln{nullptr};
-                            while (!outQueue.empty() or !consumedAllInput) {
-                                while (outQueue.try_pop(aln)) {
-                                    if (aln != nullptr) {
-                                        int ret = aln->writeToFile(bf);
-                                        if (ret != 0) {
-                                            std::cerr << "ret = " << ret << "\n";
-                                            fmt::MemoryWriter errstr;
-                                            errstr << ioutils::SET_RED << "ERROR:"
-                                                << ioutils::RESET_COLOR << "Could not write "
-                                                << "a sampled alignment to the output BAM "
-                                                << "file. Please check that the file can "
-                                                << "be created properly and that the disk "
-                                                << "is not full.  Exiting.\n";
-                                            log->warn() << errstr.str();
-                                            std::exit(-1);
-                                        }
-                                        // Eventually, as we do in BAMQueue, we should
-                                        // have queue of bam1_t structures that can be
-                                        // re-used rather than continually calling
-                                        // new and delete.
-                                        delete aln;
-                                        aln = nullptr;
+                            // Block until a batch of alignments is available; a
+                            // nullptr (pushed once the samplers have finished) marks the end
+                            std::vector<FragT*>* batch{nullptr};
+                            while (true) {
+                                outQueue.pop(batch);
+                                if (batch == nullptr) { break; }
+                                for (auto aln : *batch) {
+                                    int ret = aln->writeToFile(bf);
+                                    if (ret != 0) {
+                                        std::cerr << "ret = " << ret << "\n";
+                                        fmt::MemoryWriter errstr;
+                                        errstr << ioutils::SET_RED << "ERROR:"
+                                            << ioutils::RESET_COLOR << "Could not write "
+                                            << "a sampled alignment to the output BAM "
+                                            << "file. Please check that the file can "
+                                            << "be created properly and that the disk "
+                                            << "is not full.  Exiting.\n";
+                                        log->warn() << errstr.str();
+                                        std::exit(-1);
                                     }
+                                    delete aln;
                                 }
+                                delete batch;
+                                batch = nullptr;
                             }
 
                             scram_close(bf); // will delete the header itself
@@ -411,48 +426,63 @@ namespace salmon {
 
 
 
-                BAMQueue<FragT>& bq = alnLib.getAlignmentGroupQueue();
-                std::vector<AlignmentGroup<FragT*>*>* alignments = new std::vector<AlignmentGroup<FragT*>*>;
-                alignments->reserve(miniBatchSize);
-                AlignmentGroup<FragT*>* ag;
-
-                bool alignmentGroupsRemain = bq.getAlignmentGroup(ag);
-                while (alignmentGroupsRemain or alignments->size() > 0) {
-                    if (alignmentGroupsRemain) { alignments->push_back(ag); }
-                    // If this minibatch has reached the size limit, or we have nothing
-                    // left to fill it up with
-                    if (alignments->size() >= miniBatchSize or !alignmentGroupsRemain) {
-                        // Don't need to update the batch number or log forgetting mass in this phase
-                        MiniBatchInfo<AlignmentGroup<FragT*>>* mbi =
-                            new MiniBatchInfo<AlignmentGroup<FragT*>>(batchNum, alignments, logForgettingMass);
-                        workQueue.push(mbi);
-                        {
-                            std::unique_lock<std::mutex> l(cvmutex);
-                            workAvailable.notify_one();
-                        }
-                        alignments = new std::vector<AlignmentGroup<FragT*>*>;
-                        alignments->reserve(miniBatchSize);
-                    }
-                    if (numProc % 1000000 == 0) {
-                        const char RESET_COLOR[] = "\x1b[0m";
-                        char green[] = "\x1b[30m";
-                        green[3] = '0' + static_cast<char>(fmt::GREEN);
-                        char red[] = "\x1b[30m";
-                        red[3] = '0' + static_cast<char>(fmt::RED);
-                        fmt::print(stderr, "\r\r{}processed{} {} {}reads{}", green, red, numProc, green, RESET_COLOR);
+                if (streamedCache) {
+                    bool replayed = streamedCache->replay(alnLib.fragmentQueue(), alnLib.alignmentGroupQueue(),
+                        [&](std::vector<AlignmentGroup<FragT*>*>* alignments) -> void {
+                            numProc += alignments->size();
+                            MiniBatchInfo<AlignmentGroup<FragT*>>* mbi =
+                                new MiniBatchInfo<AlignmentGroup<FragT*>>(batchNum, alignments, logForgettingMass);
+                            workQueue.push(mbi);
+                            {
+                                std::unique_lock<std::mutex> l(cvmutex);
+                                workAvailable.notify_one();
+                            }
+                        });
+                    if (!replayed) {
+                        log->warn("Could not read back the alignment cache; the sampled output is incomplete");
                     }
-                    ++numProc;
-                    alignmentGroupsRemain = bq.getAlignmentGroup(ag);
+                } else {
+                    BAMQueue<FragT>& bq = alnLib.getAlignmentGroupQueue();
+                    std::vector<AlignmentGroup<FragT*>*>* alignments = new std::vector<AlignmentGroup<FragT*>*>;
+                    alignments->reserve(miniBatchSize);
+                    AlignmentGroup<FragT*>* ag;
+
+                    bool alignmentGroupsRemain = bq.getAlignmentGroup(ag);
+                    while (alignmentGroupsRemain or alignments->size() > 0) {
+                        if (alignmentGroupsRemain) { alignments->push_back(ag); }
+                        // If this minibatch has reached the size limit, or we have nothing
+                        // left to fill it up with
+                        if (alignments->size() >= miniBatchSize or !alignmentGroupsRemain) {
+                            // Don't need to update the batch number or log forgetting mass in this phase
+                            MiniBatchInfo<AlignmentGroup<FragT*>>* mbi =
+                                new MiniBatchInfo<AlignmentGroup<FragT*>>(batchNum, alignments, logForgettingMass);
+                            workQueue.push(mbi);
+                            {
+                                std::unique_lock<std::mutex> l(cvmutex);
+                                workAvailable.notify_one();
+                            }
+                            alignments = new std::vector<AlignmentGroup<FragT*>*>;
+                            alignments->reserve(miniBatchSize);
+                        }
+                        if (numProc % 1000000 == 0) {
+                            const char RESET_COLOR[] = "\x1b[0m";
+                            char green[] = "\x1b[30m";
+                            green[3] = '0' + static_cast<char>(fmt::GREEN);
+                            char red[] = "\x1b[30m";
+                            red[3] = '0' + static_cast<char>(fmt::RED);
+                            fmt::print(stderr, "\r\r{}processed{} {} {}reads{}", green, red, numProc, green, RESET_COLOR);
+                        }
+                        ++numProc;
+                        alignmentGroupsRemain = bq.getAlignmentGroup(ag);
 
-                }
-                std::cerr << "\n";
+                    }
+                    std::cerr << "\n";
 
-                // Free the alignments and the vector holding them
-                for (auto& aln : *alignments) {
-                    aln->alignments().clear();
-                    delete aln; aln = nullptr;
+                    // Return the alignments to their pools, and free the
+                    // vector holding them
+                    MiniBatchInfo<AlignmentGroup<FragT*>> leftover(batchNum, alignments, 0.0);
+                    leftover.release(alnLib.fragmentQueue(), alnLib.alignmentGroupQueue());
                 }
-                delete alignments;
 
                 doneParsing = true;
 
@@ -478,7 +508,8 @@ namespace salmon {
                     fmt::print(stderr, "done\r\r");
                 }
                 fmt::print(stderr, "\n");
-                consumedAllInput = true;
+                if (outFilt) { outFilt->flush(); }
+                outQueue.push(nullptr);
 
                 numObservedFragments += alnLib.numMappedFragments();
                 fmt::print(stderr, "# observed = {} mapped fragments.\033[F\033[F\033[F\033[F",
@@ -0,0 +1,298 @@
+#ifndef __SHARD_STATE_HPP__
+#define __SHARD_STATE_HPP__
+
+#include <algorithm>
+#include <cstdint>
+#include <exception>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/functional/hash.hpp>
+
+#include "cereal/archives/binary.hpp"
+#include "cereal/types/vector.hpp"
+
+#include "BinaryEquivalenceClasses.hpp"
+#include "SalmonMath.hpp"
+
+namespace salmon {
+namespace shard {
+
+/**
+ * The state of a sample after the mapping pass over one or more of its
+ * shards (e.g. its sequencing lanes): all that is needed to estimate the
+ * abundances, without the reads.  salmon quant --mapOnly writes the state
+ * of the reads it maps to <output>/shard, salmon merge combines the states
+ * of several shards, and salmon infer estimates the abundances (and runs
+ * the bootstraps or the Gibbs sampler) from a state, with the output of
+ * salmon quant.  So the shards of a sample can be mapped on different
+ * nodes as they arrive, and quantified together.
+ *
+ * A state directory holds
+ *
+ *   eq_classes.bin   the equivalence classes, with their (conditional
+ *                    probability) weights, see BinaryEquivalenceClasses.hpp
+ *   shard_stats.bin  the ShardStats, as a cereal binary archive
+ *
+ * salmon quant --saveState writes the state of a whole run (with the final
+ * estimates) there as well, and salmon quant --extend maps only the reads
+ * added to a sample since, adding them to such a state.
+ */
+constexpr const char* eqClassesFileName = "eq_classes.bin";
+constexpr const char* statsFileName = "shard_stats.bin";
+
+/**
+ * The statistics of the mapping pass, other than the equivalence classes.
+ * The bias counts are kept without the pseudo-counts from which the models
+ * start, so that they simply add up over the shards.
+ */
+struct ShardStats {
+    static constexpr uint32_t currentVersion = 2;
+
+    uint32_t version{currentVersion};
+    uint64_t numShards{1};
+    uint64_t numObservedFragments{0};
+    uint64_t numAssignedFragments{0};
+    uint64_t upperBoundHits{0};
+    // The format (LibraryFormat::formatID()) of each read library, and its
+    // counts of the library types of the mapped fragments
+    std::vector<uint8_t> libFormats;
+    std::vector<std::vector<uint64_t>> libTypeCounts;
+    // The (logged) mass of each bin of the fragment length distribution,
+    // and the smallest bin observed (see FragmentLengthDistribution::logMasses)
+    std::vector<double> fldLogMasses;
+    uint64_t fldMinBin{0};
+    // The read k-mer counts of the sequence-specific bias model (empty
+    // unless it was trained)
+    std::vector<uint64_t> readBiasCounts;
+    // The observed fragment GC distribution, and the fraction of the GC
+    // mass on the forward strand (negative unless it was observed)
+    std::vector<double> observedGC;
+    double gcFracFwd{-1.0};
+    // The online estimate of the number of fragments of each transcript,
+    // from which the optimizer starts
+    std::vector<double> projectedCounts;
+    // The estimated number of fragments of each transcript, after the
+    // optimizer (empty unless the state was saved after it; version 2)
+    std::vector<double> estimatedCounts;
+
+    template <typename Archive>
+    void serialize(Archive& ar) {
+        ar(version, numShards, numObservedFragments, numAssignedFragments, upperBoundHits,
+           libFormats, libTypeCounts, fldLogMasses, fldMinBin, readBiasCounts,
+           observedGC, gcFracFwd, projectedCounts);
+        if (version >= 2) { ar(estimatedCounts); }
+    }
+};
+
+/**
+ * The directory holding the state at path: either path itself, or the
+ * shard directory of a salmon quant --mapOnly run.
+ */
+inline boost::filesystem::path stateDirectory(const boost::filesystem::path& path) {
+    if (boost::filesystem::exists(path / statsFileName)) { return path; }
+    return path / "shard";
+}
+
+inline bool writeStats(const boost::filesystem::path& dir, const ShardStats& stats) {
+    std::ofstream out((dir / statsFileName).string(), std::ios_base::out | std::ios_base::binary);
+    if (!out.good()) { return false; }
+    {
+        cereal::BinaryOutputArchive oa(out);
+        oa(stats);
+    }
+    return out.good();
+}
+
+inline bool readStats(const boost::filesystem::path& dir, ShardStats& stats, std::string& err) {
+    auto path = dir / statsFileName;
+    std::ifstream in(path.string(), std::ios_base::in | std::ios_base::binary);
+    if (!in.good()) {
+        err = "could not open " + path.string();
+        return false;
+    }
+    try {
+        cereal::BinaryInputArchive ia(in);
+        ia(stats);
+    } catch (std::exception& e) {
+        err = "could not read " + path.string() + " (" + e.what() + ")";
+        return false;
+    }
+    if (stats.version == 0 or stats.version > ShardStats::currentVersion) {
+        err = path.string() + " was written by an incompatible version of salmon";
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Add the statistics of from to those of into; fails, leaving into as it
+ * was, if they come from different indices or settings.
+ */
+inline bool mergeStats(ShardStats& into, const ShardStats& from, std::string& err) {
+    if (into.projectedCounts.size() != from.projectedCounts.size()) {
+        err = "the shards were mapped against different indices";
+        return false;
+    }
+    if (into.fldLogMasses.size() != from.fldLogMasses.size()) {
+        err = "the shards have fragment length distributions of different lengths (--fldMax)";
+        return false;
+    }
+    if (!into.readBiasCounts.empty() and !from.readBiasCounts.empty() and
+        into.readBiasCounts.size() != from.readBiasCounts.size()) {
+        err = "the shards have sequence-specific bias models of different sizes";
+        return false;
+    }
+
+    // The GC strand fraction is averaged over the shards that observed it
+    if (from.gcFracFwd >= 0.0) {
+        if (into.gcFracFwd < 0.0) {
+            into.gcFracFwd = from.gcFracFwd;
+        } else {
+            double total = static_cast<double>(into.numAssignedFragments + from.numAssignedFragments);
+            if (total > 0.0) {
+                into.gcFracFwd = (into.gcFracFwd * into.numAssignedFragments +
+                                  from.gcFracFwd * from.numAssignedFragments) / total;
+            }
+        }
+    }
+    into.numShards += from.numShards;
+    into.numObservedFragments += from.numObservedFragments;
+    into.numAssignedFragments += from.numAssignedFragments;
+    into.upperBoundHits += from.upperBoundHits;
+
+    // The counts of libraries of the same format are combined
+    for (size_t i = 0; i < from.libFormats.size(); ++i) {
+        size_t j = 0;
+        while (j < into.libFormats.size() and into.libFormats[j] != from.libFormats[i]) { ++j; }
+        if (j == into.libFormats.size()) {
+            into.libFormats.push_back(from.libFormats[i]);
+            into.libTypeCounts.emplace_back(from.libTypeCounts[i].size(), 0);
+        }
+        auto& counts = into.libTypeCounts[j];
+        if (counts.size() < from.libTypeCounts[i].size()) { counts.resize(from.libTypeCounts[i].size(), 0); }
+        for (size_t k = 0; k < from.libTypeCounts[i].size(); ++k) { counts[k] += from.libTypeCounts[i][k]; }
+    }
+
+    for (size_t i = 0; i < into.fldLogMasses.size(); ++i) {
+        into.fldLogMasses[i] = salmon::math::logAdd(into.fldLogMasses[i], from.fldLogMasses[i]);
+    }
+    into.fldMinBin = std::min(into.fldMinBin, from.fldMinBin);
+
+    if (into.readBiasCounts.empty()) {
+        into.readBiasCounts = from.readBiasCounts;
+    } else {
+        for (size_t i = 0; i < from.readBiasCounts.size(); ++i) { into.readBiasCounts[i] += from.readBiasCounts[i]; }
+    }
+    if (into.observedGC.size() < from.observedGC.size()) { into.observedGC.resize(from.observedGC.size(), 0.0); }
+    for (size_t i = 0; i < from.observedGC.size(); ++i) { into.observedGC[i] += from.observedGC[i]; }
+    for (size_t i = 0; i < from.projectedCounts.size(); ++i) { into.projectedCounts[i] += from.projectedCounts[i]; }
+    // The estimates only add up if every state has them
+    if (into.estimatedCounts.size() == from.estimatedCounts.size()) {
+        for (size_t i = 0; i < from.estimatedCounts.size(); ++i) { into.estimatedCounts[i] += from.estimatedCounts[i]; }
+    } else {
+        into.estimatedCounts.clear();
+    }
+    return true;
+}
+
+/**
+ * Combines the states of shards (salmon merge).  The classes with the same
+ * label are merged: their counts are summed, and their weights averaged,
+ * weighted by the counts, as if their fragments had been mapped together.
+ */
+class ShardMerger {
+    public:
+        /** Add the state in dir; on failure, err says why. */
+        bool add(const boost::filesystem::path& dir, std::string& err) {
+            ShardStats stats;
+            if (!readStats(dir, stats, err)) { return false; }
+            auto eqPath = dir / eqClassesFileName;
+            BinaryEqClassReader reader(eqPath);
+            if (!reader.good()) {
+                err = "could not read the equivalence classes from " + eqPath.string();
+                return false;
+            }
+            if (numShardsAdded_ == 0) {
+                names_ = reader.transcriptNames();
+                stats_ = stats;
+            } else {
+                if (reader.transcriptNames() != names_) {
+                    err = dir.string() + " was mapped against a different index than the shards before it";
+                    return false;
+                }
+                if (!mergeStats(stats_, stats, err)) { return false; }
+            }
+
+            std::vector<uint32_t> labels;
+            std::vector<float> weights;
+            uint64_t count{0};
+            while (reader.next(labels, weights, count)) {
+                auto it = classes_.find(labels);
+                if (it == classes_.end()) {
+                    it = classes_.emplace(labels, MergedClass(labels.size())).first;
+                }
+                auto& c = it->second;
+                c.count += count;
+                for (size_t i = 0; i < labels.size(); ++i) {
+                    double w = weights.empty() ? (1.0 / labels.size()) : weights[i];
+                    c.weightedSums[i] += count * w;
+                }
+            }
+            if (!reader.good()) {
+                err = eqPath.string() + " is truncated";
+                return false;
+            }
+            ++numShardsAdded_;
+            return true;
+        }
+
+        /** Write the combined state to dir (which must exist). */
+        bool write(const boost::filesystem::path& dir, std::string& err) {
+            BinaryEqClassWriter writer(names_, true);
+            std::vector<double> weights;
+            for (auto& kv : classes_) {
+                auto& c = kv.second;
+                double total{0.0};
+                for (auto w : c.weightedSums) { total += w; }
+                weights.resize(c.weightedSums.size());
+                for (size_t i = 0; i < weights.size(); ++i) {
+                    weights[i] = (total > 0.0) ? c.weightedSums[i] / total : 1.0 / weights.size();
+                }
+                writer.add(kv.first, weights.begin(), c.count);
+            }
+            if (!writer.write(dir / eqClassesFileName)) {
+                err = "could not write the equivalence classes to " + (dir / eqClassesFileName).string();
+                return false;
+            }
+            if (!writeStats(dir, stats_)) {
+                err = "could not write the statistics to " + (dir / statsFileName).string();
+                return false;
+            }
+            return true;
+        }
+
+        size_t numShardsAdded() const { return numShardsAdded_; }
+        size_t numClasses() const { return classes_.size(); }
+        const ShardStats& stats() const { return stats_; }
+
+    private:
+        struct MergedClass {
+            explicit MergedClass(size_t n) : weightedSums(n, 0.0) {}
+            uint64_t count{0};
+            std::vector<double> weightedSums;
+        };
+
+        std::vector<std::string> names_;
+        ShardStats stats_;
+        std::unordered_map<std::vector<uint32_t>, MergedClass, boost::hash<std::vector<uint32_t>>> classes_;
+        size_t numShardsAdded_{0};
+};
+
+} // namespace shard
+} // namespace salmon
+
+#endif // __SHARD_STATE_HPP__
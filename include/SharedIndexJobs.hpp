@@ -0,0 +1,42 @@
+#ifndef __SHARED_INDEX_JOBS_HPP__
+#define __SHARED_INDEX_JOBS_HPP__
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+class SalmonIndex;
+
+namespace spdlog {
+class logger;
+}
+
+int salmonQuantifyWithIndex(int argc, char *argv[], std::shared_ptr<SalmonIndex> sharedIndex);
+
+namespace salmon {
+namespace utils {
+
+/**
+ * Load the index in indexDir once, for the commands that run many salmon
+ * quant jobs against it (salmon serve, salmon quant --batch and the
+ * Quantifier of SalmonAPI.hpp), after checking it against its recorded
+ * checksums if verify is true.  Returns nullptr, with the reason in err,
+ * if the index can't be used.
+ */
+std::shared_ptr<SalmonIndex> loadSharedIndex(const boost::filesystem::path& indexDir, bool verify,
+                                             std::shared_ptr<spdlog::logger>& log, std::string& err);
+
+/**
+ * Run salmon quant, with the arguments jobArgs (argv[0] first), against
+ * the shared index in a forked child, and end the child with its exit
+ * status.  The child's output is flushed first, but no atexit handlers or
+ * static destructors are run, since those belong to the parent.
+ */
+[[noreturn]] void runForkedQuantJob(std::vector<std::string> jobArgs, std::shared_ptr<SalmonIndex> index);
+
+}
+}
+
+#endif // __SHARED_INDEX_JOBS_HPP__
@@ -0,0 +1,391 @@
+#ifndef __SHARED_INDEX_SEGMENT_HPP__
+#define __SHARED_INDEX_SEGMENT_HPP__
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <boost/filesystem.hpp>
+
+#include "xxhash.h"
+
+/**
+ * Holds the mappable components of an index (e.g. the BWT, suffix array
+ * and text of the FMD index, and its auxiliary k-mer table; see
+ * MappedBWAIndex and KmerIntervalMap) in a named shared-memory segment, so
+ * that the index is read from storage once per machine, by the first
+ * process that asks for it, and every other salmon process on the machine
+ * (e.g. in other containers sharing its /dev/shm) attaches to the loaded
+ * copy read-only.  A name that is a path (contains a '/' after its first
+ * character) is a file, e.g. on a hugetlbfs mount, rather than a POSIX
+ * shared-memory object; the segment is then backed by huge pages.
+ *
+ * The segment is
+ *
+ *   magic[8] layoutVersion:u32 numComponents:u32 versionKey:u64
+ *   totalBytes:u64 ready:u64 (name[48] offset:u64 size:u64) * maxComponents
+ *
+ * in a 4K header page, followed by the components, each at a page-aligned
+ * offset.  The version key identifies the index the segment was loaded
+ * from (the hash of its recorded checksums, or of the sizes and
+ * modification times of the components if it has none), so that a process
+ * never attaches to a segment of another (e.g. rebuilt) index.
+ *
+ * Each attached process holds a shared flock on the segment, which acts as
+ * its reference count: the kernel drops it when the process exits, however
+ * it exits, so a crashed process never leaks a reference.  The segment
+ * outlives its last process, so that the next run on the machine finds the
+ * index loaded; a stale segment (of another version, or left incomplete by
+ * a process that died while loading it) is replaced by the next process
+ * once no process is attached to it, and until then the index is mapped
+ * from its files.  The segment can be removed by hand (e.g. from /dev/shm)
+ * at any time, without disturbing the processes attached to it.  The
+ * attach-or-load decision is serialized by an exclusive flock on a
+ * companion lock object (the segment's name with a .lock suffix), so
+ * processes started together wait for the first one to load the index
+ * rather than each loading it; the last process to drop its reference
+ * removes the lock object.  Both objects are private to the user (mode
+ * 0600), and a segment owned by another user is never attached to.
+ */
+class SharedIndexSegment {
+    public:
+        static constexpr size_t maxComponents = 32;
+
+        SharedIndexSegment() = default;
+        SharedIndexSegment(const SharedIndexSegment&) = delete;
+        SharedIndexSegment& operator=(const SharedIndexSegment&) = delete;
+
+        ~SharedIndexSegment() { detach(); }
+
+        /**
+         * Attach to the segment called name holding the given components
+         * (files) of the index in indexDir, loading them into it first if
+         * it doesn't exist yet (or is stale, and unused).  Returns false,
+         * with a message in err, if the segment can't be used, in which
+         * case the components should be mapped from their files.
+         */
+        bool attach(const std::string& name, const boost::filesystem::path& indexDir,
+                    const std::vector<std::string>& components, std::string& err) {
+            detach();
+            if (name.empty() or components.empty() or components.size() > maxComponents) {
+                err = "invalid shared index segment";
+                return false;
+            }
+            name_ = objectName_(name);
+            uint64_t versionKey{0};
+            if (!versionKey_(indexDir, components, versionKey, err)) { return false; }
+
+            // Serialize attaching and loading across the processes
+            std::string guardName = name_ + ".lock";
+            int guard = lockGuard_(O_RDWR | O_CREAT);
+            if (guard < 0) {
+                err = "could not open " + guardName + ": " + std::strerror(errno);
+                return false;
+            }
+            struct stat st;
+            if (::fstat(guard, &st) != 0 or st.st_uid != ::geteuid()) {
+                err = "the lock " + guardName + " is not owned by this user";
+                ::close(guard);
+                return false;
+            }
+            bool ok = attachExisting_(components, versionKey, err);
+            if (!ok and err.empty()) { ok = load_(indexDir, components, versionKey, err); }
+            ::flock(guard, LOCK_UN);
+            ::close(guard);
+            return ok;
+        }
+
+        // Drop this process's reference to the segment (the segment itself is kept)
+        void detach() {
+            if (fd_ >= 0) {
+                // Remove the lock object if no other process is attached
+                int guard = lockGuard_(O_RDWR);
+                if (guard >= 0) {
+                    if (::flock(fd_, LOCK_EX | LOCK_NB) == 0) { unlinkObject_(name_ + ".lock"); }
+                    ::close(guard);
+                }
+            }
+            if (data_) { ::munmap(data_, mappedBytes_); }
+            if (fd_ >= 0) { ::close(fd_); }
+            data_ = nullptr;
+            mappedBytes_ = 0;
+            fd_ = -1;
+            loaded_ = false;
+        }
+
+        bool attached() const { return data_ != nullptr; }
+        // Whether this process loaded the segment (rather than finding it loaded)
+        bool loadedHere() const { return loaded_; }
+        const std::string& name() const { return name_; }
+        uint64_t bytes() const { return mappedBytes_; }
+
+        /**
+         * The contents of the given component in the segment, or nullptr
+         * (with size 0) if it doesn't hold it.
+         */
+        const char* find(const std::string& component, size_t& size) const {
+            size = 0;
+            if (!data_) { return nullptr; }
+            auto header = header_();
+            for (uint32_t i = 0; i < header->numComponents; ++i) {
+                if (component == header->entries[i].name) {
+                    size = static_cast<size_t>(header->entries[i].size);
+                    return static_cast<const char*>(data_) + header->entries[i].offset;
+                }
+            }
+            return nullptr;
+        }
+
+    private:
+        struct Entry_ {
+            char name[48];
+            uint64_t offset;
+            uint64_t size;
+        };
+
+        struct Header_ {
+            char magic[8];
+            uint32_t layoutVersion;
+            uint32_t numComponents;
+            uint64_t versionKey;
+            uint64_t totalBytes;
+            uint64_t ready;
+            Entry_ entries[maxComponents];
+        };
+
+        static constexpr size_t pageBytes_ = 4096;
+        static_assert(sizeof(Header_) <= pageBytes_, "the segment header must fit in its page");
+        // The 8 bytes (with its terminator) that start the segment
+        static const char* magic_() { return "SLMSHMI"; }
+        static constexpr uint32_t layoutVersion_ = 1;
+
+        static bool isPath_(const std::string& name) { return name.find('/', 1) != std::string::npos; }
+
+        // POSIX shared-memory objects are named /name; paths are used as they are
+        static std::string objectName_(const std::string& name) {
+            if (isPath_(name)) { return name; }
+            return (name[0] == '/') ? name : "/salmon." + name;
+        }
+
+        static int openObject_(const std::string& name, int flags, mode_t mode) {
+            return isPath_(name) ? ::open(name.c_str(), flags, mode) : ::shm_open(name.c_str(), flags, mode);
+        }
+
+        static void unlinkObject_(const std::string& name) {
+            if (isPath_(name)) {
+                ::unlink(name.c_str());
+            } else {
+                ::shm_unlink(name.c_str());
+            }
+        }
+
+        static int flockRetry_(int fd, int op) {
+            int ret;
+            while ((ret = ::flock(fd, op)) != 0 and errno == EINTR) {}
+            return ret;
+        }
+
+        /**
+         * Open (with the given flags) and exclusively lock the lock object,
+         * making sure the one locked is still the one under its name, as the
+         * last process to detach may have removed it meanwhile.  Returns the
+         * locked descriptor, or -1 if it can't be opened.
+         */
+        int lockGuard_(int flags) const {
+            std::string guardName = name_ + ".lock";
+            while (true) {
+                int guard = openObject_(guardName, flags, 0600);
+                if (guard < 0) { return -1; }
+                flockRetry_(guard, LOCK_EX);
+                int current = openObject_(guardName, O_RDONLY, 0);
+                struct stat held, linked;
+                bool same = current >= 0 and ::fstat(guard, &held) == 0 and ::fstat(current, &linked) == 0 and
+                            held.st_dev == linked.st_dev and held.st_ino == linked.st_ino;
+                if (current >= 0) { ::close(current); }
+                if (same) { return guard; }
+                ::close(guard);
+            }
+        }
+
+        static uint64_t roundUp_(uint64_t n, uint64_t to) { return (n + to - 1) / to * to; }
+
+        const Header_* header_() const { return static_cast<const Header_*>(data_); }
+
+        static bool versionKey_(const boost::filesystem::path& indexDir, const std::vector<std::string>& components,
+                                uint64_t& key, std::string& err) {
+            namespace bfs = boost::filesystem;
+            std::string id;
+            bfs::path sumPath = indexDir / "checksums.json";
+            if (bfs::exists(sumPath)) {
+                std::ifstream ifs(sumPath.string(), std::ios::binary);
+                id.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+            }
+            for (auto& c : components) {
+                struct stat st;
+                std::string path = (indexDir / c).string();
+                if (::stat(path.c_str(), &st) != 0) {
+                    err = "could not stat " + path;
+                    return false;
+                }
+                id += c + ":" + std::to_string(st.st_size);
+                if (!bfs::exists(sumPath)) { id += ":" + std::to_string(st.st_mtime); }
+                id += "\n";
+            }
+            key = XXH64(id.data(), id.size(), 0);
+            return true;
+        }
+
+        /**
+         * Attach to the existing segment, if it's a complete one of this
+         * version of the index.  Returns false with an empty err if there
+         * is no usable segment and the caller may load one, or with a
+         * message in err if it may not (because a stale segment is in use).
+         */
+        bool attachExisting_(const std::vector<std::string>& components, uint64_t versionKey, std::string& err) {
+            int fd = openObject_(name_, O_RDONLY, 0);
+            if (fd < 0) {
+                if (errno != ENOENT) { err = "could not open " + name_ + ": " + std::strerror(errno); }
+                return false;
+            }
+            struct stat st;
+            if (::fstat(fd, &st) != 0 or st.st_uid != ::geteuid()) {
+                err = "the shared index segment " + name_ + " is not owned by this user";
+                ::close(fd);
+                return false;
+            }
+            void* addr = MAP_FAILED;
+            if (static_cast<size_t>(st.st_size) >= pageBytes_) {
+                addr = ::mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+            }
+            if (addr != MAP_FAILED) {
+                auto header = static_cast<const Header_*>(addr);
+                bool valid = std::memcmp(header->magic, magic_(), sizeof(header->magic)) == 0 and
+                             header->layoutVersion == layoutVersion_ and header->ready == 1 and
+                             header->versionKey == versionKey and header->numComponents == components.size() and
+                             header->totalBytes <= static_cast<uint64_t>(st.st_size);
+                for (uint32_t i = 0; valid and i < header->numComponents; ++i) {
+                    valid = (components[i] == header->entries[i].name) and
+                            header->entries[i].offset + header->entries[i].size <= header->totalBytes;
+                }
+                if (valid) {
+                    flockRetry_(fd, LOCK_SH);
+                    data_ = addr;
+                    mappedBytes_ = static_cast<size_t>(st.st_size);
+                    fd_ = fd;
+                    return true;
+                }
+                ::munmap(addr, static_cast<size_t>(st.st_size));
+            }
+            // Stale; it can only be replaced if no process is attached to it
+            if (::flock(fd, LOCK_EX | LOCK_NB) != 0) {
+                err = "the shared index segment " + name_ + " holds another version of the index, and is in use";
+                ::close(fd);
+                return false;
+            }
+            unlinkObject_(name_);
+            ::close(fd);
+            return false;
+        }
+
+        // Create the segment and read the components into it
+        bool load_(const boost::filesystem::path& indexDir, const std::vector<std::string>& components,
+                   uint64_t versionKey, std::string& err) {
+            int fd = openObject_(name_, O_RDWR | O_CREAT | O_EXCL, 0600);
+            if (fd < 0) {
+                err = "could not create " + name_ + ": " + std::strerror(errno);
+                return false;
+            }
+            auto fail = [&](const std::string& msg, void* addr, size_t bytes) -> bool {
+                err = msg;
+                if (addr != MAP_FAILED) { ::munmap(addr, bytes); }
+                unlinkObject_(name_);
+                ::close(fd);
+                return false;
+            };
+
+            Header_ header;
+            std::memset(&header, 0, sizeof(header));
+            std::memcpy(header.magic, magic_(), sizeof(header.magic));
+            header.layoutVersion = layoutVersion_;
+            header.numComponents = static_cast<uint32_t>(components.size());
+            header.versionKey = versionKey;
+            uint64_t offset = pageBytes_;
+            for (size_t i = 0; i < components.size(); ++i) {
+                auto& entry = header.entries[i];
+                if (components[i].size() >= sizeof(entry.name)) {
+                    return fail("the index component name " + components[i] + " is too long", MAP_FAILED, 0);
+                }
+                struct stat st;
+                std::string path = (indexDir / components[i]).string();
+                if (::stat(path.c_str(), &st) != 0) { return fail("could not stat " + path, MAP_FAILED, 0); }
+                std::strcpy(entry.name, components[i].c_str());
+                entry.offset = offset;
+                entry.size = static_cast<uint64_t>(st.st_size);
+                offset = roundUp_(offset + entry.size, pageBytes_);
+            }
+            header.totalBytes = offset;
+
+            // Reserve the memory up front (hugetlbfs needs a multiple of its page size), so
+            // that running out of it is an error here rather than a SIGBUS while copying
+            struct stat fst;
+            if (::fstat(fd, &fst) != 0) { return fail("could not stat " + name_, MAP_FAILED, 0); }
+            uint64_t blockBytes = (fst.st_blksize > 0) ? static_cast<uint64_t>(fst.st_blksize) : pageBytes_;
+            size_t bytes = static_cast<size_t>(roundUp_(header.totalBytes, blockBytes));
+            int ret = ::posix_fallocate(fd, 0, static_cast<off_t>(bytes));
+            if (ret != 0) {
+                return fail("could not reserve " + std::to_string(bytes) + " bytes for " + name_ + ": " +
+                            std::strerror(ret), MAP_FAILED, 0);
+            }
+            void* addr = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (addr == MAP_FAILED) { return fail("could not map " + name_, MAP_FAILED, 0); }
+
+            char* base = static_cast<char*>(addr);
+            for (uint32_t i = 0; i < header.numComponents; ++i) {
+                auto& entry = header.entries[i];
+                std::string path = (indexDir / entry.name).string();
+                int in = ::open(path.c_str(), O_RDONLY);
+                if (in < 0) { return fail("could not open " + path, addr, bytes); }
+                uint64_t done{0};
+                while (done < entry.size) {
+                    ssize_t n = ::read(in, base + entry.offset + done, static_cast<size_t>(entry.size - done));
+                    if (n < 0 and errno == EINTR) { continue; }
+                    if (n <= 0) { break; }
+                    done += static_cast<uint64_t>(n);
+                }
+                ::close(in);
+                if (done != entry.size) { return fail("could not read " + path, addr, bytes); }
+            }
+            // Publish the header (and with it the ready flag) last
+            std::memcpy(base, &header, sizeof(header));
+            reinterpret_cast<Header_*>(base)->ready = 1;
+            ::munmap(addr, bytes);
+
+            // Attach to it read-only, as the other processes will
+            addr = ::mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+            if (addr == MAP_FAILED) { return fail("could not map " + name_, MAP_FAILED, 0); }
+            flockRetry_(fd, LOCK_SH);
+            data_ = addr;
+            mappedBytes_ = bytes;
+            fd_ = fd;
+            loaded_ = true;
+            return true;
+        }
+
+        std::string name_;
+        void* data_{nullptr};
+        size_t mappedBytes_{0};
+        int fd_{-1};
+        bool loaded_{false};
+};
+
+#endif // __SHARED_INDEX_SEGMENT_HPP__
@@ -0,0 +1,59 @@
+#ifndef __SIMD_DISPATCH_HPP__
+#define __SIMD_DISPATCH_HPP__
+
+#include <cstddef>
+#include <cstdint>
+
+namespace salmon {
+namespace simd {
+
+// The instruction sets for which kernels are compiled, from least to most capable
+enum class InstructionSet : uint8_t { SCALAR = 0, SSE2 = 1, AVX2 = 2, AVX512 = 3, NEON = 4 };
+
+const char* instructionSetName(InstructionSet isa);
+
+/**
+ * The features of the CPU that the kernels can use, detected once (on the
+ * first call to cpuFeatures()).
+ */
+struct CpuFeatures {
+    bool sse2{false};
+    bool avx2{false};
+    bool avx512f{false};
+    bool neon{false};
+};
+
+const CpuFeatures& cpuFeatures();
+
+/**
+ * The kernels of each SIMD family, bound to the variants for one instruction
+ * set.  A single binary holds the variants for every instruction set of its
+ * architecture (each compiled for its own target), and kernels() binds the
+ * best one that the CPU supports the first time it's called, so the same
+ * build runs at full width on AVX2, AVX-512 and NEON nodes alike.  The
+ * environment variable SALMON_SIMD (scalar, sse2, avx2, avx512 or neon)
+ * caps the instruction set that is chosen, e.g. to compare the variants.
+ */
+struct Kernels {
+    InstructionSet isa{InstructionSet::SCALAR};
+
+    /**
+     * The intersection of the sorted lists of ids a and b (see
+     * salmon::utils::intersectSorted): writes the positions i and j of each
+     * match a[i] == b[j], in order, to indexA and indexB (each of at least
+     * min(na, nb) entries), and returns the number of matches.
+     */
+    size_t (*intersectSorted)(const uint32_t* a, size_t na, const uint32_t* b, size_t nb,
+                              uint32_t* indexA, uint32_t* indexB){nullptr};
+};
+
+// The kernels for the best instruction set of this CPU (and SALMON_SIMD)
+const Kernels& kernels();
+
+// The kernels for isa, or for the best supported instruction set below it
+Kernels kernelsFor(InstructionSet isa);
+
+} // namespace simd
+} // namespace salmon
+
+#endif // __SIMD_DISPATCH_HPP__
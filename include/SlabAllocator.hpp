@@ -0,0 +1,60 @@
+#ifndef __SLAB_ALLOCATOR_HPP__
+#define __SLAB_ALLOCATOR_HPP__
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+/**
+ * Hands out default-constructed objects of type T from contiguous blocks
+ * ("slabs") of slabSize objects, rather than allocating each one
+ * separately on the heap.  The objects are never freed individually; they
+ * are meant to be recycled by their owner (e.g. through a free list), and
+ * are all destroyed, along with their slabs, when the allocator is.
+ *
+ * allocate() is not thread-safe; it should only be called by the thread
+ * that owns the allocator.
+ */
+template <typename T>
+class SlabAllocator {
+    public:
+        SlabAllocator(size_t slabSize = 4096) :
+            slabSize_(slabSize > 0 ? slabSize : 1), nextInSlab_(slabSize_) {}
+
+        SlabAllocator(const SlabAllocator&) = delete;
+        SlabAllocator& operator=(const SlabAllocator&) = delete;
+
+        T* allocate() {
+            if (nextInSlab_ == slabSize_) {
+                slabs_.emplace_back(new T[slabSize_]);
+                current_ = slabs_.back().get();
+                nextInSlab_ = 0;
+            }
+            ++numAllocated_;
+            return current_ + nextInSlab_++;
+        }
+
+        /**
+         * Allocate a whole slab of n objects at once, and pass it (and n)
+         * to f.
+         */
+        template <typename CallbackT>
+        void allocateSlab(size_t n, CallbackT f) {
+            if (n == 0) { return; }
+            slabs_.emplace_back(new T[n]);
+            numAllocated_ += n;
+            f(slabs_.back().get(), n);
+        }
+
+        size_t numAllocated() const { return numAllocated_; }
+
+    private:
+        size_t slabSize_;
+        size_t nextInSlab_;
+        size_t numAllocated_{0};
+        // The slab from which allocate() hands out objects
+        T* current_{nullptr};
+        std::vector<std::unique_ptr<T[]>> slabs_;
+};
+
+#endif //__SLAB_ALLOCATOR_HPP__
@@ -0,0 +1,80 @@
+#ifndef __SORTED_INTERSECTION_HPP__
+#define __SORTED_INTERSECTION_HPP__
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace salmon {
+namespace utils {
+
+/**
+ * The intersection of two sorted lists of (transcript) ids, e.g. those of
+ * the hits of the two mates of a fragment: calls onMatch(i, j) for each
+ * pair of positions with a[i] == b[j], exactly as the usual two-pointer
+ * merge would (advancing both on a match, so that duplicate ids are paired
+ * in order).  With SSE2, the ids are compared 4 against 4 at once, and a
+ * pair of blocks without any id in common is skipped as a whole (by the
+ * block with the smaller last id); the two-pointer merge is only run
+ * through blocks that have a match.  When the mates of a fragment hit many
+ * transcripts, most of the blocks of the one that hits more have none of
+ * the other's.  This is the baseline variant; salmon::simd::kernels() binds
+ * the widest one that the CPU supports.
+ */
+template <typename MatchFn>
+inline void intersectSorted(const uint32_t* a, size_t na, const uint32_t* b, size_t nb, MatchFn onMatch) {
+    size_t i{0};
+    size_t j{0};
+#if defined(__SSE2__)
+    while (i + 4 <= na and j + 4 <= nb) {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + j));
+        // Compare each id of va with all 4 of vb (rotating vb through its lanes)
+        __m128i eq = _mm_cmpeq_epi32(va, vb);
+        vb = _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1));
+        eq = _mm_or_si128(eq, _mm_cmpeq_epi32(va, vb));
+        vb = _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1));
+        eq = _mm_or_si128(eq, _mm_cmpeq_epi32(va, vb));
+        vb = _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1));
+        eq = _mm_or_si128(eq, _mm_cmpeq_epi32(va, vb));
+        if (_mm_movemask_epi8(eq) == 0) {
+            // No id in common; the block with the smaller last id can't match anything further on
+            if (a[i + 3] < b[j + 3]) { i += 4; } else { j += 4; }
+            continue;
+        }
+        // Merge through (at least) one of the blocks
+        size_t iEnd = i + 4;
+        size_t jEnd = j + 4;
+        while (i < iEnd and j < jEnd) {
+            if (a[i] < b[j]) {
+                ++i;
+            } else if (b[j] < a[i]) {
+                ++j;
+            } else {
+                onMatch(i, j);
+                ++i;
+                ++j;
+            }
+        }
+    }
+#endif
+    while (i < na and j < nb) {
+        if (a[i] < b[j]) {
+            ++i;
+        } else if (b[j] < a[i]) {
+            ++j;
+        } else {
+            onMatch(i, j);
+            ++i;
+            ++j;
+        }
+    }
+}
+
+} // namespace utils
+} // namespace salmon
+
+#endif // __SORTED_INTERSECTION_HPP__
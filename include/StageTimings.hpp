@@ -0,0 +1,102 @@
+#ifndef STAGE_TIMINGS_HPP
+#define STAGE_TIMINGS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+/**
+ * The occupancy of a queue, sampled periodically while the reads are
+ * processed.
+ */
+struct QueueDepthStats {
+    std::atomic<uint64_t> numSamples{0};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> max{0};
+    std::atomic<uint64_t> numEmpty{0}; // samples at which the queue was empty
+    std::atomic<uint64_t> last{0}; // the most recent sample
+
+    inline void sample(uint64_t depth) {
+        ++numSamples;
+        last = depth;
+        sum += depth;
+        if (depth == 0) { ++numEmpty; }
+        uint64_t m = max.load();
+        while (depth > m and !max.compare_exchange_weak(m, depth)) {}
+    }
+
+    double mean() const { return numSamples > 0 ? static_cast<double>(sum) / numSamples : 0.0; }
+    // The fraction of the samples at which the queue was empty
+    double fracEmpty() const { return numSamples > 0 ? static_cast<double>(numEmpty) / numSamples : 0.0; }
+};
+
+/**
+ * Aggregate counters recording where the time of a quantification run is
+ * spent.  The per-fragment stages are timed by each thread into a
+ * LocalStageTimings, which is added to these (atomic) totals once, when
+ * the thread is done; the totals are written to aux/meta_info.json.
+ */
+struct StageTimings {
+    // Cumulative, over all mapping threads
+    std::atomic<uint64_t> parseWaitNs{0}; // time spent waiting on the read parser
+    std::atomic<uint64_t> mappingNs{0}; // time spent mapping fragments
+    std::atomic<uint64_t> assignmentNs{0}; // time spent in processMiniBatch
+    std::atomic<uint64_t> addGroupNs{0}; // time spent adding fragments to equivalence classes
+    std::atomic<uint64_t> numMiniBatches{0}; // number of mini-batches processed
+    std::atomic<uint64_t> poolWaitNs{0}; // time the (BAM) parser spent waiting for free fragments / alignment groups
+    std::atomic<uint64_t> workerWaitNs{0}; // time the (alignment-mode) quantification threads spent waiting for mini-batches
+    std::atomic<uint64_t> poolExhaustedEvents{0}; // times the (BAM) parser found no free alignment group
+    std::atomic<uint64_t> ioWaitNs{0}; // time the parsers spent waiting for the readahead threads' reads (--readahead)
+    std::atomic<uint64_t> readHitCacheLookups{0}; // reads looked up in the mapping threads' hit caches
+    std::atomic<uint64_t> readHitCacheHits{0}; // reads whose hits were found in (and copied from) them
+
+    // Sampled queue occupancy (alignment mode)
+    QueueDepthStats alnGroupQueueDepth; // parsed alignment groups waiting to be batched
+    QueueDepthStats alnGroupPoolDepth; // free alignment groups available to the parser
+    QueueDepthStats workQueueDepth; // mini-batches waiting for a quantification thread
+
+    // Wall-clock
+    double processReadsSeconds{0.0}; // time spent making passes over the reads
+    double optimizeSeconds{0.0}; // time spent in the offline (EM / VBEM) optimization
+    double biasSeconds{0.0}; // time spent re-computing (bias-corrected) effective lengths
+    uint64_t numEMIterations{0}; // number of rounds of the offline optimization
+};
+
+/**
+ * The per-thread counterpart of StageTimings.
+ */
+struct LocalStageTimings {
+    using Clock = std::chrono::steady_clock;
+
+    LocalStageTimings(StageTimings& global) : global_(global) {}
+    ~LocalStageTimings() { flush(); }
+
+    static inline Clock::time_point now() { return Clock::now(); }
+
+    static inline uint64_t elapsedNs(Clock::time_point start) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+    }
+
+    /**
+     * Add the local totals to the global ones, and reset them.
+     */
+    void flush() {
+        global_.parseWaitNs += parseWaitNs;
+        global_.mappingNs += mappingNs;
+        global_.assignmentNs += assignmentNs;
+        global_.addGroupNs += addGroupNs;
+        global_.numMiniBatches += numMiniBatches;
+        parseWaitNs = mappingNs = assignmentNs = addGroupNs = numMiniBatches = 0;
+    }
+
+    uint64_t parseWaitNs{0};
+    uint64_t mappingNs{0};
+    uint64_t assignmentNs{0};
+    uint64_t addGroupNs{0};
+    uint64_t numMiniBatches{0};
+
+  private:
+    StageTimings& global_;
+};
+
+#endif // STAGE_TIMINGS_HPP
@@ -0,0 +1,136 @@
+#ifndef __STREAMING_PCA_HPP__
+#define __STREAMING_PCA_HPP__
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <random>
+#include <vector>
+
+#include "Eigen/Dense"
+
+/**
+ * The top principal components of an n x m matrix (n samples, each a row of
+ * m features, e.g. the abundances of the transcripts), computed by
+ * randomized subspace iteration (Halko, Martinsson & Tropp, 2011) without
+ * ever holding the matrix: the rows are read in blocks, once per pass, by a
+ * RowSource, so the memory is O(m x (k + oversampling)) plus one block,
+ * independent of the number of samples.
+ *
+ * A fit makes 3 + numPowerIterations passes over the rows: one for the
+ * column means, one to sample the range of the centered matrix (which also
+ * sums its squares, for the total variance), one per power iteration, and a
+ * final one in which the components are extracted (Rayleigh-Ritz on the
+ * sampled subspace) and the scores of the samples computed.
+ */
+class StreamingPCA {
+    public:
+        /**
+         * Fills block (resizing it to numRows x m) with the rows
+         * [firstRow, firstRow + numRows); returns false if they couldn't be
+         * read, which ends the fit.
+         */
+        using RowSource = std::function<bool(size_t firstRow, size_t numRows, Eigen::MatrixXd& block)>;
+
+        StreamingPCA(uint32_t numComponents, uint32_t oversampling = 10,
+                     uint32_t numPowerIterations = 2, uint64_t seed = 271828) :
+            k_(numComponents), oversampling_(oversampling),
+            numPowerIterations_(numPowerIterations), seed_(seed) {}
+
+        /**
+         * Compute the components of the n x m matrix given by source, read
+         * blockSize rows at a time.
+         */
+        bool fit(const RowSource& source, size_t n, size_t m, size_t blockSize) {
+            if (n < 2 or m == 0 or k_ == 0) { return false; }
+            blockSize = std::max(blockSize, size_t(1));
+            size_t l = std::min({static_cast<size_t>(k_) + oversampling_, n, m});
+            k_ = static_cast<uint32_t>(std::min(static_cast<size_t>(k_), l));
+
+            Eigen::MatrixXd block;
+
+            // The column means
+            means_ = Eigen::VectorXd::Zero(m);
+            for (size_t first = 0; first < n; first += blockSize) {
+                size_t b = std::min(blockSize, n - first);
+                if (!source(first, b, block)) { return false; }
+                means_ += block.colwise().sum().transpose();
+            }
+            means_ /= static_cast<double>(n);
+
+            // Y = Xc^T Xc Omega, for a Gaussian Omega, then the power iterations
+            std::mt19937_64 gen(seed_);
+            std::normal_distribution<double> normal;
+            Eigen::MatrixXd Q(m, l);
+            for (size_t j = 0; j < l; ++j) {
+                for (size_t i = 0; i < m; ++i) { Q(i, j) = normal(gen); }
+            }
+            // The total variance is summed from the centered rows, rather than
+            // as E[x^2] - E[x]^2, which cancels catastrophically (and can go
+            // negative) when the means are large relative to the spread
+            double sumSq{0.0};
+            for (uint32_t it = 0; it <= numPowerIterations_; ++it) {
+                Eigen::MatrixXd Y = Eigen::MatrixXd::Zero(m, l);
+                for (size_t first = 0; first < n; first += blockSize) {
+                    size_t b = std::min(blockSize, n - first);
+                    if (!source(first, b, block)) { return false; }
+                    block.rowwise() -= means_.transpose();
+                    if (it == 0) { sumSq += block.squaredNorm(); }
+                    Eigen::MatrixXd Z = block * Q;
+                    Y.noalias() += block.transpose() * Z;
+                }
+                orthonormalize_(Y);
+                Q.swap(Y);
+            }
+            totalVariance_ = sumSq / static_cast<double>(n - 1);
+
+            // Project on the subspace: T = Q^T Xc^T Xc Q, keeping Z = Xc Q
+            Eigen::MatrixXd Zall(n, l);
+            Eigen::MatrixXd T = Eigen::MatrixXd::Zero(l, l);
+            for (size_t first = 0; first < n; first += blockSize) {
+                size_t b = std::min(blockSize, n - first);
+                if (!source(first, b, block)) { return false; }
+                block.rowwise() -= means_.transpose();
+                Zall.middleRows(first, b).noalias() = block * Q;
+                T.noalias() += Zall.middleRows(first, b).transpose() * Zall.middleRows(first, b);
+            }
+
+            // The eigenvalues come in increasing order
+            Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eig(T);
+            Eigen::MatrixXd W = eig.eigenvectors().rowwise().reverse().leftCols(k_);
+            Eigen::VectorXd lambda = eig.eigenvalues().reverse().head(k_);
+            variances_ = lambda.cwiseMax(0.0) / static_cast<double>(n - 1);
+            components_ = Q * W;
+            scores_ = Zall * W;
+            return true;
+        }
+
+        uint32_t numComponents() const { return k_; }
+        // The m x k loadings (one column per component, of unit length)
+        const Eigen::MatrixXd& components() const { return components_; }
+        // The n x k coordinates of the samples on the components
+        const Eigen::MatrixXd& scores() const { return scores_; }
+        // The variance explained by each component
+        const Eigen::VectorXd& variances() const { return variances_; }
+        // The total variance of the (centered) matrix, of which the components explain a part
+        double totalVariance() const { return totalVariance_; }
+        const Eigen::VectorXd& means() const { return means_; }
+
+    private:
+        static void orthonormalize_(Eigen::MatrixXd& Y) {
+            Eigen::HouseholderQR<Eigen::MatrixXd> qr(Y);
+            Y = qr.householderQ() * Eigen::MatrixXd::Identity(Y.rows(), Y.cols());
+        }
+
+        uint32_t k_;
+        uint32_t oversampling_;
+        uint32_t numPowerIterations_;
+        uint64_t seed_;
+        Eigen::VectorXd means_;
+        Eigen::MatrixXd components_;
+        Eigen::MatrixXd scores_;
+        Eigen::VectorXd variances_;
+        double totalVariance_{0.0};
+};
+
+#endif // __STREAMING_PCA_HPP__
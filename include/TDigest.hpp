@@ -0,0 +1,114 @@
+#ifndef __TDIGEST_HPP__
+#define __TDIGEST_HPP__
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+/**
+ * A (merging) t-digest: a compact sketch of a distribution, from which
+ * quantiles can be estimated, that is updated one value at a time.  The
+ * values are buffered and periodically merged into a sorted list of
+ * weighted centroids whose sizes are bounded by q(1 - q) (for the quantile
+ * q of the centroid), so that the tails are represented more finely than
+ * the bulk.  The size of the digest depends on the compression, but not on
+ * the number of values added.
+ */
+class TDigest {
+    public:
+        TDigest(double compression = 25.0) :
+            compression_(compression),
+            bufferSize_(static_cast<size_t>(compression)) {}
+
+        void add(double x) {
+            buffer_.push_back(x);
+            if (x < min_) { min_ = x; }
+            if (x > max_) { max_ = x; }
+            if (buffer_.size() >= bufferSize_) { compress(); }
+        }
+
+        /**
+         * Merge the buffered values into the centroids.
+         */
+        void compress() {
+            if (buffer_.empty()) { return; }
+            for (auto x : buffer_) { centroids_.push_back({x, 1.0}); }
+            buffer_.clear();
+            std::sort(centroids_.begin(), centroids_.end(),
+                      [](const Centroid& a, const Centroid& b) -> bool { return a.mean < b.mean; });
+
+            double total{0.0};
+            for (auto& c : centroids_) { total += c.weight; }
+
+            size_t numMerged{0};
+            double weightSoFar{0.0};
+            Centroid cur = centroids_.front();
+            for (size_t i = 1; i < centroids_.size(); ++i) {
+                auto& c = centroids_[i];
+                double proposed = cur.weight + c.weight;
+                double q = (weightSoFar + 0.5 * proposed) / total;
+                double limit = 4.0 * total * q * (1.0 - q) / compression_;
+                if (proposed <= std::max(1.0, limit)) {
+                    cur.mean += (c.mean - cur.mean) * (c.weight / proposed);
+                    cur.weight = proposed;
+                } else {
+                    weightSoFar += cur.weight;
+                    centroids_[numMerged++] = cur;
+                    cur = c;
+                }
+            }
+            centroids_[numMerged++] = cur;
+            centroids_.resize(numMerged);
+            totalWeight_ = total;
+        }
+
+        /**
+         * The estimated q-th quantile (0 <= q <= 1) of the values added.
+         */
+        double quantile(double q) {
+            compress();
+            if (centroids_.empty()) { return 0.0; }
+            if (centroids_.size() == 1) { return centroids_.front().mean; }
+
+            double target = q * totalWeight_;
+            // Each centroid is centered at the middle of its weight
+            double left = centroids_.front().weight * 0.5;
+            if (target <= left) {
+                return interpolate_(min_, centroids_.front().mean, target / left);
+            }
+            for (size_t i = 1; i < centroids_.size(); ++i) {
+                double right = left + 0.5 * (centroids_[i - 1].weight + centroids_[i].weight);
+                if (target <= right) {
+                    return interpolate_(centroids_[i - 1].mean, centroids_[i].mean,
+                                        (target - left) / (right - left));
+                }
+                left = right;
+            }
+            double rest = totalWeight_ - left;
+            return (rest > 0.0) ?
+                   interpolate_(centroids_.back().mean, max_, (target - left) / rest) : max_;
+        }
+
+        size_t numCentroids() const { return centroids_.size(); }
+
+    private:
+        struct Centroid {
+            double mean;
+            double weight;
+        };
+
+        static inline double interpolate_(double a, double b, double t) {
+            return a + (b - a) * std::min(1.0, std::max(0.0, t));
+        }
+
+        double compression_;
+        size_t bufferSize_;
+        double totalWeight_{0.0};
+        double min_{std::numeric_limits<double>::max()};
+        double max_{std::numeric_limits<double>::lowest()};
+        std::vector<Centroid> centroids_;
+        std::vector<double> buffer_;
+};
+
+#endif //__TDIGEST_HPP__
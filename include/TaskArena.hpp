@@ -0,0 +1,118 @@
+#ifndef __TASK_ARENA_HPP__
+#define __TASK_ARENA_HPP__
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "tbb/task_arena.h"
+#include "tbb/task_group.h"
+#include "tbb/task_scheduler_observer.h"
+
+namespace salmon {
+namespace threading {
+
+/**
+ * The task arena in which all of the TBB-parallel phases of a run (the EM,
+ * the Gibbs sampler and the bootstraps) execute, created once per process
+ * with a fixed concurrency.  Before, each phase constructed its own
+ * tbb::task_scheduler_init: re-initializing the scheduler at every phase,
+ * and not bounding the threads of phases that ran at once.  Work submitted
+ * to the arena from several threads shares its (numThreads) slots.
+ *
+ * The mapping and alignment-parsing threads are not tasks: they block on
+ * their queues, and would hold the slots of the arena while they do.
+ *
+ * If pinThreads is set, each worker thread of the arena is pinned to its
+ * own CPU when it first joins (see salmon::utils::pinThreads).
+ */
+class TaskArena {
+    public:
+        /**
+         * The arena of the process; the first call creates it, with the
+         * given concurrency, and later calls return it as it is.
+         */
+        static TaskArena& global(uint32_t numThreads, bool pinThreads = false) {
+            static std::once_flag created;
+            static std::unique_ptr<TaskArena> arena{nullptr};
+            std::call_once(created, [numThreads, pinThreads]() {
+                    arena.reset(new TaskArena(numThreads, pinThreads));
+                });
+            return *arena;
+        }
+
+        /** Run f in the arena, blocking until it (and the work it spawns)
+         * has finished, and return its result. */
+        template <typename ResultT, typename FuncT>
+        ResultT run(FuncT f) {
+            ResultT result;
+            arena_.execute([&result, &f]() { result = f(); });
+            return result;
+        }
+
+        /** Run each of n copies of f (called with its index) as a task of
+         * the arena, and wait for them all. */
+        template <typename FuncT>
+        void runTasks(size_t n, FuncT f) {
+            arena_.execute([n, &f]() {
+                    tbb::task_group tasks;
+                    for (size_t i = 0; i < n; ++i) { tasks.run([i, &f]() { f(i); }); }
+                    tasks.wait();
+                });
+        }
+
+        uint32_t concurrency() const { return concurrency_; }
+
+        TaskArena(const TaskArena&) = delete;
+        TaskArena& operator=(const TaskArena&) = delete;
+
+    private:
+        /** Pins each worker thread to the next CPU the first time it enters
+         * the scheduler. */
+        class PinningObserver : public tbb::task_scheduler_observer {
+            public:
+                PinningObserver() { observe(true); }
+                ~PinningObserver() { observe(false); }
+
+                void on_scheduler_entry(bool isWorker) override {
+#if defined(__linux__)
+                    static thread_local bool pinned{false};
+                    if (!isWorker or pinned) { return; }
+                    size_t numCPUs = std::thread::hardware_concurrency();
+                    if (numCPUs == 0) { return; }
+                    cpu_set_t cpus;
+                    CPU_ZERO(&cpus);
+                    CPU_SET(nextCPU_++ % numCPUs, &cpus);
+                    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus);
+                    pinned = true;
+#else
+                    (void)isWorker;
+#endif
+                }
+
+            private:
+                std::atomic<size_t> nextCPU_{0};
+        };
+
+        TaskArena(uint32_t numThreads, bool pinThreads) :
+            concurrency_(numThreads > 0 ? numThreads : 1), arena_(static_cast<int>(concurrency_)) {
+            if (pinThreads) { observer_.reset(new PinningObserver); }
+            arena_.initialize();
+        }
+
+        uint32_t concurrency_;
+        tbb::task_arena arena_;
+        std::unique_ptr<PinningObserver> observer_{nullptr};
+};
+
+} // namespace threading
+} // namespace salmon
+
+#endif // __TASK_ARENA_HPP__
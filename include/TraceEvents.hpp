@@ -0,0 +1,197 @@
+#ifndef __TRACE_EVENTS_HPP__
+#define __TRACE_EVENTS_HPP__
+
+/**
+ * Scoped trace events, recorded by each thread and written as a Chrome
+ * trace (viewable in chrome://tracing or Perfetto) to aux/trace.json.
+ * Tracing is compiled in only when SALMON_ENABLE_TRACING is defined
+ * (cmake -DENABLE_TRACING=ON); otherwise SALMON_TRACE_SCOPE expands to
+ * nothing, and costs nothing.
+ *
+ * Usage:
+ *     {
+ *         SALMON_TRACE_SCOPE("map batch");
+ *         ...
+ *     }
+ *
+ * or, for an event that ends before its scope does,
+ *     SALMON_TRACE_BEGIN(parseEvent, "parse job");
+ *     ...
+ *     SALMON_TRACE_END(parseEvent);
+ *
+ * The name of an event must be a string literal (only the pointer is
+ * recorded).
+ */
+#ifdef SALMON_ENABLE_TRACING
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace salmon {
+namespace trace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Event {
+    const char* name;
+    uint64_t startNs;
+    uint64_t durNs;
+};
+
+/**
+ * The events of a single thread.  Only the owning thread writes to the
+ * buffer, so recording an event takes no lock; once the buffer is full,
+ * the oldest events are overwritten.  The buffer outlives its thread, so
+ * that the events of the (short-lived) worker threads can be written at
+ * the end of the run.
+ */
+class ThreadBuffer {
+    public:
+        static constexpr size_t capacity = 1 << 16;
+
+        explicit ThreadBuffer(uint32_t tid) : tid_(tid), events_(capacity) {}
+
+        inline void record(const char* name, uint64_t startNs, uint64_t durNs) {
+            uint64_t n = count_.load(std::memory_order_relaxed);
+            events_[n & (capacity - 1)] = Event{name, startNs, durNs};
+            count_.store(n + 1, std::memory_order_release);
+        }
+
+        uint32_t tid() const { return tid_; }
+
+        // Call the function on each retained event, oldest first
+        template <typename FnT>
+        void forEach(FnT fn) const {
+            uint64_t n = count_.load(std::memory_order_acquire);
+            uint64_t first = (n > capacity) ? n - capacity : 0;
+            for (uint64_t i = first; i < n; ++i) { fn(events_[i & (capacity - 1)]); }
+        }
+
+    private:
+        uint32_t tid_;
+        std::vector<Event> events_;
+        std::atomic<uint64_t> count_{0};
+};
+
+/**
+ * The buffers of every thread that has recorded an event.  The mutex is
+ * taken only when a thread records its first event, and when the trace
+ * is written.
+ */
+class TraceRegistry {
+    public:
+        static TraceRegistry& instance() {
+            static TraceRegistry registry;
+            return registry;
+        }
+
+        inline ThreadBuffer& localBuffer() {
+            static thread_local ThreadBuffer* buffer{nullptr};
+            if (!buffer) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                buffers_.emplace_back(new ThreadBuffer(static_cast<uint32_t>(buffers_.size())));
+                buffer = buffers_.back().get();
+            }
+            return *buffer;
+        }
+
+        inline uint64_t nowNs() const {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - epoch_).count();
+        }
+
+        /**
+         * Write the events recorded so far in the Chrome trace event format
+         * (complete, "X", events, with timestamps in microseconds).  Events
+         * should not be recorded while the trace is being written.
+         */
+        bool write(const std::string& path) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            std::ofstream out(path);
+            if (!out.good()) { return false; }
+            out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+            bool first{true};
+            for (auto& b : buffers_) {
+                out << (first ? "" : ",\n")
+                    << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << b->tid()
+                    << ",\"args\":{\"name\":\"thread " << b->tid() << "\"}}";
+                first = false;
+                b->forEach([&out, &b](const Event& e) -> void {
+                    out << ",\n{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << b->tid()
+                        << ",\"ts\":" << (e.startNs / 1000) << '.' << pad3_(e.startNs % 1000)
+                        << ",\"dur\":" << (e.durNs / 1000) << '.' << pad3_(e.durNs % 1000) << '}';
+                });
+            }
+            out << "\n]}\n";
+            return out.good();
+        }
+
+    private:
+        TraceRegistry() : epoch_(Clock::now()) {}
+
+        static std::string pad3_(uint64_t v) {
+            std::string s = std::to_string(v);
+            return std::string(3 - s.size(), '0') + s;
+        }
+
+        Clock::time_point epoch_;
+        std::vector<std::unique_ptr<ThreadBuffer>> buffers_;
+        std::mutex mutex_;
+};
+
+/**
+ * Records an event spanning its lifetime in the buffer of the current
+ * thread.
+ */
+class ScopedEvent {
+    public:
+        explicit ScopedEvent(const char* name) :
+            name_(name), startNs_(TraceRegistry::instance().nowNs()) {}
+        ~ScopedEvent() { end(); }
+        // End the event before the end of the scope
+        void end() {
+            if (!name_) { return; }
+            auto& registry = TraceRegistry::instance();
+            registry.localBuffer().record(name_, startNs_, registry.nowNs() - startNs_);
+            name_ = nullptr;
+        }
+    private:
+        const char* name_;
+        uint64_t startNs_;
+};
+
+inline bool writeTrace(const std::string& path) { return TraceRegistry::instance().write(path); }
+
+} // namespace trace
+} // namespace salmon
+
+#define SALMON_TRACE_CONCAT_(a, b) a##b
+#define SALMON_TRACE_NAME_(line) SALMON_TRACE_CONCAT_(salmonTraceEvent_, line)
+#define SALMON_TRACE_SCOPE(name) ::salmon::trace::ScopedEvent SALMON_TRACE_NAME_(__LINE__)(name)
+#define SALMON_TRACE_BEGIN(var, name) ::salmon::trace::ScopedEvent var(name)
+#define SALMON_TRACE_END(var) var.end()
+#define SALMON_TRACE_ENABLED 1
+
+#else // !SALMON_ENABLE_TRACING
+
+#include <string>
+
+namespace salmon {
+namespace trace {
+inline bool writeTrace(const std::string&) { return true; }
+} // namespace trace
+} // namespace salmon
+
+#define SALMON_TRACE_SCOPE(name) do {} while (0)
+#define SALMON_TRACE_BEGIN(var, name) do {} while (0)
+#define SALMON_TRACE_END(var) do {} while (0)
+#define SALMON_TRACE_ENABLED 0
+
+#endif // SALMON_ENABLE_TRACING
+
+#endif // __TRACE_EVENTS_HPP__
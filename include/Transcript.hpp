@@ -5,11 +5,14 @@
 #include <cmath>
 #include <limits>
 #include <memory>
+#include <vector>
 #include "SalmonStringUtils.hpp"
 #include "SalmonUtils.hpp"
 #include "SalmonMath.hpp"
 #include "SequenceBiasModel.hpp"
 #include "FragmentLengthDistribution.hpp"
+#include "PackedSequenceStore.hpp"
+#include "TranscriptHotState.hpp"
 #include "tbb/atomic.h"
 
 class Transcript {
@@ -49,6 +52,8 @@ public:
 
     Transcript(Transcript&& other) {
         id = other.id;
+        hot_ = other.hot_;
+        hotIndex_ = other.hotIndex_;
 
         RefName = std::move(other.RefName);
         RefLength = other.RefLength;
@@ -56,7 +61,11 @@ public:
 
         SAMSequence_ = std::move(other.SAMSequence_);
         Sequence_ = std::move(other.Sequence_);
+        packedStore_ = other.packedStore_;
+        packedOffset_ = other.packedOffset_;
         GCCount_ = std::move(other.GCCount_);
+        tableGCCount_ = other.tableGCCount_;
+        tableKmers_ = other.tableKmers_;
         gcStep_ = other.gcStep_;
         gcFracLen_ = other.gcFracLen_;
         lastRegularSample_ = other.lastRegularSample_;
@@ -78,13 +87,19 @@ public:
 
     Transcript& operator=(Transcript&& other) {
         id = other.id;
+        hot_ = other.hot_;
+        hotIndex_ = other.hotIndex_;
 
         RefName = std::move(other.RefName);
         RefLength = other.RefLength;
         EffectiveLength = other.EffectiveLength;
         SAMSequence_ = std::move(other.SAMSequence_);
         Sequence_ = std::move(other.Sequence_);
+        packedStore_ = other.packedStore_;
+        packedOffset_ = other.packedOffset_;
         GCCount_ = std::move(other.GCCount_);
+        tableGCCount_ = other.tableGCCount_;
+        tableKmers_ = other.tableKmers_;
         gcStep_ = other.gcStep_;
         gcFracLen_ = other.gcFracLen_;
         lastRegularSample_ = other.lastRegularSample_;
@@ -106,16 +121,16 @@ public:
     }
 
 
-    inline double sharedCount() { return sharedCount_.load(); }
-    inline size_t uniqueCount() { return uniqueCount_.load(); }
-    inline size_t totalCount() { return totalCount_.load(); }
+    inline double sharedCount() { return sharedCountRef_().load(); }
+    inline size_t uniqueCount() { return uniqueCountRef_().load(); }
+    inline size_t totalCount() { return totalCountRef_().load(); }
 
-    inline void addUniqueCount(size_t newCount) { uniqueCount_ += newCount; }
-    inline void addTotalCount(size_t newCount) { totalCount_ += newCount; }
+    inline void addUniqueCount(size_t newCount) { uniqueCountRef_() += newCount; }
+    inline void addTotalCount(size_t newCount) { totalCountRef_() += newCount; }
 
     inline double uniqueUpdateFraction() {
-        double ambigCount = static_cast<double>(totalCount_ - uniqueCount_);
-        return uniqueCount_ / ambigCount;
+        double ambigCount = static_cast<double>(totalCountRef_() - uniqueCountRef_());
+        return uniqueCountRef_() / ambigCount;
     }
 
     inline char charBaseAt(size_t idx,
@@ -123,6 +138,24 @@ public:
         return salmon::stringtools::samCodeToChar[baseAt(idx, dir)];
     }
 
+    /**
+     * The 2-bit code (A = 0, C = 1, G = 2, T = 3) of the base at idx, read
+     * from the shared packed sequence store (see setPackedSequence).
+     */
+    inline uint8_t twoBitBaseAt(size_t idx,
+                                salmon::stringtools::strand dir = salmon::stringtools::strand::forward) const {
+        uint8_t b = packedStore_->baseAt(packedOffset_ + idx);
+        return (dir == salmon::stringtools::strand::forward) ? b : (0x3 - b);
+    }
+
+    /**
+     * The k bases (k <= 32) of the forward strand starting at idx, packed
+     * 2 bits per base, with the first base in the most significant bits.
+     */
+    inline uint64_t kmerAt(size_t idx, uint32_t k) const {
+        return packedStore_->kmerAt(packedOffset_ + idx, k);
+    }
+
     inline uint8_t baseAt(size_t idx,
                           salmon::stringtools::strand dir = salmon::stringtools::strand::forward) {
         using salmon::stringtools::strand;
@@ -152,42 +185,42 @@ public:
     }
 
     inline void setSharedCount(double sc) {
-        sharedCount_.store(sc);
+        sharedCountRef_().store(sc);
     }
 
     inline void addSharedCount(double sc) {
-	    salmon::utils::incLoop(sharedCount_, sc);
+	    salmon::utils::incLoop(sharedCountRef_(), sc);
     }
 
     inline void setLastTimestepUpdated(uint64_t currentTimestep) {
-        uint64_t oldTimestep = lastTimestepUpdated_;
+        uint64_t oldTimestep = lastTimestepUpdatedRef_();
         if (currentTimestep > oldTimestep) {
-            lastTimestepUpdated_ = currentTimestep;
+            lastTimestepUpdatedRef_() = currentTimestep;
         }
     }
 
     inline void addBias(double bias) {
-	salmon::utils::incLoopLog(avgMassBias_, bias);
+	salmon::utils::incLoopLog(avgMassBiasRef_(), bias);
     }
 
     inline void addMass(double mass) {
-	salmon::utils::incLoopLog(mass_, mass);
+	salmon::utils::incLoopLog(massRef_(), mass);
     }
 
     inline void setMass(double mass) {
-        mass_.store(mass);
+        massRef_().store(mass);
     }
 
     inline double mass(bool withPrior=true) {
-        return (withPrior) ? salmon::math::logAdd(priorMass_, mass_.load()) : mass_.load();
+        return (withPrior) ? salmon::math::logAdd(priorMass_, massRef_().load()) : massRef_().load();
     }
 
     void setActive() { active_ = true; }
     bool getActive() { return active_; }
 
     inline double bias() {
-        return (totalCount_.load() > 0) ?
-                    avgMassBias_ - std::log(totalCount_.load()) :
+        return (totalCountRef_().load() > 0) ?
+                    avgMassBiasRef_() - std::log(totalCountRef_().load()) :
                     salmon::math::LOG_1;
     }
 
@@ -242,7 +275,7 @@ public:
      * Return the cached value for the log of the effective length.
      */
     double getCachedLogEffectiveLength() {
-        return cachedEffectiveLength_.load();
+        return cachedEffectiveLengthRef_().load();
     }
 
     void updateEffectiveLength(
@@ -251,7 +284,7 @@ public:
             size_t minVal,
             size_t maxVal) {
         double cel = computeLogEffectiveLength(logPMF, logFLDMean, minVal, maxVal);
-        cachedEffectiveLength_.store(cel);
+        cachedEffectiveLengthRef_().store(cel);
     }
 
     /**
@@ -279,7 +312,7 @@ public:
     */
 
     double perBasePrior() { return std::exp(logPerBasePrior_); }
-    inline size_t lastTimestepUpdated() { return lastTimestepUpdated_.load(); }
+    inline size_t lastTimestepUpdated() { return lastTimestepUpdatedRef_().load(); }
 
     void lengthClassIndex(uint32_t ind) { lengthClassIndex_ = ind; }
     uint32_t lengthClassIndex() { return lengthClassIndex_; }
@@ -292,12 +325,21 @@ public:
         return hasAnchorFragment_.load();
     }
 
+    // Fill counts with the cumulative GC count at each position of this
+    // transcript, i.e. the values from which gcFrac() is computed, so that
+    // the GC fractions of many intervals can be computed without
+    // re-interpolating the (possibly sampled) counts.
+    void fillGCCounts(std::vector<double>& counts) const {
+        counts.resize(RefLength);
+        for (int32_t p = 0; p < static_cast<int32_t>(RefLength); ++p) { counts[p] = gcCount_(p); }
+    }
+
     // Return the fractional GC content along this transcript
     // in the interval [s,e] (note; this interval is closed on both sides).
     inline int32_t gcFrac(int32_t s, int32_t e) const {
         if (gcStep_ == 1) {
-            auto cs = GCCount_[s];
-            auto ce = GCCount_[e];
+            auto cs = gcCounts_()[s];
+            auto ce = gcCounts_()[e];
             return std::lrint((100.0 * (ce - cs)) / (e - s + 1));
         } else {
             auto cs = gcCountInterp_(s);
@@ -342,6 +384,35 @@ public:
         if (needGC) { computeGCContent_(gcSampFactor); }
     }
 
+    // The sequence of this transcript is the RefLength bases starting at
+    // offset in store, which must outlive the transcript.
+    void setPackedSequence(const PackedSequenceStore* store, uint64_t offset) {
+        packedStore_ = store;
+        packedOffset_ = offset;
+    }
+
+    bool hasPackedSequence() const { return packedStore_ != nullptr; }
+
+    /**
+     * Use the tables of this transcript precomputed when the index was built
+     * (see TranscriptBiasTables), which must outlive the transcript: gcCounts
+     * (if not null) in place of the (unsampled) GC counts computeGCContent_
+     * would compute, and kmers for the k-mer indices of the sequence bias
+     * model (see biasKmers()).
+     */
+    void setBiasTables(const uint32_t* gcCounts, const uint16_t* kmers) {
+        tableGCCount_ = gcCounts;
+        tableKmers_ = kmers;
+        if (gcCounts) {
+            GCCount_.clear();
+            GCCount_.shrink_to_fit();
+            gcStep_ = 1;
+        }
+    }
+
+    // The precomputed k-mer indices of this transcript (nullptr if there are none)
+    const uint16_t* biasKmers() const { return tableKmers_; }
+
     const char* Sequence() const {
         return Sequence_.get();
     }
@@ -351,6 +422,24 @@ public:
     }
 
 
+    /**
+     * Keep the state updated during quantification (the mass, counts,
+     * cached effective length, ...) in slot i of state rather than in this
+     * Transcript, starting from its current values.
+     */
+    void bindHotState(TranscriptHotState* state, uint32_t i) {
+        state->mass[i].store(massRef_().load());
+        state->sharedCount[i].store(sharedCountRef_().load());
+        state->cachedEffectiveLength[i].store(cachedEffectiveLengthRef_().load());
+        state->avgMassBias[i].store(avgMassBiasRef_().load());
+        state->uniqueCount[i].store(uniqueCountRef_().load());
+        state->totalCount[i].store(totalCountRef_().load());
+        state->lastTimestepUpdated[i].store(lastTimestepUpdatedRef_().load());
+        state->lastUpdate[i].store(lastUpdateRef_().load());
+        hot_ = state;
+        hotIndex_ = i;
+    }
+
     std::string RefName;
     uint32_t RefLength;
     double EffectiveLength;
@@ -362,13 +451,32 @@ public:
     double sharedCounts{0.0};
 
 private:
+    // The state updated during quantification: in the bound
+    // TranscriptHotState if there is one, and otherwise in this Transcript
+    inline tbb::atomic<double>& massRef_() { return hot_ ? hot_->mass[hotIndex_] : mass_; }
+    inline tbb::atomic<double>& sharedCountRef_() { return hot_ ? hot_->sharedCount[hotIndex_] : sharedCount_; }
+    inline tbb::atomic<double>& cachedEffectiveLengthRef_() {
+        return hot_ ? hot_->cachedEffectiveLength[hotIndex_] : cachedEffectiveLength_;
+    }
+    inline tbb::atomic<double>& avgMassBiasRef_() { return hot_ ? hot_->avgMassBias[hotIndex_] : avgMassBias_; }
+    inline std::atomic<size_t>& uniqueCountRef_() { return hot_ ? hot_->uniqueCount[hotIndex_] : uniqueCount_; }
+    inline std::atomic<size_t>& totalCountRef_() { return hot_ ? hot_->totalCount[hotIndex_] : totalCount_; }
+    inline std::atomic<size_t>& lastTimestepUpdatedRef_() {
+        return hot_ ? hot_->lastTimestepUpdated[hotIndex_] : lastTimestepUpdated_;
+    }
+    inline tbb::atomic<size_t>& lastUpdateRef_() { return hot_ ? hot_->lastUpdate[hotIndex_] : lastUpdate_; }
+
     // NOTE: Is it worth it to check if we have GC here?
     // we should never access these without bias correction.
     inline double gcCount_(int32_t p) {
-        return (gcStep_ == 1) ? static_cast<double>(GCCount_[p]) : gcCountInterp_(p);
+        return (gcStep_ == 1) ? static_cast<double>(gcCounts_()[p]) : gcCountInterp_(p);
     }
     inline double gcCount_(int32_t p) const {
-        return (gcStep_ == 1) ? static_cast<double>(GCCount_[p]) : gcCountInterp_(p);
+        return (gcStep_ == 1) ? static_cast<double>(gcCounts_()[p]) : gcCountInterp_(p);
+    }
+    // The unsampled GC counts, precomputed or not
+    inline const uint32_t* gcCounts_() const {
+        return tableGCCount_ ? tableGCCount_ : GCCount_.data();
     }
 
     inline double gcCountInterp_(int32_t p) const {
@@ -454,6 +562,12 @@ private:
     std::unique_ptr<const char, void(*)(const char*)> Sequence_ =
         std::unique_ptr<const char, void(*)(const char*)> (nullptr, [](const char*){});
 
+    const PackedSequenceStore* packedStore_{nullptr};
+    uint64_t packedOffset_{0};
+
+    TranscriptHotState* hot_{nullptr};
+    uint32_t hotIndex_{0};
+
     std::atomic<size_t> uniqueCount_;
     std::atomic<size_t> totalCount_;
     // The most recent timestep at which this transcript's mass was updated.
@@ -476,6 +590,22 @@ private:
     double gcFracLen_{0.0};
     uint32_t lastRegularSample_{0};
     std::vector<uint32_t> GCCount_;
+    // The precomputed GC counts and k-mer indices (see setBiasTables)
+    const uint32_t* tableGCCount_{nullptr};
+    const uint16_t* tableKmers_{nullptr};
 };
 
+/**
+ * Create the hot state of the transcripts, and bind each transcript (by
+ * its position) to it; the transcripts must not be added to or removed
+ * afterwards.
+ */
+inline std::unique_ptr<TranscriptHotState> bindTranscriptHotState(std::vector<Transcript>& transcripts) {
+    std::unique_ptr<TranscriptHotState> state(new TranscriptHotState(transcripts.size()));
+    for (size_t i = 0; i < transcripts.size(); ++i) {
+        transcripts[i].bindHotState(state.get(), static_cast<uint32_t>(i));
+    }
+    return state;
+}
+
 #endif //TRANSCRIPT
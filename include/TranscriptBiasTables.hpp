@@ -0,0 +1,210 @@
+#ifndef __TRANSCRIPT_BIAS_TABLES_HPP__
+#define __TRANSCRIPT_BIAS_TABLES_HPP__
+
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <boost/filesystem.hpp>
+
+#include "RollingKmerIndex.hpp"
+
+/**
+ * The transcript-side tables of the bias models, precomputed when the index
+ * is built (salmon index --biasTables) since they depend only on the
+ * reference: for each position of each transcript, the cumulative GC count
+ * up to and including it (what Transcript::computeGCContent_ would compute)
+ * and the (forward) index of the k-mer starting at it (what
+ * RollingKmerIndex::indicesOf would compute).  The file is mapped, rather
+ * than read, by quant, so that its pages are shared by all of the runs on a
+ * machine that use the same index.
+ *
+ * The layout of the file (in host byte order) is
+ *
+ *   magic[8] version:u32 k:u32 numTranscripts:u64 numBases:u64
+ *   offsets:u64[numTranscripts + 1]  (of the first base of each transcript)
+ *   gcCounts:u32[numBases]
+ *   kmers:u16[numBases]              (noKmer past the last k-mer, or for a
+ *                                     k-mer with a base other than ACGT)
+ *
+ * The transcripts are those of the index, followed by those of each of its
+ * extensions, in the order in which quant numbers them.
+ */
+class TranscriptBiasTables {
+    public:
+        static const char* fileName() { return "bias_tables.bin"; }
+        static constexpr uint32_t version = 1;
+        // The largest k whose k-mer indices fit below noKmer
+        static constexpr uint32_t maxK = 7;
+        static constexpr uint16_t noKmer = 0xFFFF;
+
+        TranscriptBiasTables() = default;
+        TranscriptBiasTables(const TranscriptBiasTables&) = delete;
+        TranscriptBiasTables& operator=(const TranscriptBiasTables&) = delete;
+
+        ~TranscriptBiasTables() {
+            if (data_) { ::munmap(const_cast<char*>(data_), size_); }
+        }
+
+        /**
+         * Write the tables of the transcripts whose sequences are seqs (of
+         * lengths lens) for k-mers of length k to indexDir.  Returns false
+         * (with a message in err) if the file can't be written.
+         */
+        static bool write(const boost::filesystem::path& indexDir, uint32_t k,
+                          const std::vector<const char*>& seqs, const std::vector<uint32_t>& lens,
+                          std::string& err) {
+            if (k == 0 or k > maxK) {
+                err = "the bias tables support k-mers of length 1 to " + std::to_string(maxK);
+                return false;
+            }
+            auto path = indexDir / fileName();
+            std::ofstream out(path.string(), std::ios::binary);
+            if (!out.good()) {
+                err = "couldn't write " + path.string();
+                return false;
+            }
+            std::vector<uint64_t> offsets(seqs.size() + 1, 0);
+            for (size_t t = 0; t < seqs.size(); ++t) { offsets[t + 1] = offsets[t] + lens[t]; }
+            uint64_t numTxps = seqs.size();
+            uint64_t numBases = offsets.back();
+
+            out.write(magic_(), magicBytes_);
+            write_(out, version);
+            write_(out, k);
+            write_(out, numTxps);
+            write_(out, numBases);
+            out.write(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(uint64_t));
+
+            std::vector<uint32_t> gc;
+            for (size_t t = 0; t < seqs.size(); ++t) {
+                gc.assign(lens[t], 0);
+                uint32_t totGC{0};
+                for (uint32_t i = 0; i < lens[t]; ++i) {
+                    auto c = std::toupper(seqs[t][i]);
+                    if (c == 'G' or c == 'C') { ++totGC; }
+                    gc[i] = totGC;
+                }
+                out.write(reinterpret_cast<const char*>(gc.data()), gc.size() * sizeof(uint32_t));
+            }
+
+            std::vector<uint16_t> kmers;
+            RollingKmerIndex window(k);
+            for (size_t t = 0; t < seqs.size(); ++t) {
+                // (by value, as noKmer has no out-of-class definition)
+                kmers.assign(lens[t], static_cast<uint16_t>(noKmer));
+                window.reset();
+                for (uint32_t i = 0; i < lens[t]; ++i) {
+                    window.push(seqs[t][i]);
+                    if (window.valid()) { kmers[i + 1 - k] = static_cast<uint16_t>(window.fw()); }
+                }
+                out.write(reinterpret_cast<const char*>(kmers.data()), kmers.size() * sizeof(uint16_t));
+            }
+
+            out.close();
+            if (out.fail()) {
+                err = "couldn't write " + path.string();
+                return false;
+            }
+            return true;
+        }
+
+        /**
+         * Map the tables of the index in indexDir.  Returns false if the
+         * index has none, or (with a message in err) if they can't be read.
+         */
+        bool open(const boost::filesystem::path& indexDir, std::string& err) {
+            auto path = indexDir / fileName();
+            if (!boost::filesystem::exists(path)) { return false; }
+            int fd = ::open(path.string().c_str(), O_RDONLY);
+            if (fd < 0) { err = "could not open " + path.string(); return false; }
+            struct stat st;
+            if (::fstat(fd, &st) != 0) { ::close(fd); err = "could not stat " + path.string(); return false; }
+            size_t size = static_cast<size_t>(st.st_size);
+            if (size < headerBytes_) { ::close(fd); err = path.string() + " is truncated"; return false; }
+            void* addr = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (addr == MAP_FAILED) { err = "could not map " + path.string(); return false; }
+            data_ = static_cast<const char*>(addr);
+            size_ = size;
+
+            uint32_t fileVersion;
+            std::memcpy(&fileVersion, data_ + magicBytes_, sizeof(uint32_t));
+            std::memcpy(&k_, data_ + magicBytes_ + 4, sizeof(uint32_t));
+            std::memcpy(&numTxps_, data_ + magicBytes_ + 8, sizeof(uint64_t));
+            std::memcpy(&numBases_, data_ + magicBytes_ + 16, sizeof(uint64_t));
+            if (std::memcmp(data_, magic_(), magicBytes_) != 0 or fileVersion != version) {
+                err = path.string() + " is not a (version " + std::to_string(version) + ") bias table file";
+                return false;
+            }
+            uint64_t expected = headerBytes_ + (numTxps_ + 1) * sizeof(uint64_t) +
+                                numBases_ * (sizeof(uint32_t) + sizeof(uint16_t));
+            if (size != expected) {
+                err = path.string() + " is truncated";
+                return false;
+            }
+            offsets_ = reinterpret_cast<const uint64_t*>(data_ + headerBytes_);
+            gcCounts_ = reinterpret_cast<const uint32_t*>(offsets_ + numTxps_ + 1);
+            kmers_ = reinterpret_cast<const uint16_t*>(gcCounts_ + numBases_);
+            return true;
+        }
+
+        uint32_t k() const { return k_; }
+        uint64_t numTranscripts() const { return numTxps_; }
+        uint64_t length(uint64_t t) const { return offsets_[t + 1] - offsets_[t]; }
+        const uint32_t* gcCounts(uint64_t t) const { return gcCounts_ + offsets_[t]; }
+        const uint16_t* kmers(uint64_t t) const { return kmers_ + offsets_[t]; }
+
+        /**
+         * Fill fw and rc as RollingKmerIndex::indicesOf(s, len, k, fw, rc)
+         * would, from the k-mer table kmers of the sequence s.
+         */
+        static void indicesOf(const uint16_t* kmers, size_t len, uint32_t k,
+                              std::vector<uint32_t>& fw, std::vector<uint32_t>& rc) {
+            size_t n = (len >= k) ? len - k + 1 : 0;
+            fw.resize(n);
+            rc.resize(n);
+            uint32_t mask = (uint32_t(1) << (2 * k)) - 1;
+            for (size_t i = 0; i < n; ++i) {
+                uint32_t f = kmers[i];
+                // The reverse complement: complement the bases, then
+                // reverse the order of the (2-bit) bases
+                uint32_t r = ~f & mask;
+                r = ((r >> 2) & 0x33333333) | ((r & 0x33333333) << 2);
+                r = ((r >> 4) & 0x0F0F0F0F) | ((r & 0x0F0F0F0F) << 4);
+                r = ((r >> 8) & 0x00FF00FF) | ((r & 0x00FF00FF) << 8);
+                r = ((r >> 16) | (r << 16)) >> (32 - 2 * k);
+                bool valid = (f != noKmer);
+                fw[i] = valid ? f : RollingKmerIndex::invalidIndex;
+                rc[i] = valid ? r : RollingKmerIndex::invalidIndex;
+            }
+        }
+
+    private:
+        template <typename T>
+        static void write_(std::ofstream& out, T v) { out.write(reinterpret_cast<const char*>(&v), sizeof(T)); }
+
+        // The 8 bytes (with its terminator) that start the file
+        static const char* magic_() { return "SLMBIAS"; }
+        static constexpr size_t magicBytes_ = 8;
+        static constexpr size_t headerBytes_ = magicBytes_ + 4 + 4 + 8 + 8;
+
+        const char* data_{nullptr};
+        size_t size_{0};
+        uint32_t k_{0};
+        uint64_t numTxps_{0};
+        uint64_t numBases_{0};
+        const uint64_t* offsets_{nullptr};
+        const uint32_t* gcCounts_{nullptr};
+        const uint16_t* kmers_{nullptr};
+};
+
+#endif //__TRANSCRIPT_BIAS_TABLES_HPP__
@@ -98,6 +98,11 @@ public:
         return ( it == _transcriptNames.end() ) ? INVALID : ( distance(_transcriptNames.begin(), it) );
     }
 
+    // The (sorted) names of the transcripts, indexed by their ids
+    const NameVector& transcriptNames() const {
+        return _transcriptNames;
+    }
+
     Size numTranscripts() {
         return _transcriptNames.size();
     }
@@ -3,16 +3,105 @@
 
 #include <boost/functional/hash.hpp>
 
-#include <vector>
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
+#include <vector>
+
+/**
+ * The (sorted) transcript ids of an equivalence class label.  Most labels
+ * have only a few transcripts, so up to inlineCapacity ids are kept in the
+ * label itself, in the space a std::vector's header would take, and only
+ * longer labels have a block on the heap.  The ids are contiguous either
+ * way, so the label is hashed and compared as a single block of memory.
+ * Re-assigning a label keeps its heap block (if it has one), as
+ * FragmentScratch re-uses the label of each fragment.
+ */
+class TranscriptLabel {
+    public:
+        static constexpr uint32_t inlineCapacity = 4;
+
+        TranscriptLabel() {}
+        TranscriptLabel(const std::vector<uint32_t>& txps) { assign(txps.begin(), txps.end()); }
+        TranscriptLabel(const TranscriptLabel& other) { assign(other.begin(), other.end()); }
+        TranscriptLabel(TranscriptLabel&& other) { steal_(other); }
+        ~TranscriptLabel() { release_(); }
+
+        TranscriptLabel& operator=(const TranscriptLabel& other) {
+            if (this != &other) { assign(other.begin(), other.end()); }
+            return *this;
+        }
+
+        TranscriptLabel& operator=(TranscriptLabel&& other) {
+            if (this != &other) {
+                release_();
+                steal_(other);
+            }
+            return *this;
+        }
+
+        template <typename It>
+        void assign(It first, It last) {
+            size_t n = static_cast<size_t>(std::distance(first, last));
+            if (n > capacity_) {
+                release_();
+                heap_ = new uint32_t[n];
+                capacity_ = static_cast<uint32_t>(n);
+            }
+            std::copy(first, last, data());
+            size_ = static_cast<uint32_t>(n);
+        }
+
+        uint32_t* data() { return onHeap_() ? heap_ : inline_; }
+        const uint32_t* data() const { return onHeap_() ? heap_ : inline_; }
+        size_t size() const { return size_; }
+        bool empty() const { return size_ == 0; }
+        const uint32_t* begin() const { return data(); }
+        const uint32_t* end() const { return data() + size_; }
+        uint32_t operator[](size_t i) const { return data()[i]; }
+
+        friend bool operator==(const TranscriptLabel& lhs, const TranscriptLabel& rhs) {
+            return lhs.size_ == rhs.size_ and
+                std::memcmp(lhs.data(), rhs.data(), lhs.size_ * sizeof(uint32_t)) == 0;
+        }
+
+    private:
+        bool onHeap_() const { return capacity_ > inlineCapacity; }
+
+        void release_() {
+            if (onHeap_()) { delete[] heap_; }
+            capacity_ = inlineCapacity;
+            size_ = 0;
+        }
+
+        // Take the ids of other (which must not own a heap block of this one's), leaving it empty
+        void steal_(TranscriptLabel& other) {
+            size_ = other.size_;
+            capacity_ = other.capacity_;
+            if (other.onHeap_()) {
+                heap_ = other.heap_;
+            } else {
+                std::copy(other.inline_, other.inline_ + other.size_, inline_);
+            }
+            other.capacity_ = inlineCapacity;
+            other.size_ = 0;
+        }
+
+        uint32_t size_{0};
+        uint32_t capacity_{inlineCapacity};
+        union {
+            uint32_t inline_[inlineCapacity];
+            uint32_t* heap_;
+        };
+};
 
 class TranscriptGroup {
     public:
         TranscriptGroup();
-        TranscriptGroup(std::vector<uint32_t> txpsIn);
+        TranscriptGroup(const std::vector<uint32_t>& txpsIn);
 
 	TranscriptGroup(
-        	std::vector<uint32_t> txpsIn,
+        	const std::vector<uint32_t>& txpsIn,
 		    size_t hashIn);
 
         TranscriptGroup(TranscriptGroup&& other);
@@ -26,7 +115,11 @@ class TranscriptGroup {
 
         void setValid(bool v) const;
 
-        std::vector<uint32_t> txps;
+        // Replace the label with `txpsIn` (re-using the existing
+        // storage) and recompute the hash.
+        void assign(const std::vector<uint32_t>& txpsIn);
+
+        TranscriptLabel txps;
     	size_t hash;
         double totalMass;
         mutable bool valid;
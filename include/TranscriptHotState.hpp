@@ -0,0 +1,82 @@
+#ifndef __TRANSCRIPT_HOT_STATE_HPP__
+#define __TRANSCRIPT_HOT_STATE_HPP__
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+#include "tbb/atomic.h"
+
+/**
+ * A fixed-size array whose storage begins on a cache line and is padded to
+ * a whole number of cache lines, so that it shares no line with any other
+ * allocation.  The elements need not be copyable or movable (e.g. atomics).
+ */
+template <typename T>
+class CacheAlignedArray {
+    public:
+        static constexpr size_t cacheLineSize = 64;
+
+        explicit CacheAlignedArray(size_t n) : size_(n) {
+            size_t bytes = ((n * sizeof(T) + cacheLineSize - 1) / cacheLineSize) * cacheLineSize;
+            void* p{nullptr};
+            if (posix_memalign(&p, cacheLineSize, bytes > 0 ? bytes : cacheLineSize) != 0) {
+                throw std::bad_alloc();
+            }
+            data_ = static_cast<T*>(p);
+            for (size_t i = 0; i < size_; ++i) { new (&data_[i]) T(); }
+        }
+
+        ~CacheAlignedArray() {
+            for (size_t i = 0; i < size_; ++i) { data_[i].~T(); }
+            std::free(data_);
+        }
+
+        CacheAlignedArray(const CacheAlignedArray&) = delete;
+        CacheAlignedArray& operator=(const CacheAlignedArray&) = delete;
+
+        inline T& operator[](size_t i) { return data_[i]; }
+        inline const T& operator[](size_t i) const { return data_[i]; }
+        inline T* data() { return data_; }
+        size_t size() const { return size_; }
+
+    private:
+        size_t size_;
+        T* data_{nullptr};
+};
+
+/**
+ * The per-transcript state that the quantification threads update during
+ * the online phase, stored as a struct of (cache-line aligned) arrays
+ * indexed by transcript id, rather than inside of each Transcript, so that
+ * the Transcript objects are only read once loaded, and each array is dense.
+ * The arrays are not padded per transcript: the entries of neighbouring
+ * transcripts share cache lines (8 to a line), and updates to them from
+ * different threads still contend for those lines.  Padding each entry to
+ * its own line would multiply the size of the state by 8.
+ *
+ * The state is owned by the ReadExperiment / AlignmentLibrary, which binds
+ * its transcripts to it once they've been loaded (see
+ * Transcript::bindHotState); the accessors of an unbound Transcript use
+ * its own members.
+ */
+struct TranscriptHotState {
+    explicit TranscriptHotState(size_t n) :
+        mass(n), sharedCount(n), cachedEffectiveLength(n), avgMassBias(n),
+        uniqueCount(n), totalCount(n), lastTimestepUpdated(n), lastUpdate(n) {}
+
+    size_t size() const { return mass.size(); }
+
+    CacheAlignedArray<tbb::atomic<double>> mass;
+    CacheAlignedArray<tbb::atomic<double>> sharedCount;
+    CacheAlignedArray<tbb::atomic<double>> cachedEffectiveLength;
+    CacheAlignedArray<tbb::atomic<double>> avgMassBias;
+    CacheAlignedArray<std::atomic<size_t>> uniqueCount;
+    CacheAlignedArray<std::atomic<size_t>> totalCount;
+    // The most recent timestep at which each transcript's mass was updated
+    CacheAlignedArray<std::atomic<size_t>> lastTimestepUpdated;
+    CacheAlignedArray<tbb::atomic<size_t>> lastUpdate;
+};
+
+#endif // __TRANSCRIPT_HOT_STATE_HPP__
@@ -0,0 +1,125 @@
+#ifndef __TRANSCRIPT_NAME_INDEX_HPP__
+#define __TRANSCRIPT_NAME_INDEX_HPP__
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "xxhash.h"
+
+/**
+ * The names of a set of transcripts, packed one after another into a single
+ * arena, with a flat (open-addressing, linear-probing) hash from name to id
+ * over it.  Looking a name up takes a pointer and a length, so that a name
+ * can be found where it already is (e.g. the first word of a FASTA header, or
+ * a field of a line) without first being copied into a std::string, and the
+ * index itself costs two allocations rather than one (or more) per name.
+ *
+ * The index is built once, from names given in order of transcript id, and
+ * can then be read concurrently.  If a name occurs more than once, find()
+ * returns its first id.
+ */
+class TranscriptNameIndex {
+    public:
+        static constexpr uint32_t INVALID = std::numeric_limits<uint32_t>::max();
+
+        // A name in the arena (valid for as long as the index is)
+        struct NameRef {
+            const char* data;
+            size_t size;
+            std::string str() const { return std::string(data, size); }
+        };
+
+        TranscriptNameIndex() : offsets_(1, 0) {}
+
+        /**
+         * The index of the names of the transcripts of refs (anything with
+         * a std::string RefName), in order, whose ids are their positions.
+         */
+        template <typename TranscriptVecT>
+        static TranscriptNameIndex fromTranscripts(const TranscriptVecT& refs) {
+            using T = typename TranscriptVecT::value_type;
+            return build_(refs, [](const T& t) -> const std::string& { return t.RefName; });
+        }
+
+        // The index of names, whose ids are their positions
+        static TranscriptNameIndex fromNames(const std::vector<std::string>& names) {
+            return build_(names, [](const std::string& n) -> const std::string& { return n; });
+        }
+
+        size_t size() const { return offsets_.size() - 1; }
+
+        NameRef name(uint32_t id) const {
+            return NameRef{arena_.data() + offsets_[id], static_cast<size_t>(offsets_[id + 1] - offsets_[id])};
+        }
+
+        // The id of the name of len bytes at name; INVALID if it isn't one
+        uint32_t find(const char* name, size_t len) const {
+            if (slots_.empty()) { return INVALID; }
+            uint64_t h = hash_(name, len);
+            uint32_t tag = static_cast<uint32_t>(h >> 32);
+            for (size_t s = h & mask_; slots_[s] != INVALID; s = (s + 1) & mask_) {
+                uint32_t id = slots_[s];
+                if (tags_[s] == tag and matches_(id, name, len)) { return id; }
+            }
+            return INVALID;
+        }
+
+        uint32_t find(const std::string& name) const { return find(name.data(), name.size()); }
+
+    private:
+        static inline uint64_t hash_(const char* name, size_t len) {
+            return XXH64(name, len, 0);
+        }
+
+        inline bool matches_(uint32_t id, const char* name, size_t len) const {
+            uint64_t b = offsets_[id];
+            return (offsets_[id + 1] - b == len) and std::memcmp(arena_.data() + b, name, len) == 0;
+        }
+
+        template <typename VecT, typename NameFn>
+        static TranscriptNameIndex build_(const VecT& v, NameFn nameOf) {
+            TranscriptNameIndex idx;
+            size_t totalBytes{0};
+            for (auto& e : v) { totalBytes += nameOf(e).size(); }
+            idx.arena_.reserve(totalBytes);
+            idx.offsets_.reserve(v.size() + 1);
+            for (auto& e : v) {
+                const std::string& n = nameOf(e);
+                idx.arena_.insert(idx.arena_.end(), n.begin(), n.end());
+                idx.offsets_.push_back(idx.arena_.size());
+            }
+            idx.hashNames_();
+            return idx;
+        }
+
+        // Hash the names into a table of (at least) twice as many slots
+        void hashNames_() {
+            size_t n = size();
+            size_t numSlots{16};
+            while (numSlots < 2 * n) { numSlots <<= 1; }
+            mask_ = numSlots - 1;
+            slots_.assign(numSlots, uint32_t(INVALID));
+            tags_.assign(numSlots, 0);
+            for (uint32_t id = 0; id < n; ++id) {
+                auto nm = name(id);
+                if (find(nm.data, nm.size) != INVALID) { continue; }
+                uint64_t h = hash_(nm.data, nm.size);
+                size_t s = h & mask_;
+                while (slots_[s] != INVALID) { s = (s + 1) & mask_; }
+                slots_[s] = id;
+                tags_[s] = static_cast<uint32_t>(h >> 32);
+            }
+        }
+
+        std::vector<char> arena_;
+        std::vector<uint64_t> offsets_; // name i is arena_[offsets_[i], offsets_[i + 1])
+        std::vector<uint32_t> slots_; // the id in each slot of the table, or INVALID
+        std::vector<uint32_t> tags_; // the high bits of the hash of the name in each slot
+        size_t mask_{0};
+};
+
+#endif // __TRANSCRIPT_NAME_INDEX_HPP__
@@ -0,0 +1,143 @@
+#ifndef __UMI_DEDUPLICATOR_HPP__
+#define __UMI_DEDUPLICATOR_HPP__
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "SalmonSpinLock.hpp"
+
+/**
+ * The distinct UMIs observed in each equivalence class, with which an
+ * EquivalenceClassBuilder replaces the number of fragments of a class by
+ * the number of molecules (salmon quant --umiTag).  Fragments with the same
+ * UMI and the same label are PCR duplicates of one molecule, so only the
+ * (class, UMI) pairs are kept, in a table sharded by the label hash; the
+ * input needn't be sorted, and duplicates are found in the same pass that
+ * builds the classes.
+ *
+ * With collapseOneEdit, UMIs that differ by one substitution from a UMI
+ * observed at least (about) twice as often are taken for sequencing
+ * errors of it, and merged into its molecule (the "directional" method of
+ * UMI-tools).  Fragments without a (valid) UMI each count as a molecule.
+ *
+ * UMIs are packed 2 bits per base, below their length, so they can be at
+ * most maxUMILength bases long.
+ */
+class UMIDeduplicator {
+    public:
+        static constexpr uint32_t maxUMILength = 28;
+
+        explicit UMIDeduplicator(bool collapseOneEdit, size_t numShards = 256) :
+            collapseOneEdit_(collapseOneEdit), shards_(numShards) {
+            for (auto& s : shards_) { s.reset(new Shard); }
+        }
+
+        /**
+         * Pack the UMI umi[0, len) into code; false if it's too long, or has
+         * a base other than A, C, G or T.
+         */
+        static bool encode(const char* umi, size_t len, uint64_t& code) {
+            if (len == 0 or len > maxUMILength) { return false; }
+            uint64_t bits{0};
+            for (size_t i = 0; i < len; ++i) {
+                uint64_t c;
+                switch (umi[i]) {
+                    case 'A': case 'a': c = 0; break;
+                    case 'C': case 'c': c = 1; break;
+                    case 'G': case 'g': c = 2; break;
+                    case 'T': case 't': c = 3; break;
+                    default: return false;
+                }
+                bits = (bits << 2) | c;
+            }
+            code = (static_cast<uint64_t>(len) << lengthShift_) | bits;
+            return true;
+        }
+
+        /**
+         * Record a fragment of the class whose label hashes to labelHash;
+         * with its UMI if hasUMI.  Can be called from any thread.
+         */
+        void add(uint64_t labelHash, bool hasUMI, uint64_t umi) {
+            auto& shard = *shards_[labelHash % shards_.size()];
+            spin_lock::scoped_lock l(shard.lock);
+            auto& c = shard.classes[labelHash];
+            if (hasUMI) {
+                ++c.umis[umi];
+            } else {
+                ++c.numUntagged;
+            }
+        }
+
+        /**
+         * The number of molecules of the class whose label hashes to
+         * labelHash, or numFragments if none of its fragments were recorded.
+         */
+        uint64_t numMolecules(uint64_t labelHash, uint64_t numFragments) const {
+            auto& shard = *shards_[labelHash % shards_.size()];
+            auto it = shard.classes.find(labelHash);
+            if (it == shard.classes.end()) { return numFragments; }
+            auto& c = it->second;
+            uint64_t n = collapseOneEdit_ ? numDirectionalClusters_(c.umis) : c.umis.size();
+            return std::max(n + c.numUntagged, uint64_t(1));
+        }
+
+    private:
+        static constexpr uint32_t lengthShift_ = 58;
+
+        struct ClassUMIs {
+            std::unordered_map<uint64_t, uint32_t> umis;
+            uint64_t numUntagged{0};
+        };
+
+        struct Shard {
+            spin_lock lock;
+            std::unordered_map<uint64_t, ClassUMIs> classes;
+        };
+
+        // The number of molecules the UMIs (and their counts) come from
+        static uint64_t numDirectionalClusters_(const std::unordered_map<uint64_t, uint32_t>& umis) {
+            if (umis.size() < 2) { return umis.size(); }
+            std::vector<std::pair<uint64_t, uint32_t>> byCount(umis.begin(), umis.end());
+            std::sort(byCount.begin(), byCount.end(),
+                      [](const std::pair<uint64_t, uint32_t>& a, const std::pair<uint64_t, uint32_t>& b) {
+                          return (a.second != b.second) ? a.second > b.second : a.first < b.first;
+                      });
+            std::unordered_map<uint64_t, bool> absorbed;
+            absorbed.reserve(umis.size());
+            std::vector<std::pair<uint64_t, uint32_t>> stack;
+            uint64_t numClusters{0};
+            for (auto& u : byCount) {
+                if (absorbed[u.first]) { continue; }
+                absorbed[u.first] = true;
+                ++numClusters;
+                stack.push_back(u);
+                while (!stack.empty()) {
+                    auto x = stack.back();
+                    stack.pop_back();
+                    uint64_t len = x.first >> lengthShift_;
+                    uint64_t bits = x.first & ((uint64_t(1) << lengthShift_) - 1);
+                    for (uint64_t pos = 0; pos < len; ++pos) {
+                        for (uint64_t sub = 1; sub < 4; ++sub) {
+                            uint64_t y = (len << lengthShift_) | (bits ^ (sub << (2 * pos)));
+                            auto it = umis.find(y);
+                            if (it == umis.end() or absorbed[y]) { continue; }
+                            if (x.second >= 2 * it->second - 1) {
+                                absorbed[y] = true;
+                                stack.emplace_back(y, it->second);
+                            }
+                        }
+                    }
+                }
+            }
+            return numClusters;
+        }
+
+        bool collapseOneEdit_;
+        std::vector<std::unique_ptr<Shard>> shards_;
+};
+
+#endif // __UMI_DEDUPLICATOR_HPP__
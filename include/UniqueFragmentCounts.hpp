@@ -0,0 +1,75 @@
+#ifndef __UNIQUE_FRAGMENT_COUNTS_HPP__
+#define __UNIQUE_FRAGMENT_COUNTS_HPP__
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "EquivalenceClassBuilder.hpp"
+#include "TranscriptGroup.hpp"
+
+/**
+ * The equivalence class increments of one thread's uniquely mapping
+ * fragments during a mini-batch.  The label of such a fragment is its one
+ * transcript, and its (normalized) auxiliary weight is exactly 1, so the
+ * class is fully described by the number of fragments and the sum of their
+ * positional weights.  These are summed here, per transcript, and added to
+ * the equivalence class builder once at the end of the mini-batch, rather
+ * than building and hashing a label for every fragment.
+ */
+class UniqueFragmentCounts {
+    public:
+        inline void add(uint32_t transcriptID, double posWeight) {
+            auto& e = entry_(transcriptID);
+            ++e.count;
+            e.posWeight += posWeight;
+        }
+
+        bool empty() const { return entries_.empty(); }
+
+        /**
+         * Add the classes to eqBuilder (with positional weights if
+         * hasPosWeights), and clear them.
+         */
+        void flush(EquivalenceClassBuilder& eqBuilder, bool hasPosWeights) {
+            std::vector<uint32_t> txps(1);
+            std::vector<double> weights(1);
+            std::vector<double> posWeights(hasPosWeights ? 1 : 0);
+            for (auto& e : entries_) {
+                txps[0] = e.transcriptID;
+                weights[0] = static_cast<double>(e.count);
+                if (hasPosWeights) { posWeights[0] = e.posWeight; }
+                label_.assign(txps);
+                eqBuilder.addGroup(label_, weights, posWeights, e.count);
+                slot_[e.transcriptID] = noSlot_;
+            }
+            entries_.clear();
+        }
+
+    private:
+        struct Entry {
+            uint32_t transcriptID;
+            uint64_t count;
+            double posWeight;
+        };
+
+        static constexpr uint32_t noSlot_ = std::numeric_limits<uint32_t>::max();
+
+        inline Entry& entry_(uint32_t transcriptID) {
+            if (transcriptID >= slot_.size()) { slot_.resize(transcriptID + 1, uint32_t(noSlot_)); }
+            uint32_t s = slot_[transcriptID];
+            if (s == noSlot_) {
+                s = static_cast<uint32_t>(entries_.size());
+                slot_[transcriptID] = s;
+                entries_.push_back(Entry{transcriptID, 0, 0.0});
+            }
+            return entries_[s];
+        }
+
+        // The index in entries_ of the counts of each transcript (or noSlot_)
+        std::vector<uint32_t> slot_;
+        std::vector<Entry> entries_;
+        TranscriptGroup label_;
+};
+
+#endif // __UNIQUE_FRAGMENT_COUNTS_HPP__
@@ -0,0 +1,133 @@
+#ifndef __UNMAPPED_NAME_WRITER_HPP__
+#define __UNMAPPED_NAME_WRITER_HPP__
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <thread>
+
+#include "tbb/concurrent_queue.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+
+/**
+ * The gzipped file of the names of the fragments that weren't mapped
+ * (--writeUnmappedNames), one per line, followed by the reason:
+ *
+ *   u  no mapping was found
+ *   m  it mapped to more than --maxReadOccs places
+ *   s  it (both of its mates) was shorter than the minimum seed length
+ *
+ * The mapping threads collect the names in their own UnmappedNameBuffers,
+ * which hand them over in large blocks; a single writer thread compresses
+ * each block into its own gzip member and appends it to the file (a
+ * sequence of gzip members is itself a valid gzip file), so the mapping
+ * threads never wait on the compression or on one another.
+ */
+class UnmappedNameWriter {
+    public:
+        static constexpr char unmapped = 'u';
+        static constexpr char tooManyHits = 'm';
+        static constexpr char tooShort = 's';
+
+        explicit UnmappedNameWriter(const boost::filesystem::path& path) :
+            ofile_(path.string(), std::ios_base::out | std::ios_base::binary | std::ios_base::trunc) {
+            queue_.set_capacity(queueCapacity_);
+            writer_ = std::thread([this]() -> void { this->compressBlocks_(); });
+        }
+
+        ~UnmappedNameWriter() { finish(); }
+
+        bool good() const { return ofile_.good(); }
+
+        // Take over the names in block (leaving it empty)
+        void push(std::string& block) {
+            if (block.empty()) { return; }
+            std::string* b = new std::string;
+            b->swap(block);
+            queue_.push(b);
+        }
+
+        /**
+         * Wait for all of the blocks to be written, and close the file.
+         */
+        void finish() {
+            if (!writer_.joinable()) { return; }
+            queue_.push(nullptr);
+            writer_.join();
+            ofile_.close();
+        }
+
+        uint64_t numNames() const { return numNames_; }
+
+    private:
+        void compressBlocks_() {
+            std::string* b{nullptr};
+            std::string member;
+            while (true) {
+                queue_.pop(b);
+                if (b == nullptr) { break; }
+                member.clear();
+                {
+                    boost::iostreams::filtering_ostream out;
+                    out.push(boost::iostreams::gzip_compressor());
+                    out.push(boost::iostreams::back_inserter(member));
+                    out.write(b->data(), b->size());
+                }
+                for (char c : *b) { numNames_ += (c == '\n'); }
+                delete b;
+                ofile_.write(member.data(), member.size());
+            }
+        }
+
+        // The number of blocks that may wait for the writer before the mapping threads block
+        static constexpr size_t queueCapacity_ = 64;
+
+        std::ofstream ofile_;
+        tbb::concurrent_bounded_queue<std::string*> queue_;
+        std::thread writer_;
+        uint64_t numNames_{0};
+};
+
+/**
+ * A mapping thread's buffer of the names of the fragments that it didn't
+ * map.
+ */
+class UnmappedNameBuffer {
+    public:
+        static constexpr size_t flushSize = 1 << 20;
+
+        explicit UnmappedNameBuffer(UnmappedNameWriter* writer) : writer_(writer) {}
+        ~UnmappedNameBuffer() { flush(); }
+
+        /**
+         * Record the fragment whose (first) read has the given header,
+         * for the given reason (one of the codes of UnmappedNameWriter).
+         */
+        void add(const std::string& header, char reason) {
+            // The read name, up to the first whitespace, without a /1 or /2 suffix
+            size_t end = header.find_first_of(" \t");
+            if (end == std::string::npos) { end = header.size(); }
+            if (end >= 2 and header[end - 2] == '/' and (header[end - 1] == '1' or header[end - 1] == '2')) {
+                end -= 2;
+            }
+            buf_.append(header, 0, end);
+            buf_ += ' ';
+            buf_ += reason;
+            buf_ += '\n';
+            if (buf_.size() >= flushSize) { flush(); }
+        }
+
+        void flush() {
+            if (writer_) { writer_->push(buf_); }
+        }
+
+    private:
+        UnmappedNameWriter* writer_;
+        std::string buf_;
+};
+
+#endif // __UNMAPPED_NAME_WRITER_HPP__
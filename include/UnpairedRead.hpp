@@ -21,6 +21,9 @@ struct UnpairedRead {
    bam_seq_t* read = nullptr;
    double logProb;
    LibraryFormat libFmt{ReadType::PAIRED_END, ReadOrientation::NONE, ReadStrandedness::U};
+   // A hash of the read name, set by the BAMQueue when the record is
+   // decoded; used to group alignments by read.
+   uint64_t nameHash{0};
 
    UnpairedRead() : read(staden::utils::bam_init()), logProb(salmon::math::LOG_0) {}
 
@@ -31,12 +34,14 @@ struct UnpairedRead {
        logProb = other.logProb;
        std::swap(read, other.read);
        libFmt = other.libFmt;
+       nameHash = other.nameHash;
    }
 
    UnpairedRead& operator=(UnpairedRead&& other) {
        logProb = other.logProb;
        std::swap(read, other.read);
        libFmt = other.libFmt;
+       nameHash = other.nameHash;
        return *this;
    }
 
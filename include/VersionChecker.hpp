@@ -16,6 +16,8 @@
 #include <ostream>
 #include <string>
 #include <sstream>
+#include <memory>
+#include <mutex>
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
@@ -48,5 +50,29 @@ private:
 };
 
 std::string getVersionMessage();
+// As above, with the check run on io_service (which may be stopped to end it)
+std::string getVersionMessage(boost::asio::io_service& io_service);
+
+/**
+ * The version check of a run, made on its own thread so that it never
+ * delays the run; its result is printed when the process exits, but only
+ * if it has arrived by then (the check is stopped, and its thread joined,
+ * otherwise).
+ *
+ * The check is skipped if the environment variable SALMON_NO_VERSION_CHECK
+ * is set (to anything but 0), or if the config file (SALMON_CONFIG, or else
+ * ~/.salmonrc, or else /etc/salmonrc) has the line "no-version-check = true".
+ */
+namespace salmon {
+namespace versioncheck {
+
+// Whether the check has been disabled by the environment or a config file
+bool versionCheckDisabled();
+
+// Start the check (if it isn't disabled), and print its result at exit
+void startVersionCheck();
+
+} // namespace versioncheck
+} // namespace salmon
 
 #endif //VERSION_CHECKER_HPP
\ No newline at end of file
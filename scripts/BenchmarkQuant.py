@@ -0,0 +1,331 @@
+"""
+An end-to-end performance (and accuracy) regression harness for salmon.
+
+For each data set, the harness builds a quasi and an FMD index, writes the
+quasi-mappings as SAM (for the alignment-based mode), and then runs
+`salmon quant` in quasi, FMD and alignment mode at each of the requested
+thread counts.  For every run it records the wall time, the peak RSS and
+the number of fragments processed per second, and the accuracy of the
+estimates: the Spearman correlation and the mean absolute relative
+difference (MARD) of NumReads against the true counts when the data set
+has them, and otherwise against the quasi-mode estimates made with the
+most threads.
+
+The data sets are the reads of sample_data.tgz, and (with --synthetic)
+reads simulated from the sample transcripts with known abundances.
+
+    python scripts/BenchmarkQuant.py --salmon build/src/salmon --out bench_out \\
+        --threads 1 4 16 --synthetic 500000 --baseline baseline.json
+
+With --baseline, the results are compared against those of a previous run
+and the script exits with a non-zero status if a run is slower (or uses
+more memory) than the baseline by more than --timeTolerance
+(--memTolerance), or is less accurate by more than --accTolerance.  With
+--saveBaseline, the results of this run are written as the new baseline.
+"""
+import argparse
+import bisect
+import errno
+import json
+import logging
+import math
+import os
+import random
+import subprocess
+import sys
+import tarfile
+import time
+
+# from: http://stackoverflow.com/questions/600268/mkdir-p-functionality-in-python
+def mkdir_p(path):
+    try:
+        os.makedirs(path)
+    except OSError as exc:  # Python >2.5
+        if exc.errno == errno.EEXIST and os.path.isdir(path):
+            pass
+        else:
+            raise
+
+
+def run(cmd, logPath, cwd=None):
+    """
+    Run cmd, with its output going to logPath, and return its wall time (in
+    seconds) and peak RSS (in bytes).
+    """
+    logging.info("running {}".format(" ".join(cmd)))
+    with open(logPath, 'w') as log:
+        start = time.time()
+        proc = subprocess.Popen(cmd, stdout=log, stderr=subprocess.STDOUT, cwd=cwd)
+        _, status, usage = os.wait4(proc.pid, 0)
+        wall = time.time() - start
+    proc.returncode = status
+    if status != 0:
+        logging.error("{} failed (see {})".format(cmd[0:2], logPath))
+        sys.exit(1)
+    # ru_maxrss is in kilobytes on Linux, and in bytes on OS X
+    rss = usage.ru_maxrss if sys.platform == 'darwin' else usage.ru_maxrss * 1024
+    return wall, rss
+
+
+def readFasta(path):
+    names, seqs, cur = [], [], []
+    with open(path) as ifile:
+        for line in ifile:
+            line = line.strip()
+            if line.startswith('>'):
+                if names:
+                    seqs.append(''.join(cur))
+                names.append(line[1:].split()[0])
+                cur = []
+            else:
+                cur.append(line)
+    if names:
+        seqs.append(''.join(cur))
+    return names, seqs
+
+
+_comp = {'A': 'T', 'C': 'G', 'G': 'C', 'T': 'A'}
+def revComp(s):
+    return ''.join(_comp.get(c, 'N') for c in reversed(s.upper()))
+
+
+def simulateReads(fastaPath, outDir, numFrags, seed, readLen=100, fragMean=250, fragSD=25):
+    """
+    Simulate numFrags (error-free, IU) paired-end fragments from the
+    transcripts in fastaPath, with log-normal abundances.  The true number of
+    fragments drawn from each transcript is written to truth.tsv.
+    """
+    rng = random.Random(seed)
+    names, seqs = readFasta(fastaPath)
+    usable = [i for i, s in enumerate(seqs) if len(s) >= fragMean + 3 * fragSD]
+    weights = [rng.lognormvariate(0, 2) * len(seqs[i]) for i in usable]
+    total = sum(weights)
+    cdf, acc = [], 0.0
+    for w in weights:
+        acc += w / total
+        cdf.append(acc)
+
+    counts = dict((n, 0) for n in names)
+    qual = 'I' * readLen
+    with open(os.path.join(outDir, 'reads_1.fastq'), 'w') as r1, \
+         open(os.path.join(outDir, 'reads_2.fastq'), 'w') as r2:
+        for f in range(numFrags):
+            ti = usable[min(bisect.bisect_left(cdf, rng.random()), len(usable) - 1)]
+            seq = seqs[ti]
+            flen = max(readLen, min(len(seq), int(rng.gauss(fragMean, fragSD))))
+            start = rng.randint(0, len(seq) - flen)
+            frag = seq[start:start + flen]
+            left, right = frag[:readLen], revComp(frag[-readLen:])
+            if rng.random() < 0.5:
+                left, right = right, left
+            r1.write('@sim{}/1\n{}\n+\n{}\n'.format(f, left, qual[:len(left)]))
+            r2.write('@sim{}/2\n{}\n+\n{}\n'.format(f, right, qual[:len(right)]))
+            counts[names[ti]] += 1
+    with open(os.path.join(outDir, 'truth.tsv'), 'w') as ofile:
+        for n in names:
+            ofile.write('{}\t{}\n'.format(n, counts[n]))
+
+
+def readQuant(path):
+    est = {}
+    with open(path) as ifile:
+        header = ifile.readline().rstrip().split('\t')
+        col = header.index('NumReads')
+        for line in ifile:
+            toks = line.rstrip().split('\t')
+            est[toks[0]] = float(toks[col])
+    return est
+
+
+def readTruth(path):
+    truth = {}
+    with open(path) as ifile:
+        for line in ifile:
+            name, count = line.rstrip().split('\t')
+            truth[name] = float(count)
+    return truth
+
+
+def ranks(vals):
+    order = sorted(range(len(vals)), key=lambda i: vals[i])
+    r = [0.0] * len(vals)
+    i = 0
+    while i < len(order):
+        j = i
+        while j + 1 < len(order) and vals[order[j + 1]] == vals[order[i]]:
+            j += 1
+        for k in range(i, j + 1):
+            r[order[k]] = (i + j) / 2.0
+        i = j + 1
+    return r
+
+
+def accuracy(est, truth):
+    """
+    The Spearman correlation and the mean absolute relative difference of
+    the estimated and the true counts.
+    """
+    names = sorted(truth)
+    x = [est.get(n, 0.0) for n in names]
+    y = [truth[n] for n in names]
+    rx, ry = ranks(x), ranks(y)
+    mx, my = sum(rx) / len(rx), sum(ry) / len(ry)
+    cov = sum((a - mx) * (b - my) for a, b in zip(rx, ry))
+    sx = math.sqrt(sum((a - mx) ** 2 for a in rx))
+    sy = math.sqrt(sum((b - my) ** 2 for b in ry))
+    spearman = cov / (sx * sy) if sx > 0 and sy > 0 else 0.0
+    mard = sum(abs(a - b) / (a + b) for a, b in zip(x, y) if a + b > 0) / len(names)
+    return spearman, mard
+
+
+def benchmarkDataSet(args, name, dataDir, truthPath):
+    salmon = os.path.abspath(args.salmon)
+    outDir = os.path.join(args.out, name)
+    mkdir_p(outDir)
+    fasta = os.path.join(dataDir, 'transcripts.fasta')
+    r1, r2 = os.path.join(dataDir, 'reads_1.fastq'), os.path.join(dataDir, 'reads_2.fastq')
+    maxThreads = str(max(args.threads))
+
+    results = []
+    def record(mode, threads, quantDir, wall, rss, truth):
+        with open(os.path.join(quantDir, 'aux', 'meta_info.json')) as ifile:
+            meta = json.load(ifile)
+        est = readQuant(os.path.join(quantDir, 'quant.sf'))
+        spearman, mard = accuracy(est, truth) if truth else (None, None)
+        r = {'dataset': name, 'mode': mode, 'threads': threads,
+             'wall_sec': wall, 'peak_rss_bytes': rss,
+             'num_processed': meta.get('num_processed', 0),
+             'reads_per_sec': meta.get('num_processed', 0) / wall if wall > 0 else 0.0,
+             'spearman': spearman, 'mard': mard}
+        logging.info("{} {} x{}: {:.2f} s, {:.1f} MB, {:.0f} reads/sec{}".format(
+            name, mode, threads, wall, rss / 1e6, r['reads_per_sec'],
+            "" if spearman is None else ", spearman {:.4f}, MARD {:.4f}".format(spearman, mard)))
+        results.append(r)
+        return est
+
+    truth = readTruth(truthPath) if truthPath else None
+    for indexType in ['quasi', 'fmd']:
+        if indexType not in args.modes and not (indexType == 'quasi' and 'alignment' in args.modes):
+            continue
+        idx = os.path.join(outDir, 'index_' + indexType)
+        wall, rss = run([salmon, 'index', '-t', fasta, '-i', idx, '--type', indexType, '-p', maxThreads],
+                        os.path.join(outDir, 'index_' + indexType + '.log'))
+        results.append({'dataset': name, 'mode': 'index_' + indexType, 'threads': int(maxThreads),
+                        'wall_sec': wall, 'peak_rss_bytes': rss})
+
+    for mode in args.modes:
+        for t in args.threads:
+            quantDir = os.path.join(outDir, '{}_{}'.format(mode, t))
+            if mode == 'alignment':
+                sam = os.path.join(outDir, 'mappings.sam')
+                if not os.path.exists(sam):
+                    run([salmon, 'quant', '-i', os.path.join(outDir, 'index_quasi'), '-l', 'IU',
+                         '-1', r1, '-2', r2, '-p', maxThreads, '-o', os.path.join(outDir, 'sam_quant'),
+                         '--writeMappings', sam], os.path.join(outDir, 'write_mappings.log'))
+                cmd = [salmon, 'quant', '-t', fasta, '-l', 'IU', '-a', sam, '-p', str(t), '-o', quantDir]
+            else:
+                cmd = [salmon, 'quant', '-i', os.path.join(outDir, 'index_' + mode), '-l', 'IU',
+                       '-1', r1, '-2', r2, '-p', str(t), '-o', quantDir]
+            wall, rss = run(cmd + args.quantArgs, quantDir + '.log')
+            record(mode, t, quantDir, wall, rss, truth)
+    return results
+
+
+def compare(results, baseline, args):
+    """
+    Return the regressions of results relative to baseline.
+    """
+    key = lambda r: (r['dataset'], r['mode'], r['threads'])
+    base = dict((key(r), r) for r in baseline['results'])
+    regressions = []
+    for r in results:
+        b = base.get(key(r))
+        if b is None:
+            continue
+        label = '{} {} x{}'.format(*key(r))
+        if r['wall_sec'] > b['wall_sec'] * (1.0 + args.timeTolerance):
+            regressions.append('{}: wall time {:.2f} s (baseline {:.2f} s)'.format(label, r['wall_sec'], b['wall_sec']))
+        if r['peak_rss_bytes'] > b['peak_rss_bytes'] * (1.0 + args.memTolerance):
+            regressions.append('{}: peak RSS {:.1f} MB (baseline {:.1f} MB)'.format(
+                label, r['peak_rss_bytes'] / 1e6, b['peak_rss_bytes'] / 1e6))
+        if r.get('spearman') is not None and b.get('spearman') is not None:
+            if r['spearman'] < b['spearman'] - args.accTolerance:
+                regressions.append('{}: spearman {:.4f} (baseline {:.4f})'.format(label, r['spearman'], b['spearman']))
+            if r['mard'] > b['mard'] + args.accTolerance:
+                regressions.append('{}: MARD {:.4f} (baseline {:.4f})'.format(label, r['mard'], b['mard']))
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description="End-to-end performance regression harness for salmon quant")
+    parser.add_argument('--salmon', required=True, help="The salmon executable")
+    parser.add_argument('--out', required=True, help="The directory in which the indices and estimates are written")
+    parser.add_argument('--sampleData', default=os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'sample_data.tgz'),
+                        help="The sample data archive (default: the sample_data.tgz of the repository)")
+    parser.add_argument('--threads', type=int, nargs='+', default=[1, 4], help="The thread counts at which to run")
+    parser.add_argument('--modes', nargs='+', default=['quasi', 'fmd', 'alignment'],
+                        choices=['quasi', 'fmd', 'alignment'], help="The modes in which to run salmon quant")
+    parser.add_argument('--synthetic', type=int, default=0,
+                        help="Also benchmark this many fragments simulated, with known abundances, from the sample transcripts")
+    parser.add_argument('--seed', type=int, default=271828, help="The seed of the simulated reads")
+    parser.add_argument('--quantArgs', nargs=argparse.REMAINDER, default=[],
+                        help="Further arguments given to every salmon quant (must come last)")
+    parser.add_argument('--baseline', help="Compare the results against this baseline")
+    parser.add_argument('--saveBaseline', help="Write the results of this run as a baseline to this file")
+    parser.add_argument('--timeTolerance', type=float, default=0.10, help="The allowed fractional increase in wall time")
+    parser.add_argument('--memTolerance', type=float, default=0.10, help="The allowed fractional increase in peak RSS")
+    parser.add_argument('--accTolerance', type=float, default=0.005,
+                        help="The allowed (absolute) decrease in spearman correlation, or increase in MARD")
+    args = parser.parse_args()
+
+    logging.basicConfig(level=logging.INFO, format='%(asctime)s %(message)s')
+    mkdir_p(args.out)
+
+    sampleDir = os.path.join(args.out, 'sample_data')
+    if not os.path.exists(os.path.join(sampleDir, 'transcripts.fasta')):
+        with tarfile.open(args.sampleData) as tf:
+            tf.extractall(args.out)
+
+    results = benchmarkDataSet(args, 'sample_data', sampleDir, None)
+    if args.synthetic > 0:
+        synDir = os.path.join(args.out, 'synthetic_data')
+        mkdir_p(synDir)
+        truthPath = os.path.join(synDir, 'truth.tsv')
+        if not os.path.exists(truthPath):
+            logging.info("simulating {} fragments".format(args.synthetic))
+            os.symlink(os.path.abspath(os.path.join(sampleDir, 'transcripts.fasta')),
+                       os.path.join(synDir, 'transcripts.fasta'))
+            simulateReads(os.path.join(synDir, 'transcripts.fasta'), synDir, args.synthetic, args.seed)
+        results += benchmarkDataSet(args, 'synthetic', synDir, truthPath)
+
+    # The sample data has no truth, so its estimates are scored against
+    # those of the quasi mode with the most threads
+    ref = os.path.join(args.out, 'sample_data', 'quasi_{}'.format(max(args.threads)), 'quant.sf')
+    if os.path.exists(ref):
+        refEst = readQuant(ref)
+        for r in results:
+            if r['dataset'] == 'sample_data' and not r['mode'].startswith('index_'):
+                quantDir = os.path.join(args.out, 'sample_data', '{}_{}'.format(r['mode'], r['threads']))
+                r['spearman'], r['mard'] = accuracy(readQuant(os.path.join(quantDir, 'quant.sf')), refEst)
+
+    summary = {'salmon': args.salmon, 'threads': args.threads, 'results': results}
+    with open(os.path.join(args.out, 'benchmark.json'), 'w') as ofile:
+        json.dump(summary, ofile, indent=4)
+    if args.saveBaseline:
+        with open(args.saveBaseline, 'w') as ofile:
+            json.dump(summary, ofile, indent=4)
+        logging.info("wrote the baseline to {}".format(args.saveBaseline))
+
+    if args.baseline:
+        with open(args.baseline) as ifile:
+            baseline = json.load(ifile)
+        regressions = compare(results, baseline, args)
+        if regressions:
+            for r in regressions:
+                logging.error("regression: " + r)
+            sys.exit(1)
+        logging.info("no regressions relative to {}".format(args.baseline))
+
+
+if __name__ == "__main__":
+    main()
@@ -1,7 +1,11 @@
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <cstdio>
+#include <sstream>
 #include <tuple>
 #include <map>
+#include <vector>
 
 #include <boost/config.hpp> // for BOOST_LIKELY/BOOST_UNLIKELY
 
@@ -209,76 +213,75 @@ char opToChr(enum cigar_op op){
 }
 
 
-double AlignmentModel::logLikelihood(bam_seq_t* read, Transcript& ref,
-                                 std::vector<AtomicMatrix<double>>& transitionProbs){
+template <typename CallbackT>
+bool AlignmentModel::walkTransitions_(bam_seq_t* read, Transcript& ref, size_t readIdx,
+                                      size_t uTranscriptIdx, const char* caller, CallbackT f) {
     using namespace salmon::stringtools;
-    bool useQual{false};
-    size_t readIdx{0};
-    auto transcriptIdx = bam_pos(read);
     size_t transcriptLen = ref.RefLength;
-    // if the read starts before the beginning of the transcript,
-    // only consider the part overlapping the transcript
-    if (transcriptIdx < 0) {
-        readIdx = -transcriptIdx;
-        transcriptIdx = 0;
-    }
-
-    // unsigned version of transcriptIdx
-    size_t uTranscriptIdx = static_cast<size_t>(transcriptIdx);
-
-    if (uTranscriptIdx >= transcriptLen) {
-        std::lock_guard<std::mutex> l(outputMutex_);
-        std::cerr << "transcript index = " << uTranscriptIdx << ", transcript length = " << transcriptLen << "\n";
-        return salmon::math::LOG_0;
-    }
-
-    //std::stringstream readStream, matchStream, refStream;
 
     uint32_t* cigar = bam_cigar(read);
     uint32_t cigarLen = bam_cigar_len(read);
     uint8_t* qseq = reinterpret_cast<uint8_t*>(bam_seq(read));
-    uint8_t* qualStr = reinterpret_cast<uint8_t*>(bam_qual(read));
     int32_t readLen = bam_seq_len(read);
 
-    if (cigarLen == 0 or !cigar) { return salmon::math::LOG_EPSILON; }
-
     salmon::stringtools::strand readStrand = salmon::stringtools::strand::forward;
-    double logLike = salmon::math::LOG_1;
 
     bool advanceInRead{false};
     bool advanceInReference{false};
     uint32_t readPosBin{0};
-    uint32_t cigarIdx{0};
     uint32_t prevStateIdx{startStateIdx};
     uint32_t curStateIdx{0};
-    double invLen = static_cast<double>(readBins_) / bam_seq_len(read);
+    double invLen = static_cast<double>(readBins_) / readLen;
 
     for (uint32_t cigarIdx = 0; cigarIdx < cigarLen; ++cigarIdx) {
         uint32_t opLen = cigar[cigarIdx] >> BAM_CIGAR_SHIFT;
         enum cigar_op op = static_cast<enum cigar_op>(cigar[cigarIdx] & BAM_CIGAR_MASK);
+
+        // Fast path for (mis)matches that lie entirely within both the read
+        // and the reference: the bases need no bounds checks, and are read
+        // directly from the read's 4-bit and the reference's 2-bit encodings.
+        bool isMatch = (op == BAM_CMATCH or op == BAM_CBASE_MATCH or op == BAM_CBASE_MISMATCH);
+        if (isMatch and opLen > 0 and
+            readIdx + opLen <= static_cast<size_t>(readLen) and
+            uTranscriptIdx + opLen <= transcriptLen) {
+            for (size_t i = 0; i < opLen; ++i) {
+                size_t readPos = readIdx + i;
+                // The first base of the operation keeps the bin of the
+                // previous read base
+                if (i > 0) { readPosBin = static_cast<uint32_t>(readPos * invLen); }
+                uint32_t curReadBase = samToTwoBit[bam_seqi(qseq, readPos)];
+                uint32_t curRefBase = ref.twoBitBaseAt(uTranscriptIdx + i, readStrand);
+                curStateIdx = curRefBase * numStates + curReadBase;
+                f(readPosBin, prevStateIdx, curStateIdx);
+                prevStateIdx = curStateIdx;
+            }
+            readIdx += opLen;
+            uTranscriptIdx += opLen;
+            continue;
+        }
+
         size_t curReadBase = samToTwoBit[bam_seqi(qseq, readIdx)];
-        size_t curRefBase = samToTwoBit[ref.baseAt(uTranscriptIdx, readStrand)];
+        size_t curRefBase = ref.twoBitBaseAt(uTranscriptIdx, readStrand);
         advanceInRead = false;
         advanceInReference = false;
 
-
         for (size_t i = 0; i < opLen; ++i) {
             if (advanceInRead) {
                 // Shouldn't happen!
                 if (readIdx >= readLen) {
                     if (logger_) {
-                        logger_->warn("(in logLikelihood()) CIGAR string for read [{}] "
+                        logger_->warn("(in {}()) CIGAR string for read [{}] "
                             "seems inconsistent. It refers to non-existant "
-                            "positions in the read!", bam_name(read));
+                            "positions in the read!", caller, bam_name(read));
                         std::stringstream cigarStream;
                         for (size_t j = 0; j < cigarLen; ++j) {
                             uint32_t opLen = cigar[j] >> BAM_CIGAR_SHIFT;
                             enum cigar_op op = static_cast<enum cigar_op>(cigar[j] & BAM_CIGAR_MASK);
                             cigarStream << opLen << opToChr(op);
                         }
-                        logger_->warn("(in logLikelihood()) CIGAR = {}", cigarStream.str());
+                        logger_->warn("(in {}()) CIGAR = {}", caller, cigarStream.str());
                     }
-                    return logLike;
+                    return false;
                 }
                 curReadBase = samToTwoBit[bam_seqi(qseq, readIdx)];
                 readPosBin = static_cast<uint32_t>((readIdx * invLen));
@@ -288,23 +291,21 @@ double AlignmentModel::logLikelihood(bam_seq_t* read, Transcript& ref,
                 // Shouldn't happen!
                 if (uTranscriptIdx >= transcriptLen) {
                     if (logger_) {
-			    logger_->warn("(in logLikelihood()) CIGAR string for read [{}] "
-					    "seems inconsistent. It refers to non-existant "
-					    "positions in the reference! Transcript name "
-	    				    "is {}, length is {}, id is {}. Read things refid is {}",  
-					    bam_name(read), ref.RefName, transcriptLen, ref.id, bam_ref(read));
+                        logger_->warn("(in {}()) CIGAR string for read [{}] "
+                                      "seems inconsistent. It refers to non-existant "
+                                      "positions in the reference! Transcript name "
+                                      "is {}, length is {}, id is {}. Read things refid is {}",
+                                      caller, bam_name(read), ref.RefName, transcriptLen, ref.id, bam_ref(read));
                     }
-                    return logLike;
+                    return false;
                 }
-                curRefBase = samToTwoBit[ref.baseAt(uTranscriptIdx, readStrand)];
+                curRefBase = ref.twoBitBaseAt(uTranscriptIdx, readStrand);
                 advanceInReference = false;
             }
 
-
             setBasesFromCIGAROp_(op, curRefBase, curReadBase);//, readStream, matchStream, refStream);
             curStateIdx = curRefBase * numStates + curReadBase;
-            double tp = transitionProbs[readPosBin](prevStateIdx, curStateIdx);
-            logLike += tp;
+            f(readPosBin, prevStateIdx, curStateIdx);
             prevStateIdx = curStateIdx;
             if (BAM_CONSUME_SEQ(op)) {
                 ++readIdx;
@@ -314,23 +315,61 @@ double AlignmentModel::logLikelihood(bam_seq_t* read, Transcript& ref,
                 ++uTranscriptIdx;
                 advanceInReference = true;
             }
-
         }
     }
+    return true;
+}
 
-    /*
-    {
+double AlignmentModel::logLikelihood(bam_seq_t* read, Transcript& ref,
+                                 std::vector<AtomicMatrix<double>>& transitionProbs){
+    size_t readIdx{0};
+    auto transcriptIdx = bam_pos(read);
+    size_t transcriptLen = ref.RefLength;
+    // if the read starts before the beginning of the transcript,
+    // only consider the part overlapping the transcript
+    if (transcriptIdx < 0) {
+        readIdx = -transcriptIdx;
+        transcriptIdx = 0;
+    }
+
+    // unsigned version of transcriptIdx
+    size_t uTranscriptIdx = static_cast<size_t>(transcriptIdx);
+
+    if (uTranscriptIdx >= transcriptLen) {
         std::lock_guard<std::mutex> l(outputMutex_);
-        std::cerr << "\n\nread:   " << readStream.str() << "\n";
-        std::cerr << "        " << matchStream.str() << "\n";
-        std::cerr << "ref:    " << refStream.str() << "\n";
-        //std::cerr << "states: " << stateStream.str() << "\n";
+        std::cerr << "transcript index = " << uTranscriptIdx << ", transcript length = " << transcriptLen << "\n";
+        return salmon::math::LOG_0;
     }
-    */
 
+    uint32_t* cigar = bam_cigar(read);
+    uint32_t cigarLen = bam_cigar_len(read);
+    if (cigarLen == 0 or !cigar) { return salmon::math::LOG_EPSILON; }
+
+    double logLike = salmon::math::LOG_1;
+    walkTransitions_(read, ref, readIdx, uTranscriptIdx, "logLikelihood",
+                     [&logLike, &transitionProbs](uint32_t bin, uint32_t prevStateIdx, uint32_t curStateIdx) -> void {
+                         logLike += transitionProbs[bin](prevStateIdx, curStateIdx);
+                     });
     return logLike;
 }
 
+bool AlignmentModel::startsWithinTranscript(bam_seq_t* read, Transcript& ref) {
+    // As in logLikelihood(); a read starting before the transcript is clipped to it
+    auto transcriptIdx = bam_pos(read);
+    return transcriptIdx < 0 or static_cast<size_t>(transcriptIdx) < ref.RefLength;
+}
+
+bool AlignmentModel::startsWithinTranscript(const ReadPair& hit, Transcript& ref) {
+    if (BOOST_UNLIKELY(!isEnabled_)) { return true; }
+    if (!hit.isPaired()) { return startsWithinTranscript(hit.read1, ref); }
+    return startsWithinTranscript(hit.read1, ref) and startsWithinTranscript(hit.read2, ref);
+}
+
+bool AlignmentModel::startsWithinTranscript(const UnpairedRead& hit, Transcript& ref) {
+    if (BOOST_UNLIKELY(!isEnabled_)) { return true; }
+    return startsWithinTranscript(hit.read, ref);
+}
+
 double AlignmentModel::logLikelihood(const ReadPair& hit, Transcript& ref){
     double logLike = salmon::math::LOG_1;
     if (BOOST_UNLIKELY(!isEnabled_)) { return logLike; }
@@ -388,20 +427,18 @@ double AlignmentModel::logLikelihood(const UnpairedRead& hit, Transcript& ref){
     return logLike;
 }
 
-void AlignmentModel::update(const UnpairedRead& hit, Transcript& ref, double p, double mass){
+void AlignmentModel::update(const UnpairedRead& hit, Transcript& ref, double p, double mass, Stage* stage){
     if (mass == salmon::math::LOG_0) { return; }
     if (BOOST_UNLIKELY(!isEnabled_)) { return; }
     bam_seq_t* leftRead = hit.read;
-    update(leftRead, ref, p, mass, transitionProbsLeft_);
+    update(leftRead, ref, p, mass, transitionProbsLeft_, stage ? &stage->left_ : nullptr);
 }
 
 void AlignmentModel::update(bam_seq_t* read, Transcript& ref, double p, double mass,
-                        std::vector<AtomicMatrix<double>>& transitionProbs) {
-    using namespace salmon::stringtools;
-    bool useQual{false};
+                        std::vector<AtomicMatrix<double>>& transitionProbs,
+                        AtomicMatrixStage<double>* stage) {
     size_t readIdx{0};
     auto transcriptIdx = bam_pos(read);
-    size_t transcriptLen = ref.RefLength;
     // if the read starts before the beginning of the transcript,
     // only consider the part overlapping the transcript
     if (transcriptIdx < 0) {
@@ -411,130 +448,74 @@ void AlignmentModel::update(bam_seq_t* read, Transcript& ref, double p, double m
     // unsigned version of transcriptIdx
     size_t uTranscriptIdx = static_cast<size_t>(transcriptIdx);
 
-    //std::stringstream readStream, matchStream, refStream;
-
     uint32_t* cigar = bam_cigar(read);
     uint32_t cigarLen = bam_cigar_len(read);
-    uint8_t* qseq = reinterpret_cast<uint8_t*>(bam_seq(read));
-    uint8_t* qualStr = reinterpret_cast<uint8_t*>(bam_qual(read));
-    int32_t readLen = bam_seq_len(read);
-
-    if (cigarLen > 0 and cigar) {
-
-        salmon::stringtools::strand readStrand = salmon::stringtools::strand::forward;
-
-        bool advanceInRead{false};
-        bool advanceInReference{false};
-        uint32_t readPosBin{0};
-        uint32_t cigarIdx{0};
-        uint32_t prevStateIdx{startStateIdx};
-        uint32_t curStateIdx{0};
-        double invLen = static_cast<double>(readBins_) / readLen;
-
-
-        for (uint32_t cigarIdx = 0; cigarIdx < cigarLen; ++cigarIdx) {
-            uint32_t opLen = cigar[cigarIdx] >> BAM_CIGAR_SHIFT;
-            enum cigar_op op = static_cast<enum cigar_op>(cigar[cigarIdx] & BAM_CIGAR_MASK);
-            size_t curReadBase = samToTwoBit[bam_seqi(qseq, readIdx)];
-            size_t curRefBase = samToTwoBit[ref.baseAt(uTranscriptIdx, readStrand)];
-            advanceInRead = false;
-            advanceInReference = false;
-
-            for (size_t i = 0; i < opLen; ++i) {
-                if (advanceInRead) {
-                    // Shouldn't happen!
-                    if (readIdx >= readLen) {
-                        if (logger_) {
-                            logger_->warn("(in update()) CIGAR string for read [{}] "
-                                "seems inconsistent. It refers to non-existant "
-                                "positions in the read!", bam_name(read));
-                            std::stringstream cigarStream;
-                            for (size_t j = 0; j < cigarLen; ++j) {
-                                uint32_t opLen = cigar[j] >> BAM_CIGAR_SHIFT;
-                                enum cigar_op op = static_cast<enum cigar_op>(cigar[j] & BAM_CIGAR_MASK);
-                                cigarStream << opLen << opToChr(op);
-                            }
-                            logger_->warn("CIGAR = {}", cigarStream.str());
-                        }
-                        return;
-                    }
-                    curReadBase = samToTwoBit[bam_seqi(qseq, readIdx)];
-                    readPosBin = static_cast<uint32_t>((readIdx * invLen));
-                    advanceInRead = false;
-                }
-                if (advanceInReference) {
-                    // Shouldn't happen!
-                    if (uTranscriptIdx >= transcriptLen) {
-                        if (logger_) {
-			    logger_->warn("(in update()) CIGAR string for read [{}] "
-					    "seems inconsistent. It refers to non-existant "
-					    "positions in the reference! Transcript name "
-	    				    "is {}, length is {}, id is {}. Read things refid is {}",  
-					    bam_name(read), ref.RefName, transcriptLen, ref.id, bam_ref(read));
-                               }
-                        return;
-                    }
-                    curRefBase = samToTwoBit[ref.baseAt(uTranscriptIdx, readStrand)];
-                    advanceInReference = false;
-                }
-
-                setBasesFromCIGAROp_(op, curRefBase, curReadBase);//, readStream, matchStream, refStream);
-                curStateIdx = curRefBase * numStates + curReadBase;
-
-                // update the state in the actual model
-                transitionProbs[readPosBin].increment(prevStateIdx, curStateIdx, mass+p);
+    if (cigarLen == 0 or !cigar) { return; }
+
+    // Every transition of the read is incremented by the same amount, so
+    // rather than updating the (atomic) matrices once per base, we collect
+    // the transitions, and add count * amount to each distinct transition
+    // (and to the sum of its row) once.
+    constexpr uint32_t numCells = numAlignmentStates() * numAlignmentStates();
+    std::vector<uint32_t> transitions;
+    transitions.reserve(bam_seq_len(read) + cigarLen);
+    walkTransitions_(read, ref, readIdx, uTranscriptIdx, "update",
+                     [&transitions](uint32_t bin, uint32_t prevStateIdx, uint32_t curStateIdx) -> void {
+                         transitions.push_back(bin * numCells + prevStateIdx * numAlignmentStates() + curStateIdx);
+                     });
+    if (transitions.empty()) { return; }
+    std::sort(transitions.begin(), transitions.end());
+
+    // Since the keys are ordered by (bin, row, column), the transitions of
+    // each row are contiguous.
+    double amount = mass + p;
+    size_t rowCount{0};
+    for (size_t i = 0; i < transitions.size();) {
+        uint32_t key = transitions[i];
+        size_t j = i + 1;
+        while (j < transitions.size() and transitions[j] == key) { ++j; }
+        uint32_t bin = key / numCells;
+        uint32_t row = (key % numCells) / numAlignmentStates();
+        uint32_t col = key % numAlignmentStates();
+        size_t count = j - i;
+        if (stage) {
+            stage->incrementUnnormalized(bin, row, col, amount + std::log(count));
+        } else {
+            transitionProbs[bin].incrementUnnormalized(row, col, amount + std::log(count));
+        }
 
-                prevStateIdx = curStateIdx;
-                if (BAM_CONSUME_SEQ(op)) {
-                    ++readIdx;
-                    advanceInRead = true;
-                    /* DEBUG -- print what happened
-                       std::cerr << "read name = " << bam_name(read) << "\n";
-                       std::cerr << "curReadBase = " << readIdx << "\n";
-                       std::cerr << "readLen = " << bam_seq_len(read) << "\n";
-                       std::cerr << "ref = ";
-                       for (size_t j = 0; j < std::min(static_cast<size_t>(bam_seq_len(read)),
-                       static_cast<size_t>(transcriptLen - transcriptIdx)); ++j) {
-                       std::cerr << salmon::stringtools::samCodeToChar[ref.baseAt(j, readStrand)];
-                       }
-                       std::cerr << "\n";
-                       std::cerr << "read = ";
-                       for (size_t j = 0; j < bam_seq_len(read); ++j) {
-                       std::cerr << salmon::stringtools::samCodeToChar[bam_seqi(qseq, j)];
-                       }
-                       std::cerr << "\nCIGAR = ";
-                       for (size_t j = 0; j < cigarLen; ++j) {
-                       uint32_t opLen = cigar[j] >> BAM_CIGAR_SHIFT;
-                       enum cigar_op op = static_cast<enum cigar_op>(cigar[j] & BAM_CIGAR_MASK);
-                       std::cerr << opLen << opToChr(op);
-                       }
-                       std::cerr << "\n";
-                       */
-                }
-                if (BAM_CONSUME_REF(op)) {
-                    ++uTranscriptIdx;
-                    advanceInReference = true;
-                }
-           }
+        rowCount += count;
+        bool rowEnds = (j == transitions.size()) or
+                       (transitions[j] / numAlignmentStates() != key / numAlignmentStates());
+        if (rowEnds) {
+            if (stage) {
+                stage->incrementRowSum(bin, row, amount + std::log(rowCount));
+            } else {
+                transitionProbs[bin].incrementRowSum(row, amount + std::log(rowCount));
+            }
+            rowCount = 0;
         }
-    } // if we had a cigar string
+        i = j;
+    }
 }
 
-void AlignmentModel::update(const ReadPair& hit, Transcript& ref, double p, double mass){
+void AlignmentModel::update(const ReadPair& hit, Transcript& ref, double p, double mass, Stage* stage){
     if (mass == salmon::math::LOG_0) { return; }
     if (BOOST_UNLIKELY(!isEnabled_)) { return; }
+    AtomicMatrixStage<double>* leftStage = stage ? &stage->left_ : nullptr;
+    AtomicMatrixStage<double>* rightStage = stage ? &stage->right_ : nullptr;
 
     if (hit.isPaired()){
         bam_seq_t* leftRead = (bam_pos(hit.read1) < bam_pos(hit.read2)) ? hit.read1 : hit.read2;
         bam_seq_t* rightRead = (bam_pos(hit.read1) < bam_pos(hit.read2)) ? hit.read2 : hit.read1;
-	update(leftRead, ref, p, mass, transitionProbsLeft_);
-        update(rightRead, ref, p, mass, transitionProbsRight_);
+	update(leftRead, ref, p, mass, transitionProbsLeft_, leftStage);
+        update(rightRead, ref, p, mass, transitionProbsRight_, rightStage);
     } else if (hit.isLeftOrphan()) {
 	bam_seq_t* read = hit.read1;
-	update(read, ref, p, mass, transitionProbsLeft_);
+	update(read, ref, p, mass, transitionProbsLeft_, leftStage);
     } else if (hit.isRightOrphan()) {
 	bam_seq_t* read = hit.read1;
-	update(read, ref, p, mass, transitionProbsRight_);
+	update(read, ref, p, mass, transitionProbsRight_, rightStage);
     }
 }
 
@@ -0,0 +1,140 @@
+#include "AllocationStats.hpp"
+
+#ifdef SALMON_ENABLE_ALLOC_STATS
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <new>
+
+namespace salmon {
+namespace alloc {
+
+namespace {
+
+constexpr size_t maxThreads = 1024;
+
+/**
+ * The counts of a thread.  They're written (almost always) by their own
+ * thread only; threads beyond the first maxThreads share the last slot,
+ * so the counts are nonetheless updated atomically.
+ */
+struct ThreadCounts {
+    std::atomic<uint64_t> allocs[maxCategories];
+    std::atomic<uint64_t> bytes[maxCategories];
+    std::atomic<uint64_t> frees[maxCategories];
+};
+
+// Nothing here may allocate: it's all statically sized (and zero-initialized)
+ThreadCounts threadCounts[maxThreads];
+std::atomic<size_t> numThreads{0};
+const char* categoryNames[maxCategories] = {"other"};
+size_t numCategories{1};
+std::mutex categoryMutex;
+
+thread_local ThreadCounts* localCounts{nullptr};
+thread_local size_t localCategory{0};
+
+inline ThreadCounts& counts() {
+    if (!localCounts) {
+        size_t slot = numThreads.fetch_add(1, std::memory_order_relaxed);
+        localCounts = &threadCounts[slot < maxThreads ? slot : maxThreads - 1];
+    }
+    return *localCounts;
+}
+
+inline void recordAlloc(size_t n) {
+    auto& c = counts();
+    c.allocs[localCategory].fetch_add(1, std::memory_order_relaxed);
+    c.bytes[localCategory].fetch_add(n, std::memory_order_relaxed);
+}
+
+inline void recordFree() { counts().frees[localCategory].fetch_add(1, std::memory_order_relaxed); }
+
+void* allocate(size_t n) {
+    recordAlloc(n);
+    if (n == 0) { n = 1; }
+    while (true) {
+        void* p = std::malloc(n);
+        if (p) { return p; }
+        std::new_handler handler = std::get_new_handler();
+        if (!handler) { throw std::bad_alloc(); }
+        handler();
+    }
+}
+
+void* allocateNoThrow(size_t n) noexcept {
+    try {
+        return allocate(n);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void deallocate(void* p) noexcept {
+    if (!p) { return; }
+    recordFree();
+    std::free(p);
+}
+
+} // anonymous namespace
+
+size_t categoryIndex(const char* name) {
+    std::lock_guard<std::mutex> lock(categoryMutex);
+    for (size_t i = 0; i < numCategories; ++i) {
+        if (std::strcmp(categoryNames[i], name) == 0) { return i; }
+    }
+    // Once the table is full, further categories are counted as "other"
+    if (numCategories == maxCategories) { return 0; }
+    categoryNames[numCategories] = name;
+    return numCategories++;
+}
+
+size_t setCategory(size_t category) {
+    size_t prev = localCategory;
+    localCategory = category;
+    return prev;
+}
+
+bool writeStats(const std::string& path) {
+    size_t nthreads = std::min(numThreads.load(), maxThreads);
+    size_t ncat{0};
+    {
+        std::lock_guard<std::mutex> lock(categoryMutex);
+        ncat = numCategories;
+    }
+    std::ofstream out(path);
+    if (!out.good()) { return false; }
+    out << "{\n    \"categories\": [";
+    for (size_t c = 0; c < ncat; ++c) {
+        uint64_t allocs{0}, bytes{0}, frees{0};
+        for (size_t t = 0; t < nthreads; ++t) {
+            allocs += threadCounts[t].allocs[c].load(std::memory_order_relaxed);
+            bytes += threadCounts[t].bytes[c].load(std::memory_order_relaxed);
+            frees += threadCounts[t].frees[c].load(std::memory_order_relaxed);
+        }
+        out << (c > 0 ? ",\n" : "\n")
+            << "        {\"name\": \"" << categoryNames[c] << "\", \"allocations\": " << allocs
+            << ", \"bytes\": " << bytes << ", \"deallocations\": " << frees << "}";
+    }
+    out << "\n    ],\n    \"num_threads\": " << numThreads.load() << "\n}\n";
+    return out.good();
+}
+
+} // namespace alloc
+} // namespace salmon
+
+void* operator new(std::size_t n) { return salmon::alloc::allocate(n); }
+void* operator new[](std::size_t n) { return salmon::alloc::allocate(n); }
+void* operator new(std::size_t n, const std::nothrow_t&) noexcept { return salmon::alloc::allocateNoThrow(n); }
+void* operator new[](std::size_t n, const std::nothrow_t&) noexcept { return salmon::alloc::allocateNoThrow(n); }
+void operator delete(void* p) noexcept { salmon::alloc::deallocate(p); }
+void operator delete[](void* p) noexcept { salmon::alloc::deallocate(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { salmon::alloc::deallocate(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { salmon::alloc::deallocate(p); }
+
+#endif // SALMON_ENABLE_ALLOC_STATS
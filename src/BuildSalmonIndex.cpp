@@ -12,6 +12,7 @@
 #include <functional>
 #include <memory>
 #include <cassert>
+#include <unordered_map>
 
 #include <unistd.h>
 #include <sys/types.h>
@@ -33,6 +34,7 @@
 #include <boost/algorithm/string.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/range/irange.hpp>
+#include <boost/functional/hash.hpp>
 #include <boost/filesystem.hpp>
 
 #include "tbb/parallel_for_each.h"
@@ -43,6 +45,10 @@
 #include "Transcript.hpp"
 #include "SalmonUtils.hpp"
 #include "SalmonIndex.hpp"
+#include "IndexChecksums.hpp"
+#include "DuplicateTranscripts.hpp"
+#include "TranscriptBiasTables.hpp"
+#include "xxhash.h"
 #include "GenomicFeature.hpp"
 #include "spdlog/spdlog.h"
 #include "spdlog/details/format.h"
@@ -62,6 +68,311 @@ bool isPowerOfTwo(uint32_t n) {
   return (n > 0 and (n & (n-1)) == 0);
 }
 
+/**
+ * Write the transcripts of a quasi index, followed by those of each of its
+ * extensions, to out in FASTA format.
+ */
+template <typename RapMapIndexT>
+void writeQuasiTranscripts(SalmonIndex& sidx, RapMapIndexT* qidx, std::ostream& out) {
+    auto writeIndex = [&out](RapMapIndexT* idx) -> void {
+        for (size_t i = 0; i < idx->txpNames.size(); ++i) {
+            out << '>' << idx->txpNames[i] << '\n';
+            out.write(idx->seq.data() + idx->txpOffsets[i], idx->txpLens[i]);
+            out << '\n';
+        }
+    };
+    writeIndex(qidx);
+    for (auto& ext : sidx.quasiExtensions(qidx)) { writeIndex(ext.get()); }
+}
+
+// The length of the k-mers of the sequence bias model (see ReadKmerDist)
+constexpr uint32_t biasTablesKmerLen = 6;
+
+template <typename RapMapIndexT>
+bool writeQuasiBiasTables(SalmonIndex& sidx, RapMapIndexT* qidx,
+                          const boost::filesystem::path& indexDirectory, std::string& err) {
+    std::vector<const char*> seqs;
+    std::vector<uint32_t> lens;
+    auto addIndex = [&seqs, &lens](RapMapIndexT* idx) -> void {
+        for (size_t i = 0; i < idx->txpNames.size(); ++i) {
+            seqs.push_back(idx->seq.data() + idx->txpOffsets[i]);
+            lens.push_back(idx->txpLens[i]);
+        }
+    };
+    addIndex(qidx);
+    for (auto& ext : sidx.quasiExtensions(qidx)) { addIndex(ext.get()); }
+    return TranscriptBiasTables::write(indexDirectory, biasTablesKmerLen, seqs, lens, err);
+}
+
+/**
+ * Precompute the transcript-side tables of the bias models (see
+ * TranscriptBiasTables) of the quasi index in indexDirectory and its
+ * extensions.  They're computed from the sequences of the index itself,
+ * since those are the sequences quant reads.
+ */
+bool writeBiasTables(const boost::filesystem::path& indexDirectory,
+                     std::shared_ptr<spdlog::logger>& log) {
+    log->info("precomputing the bias tables");
+    SalmonIndex sidx(log, SalmonIndexType::QUASI);
+    sidx.load(indexDirectory);
+    std::string err;
+    bool ok{false};
+    if (sidx.is64BitQuasi()) {
+        ok = sidx.isPerfectHashQuasi() ?
+            writeQuasiBiasTables(sidx, sidx.quasiIndexPerfectHash64(), indexDirectory, err) :
+            writeQuasiBiasTables(sidx, sidx.quasiIndex64(), indexDirectory, err);
+    } else {
+        ok = sidx.isPerfectHashQuasi() ?
+            writeQuasiBiasTables(sidx, sidx.quasiIndexPerfectHash32(), indexDirectory, err) :
+            writeQuasiBiasTables(sidx, sidx.quasiIndex32(), indexDirectory, err);
+    }
+    if (!ok) { log->error("Couldn't precompute the bias tables: {}", err); }
+    return ok;
+}
+
+/**
+ * Merge the extensions of the quasi index in indexDirectory (see --extend)
+ * into the index itself, by rebuilding it from the transcripts of the index
+ * and all of its extensions.  If the rebuild fails, the merged transcripts
+ * are left in compacted_transcripts.fa in the index directory.
+ */
+int compactQuasiIndex(const boost::filesystem::path& indexDirectory, bool biasTables,
+                      std::shared_ptr<spdlog::logger>& log) {
+    namespace bfs = boost::filesystem;
+    if (SalmonIndex::quasiExtensionDirs(indexDirectory).empty()) {
+        log->info("The index {} has no extensions; there is nothing to compact", indexDirectory.string());
+        return 0;
+    }
+
+    SalmonIndexVersionInfo versionInfo;
+    versionInfo.load(indexDirectory / "versionInfo.json");
+    if (versionInfo.indexVersion() == 0 or versionInfo.indexType() != SalmonIndexType::QUASI) {
+        log->error("{} does not appear to be a quasi index", indexDirectory.string());
+        return 1;
+    }
+    uint32_t k = versionInfo.auxKmerLength();
+
+    bfs::path fastaPath = indexDirectory / "compacted_transcripts.fa";
+    bool perfectHash{false};
+    {
+        SalmonIndex sidx(log, SalmonIndexType::QUASI);
+        sidx.load(indexDirectory);
+        perfectHash = sidx.isPerfectHashQuasi();
+        std::ofstream out(fastaPath.string());
+        if (sidx.is64BitQuasi()) {
+            if (perfectHash) {
+                writeQuasiTranscripts(sidx, sidx.quasiIndexPerfectHash64(), out);
+            } else {
+                writeQuasiTranscripts(sidx, sidx.quasiIndex64(), out);
+            }
+        } else {
+            if (perfectHash) {
+                writeQuasiTranscripts(sidx, sidx.quasiIndexPerfectHash32(), out);
+            } else {
+                writeQuasiTranscripts(sidx, sidx.quasiIndex32(), out);
+            }
+        }
+        if (!out.good()) {
+            log->error("Couldn't write the merged transcripts to {}", fastaPath.string());
+            return 1;
+        }
+    }
+
+    std::vector<std::string> argVec{"dummy", "-k", std::to_string(k), "-t", fastaPath.string(),
+                                    "-i", indexDirectory.string()};
+    if (perfectHash) { argVec.push_back("--perfectHash"); }
+    log->info("rebuilding the index from the transcripts of the index and its extensions");
+    SalmonIndex builder(log, SalmonIndexType::QUASI);
+    if (!builder.build(indexDirectory, argVec, k)) {
+        log->error("Rebuilding the index failed; the merged transcripts are in {}", fastaPath.string());
+        return 1;
+    }
+    bfs::remove_all(indexDirectory / "extensions");
+    bfs::remove(fastaPath);
+    if (biasTables and !writeBiasTables(indexDirectory, log)) { return 1; }
+    salmon::utils::IndexChecksums::write(indexDirectory, log);
+    log->info("done compacting the index");
+    return 0;
+}
+
+/**
+ * Write the transcripts of fastaFile to uniqueFile, leaving out each whose
+ * sequence is identical to that of an earlier one, and record the ones left
+ * out in dups.  Only the length and 64-bit hash of each retained sequence
+ * (and where it was written to uniqueFile) is held; a sequence whose length
+ * and hash match those of a retained one is read back from uniqueFile and
+ * compared with it, so that a hash collision doesn't merge two transcripts.
+ */
+bool collapseDuplicateSequences(const std::string& fastaFile,
+                                const boost::filesystem::path& uniqueFile,
+                                DuplicateTranscripts& dups,
+                                std::shared_ptr<spdlog::logger>& log) {
+    using stream_manager = jellyfish::stream_manager<std::vector<std::string>::const_iterator>;
+    using single_parser = jellyfish::whole_sequence_parser<stream_manager>;
+
+    std::vector<std::string> readFiles{fastaFile};
+    size_t maxReadGroup{1000};
+    size_t concurrentFile{1};
+    stream_manager streams(readFiles.cbegin(), readFiles.cend(), concurrentFile);
+    single_parser parser(4, maxReadGroup, concurrentFile, streams);
+
+    std::ofstream out(uniqueFile.string());
+    if (!out.good()) {
+        log->error("Couldn't write {}", uniqueFile.string());
+        return false;
+    }
+    std::ifstream written(uniqueFile.string(), std::ios_base::in | std::ios_base::binary);
+    // (length, hash) of the retained sequences -> the offset of each in
+    // uniqueFile, and its name (more than one only on a hash collision)
+    std::unordered_map<std::pair<uint64_t, uint64_t>, std::vector<std::pair<uint64_t, std::string>>,
+                       boost::hash<std::pair<uint64_t, uint64_t>>> retained;
+    uint64_t numRetained{0};
+    uint64_t outPos{0};
+    std::string prevSeq;
+    // The name of the retained transcript whose sequence is seq, if any
+    auto findRetained = [&](const std::vector<std::pair<uint64_t, std::string>>& candidates,
+                            const std::string& seq) -> const std::string* {
+        out.flush();
+        for (auto& c : candidates) {
+            prevSeq.resize(seq.size());
+            written.clear();
+            written.seekg(c.first);
+            if (written.read(&prevSeq[0], seq.size()) and prevSeq == seq) { return &c.second; }
+        }
+        return nullptr;
+    };
+    while (true) {
+        single_parser::job j(parser);
+        if (j.is_empty()) { break; }
+        for (size_t i = 0; i < j->nb_filled; ++i) {
+            auto& header = j->data[i].header;
+            auto& seq = j->data[i].seq;
+            std::string name = header.substr(0, header.find(' '));
+            auto key = std::make_pair(static_cast<uint64_t>(seq.size()),
+                                      static_cast<uint64_t>(XXH64(seq.data(), seq.size(), 0)));
+            auto& candidates = retained[key];
+            if (!candidates.empty()) {
+                auto prevName = findRetained(candidates, seq);
+                if (prevName) {
+                    dups.add(*prevName, name);
+                    continue;
+                }
+            }
+            out << '>' << header << '\n';
+            outPos += header.size() + 2;
+            candidates.emplace_back(outPos, name);
+            out << seq << '\n';
+            outPos += seq.size() + 1;
+            ++numRetained;
+        }
+    }
+    log->info("left out {} transcripts whose sequences duplicate those of others ({} remain)",
+              dups.numDuplicates(), numRetained);
+    out.close();
+    return !out.fail();
+}
+
+/**
+ * An estimate of the peak memory, per base of the transcripts, of building a
+ * quasi index with a 32-bit suffix array: the text, the suffix array and
+ * the working space of its construction, and the k-mer hash (at most one
+ * distinct k-mer per base, at a load factor of 1/2).
+ */
+constexpr uint64_t quasiBuildBytesPerBase = 48;
+// The largest part whose suffix array is still 32-bit (with room for the separators)
+constexpr uint64_t maxQuasiPartBases = (uint64_t(1) << 31) - (uint64_t(1) << 26);
+
+/**
+ * Split the transcripts of fastaFile, in order, into FASTA files of at most
+ * maxBases bases each (a longer transcript gets a file of its own), written
+ * to partDir as part_000.fa, part_001.fa, ...
+ */
+bool partitionTranscripts(const std::string& fastaFile, uint64_t maxBases,
+                          const boost::filesystem::path& partDir,
+                          std::vector<boost::filesystem::path>& parts,
+                          std::shared_ptr<spdlog::logger>& log) {
+    namespace bfs = boost::filesystem;
+    using stream_manager = jellyfish::stream_manager<std::vector<std::string>::const_iterator>;
+    using single_parser = jellyfish::whole_sequence_parser<stream_manager>;
+
+    bfs::create_directories(partDir);
+    std::vector<std::string> readFiles{fastaFile};
+    size_t maxReadGroup{1000};
+    size_t concurrentFile{1};
+    stream_manager streams(readFiles.cbegin(), readFiles.cend(), concurrentFile);
+    single_parser parser(4, maxReadGroup, concurrentFile, streams);
+
+    std::ofstream out;
+    uint64_t partBases{0};
+    auto nextPart = [&]() -> bool {
+        if (out.is_open()) { out.close(); }
+        fmt::MemoryWriter partName;
+        partName.write("part_{:03d}.fa", parts.size());
+        parts.push_back(partDir / partName.str());
+        out.open(parts.back().string());
+        partBases = 0;
+        return out.good();
+    };
+
+    while (true) {
+        single_parser::job j(parser);
+        if (j.is_empty()) { break; }
+        for (size_t i = 0; i < j->nb_filled; ++i) {
+            auto& header = j->data[i].header;
+            auto& seq = j->data[i].seq;
+            if (parts.empty() or (partBases > 0 and partBases + seq.size() > maxBases)) {
+                if (!nextPart()) {
+                    log->error("Couldn't write {}", parts.back().string());
+                    return false;
+                }
+            }
+            if (seq.size() > maxBases) {
+                log->warn("transcript {} ({} bases) alone exceeds the build memory budget",
+                          header.substr(0, header.find(' ')), seq.size());
+            }
+            out << '>' << header << '\n' << seq << '\n';
+            partBases += seq.size();
+        }
+    }
+    out.close();
+    return !out.fail();
+}
+
+/**
+ * Build the quasi index in indexDirectory from the transcripts in parts:
+ * the first part as the index, and each of the others as an extension of
+ * it (see --extend), so that at most one part's index is in memory at a
+ * time.
+ */
+int buildQuasiIndexInParts(const boost::filesystem::path& indexDirectory,
+                           const std::vector<boost::filesystem::path>& parts,
+                           uint32_t k, bool perfectHash,
+                           std::shared_ptr<spdlog::logger>& log) {
+    namespace bfs = boost::filesystem;
+    size_t firstExt = SalmonIndex::quasiExtensionDirs(indexDirectory).size();
+    for (size_t i = 0; i < parts.size(); ++i) {
+        bfs::path buildDirectory = indexDirectory;
+        if (i > 0) {
+            fmt::MemoryWriter extName;
+            extName.write("ext_{:03d}", firstExt + i - 1);
+            buildDirectory = indexDirectory / "extensions" / extName.str();
+            bfs::create_directories(buildDirectory);
+        }
+        std::vector<std::string> argVec{"dummy", "-k", std::to_string(k), "-t", parts[i].string(),
+                                        "-i", buildDirectory.string()};
+        if (perfectHash) { argVec.push_back("--perfectHash"); }
+        log->info("building part {} of {} of the index", i + 1, parts.size());
+        SalmonIndex builder(log, SalmonIndexType::QUASI);
+        if (!builder.build(buildDirectory, argVec, k)) {
+            log->error("Building part {} of the index (from {}) failed", i + 1, parts[i].string());
+            return 1;
+        }
+        bfs::remove(parts[i]);
+    }
+    bfs::remove_all(indexDirectory / "partitions");
+    return 0;
+}
+
 int salmonIndex(int argc, char* argv[]) {
 
     using std::string;
@@ -73,15 +384,21 @@ int salmonIndex(int argc, char* argv[]) {
     string indexTypeStr = "fmd";
     uint32_t saSampInterval = 1;
     uint32_t auxKmerLen = 0;
+    uint32_t fmdAuxKmerLen = 0;
     uint32_t numThreads;
     bool useQuasi{false};
     bool perfectHash{false};
+    bool extend{false};
+    bool compact{false};
+    double buildMemoryGB{0.0};
+    bool collapseDuplicates{false};
+    bool biasTables{false};
 
     po::options_description generic("Command Line Options");
     generic.add_options()
     ("version,v", "print version string")
     ("help,h", "produce help message")
-    ("transcripts,t", po::value<string>()->required(), "Transcript fasta file.")
+    ("transcripts,t", po::value<string>(), "Transcript fasta file.")
     ("kmerLen,k", po::value<uint32_t>(&auxKmerLen)->default_value(31)->required(),
                     "The size of k-mers that should be used for the quasi index.")
     ("index,i", po::value<string>()->required(), "Salmon index.")
@@ -90,6 +407,29 @@ int salmonIndex(int argc, char* argv[]) {
     ("perfectHash", po::bool_switch(&perfectHash)->default_value(false), 
                              "[quasi index only] Build the index using a perfect hash rather than a dense hash.  This "
                              "will require less memory (especially during quantification), but will take longer to construct")
+    ("extend", po::bool_switch(&extend)->default_value(false),
+                             "[quasi index only] Add the transcripts of -t to the existing index -i as an "
+                             "extension, which is mapped against alongside the index, rather than rebuilding "
+                             "the index.  The extension uses the k-mer length and hash type of the index.")
+    ("compact", po::bool_switch(&compact)->default_value(false),
+                             "[quasi index only] Merge the extensions of the index -i into the index itself, "
+                             "by rebuilding it from all of their transcripts (no -t is needed)")
+    ("collapseDuplicates", po::bool_switch(&collapseDuplicates)->default_value(false),
+                             "[quasi index only] Index each distinct transcript sequence once: a transcript "
+                             "whose sequence is identical to that of an earlier one is left out of the index, "
+                             "and recorded in duplicate_transcripts.tsv, from which quant can report it "
+                             "again (--expandDuplicates).")
+    ("biasTables", po::bool_switch(&biasTables)->default_value(false),
+                             "[quasi index only] Precompute the tables of the transcripts that the bias models "
+                             "of quant (--seqBias, --gcBias) would otherwise compute in every run: the "
+                             "cumulative GC count and the k-mer at each position of each transcript.  They "
+                             "take 6 bytes per base, in bias_tables.bin, which quant maps.  The tables of an "
+                             "index that has them are kept up to date by --extend and --compact.")
+    ("buildMemory", po::value<double>(&buildMemoryGB)->default_value(0.0),
+                             "[quasi index only] The memory (in GB) the build may use.  If the transcripts "
+                             "need more, they are split into parts which each fit, and which are built one "
+                             "after another: the first as the index, the others as its extensions (see "
+                             "--extend).  Mapping is somewhat slower with more parts.  0 means no limit.")
     ("type", po::value<string>(&indexTypeStr)->default_value("quasi")->required(), "The type of index to build; options are \"fmd\" and \"quasi\" "
     							   			   "\"quasi\" is recommended, and \"fmd\" may be removed in the future")
     ("sasamp,s", po::value<uint32_t>(&saSampInterval)->default_value(1)->required(),
@@ -97,6 +437,12 @@ int salmonIndex(int argc, char* argv[]) {
                             "Smaller values are faster, but produce a larger index. "
                             "The default should be OK, unless your transcriptome is huge. "
 			    "This value should be a power of 2.")
+    ("auxKmerLen", po::value<uint32_t>(&fmdAuxKmerLen)->default_value(10),
+                            "[fmd index only] The length of the k-mers of the auxiliary k-mer index, which "
+                            "holds the BWT interval of every k-mer of the transcripts; the seed searches "
+                            "start from it rather than extending each seed base by base.  It's only used "
+                            "when it's no longer than the minimum seed length (quant --minLen), and its "
+                            "size grows quickly with k.  0 disables it.")
     ;
 
     po::variables_map vm;
@@ -134,9 +480,22 @@ Creates a salmon index.
           throw(std::logic_error(errWriter.str()));
         }
 
-        string transcriptFile = vm["transcripts"].as<string>();
+        if (extend and compact) {
+            throw(std::logic_error("Error: --extend and --compact cannot be used together."));
+        }
+        if (!compact and !vm.count("transcripts")) {
+            throw(std::logic_error("Error: the option '--transcripts' is required."));
+        }
+        string transcriptFile = compact ? "" : vm["transcripts"].as<string>();
         bfs::path indexDirectory(vm["index"].as<string>());
 
+        if ((extend or compact) and !bfs::exists(indexDirectory / "versionInfo.json")) {
+            fmt::MemoryWriter errWriter;
+            errWriter << "Error: --extend and --compact require an existing index, but "
+                      << indexDirectory << " does not contain one.";
+            throw(std::logic_error(errWriter.str()));
+        }
+
 
         if (!bfs::exists(indexDirectory)) {
             std::cerr << "index [" << indexDirectory << "] did not previously exist "
@@ -154,6 +513,63 @@ Creates a salmon index.
         auto fileLog = spdlog::create("fLog", {fileSink});
         auto jointLog = spdlog::create("jLog", {fileSink, consoleSink});
 
+        // The bias tables are written if asked for, or kept up to date if
+        // an index that has them is extended or compacted; a new index
+        // doesn't keep those of the one it replaces
+        bfs::path biasTablesPath = indexDirectory / TranscriptBiasTables::fileName();
+        if (biasTables and !useQuasi) {
+            throw(std::logic_error("Error: --biasTables only applies to quasi indices."));
+        }
+        bool writeTables = biasTables or ((extend or compact) and bfs::exists(biasTablesPath));
+        if (!writeTables) { bfs::remove(biasTablesPath); }
+
+        if (compact) { return compactQuasiIndex(indexDirectory, writeTables, jointLog); }
+
+        // An extension is built as an index of its own, in the extensions
+        // directory of the index that it extends
+        bfs::path buildDirectory = indexDirectory;
+        if (extend) {
+            SalmonIndexVersionInfo baseInfo;
+            baseInfo.load(indexDirectory / "versionInfo.json");
+            if (!useQuasi or baseInfo.indexType() != SalmonIndexType::QUASI) {
+                throw(std::logic_error("Error: only quasi indices can be extended."));
+            }
+            if (baseInfo.auxKmerLength() != auxKmerLen) {
+                jointLog->warn("The index being extended uses k = {}; using this k-mer length "
+                               "for the extension", baseInfo.auxKmerLength());
+                auxKmerLen = baseInfo.auxKmerLength();
+            }
+            IndexHeader h;
+            std::ifstream headerStream((indexDirectory / "header.json").string());
+            {
+                cereal::JSONInputArchive ar(headerStream);
+                ar(h);
+            }
+            perfectHash = h.perfectHash();
+
+            fmt::MemoryWriter extName;
+            extName.write("ext_{:03d}", SalmonIndex::quasiExtensionDirs(indexDirectory).size());
+            buildDirectory = indexDirectory / "extensions" / extName.str();
+            bfs::create_directories(buildDirectory);
+            jointLog->info("building extension {} of index {}", extName.str(), indexDirectory.string());
+        }
+
+        // The index is built from the distinct sequences, in a file which
+        // is removed once it has been
+        bfs::path uniqueFile;
+        if (collapseDuplicates) {
+            if (!useQuasi or extend) {
+                throw(std::logic_error("Error: --collapseDuplicates only applies to new quasi indices."));
+            }
+            DuplicateTranscripts dups;
+            uniqueFile = indexDirectory / "unique_transcripts.fa";
+            if (!collapseDuplicateSequences(transcriptFile, uniqueFile, dups, jointLog) or
+                !dups.write(indexDirectory)) {
+                return 1;
+            }
+            transcriptFile = uniqueFile.string();
+        }
+
         std::vector<std::string> transcriptFiles = {transcriptFile};
         fmt::MemoryWriter infostr;
 
@@ -164,7 +580,7 @@ Creates a salmon index.
         std::unique_ptr<SalmonIndex> sidx = nullptr;
         // Build a quasi-mapping index
         if (useQuasi) {
-            outputPrefix = indexDirectory;
+            outputPrefix = buildDirectory;
             argVec->push_back("dummy");
             argVec->push_back("-k");
 
@@ -196,13 +612,41 @@ Creates a salmon index.
             argVec->push_back(outputPrefix.string());
             argVec->push_back(transcriptFile);
             sidx.reset(new SalmonIndex(jointLog, SalmonIndexType::FMD));
-    	    // Disable the auxiliary k-mer index for now
-	        auxKmerLen = 0;
+            // The auxiliary k-mer index is built with its own (small) k
+            auxKmerLen = fmdAuxKmerLen;
+        }
+
+        if (useQuasi and !extend and buildMemoryGB > 0.0) {
+            uint64_t budget = static_cast<uint64_t>(buildMemoryGB * 1024.0 * 1024.0 * 1024.0);
+            uint64_t maxBases = std::min(std::max(budget / quasiBuildBytesPerBase, uint64_t(1)),
+                                         maxQuasiPartBases);
+            std::vector<bfs::path> parts;
+            bfs::path partDir = indexDirectory / "partitions";
+            if (!partitionTranscripts(transcriptFile, maxBases, partDir, parts, jointLog)) {
+                return 1;
+            }
+            if (parts.size() > 1) {
+                jointLog->info("the transcripts don't fit in {} GB; building the index in {} parts "
+                               "of at most {} bases", buildMemoryGB, parts.size(), maxBases);
+                ret = buildQuasiIndexInParts(indexDirectory, parts, auxKmerLen, perfectHash, jointLog);
+                if (!uniqueFile.empty()) { bfs::remove(uniqueFile); }
+                if (ret == 0 and writeTables and !writeBiasTables(indexDirectory, jointLog)) { ret = 1; }
+                if (ret == 0) {
+                    salmon::utils::IndexChecksums::write(indexDirectory, jointLog);
+                    jointLog->info("done building index");
+                }
+                return ret;
+            }
+            bfs::remove_all(partDir);
         }
 
         jointLog->info("building index");
-	    sidx->build(indexDirectory, *(argVec.get()), auxKmerLen);
+	    sidx->build(buildDirectory, *(argVec.get()), auxKmerLen);
+        if (!uniqueFile.empty()) { bfs::remove(uniqueFile); }
         jointLog->info("done building index");
+        if (writeTables and !writeBiasTables(indexDirectory, jointLog)) { return 1; }
+        // The checksums cover the index and all of its extensions
+        salmon::utils::IndexChecksums::write(indexDirectory, jointLog);
         // If we want to build the auxiliary k-mer index, do it here.
         /*
         uint32_t k = 15;
@@ -1,16 +1,24 @@
 #include <vector>
+#include <map>
+#include <mutex>
 #include <unordered_map>
 #include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <numeric>
+#include <algorithm>
 
-#include "tbb/task_scheduler_init.h"
 #include "tbb/parallel_for.h"
 #include "tbb/parallel_for_each.h"
 #include "tbb/parallel_reduce.h"
 #include "tbb/blocked_range.h"
 #include "tbb/partitioner.h"
+#include "tbb/combinable.h"
 
 //#include "fastapprox.h"
 #include <boost/math/special_functions/digamma.hpp>
+#include <boost/pending/disjoint_sets.hpp>
 
 // C++ string formatting library
 #include "spdlog/details/format.h"
@@ -21,21 +29,36 @@
 #include "CollapsedEMOptimizer.hpp"
 #include "Transcript.hpp"
 #include "TranscriptGroup.hpp"
+#include "EquivalenceClassArena.hpp"
+#include "EquivalenceClassComponents.hpp"
+#include "BootstrapEMUpdate.hpp"
 #include "SalmonMath.hpp"
 #include "AlignmentLibrary.hpp"
 #include "ReadPair.hpp"
 #include "UnpairedRead.hpp"
 #include "ReadExperiment.hpp"
 #include "MultinomialSampler.hpp"
+#include "BootstrapCheckpoint.hpp"
+#include "SampleSummary.hpp"
+#include "RandomStreams.hpp"
 #include "BootstrapWriter.hpp"
+#include "TaskArena.hpp"
+#include "RunProfiler.hpp"
+#include "MetricsServer.hpp"
+#include "TraceEvents.hpp"
+#include "AllocationStats.hpp"
+#include "EMDevice.hpp"
+#include "RunExit.hpp"
 
 using BlockedIndexRange =  tbb::blocked_range<size_t>;
 
-// intelligently chosen value adopted from
-// https://github.com/pachterlab/kallisto/blob/master/src/EMAlgorithm.h#L18
-constexpr double minEQClassWeight = std::numeric_limits<double>::denorm_min();
 constexpr double minWeight = std::numeric_limits<double>::denorm_min();
 
+using salmon::optimizer::minEQClassWeight;
+using salmon::optimizer::SingletonClasses;
+using salmon::optimizer::EMUpdate_;
+using salmon::optimizer::batchEMUpdate_;
+
 double normalize(std::vector<tbb::atomic<double>>& vec) {
     double sum{0.0};
     for (auto& v : vec) {
@@ -68,67 +91,69 @@ double truncateCountVector(VecT& alphas, double cutoff) {
     return alphaSum;
 }
 
+
 /**
- * Single-threaded EM-update routine for use in bootstrapping
+ * The valid classes of an arena restricted to its active transcripts
+ * (--activeSetEM): those whose abundance is at least minAlpha.  A
+ * transcript below it takes (almost) nothing from any class it shares, so
+ * between the full rounds that re-check it, it is frozen at its abundance
+ * and dropped from the labels of its classes.  The classes left with a
+ * single active transcript move to the singleton path, and those left
+ * with none (whose weight is then negligible anyway) are dropped.
  */
-template <typename VecT>
-void EMUpdate_(
-        std::vector<std::vector<uint32_t>>& txpGroupLabels,
-        std::vector<std::vector<double>>& txpGroupCombinedWeights,
-        std::vector<uint64_t>& txpGroupCounts,
-        std::vector<Transcript>& transcripts,
-        const VecT& alphaIn,
-        VecT& alphaOut) {
-
-    assert(alphaIn.size() == alphaOut.size());
-
-    size_t numEqClasses = txpGroupLabels.size();
-    for (size_t eqID = 0; eqID < numEqClasses; ++eqID) {
-        uint64_t count = txpGroupCounts[eqID];
-        // for each transcript in this class
-        const std::vector<uint32_t>& txps = txpGroupLabels[eqID];
-        const auto& auxs = txpGroupCombinedWeights[eqID];
-
-        double denom = 0.0;
-        size_t groupSize = txps.size();
-        // If this is a single-transcript group,
-        // then it gets the full count.  Otherwise,
-        // update according to our VBEM rule.
-        if (BOOST_LIKELY(groupSize > 1)) {
-           for (size_t i = 0; i < groupSize; ++i) {
-               auto tid = txps[i];
-               auto aux = auxs[i];
-               double v = alphaIn[tid] * aux;
-               denom += v;
+struct ActiveSetArena {
+    template <typename VecT>
+    void build(const EquivalenceClassArena& full, const VecT& alphas, double minAlpha) {
+        std::vector<uint8_t> active(alphas.size(), 0);
+        frozen.clear();
+        for (size_t t = 0; t < alphas.size(); ++t) {
+            if (alphas[t] >= minAlpha) {
+                active[t] = 1;
+            } else {
+                frozen.push_back(t);
             }
+        }
 
-            if (denom <= ::minEQClassWeight) {
-                // tgroup.setValid(false);
-            } else {
-                double invDenom = count / denom;
-                for (size_t i = 0; i < groupSize; ++i) {
-                    auto tid = txps[i];
-                    auto aux = auxs[i];
-                    double v = alphaIn[tid] * aux;
-                    if (!std::isnan(v)) {
-                        salmon::utils::incLoop(alphaOut[tid], v * invDenom);
-                    }
+        arena.clear();
+        arena.reserve(full.numClasses(), full.numEntries());
+        std::vector<uint32_t> label;
+        std::vector<double> weights;
+        for (size_t eqID = 0; eqID < full.numClasses(); ++eqID) {
+            if (!full.valid[eqID]) { continue; }
+            label.clear();
+            weights.clear();
+            for (size_t i = full.offsets[eqID]; i < full.offsets[eqID + 1]; ++i) {
+                if (active[full.labels[i]]) {
+                    label.push_back(full.labels[i]);
+                    weights.push_back(full.combinedWeights[i]);
                 }
             }
-        } else {
-            salmon::utils::incLoop(alphaOut[txps.front()], count);
+            if (label.empty()) { continue; }
+            arena.addClass(label.begin(), label.end(), weights.begin(), weights.begin(),
+                           false, full.counts[eqID]);
+            std::copy(weights.begin(), weights.end(), arena.combinedWeights.end() - weights.size());
         }
+        if (full.hasSinglePrecisionWeights()) { arena.storeSinglePrecisionWeights(); }
+        split.reset(new SingletonClasses(arena, false));
+        split->setCounts(arena, arena.counts.data(), alphas.size());
+        if (indexEntries) { split->indexEntries(arena, alphas.size()); }
     }
-}
+
+    EquivalenceClassArena arena;
+    std::unique_ptr<SingletonClasses> split{nullptr};
+    std::vector<uint32_t> frozen; // the transcripts left out of arena's labels
+    bool indexEntries{false}; // index the entries of split by transcript (--deterministic)
+};
 
 /**
  * Single-threaded VBEM-update routine for use in bootstrapping
  */
-template <typename VecT>
+template <typename WeightT, typename VecT>
 void VBEMUpdate_(
-		std::vector<std::vector<uint32_t>>& txpGroupLabels,
-		std::vector<std::vector<double>>& txpGroupCombinedWeights,
-		std::vector<uint64_t>& txpGroupCounts,
+		const EquivalenceClassArena& eqArena,
+		const WeightT* auxs,
+		const std::vector<uint64_t>& txpGroupCounts,
+		const SingletonClasses& split,
 		std::vector<Transcript>& transcripts,
 		double priorAlpha,
 		double totLen,
@@ -138,98 +163,305 @@ void VBEMUpdate_(
 
 	assert(alphaIn.size() == alphaOut.size());
 
-	size_t numEQClasses = txpGroupLabels.size();
+	const uint64_t* offsets = eqArena.offsets.data();
+	const uint32_t* labels = eqArena.labels.data();
+
 	double alphaSum = {0.0};
 	for (auto& e : alphaIn) { alphaSum += e; }
 
-	double logNorm = boost::math::digamma(alphaSum);
+	double logNorm = salmon::math::digamma(alphaSum);
+	// exp(psi(alpha_i) - logNorm), without a log or an exp for most alphas
+	double invNorm = std::exp(-logNorm);
 
 
 	double prior = priorAlpha;
 	double priorNorm = prior * totLen;
 
+	// The single-transcript classes give their transcripts their full counts
+	const double* uniqueCounts = split.uniqueCounts.data();
 	for (size_t i = 0; i < transcripts.size(); ++i) {
 	  if (alphaIn[i] > ::minWeight) {
-	    expTheta[i] = std::exp(boost::math::digamma(alphaIn[i]) - logNorm);
+	    expTheta[i] = salmon::math::expDigamma(alphaIn[i]) * invNorm;
 	  } else {
 	    expTheta[i] = 0.0;
 	  }
-	  alphaOut[i] = prior;
+	  alphaOut[i] = prior + uniqueCounts[i];
 	}
 
-	for (size_t eqID = 0; eqID < numEQClasses; ++eqID) {
+	for (auto eqID : split.multiClasses) {
 	  uint64_t count = txpGroupCounts[eqID];
-	  const std::vector<uint32_t>& txps = txpGroupLabels[eqID];
-	  const auto& auxs = txpGroupCombinedWeights[eqID];
+	  // classes that were not sampled (or are invalid) contribute nothing
+	  if (count == 0) { continue; }
+	  size_t start = offsets[eqID];
+	  size_t end = offsets[eqID + 1];
 
 	  double denom = 0.0;
-	  size_t groupSize = txps.size();
-	  // If this is a single-transcript group,
-	  // then it gets the full count.  Otherwise,
-	  // update according to our VBEM rule.
-	  if (BOOST_LIKELY(groupSize > 1)) {
-	    for (size_t i = 0; i < groupSize; ++i) {
-	      auto tid = txps[i];
+	  for (size_t i = start; i < end; ++i) {
+	    auto tid = labels[i];
+	    auto aux = auxs[i];
+	    if (expTheta[tid] > 0.0) {
+	      double v = expTheta[tid] * aux;
+	      denom += v;
+	    }
+	  }
+	  if (denom <= ::minEQClassWeight) {
+	    // tgroup.setValid(false);
+	  } else {
+	    double invDenom = count / denom;
+	    for (size_t i = start; i < end; ++i) {
+	      auto tid = labels[i];
 	      auto aux = auxs[i];
 	      if (expTheta[tid] > 0.0) {
 		double v = expTheta[tid] * aux;
-		denom += v;
+		salmon::utils::incLoop(alphaOut[tid], v * invDenom);
 	      }
 	    }
-	    if (denom <= ::minEQClassWeight) {
-	      // tgroup.setValid(false);
-	    } else {
-	      double invDenom = count / denom;
-	      for (size_t i = 0; i < groupSize; ++i) {
-		auto tid = txps[i];
-		auto aux = auxs[i];
-		if (expTheta[tid] > 0.0) {
-		  double v = expTheta[tid] * aux;
-		  salmon::utils::incLoop(alphaOut[tid], v * invDenom);
-		}
-	      }
-	    }
-
-	  } else {
-	    salmon::utils::incLoop(alphaOut[txps.front()], count);
 	  }
 	}
 }
 
 
+// Read the class weights at the precision in which the arena stores them
+template <typename VecT>
+void VBEMUpdate_(
+		const EquivalenceClassArena& eqArena,
+		const std::vector<uint64_t>& txpGroupCounts,
+		const SingletonClasses& split,
+		std::vector<Transcript>& transcripts,
+		double priorAlpha,
+		double totLen,
+		const VecT& alphaIn,
+		VecT& alphaOut,
+		VecT& expTheta) {
+    if (eqArena.hasSinglePrecisionWeights()) {
+        VBEMUpdate_(eqArena, eqArena.singlePrecisionWeights.data(), txpGroupCounts, split, transcripts,
+                    priorAlpha, totLen, alphaIn, alphaOut, expTheta);
+    } else {
+        VBEMUpdate_(eqArena, eqArena.combinedWeights.data(), txpGroupCounts, split, transcripts,
+                    priorAlpha, totLen, alphaIn, alphaOut, expTheta);
+    }
+}
+
+namespace salmon {
+namespace optimizer {
+
+void emRound(const EquivalenceClassArena& eqArena,
+             const std::vector<uint64_t>& counts,
+             std::vector<Transcript>& transcripts,
+             const std::vector<double>& alphaIn,
+             std::vector<double>& alphaOut) {
+    std::fill(alphaOut.begin(), alphaOut.end(), 0.0);
+    SingletonClasses split(eqArena, false);
+    split.setCounts(eqArena, counts.data(), transcripts.size());
+    EMUpdate_(eqArena, counts, split, alphaIn, alphaOut);
+}
+
+void vbemRound(const EquivalenceClassArena& eqArena,
+               const std::vector<uint64_t>& counts,
+               std::vector<Transcript>& transcripts,
+               double priorAlpha,
+               double totLen,
+               const std::vector<double>& alphaIn,
+               std::vector<double>& alphaOut,
+               std::vector<double>& expTheta) {
+    SingletonClasses split(eqArena, false);
+    split.setCounts(eqArena, counts.data(), transcripts.size());
+    VBEMUpdate_(eqArena, counts, split, transcripts, priorAlpha, totLen, alphaIn, alphaOut, expTheta);
+}
+
+uint32_t distributedEM(salmon::dist::Communicator& comm,
+                       const EquivalenceClassArena& localArena,
+                       const std::vector<uint64_t>& localCounts,
+                       std::vector<Transcript>& transcripts,
+                       bool useVBEM,
+                       double priorAlpha,
+                       double relDiffTolerance,
+                       uint32_t maxIter,
+                       std::vector<double>& alphas) {
+    size_t numTxps = transcripts.size();
+    std::vector<double> alphasPrime(numTxps, 0.0);
+    std::vector<double> expTheta(useVBEM ? numTxps : 0, 0.0);
+    double totLen{0.0};
+    for (auto& t : transcripts) { totLen += t.EffectiveLength; }
+    // The VBEM update starts each transcript from the prior; only one rank
+    // may add it, or the sum would hold it once per rank
+    double localPrior = (comm.rank() == 0) ? priorAlpha : 0.0;
+
+    const uint32_t minIter{50};
+    const double alphaCheckCutoff{1e-2};
+    uint32_t itNum{0};
+    bool converged{false};
+    SingletonClasses split(localArena, false);
+    split.setCounts(localArena, localCounts.data(), numTxps);
+    while (itNum < minIter or (itNum < maxIter and !converged)) {
+        if (useVBEM) {
+            VBEMUpdate_(localArena, localCounts, split, transcripts, localPrior, totLen, alphas, alphasPrime, expTheta);
+        } else {
+            std::fill(alphasPrime.begin(), alphasPrime.end(), 0.0);
+            EMUpdate_(localArena, localCounts, split, alphas, alphasPrime);
+        }
+        comm.allreduceSum(alphasPrime.data(), numTxps);
+
+        converged = true;
+        for (size_t i = 0; i < numTxps; ++i) {
+            if (alphasPrime[i] > alphaCheckCutoff) {
+                double relDiff = std::abs(alphas[i] - alphasPrime[i]) / alphasPrime[i];
+                if (relDiff > relDiffTolerance) {
+                    converged = false;
+                    break;
+                }
+            }
+        }
+        std::swap(alphas, alphasPrime);
+        ++itNum;
+    }
+    return itNum;
+}
+
+} // namespace optimizer
+} // namespace salmon
+
+/*
+ * Per-thread, dense accumulation buffers for the parallel EM / VBEM
+ * updates.  Rather than performing an atomic add on the shared output
+ * vector for every contribution, each thread adds the contributions of the
+ * classes it processes to its own buffer.  At the end of the update, the
+ * buffers are summed into the output, in parallel over the transcripts.
+ *
+ * If deterministic (--deterministic), the contributions are instead
+ * stored per class entry, and each transcript's are summed in the order of
+ * the arena (see SingletonClasses::indexEntries), so that the update is
+ * the same, bit for bit, whatever the number of threads and however the
+ * classes are scheduled on them.
+ */
+class EMReductionBuffers {
+    public:
+        EMReductionBuffers(size_t numTxps, bool deterministic = false) :
+            deterministic_(deterministic),
+            buffers_([numTxps]() -> std::vector<double> {
+                return std::vector<double>(numTxps, 0.0);
+            }) {}
+
+        double* local() { return deterministic_ ? nullptr : buffers_.local().data(); }
+
+        // The (zeroed) per-entry buffer, if deterministic; nullptr otherwise
+        double* entries(size_t numEntries) {
+            if (!deterministic_) { return nullptr; }
+            if (entries_.size() < numEntries) { entries_.resize(numEntries, 0.0); }
+            return entries_.data();
+        }
+
+        /**
+         * Add the contents of all of the per-thread buffers (or of the
+         * per-entry buffer, indexed by split) to alphaOut, and zero the
+         * buffers for the next update.
+         */
+        void reduceInto(CollapsedEMOptimizer::VecType& alphaOut, const SingletonClasses& split) {
+            if (deterministic_) {
+                const uint64_t* offsets = split.txpEntryOffsets.data();
+                const uint64_t* txpEntries = split.txpEntries.data();
+                double* entries = entries_.data();
+                tbb::parallel_for(BlockedIndexRange(size_t(0), size_t(alphaOut.size())),
+                        [offsets, txpEntries, entries, &alphaOut](const BlockedIndexRange& range) -> void {
+                        for (auto t : boost::irange(range.begin(), range.end())) {
+                            double sum{0.0};
+                            for (size_t k = offsets[t]; k < offsets[t + 1]; ++k) {
+                                sum += entries[txpEntries[k]];
+                                entries[txpEntries[k]] = 0.0;
+                            }
+                            alphaOut[t] = alphaOut[t] + sum;
+                        }
+                });
+                return;
+            }
+            std::vector<std::vector<double>*> buffers;
+            buffers_.combine_each([&buffers](std::vector<double>& b) -> void {
+                buffers.push_back(&b);
+            });
+            tbb::parallel_for(BlockedIndexRange(size_t(0), size_t(alphaOut.size())),
+                    [&buffers, &alphaOut](const BlockedIndexRange& range) -> void {
+                    for (auto i : boost::irange(range.begin(), range.end())) {
+                        double sum{0.0};
+                        for (auto b : buffers) {
+                            sum += (*b)[i];
+                            (*b)[i] = 0.0;
+                        }
+                        alphaOut[i] = alphaOut[i] + sum;
+                    }
+            });
+        }
+
+    private:
+        bool deterministic_;
+        tbb::combinable<std::vector<double>> buffers_;
+        std::vector<double> entries_;
+};
+
+/*
+ * Add the contribution v of entry i to transcript tid; to the per-entry
+ * buffer or the thread's local buffer if we have one, and atomically to
+ * alphaOut otherwise.
+ */
+inline void addContribution_(double* entryOut,
+                             double* localOut,
+                             CollapsedEMOptimizer::VecType& alphaOut,
+                             size_t i,
+                             uint32_t tid,
+                             double v) {
+    if (entryOut) {
+        entryOut[i] = v;
+    } else if (localOut) {
+        localOut[tid] += v;
+    } else {
+        salmon::utils::incLoop(alphaOut[tid], v);
+    }
+}
+
 /*
  * Use the "standard" EM algorithm over equivalence
  * classes to estimate the latent variables (alphaOut)
  * given the current estimates (alphaIn).
  */
+template <typename WeightT>
 void EMUpdate_(
-        std::vector<std::pair<const TranscriptGroup, TGValue>>& eqVec,
+        EquivalenceClassArena& eqArena,
+        const WeightT* auxs,
+        const SingletonClasses& split,
         std::vector<Transcript>& transcripts,
         const CollapsedEMOptimizer::VecType& alphaIn,
-        CollapsedEMOptimizer::VecType& alphaOut) {
+        CollapsedEMOptimizer::VecType& alphaOut,
+        EMReductionBuffers* buffers) {
 
     assert(alphaIn.size() == alphaOut.size());
 
-    tbb::parallel_for(BlockedIndexRange(size_t(0), size_t(eqVec.size())),
-            [&eqVec, &alphaIn, &alphaOut](const BlockedIndexRange& range) -> void {
-            for (auto eqID : boost::irange(range.begin(), range.end())) {
-            auto& kv = eqVec[eqID];
+    const uint64_t* offsets = eqArena.offsets.data();
+    const uint64_t* counts = eqArena.counts.data();
+    const uint32_t* labels = eqArena.labels.data();
+    const uint32_t* multiClasses = split.multiClasses.data();
+    const double* uniqueCounts = split.uniqueCounts.data();
+
+    // The single-transcript classes give their transcripts their full counts
+    tbb::parallel_for(BlockedIndexRange(size_t(0), alphaOut.size()),
+            [uniqueCounts, &alphaOut](const BlockedIndexRange& range) -> void {
+            for (auto i : boost::irange(range.begin(), range.end())) {
+                alphaOut[i] = alphaOut[i] + uniqueCounts[i];
+            }
+    });
 
-            uint64_t count = kv.second.count;
+    double* entryOut = (buffers) ? buffers->entries(eqArena.numEntries()) : nullptr;
+    tbb::parallel_for(BlockedIndexRange(size_t(0), split.multiClasses.size()),
+            [offsets, counts, labels, multiClasses, auxs, &alphaIn, &alphaOut, buffers, entryOut](const BlockedIndexRange& range) -> void {
+            double* localOut = (buffers) ? buffers->local() : nullptr;
+            for (auto k : boost::irange(range.begin(), range.end())) {
+            auto eqID = multiClasses[k];
+            uint64_t count = counts[eqID];
             // for each transcript in this class
-            const TranscriptGroup& tgroup = kv.first;
-            if (tgroup.valid) {
-            const std::vector<uint32_t>& txps = tgroup.txps;
-            const auto& auxs = kv.second.combinedWeights;
+            size_t start = offsets[eqID];
+            size_t end = offsets[eqID + 1];
 
             double denom = 0.0;
-            size_t groupSize = txps.size();
-            // If this is a single-transcript group,
-            // then it gets the full count.  Otherwise,
-            // update according to our VBEM rule.
-            if (BOOST_LIKELY(groupSize > 1)) {
-            for (size_t i = 0; i < groupSize; ++i) {
-            auto tid = txps[i];
+            for (size_t i = start; i < end; ++i) {
+            auto tid = labels[i];
             auto aux = auxs[i];
             double v = alphaIn[tid] * aux;
             denom += v;
@@ -239,22 +471,36 @@ void EMUpdate_(
                 // tgroup.setValid(false);
             } else {
                 double invDenom = count / denom;
-                for (size_t i = 0; i < groupSize; ++i) {
-                    auto tid = txps[i];
+                for (size_t i = start; i < end; ++i) {
+                    auto tid = labels[i];
                     auto aux = auxs[i];
                     double v = alphaIn[tid] * aux;
                     if (!std::isnan(v)) {
-                        salmon::utils::incLoop(alphaOut[tid], v * invDenom);
+                        addContribution_(entryOut, localOut, alphaOut, i, tid, v * invDenom);
                     }
                 }
             }
-            } else {
-                salmon::utils::incLoop(alphaOut[txps.front()], count);
-            }
-            }
     }
     });
 
+    if (buffers) { buffers->reduceInto(alphaOut, split); }
+}
+
+// Read the class weights at the precision in which the arena stores them
+void EMUpdate_(
+        EquivalenceClassArena& eqArena,
+        const SingletonClasses& split,
+        std::vector<Transcript>& transcripts,
+        const CollapsedEMOptimizer::VecType& alphaIn,
+        CollapsedEMOptimizer::VecType& alphaOut,
+        EMReductionBuffers* buffers = nullptr) {
+    if (eqArena.hasSinglePrecisionWeights()) {
+        EMUpdate_(eqArena, eqArena.singlePrecisionWeights.data(), split, transcripts,
+                  alphaIn, alphaOut, buffers);
+    } else {
+        EMUpdate_(eqArena, eqArena.combinedWeights.data(), split, transcripts,
+                  alphaIn, alphaOut, buffers);
+    }
 }
 
 /*
@@ -262,24 +508,32 @@ void EMUpdate_(
  * classes to estimate the latent variables (alphaOut)
  * given the current estimates (alphaIn).
  */
+template <typename WeightT>
 void VBEMUpdate_(
-        std::vector<std::pair<const TranscriptGroup, TGValue>>& eqVec,
+        EquivalenceClassArena& eqArena,
+        const WeightT* auxs,
+        const SingletonClasses& split,
         std::vector<Transcript>& transcripts,
         double priorAlpha,
         double totLen,
         const CollapsedEMOptimizer::VecType& alphaIn,
         CollapsedEMOptimizer::VecType& alphaOut,
-	    CollapsedEMOptimizer::VecType& expTheta) {
+	    CollapsedEMOptimizer::VecType& expTheta,
+        EMReductionBuffers* buffers) {
 
     assert(alphaIn.size() == alphaOut.size());
 
     double alphaSum = {0.0};
     for (auto& e : alphaIn) { alphaSum += e; }
 
-    double logNorm = boost::math::digamma(alphaSum);
+    double logNorm = salmon::math::digamma(alphaSum);
+    // exp(psi(alpha_i) - logNorm), without a log or an exp for most alphas
+    double invNorm = std::exp(-logNorm);
+    // The single-transcript classes give their transcripts their full counts
+    const double* uniqueCounts = split.uniqueCounts.data();
 
     tbb::parallel_for(BlockedIndexRange(size_t(0), size_t(transcripts.size())),
-            [logNorm, priorAlpha, totLen, &alphaIn,
+            [invNorm, priorAlpha, totLen, uniqueCounts, &alphaIn,
              &alphaOut, &expTheta]( const BlockedIndexRange& range) -> void {
 
              double prior = priorAlpha;
@@ -287,85 +541,277 @@ void VBEMUpdate_(
 
              for (auto i : boost::irange(range.begin(), range.end())) {
                 if (alphaIn[i] > ::minWeight) {
-                    expTheta[i] = std::exp(boost::math::digamma(alphaIn[i].load()) - logNorm);
+                    expTheta[i] = salmon::math::expDigamma(alphaIn[i].load()) * invNorm;
                 } else {
                     expTheta[i] = 0.0;
                 }
-                alphaOut[i] = prior;
+                alphaOut[i] = prior + uniqueCounts[i];
             }
         });
 
-    tbb::parallel_for(BlockedIndexRange(size_t(0), size_t(eqVec.size())),
-            [&eqVec, &alphaIn,
-             &alphaOut,
-	     &expTheta]( const BlockedIndexRange& range) -> void {
-            for (auto eqID : boost::irange(range.begin(), range.end())) {
-            auto& kv = eqVec[eqID];
+    const uint64_t* offsets = eqArena.offsets.data();
+    const uint64_t* counts = eqArena.counts.data();
+    const uint32_t* labels = eqArena.labels.data();
+    const uint32_t* multiClasses = split.multiClasses.data();
 
-            uint64_t count = kv.second.count;
-            // for each transcript in this class
-            const TranscriptGroup& tgroup = kv.first;
-            if (tgroup.valid) {
-                const std::vector<uint32_t>& txps = tgroup.txps;
-                const auto& auxs = kv.second.combinedWeights;
+    double* entryOut = (buffers) ? buffers->entries(eqArena.numEntries()) : nullptr;
+    tbb::parallel_for(BlockedIndexRange(size_t(0), split.multiClasses.size()),
+            [offsets, counts, labels, multiClasses, auxs, &alphaIn,
+             &alphaOut,
+	     &expTheta, buffers, entryOut]( const BlockedIndexRange& range) -> void {
+            double* localOut = (buffers) ? buffers->local() : nullptr;
+            for (auto k : boost::irange(range.begin(), range.end())) {
+                auto eqID = multiClasses[k];
+                uint64_t count = counts[eqID];
+                // for each transcript in this class
+                size_t start = offsets[eqID];
+                size_t end = offsets[eqID + 1];
 
                 double denom = 0.0;
-                size_t groupSize = txps.size();
-                // If this is a single-transcript group,
-                // then it gets the full count.  Otherwise,
-                // update according to our VBEM rule.
-                if (BOOST_LIKELY(groupSize > 1)) {
-                    for (size_t i = 0; i < groupSize; ++i) {
-                        auto tid = txps[i];
+                for (size_t i = start; i < end; ++i) {
+                    auto tid = labels[i];
+                    auto aux = auxs[i];
+                    if (expTheta[tid] > 0.0) {
+                        double v = expTheta[tid] * aux;
+                        denom += v;
+                   }
+                }
+                if (denom <= ::minEQClassWeight) {
+                    // tgroup.setValid(false);
+                } else {
+                    double invDenom = count / denom;
+                    for (size_t i = start; i < end; ++i) {
+                        auto tid = labels[i];
                         auto aux = auxs[i];
                         if (expTheta[tid] > 0.0) {
-                            double v = expTheta[tid] * aux;
-                            denom += v;
-                       }
-                    }
-                    if (denom <= ::minEQClassWeight) {
-                        // tgroup.setValid(false);
-                    } else {
-                        double invDenom = count / denom;
-                        for (size_t i = 0; i < groupSize; ++i) {
-                            auto tid = txps[i];
-                            auto aux = auxs[i];
-                            if (expTheta[tid] > 0.0) {
-                              double v = expTheta[tid] * aux;
-			      salmon::utils::incLoop(alphaOut[tid], v * invDenom);
-                            }
+                          double v = expTheta[tid] * aux;
+			  addContribution_(entryOut, localOut, alphaOut, i, tid, v * invDenom);
                         }
                     }
+                }
+        }});
 
-                } else {
-                    salmon::utils::incLoop(alphaOut[txps.front()], count);
+    if (buffers) { buffers->reduceInto(alphaOut, split); }
+}
+
+// Read the class weights at the precision in which the arena stores them
+void VBEMUpdate_(
+        EquivalenceClassArena& eqArena,
+        const SingletonClasses& split,
+        std::vector<Transcript>& transcripts,
+        double priorAlpha,
+        double totLen,
+        const CollapsedEMOptimizer::VecType& alphaIn,
+        CollapsedEMOptimizer::VecType& alphaOut,
+	    CollapsedEMOptimizer::VecType& expTheta,
+        EMReductionBuffers* buffers = nullptr) {
+    if (eqArena.hasSinglePrecisionWeights()) {
+        VBEMUpdate_(eqArena, eqArena.singlePrecisionWeights.data(), split, transcripts, priorAlpha,
+                    totLen, alphaIn, alphaOut, expTheta, buffers);
+    } else {
+        VBEMUpdate_(eqArena, eqArena.combinedWeights.data(), split, transcripts, priorAlpha,
+                    totLen, alphaIn, alphaOut, expTheta, buffers);
+    }
+}
+
+/*
+ * The log-likelihood (up to a constant) of the abundances alphaIn under the
+ * model optimized by EMUpdate_, i.e.
+ *   sum_c count_c * log(sum_{t in c} alpha_t * w_{c,t}) - N * log(sum_t alpha_t)
+ * where N = sum_c count_c.  This is used to safeguard the SQUAREM steps.
+ */
+double logLikelihood_(
+        EquivalenceClassArena& eqArena,
+        const CollapsedEMOptimizer::VecType& alphaIn) {
+
+    const uint64_t* offsets = eqArena.offsets.data();
+    const uint64_t* counts = eqArena.counts.data();
+    const uint8_t* valid = eqArena.valid.data();
+    const uint32_t* labels = eqArena.labels.data();
+    const double* auxs = eqArena.combinedWeights.data();
+
+    // Summed over fixed blocks of classes, and then over the blocks in
+    // order, so that the result doesn't depend on the number of threads
+    struct LL { double ll; double n; };
+    constexpr size_t blockSize = 4096;
+    size_t numClasses = eqArena.numClasses();
+    std::vector<LL> blockLL((numClasses + blockSize - 1) / blockSize, LL{0.0, 0.0});
+    tbb::parallel_for(BlockedIndexRange(size_t(0), blockLL.size()),
+            [offsets, counts, valid, labels, auxs, numClasses, &alphaIn, &blockLL](const BlockedIndexRange& range) -> void {
+            for (auto b : boost::irange(range.begin(), range.end())) {
+                LL acc{0.0, 0.0};
+                for (size_t eqID = b * blockSize; eqID < std::min(numClasses, (b + 1) * blockSize); ++eqID) {
+                    if (!valid[eqID] or counts[eqID] == 0) { continue; }
+                    double denom{0.0};
+                    for (size_t i = offsets[eqID]; i < offsets[eqID + 1]; ++i) {
+                        denom += alphaIn[labels[i]] * auxs[i];
+                    }
+                    acc.ll += (denom > 0.0) ? counts[eqID] * std::log(denom) :
+                                              -std::numeric_limits<double>::infinity();
+                    acc.n += counts[eqID];
                 }
+                blockLL[b] = acc;
             }
-        }});
+            });
+    LL tot{0.0, 0.0};
+    for (auto& acc : blockLL) {
+        tot.ll += acc.ll;
+        tot.n += acc.n;
+    }
 
+    double alphaSum{0.0};
+    for (auto& a : alphaIn) { alphaSum += a; }
+    return (alphaSum > 0.0) ? tot.ll - tot.n * std::log(alphaSum) :
+                              -std::numeric_limits<double>::infinity();
+}
+
+/*
+ * Single-threaded log-likelihood, for use in bootstrapping.
+ */
+template <typename VecT>
+double logLikelihood_(
+        const EquivalenceClassArena& eqArena,
+        const std::vector<uint64_t>& txpGroupCounts,
+        const VecT& alphaIn) {
+
+    const uint64_t* offsets = eqArena.offsets.data();
+    const uint32_t* labels = eqArena.labels.data();
+    const double* auxs = eqArena.combinedWeights.data();
+
+    double ll{0.0};
+    double n{0.0};
+    for (size_t eqID = 0; eqID < eqArena.numClasses(); ++eqID) {
+        uint64_t count = txpGroupCounts[eqID];
+        if (count == 0) { continue; }
+        double denom{0.0};
+        for (size_t i = offsets[eqID]; i < offsets[eqID + 1]; ++i) {
+            denom += alphaIn[labels[i]] * auxs[i];
+        }
+        if (denom <= 0.0) { return -std::numeric_limits<double>::infinity(); }
+        ll += count * std::log(denom);
+        n += count;
+    }
+
+    double alphaSum{0.0};
+    for (auto& a : alphaIn) { alphaSum += a; }
+    return (alphaSum > 0.0) ? ll - n * std::log(alphaSum) :
+                              -std::numeric_limits<double>::infinity();
+}
+
+/*
+ * Move the new estimates (alphaOut) into alphaIn, zeroing alphaOut for the
+ * next round, and return the maximum relative difference between the old
+ * and new estimates of the transcripts whose new estimate is above
+ * `alphaCheckCutoff`.  This is done in a single parallel pass; since no
+ * update is running concurrently, the elements are accessed with relaxed
+ * (plain) loads and stores.
+ */
+double swapAndCheckConvergence_(
+        CollapsedEMOptimizer::VecType& alphaIn,
+        CollapsedEMOptimizer::VecType& alphaOut,
+        double alphaCheckCutoff) {
+
+    return tbb::parallel_reduce(BlockedIndexRange(size_t(0), alphaIn.size()),
+            -std::numeric_limits<double>::max(),
+            [&alphaIn, &alphaOut, alphaCheckCutoff](const BlockedIndexRange& range, double maxRelDiff) -> double {
+            for (auto i : boost::irange(range.begin(), range.end())) {
+                double oldAlpha = alphaIn[i].load<tbb::relaxed>();
+                double newAlpha = alphaOut[i].load<tbb::relaxed>();
+                if (newAlpha > alphaCheckCutoff) {
+                    double relDiff = std::abs(oldAlpha - newAlpha) / newAlpha;
+                    maxRelDiff = (relDiff > maxRelDiff) ? relDiff : maxRelDiff;
+                }
+                alphaIn[i].store<tbb::relaxed>(newAlpha);
+                alphaOut[i].store<tbb::relaxed>(0.0);
+            }
+            return maxRelDiff;
+            },
+            [](double a, double b) -> double { return (a > b) ? a : b; });
+}
+
+/*
+ * One step of the SQUAREM acceleration (Varadhan & Roland, 2008; scheme
+ * S3) of the EM fixed-point map `update`, which adds the EM update of its
+ * first argument into its (zeroed) second argument.  Two EM updates from
+ * alphaIn are used to extrapolate a new point, which is then stabilized
+ * by a third update and written to alphaOut.  If the extrapolated point
+ * decreases the log-likelihood, the step length is shrunk; in the worst
+ * case, the step is equivalent to three EM updates.  alpha1, alpha2 and
+ * alphaExtrap are scratch vectors of the same size as alphaIn.
+ */
+template <typename VecT, typename UpdateT, typename LogLikT>
+void SQUAREMUpdate_(
+        const VecT& alphaIn,
+        VecT& alphaOut,
+        VecT& alpha1,
+        VecT& alpha2,
+        VecT& alphaExtrap,
+        UpdateT& update,
+        LogLikT& logLikelihood) {
+
+    auto zero = [](VecT& v) -> void { for (auto& x : v) { x = 0.0; } };
+    size_t numTxps = alphaIn.size();
+
+    zero(alpha1);
+    update(alphaIn, alpha1);
+    zero(alpha2);
+    update(alpha1, alpha2);
+
+    // r = alpha1 - alphaIn, v = (alpha2 - alpha1) - r
+    double rNorm{0.0};
+    double vNorm{0.0};
+    for (size_t i = 0; i < numTxps; ++i) {
+        double r = alpha1[i] - alphaIn[i];
+        double v = alpha2[i] - 2.0 * alpha1[i] + alphaIn[i];
+        rNorm += r * r;
+        vNorm += v * v;
+    }
+
+    double step = (vNorm > 0.0) ? -std::sqrt(rNorm / vNorm) : -1.0;
+    if (step > -1.0) { step = -1.0; }
+    double prevLogLikelihood = (step < -1.0) ? logLikelihood(alphaIn) : 0.0;
+
+    uint32_t numBacktracks{0};
+    while (step < -1.0) {
+        for (size_t i = 0; i < numTxps; ++i) {
+            double r = alpha1[i] - alphaIn[i];
+            double v = alpha2[i] - 2.0 * alpha1[i] + alphaIn[i];
+            double a = alphaIn[i] - 2.0 * step * r + step * step * v;
+            alphaExtrap[i] = (a > 0.0) ? a : 0.0;
+        }
+        zero(alphaOut);
+        update(alphaExtrap, alphaOut);
+        double ll = logLikelihood(alphaOut);
+        if (std::isfinite(ll) and ll >= prevLogLikelihood) { return; }
+        // Otherwise, move the step back towards a plain EM step
+        step = (++numBacktracks < 3) ? (step - 1.0) / 2.0 : -1.0;
+    }
+
+    // A step length of -1 extrapolates to alpha2 itself
+    zero(alphaOut);
+    update(alpha2, alphaOut);
 }
 
 template <typename VecT>
 size_t markDegenerateClasses(
-        std::vector<std::pair<const TranscriptGroup, TGValue>>& eqVec,
+        EquivalenceClassArena& eqArena,
         VecT& alphaIn,
         Eigen::VectorXd& effLens,
         std::shared_ptr<spdlog::logger> jointLog,
         bool verbose=false) {
 
     size_t numDropped{0};
-    size_t idx{0};
-    for (auto& kv : eqVec) {
-        uint64_t count = kv.second.count;
+    size_t numClasses = eqArena.numClasses();
+    for (size_t eqID = 0; eqID < numClasses; ++eqID) {
+        uint64_t count = eqArena.counts[eqID];
         // for each transcript in this class
-        const TranscriptGroup& tgroup = kv.first;
-        const std::vector<uint32_t>& txps = tgroup.txps;
-        const auto& auxs = kv.second.combinedWeights;
+        size_t start = eqArena.offsets[eqID];
+        size_t end = eqArena.offsets[eqID + 1];
 
         double denom = 0.0;
-        for (size_t i = 0; i < txps.size(); ++i) {
-            auto tid = txps[i];
-            auto aux = auxs[i];
+        for (size_t i = start; i < end; ++i) {
+            auto tid = eqArena.labels[i];
+            auto aux = eqArena.combinedWeights[i];
             double v = alphaIn[tid] * aux;
             if (!std::isnan(v)) {
                 denom += v;
@@ -383,18 +829,18 @@ size_t markDegenerateClasses(
 
             errstream << "denom = 0, count = " << count << "\n";
             errstream << "class = { ";
-            for (auto e : txps) {
-                errstream << e << " ";
+            for (size_t i = start; i < end; ++i) {
+                errstream << eqArena.labels[i] << " ";
             }
             errstream << "}\n";
             errstream << "alphas = { ";
-            for (auto e : txps) {
-                errstream << alphaIn[e] << " ";
+            for (size_t i = start; i < end; ++i) {
+                errstream << alphaIn[eqArena.labels[i]] << " ";
             }
             errstream << "}\n";
             errstream << "weights = { ";
-            for (auto e : auxs) {
-                errstream << e << " ";
+            for (size_t i = start; i < end; ++i) {
+                errstream << eqArena.combinedWeights[i] << " ";
             }
             errstream << "}\n";
             errstream << "============================\n\n";
@@ -404,58 +850,626 @@ size_t markDegenerateClasses(
                 jointLog->info(errstream.str());
             }
             ++numDropped;
-            kv.first.setValid(false);
+            eqArena.valid[eqID] = 0;
         }
     }
     return numDropped;
 }
 
 
+EqClassComponents buildEqClassComponents(const EquivalenceClassArena& eqArena,
+                                         size_t numTranscripts) {
+    const uint32_t invalidComponent = std::numeric_limits<uint32_t>::max();
+    size_t numClasses = eqArena.numClasses();
+
+    // Union the transcripts of each class
+    std::vector<size_t> rank(numTranscripts, 0);
+    std::vector<size_t> parent(numTranscripts, 0);
+    boost::disjoint_sets<size_t*, size_t*> sets(&rank[0], &parent[0]);
+    for (size_t tid = 0; tid < numTranscripts; ++tid) { sets.make_set(tid); }
+    std::vector<uint8_t> observed(numTranscripts, 0);
+    for (size_t eqID = 0; eqID < numClasses; ++eqID) {
+        if (!eqArena.valid[eqID]) { continue; }
+        size_t start = eqArena.offsets[eqID];
+        size_t end = eqArena.offsets[eqID + 1];
+        auto firstTxp = eqArena.labels[start];
+        observed[firstTxp] = 1;
+        for (size_t i = start + 1; i < end; ++i) {
+            sets.union_set(firstTxp, eqArena.labels[i]);
+            observed[eqArena.labels[i]] = 1;
+        }
+    }
+
+    // Number the components, and measure the size of each
+    std::vector<uint32_t> txpComponent(numTranscripts, invalidComponent);
+    std::vector<uint32_t> rootComponent(numTranscripts, invalidComponent);
+    std::vector<size_t> componentSize;
+    for (size_t tid = 0; tid < numTranscripts; ++tid) {
+        if (!observed[tid]) { continue; }
+        auto root = sets.find_set(tid);
+        if (rootComponent[root] == invalidComponent) {
+            rootComponent[root] = componentSize.size();
+            componentSize.push_back(0);
+        }
+        txpComponent[tid] = rootComponent[root];
+    }
+    for (size_t eqID = 0; eqID < numClasses; ++eqID) {
+        if (!eqArena.valid[eqID]) { continue; }
+        componentSize[txpComponent[eqArena.labels[eqArena.offsets[eqID]]]] +=
+            eqArena.classSize(eqID);
+    }
+
+    // Re-number the components by decreasing size
+    size_t numComponents = componentSize.size();
+    std::vector<uint32_t> order(numComponents);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(),
+              [&componentSize](uint32_t a, uint32_t b) -> bool {
+                  return componentSize[a] > componentSize[b];
+              });
+    std::vector<uint32_t> rankOf(numComponents);
+    for (size_t c = 0; c < numComponents; ++c) { rankOf[order[c]] = c; }
+
+    // Bucket the classes and transcripts by component
+    EqClassComponents comps;
+    comps.classOffsets.assign(numComponents + 1, 0);
+    comps.txpOffsets.assign(numComponents + 1, 0);
+    for (size_t eqID = 0; eqID < numClasses; ++eqID) {
+        if (!eqArena.valid[eqID]) { continue; }
+        auto c = rankOf[txpComponent[eqArena.labels[eqArena.offsets[eqID]]]];
+        ++comps.classOffsets[c + 1];
+    }
+    for (size_t tid = 0; tid < numTranscripts; ++tid) {
+        if (txpComponent[tid] == invalidComponent) { continue; }
+        ++comps.txpOffsets[rankOf[txpComponent[tid]] + 1];
+    }
+    std::partial_sum(comps.classOffsets.begin(), comps.classOffsets.end(),
+                     comps.classOffsets.begin());
+    std::partial_sum(comps.txpOffsets.begin(), comps.txpOffsets.end(),
+                     comps.txpOffsets.begin());
+
+    std::vector<size_t> classFill(comps.classOffsets.begin(), comps.classOffsets.end() - 1);
+    std::vector<size_t> txpFill(comps.txpOffsets.begin(), comps.txpOffsets.end() - 1);
+    comps.classes.resize(comps.classOffsets.back());
+    comps.txps.resize(comps.txpOffsets.back());
+    for (size_t eqID = 0; eqID < numClasses; ++eqID) {
+        if (!eqArena.valid[eqID]) { continue; }
+        auto c = rankOf[txpComponent[eqArena.labels[eqArena.offsets[eqID]]]];
+        comps.classes[classFill[c]++] = eqID;
+    }
+    for (size_t tid = 0; tid < numTranscripts; ++tid) {
+        if (txpComponent[tid] == invalidComponent) { continue; }
+        auto c = rankOf[txpComponent[tid]];
+        comps.txps[txpFill[c]++] = tid;
+    }
+    return comps;
+}
+
+/**
+ * Run the EM on the single component `c` until it has performed at least
+ * `minIter` rounds and either has converged or has reached `maxIter`
+ * rounds.  `itNum` holds the number of rounds already performed on this
+ * component, and is updated; the maximum relative difference of the last
+ * round is returned.  Since no two components share a transcript, the
+ * components can be processed concurrently without contention.
+ */
+template <typename WeightT>
+double componentEM_(
+        const EquivalenceClassArena& eqArena,
+        const WeightT* auxs,
+        const EqClassComponents& comps,
+        size_t c,
+        CollapsedEMOptimizer::VecType& alphas,
+        CollapsedEMOptimizer::VecType& alphasPrime,
+        size_t& itNum,
+        size_t minIter,
+        size_t maxIter,
+        double alphaCheckCutoff,
+        double relDiffTolerance) {
+
+    const uint64_t* offsets = eqArena.offsets.data();
+    const uint64_t* counts = eqArena.counts.data();
+    const uint32_t* labels = eqArena.labels.data();
+
+    size_t classBegin = comps.classOffsets[c];
+    size_t classEnd = comps.classOffsets[c + 1];
+    size_t txpBegin = comps.txpOffsets[c];
+    size_t txpEnd = comps.txpOffsets[c + 1];
+
+    bool converged{false};
+    double maxRelDiff = -std::numeric_limits<double>::max();
+    while (itNum < minIter or (itNum < maxIter and !converged)) {
+        for (size_t ci = classBegin; ci < classEnd; ++ci) {
+            auto eqID = comps.classes[ci];
+            uint64_t count = counts[eqID];
+            size_t start = offsets[eqID];
+            size_t end = offsets[eqID + 1];
+            if (BOOST_LIKELY(end - start > 1)) {
+                double denom = 0.0;
+                for (size_t i = start; i < end; ++i) {
+                    denom += alphas[labels[i]] * auxs[i];
+                }
+                if (denom > ::minEQClassWeight) {
+                    double invDenom = count / denom;
+                    for (size_t i = start; i < end; ++i) {
+                        auto tid = labels[i];
+                        double v = alphas[tid] * auxs[i];
+                        if (!std::isnan(v)) {
+                            alphasPrime[tid] = alphasPrime[tid] + v * invDenom;
+                        }
+                    }
+                }
+            } else {
+                alphasPrime[labels[start]] = alphasPrime[labels[start]] + count;
+            }
+        }
+
+        converged = true;
+        maxRelDiff = -std::numeric_limits<double>::max();
+        for (size_t ti = txpBegin; ti < txpEnd; ++ti) {
+            auto tid = comps.txps[ti];
+            if (alphasPrime[tid] > alphaCheckCutoff) {
+                double relDiff = std::abs(alphas[tid] - alphasPrime[tid]) / alphasPrime[tid];
+                maxRelDiff = (relDiff > maxRelDiff) ? relDiff : maxRelDiff;
+                if (relDiff > relDiffTolerance) {
+                    converged = false;
+                }
+            }
+            alphas[tid] = alphasPrime[tid];
+            alphasPrime[tid] = 0.0;
+        }
+        ++itNum;
+    }
+    return maxRelDiff;
+}
+
 CollapsedEMOptimizer::CollapsedEMOptimizer() {}
 
+/**
+ * The CUDA device on which to run the EM rounds (--gpu), holding the
+ * classes of eqArena (only its valid ones, if onlyValid); nullptr, after a
+ * warning, if there's none to run on.
+ */
+std::unique_ptr<salmon::gpu::EMDevice> makeEMDevice_(const EquivalenceClassArena& eqArena,
+                                                     size_t numTxps, bool onlyValid,
+                                                     std::shared_ptr<spdlog::logger>& log) {
+    std::string reason;
+    if (!salmon::gpu::EMDevice::available(reason)) {
+        log->warn("--gpu was given, but {}; running the EM on the CPU", reason);
+        return nullptr;
+    }
+    try {
+        return std::unique_ptr<salmon::gpu::EMDevice>(new salmon::gpu::EMDevice(eqArena, numTxps, onlyValid));
+    } catch (std::runtime_error& e) {
+        log->warn("could not set up the EM on the device ({}); running it on the CPU", e.what());
+        return nullptr;
+    }
+}
+
+
+/**
+ * Writes a finished bootstrap replicate, given its id; returns false if it
+ * couldn't be written.  A replicate is recorded in the checkpoint (if any)
+ * only once it has been written.
+ */
+using ReplicateWriter = std::function<bool(uint32_t, const std::vector<double>&)>;
+
+/**
+ * Writes the bootstrap replicates in the order of their ids, whichever
+ * thread finishes them first (--seed or --deterministic), so that the
+ * i-th replicate of bootstraps.gz is always the one drawn from the i-th
+ * stream of the seed; a replicate finished early
+ * is held until all of those before it are written.  The replicates
+ * restored from a checkpoint (written before any is drawn) are skipped.
+ */
+class ReplicateOrder {
+    public:
+        ReplicateOrder(ReplicateWriter& writeReplicate, const BootstrapCheckpoint* checkpoint) :
+            writeReplicate_(writeReplicate), checkpoint_(checkpoint) {}
+
+        // Returns false if any replicate written by this call couldn't be
+        bool write(uint32_t bsID, const std::vector<double>& alphas) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            bool ok{true};
+            pending_[bsID] = alphas;
+            while (true) {
+                while (checkpoint_ and checkpoint_->isDone(next_)) { ++next_; }
+                auto it = pending_.find(next_);
+                if (it == pending_.end()) { break; }
+                ok = writeReplicate_(next_, it->second) and ok;
+                pending_.erase(it);
+                ++next_;
+            }
+            return ok;
+        }
+
+    private:
+        ReplicateWriter& writeReplicate_;
+        const BootstrapCheckpoint* checkpoint_;
+        std::map<uint32_t, std::vector<double>> pending_;
+        uint32_t next_{0};
+        std::mutex mutex_;
+};
+
+/**
+ * Decides, as the replicates are written, when enough have been drawn
+ * (--adaptiveBootstraps).  After minBootstraps replicates, and then every
+ * checkInterval, the variances of the expressed transcripts (those with a
+ * mean of at least one fragment) are compared with those of the previous
+ * check; once their total change, relative to their total, is below the
+ * tolerance, the counter from which the workers take the replicate ids is
+ * exhausted, so that no more are drawn.  The replicates still in progress
+ * are then dropped, so that (with --seed or --deterministic, which write
+ * them in order) the replicates kept depend only on the seed; only the
+ * replicates kept are recorded in the checkpoint.  The replicates restored
+ * from a checkpoint are counted, but don't contribute to the variances.
+ */
+class AdaptiveBootstraps {
+    public:
+        AdaptiveBootstraps(ReplicateWriter& writeReplicate,
+                           std::atomic<uint32_t>& bsNum, size_t numTranscripts, size_t numRestored,
+                           const SalmonOpts& sopt) :
+            writeReplicate_(writeReplicate), bsNum_(bsNum), summary_(numTranscripts, false),
+            prevVariance_(numTranscripts, 0.0), numRestored_(numRestored),
+            maxBootstraps_(sopt.numBootstraps), minBootstraps_(sopt.minBootstraps),
+            tolerance_(sopt.bootstrapVarianceTolerance), jointLog_(sopt.jointLog) {}
+
+        bool write(uint32_t bsID, const std::vector<double>& alphas) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (stopped_) { return true; }
+                summary_.add(alphas);
+                uint64_t n = summary_.numSamples();
+                if (n >= minBootstraps_ and (n - minBootstraps_) % checkInterval_ == 0) { check_(); }
+            }
+            return writeReplicate_(bsID, alphas);
+        }
+
+        // The number of replicates kept (including those restored)
+        uint32_t numDrawn() const { return static_cast<uint32_t>(numRestored_ + summary_.numSamples()); }
+
+    private:
+        void check_() {
+            double change{0.0};
+            double total{0.0};
+            for (size_t i = 0; i < prevVariance_.size(); ++i) {
+                double v = summary_.variance(i);
+                if (summary_.mean(i) >= 1.0) {
+                    change += std::abs(v - prevVariance_[i]);
+                    total += prevVariance_[i];
+                }
+                prevVariance_[i] = v;
+            }
+            bool first = !havePrevious_;
+            havePrevious_ = true;
+            if (first or total <= 0.0) { return; }
+            double relChange = change / total;
+            if (relChange < tolerance_) {
+                stopped_ = true;
+                bsNum_.store(maxBootstraps_);
+                jointLog_->info("the variances of the expressed transcripts changed by {:.4f} over the last "
+                                "{} bootstraps; stopping after {} of at most {}",
+                                relChange, checkInterval_, numDrawn(), maxBootstraps_);
+            }
+        }
+
+        ReplicateWriter& writeReplicate_;
+        std::atomic<uint32_t>& bsNum_;
+        SampleSummary summary_;
+        std::vector<double> prevVariance_;
+        bool havePrevious_{false};
+        bool stopped_{false};
+        size_t numRestored_;
+        uint32_t maxBootstraps_;
+        uint32_t minBootstraps_;
+        double tolerance_;
+        const uint32_t checkInterval_{10};
+        std::shared_ptr<spdlog::logger> jointLog_;
+        std::mutex mutex_;
+};
+
+/**
+ * Truncate, (optionally) rescale and write the abundances of a finished
+ * bootstrap replicate (in the order of the replicates, if given one).
+ */
+bool finishBootstrap_(
+        uint32_t bsID,
+        std::vector<double>& alphas,
+        double cutoff,
+        bool useScaledCounts,
+        uint64_t numMappedFrags,
+        SalmonOpts& sopt,
+        ReplicateWriter& writeReplicate,
+        ReplicateOrder* order) {
+
+    double alphaSum = truncateCountVector(alphas, cutoff);
+
+    if (alphaSum < minWeight) {
+        sopt.jointLog->error("Total alpha weight was too small! "
+                "Make sure you ran salmon correclty.");
+        return false;
+    }
+
+    if (useScaledCounts) {
+        double mappedFragsDouble = static_cast<double>(numMappedFrags);
+        double alphaSum = 0.0;
+        for (auto a : alphas) { alphaSum += a; }
+        if (alphaSum > ::minWeight) {
+            double scaleFrac = 1.0 / alphaSum;
+            // scaleFrac converts alpha to nucleotide fraction,
+            // and multiplying by numMappedFrags scales by the total
+            // number of mapped fragments to provide an estimated count.
+            for (auto& a : alphas) { a = mappedFragsDouble * (a * scaleFrac); }
+        } else { // This shouldn't happen!
+            sopt.jointLog->error("Bootstrap had insufficient number of fragments!"
+                                 "Something is probably wrong; please check that you "
+                                 "have run salmon correctly and report this to GitHub.");
+        }
+    }
+    bool written = order ? order->write(bsID, alphas) : writeReplicate(bsID, alphas);
+    if (!written) { sopt.jointLog->error("could not write bootstrap replicate {}", bsID); }
+    return written;
+}
+
+/**
+ * Draw and optimize the bootstrap replicates in batches of batchSize,
+ * using batchEMUpdate_ (see doBootstrap), or on device, if given.  Each
+ * replicate of a batch has its own convergence test, and is written as
+ * soon as the whole batch is done.
+ */
+bool doBootstrapBatch_(
+        EquivalenceClassArena& eqArena,
+        std::vector<Transcript>& transcripts,
+        const MultinomialSplitTree& sampleTree,
+        uint64_t totalNumFrags,
+        uint64_t numMappedFrags,
+        double uniformTxpWeight,
+        std::atomic<uint32_t>& bsNum,
+        SalmonOpts& sopt,
+        ReplicateWriter& writeReplicate,
+        double relDiffTolerance,
+        uint32_t maxIter,
+        size_t batchSize,
+        ReplicateOrder* order,
+        salmon::gpu::EMDevice* device = nullptr) {
+
+    uint32_t minIter = 50;
+    double minAlpha = 1e-8;
+    double alphaCheckCutoff = 1e-2;
+    double cutoff = minAlpha;
+
+    bool useScaledCounts = !(sopt.useQuasi or sopt.allowOrphans);
+    uint32_t numBootstraps = sopt.numBootstraps;
+    size_t numTxps = transcripts.size();
+    size_t numClasses = eqArena.numClasses();
+
+    // Interleaved (see batchEMUpdate_) counts and abundances
+    std::vector<uint64_t> sampCounts(numClasses, 0);
+    std::vector<uint64_t> batchCounts(numClasses * batchSize, 0);
+    std::vector<double> alphas(numTxps * batchSize, 0.0);
+    std::vector<double> alphasPrime(numTxps * batchSize, 0.0);
+    std::vector<double> denoms(batchSize, 0.0);
+    std::vector<double> replicateAlphas(numTxps, 0.0);
+    std::vector<uint8_t> converged(batchSize, 0);
+    SingletonClasses split(eqArena, false);
+
+    double initAlpha = uniformTxpWeight * totalNumFrags;
+    double pointScale{0.0};
+    double uniformFrac{0.01};
+    if (sopt.bootstrapFromPointEstimate) {
+        double pointTotal{0.0};
+        double uniformTotal{0.0};
+        for (size_t i = 0; i < numTxps; ++i) {
+            if (transcripts[i].getActive()) {
+                pointTotal += transcripts[i].sharedCount();
+                uniformTotal += initAlpha;
+            }
+        }
+        if (pointTotal > 0.0) { pointScale = uniformTotal / pointTotal; }
+    }
+
+    MultinomialSampler msamp(uint32_t(0));
+    auto checkpoint = sopt.bootstrapCheckpoint.get();
+
+    while (true) {
+        // Claim the next batch of replicates
+        uint32_t firstBS = bsNum.fetch_add(batchSize);
+        if (firstBS >= numBootstraps) { break; }
+        size_t R = std::min(batchSize, static_cast<size_t>(numBootstraps - firstBS));
+        // A batch whose replicates were all restored from the checkpoint is skipped
+        size_t numDone{0};
+        for (size_t r = 0; checkpoint and r < R; ++r) { numDone += checkpoint->isDone(firstBS + r) ? 1 : 0; }
+        if (numDone == R) { continue; }
+
+        for (size_t r = 0; r < R; ++r) {
+            // Each replicate has its own stream, so the counts drawn for it
+            // don't depend on the thread or batch by which it's optimized
+            msamp.seed(salmon::utils::streamSeed(sopt, salmon::utils::RandomStream::BOOTSTRAP, firstBS + r));
+            msamp(sampCounts.begin(), totalNumFrags, sampleTree);
+            for (size_t eqID = 0; eqID < numClasses; ++eqID) {
+                batchCounts[eqID * R + r] = sampCounts[eqID];
+            }
+        }
+        if (!device) { split.setCounts(eqArena, batchCounts.data(), numTxps, R); }
+        for (size_t i = 0; i < numTxps; ++i) {
+            double a{0.0};
+            if (transcripts[i].getActive()) {
+                a = (pointScale > 0.0) ?
+                    (1.0 - uniformFrac) * pointScale * transcripts[i].sharedCount() + uniformFrac * initAlpha :
+                    initAlpha;
+            }
+            for (size_t r = 0; r < R; ++r) {
+                alphas[i * R + r] = a;
+                alphasPrime[i * R + r] = 0.0;
+            }
+        }
+        std::fill(converged.begin(), converged.begin() + R, 0);
+
+        size_t numConverged{0};
+        size_t itNum{0};
+        if (device) {
+            alphas.resize(numTxps * R);
+            try {
+                device->optimizeBatch(batchCounts.data(), R, minIter, maxIter, alphaCheckCutoff,
+                                      relDiffTolerance, alphas);
+            } catch (std::runtime_error& e) {
+                sopt.jointLog->error("the bootstrap EM failed on the device: {}", e.what());
+                return false;
+            }
+            // The rounds have all been run
+            itNum = std::max(maxIter, minIter);
+            numConverged = R;
+        }
+        while (itNum < minIter or (itNum < maxIter and numConverged < R)) {
+            if (eqArena.hasSinglePrecisionWeights()) {
+                batchEMUpdate_(eqArena, eqArena.singlePrecisionWeights.data(), batchCounts, split, R,
+                               alphas, alphasPrime, denoms);
+            } else {
+                batchEMUpdate_(eqArena, eqArena.combinedWeights.data(), batchCounts, split, R,
+                               alphas, alphasPrime, denoms);
+            }
+
+            // Test each replicate for convergence; the abundances of the
+            // replicates that have already converged are left as they are.
+            std::fill(denoms.begin(), denoms.begin() + R, -std::numeric_limits<double>::max());
+            for (size_t i = 0; i < numTxps; ++i) {
+                for (size_t r = 0; r < R; ++r) {
+                    size_t j = i * R + r;
+                    if (!converged[r]) {
+                        if (alphasPrime[j] > alphaCheckCutoff) {
+                            double relDiff = std::abs(alphas[j] - alphasPrime[j]) / alphasPrime[j];
+                            denoms[r] = (relDiff > denoms[r]) ? relDiff : denoms[r];
+                        }
+                        alphas[j] = alphasPrime[j];
+                    }
+                    alphasPrime[j] = 0.0;
+                }
+            }
+            ++itNum;
+            if (itNum >= minIter) {
+                for (size_t r = 0; r < R; ++r) {
+                    if (!converged[r] and denoms[r] <= relDiffTolerance) {
+                        converged[r] = 1;
+                        ++numConverged;
+                    }
+                }
+            }
+        }
+
+        for (size_t r = 0; r < R; ++r) {
+            if (checkpoint and checkpoint->isDone(firstBS + r)) { continue; }
+            for (size_t i = 0; i < numTxps; ++i) { replicateAlphas[i] = alphas[i * R + r]; }
+            if (!finishBootstrap_(firstBS + r, replicateAlphas, cutoff, useScaledCounts, numMappedFrags,
+                                  sopt, writeReplicate, order)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
 
 bool doBootstrap(
-        std::vector<std::vector<uint32_t>>& txpGroups,
-        std::vector<std::vector<double>>& txpGroupCombinedWeights,
+        EquivalenceClassArena& eqArena,
         std::vector<Transcript>& transcripts,
         Eigen::VectorXd& effLens,
-        std::vector<double>& sampleWeights,
+        const MultinomialSplitTree& sampleTree,
         uint64_t totalNumFrags,
         uint64_t numMappedFrags,
         double uniformTxpWeight,
         std::atomic<uint32_t>& bsNum,
         SalmonOpts& sopt,
-        std::function<bool(const std::vector<double>&)>& writeBootstrap,
+        ReplicateWriter& writeReplicate,
         double relDiffTolerance,
-        uint32_t maxIter) {
+        uint32_t maxIter,
+        ReplicateOrder* order) {
+    SALMON_ALLOC_SCOPE("bootstraps");
 
     uint32_t minIter = 50;
 
     // Determine up front if we're going to use scaled counts.
     bool useScaledCounts = !(sopt.useQuasi or sopt.allowOrphans);
     bool useVBEM{sopt.useVBOpt};
-    size_t numClasses = txpGroups.size();
+
+    // If requested, optimize several replicates at once
+    if (sopt.bootstrapBatchSize > 1 and !useVBEM and !sopt.useSQUAREM) {
+        return doBootstrapBatch_(eqArena, transcripts, sampleTree, totalNumFrags,
+                                 numMappedFrags, uniformTxpWeight, bsNum, sopt,
+                                 writeReplicate, relDiffTolerance, maxIter,
+                                 sopt.bootstrapBatchSize, order);
+    }
+    size_t numClasses = eqArena.numClasses();
     CollapsedEMOptimizer::SerialVecType alphas(transcripts.size(), 0.0);
     CollapsedEMOptimizer::SerialVecType alphasPrime(transcripts.size(), 0.0);
     CollapsedEMOptimizer::SerialVecType expTheta(transcripts.size(), 0.0);
     std::vector<uint64_t> sampCounts(numClasses, 0);
+    SingletonClasses split(eqArena, false);
+
+    // Scratch space and EM map for SQUAREM
+    bool useSQUAREM{sopt.useSQUAREM and !useVBEM};
+    size_t squaremSize = useSQUAREM ? transcripts.size() : 0;
+    CollapsedEMOptimizer::SerialVecType squaremAlpha1(squaremSize, 0.0);
+    CollapsedEMOptimizer::SerialVecType squaremAlpha2(squaremSize, 0.0);
+    CollapsedEMOptimizer::SerialVecType squaremAlphaExtrap(squaremSize, 0.0);
+    auto emMap = [&](const CollapsedEMOptimizer::SerialVecType& in,
+                     CollapsedEMOptimizer::SerialVecType& out) -> void {
+        EMUpdate_(eqArena, sampCounts, split, in, out);
+    };
+    auto emLogLikelihood = [&](const CollapsedEMOptimizer::SerialVecType& a) -> double {
+        return logLikelihood_(eqArena, sampCounts, a);
+    };
 
     uint32_t numBootstraps = sopt.numBootstraps;
 
     auto& jointLog = sopt.jointLog;
 
-    std::random_device rd;
-    MultinomialSampler msamp(rd);
+    // The point estimate (if we start from it) is rescaled to the total
+    // of the uniform initialization, of which a small fraction is retained
+    // so that no active transcript starts (and hence stays) at zero.
+    bool usePointEstimate{sopt.bootstrapFromPointEstimate};
+    double uniformFrac{0.01};
+    double pointScale{0.0};
+    if (usePointEstimate) {
+        double pointTotal{0.0};
+        double uniformTotal{0.0};
+        for (size_t i = 0; i < transcripts.size(); ++i) {
+            if (transcripts[i].getActive()) {
+                pointTotal += transcripts[i].sharedCount();
+                uniformTotal += uniformTxpWeight * totalNumFrags;
+            }
+        }
+        if (pointTotal > 0.0) {
+            pointScale = uniformTotal / pointTotal;
+        } else {
+            usePointEstimate = false;
+        }
+    }
+
+    MultinomialSampler msamp(uint32_t(0));
 
-    while (bsNum++ < numBootstraps) {
-        // Do a new bootstrap
-        msamp(sampCounts.begin(), totalNumFrags, numClasses, sampleWeights.begin());
+    uint32_t bsID{0};
+    auto checkpoint = sopt.bootstrapCheckpoint.get();
+    while ((bsID = bsNum++) < numBootstraps) {
+        // A replicate restored from the checkpoint isn't drawn again
+        if (checkpoint and checkpoint->isDone(bsID)) { continue; }
+        // Do a new bootstrap, drawn from the stream of this replicate
+        msamp.seed(salmon::utils::streamSeed(sopt, salmon::utils::RandomStream::BOOTSTRAP, bsID));
+        msamp(sampCounts.begin(), totalNumFrags, sampleTree);
+        split.setCounts(eqArena, sampCounts.data(), transcripts.size());
 
 	double totalLen{0.0};
         for (size_t i = 0; i < transcripts.size(); ++i) {
             alphas[i] = transcripts[i].getActive() ? uniformTxpWeight * totalNumFrags : 0.0;
             totalLen += effLens(i);
         }
+        // If requested, start (mostly) from the point estimate
+        if (usePointEstimate) {
+            for (size_t i = 0; i < transcripts.size(); ++i) {
+                if (transcripts[i].getActive()) {
+                    alphas[i] = (1.0 - uniformFrac) * pointScale * transcripts[i].sharedCount() +
+                                uniformFrac * alphas[i];
+                }
+            }
+        }
 
         bool converged{false};
         double maxRelDiff = -std::numeric_limits<double>::max();
@@ -469,12 +1483,14 @@ bool doBootstrap(
 
         while (itNum < minIter or (itNum < maxIter and !converged)) {
 
-            if (useVBEM) {
-                VBEMUpdate_(txpGroups, txpGroupCombinedWeights, sampCounts, transcripts,
+            if (useSQUAREM) {
+                SQUAREMUpdate_(alphas, alphasPrime, squaremAlpha1, squaremAlpha2,
+                               squaremAlphaExtrap, emMap, emLogLikelihood);
+            } else if (useVBEM) {
+                VBEMUpdate_(eqArena, sampCounts, split, transcripts,
                             priorAlpha, totalLen, alphas, alphasPrime, expTheta);
             } else {
-                EMUpdate_(txpGroups, txpGroupCombinedWeights, sampCounts, transcripts,
-                          alphas, alphasPrime);
+                EMUpdate_(eqArena, sampCounts, split, alphas, alphasPrime);
             }
 
             converged = true;
@@ -494,31 +1510,10 @@ bool doBootstrap(
             ++itNum;
         }
 
-        double alphaSum = truncateCountVector(alphas, cutoff);
-
-        if (alphaSum < minWeight) {
-            jointLog->error("Total alpha weight was too small! "
-                    "Make sure you ran salmon correclty.");
+        if (!finishBootstrap_(bsID, alphas, cutoff, useScaledCounts, numMappedFrags,
+                              sopt, writeReplicate, order)) {
             return false;
         }
-
-        if (useScaledCounts) {
-            double mappedFragsDouble = static_cast<double>(numMappedFrags);
-            double alphaSum = 0.0;
-            for (auto a : alphas) { alphaSum += a; }
-            if (alphaSum > ::minWeight) {
-                double scaleFrac = 1.0 / alphaSum;
-                // scaleFrac converts alpha to nucleotide fraction,
-                // and multiplying by numMappedFrags scales by the total
-                // number of mapped fragments to provide an estimated count.
-                for (auto& a : alphas) { a = mappedFragsDouble * (a * scaleFrac); }
-            } else { // This shouldn't happen!
-                sopt.jointLog->error("Bootstrap had insufficient number of fragments!"
-                                     "Something is probably wrong; please check that you "
-                                     "have run salmon correctly and report this to GitHub.");
-            }
-        }
-        writeBootstrap(alphas);
     }
     return true;
 }
@@ -530,6 +1525,7 @@ bool CollapsedEMOptimizer::gatherBootstraps(
         std::function<bool(const std::vector<double>&)>& writeBootstrap,
         double relDiffTolerance,
         uint32_t maxIter) {
+    SALMON_ALLOC_SCOPE("bootstraps");
 
     std::vector<Transcript>& transcripts = readExp.transcripts();
     using VecT = CollapsedEMOptimizer::SerialVecType;
@@ -546,16 +1542,13 @@ bool CollapsedEMOptimizer::gatherBootstraps(
 
     uint32_t numBootstraps = sopt.numBootstraps;
 
-    std::vector<std::pair<const TranscriptGroup, TGValue>>& eqVec =
-        readExp.equivalenceClassBuilder().eqVec();
+    EquivalenceClassArena& eqArena =
+        readExp.equivalenceClassBuilder().eqArena();
 
     std::unordered_set<uint32_t> activeTranscriptIDs;
-    for (auto& kv : eqVec) {
-        auto& tg = kv.first;
-        for (auto& t : tg.txps) {
-            transcripts[t].setActive();
-            activeTranscriptIDs.insert(t);
-        }
+    for (auto t : eqArena.labels) {
+        transcripts[t].setActive();
+        activeTranscriptIDs.insert(t);
     }
 
     bool useVBEM{sopt.useVBOpt};
@@ -564,15 +1557,15 @@ bool CollapsedEMOptimizer::gatherBootstraps(
 
     auto jointLog = sopt.jointLog;
 
-    jointLog->info("Will draw {} bootstrap samples", numBootstraps);
-    jointLog->info("Optimizing over {} equivalence classes", eqVec.size());
+    jointLog->info("Will draw {}{} bootstrap samples", sopt.adaptiveBootstraps ? "at most " : "", numBootstraps);
+    jointLog->info("Optimizing over {} equivalence classes", eqArena.numClasses());
 
     double totalNumFrags{static_cast<double>(readExp.numMappedFragments())};
     double totalLen{0.0};
 
     if (activeTranscriptIDs.size() == 0) {
         jointLog->error("It seems that no transcripts are expressed; something is likely wrong!");
-        std::exit(1);
+        salmon::utils::exitRun(1);
     }
 
     double scale = 1.0 / activeTranscriptIDs.size();
@@ -585,7 +1578,7 @@ bool CollapsedEMOptimizer::gatherBootstraps(
         totalLen += effLens(i);
     }
 
-    auto numRemoved = markDegenerateClasses(eqVec, alphas, effLens, sopt.jointLog);
+    auto numRemoved = markDegenerateClasses(eqArena, alphas, effLens, sopt.jointLog);
     sopt.jointLog->info("Marked {} weighted equivalence classes as degenerate",
             numRemoved);
 
@@ -594,94 +1587,167 @@ bool CollapsedEMOptimizer::gatherBootstraps(
     double cutoff = (useVBEM) ? (priorAlpha + minAlpha) : minAlpha;
 
     // Since we will use the same weights and transcript groups for each
-    // of the bootstrap samples (only the count vector will change), it
-    // makes sense to keep only one copy of these.
-    using TGroupLabelT = std::vector<uint32_t>;
-    using TGroupWeightVec = std::vector<double>;
-    std::vector<TGroupLabelT> txpGroups;
-    std::vector<TGroupWeightVec> txpGroupCombinedWeights;
-    std::vector<uint64_t> origCounts;
+    // of the bootstrap samples (only the count vector will change), all
+    // of the bootstrap threads share the arena directly, as they do the
+    // tree from which the counts are drawn; each thread only holds its
+    // own counts and abundances.  Invalid classes are given a sampling
+    // weight of 0, so they are never sampled.
     uint64_t totalCount{0};
-
-    for (auto& kv : eqVec) {
-        uint64_t count = kv.second.count;
-        // for each transcript in this class
-        const TranscriptGroup& tgroup = kv.first;
-        if (tgroup.valid) {
-            const std::vector<uint32_t>& txps = tgroup.txps;
-            const auto& auxs = kv.second.combinedWeights;
-            txpGroups.push_back(txps);
-	    // Convert to non-atomic
-            txpGroupCombinedWeights.emplace_back(auxs.begin(), auxs.end());
-            origCounts.push_back(count);
-            totalCount += count;
-        }
+    for (size_t eqID = 0; eqID < eqArena.numClasses(); ++eqID) {
+        if (eqArena.valid[eqID]) { totalCount += eqArena.counts[eqID]; }
     }
 
     double floatCount = totalCount;
-    std::vector<double> samplingWeights(txpGroups.size(), 0.0);
-    for (size_t i = 0; i < origCounts.size(); ++i) {
-        samplingWeights[i] = origCounts[i] / floatCount;
+    std::vector<double> samplingWeights(eqArena.numClasses(), 0.0);
+    for (size_t eqID = 0; eqID < eqArena.numClasses(); ++eqID) {
+        if (eqArena.valid[eqID]) {
+            samplingWeights[eqID] = eqArena.counts[eqID] / floatCount;
+        }
     }
+    MultinomialSplitTree samplingTree(std::move(samplingWeights));
 
     size_t numWorkerThreads{1};
-    if (sopt.numThreads > 1 and numBootstraps > 1) {
-        numWorkerThreads = std::min(sopt.numThreads - 1, numBootstraps - 1);
+    // Each thread draws batches of (one or more) replicates
+    bool batched{sopt.bootstrapBatchSize > 1 and !sopt.useVBOpt and !sopt.useSQUAREM};
+    uint32_t batchSize = batched ? sopt.bootstrapBatchSize : 1;
+    uint32_t numBatches = (numBootstraps + batchSize - 1) / batchSize;
+    if (sopt.numThreads > 1 and numBatches > 1) {
+        numWorkerThreads = std::min(sopt.numThreads - 1, numBatches - 1);
     }
 
     std::atomic<uint32_t> bsCounter{0};
-    std::vector<std::thread> workerThreads;
-    for (size_t tn = 0; tn < numWorkerThreads; ++tn) {
-        workerThreads.emplace_back(doBootstrap,
-                std::ref(txpGroups),
-                std::ref(txpGroupCombinedWeights),
-                std::ref(transcripts),
-                std::ref(effLens),
-                std::ref(samplingWeights),
-                totalCount,
-                numMappedFrags,
-                scale,
-                std::ref(bsCounter),
-                std::ref(sopt),
-                std::ref(writeBootstrap),
-                relDiffTolerance,
-                maxIter);
-    }
-
-    for (auto& t : workerThreads) {
-        t.join();
+    // Count the replicates drawn, for the metrics (if they're served)
+    std::function<bool(const std::vector<double>&)> countedWriteBootstrap;
+    if (sopt.metrics) {
+        sopt.metrics->set("salmon_bootstraps_requested", numBootstraps);
+        countedWriteBootstrap = [&sopt, &writeBootstrap](const std::vector<double>& alphas) -> bool {
+            bool written = writeBootstrap(alphas);
+            sopt.metrics->add("salmon_bootstraps_completed_total", 1);
+            return written;
+        };
     }
-    return true;
+    auto& writeCounted = sopt.metrics ? countedWriteBootstrap : writeBootstrap;
+    // Each replicate that is written is then recorded in the checkpoint
+    auto checkpoint = sopt.bootstrapCheckpoint.get();
+    ReplicateWriter writeRecorded = [&writeCounted, checkpoint](uint32_t bsID,
+                                                                const std::vector<double>& alphas) -> bool {
+        bool written = writeCounted(alphas);
+        if (written and checkpoint) { checkpoint->record(bsID, alphas); }
+        return written;
+    };
+    ReplicateWriter* writeReplicatePtr = &writeRecorded;
+    // With --adaptiveBootstraps, the replicates pass through the monitor
+    // that decides how many are drawn (and drops the rest)
+    std::unique_ptr<AdaptiveBootstraps> adaptive{nullptr};
+    ReplicateWriter adaptiveWriteReplicate;
+    if (sopt.adaptiveBootstraps) {
+        adaptive.reset(new AdaptiveBootstraps(writeRecorded, bsCounter, transcripts.size(),
+                                              checkpoint ? checkpoint->numRestored() : 0, sopt));
+        adaptiveWriteReplicate = [&adaptive](uint32_t bsID, const std::vector<double>& alphas) -> bool {
+            return adaptive->write(bsID, alphas);
+        };
+        writeReplicatePtr = &adaptiveWriteReplicate;
+        jointLog->info("will stop once the variances settle (after at least {} bootstraps)", sopt.minBootstraps);
+    }
+    auto& writeReplicate = *writeReplicatePtr;
+    // Record the number of adaptive bootstraps drawn
+    auto finish = [&adaptive, &sopt](bool success) -> bool {
+        if (adaptive) { sopt.numBootstraps = adaptive->numDrawn(); }
+        return success;
+    };
+    // With --seed or --deterministic, the replicates are written in order, however they're scheduled
+    std::unique_ptr<ReplicateOrder> order{nullptr};
+    if (sopt.haveSeed or sopt.deterministic) { order.reset(new ReplicateOrder(writeReplicate, checkpoint)); }
+    // If requested, one thread draws the replicates, and the device
+    // optimizes them, many at a time
+    if (sopt.useGPU and !sopt.useVBOpt and !sopt.useSQUAREM and !sopt.deterministic) {
+        auto device = makeEMDevice_(eqArena, transcripts.size(), false, jointLog);
+        if (device) {
+            size_t deviceBatchSize = std::min(static_cast<size_t>(numBootstraps),
+                                              std::max(static_cast<size_t>(sopt.bootstrapBatchSize), size_t(32)));
+            jointLog->info("optimizing the bootstrap replicates on the device, {} at a time", deviceBatchSize);
+            return finish(doBootstrapBatch_(eqArena, transcripts, samplingTree, totalCount, numMappedFrags, scale,
+                                            bsCounter, sopt, writeReplicate, relDiffTolerance, maxIter,
+                                            deviceBatchSize, order.get(), device.get()));
+        }
+    } else if (sopt.useGPU) {
+        jointLog->warn("the bootstraps of the VBEM, or with --useSQUAREM or --deterministic, aren't run on the device");
+    }
+
+    // Each worker is a task of the shared arena, so that the bootstraps
+    // don't oversubscribe the CPUs next to the other parallel phases
+    auto& arena = salmon::threading::TaskArena::global(sopt.numThreads, sopt.pinThreads);
+    arena.runTasks(numWorkerThreads, [&](size_t) -> void {
+            doBootstrap(eqArena, transcripts, effLens, samplingTree, totalCount,
+                        numMappedFrags, scale, bsCounter, sopt, writeReplicate,
+                        relDiffTolerance, maxIter, order.get());
+        });
+    return finish(true);
 }
 
-void updateEqClassWeights(std::vector<std::pair<const TranscriptGroup, TGValue>>& eqVec,
+/**
+ * Set posWeightInvDenoms(i) to the inverse of the probability, under the
+ * fragment start position distribution of its length class, that a
+ * fragment of transcript i starts within its effective length, for each
+ * of the active transcripts i (the denominators of the other transcripts
+ * are never read).  The transcripts of each length class are evaluated in
+ * a single batch (see FragmentStartPositionDistribution::evalLinearCDFs).
+ */
+void computePosWeightInvDenoms(std::vector<Transcript>& transcripts,
+                               const std::vector<uint32_t>& activeTxps,
+                               const Eigen::VectorXd& effLens,
+                               std::vector<FragmentStartPositionDistribution>& fragStartDists,
+                               Eigen::VectorXd& posWeightInvDenoms) {
+    std::vector<std::vector<uint32_t>> txpsByClass(fragStartDists.size());
+    for (auto i : activeTxps) {
+        txpsByClass[transcripts[i].lengthClassIndex()].push_back(i);
+    }
+    std::vector<int32_t> positions;
+    std::vector<uint32_t> lengths;
+    std::vector<double> cdfs;
+    for (size_t c = 0; c < txpsByClass.size(); ++c) {
+        auto& txps = txpsByClass[c];
+        positions.resize(txps.size());
+        lengths.resize(txps.size());
+        cdfs.resize(txps.size());
+        for (size_t j = 0; j < txps.size(); ++j) {
+            positions[j] = static_cast<int32_t>(effLens(txps[j]));
+            lengths[j] = transcripts[txps[j]].RefLength;
+        }
+        fragStartDists[c].evalLinearCDFs(txps.size(), positions.data(), lengths.data(), cdfs.data());
+        for (size_t j = 0; j < txps.size(); ++j) {
+            // As with the logged CDF, a CDF of 0 (LOG_0) gives a weight of 0
+            double cdf = cdfs[j];
+            posWeightInvDenoms(txps[j]) = (cdf == 0.0) ? 0.0 :
+                ((cdf >= salmon::math::EPSILON) ? 1.0 / cdf : 1e-5);
+        }
+    }
+}
+
+void updateEqClassWeights(EquivalenceClassArena& eqArena,
                           Eigen::VectorXd& posWeightInvDenoms,
 			  Eigen::VectorXd& effLens) {
-    tbb::parallel_for(BlockedIndexRange(size_t(0), size_t(eqVec.size())),
-            [&eqVec, &effLens, &posWeightInvDenoms]( const BlockedIndexRange& range) -> void {
+    tbb::parallel_for(BlockedIndexRange(size_t(0), size_t(eqArena.numClasses())),
+            [&eqArena, &effLens, &posWeightInvDenoms]( const BlockedIndexRange& range) -> void {
                 // For each index in the equivalence class vector
                 for (auto eqID : boost::irange(range.begin(), range.end())) {
-                    // The vector entry
-                    auto& kv = eqVec[eqID];
-                    // The label of the equivalence class
-                    const TranscriptGroup& k = kv.first;
-                    // The size of the label
-                    size_t classSize = k.txps.size();
-                    // The weights of the label
-                    TGValue& v = kv.second;
+                    // The extent of the label
+                    size_t start = eqArena.offsets[eqID];
+                    size_t end = eqArena.offsets[eqID + 1];
+                    double count = eqArena.counts[eqID];
 
                     // Iterate over each weight and set it equal to
                     // 1 / effLen of the corresponding transcript
                     double wsum{0.0};
-                    for (size_t i = 0; i < classSize; ++i) {
-		      auto tid = k.txps[i];
-		      v.posWeights[i] = 1.0 / effLens(tid);
-                      v.combinedWeights[i] = kv.second.count * (v.weights[i] * v.posWeights[i] * posWeightInvDenoms[tid]);
-                      wsum += v.combinedWeights[i];
+                    for (size_t i = start; i < end; ++i) {
+		      auto tid = eqArena.labels[i];
+		      eqArena.posWeights[i] = 1.0 / effLens(tid);
+                      eqArena.combinedWeights[i] = count * (eqArena.weights[i] * eqArena.posWeights[i] * posWeightInvDenoms[tid]);
+                      wsum += eqArena.combinedWeights[i];
                     }
                     double wnorm = 1.0 / wsum;
-                    for (size_t i = 0; i < classSize; ++i) {
-                        v.combinedWeights[i] *= wnorm;
+                    for (size_t i = start; i < end; ++i) {
+                        eqArena.combinedWeights[i] *= wnorm;
                     }
                 }
             });
@@ -692,8 +1758,19 @@ bool CollapsedEMOptimizer::optimize(ExpT& readExp,
         SalmonOpts& sopt,
         double relDiffTolerance,
         uint32_t maxIter) {
+    auto& arena = salmon::threading::TaskArena::global(sopt.numThreads, sopt.pinThreads);
+    return arena.run<bool>([&]() -> bool {
+            return optimize_(readExp, sopt, relDiffTolerance, maxIter);
+        });
+}
+
+template <typename ExpT>
+bool CollapsedEMOptimizer::optimize_(ExpT& readExp,
+        SalmonOpts& sopt,
+        double relDiffTolerance,
+        uint32_t maxIter) {
+    SALMON_ALLOC_BEGIN(setupScope, "EM setup");
 
-    tbb::task_scheduler_init tbbScheduler(sopt.numThreads);
     std::vector<Transcript>& transcripts = readExp.transcripts();
 
     uint32_t minIter = 50;
@@ -710,8 +1787,8 @@ bool CollapsedEMOptimizer::optimize(ExpT& readExp,
     Eigen::VectorXd effLens(transcripts.size());
     Eigen::VectorXd posWeightInvDenoms(transcripts.size());
 
-    std::vector<std::pair<const TranscriptGroup, TGValue>>& eqVec =
-        readExp.equivalenceClassBuilder().eqVec();
+    EquivalenceClassArena& eqArena =
+        readExp.equivalenceClassBuilder().eqArena();
 
     bool noRichEq = sopt.noRichEqClasses;
     bool useFSPD{sopt.useFSPD};
@@ -746,18 +1823,20 @@ bool CollapsedEMOptimizer::optimize(ExpT& readExp,
         effLens(i) = useEffectiveLengths ? std::exp(txp.getCachedLogEffectiveLength()) : txp.RefLength;
         txp.EffectiveLength = effLens(i);
 
-        if (noRichEq or !useFSPD) {
-            posWeightInvDenoms(i) = 1.0;
-        } else {
-            auto& fragStartDist = fragStartDists[txp.lengthClassIndex()];
-            double denomFactor = fragStartDist.evalCDF(static_cast<int32_t>(txp.EffectiveLength), txp.RefLength);
-            posWeightInvDenoms(i) = (denomFactor >= salmon::math::LOG_EPSILON) ?
-                std::exp(-denomFactor) : (1e-5);
-        }
+        posWeightInvDenoms(i) = 1.0;
 
         totalLen += effLens(i);
     }
 
+    // Only the transcripts that appear in some equivalence class can be
+    // assigned fragments; the rest are skipped by the per-transcript setup
+    std::vector<uint32_t> activeTxps = eqArena.activeTranscripts(transcripts.size());
+    jointLog->info("{} of {} transcripts appear in an equivalence class",
+                   activeTxps.size(), transcripts.size());
+    if (!noRichEq and useFSPD) {
+        computePosWeightInvDenoms(transcripts, activeTxps, effLens, fragStartDists, posWeightInvDenoms);
+    }
+
     // Based on the number of observed reads, use
     // a linear combination of the online estimates
     // and the uniform distribution.
@@ -767,67 +1846,112 @@ bool CollapsedEMOptimizer::optimize(ExpT& readExp,
         alphas[i] = (alphasPrime[i] == 1.0) ? ((alphas[i] * fracObserved) + (uniformPrior * (1.0 - fracObserved))) : 0.0;
     }
 
+    // If requested, start from the abundances estimated by a previous run
+    // (matched by transcript name).  These are rescaled to the total of the
+    // online estimates of the matched transcripts, and a small fraction of
+    // the online estimate is retained, so that no active transcript starts
+    // (and hence stays) at zero.
+    if (!sopt.initialAbundanceFile.empty()) {
+        std::unordered_map<std::string, double> prevNumReads;
+        std::string err;
+        if (!salmon::utils::readNumReads(sopt.initialAbundanceFile, prevNumReads, err)) {
+            jointLog->error("Could not read the initial abundances from [{}] ({}); "
+                            "it should be a quant.sf file written by salmon quant",
+                            sopt.initialAbundanceFile, err);
+            salmon::utils::exitRun(1);
+        }
+        std::vector<double> prevAlphas(transcripts.size(), -1.0);
+        double prevTotal{0.0};
+        double onlineTotal{0.0};
+        size_t numMatched{0};
+        for (size_t i = 0; i < transcripts.size(); ++i) {
+            if (alphasPrime[i] != 1.0) { continue; }
+            auto it = prevNumReads.find(transcripts[i].RefName);
+            if (it == prevNumReads.end()) { continue; }
+            prevAlphas[i] = it->second;
+            prevTotal += it->second;
+            onlineTotal += alphas[i];
+            ++numMatched;
+        }
+        jointLog->info("Initializing the optimizer from [{}]; matched {} of {} active transcripts",
+                       sopt.initialAbundanceFile, numMatched, numActive);
+        if (prevTotal > 0.0) {
+            double prevScale = onlineTotal / prevTotal;
+            double onlineFrac{0.01};
+            for (size_t i = 0; i < alphas.size(); ++i) {
+                if (prevAlphas[i] >= 0.0) {
+                    alphas[i] = (1.0 - onlineFrac) * prevScale * prevAlphas[i] + onlineFrac * alphas[i];
+                }
+            }
+        } else {
+            jointLog->warn("The initial abundances of the matched transcripts sum to 0; "
+                           "starting from the online estimates instead");
+        }
+    }
+
     // If the user requested *not* to use "rich" equivalence classes,
     // then wipe out all of the weight information here and simply replace
     // the weights with the effective length terms (here, the *inverse* of
     // the effective length).  Otherwise, multiply the existing weight terms
     // by the effective length term.
-    tbb::parallel_for(BlockedIndexRange(size_t(0), size_t(eqVec.size())),
-            [&eqVec, &effLens, &posWeightInvDenoms, useFSPD, noRichEq]( const BlockedIndexRange& range) -> void {
+    tbb::parallel_for(BlockedIndexRange(size_t(0), size_t(eqArena.numClasses())),
+            [&eqArena, &effLens, &posWeightInvDenoms, useFSPD, noRichEq]( const BlockedIndexRange& range) -> void {
             // For each index in the equivalence class vector
             for (auto eqID : boost::irange(range.begin(), range.end())) {
-                // The vector entry
-                auto& kv = eqVec[eqID];
-                // The label of the equivalence class
-                const TranscriptGroup& k = kv.first;
-                // The size of the label
-                size_t classSize = k.txps.size();
-                // The weights of the label
-                TGValue& v = kv.second;
+                // The extent of the label
+                size_t start = eqArena.offsets[eqID];
+                size_t end = eqArena.offsets[eqID + 1];
 
                 // Iterate over each weight and set it
                 double wsum{0.0};
 
 		// If we don't have positional weights, then
 		// create them here.
-		bool createdPosWeights{false};
-		if (v.weights.size() != v.posWeights.size()) {
-		  createdPosWeights = true;
-		  v.posWeights = std::vector<tbb::atomic<double>>(v.weights.size());
-		}
-
-                for (size_t i = 0; i < classSize; ++i) {
-        	    auto tid = k.txps[i];
+		bool createdPosWeights = !eqArena.hasPosWeights[eqID];
+
+                for (size_t i = start; i < end; ++i) {
+        	    auto tid = eqArena.labels[i];
                     double el = effLens(tid);
                     if (el <= 1.0) { el = 1.0; }
                     if (noRichEq) {
                         // Keep length factor separate for the time being
-                        v.weights[i] = 1.0;
+                        eqArena.weights[i] = 1.0;
 			// Pos weight
-			v.posWeights[i] = 1.0 / el;
+			eqArena.posWeights[i] = 1.0 / el;
                     } else if (createdPosWeights or !useFSPD) {
 		    // If the positional weights are new, then give them
 		    // meaningful values.
-			v.posWeights[i] = 1.0 / el;
+			eqArena.posWeights[i] = 1.0 / el;
 		    }
 
 		    // combined weight
-		    v.combinedWeights.push_back(
-			v.weights[i].load() * (v.posWeights[i].load() * posWeightInvDenoms[tid]));
-		    wsum += v.combinedWeights.back();
+		    eqArena.combinedWeights[i] =
+			eqArena.weights[i] * (eqArena.posWeights[i] * posWeightInvDenoms[tid]);
+		    wsum += eqArena.combinedWeights[i];
                 }
 
                 double wnorm = 1.0 / wsum;
-                for (size_t i = 0; i < classSize; ++i) {
-                  v.combinedWeights[i] = v.combinedWeights[i] * wnorm;
+                for (size_t i = start; i < end; ++i) {
+                  eqArena.combinedWeights[i] = eqArena.combinedWeights[i] * wnorm;
                 }
             }
     });
 
-    auto numRemoved = markDegenerateClasses(eqVec, alphas, effLens, sopt.jointLog);
+    auto numRemoved = markDegenerateClasses(eqArena, alphas, effLens, sopt.jointLog);
     sopt.jointLog->info("Marked {} weighted equivalence classes as degenerate",
             numRemoved);
 
+    // If requested, have the inference kernels read single-precision weights
+    if (sopt.mixedPrecisionEM) {
+        eqArena.storeSinglePrecisionWeights();
+    } else {
+        eqArena.releaseSinglePrecisionWeights();
+    }
+    if (sopt.hugePages) {
+        auto numAdvised = eqArena.adviseHugePages();
+        jointLog->info("requested huge pages for {} equivalence class arrays", numAdvised);
+    }
+
     size_t itNum{0};
     double minAlpha = 1e-8;
     double alphaCheckCutoff = 1e-2;
@@ -838,57 +1962,342 @@ bool CollapsedEMOptimizer::optimize(ExpT& readExp,
     std::vector<uint32_t> recomputeIt{50, 500, 1000};
     minIter = recomputeIt.front();
 
+    // If requested, accelerate the EM with SQUAREM
+    bool useSQUAREM{sopt.useSQUAREM and !useVBEM};
+    if (sopt.useSQUAREM and useVBEM) {
+        jointLog->warn("SQUAREM acceleration is only available for the EM optimizer; "
+                       "running the VBEM without it");
+    }
+    size_t squaremSize = useSQUAREM ? transcripts.size() : 0;
+    VecType squaremAlpha1(squaremSize);
+    VecType squaremAlpha2(squaremSize);
+    VecType squaremAlphaExtrap(squaremSize);
+    // If requested, accumulate the updates in per-thread buffers
+    // (or, with --deterministic, per class entry, summed in a fixed order)
+    std::unique_ptr<EMReductionBuffers> reductionBuffers{nullptr};
+    if (sopt.threadLocalEMBuffers or sopt.deterministic) {
+        reductionBuffers.reset(new EMReductionBuffers(transcripts.size(), sopt.deterministic));
+    }
+    // The single-transcript classes are summed once, rather than visited every round
+    SingletonClasses split(eqArena, true);
+    split.setCounts(eqArena, eqArena.counts.data(), transcripts.size());
+    if (sopt.deterministic) { split.indexEntries(eqArena, transcripts.size()); }
+
+    // If requested, the (non-VB) EM rounds between every activeSetInterval-th
+    // one only visit the transcripts whose abundance is at least minAlpha;
+    // the full rounds re-check the frozen ones (as do those right after the
+    // weights change)
+    bool useActiveSet{sopt.activeSetEM and !useVBEM};
+    if (sopt.activeSetEM and useVBEM) {
+        jointLog->warn("The active set is only available for the EM optimizer; "
+                       "running the VBEM over all transcripts");
+    }
+    const size_t activeSetInterval{20};
+    ActiveSetArena activeSet;
+    activeSet.indexEntries = sopt.deterministic;
+    bool activeSetRound{false};
+
+    auto emMap = [&](const VecType& in, VecType& out) -> void {
+        if (activeSetRound) {
+            EMUpdate_(activeSet.arena, *activeSet.split, transcripts, in, out, reductionBuffers.get());
+            for (auto tid : activeSet.frozen) { out[tid] = in[tid]; }
+        } else {
+            EMUpdate_(eqArena, split, transcripts, in, out, reductionBuffers.get());
+        }
+    };
+    auto emLogLikelihood = [&](const VecType& a) -> double {
+        return logLikelihood_(eqArena, a);
+    };
+
     bool converged{false};
     double maxRelDiff = -std::numeric_limits<double>::max();
-    while (itNum < minIter or (itNum < maxIter and !converged)) {
-        if (doBiasCorrect and
-            (find(recomputeIt.begin(), recomputeIt.end(), itNum) != recomputeIt.end())) {
+    auto& stageTimings = readExp.stageTimings();
+    // Publish the rounds done (and the last one's max rel diff) to the metrics, if they're served
+    auto reportProgress = [&sopt](size_t numRounds, double relDiff) -> void {
+        if (!sopt.metrics) { return; }
+        sopt.metrics->set("salmon_em_iteration", numRounds);
+        sopt.metrics->set("salmon_em_max_rel_diff", relDiff);
+    };
+    // The expected bias distributions are updated incrementally from one
+    // re-computation of the effective lengths to the next
+    salmon::utils::EffectiveLengthCache effLenCache(sopt.biasUpdateTolerance);
+    // Check the new effective lengths (and the positional weights computed
+    // from them), and re-weight the classes with them
+    auto applyEffectiveLengths = [&]() -> void {
+        // Check for strangeness with the lengths.
+        for (size_t i = 0; i < effLens.size(); ++i) {
+            if (effLens(i) <= 0.0) {
+                jointLog->warn("Transcript {} had length {}", i, effLens(i));
+            }
+        }
+        updateEqClassWeights(eqArena, posWeightInvDenoms, effLens);
+        if (sopt.mixedPrecisionEM) { eqArena.storeSinglePrecisionWeights(); }
+    };
+    auto recomputeEffectiveLengths = [&](size_t it) -> void {
+        jointLog->info("iteration {}, recomputing effective lengths", it);
+        RunProfiler::Phase biasPhase(sopt.profiler.get(), "bias recompute");
+        auto biasStart = std::chrono::steady_clock::now();
+        effLens = salmon::utils::updateEffectiveLengths(
+                sopt,
+                readExp,
+                effLens,
+                alphas,
+                &effLenCache);
+        if (!noRichEq and useFSPD) {
+            computePosWeightInvDenoms(transcripts, activeTxps, effLens, fragStartDists, posWeightInvDenoms);
+        }
+        applyEffectiveLengths();
+        stageTimings.biasSeconds += std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - biasStart).count();
+    };
+
+    // With --asyncBiasUpdate, the effective lengths are recomputed by a
+    // background task, from a snapshot of the abundances, while the rounds
+    // continue; its lengths (and positional weights) are swapped in between
+    // two rounds, once they're ready.  After the first recomputation, the
+    // next starts as soon as the abundances have moved far enough from the
+    // previous snapshot (or, at the latest, at the next of recomputeIt),
+    // and there are at most as many as there are entries in recomputeIt.
+    // The task works on copies of the state it updates (the length cache and
+    // the expected bias distributions), which are committed only when its
+    // result is swapped in, so that a dropped update changes nothing
+    struct BiasUpdate {
+        Eigen::VectorXd effLens;
+        Eigen::VectorXd posWeightInvDenoms;
+        std::unique_ptr<salmon::utils::EffectiveLengthCache> cache;
+        salmon::utils::ExpectedBiasDists expected;
+        double seconds{0.0};
+    };
+    bool asyncBias{doBiasCorrect and sopt.asyncBiasUpdate};
+    if (asyncBias and sopt.deterministic) {
+        jointLog->warn("the background bias updates are swapped in whenever they're ready; "
+                       "recomputing the effective lengths between rounds with --deterministic");
+        asyncBias = false;
+    }
+    // The total variation distance between the (normalized) abundances and
+    // the last snapshot beyond which the effective lengths are recomputed
+    const double asyncBiasMinChange{0.01};
+    std::future<BiasUpdate> pendingBias;
+    std::vector<double> biasSnapshot;
+    size_t numBiasUpdates{0};
+    auto startBiasUpdate = [&](size_t it) -> void {
+        jointLog->info("iteration {}, recomputing effective lengths (in the background)", it);
+        biasSnapshot.resize(alphas.size());
+        for (size_t i = 0; i < alphas.size(); ++i) { biasSnapshot[i] = alphas[i]; }
+        Eigen::VectorXd effLensIn = effLens;
+        Eigen::VectorXd posWeightInvDenomsIn = posWeightInvDenoms;
+        salmon::utils::EffectiveLengthCache cacheIn = effLenCache;
+        // The task shares the slots of the (global) arena with the rounds
+        pendingBias = std::async(std::launch::async,
+            [&, effLensIn, posWeightInvDenomsIn, cacheIn]() mutable -> BiasUpdate {
+                auto& arena = salmon::threading::TaskArena::global(sopt.numThreads, sopt.pinThreads);
+                return arena.run<BiasUpdate>([&]() -> BiasUpdate {
+                    auto biasStart = std::chrono::steady_clock::now();
+                    BiasUpdate u;
+                    u.cache.reset(new salmon::utils::EffectiveLengthCache(std::move(cacheIn)));
+                    u.effLens = salmon::utils::updateEffectiveLengths(sopt, readExp, effLensIn, biasSnapshot,
+                                                                      u.cache.get(), &u.expected);
+                    u.posWeightInvDenoms = std::move(posWeightInvDenomsIn);
+                    if (!noRichEq and useFSPD) {
+                        computePosWeightInvDenoms(transcripts, activeTxps, u.effLens, fragStartDists,
+                                                  u.posWeightInvDenoms);
+                    }
+                    u.seconds = std::chrono::duration<double>(
+                            std::chrono::steady_clock::now() - biasStart).count();
+                    return u;
+                });
+            });
+        ++numBiasUpdates;
+    };
+    auto movedSinceSnapshot = [&]() -> double {
+        double total{0.0};
+        double snapshotTotal{0.0};
+        for (size_t i = 0; i < alphas.size(); ++i) {
+            total += alphas[i];
+            snapshotTotal += biasSnapshot[i];
+        }
+        if (total <= 0.0 or snapshotTotal <= 0.0) { return 0.0; }
+        double dist{0.0};
+        for (size_t i = 0; i < alphas.size(); ++i) {
+            dist += std::abs(alphas[i] / total - biasSnapshot[i] / snapshotTotal);
+        }
+        return 0.5 * dist;
+    };
+    // Swap in the background recomputation's lengths if they're ready (or,
+    // if wait, once they are)
+    auto finishBiasUpdate = [&](bool wait) -> bool {
+        if (!pendingBias.valid()) { return false; }
+        if (!wait and pendingBias.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            return false;
+        }
+        BiasUpdate u = pendingBias.get();
+        effLens = std::move(u.effLens);
+        posWeightInvDenoms = std::move(u.posWeightInvDenoms);
+        effLenCache = std::move(*u.cache);
+        readExp.expectedSeqBias() = std::move(u.expected.seq);
+        readExp.expectedGCBias() = std::move(u.expected.gc);
+        applyEffectiveLengths();
+        stageTimings.biasSeconds += u.seconds;
+        return true;
+    };
+
+    // If requested, run the EM separately on each connected component
+    bool useComponentEM{sopt.componentEM and !useVBEM};
+    if (sopt.componentEM and useVBEM) {
+        jointLog->warn("The component-wise optimization is only available for the EM optimizer; "
+                       "running the VBEM over all equivalence classes");
+    }
+
+    // The EM (and the bias recomputations between its iterations) as one
+    // phase, so that the hardware counters of all of the TBB worker threads
+    // are attributed to it (--perfCounters)
+    RunProfiler::Phase emPhase(sopt.profiler.get(), "EM iterations");
+    SALMON_ALLOC_END(setupScope);
+    auto optimizeStart = std::chrono::steady_clock::now();
+    if (useComponentEM) {
+        auto comps = buildEqClassComponents(eqArena, transcripts.size());
+        size_t numComponents = comps.numComponents();
+        jointLog->info("running the EM independently on {} connected components", numComponents);
+
+        // Transcripts that appear in no valid class receive no mass
+        std::vector<uint8_t> inComponent(transcripts.size(), 0);
+        for (auto tid : comps.txps) { inComponent[tid] = 1; }
+        for (size_t i = 0; i < transcripts.size(); ++i) {
+            if (!inComponent[i]) { alphas[i] = 0.0; }
+            alphasPrime[i] = 0.0;
+        }
 
-            jointLog->info("iteration {}, recomputing effective lengths", itNum);
-            effLens = salmon::utils::updateEffectiveLengths(
-                    sopt,
-                    readExp,
-                    effLens,
-                    alphas);
-
-            // Check for strangeness with the lengths.
-            for (size_t i = 0; i < effLens.size(); ++i) {
-                if (effLens(i) <= 0.0) {
-                    jointLog->warn("Transcript {} had length {}", i, effLens(i));
+        // The effective lengths, and hence the weights of every class, can
+        // change at the iterations in recomputeIt.  The optimization is
+        // split into phases at these points; in each phase, each component
+        // is iterated until it converges (or reaches the end of the phase).
+        std::vector<size_t> phaseEnds;
+        if (doBiasCorrect) {
+            for (auto it : recomputeIt) {
+                if (it < maxIter) { phaseEnds.push_back(it); }
+            }
+        }
+        phaseEnds.push_back(maxIter);
+
+        std::vector<size_t> componentIt(numComponents, 0);
+        std::vector<double> componentRelDiff(numComponents, 0.0);
+        for (size_t phase = 0; phase < phaseEnds.size(); ++phase) {
+            size_t phaseEnd = phaseEnds[phase];
+            tbb::parallel_for(BlockedIndexRange(size_t(0), numComponents, 1),
+                    [&](const BlockedIndexRange& range) -> void {
+                    for (auto c : boost::irange(range.begin(), range.end())) {
+                        componentRelDiff[c] = (eqArena.hasSinglePrecisionWeights()) ?
+                            componentEM_(eqArena, eqArena.singlePrecisionWeights.data(), comps, c,
+                                         alphas, alphasPrime, componentIt[c], minIter, phaseEnd,
+                                         alphaCheckCutoff, relDiffTolerance) :
+                            componentEM_(eqArena, eqArena.combinedWeights.data(), comps, c,
+                                         alphas, alphasPrime, componentIt[c], minIter, phaseEnd,
+                                         alphaCheckCutoff, relDiffTolerance);
+                    }
+            });
+
+            // The global optimization would only reach the end of this phase
+            // if some component has not yet converged.
+            bool reachedEnd{false};
+            itNum = 0;
+            maxRelDiff = -std::numeric_limits<double>::max();
+            for (size_t c = 0; c < numComponents; ++c) {
+                itNum = std::max(itNum, componentIt[c]);
+                maxRelDiff = std::max(maxRelDiff, componentRelDiff[c]);
+                if (componentIt[c] == phaseEnd and componentRelDiff[c] > relDiffTolerance) {
+                    reachedEnd = true;
                 }
-		if (noRichEq or !useFSPD) {
-		  posWeightInvDenoms(i) = 1.0;
-		} else {
-		  auto& txp = transcripts[i];
-		  auto& fragStartDist = fragStartDists[txp.lengthClassIndex()];
-		  double denomFactor = fragStartDist.evalCDF(static_cast<int32_t>(effLens(i)), txp.RefLength);
-		  posWeightInvDenoms(i) = (denomFactor >= salmon::math::LOG_EPSILON) ?
-		    std::exp(-denomFactor) : 1e-5;
-		}
             }
-	   updateEqClassWeights(eqVec, posWeightInvDenoms, effLens);
+            reportProgress(itNum, maxRelDiff);
+            if (!reachedEnd or phase + 1 == phaseEnds.size()) { break; }
+            recomputeEffectiveLengths(phaseEnd);
         }
+        stageTimings.numEMIterations += itNum;
+    }
 
-        if (useVBEM) {
-            VBEMUpdate_(eqVec, transcripts, priorAlpha, totalLen, alphas, alphasPrime, expTheta);
+    // If requested, run the rounds on a CUDA device, from one
+    // re-computation of the effective lengths to the next; if the device
+    // fails, the rounds continue on the CPU from the last estimates it
+    // returned
+    std::unique_ptr<salmon::gpu::EMDevice> device{nullptr};
+    if (sopt.useGPU) {
+        if (useSQUAREM or useComponentEM or useActiveSet) {
+            jointLog->warn("--useSQUAREM, --componentEM and --activeSetEM run on the CPU; ignoring --gpu");
+        } else if (sopt.deterministic) {
+            jointLog->warn("the device sums the updates in no fixed order; ignoring --gpu with --deterministic");
         } else {
-            EMUpdate_(eqVec, transcripts, alphas, alphasPrime);
+            device = makeEMDevice_(eqArena, transcripts.size(), true, jointLog);
         }
-
-        converged = true;
-        maxRelDiff = -std::numeric_limits<double>::max();
-        for (size_t i = 0; i < transcripts.size(); ++i) {
-            if (alphasPrime[i] > alphaCheckCutoff) {
-                double relDiff = std::abs(alphas[i] - alphasPrime[i]) / alphasPrime[i];
-                maxRelDiff = (relDiff > maxRelDiff) ? relDiff : maxRelDiff;
-                if (relDiff > relDiffTolerance) {
-                    converged = false;
+    }
+    if (device) {
+        asyncBias = false;
+        std::vector<double> deviceAlphas(alphas.size());
+        for (size_t i = 0; i < alphas.size(); ++i) { deviceAlphas[i] = alphas[i]; }
+        try {
+            while (itNum < minIter or (itNum < maxIter and !converged)) {
+                size_t endIt = maxIter;
+                if (doBiasCorrect) {
+                    if (find(recomputeIt.begin(), recomputeIt.end(), itNum) != recomputeIt.end()) {
+                        for (size_t i = 0; i < alphas.size(); ++i) { alphas[i] = deviceAlphas[i]; }
+                        recomputeEffectiveLengths(itNum);
+                        device->updateWeights(eqArena);
+                    }
+                    for (auto it : recomputeIt) {
+                        if (it > itNum) { endIt = std::min(endIt, static_cast<size_t>(it)); }
+                    }
                 }
+                itNum = device->optimize(useVBEM, priorAlpha, itNum, endIt, minIter, alphaCheckCutoff,
+                                         relDiffTolerance, deviceAlphas, maxRelDiff);
+                converged = (maxRelDiff <= relDiffTolerance);
+                reportProgress(itNum, maxRelDiff);
+                jointLog->info("iteration = {} | max rel diff. = {} (on the device)", itNum, maxRelDiff);
             }
-            alphas[i] = alphasPrime[i];
-            alphasPrime[i] = 0.0;
+        } catch (std::runtime_error& e) {
+            jointLog->warn("the EM failed on the device ({}); continuing on the CPU from iteration {}",
+                           e.what(), itNum);
+            converged = false;
+        }
+        for (size_t i = 0; i < alphas.size(); ++i) { alphas[i] = deviceAlphas[i]; }
+    }
+
+    while (!useComponentEM and (itNum < minIter or (itNum < maxIter and !converged))) {
+        SALMON_TRACE_SCOPE("EM iteration");
+        bool weightsChanged{false};
+        if (asyncBias) {
+            if (finishBiasUpdate(false)) {
+                jointLog->info("iteration {}, swapped in the recomputed effective lengths", itNum);
+                weightsChanged = true;
+            }
+            if (!pendingBias.valid() and numBiasUpdates < recomputeIt.size() and itNum >= recomputeIt.front() and
+                (numBiasUpdates == 0 or itNum >= recomputeIt[numBiasUpdates] or
+                 movedSinceSnapshot() > asyncBiasMinChange)) {
+                startBiasUpdate(itNum);
+            }
+        } else if (doBiasCorrect and
+            (find(recomputeIt.begin(), recomputeIt.end(), itNum) != recomputeIt.end())) {
+            recomputeEffectiveLengths(itNum);
+            weightsChanged = true;
+        }
+        bool rebuildActiveSet = useActiveSet and
+            (!activeSet.split or weightsChanged or itNum % activeSetInterval == 0);
+        activeSetRound = useActiveSet and !rebuildActiveSet;
+
+        if (useSQUAREM) {
+            SQUAREMUpdate_(alphas, alphasPrime, squaremAlpha1, squaremAlpha2,
+                           squaremAlphaExtrap, emMap, emLogLikelihood);
+        } else if (useVBEM) {
+            VBEMUpdate_(eqArena, split, transcripts, priorAlpha, totalLen, alphas, alphasPrime, expTheta,
+                        reductionBuffers.get());
+        } else {
+            emMap(alphas, alphasPrime);
         }
 
+        maxRelDiff = swapAndCheckConvergence_(alphas, alphasPrime, alphaCheckCutoff);
+        // (not while the effective lengths are being recomputed)
+        converged = (maxRelDiff <= relDiffTolerance) and !pendingBias.valid();
+        if (rebuildActiveSet) { activeSet.build(eqArena, alphas, minAlpha); }
+        reportProgress(itNum + 1, maxRelDiff);
+
         if (itNum % 100 == 0) {
             jointLog->info("iteration = {} | max rel diff. = {}",
                             itNum, maxRelDiff);
@@ -896,6 +2305,17 @@ bool CollapsedEMOptimizer::optimize(ExpT& readExp,
 
         ++itNum;
     }
+    // A recomputation still running when the rounds end is dropped, so that
+    // the effective lengths are those the abundances were estimated with
+    if (pendingBias.valid()) {
+        pendingBias.wait();
+        jointLog->info("the rounds ended before the background recomputation of the effective "
+                       "lengths; not using it");
+    }
+    stageTimings.optimizeSeconds += std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - optimizeStart).count();
+    if (!useComponentEM) { stageTimings.numEMIterations += itNum; }
+    emPhase.end();
 
     // Reset the original bias correction options
     sopt.gcBiasCorrect = gcBiasCorrect;
@@ -926,6 +2346,117 @@ bool CollapsedEMOptimizer::optimize(ExpT& readExp,
     return true;
 }
 
+bool CollapsedEMOptimizer::optimizeGenes(ReadExperiment& readExp,
+        SalmonOpts& sopt,
+        const std::vector<uint32_t>& geneIDs,
+        const std::vector<std::string>& geneNames,
+        double relDiffTolerance,
+        uint32_t maxIter) {
+    std::vector<Transcript>& transcripts = readExp.transcripts();
+    EquivalenceClassArena& eqArena = readExp.equivalenceClassBuilder().eqArena();
+    auto jointLog = sopt.jointLog;
+    size_t numGenes = geneNames.size();
+    bool useEffectiveLengths = !sopt.noEffectiveLengthCorrection;
+    if (sopt.biasCorrect or sopt.gcBiasCorrect) {
+        jointLog->warn("The effective lengths are not bias-corrected by the gene-level EM (--geneLevelOnly)");
+    }
+
+    // The online estimates of the genes, and the means of the (effective)
+    // lengths of their transcripts, weighted by the transcripts' online
+    // estimates (or unweighted, for genes that have none)
+    std::vector<double> online(numGenes, 0.0);
+    std::vector<double> weightedEffLen(numGenes, 0.0);
+    std::vector<double> weightedLen(numGenes, 0.0);
+    std::vector<double> effLenSum(numGenes, 0.0);
+    std::vector<double> lenSum(numGenes, 0.0);
+    std::vector<uint32_t> numTxps(numGenes, 0);
+    for (size_t i = 0; i < transcripts.size(); ++i) {
+        auto& txp = transcripts[i];
+        txp.EffectiveLength = useEffectiveLengths ? std::exp(txp.getCachedLogEffectiveLength()) : txp.RefLength;
+        auto g = geneIDs[i];
+        online[g] += txp.projectedCounts;
+        weightedEffLen[g] += txp.projectedCounts * txp.EffectiveLength;
+        weightedLen[g] += txp.projectedCounts * txp.RefLength;
+        effLenSum[g] += txp.EffectiveLength;
+        lenSum[g] += txp.RefLength;
+        ++numTxps[g];
+    }
+    std::vector<Transcript> genes;
+    genes.reserve(numGenes);
+    for (size_t g = 0; g < numGenes; ++g) {
+        double len = (online[g] > 0.0) ? weightedLen[g] / online[g] : lenSum[g] / numTxps[g];
+        genes.emplace_back(g, geneNames[g].c_str(), static_cast<uint32_t>(std::round(len)));
+        double el = (online[g] > 0.0) ? weightedEffLen[g] / online[g] : effLenSum[g] / numTxps[g];
+        genes.back().EffectiveLength = std::max(el, 1.0);
+    }
+
+    // As in optimize, the (auxiliary) weight of each gene of a class over
+    // the gene's effective length, normalized over the class
+    bool noRichEq = sopt.noRichEqClasses;
+    for (size_t eqID = 0; eqID < eqArena.numClasses(); ++eqID) {
+        size_t start = eqArena.offsets[eqID];
+        size_t end = eqArena.offsets[eqID + 1];
+        double wsum{0.0};
+        for (size_t i = start; i < end; ++i) {
+            double w = noRichEq ? 1.0 : eqArena.weights[i];
+            eqArena.combinedWeights[i] = w / genes[eqArena.labels[i]].EffectiveLength;
+            wsum += eqArena.combinedWeights[i];
+        }
+        double wnorm = (wsum > 0.0) ? 1.0 / wsum : 0.0;
+        for (size_t i = start; i < end; ++i) { eqArena.combinedWeights[i] *= wnorm; }
+    }
+    eqArena.releaseSinglePrecisionWeights();
+    jointLog->info("{} gene-level equivalence classes over {} genes", eqArena.numClasses(), numGenes);
+
+    // Start from the online estimates, mixed with the uniform distribution
+    // as in optimize; every gene that appears in a class is active, so that
+    // none (e.g. one whose online estimate is 0) starts, and stays, at 0
+    double totalWeight{0.0};
+    for (size_t g = 0; g < numGenes; ++g) { totalWeight += online[g]; }
+    std::vector<uint32_t> activeGenes = eqArena.activeTranscripts(numGenes);
+    double uniformPrior = activeGenes.empty() ? 0.0 : totalWeight / activeGenes.size();
+    double fracObserved = std::min(1.0, totalWeight / sopt.numRequiredFragments);
+    std::vector<double> alphas(numGenes, 0.0);
+    for (auto g : activeGenes) {
+        alphas[g] = online[g] * fracObserved + uniformPrior * (1.0 - fracObserved);
+    }
+
+    bool useVBEM{sopt.useVBOpt};
+    double priorAlpha = 0.01;
+    auto optimizeStart = std::chrono::steady_clock::now();
+    salmon::dist::LocalCommunicator comm;
+    uint32_t itNum = salmon::optimizer::distributedEM(comm, eqArena, eqArena.counts, genes, useVBEM,
+                                                      priorAlpha, relDiffTolerance, maxIter, alphas);
+    auto& stageTimings = readExp.stageTimings();
+    stageTimings.optimizeSeconds += std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - optimizeStart).count();
+    stageTimings.numEMIterations += itNum;
+    jointLog->info("gene-level EM finished after {} iterations", itNum);
+
+    double minAlpha = 1e-8;
+    double cutoff = useVBEM ? (priorAlpha + minAlpha) : minAlpha;
+    double alphaSum{0.0};
+    for (auto& a : alphas) {
+        if (a <= cutoff) { a = 0.0; }
+        alphaSum += a;
+    }
+    if (alphaSum < minWeight) {
+        jointLog->error("Total alpha weight was too small! "
+                        "Make sure you ran salmon correclty.");
+        return false;
+    }
+
+    // Split the estimate of each gene among its transcripts
+    for (size_t i = 0; i < transcripts.size(); ++i) {
+        auto g = geneIDs[i];
+        double share = (online[g] > 0.0) ? transcripts[i].projectedCounts / online[g] : 1.0 / numTxps[g];
+        double count = alphas[g] * share;
+        transcripts[i].setSharedCount(count);
+        transcripts[i].setMass(count / alphaSum);
+    }
+    return true;
+}
+
 template
 bool CollapsedEMOptimizer::optimize<ReadExperiment>(ReadExperiment& readExp,
         SalmonOpts& sopt,
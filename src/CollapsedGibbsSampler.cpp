@@ -2,8 +2,8 @@
 #include <unordered_map>
 #include <atomic>
 #include <random>
+#include <queue>
 
-#include "tbb/task_scheduler_init.h"
 #include "tbb/parallel_for.h"
 #include "tbb/parallel_for_each.h"
 #include "tbb/parallel_reduce.h"
@@ -23,13 +23,17 @@
 #include "CollapsedGibbsSampler.hpp"
 #include "Transcript.hpp"
 #include "TranscriptGroup.hpp"
+#include "EquivalenceClassArena.hpp"
+#include "EquivalenceClassComponents.hpp"
 #include "SalmonMath.hpp"
 #include "AlignmentLibrary.hpp"
 #include "ReadPair.hpp"
 #include "UnpairedRead.hpp"
 #include "ReadExperiment.hpp"
 #include "MultinomialSampler.hpp"
+#include "RandomStreams.hpp"
 #include "BootstrapWriter.hpp"
+#include "TaskArena.hpp"
 
 using BlockedIndexRange =  tbb::blocked_range<size_t>;
 
@@ -38,8 +42,43 @@ using BlockedIndexRange =  tbb::blocked_range<size_t>;
 constexpr double minEQClassWeight = std::numeric_limits<double>::denorm_min();
 constexpr double minWeight = std::numeric_limits<double>::denorm_min();
 
+/**
+ * Deal the connected components of the classes (see
+ * buildEqClassComponents) into at most numBlocks blocks of about the same
+ * total label length, largest components first; the classes of each block
+ * are returned.  No two blocks share a transcript, so the classes of
+ * different blocks can be sampled concurrently.
+ */
+std::vector<std::vector<uint32_t>> componentBlocks_(const EquivalenceClassArena& eqArena,
+                                                   size_t numTranscripts,
+                                                   size_t numBlocks) {
+    auto comps = buildEqClassComponents(eqArena, numTranscripts);
+    numBlocks = std::max(size_t(1), std::min(numBlocks, comps.numComponents()));
+    std::vector<std::vector<uint32_t>> blocks(numBlocks);
+    // The (load, block) of the least loaded block on top
+    using Load = std::pair<size_t, size_t>;
+    std::priority_queue<Load, std::vector<Load>, std::greater<Load>> loads;
+    for (size_t b = 0; b < numBlocks; ++b) { loads.emplace(0, b); }
+    for (size_t c = 0; c < comps.numComponents(); ++c) {
+        auto least = loads.top();
+        loads.pop();
+        size_t size{0};
+        for (size_t k = comps.classOffsets[c]; k < comps.classOffsets[c + 1]; ++k) {
+            blocks[least.second].push_back(comps.classes[k]);
+            size += eqArena.classSize(comps.classes[k]);
+        }
+        loads.emplace(least.first + size, least.second);
+    }
+    return blocks;
+}
+
+/**
+ * Draw the initial counts of the classes (of the block `classes`, or of
+ * all of them if it's null).
+ */
 void initCountMap_(
-        std::vector<std::pair<const TranscriptGroup, TGValue>>& eqVec,
+        EquivalenceClassArena& eqArena,
+        const std::vector<uint32_t>* classes,
         std::vector<Transcript>& transcriptsIn,
         double priorAlpha,
         MultinomialSampler& msamp,
@@ -48,23 +87,25 @@ void initCountMap_(
         Eigen::VectorXd& effLens,
         std::vector<int>& txpCounts) {
 
-    size_t offset{0};
-    for (auto& eqClass : eqVec) {
-        uint64_t classCount = eqClass.second.count;
+    const uint32_t* labels = eqArena.labels.data();
+    const double* auxs = eqArena.combinedWeights.data();
+    size_t numClasses = classes ? classes->size() : eqArena.numClasses();
+    for (size_t k = 0; k < numClasses; ++k) {
+        size_t eqID = classes ? (*classes)[k] : k;
+        uint64_t classCount = eqArena.counts[eqID];
 
         // for each transcript in this class
-        const TranscriptGroup& tgroup = eqClass.first;
-        const size_t groupSize = tgroup.txps.size();
-        if (tgroup.valid) {
-            const std::vector<uint32_t>& txps = tgroup.txps;
-            const auto& auxs = eqClass.second.combinedWeights;
+        const size_t offset = eqArena.offsets[eqID];
+        const size_t groupSize = eqArena.classSize(eqID);
+        if (eqArena.valid[eqID]) {
+            const uint32_t* txps = labels + offset;
 
             double denom = 0.0;
             if (BOOST_LIKELY(groupSize > 1)) {
 
                 for (size_t i = 0; i < groupSize; ++i) {
                     auto tid = txps[i];
-                    auto aux = auxs[i];
+                    auto aux = auxs[offset + i];
                     denom += (priorAlpha + transcriptsIn[tid].mass(false)) * aux;
                     countMap[offset + i] = 0;
                 }
@@ -74,7 +115,7 @@ void initCountMap_(
 		   double norm = 1.0 / denom;
 		   for (size_t i = 0; i < groupSize; ++i) {
 		     auto tid = txps[i];
-		     auto aux = auxs[i];
+		     auto aux = auxs[offset + i];
 		     probMap[offset + i] = norm *
                         ((priorAlpha + transcriptsIn[tid].mass(false)) * aux);
 		    }
@@ -95,39 +136,40 @@ void initCountMap_(
                 txpCounts[tid] += countMap[offset + i];
             }
 
-            offset += groupSize;
        } // valid group
     } // loop over all eq classes
 }
 
+// One round of the sampler over the classes (of the block `classes`, or all of them if it's null)
 void sampleRound_(
-        std::vector<std::pair<const TranscriptGroup, TGValue>>& eqVec,
+        EquivalenceClassArena& eqArena,
+        const std::vector<uint32_t>* classes,
         std::vector<uint64_t>& countMap,
         std::vector<double>& probMap,
         Eigen::VectorXd& effLens,
         double priorAlpha,
         std::vector<int>& txpCount,
-        MultinomialSampler& msamp) {
+        MultinomialSampler& msamp,
+        std::mt19937& gen) {
 
-    std::random_device rd;
-    std::mt19937 gen(rd());
     std::uniform_real_distribution<> dis(0.25, 0.75);
-    size_t offset{0};
     // Choose a fraction of this class to re-sample
 
     // The count substracted from each transcript
     std::vector<uint64_t> txpResamp;
 
-    for (auto& eqClass : eqVec) {
-        uint64_t classCount = eqClass.second.count;
+    const uint32_t* labels = eqArena.labels.data();
+    const double* auxs = eqArena.combinedWeights.data();
+    size_t numClasses = classes ? classes->size() : eqArena.numClasses();
+    for (size_t k = 0; k < numClasses; ++k) {
+        size_t eqID = classes ? (*classes)[k] : k;
         double sampleFrac = dis(gen);
 
         // for each transcript in this class
-        const TranscriptGroup& tgroup = eqClass.first;
-        const size_t groupSize = tgroup.txps.size();
-        if (tgroup.valid) {
-            const std::vector<uint32_t>& txps = tgroup.txps;
-            const auto& auxs = eqClass.second.combinedWeights;
+        const size_t offset = eqArena.offsets[eqID];
+        const size_t groupSize = eqArena.classSize(eqID);
+        if (eqArena.valid[eqID]) {
+            const uint32_t* txps = labels + offset;
 
             double denom = 0.0;
             // If this is a single-transcript group,
@@ -145,7 +187,7 @@ void sampleRound_(
                 // For each transcript in the group
                 for (size_t i = 0; i < groupSize; ++i) {
                     auto tid = txps[i];
-                    auto aux = auxs[i];
+                    auto aux = auxs[offset + i];
                     auto currCount = countMap[offset + i];
                     uint64_t currResamp = std::round(sampleFrac * currCount);
                     numResampled += currResamp;
@@ -160,7 +202,7 @@ void sampleRound_(
                     double norm = 1.0 / denom;
                     for (size_t i = 0; i < groupSize; ++i) {
                         auto tid = txps[i];
-                        auto aux = auxs[i];
+                        auto aux = auxs[offset + i];
                         probMap[offset + i] = norm * ((priorAlpha + txpCount[tid]) * aux);
                     }
 
@@ -187,7 +229,6 @@ void sampleRound_(
                 }
             }
 
-            offset += groupSize;
         } // valid group
     } // loop over all eq classes
 
@@ -208,22 +249,30 @@ bool CollapsedGibbsSampler::sample(ExpT& readExp,
         SalmonOpts& sopt,
         std::function<bool(const std::vector<int>&)>& writeBootstrap,
         uint32_t numSamples) {
+    auto& arena = salmon::threading::TaskArena::global(sopt.numThreads, sopt.pinThreads);
+    return arena.run<bool>([&]() -> bool {
+            return sample_(readExp, sopt, writeBootstrap, numSamples);
+        });
+}
+
+template <typename ExpT>
+bool CollapsedGibbsSampler::sample_(ExpT& readExp,
+        SalmonOpts& sopt,
+        std::function<bool(const std::vector<int>&)>& writeBootstrap,
+        uint32_t numSamples) {
 
     namespace bfs = boost::filesystem;
     auto& jointLog = sopt.jointLog;
-    tbb::task_scheduler_init tbbScheduler(sopt.numThreads);
     std::vector<Transcript>& transcripts = readExp.transcripts();
 
     // Fill in the effective length vector
     Eigen::VectorXd effLens(transcripts.size());
 
-    std::vector<std::pair<const TranscriptGroup, TGValue>>& eqVec =
-        readExp.equivalenceClassBuilder().eqVec();
+    EquivalenceClassArena& eqArena =
+        readExp.equivalenceClassBuilder().eqArena();
 
     using VecT = CollapsedGibbsSampler::VecType;
 
-    std::vector<std::vector<int>> allSamples(numSamples,
-                                        std::vector<int>(transcripts.size(),0));
     double priorAlpha = 1e-8;
     bool useScaledCounts = (!sopt.useQuasi and !sopt.allowOrphans);
     auto numMappedFragments = (useScaledCounts) ? readExp.upperBoundHits() : readExp.numMappedFragments();
@@ -235,55 +284,121 @@ bool CollapsedGibbsSampler::sample(ExpT& readExp,
         effLens(i) = txp.EffectiveLength;
     }
 
-    tbb::parallel_for(BlockedIndexRange(size_t(0), size_t(numSamples)),
-                [&eqVec, &transcripts, priorAlpha, &effLens,
-                 &allSamples, &writeBootstrap, useScaledCounts,
-                 &jointLog, numMappedFragments]( const BlockedIndexRange& range) -> void {
+    // The samples are drawn from independent chains, each with its own
+    // state and random number streams, which are run in parallel.  Each
+    // chain is burned in, and then thinned, by the requested number of
+    // rounds.
+    // (with --deterministic, one chain by default, rather than one per thread)
+    uint32_t numChains = (sopt.numGibbsChains > 0) ? sopt.numGibbsChains :
+                         (sopt.deterministic ? 1 : sopt.numThreads);
+    numChains = std::max(1u, std::min(numChains, numSamples));
+    uint32_t numBurninRounds = sopt.gibbsBurnin;
+    uint32_t thinningFactor = std::max(1u, sopt.gibbsThinningFactor);
+    jointLog->info("Drawing {} samples from {} chains (burn-in of {} rounds, thinning factor of {})",
+                   numSamples, numChains, numBurninRounds, thinningFactor);
+
+    // With fewer chains than threads, the rounds of each chain are split
+    // into blocks of connected components, which are sampled in parallel,
+    // each with its own random streams.  The number of blocks is fixed, so
+    // that a split chain's samples don't depend on how many threads sample
+    // its blocks.  Otherwise the samples do depend on the number of threads:
+    // it sets the number of chains (by default), and whether their rounds
+    // are split.  With --deterministic, the number of chains doesn't depend
+    // on it, and the rounds are always split, so the samples don't either.
+    const size_t numBlocks{256};
+    std::vector<std::vector<uint32_t>> blocks;
+    if (numChains < sopt.numThreads or sopt.deterministic) {
+        blocks = componentBlocks_(eqArena, transcripts.size(), numBlocks);
+        jointLog->info("Sampling each round of a chain in {} blocks of connected components", blocks.size());
+    }
 
+    tbb::parallel_for(BlockedIndexRange(size_t(0), size_t(numChains), 1),
+                [&eqArena, &transcripts, priorAlpha, &effLens, &writeBootstrap,
+                 useScaledCounts, &jointLog, numMappedFragments, numSamples,
+                 numChains, numBurninRounds, thinningFactor,
+                 &sopt, &blocks]( const BlockedIndexRange& range) -> void {
 
-                std::random_device rd;
-                MultinomialSampler ms(rd);
+                for (auto chainID : boost::irange(range.begin(), range.end())) {
+                // The multinomial sampler and the generator of the chain
+                // are seeded from (distinct) streams of this chain
+                MultinomialSampler ms(salmon::utils::streamSeed(
+                            sopt, salmon::utils::RandomStream::GIBBS, 2 * chainID));
+                std::mt19937 gen(salmon::utils::streamSeed(
+                            sopt, salmon::utils::RandomStream::GIBBS, 2 * chainID + 1));
 
-                size_t countMapSize{0};
-                for (size_t i = 0; i < eqVec.size(); ++i) {
-                    if (eqVec[i].first.valid) {
-                    countMapSize += eqVec[i].first.txps.size();
-                    }
-                }
+                // The counts and probabilities of each entry are
+                // stored parallel to the labels of the arena.
+                size_t countMapSize{eqArena.numEntries()};
 
                 size_t numTranscripts{transcripts.size()};
 
-                // will hold estimated counts
+                // will hold the current state of the chain and the
+                // (scaled) estimated counts
+                std::vector<int> txpCounts(numTranscripts, 0);
                 std::vector<int> alphas(numTranscripts, 0.0);
                 std::vector<uint64_t> countMap(countMapSize, 0);
                 std::vector<double> probMap(countMapSize, 0.0);
 
-                initCountMap_(eqVec, transcripts, priorAlpha, ms, countMap, probMap, effLens, allSamples[range.begin()]);
-
-                // For each sample this thread should generate
-                bool isFirstSample{true};
-                bool numInternalRounds = 10;
-                for (auto sampleID : boost::irange(range.begin(), range.end())) {
-                    if (sampleID % 100 == 0) {
-                        std::cerr << "gibbs sampling " << sampleID << "\n";
+                // The streams of the blocks of this chain (if its rounds are split)
+                std::vector<MultinomialSampler> blockMs;
+                std::vector<std::mt19937> blockGen;
+                blockMs.reserve(blocks.size());
+                blockGen.reserve(blocks.size());
+                for (size_t b = 0; b < blocks.size(); ++b) {
+                    uint64_t stream = numChains + chainID * blocks.size() + b;
+                    blockMs.emplace_back(salmon::utils::streamSeed(
+                                sopt, salmon::utils::RandomStream::GIBBS, 2 * stream));
+                    blockGen.emplace_back(salmon::utils::streamSeed(
+                                sopt, salmon::utils::RandomStream::GIBBS, 2 * stream + 1));
+                }
+                // A round over the whole chain; the blocks touch disjoint
+                // entries of countMap, probMap and txpCounts
+                auto sampleChainRound = [&]() -> void {
+                    if (blocks.empty()) {
+                        sampleRound_(eqArena, nullptr, countMap, probMap, effLens, priorAlpha,
+                                txpCounts, ms, gen);
+                        return;
                     }
+                    tbb::parallel_for(BlockedIndexRange(size_t(0), blocks.size(), 1),
+                            [&](const BlockedIndexRange& r) -> void {
+                                for (auto b : boost::irange(r.begin(), r.end())) {
+                                    sampleRound_(eqArena, &blocks[b], countMap, probMap, effLens,
+                                            priorAlpha, txpCounts, blockMs[b], blockGen[b]);
+                                }
+                            });
+                };
+
+                if (blocks.empty()) {
+                    initCountMap_(eqArena, nullptr, transcripts, priorAlpha, ms, countMap, probMap,
+                            effLens, txpCounts);
+                } else {
+                    tbb::parallel_for(BlockedIndexRange(size_t(0), blocks.size(), 1),
+                            [&](const BlockedIndexRange& r) -> void {
+                                for (auto b : boost::irange(r.begin(), r.end())) {
+                                    initCountMap_(eqArena, &blocks[b], transcripts, priorAlpha, blockMs[b],
+                                            countMap, probMap, effLens, txpCounts);
+                                }
+                            });
+                }
 
-                    if (!isFirstSample) {
-                        // the counts start at what they were last round.
-                        allSamples[sampleID] = allSamples[sampleID-1];
-                    }
+                for (size_t i = 0; i < numBurninRounds; ++i) {
+                    sampleChainRound();
+                }
 
-                    // Thin the chain by a factor of (numInternalRounds)
-                    for (size_t i = 0; i < numInternalRounds; ++i){
-                        sampleRound_(eqVec, countMap, probMap, effLens, priorAlpha,
-                                allSamples[sampleID], ms);
+                // The samples this chain should generate
+                size_t firstSample = (chainID * numSamples) / numChains;
+                size_t lastSample = ((chainID + 1) * numSamples) / numChains;
+                for (size_t sampleID = firstSample; sampleID < lastSample; ++sampleID) {
+                    // Thin the chain by a factor of (thinningFactor)
+                    for (size_t i = 0; i < thinningFactor; ++i){
+                        sampleChainRound();
                     }
 
                     // If we're scaling the counts, do it here.
                     if (useScaledCounts) {
                         double numMappedFrags = static_cast<double>(numMappedFragments);
                         double alphaSum = 0.0;
-                        for (auto c : allSamples[sampleID]) { alphaSum += static_cast<double>(c); }
+                        for (auto c : txpCounts) { alphaSum += static_cast<double>(c); }
                         if (alphaSum > ::minWeight) {
                             double scaleFrac = 1.0 / alphaSum;
                             // scaleFrac converts alpha to nucleotide fraction,
@@ -293,7 +408,7 @@ bool CollapsedGibbsSampler::sample(ExpT& readExp,
                                 alphas[tn] = static_cast<int>(
                                         std::round(
                                             numMappedFrags *
-                                            (static_cast<double>(allSamples[sampleID][tn]) * scaleFrac)));
+                                            (static_cast<double>(txpCounts[tn]) * scaleFrac)));
                             }
                         } else { // This shouldn't happen!
                             jointLog->error("Gibbs sampler had insufficient number of fragments!"
@@ -302,14 +417,15 @@ bool CollapsedGibbsSampler::sample(ExpT& readExp,
                         }
                     } else { // otherwise, just copy over from the sampled counts
                         for (size_t tn = 0; tn < numTranscripts; ++tn) {
-                            alphas[tn] = static_cast<int>(allSamples[sampleID][tn]);
+                            alphas[tn] = static_cast<int>(txpCounts[tn]);
                         }
                     }
 
+                    // The samples of the different chains are interleaved
+                    // (the writer is synchronized)
                     writeBootstrap(alphas);
-                    //bootstrapWriter->writeBootstrap(alphas);
-                    isFirstSample = false;
                 }
+                } // end for each chain
     });
     return true;
 }
@@ -0,0 +1,353 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <cuda_runtime.h>
+
+#include "EMDevice.hpp"
+
+namespace salmon {
+namespace gpu {
+
+namespace {
+
+// As in CollapsedEMOptimizer.cpp
+constexpr double minEQClassWeight = 4.9406564584124654e-324;
+constexpr double minWeight = 4.9406564584124654e-324;
+constexpr unsigned int blockSize = 256;
+
+void check(cudaError_t err, const char* what) {
+    if (err != cudaSuccess) {
+        throw std::runtime_error(std::string(what) + ": " + cudaGetErrorString(err));
+    }
+}
+
+// The double whose bits the convergence test recorded
+inline double relDiffValue(unsigned long long bits) {
+    double d;
+    std::memcpy(&d, &bits, sizeof(d));
+    return d;
+}
+
+inline unsigned int numBlocks(size_t n) {
+    return static_cast<unsigned int>((n + blockSize - 1) / blockSize);
+}
+
+template <typename T>
+T* deviceAlloc(size_t n, const char* what) {
+    T* p{nullptr};
+    check(cudaMalloc(reinterpret_cast<void**>(&p), std::max(n, size_t(1)) * sizeof(T)), what);
+    return p;
+}
+
+template <typename T>
+void toDevice(T* dst, const std::vector<T>& src, const char* what) {
+    if (src.empty()) { return; }
+    check(cudaMemcpy(dst, src.data(), src.size() * sizeof(T), cudaMemcpyHostToDevice), what);
+}
+
+// As salmon::math::digamma and salmon::math::expDigamma
+__device__ double digamma(double x) {
+    double result{0.0};
+    while (x < 10.0) {
+        result -= 1.0 / x;
+        x += 1.0;
+    }
+    double r = 1.0 / x;
+    double r2 = r * r;
+    result += log(x) - 0.5 * r -
+        r2 * (1.0/12.0 - r2 * (1.0/120.0 - r2 * (1.0/252.0 -
+        r2 * (1.0/240.0 - r2 * (1.0/132.0)))));
+    return result;
+}
+
+__device__ double expDigamma(double x) {
+    if (x < 10.0) { return exp(digamma(x)); }
+    double r = 1.0 / x;
+    return x - 0.5 + r * (1.0/24.0 + r * (1.0/48.0 + r * (23.0/5760.0 +
+        r * (-17.0/3840.0 + r * (-10099.0/2903040.0 + r * (2501.0/1161216.0))))));
+}
+
+/**
+ * One (VB)EM round over the classes, for R interleaved sets of counts: one
+ * thread per (class, replicate).  theta is alphaIn for the EM, and
+ * exp(E[log theta]) for the VBEM.  The replicates that have converged are
+ * skipped.
+ */
+__global__ void classRoundKernel(size_t numClasses, size_t R,
+                                 const uint64_t* offsets, const uint32_t* labels,
+                                 const double* weights, const double* counts,
+                                 const double* theta, double* alphaOut,
+                                 const uint8_t* converged) {
+    size_t idx = static_cast<size_t>(blockIdx.x) * blockDim.x + threadIdx.x;
+    if (idx >= numClasses * R) { return; }
+    size_t c = idx / R;
+    size_t r = idx % R;
+    if (converged and converged[r]) { return; }
+    double count = counts[idx];
+    if (count == 0.0) { return; }
+    uint64_t start = offsets[c];
+    uint64_t end = offsets[c + 1];
+    // A single-transcript class gives its transcript its full count
+    if (end - start == 1) {
+        atomicAdd(&alphaOut[labels[start] * R + r], count);
+        return;
+    }
+    double denom{0.0};
+    for (uint64_t i = start; i < end; ++i) { denom += theta[labels[i] * R + r] * weights[i]; }
+    if (denom <= minEQClassWeight) { return; }
+    double invDenom = count / denom;
+    for (uint64_t i = start; i < end; ++i) {
+        double v = theta[labels[i] * R + r] * weights[i];
+        if (v > 0.0 and !isnan(v)) { atomicAdd(&alphaOut[labels[i] * R + r], v * invDenom); }
+    }
+}
+
+__global__ void sumKernel(size_t n, const double* x, double* sum) {
+    __shared__ double partial[blockSize];
+    size_t i = static_cast<size_t>(blockIdx.x) * blockDim.x + threadIdx.x;
+    partial[threadIdx.x] = (i < n) ? x[i] : 0.0;
+    __syncthreads();
+    for (unsigned int s = blockDim.x / 2; s > 0; s >>= 1) {
+        if (threadIdx.x < s) { partial[threadIdx.x] += partial[threadIdx.x + s]; }
+        __syncthreads();
+    }
+    if (threadIdx.x == 0) { atomicAdd(sum, partial[0]); }
+}
+
+// As the per-transcript part of VBEMUpdate_
+__global__ void vbemPrepareKernel(size_t numTxps, const double* alphaIn, const double* alphaSum,
+                                  double priorAlpha, double* expTheta, double* alphaOut) {
+    size_t i = static_cast<size_t>(blockIdx.x) * blockDim.x + threadIdx.x;
+    if (i >= numTxps) { return; }
+    double invNorm = exp(-digamma(*alphaSum));
+    expTheta[i] = (alphaIn[i] > minWeight) ? expDigamma(alphaIn[i]) * invNorm : 0.0;
+    alphaOut[i] = priorAlpha;
+}
+
+/**
+ * Record the largest relative change of each (unconverged) replicate in
+ * relDiff (as the bits of a non-negative double, which order as the
+ * doubles do), move alphaOut to alphaIn and zero alphaOut.
+ */
+__global__ void swapAndCheckKernel(size_t numTxps, size_t R, double* alphaIn, double* alphaOut,
+                                   double alphaCheckCutoff, unsigned long long* relDiff,
+                                   const uint8_t* converged) {
+    size_t j = static_cast<size_t>(blockIdx.x) * blockDim.x + threadIdx.x;
+    if (j >= numTxps * R) { return; }
+    size_t r = j % R;
+    if (converged and converged[r]) {
+        alphaOut[j] = 0.0;
+        return;
+    }
+    double oldAlpha = alphaIn[j];
+    double newAlpha = alphaOut[j];
+    if (newAlpha > alphaCheckCutoff) {
+        double d = fabs(oldAlpha - newAlpha) / newAlpha;
+        atomicMax(&relDiff[r], static_cast<unsigned long long>(__double_as_longlong(d)));
+    }
+    alphaIn[j] = newAlpha;
+    alphaOut[j] = 0.0;
+}
+
+}
+
+struct EMDevice::Buffers {
+    ~Buffers() {
+        for (void* p : {static_cast<void*>(offsets), static_cast<void*>(labels), static_cast<void*>(weights),
+                        static_cast<void*>(counts), static_cast<void*>(batchCounts), static_cast<void*>(alphaIn),
+                        static_cast<void*>(alphaOut), static_cast<void*>(expTheta), static_cast<void*>(alphaSum),
+                        static_cast<void*>(relDiff), static_cast<void*>(converged)}) {
+            if (p) { cudaFree(p); }
+        }
+    }
+
+    // The classes copied to the device, and the positions of their entries in the arena
+    std::vector<uint32_t> classIDs;
+    size_t numClasses{0};
+    size_t numEntries{0};
+
+    uint64_t* offsets{nullptr};
+    uint32_t* labels{nullptr};
+    double* weights{nullptr};
+    double* counts{nullptr};
+    double* batchCounts{nullptr};
+    size_t batchCapacity{0};
+    double* alphaIn{nullptr};
+    double* alphaOut{nullptr};
+    size_t alphaCapacity{0};
+    double* expTheta{nullptr};
+    double* alphaSum{nullptr};
+    unsigned long long* relDiff{nullptr};
+    uint8_t* converged{nullptr};
+    size_t replicateCapacity{0};
+
+    // Room for R interleaved abundance vectors (and R convergence tests)
+    void reserveReplicates(size_t numTxps, size_t R) {
+        if (alphaCapacity < numTxps * R) {
+            if (alphaIn) { cudaFree(alphaIn); }
+            if (alphaOut) { cudaFree(alphaOut); }
+            alphaIn = alphaOut = nullptr;
+            alphaIn = deviceAlloc<double>(numTxps * R, "allocating the abundances");
+            alphaOut = deviceAlloc<double>(numTxps * R, "allocating the abundances");
+            alphaCapacity = numTxps * R;
+        }
+        if (replicateCapacity < R) {
+            if (relDiff) { cudaFree(relDiff); }
+            if (converged) { cudaFree(converged); }
+            relDiff = nullptr;
+            converged = nullptr;
+            relDiff = deviceAlloc<unsigned long long>(R, "allocating the convergence tests");
+            converged = deviceAlloc<uint8_t>(R, "allocating the convergence tests");
+            replicateCapacity = R;
+        }
+    }
+};
+
+bool EMDevice::available(std::string& reason) {
+    int numDevices{0};
+    cudaError_t err = cudaGetDeviceCount(&numDevices);
+    if (err != cudaSuccess) {
+        reason = cudaGetErrorString(err);
+        return false;
+    }
+    if (numDevices == 0) {
+        reason = "no CUDA device was found";
+        return false;
+    }
+    return true;
+}
+
+EMDevice::EMDevice(const EquivalenceClassArena& arena, size_t numTxps, bool onlyValid) :
+    buffers_(new Buffers), numTxps_(numTxps) {
+    auto& b = *buffers_;
+    std::vector<uint64_t> offsets(1, 0);
+    std::vector<uint32_t> labels;
+    std::vector<double> counts;
+    for (size_t eqID = 0; eqID < arena.numClasses(); ++eqID) {
+        if (onlyValid and !arena.valid[eqID]) { continue; }
+        b.classIDs.push_back(eqID);
+        labels.insert(labels.end(), arena.labels.begin() + arena.offsets[eqID],
+                      arena.labels.begin() + arena.offsets[eqID + 1]);
+        offsets.push_back(labels.size());
+        counts.push_back(static_cast<double>(arena.counts[eqID]));
+    }
+    b.numClasses = b.classIDs.size();
+    b.numEntries = labels.size();
+
+    b.offsets = deviceAlloc<uint64_t>(offsets.size(), "allocating the class offsets");
+    b.labels = deviceAlloc<uint32_t>(labels.size(), "allocating the class labels");
+    b.weights = deviceAlloc<double>(labels.size(), "allocating the class weights");
+    b.counts = deviceAlloc<double>(counts.size(), "allocating the class counts");
+    b.expTheta = deviceAlloc<double>(numTxps, "allocating the VBEM scratch");
+    b.alphaSum = deviceAlloc<double>(1, "allocating the VBEM scratch");
+    toDevice(b.offsets, offsets, "copying the class offsets");
+    toDevice(b.labels, labels, "copying the class labels");
+    toDevice(b.counts, counts, "copying the class counts");
+    updateWeights(arena);
+}
+
+EMDevice::~EMDevice() {}
+
+void EMDevice::updateWeights(const EquivalenceClassArena& arena) {
+    auto& b = *buffers_;
+    std::vector<double> weights;
+    weights.reserve(b.numEntries);
+    for (auto eqID : b.classIDs) {
+        weights.insert(weights.end(), arena.combinedWeights.begin() + arena.offsets[eqID],
+                       arena.combinedWeights.begin() + arena.offsets[eqID + 1]);
+    }
+    toDevice(b.weights, weights, "copying the class weights");
+}
+
+size_t EMDevice::optimize(bool useVBEM, double priorAlpha,
+                          size_t itNum, size_t endIt, size_t minIter,
+                          double alphaCheckCutoff, double relDiffTolerance,
+                          std::vector<double>& alphas, double& maxRelDiff) {
+    auto& b = *buffers_;
+    b.reserveReplicates(numTxps_, 1);
+    toDevice(b.alphaIn, alphas, "copying the abundances");
+    check(cudaMemset(b.alphaOut, 0, numTxps_ * sizeof(double)), "clearing the abundances");
+
+    bool converged{false};
+    while (itNum < endIt and (itNum < minIter or !converged)) {
+        const double* theta = b.alphaIn;
+        if (useVBEM) {
+            check(cudaMemset(b.alphaSum, 0, sizeof(double)), "clearing the VBEM scratch");
+            sumKernel<<<numBlocks(numTxps_), blockSize>>>(numTxps_, b.alphaIn, b.alphaSum);
+            vbemPrepareKernel<<<numBlocks(numTxps_), blockSize>>>(numTxps_, b.alphaIn, b.alphaSum,
+                                                                  priorAlpha, b.expTheta, b.alphaOut);
+            theta = b.expTheta;
+        }
+        classRoundKernel<<<numBlocks(b.numClasses), blockSize>>>(b.numClasses, 1, b.offsets, b.labels,
+                                                                 b.weights, b.counts, theta, b.alphaOut,
+                                                                 nullptr);
+        check(cudaMemset(b.relDiff, 0, sizeof(unsigned long long)), "clearing the convergence test");
+        swapAndCheckKernel<<<numBlocks(numTxps_), blockSize>>>(numTxps_, 1, b.alphaIn, b.alphaOut,
+                                                               alphaCheckCutoff, b.relDiff, nullptr);
+        unsigned long long bits{0};
+        check(cudaMemcpy(&bits, b.relDiff, sizeof(bits), cudaMemcpyDeviceToHost), "running an EM round");
+        maxRelDiff = relDiffValue(bits);
+        converged = (maxRelDiff <= relDiffTolerance);
+        ++itNum;
+    }
+    check(cudaMemcpy(alphas.data(), b.alphaIn, numTxps_ * sizeof(double), cudaMemcpyDeviceToHost),
+          "copying the abundances");
+    return itNum;
+}
+
+void EMDevice::optimizeBatch(const uint64_t* counts, size_t R, size_t minIter, size_t maxIter,
+                             double alphaCheckCutoff, double relDiffTolerance,
+                             std::vector<double>& alphas) {
+    auto& b = *buffers_;
+    b.reserveReplicates(numTxps_, R);
+    if (b.batchCapacity < b.numClasses * R) {
+        if (b.batchCounts) { cudaFree(b.batchCounts); }
+        b.batchCounts = nullptr;
+        b.batchCounts = deviceAlloc<double>(b.numClasses * R, "allocating the replicate counts");
+        b.batchCapacity = b.numClasses * R;
+    }
+    std::vector<double> batchCounts(b.numClasses * R);
+    for (size_t c = 0; c < b.numClasses; ++c) {
+        const uint64_t* cc = counts + static_cast<size_t>(b.classIDs[c]) * R;
+        for (size_t r = 0; r < R; ++r) { batchCounts[c * R + r] = static_cast<double>(cc[r]); }
+    }
+    toDevice(b.batchCounts, batchCounts, "copying the replicate counts");
+    toDevice(b.alphaIn, alphas, "copying the abundances");
+    check(cudaMemset(b.alphaOut, 0, numTxps_ * R * sizeof(double)), "clearing the abundances");
+    check(cudaMemset(b.converged, 0, R), "clearing the convergence tests");
+
+    std::vector<uint8_t> converged(R, 0);
+    std::vector<unsigned long long> relDiff(R, 0);
+    size_t numConverged{0};
+    size_t itNum{0};
+    while (itNum < minIter or (itNum < maxIter and numConverged < R)) {
+        classRoundKernel<<<numBlocks(b.numClasses * R), blockSize>>>(b.numClasses, R, b.offsets, b.labels,
+                                                                     b.weights, b.batchCounts, b.alphaIn,
+                                                                     b.alphaOut, b.converged);
+        check(cudaMemset(b.relDiff, 0, R * sizeof(unsigned long long)), "clearing the convergence tests");
+        swapAndCheckKernel<<<numBlocks(numTxps_ * R), blockSize>>>(numTxps_, R, b.alphaIn, b.alphaOut,
+                                                                   alphaCheckCutoff, b.relDiff, b.converged);
+        ++itNum;
+        if (itNum < minIter) { continue; }
+        check(cudaMemcpy(relDiff.data(), b.relDiff, R * sizeof(unsigned long long), cudaMemcpyDeviceToHost),
+              "running an EM round");
+        bool changed{false};
+        for (size_t r = 0; r < R; ++r) {
+            if (!converged[r] and relDiffValue(relDiff[r]) <= relDiffTolerance) {
+                converged[r] = 1;
+                ++numConverged;
+                changed = true;
+            }
+        }
+        if (changed) { toDevice(b.converged, converged, "updating the convergence tests"); }
+    }
+    check(cudaMemcpy(alphas.data(), b.alphaIn, numTxps_ * R * sizeof(double), cudaMemcpyDeviceToHost),
+          "copying the abundances");
+}
+
+} // namespace gpu
+} // namespace salmon
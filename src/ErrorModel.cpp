@@ -57,7 +57,7 @@ double ErrorModel::logLikelihood(bam_seq_t* read, Transcript& ref,
     while (basesChecked < numInc) {
         size_t curReadBase = samToTwoBit[bam_seqi(qseq, readIdx)];
         size_t prevReadBase = (readIdx > 0) ? samToTwoBit[bam_seqi(qseq, readIdx-1)] : 0;
-        size_t refBase = samToTwoBit[ref.baseAt(uTranscriptIdx, readStrand)];
+        size_t refBase = ref.twoBitBaseAt(uTranscriptIdx, readStrand);
         size_t index = prevReadBase + refBase;
         int qval = qualStr[readIdx];
         double qual = (useQual) ? salmon::stringtools::phredToLogProb[qval] : salmon::math::LOG_1;
@@ -165,7 +165,7 @@ void ErrorModel::update(bam_seq_t* read, Transcript& ref, double p, double mass,
         while (basesChecked < numInc) {
             size_t curReadBase = samToTwoBit[bam_seqi(qseq, readIdx)];
             size_t prevReadBase = (readIdx > 0) ? samToTwoBit[bam_seqi(qseq, readIdx-1)] : 0;
-            size_t refBase = samToTwoBit[ref.baseAt(uTranscriptIdx, readStrand)];
+            size_t refBase = ref.twoBitBaseAt(uTranscriptIdx, readStrand);
             size_t index = prevReadBase + refBase;
             if (curReadBase != refBase) { ++numMismatch; }
             int qval = qualStr[readIdx];
@@ -1,85 +1,152 @@
 #include <unistd.h>
+#include <algorithm>
+#include <atomic>
 #include <cstdio>
+#include <cstring>
 #include <iostream>
-#include <unordered_map>
+#include <mutex>
+#include <thread>
 #include <random>
 
-#include "jellyfish/mer_dna.hpp"
 #include "jellyfish/stream_manager.hpp"
 #include "jellyfish/whole_sequence_parser.hpp"
 
+#include "CRAMReference.hpp"
 #include "FASTAParser.hpp"
 #include "Transcript.hpp"
 #include "SalmonStringUtils.hpp"
+#include "TranscriptNameIndex.hpp"
 
 FASTAParser::FASTAParser(const std::string& fname): fname_(fname) {}
 
-void FASTAParser::populateTargets(std::vector<Transcript>& refs) {
+namespace {
+    // splitmix64; each loading thread replaces the non-ACGT bases from its own
+    inline uint64_t nextRandom(uint64_t& state) {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    // The upper-case base of each character, or 0 if it isn't one of ACGT
+    struct BaseTable {
+        BaseTable() {
+            std::fill(upper, upper + 256, 0);
+            for (char c : {'A', 'C', 'G', 'T'}) {
+                upper[static_cast<uint8_t>(c)] = c;
+                upper[static_cast<uint8_t>(::tolower(c))] = c;
+            }
+        }
+        char upper[256];
+    };
+
+    /**
+     * Upper-case seq, replacing its non-ACGT bases with pseudo-random ones;
+     * returns the number replaced.  Every base is looked up in a table
+     * (without branching), and the (rare) replacements are only made if
+     * the sequence had any.
+     */
+    uint64_t replaceNonACGT(std::string& seq, uint64_t& rngState) {
+        static const BaseTable table;
+        constexpr char bases[] = {'A', 'C', 'G', 'T'};
+        size_t len = seq.length();
+        char* s = &seq[0];
+        uint8_t missing{0};
+        for (size_t b = 0; b < len; ++b) {
+            char u = table.upper[static_cast<uint8_t>(s[b])];
+            missing |= (u == 0);
+            s[b] = u;
+        }
+        if (!missing) { return 0; }
+        uint64_t numReplaced{0};
+        for (size_t b = 0; b < len; ++b) {
+            if (s[b] == 0) {
+                s[b] = bases[nextRandom(rngState) & 0x3];
+                ++numReplaced;
+            }
+        }
+        return numReplaced;
+    }
+}
+
+void FASTAParser::populateTargets(std::vector<Transcript>& refs,
+                                  PackedSequenceStore& packedStore,
+                                  bool keepSequences,
+                                  uint32_t numThreads,
+                                  CRAMReference* cramRef) {
     using stream_manager = jellyfish::stream_manager<std::vector<std::string>::const_iterator>;
     using single_parser = jellyfish::whole_sequence_parser<stream_manager>;
 
-    using std::string;
-    using std::unordered_map;
-
-    unordered_map<string, size_t> nameToID;
-    for (auto& ref : refs) {
-	nameToID[ref.RefName] = ref.id;
-    }
+    // The name -> id lookup of the transcripts (of the BAM header)
+    auto nameToID = TranscriptNameIndex::fromTranscripts(refs);
 
+    numThreads = std::max(numThreads, uint32_t(1));
     std::vector<std::string> readFiles{fname_};
     size_t maxReadGroup{1000}; // Number of files to read simultaneously
     size_t concurrentFile{1}; // Number of reads in each "job"
     stream_manager streams(readFiles.cbegin(), readFiles.cend(), concurrentFile);
-    single_parser parser(4, maxReadGroup, concurrentFile, streams);
+    single_parser parser(4 * numThreads, maxReadGroup, concurrentFile, streams);
 
-    constexpr char bases[] = {'A', 'C', 'G', 'T'};
-    // Create a random uniform distribution
+    // The records of each job are processed by one of numThreads threads;
+    // only the appends to the (shared) packed store are serialized
     std::random_device rd;
-    std::default_random_engine eng(rd());
-    std::uniform_int_distribution<> dis(0, 3);
-    uint64_t numNucleotidesReplaced{0};
-
-    while(true) {
-        typename single_parser::job j(parser); // Get a job from the parser: a bunch of read (at most max_read_group)
-        if(j.is_empty()) break;           // If got nothing, quit
-
-        for(size_t i = 0; i < j->nb_filled; ++i) { // For all the read we got
-            std::string& header = j->data[i].header;
-            std::string name = header.substr(0, header.find(' '));
-
-            auto it = nameToID.find(name);
-            if (it == nameToID.end()) {
-                std::cerr << "WARNING: Transcript " << name << " appears in the reference but did not appear in the BAM\n";
-            } else {
-
-	      std::string& seq = j->data[i].seq;
-              size_t readLen = seq.length();
-
-	      refs[it->second].setSAMSequenceOwned(salmon::stringtools::encodeSequenceInSAM(seq.c_str(), readLen));
-
-	      // Replace non-ACGT bases
-	      for (size_t b = 0; b < readLen; ++b) {
-		seq[b] = ::toupper(seq[b]);
-		int c = jellyfish::mer_dna::code(seq[b]);
-		// Replace non-ACGT bases with pseudo-random bases
-		if (jellyfish::mer_dna::not_dna(c)) {
-		  char rbase = bases[dis(eng)];
-		  c = jellyfish::mer_dna::code(rbase);
-		  seq[b] = rbase;
-		  ++numNucleotidesReplaced;
-		}
-	      }
-
-	      // allocate space for the new copy
-	      char* seqCopy = new char[seq.length()+1];
-	      std::strcpy(seqCopy, seq.c_str());
-	      refs[it->second].setSequenceOwned(seqCopy);
-	      // seqCopy will only be freed when the transcript is destructed!
+    std::mutex storeMutex;
+    std::atomic<uint64_t> numNucleotidesReplaced{0};
+
+    auto loadTargets = [&](uint64_t rngState) -> void {
+        uint64_t numReplaced{0};
+        while(true) {
+            typename single_parser::job j(parser); // Get a job from the parser: a bunch of read (at most max_read_group)
+            if(j.is_empty()) break;           // If got nothing, quit
+
+            for(size_t i = 0; i < j->nb_filled; ++i) { // For all the read we got
+                std::string& header = j->data[i].header;
+                size_t nameLen = std::min(header.find(' '), header.size());
+
+                auto id = nameToID.find(header.data(), nameLen);
+                if (id == TranscriptNameIndex::INVALID) {
+                    std::lock_guard<std::mutex> lock(storeMutex);
+                    std::cerr << "WARNING: Transcript " << header.substr(0, nameLen)
+                              << " appears in the reference but did not appear in the BAM\n";
+                    continue;
+                }
+
+                std::string& seq = j->data[i].seq;
+                size_t readLen = seq.length();
+                auto& txp = refs[id];
+                if (cramRef) { cramRef->add(id, seq); }
+
+                // The models read the reference from the shared 2-bit store, in
+                // which (as in the SAM encoding) non-ACGT bases are read as A.
+                {
+                    std::lock_guard<std::mutex> lock(storeMutex);
+                    uint64_t offset = packedStore.addSequence(seq.c_str(), readLen);
+                    txp.setPackedSequence(&packedStore, offset);
+                }
+                if (!keepSequences) { continue; }
+
+                // Replace non-ACGT bases with pseudo-random bases
+                numReplaced += replaceNonACGT(seq, rngState);
+
+                // allocate space for the new copy
+                char* seqCopy = new char[readLen + 1];
+                std::memcpy(seqCopy, seq.c_str(), readLen + 1);
+                txp.setSequenceOwned(seqCopy);
+                // seqCopy will only be freed when the transcript is destructed!
             }
         }
+        numNucleotidesReplaced += numReplaced;
+    };
+
+    std::vector<std::thread> loaders;
+    for (uint32_t t = 0; t < numThreads; ++t) {
+        uint64_t seed = (static_cast<uint64_t>(rd()) << 32) ^ rd();
+        loaders.emplace_back(loadTargets, seed);
     }
+    for (auto& t : loaders) { t.join(); }
 
-    std::cerr << "replaced " << numNucleotidesReplaced << " non-ACGT nucleotides with random nucleotides\n";
+    if (keepSequences) {
+        std::cerr << "replaced " << numNucleotidesReplaced << " non-ACGT nucleotides with random nucleotides\n";
+    }
 
 }
-
@@ -9,6 +9,7 @@
 #include "FragmentLengthDistribution.hpp"
 #include "SalmonMath.hpp"
 #include <numeric>
+#include <algorithm>
 #include <cassert>
 #include <boost/assign.hpp>
 #include <iostream>
@@ -18,17 +19,23 @@
 
 using namespace std;
 
+// The linear mass, relative to exp(logScale), of a (logged) mass
+static inline double linearMass(double logMass, double logScale) {
+  return (std::abs(logMass) == salmon::math::LOG_0) ? 0.0 : exp(logMass - logScale);
+}
+
 FragmentLengthDistribution::FragmentLengthDistribution(double alpha, size_t max_val,
                                        size_t prior_mu, size_t prior_sigma,
                                        size_t kernel_n, double kernel_p,
                                        size_t bin_size)
     : hist_(max_val/bin_size+1),
-      cachedCMF_(hist_.size()),
-      haveCachedCMF_(false),
+      tree_(hist_.size()+1),
+      logScale_(log(alpha)),
       totMass_(salmon::math::LOG_0),
       sum_(salmon::math::LOG_0),
       min_(max_val/bin_size),
-      binSize_(bin_size) {
+      binSize_(bin_size),
+      version_(0) {
 
     using salmon::math::logAdd;
   max_val = max_val/bin_size;
@@ -60,6 +67,15 @@ FragmentLengthDistribution::FragmentLengthDistribution(double alpha, size_t max_
       totMass_ = tot;
   }
 
+  // Build the tree over the prior in O(n): each node passes its mass on
+  // to its parent
+  for (auto& t : tree_) { t = 0.0; }
+  for (size_t j = 1; j < tree_.size(); ++j) {
+    tree_[j] = tree_[j] + linearMass(hist_[j-1], logScale_);
+    size_t parent = j + (j & (~j + 1));
+    if (parent < tree_.size()) { tree_[parent] = tree_[parent] + tree_[j]; }
+  }
+
   // Define kernel
   boost::math::binomial_distribution<double> binom(kernel_n, kernel_p);
   kernel_ = vector<double>(kernel_n + 1);
@@ -106,6 +122,7 @@ void FragmentLengthDistribution::addVal(size_t len, double mass) {
           newVal = logAdd(oldVal, kMass);
           retVal = hist_[offset].compare_and_swap(newVal, oldVal);
       } while (retVal != oldVal);
+      treeAdd_(offset, linearMass(kMass, logScale_));
 
       retVal = sum_;
       do {
@@ -124,6 +141,108 @@ void FragmentLengthDistribution::addVal(size_t len, double mass) {
     }
     offset++;
   }
+  version_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void FragmentLengthDistribution::addVals(const std::vector<size_t>& lens,
+                                         const std::vector<uint32_t>& counts,
+                                         double mass,
+                                         std::vector<double>& binMass) {
+    using salmon::math::logAdd;
+    using salmon::math::LOG_0;
+
+  binMass.assign(hist_.size(), LOG_0);
+  size_t minOffset = hist_.size();
+  size_t maxOffset = 0;
+
+  // Spread the mass of each observed length over the kernel
+  for (auto l : lens) {
+    double lenMass = mass + log(static_cast<double>(counts[l]));
+    size_t len = l / binSize_;
+
+    if (len > maxVal()) {
+        len = maxVal();
+    }
+    if (len < min_) {
+      min_ = len;
+    }
+
+    size_t offset = len - kernel_.size()/2;
+
+    for (size_t i = 0; i < kernel_.size(); i++) {
+      if (offset > 0 && offset < hist_.size()) {
+        binMass[offset] = logAdd(binMass[offset], lenMass + kernel_[i]);
+        minOffset = std::min(minOffset, offset);
+        maxOffset = std::max(maxOffset, offset);
+      }
+      offset++;
+    }
+  }
+
+  // Add the accumulated mass to the shared histogram
+  double sumMass{LOG_0};
+  double totMass{LOG_0};
+  for (size_t offset = minOffset; offset <= maxOffset; ++offset) {
+    double kMass = binMass[offset];
+    if (kMass == LOG_0) { continue; }
+    double oldVal = hist_[offset];
+    double retVal = oldVal;
+    double newVal = 0.0;
+    do {
+        oldVal = retVal;
+        newVal = logAdd(oldVal, kMass);
+        retVal = hist_[offset].compare_and_swap(newVal, oldVal);
+    } while (retVal != oldVal);
+    treeAdd_(offset, linearMass(kMass, logScale_));
+
+    sumMass = logAdd(sumMass, log(static_cast<double>(offset))+kMass);
+    totMass = logAdd(totMass, kMass);
+  }
+  if (totMass == LOG_0) { return; }
+  version_.fetch_add(1, std::memory_order_relaxed);
+
+  double oldVal{0.0};
+  double newVal{0.0};
+  double retVal = sum_;
+  do {
+      oldVal = retVal;
+      newVal = logAdd(oldVal, sumMass);
+      retVal = sum_.compare_and_swap(newVal, oldVal);
+  } while (retVal != oldVal);
+
+  retVal = totMass_;
+  do {
+      oldVal = retVal;
+      newVal = logAdd(oldVal, totMass);
+      retVal = totMass_.compare_and_swap(newVal, oldVal);
+  } while (retVal != oldVal);
+}
+
+std::vector<double> FragmentLengthDistribution::logMasses() const {
+  std::vector<double> masses(hist_.size());
+  for (size_t i = 0; i < hist_.size(); ++i) { masses[i] = hist_[i]; }
+  return masses;
+}
+
+void FragmentLengthDistribution::addLogMasses(const std::vector<double>& logMasses,
+                                              size_t minBin) {
+  using salmon::math::logAdd;
+  using salmon::math::LOG_0;
+
+  size_t n = std::min(logMasses.size(), hist_.size());
+  double sumMass{LOG_0};
+  double totMass{LOG_0};
+  for (size_t i = 0; i < n; ++i) {
+    if (logMasses[i] == LOG_0) { continue; }
+    hist_[i] = logAdd(hist_[i], logMasses[i]);
+    treeAdd_(i, linearMass(logMasses[i], logScale_));
+    sumMass = logAdd(sumMass, log(static_cast<double>(i)) + logMasses[i]);
+    totMass = logAdd(totMass, logMasses[i]);
+  }
+  sum_ = logAdd(sum_, sumMass);
+  totMass_ = logAdd(totMass_, totMass);
+  if (minBin < min_) { min_ = minBin; }
+  version_.fetch_add(1, std::memory_order_relaxed);
 }
 
 /**
@@ -155,40 +274,47 @@ void FragmentLengthDistribution::dumpPMF(
 }
 
 
-double FragmentLengthDistribution::cmf(size_t len) const {
-    if(haveCachedCMF_) {
-        return cachedCMF_[len];
-    } else {
-        double cum = salmon::math::LOG_0;
-        len /= binSize_;
-        if (len > maxVal()) {
-            len = maxVal();
-        }
-
-        for (size_t i = 0; i <= len; ++i) {
-            cum = salmon::math::logAdd(cum, hist_[i]);
-        }
-        return cum - totMass_;
+void FragmentLengthDistribution::treeAdd_(size_t i, double mass) {
+    for (size_t j = i + 1; j < tree_.size(); j += (j & (~j + 1))) {
+        double oldVal = tree_[j];
+        double retVal = oldVal;
+        do {
+            oldVal = retVal;
+            retVal = tree_[j].compare_and_swap(oldVal + mass, oldVal);
+        } while (retVal != oldVal);
     }
 }
 
-void FragmentLengthDistribution::cacheCMF() {
-    std::lock_guard<std::mutex> lg(fldMut_);
-    if (!haveCachedCMF_) {
-        cachedCMF_ = cmf();
-        haveCachedCMF_ = true;
+double FragmentLengthDistribution::treePrefix_(size_t i) const {
+    double cum{0.0};
+    for (size_t j = i + 1; j > 0; j -= (j & (~j + 1))) { cum += tree_[j]; }
+    return cum;
+}
+
+double FragmentLengthDistribution::cmf(size_t len) const {
+    len /= binSize_;
+    size_t last = hist_.size() - 1;
+    if (len > last) {
+        len = last;
     }
+    // Both sums are read from the tree, so that the cmf is at most 1 even
+    // while it's updated
+    double cum = treePrefix_(len);
+    double tot = treePrefix_(last);
+    return (cum > 0.0) ? log(cum / tot) : salmon::math::LOG_0;
 }
 
 vector<double> FragmentLengthDistribution::cmf() const {
-  double cum = salmon::math::LOG_0;
+  // The cumulative sums of all of the bins, in linear space
   vector<double> cdf(hist_.size());
+  double cum{0.0};
   for (size_t i = 0; i < hist_.size(); ++i) {
-    cum = salmon::math::logAdd(cum, hist_[i]);
-    cdf[i] = cum - totMass_;
+    cum += linearMass(hist_[i], logScale_);
+    cdf[i] = cum;
+  }
+  for (auto& c : cdf) {
+    c = (c > 0.0) ? log(c / cum) : salmon::math::LOG_0;
   }
-  //assert(approxEq(cum, totMass_));
-
   return cdf;
 }
 
@@ -93,13 +93,52 @@ void FragmentStartPositionDistribution::addVal(
     --performingUpdate_;
 }
 
+/**
+ * The (non-logged) CDF at hitPos, computed from the linear-space tables
+ * in the same way as evalCDF() computes it from the logged ones.
+ */
+static inline double linearCDF(const std::vector<double>& cmf,
+                               const std::vector<double>& pmf,
+                               size_t numBins, int32_t hitPos, uint32_t txpLen) {
+    int i = static_cast<int>((static_cast<double>(hitPos) * numBins) / txpLen);
+    double val = hitPos * (1.0 / txpLen) * numBins;
+    double frac = val - i;
+    return (frac < 1e-7) ? cmf[i] : cmf[i] + frac * pmf[i+1];
+}
+
+static inline double logOfLinear(double x) {
+    return (x > 0.0) ? std::log(x) : salmon::math::LOG_0;
+}
+
 double FragmentStartPositionDistribution::evalCDF(int32_t hitPos, uint32_t txpLen) {
+    if (isUpdated_) {
+        return logOfLinear(linearCDF(cmfLinear_, pmfLinear_, numBins_, hitPos, txpLen));
+    }
     int i = static_cast<int>((static_cast<double>(hitPos) * numBins_) / txpLen);
     double val = hitPos * (1.0 / txpLen) * numBins_;
     return (val - i < 1e-7) ? cmf_[i].load() :
             salmon::math::logAdd(cmf_[i], std::log(val - i) + pmf_[i+1]);
 }
 
+void FragmentStartPositionDistribution::evalLinearCDFs(size_t n, const int32_t* hitPos,
+                                                       const uint32_t* txpLens, double* cdfs) {
+    if (!isUpdated_) {
+        for (size_t j = 0; j < n; ++j) {
+            double c = evalCDF(hitPos[j], txpLens[j]);
+            cdfs[j] = (c == salmon::math::LOG_0) ? 0.0 : std::exp(c);
+        }
+        return;
+    }
+    const double* cmf = cmfLinear_.data();
+    const double* pmf = pmfLinear_.data();
+    double numBins = static_cast<double>(numBins_);
+    for (size_t j = 0; j < n; ++j) {
+        int i = static_cast<int>((static_cast<double>(hitPos[j]) * numBins) / txpLens[j]);
+        double frac = hitPos[j] * (1.0 / txpLens[j]) * numBins - i;
+        cdfs[j] = cmf[i] + ((frac < 1e-7) ? 0.0 : frac * pmf[i+1]);
+    }
+}
+
 void FragmentStartPositionDistribution::update() {
     if (isUpdated_) { return; }
     // TODO: Is this (thread)-safe yet?
@@ -108,9 +147,13 @@ void FragmentStartPositionDistribution::update() {
     // Make sure an update isn't being performed
     while (performingUpdate_) {}
     if (!isUpdated_) {
+        pmfLinear_.assign(numBins_ + 2, 0.0);
+        cmfLinear_.assign(numBins_ + 2, 0.0);
         for (uint32_t i = 1; i <= numBins_; i++) {
             pmf_[i] = pmf_[i] - totMass_;
             cmf_[i] = salmon::math::logAdd(cmf_[i - 1], pmf_[i]);
+            pmfLinear_[i] = std::exp(pmf_[i]);
+            cmfLinear_[i] = std::exp(cmf_[i]);
         }
         isUpdated_ = true;
     }
@@ -133,19 +176,18 @@ double FragmentStartPositionDistribution::operator()(
         return -logEffLen; 
     }
 
-    double a = hitPos * (1.0 / txpLen);
-
     double effLen = std::exp(logEffLen);
     if (effLen >= txpLen) {
 	    effLen = txpLen - 1;
     }
 
-    double denom = evalCDF(static_cast<int32_t>(effLen), txpLen); // cmf_[numBins_];
-    double cdfNext = evalCDF(hitPos + 1, txpLen);
-    double cdfCurr = evalCDF(hitPos, txpLen);
+    double denom = logOfLinear(linearCDF(cmfLinear_, pmfLinear_, numBins_,
+                                         static_cast<int32_t>(effLen), txpLen));
+    double massNext = linearCDF(cmfLinear_, pmfLinear_, numBins_, hitPos + 1, txpLen);
+    double massCurr = linearCDF(cmfLinear_, pmfLinear_, numBins_, hitPos, txpLen);
 
     return ((denom >= salmon::math::LOG_EPSILON) ?
-            salmon::math::logSub(cdfNext, cdfCurr) - denom :
+            logOfLinear(massNext - massCurr) - denom :
             salmon::math::LOG_0);
 }
 
@@ -176,12 +218,15 @@ bool FragmentStartPositionDistribution::logNumDenomMass(
     double effLen = std::exp(logEffLen);
     if (effLen >= txpLen) { effLen = txpLen - 1; }
 
-    double denom = evalCDF(static_cast<int32_t>(effLen), txpLen); 
-    double cdfNext = evalCDF(hitPos + 1, txpLen);
-    double cdfCurr = evalCDF(hitPos, txpLen);
+    // Evaluated in linear space; this needs two logs rather than the
+    // three logAdds and a logSub of the logged CDF
+    double denom = logOfLinear(linearCDF(cmfLinear_, pmfLinear_, numBins_,
+                                         static_cast<int32_t>(effLen), txpLen));
 
     if (denom >= salmon::math::LOG_EPSILON) {
-	logNum = salmon::math::logSub(cdfNext, cdfCurr);
+	double massNext = linearCDF(cmfLinear_, pmfLinear_, numBins_, hitPos + 1, txpLen);
+	double massCurr = linearCDF(cmfLinear_, pmfLinear_, numBins_, hitPos, txpLen);
+	logNum = logOfLinear(massNext - massCurr);
 	logDenom = denom;
 	return true;
     } else {
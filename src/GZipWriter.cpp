@@ -1,20 +1,32 @@
 #include <ctime>
 #include <fstream>
+#include <functional>
 
 #include "cereal/archives/json.hpp"
 
+#include "BinaryEquivalenceClasses.hpp"
+#include "BinaryQuant.hpp"
+#include "DuplicateTranscripts.hpp"
+#include "EqLabelDictionary.hpp"
 #include "GZipWriter.hpp"
 #include "SalmonOpts.hpp"
 #include "ReadExperiment.hpp"
 #include "AlignmentLibrary.hpp"
 #include "ReadPair.hpp"
 #include "UnpairedRead.hpp"
+#include "RandomStreams.hpp"
+#include "MappingConvergenceMonitor.hpp"
+#include "ParallelTextWriter.hpp"
+#include "TraceEvents.hpp"
 
 GZipWriter::GZipWriter(const boost::filesystem::path path, std::shared_ptr<spdlog::logger> logger) :
   path_(path), logger_(logger) {
 }
 
 GZipWriter::~GZipWriter() {
+  if (bsWriter_) {
+    bsWriter_->finish();
+  }
   if (bsStream_) {
     bsStream_->reset();
   }
@@ -61,38 +73,80 @@ bool GZipWriter::writeEquivCounts(
 
   bfs::path auxDir = path_ / opts.auxDir;
   bool auxSuccess = boost::filesystem::create_directories(auxDir);
-  bfs::path eqFilePath = auxDir / "eq_classes.txt";
-
-  std::ofstream equivFile(eqFilePath.string());
 
   auto& transcripts = experiment.transcripts();
   std::vector<std::pair<const TranscriptGroup, TGValue>>& eqVec =
         experiment.equivalenceClassBuilder().eqVec();
 
-  // Number of transcripts
-  equivFile << transcripts.size() << '\n';
-
-  // Number of equivalence classes
-  equivFile << eqVec.size() << '\n';
+  bool useLabelIds = !opts.eqLabelDictPath.empty();
+  if (opts.dumpEqBinary or useLabelIds) {
+    bfs::path eqFilePath = auxDir / (useLabelIds ? "eq_class_ids.bin" : "eq_classes.bin");
+    std::vector<std::string> names;
+    names.reserve(transcripts.size());
+    for (auto& t : transcripts) { names.push_back(t.RefName); }
+
+    std::vector<uint64_t> labelIds;
+    if (useLabelIds) {
+      EqLabelDictionary dict;
+      std::vector<const TranscriptLabel*> labels;
+      labels.reserve(eqVec.size());
+      for (auto& eq : eqVec) { labels.push_back(&eq.first.txps); }
+      std::string err;
+      if (!dict.open(opts.eqLabelDictPath, transcripts.size(), err) or
+          !dict.intern(labels, labelIds, err)) {
+        logger_->error("could not look up the equivalence class labels: {}", err);
+        return false;
+      }
+      logger_->info("{} of the {} equivalence class labels were added to {} (which now has {})",
+                    dict.numAdded(), labels.size(), opts.eqLabelDictPath, dict.size());
+    }
 
-  for (auto& t : transcripts) {
-    equivFile << t.RefName << '\n';
+    BinaryEqClassWriter writer(names, true, 1, useLabelIds);
+    // Once the builder is finished, the weights of the i-th class are in
+    // the i-th class of the arena
+    auto& eqArena = experiment.equivalenceClassBuilder().eqArena();
+    std::vector<double> uniform;
+    for (size_t i = 0; i < eqVec.size(); ++i) {
+      const TranscriptLabel& txps = eqVec[i].first.txps;
+      uint64_t count = eqVec[i].second.count;
+      bool inArena = i < eqArena.numClasses() and eqArena.classSize(i) == txps.size();
+      if (!inArena) { uniform.assign(txps.size(), 1.0 / txps.size()); }
+      auto weightIt = inArena ? eqArena.weights.begin() + eqArena.offsets[i] : uniform.begin();
+      if (useLabelIds) {
+        writer.addLabelId(labelIds[i], txps.size(), weightIt, count);
+      } else {
+        writer.add(txps, weightIt, count);
+      }
+    }
+    if (!writer.write(eqFilePath)) {
+      logger_->error("could not write the equivalence classes to {}", eqFilePath.string());
+      return false;
+    }
+    return true;
   }
 
-  for (auto& eq : eqVec) {
-    uint64_t count = eq.second.count;
-    // for each transcript in this class
-    const TranscriptGroup& tgroup = eq.first;
-    const std::vector<uint32_t>& txps = tgroup.txps;
-    // group size
-    equivFile << txps.size() << '\t';
-    // each group member
-    for (auto tid : txps) { equivFile << tid << '\t'; }
-    // count for this class
-    equivFile << count << '\n';
+  bfs::path eqFilePath = auxDir / "eq_classes.txt";
+  ParallelTextWriter equivFile(eqFilePath);
+
+  // Number of transcripts and of equivalence classes, and the transcript names
+  fmt::MemoryWriter header;
+  header << transcripts.size() << '\n' << eqVec.size() << '\n';
+  for (auto& t : transcripts) { header << t.RefName << '\n'; }
+  equivFile.write(header.str());
+
+  // Each class is the group size, each group member and the count of the class
+  equivFile.writeRows(eqVec.size(), [&eqVec](size_t i, fmt::MemoryWriter& w) -> void {
+    const TranscriptLabel& txps = eqVec[i].first.txps;
+    uint64_t count = eqVec[i].second.count;
+    w << txps.size() << '\t';
+    for (auto tid : txps) { w << tid << '\t'; }
+    w << count << '\n';
+  });
+
+  if (!equivFile.close()) {
+    logger_->error("could not write the equivalence classes to {}", eqFilePath.string());
+    return false;
   }
-
-  equivFile.close();
   return true;
 }
 
@@ -101,7 +155,8 @@ bool GZipWriter::writeEquivCounts(
  *   -- Names of the target id's if bootstrapping / gibbs is performed
  *   -- The fragment length distribution
  *   -- The expected and observed bias values
- *   -- A json file with information about the run
+ *   -- A json file with information about the run (see writeMetaInfo),
+ *      unless the bootstraps are adaptive
  */
 template <typename ExpT>
 bool GZipWriter::writeMeta(
@@ -120,6 +175,27 @@ bool GZipWriter::writeMeta(
   if (numSamples > 0) {
       bsPath_ = auxDir / "bootstrap";
       bool bsSuccess = boost::filesystem::create_directories(bsPath_);
+      bsCompressionLevel_ = opts.bootstrapCompressionLevel;
+      if (opts.summarizeSamples) {
+          auto& transcripts = experiment.transcripts();
+          bsSummary_.reset(new SampleSummary(transcripts.size()));
+          bsNames_.clear();
+          for (auto& t : transcripts) { bsNames_.push_back(t.RefName); }
+      }
+      // The replicates can only be skipped if they're kept in another form
+      writeReplicates_ = !(opts.noSampleReplicates and
+                           (opts.summarizeSamples or opts.columnarBootstraps));
+      if (opts.columnarBootstraps) {
+          bsColumns_.reset(new ColumnarBootstrapWriter(bsPath_ / "bootstraps.cols",
+                                                       experiment.transcripts().size(),
+                                                       1024, bsCompressionLevel_));
+      }
+      if (writeReplicates_ and opts.numBootstrapWriters > 0) {
+          bsWriter_.reset(new ParallelBootstrapWriter(bsPath_ / "bootstraps.gz",
+                                                      opts.numBootstrapWriters,
+                                                      bsCompressionLevel_,
+                                                      logger_));
+      }
       {
 
           boost::iostreams::filtering_ostream nameOut;
@@ -146,7 +222,8 @@ bool GZipWriter::writeMeta(
   bfs::path fldPath = auxDir / "fld.gz";
   int32_t numFLDSamples{10000};
   auto fldSamples = salmon::utils::samplesFromLogPMF(
-                        experiment.fragmentLengthDistribution(), numFLDSamples);
+                        experiment.fragmentLengthDistribution(), numFLDSamples,
+                        salmon::utils::streamSeed(opts, salmon::utils::RandomStream::FLD_SAMPLES, 0));
   writeVectorToFile(fldPath, fldSamples);
 
   bfs::path normBiasPath = auxDir / "expected_bias.gz";
@@ -166,8 +243,29 @@ bool GZipWriter::writeMeta(
   std::vector<double> observedGC(gcCounts.size(), 0.0);
   std::copy(gcCounts.begin(), gcCounts.end(), observedGC.begin());
   writeVectorToFile(obsGCPath, observedGC);
-  
-  bfs::path info = auxDir / "meta_info.json";
+  numFLDSamples_ = fldSamples.size();
+
+  // The number of adaptive bootstraps is only known once they're drawn,
+  // so the caller writes the meta information then
+  if (opts.adaptiveBootstraps and numBootstraps > 0) { return true; }
+  return writeMetaInfo(opts, experiment, tstring);
+}
+
+/**
+ * Write aux/meta_info.json (see writeMeta).
+ */
+template <typename ExpT>
+bool GZipWriter::writeMetaInfo(
+    const SalmonOpts& opts,
+    const ExpT& experiment,
+    const std::string& tstring // the start time of the run
+    ) {
+
+  namespace bfs = boost::filesystem;
+
+  auto numBootstraps = opts.numBootstraps;
+  auto numSamples = (numBootstraps > 0) ? numBootstraps : opts.numGibbsSamples;
+  bfs::path info = path_ / opts.auxDir / "meta_info.json";
 
   {
       std::ofstream os(info.string());
@@ -184,20 +282,75 @@ bool GZipWriter::writeMeta(
       auto& transcripts = experiment.transcripts();
       oa(cereal::make_nvp("salmon_version", std::string(salmon::version)));
       oa(cereal::make_nvp("samp_type", sampType));
-      oa(cereal::make_nvp("frag_dist_length", fldSamples.size()));
+      oa(cereal::make_nvp("frag_dist_length", numFLDSamples_));
       oa(cereal::make_nvp("bias_correct", opts.biasCorrect));
-      oa(cereal::make_nvp("num_bias_bins", bcounts.size()));
+      oa(cereal::make_nvp("num_bias_bins", experiment.readBias().counts.size()));
 
       std::string mapTypeStr = opts.alnMode ? "alignment" : "mapping";
       oa(cereal::make_nvp("mapping_type", mapTypeStr));
 
       oa(cereal::make_nvp("num_targets", transcripts.size()));
       oa(cereal::make_nvp("num_bootstraps", numBootstraps));
+      if (opts.adaptiveBootstraps and numBootstraps > 0) {
+          oa(cereal::make_nvp("max_bootstraps", opts.maxBootstraps));
+      }
+      oa(cereal::make_nvp("wrote_replicates", writeReplicates_));
+      oa(cereal::make_nvp("wrote_replicate_summary", bool(bsSummary_)));
+      oa(cereal::make_nvp("wrote_columnar_replicates", bool(bsColumns_)));
       oa(cereal::make_nvp("num_processed", experiment.numObservedFragments()));
       oa(cereal::make_nvp("num_mapped", experiment.numMappedFragments()));
       oa(cereal::make_nvp("percent_mapped", experiment.effectiveMappingRate() * 100.0));
+      if (opts.convergenceMonitor and opts.convergenceMonitor->stopped()) {
+          auto& monitor = *opts.convergenceMonitor;
+          oa(cereal::make_nvp("mapping_stopped_early", true));
+          oa(cereal::make_nvp("mapping_converged", monitor.converged()));
+          oa(cereal::make_nvp("num_read_unmapped", monitor.numSkipped()));
+          oa(cereal::make_nvp("extrapolation_factor",
+                              monitor.extrapolationFactor(experiment.numObservedFragments())));
+      }
       oa(cereal::make_nvp("call", std::string("quant")));
       oa(cereal::make_nvp("start_time", tstring));
+
+      // Where the time of this run was spent
+      const auto& timings = experiment.stageTimings();
+      auto nsToSec = [](uint64_t ns) -> double { return ns * 1e-9; };
+      auto perSec = [](double n, double sec) -> double { return (sec > 0.0) ? (n / sec) : 0.0; };
+      double numProcessed = experiment.numObservedFragments();
+      double mappingSec = nsToSec(timings.mappingNs);
+      double assignmentSec = nsToSec(timings.assignmentNs);
+      oa(cereal::make_nvp("num_threads", opts.numThreads));
+      oa(cereal::make_nvp("time_processing_reads_sec", timings.processReadsSeconds));
+      oa(cereal::make_nvp("processed_per_sec", perSec(numProcessed, timings.processReadsSeconds)));
+      oa(cereal::make_nvp("num_mini_batches", timings.numMiniBatches.load()));
+      oa(cereal::make_nvp("thread_time_parser_wait_sec", nsToSec(timings.parseWaitNs)));
+      oa(cereal::make_nvp("parser_time_pool_wait_sec", nsToSec(timings.poolWaitNs)));
+      oa(cereal::make_nvp("thread_time_worker_wait_sec", nsToSec(timings.workerWaitNs)));
+      oa(cereal::make_nvp("parser_pool_exhausted_events", timings.poolExhaustedEvents.load()));
+      if (opts.readaheadBytes > 0) {
+          oa(cereal::make_nvp("parser_time_io_wait_sec", nsToSec(timings.ioWaitNs)));
+      }
+      if (timings.readHitCacheLookups > 0) {
+          oa(cereal::make_nvp("read_hit_cache_hit_rate",
+                              static_cast<double>(timings.readHitCacheHits) / timings.readHitCacheLookups));
+      }
+      if (timings.alnGroupQueueDepth.numSamples > 0) {
+          oa(cereal::make_nvp("aln_group_queue_depth_mean", timings.alnGroupQueueDepth.mean()));
+          oa(cereal::make_nvp("aln_group_queue_depth_max", timings.alnGroupQueueDepth.max.load()));
+          oa(cereal::make_nvp("aln_group_queue_frac_empty", timings.alnGroupQueueDepth.fracEmpty()));
+          oa(cereal::make_nvp("aln_group_pool_depth_mean", timings.alnGroupPoolDepth.mean()));
+          oa(cereal::make_nvp("aln_group_pool_frac_empty", timings.alnGroupPoolDepth.fracEmpty()));
+          oa(cereal::make_nvp("work_queue_depth_mean", timings.workQueueDepth.mean()));
+          oa(cereal::make_nvp("work_queue_frac_empty", timings.workQueueDepth.fracEmpty()));
+      }
+      oa(cereal::make_nvp("thread_time_mapping_sec", mappingSec));
+      oa(cereal::make_nvp("mapped_per_thread_sec", perSec(numProcessed, mappingSec)));
+      oa(cereal::make_nvp("thread_time_assignment_sec", assignmentSec));
+      oa(cereal::make_nvp("assigned_per_thread_sec", perSec(numProcessed, assignmentSec)));
+      oa(cereal::make_nvp("thread_time_add_group_sec", nsToSec(timings.addGroupNs)));
+      oa(cereal::make_nvp("time_optimize_sec", timings.optimizeSeconds));
+      oa(cereal::make_nvp("num_em_iterations", timings.numEMIterations));
+      oa(cereal::make_nvp("em_iterations_per_sec", perSec(timings.numEMIterations, timings.optimizeSeconds)));
+      oa(cereal::make_nvp("time_bias_correction_sec", timings.biasSeconds));
   }
   return true;
 }
@@ -205,7 +358,8 @@ bool GZipWriter::writeMeta(
 template <typename ExpT>
 bool GZipWriter::writeAbundances(
     const SalmonOpts& sopt,
-    ExpT& readExp) {
+    ExpT& readExp,
+    AsyncOutputWriter* async) {
 
   namespace bfs = boost::filesystem;
 
@@ -217,10 +371,6 @@ bool GZipWriter::writeAbundances(
   bool useScaledCounts = (!sopt.useQuasi and sopt.allowOrphans == false);
   bfs::path fname = path_ / "quant.sf";
 
-  std::unique_ptr<std::FILE, int (*)(std::FILE *)> output(std::fopen(fname.c_str(), "w"), std::fclose);
-
-  fmt::print(output.get(), "Name\tLength\tEffectiveLength\tTPM\tNumReads\n");
-
   double numMappedFrags = readExp.upperBoundHits();
 
   std::vector<Transcript>& transcripts_ = readExp.transcripts();
@@ -235,6 +385,18 @@ bool GZipWriter::writeAbundances(
       tfracDenom += (transcript.projectedCounts / numMappedFrags) / refLength;
   }
 
+  // The values of each row; the names and lengths are read from the
+  // transcripts, which are not modified once the abundances are known
+  struct Rows {
+      std::vector<double> effLengths;
+      std::vector<double> tpms;
+      std::vector<double> counts;
+  };
+  std::shared_ptr<Rows> rows = std::make_shared<Rows>();
+  rows->effLengths.reserve(transcripts_.size());
+  rows->tpms.reserve(transcripts_.size());
+  rows->counts.reserve(transcripts_.size());
+
   double million = 1000000.0;
   // Now posterior has the transcript fraction
   for (auto& transcript : transcripts_) {
@@ -243,15 +405,98 @@ bool GZipWriter::writeAbundances(
       double effLength = transcript.EffectiveLength;
       double tfrac = (npm / effLength) / tfracDenom;
       double tpm = tfrac * million;
-      fmt::print(output.get(), "{}\t{}\t{}\t{}\t{}\n",
-              transcript.RefName, transcript.RefLength, effLength,
-              tpm, count);
+      rows->effLengths.push_back(effLength);
+      rows->tpms.push_back(tpm);
+      rows->counts.push_back(count);
   }
-  return true;
+
+  // The transcripts collapsed into others at index build, which share their abundance
+  std::shared_ptr<DuplicateTranscripts> dups = std::make_shared<DuplicateTranscripts>();
+  if (sopt.expandDuplicates and sopt.useQuasi and dups->load(sopt.indexDirectory)) {
+      logger_->info("splitting the abundances of {} duplicate transcripts off those they duplicate",
+                    dups->numDuplicates());
+  }
+
+  bool binaryQuant = sopt.binaryQuant;
+  bfs::path binaryPath = path_ / "quant.bin";
+  auto logger = logger_;
+  auto write = [rows, dups, &transcripts_, fname, binaryQuant, binaryPath, logger]() -> bool {
+      ParallelTextWriter output(fname);
+      if (!output.good()) {
+          logger->error("could not open {} for writing", fname.string());
+          return false;
+      }
+      output.write("Name\tLength\tEffectiveLength\tTPM\tNumReads\n");
+
+      std::unique_ptr<BinaryQuantWriter> binaryOutput{nullptr};
+      if (binaryQuant) { binaryOutput.reset(new BinaryQuantWriter(transcripts_.size())); }
+
+      // The row of transcript i, followed by those of its duplicates (if any), which
+      // share its abundance
+      auto forEachRow = [&](size_t i, const std::function<void(const std::string&, uint32_t, double,
+                                                                double, double)>& row) -> void {
+          auto& transcript = transcripts_[i];
+          auto* copies = dups->empty() ? nullptr : dups->duplicatesOf(transcript.RefName);
+          if (copies == nullptr) {
+              row(transcript.RefName, transcript.RefLength, rows->effLengths[i], rows->tpms[i], rows->counts[i]);
+              return;
+          }
+          double share = 1.0 / (copies->size() + 1);
+          row(transcript.RefName, transcript.RefLength, rows->effLengths[i],
+              rows->tpms[i] * share, rows->counts[i] * share);
+          for (auto& name : *copies) {
+              row(name, transcript.RefLength, rows->effLengths[i], rows->tpms[i] * share, rows->counts[i] * share);
+          }
+      };
+      output.writeRows(transcripts_.size(), [&](size_t i, fmt::MemoryWriter& w) -> void {
+          forEachRow(i, [&w](const std::string& name, uint32_t length, double effLength,
+                             double tpm, double count) -> void {
+              w.write("{}\t{}\t{}\t{}\t{}\n", name, length, effLength, tpm, count);
+          });
+      });
+      if (!output.close()) {
+          logger->error("could not write {}", fname.string());
+          return false;
+      }
+
+      if (binaryOutput) {
+          for (size_t i = 0; i < transcripts_.size(); ++i) {
+              forEachRow(i, [&binaryOutput](const std::string& name, uint32_t length, double effLength,
+                                            double tpm, double count) -> void {
+                  binaryOutput->add(name, length, effLength, tpm, count);
+              });
+          }
+          if (!binaryOutput->write(binaryPath)) {
+              logger->error("could not write the binary abundances to {}", binaryPath.string());
+              return false;
+          }
+      }
+      return true;
+  };
+
+  if (async) {
+      async->submit("quant.sf", write);
+      return true;
+  }
+  return write();
 }
 
 template <typename T>
 bool GZipWriter::writeBootstrap(const std::vector<T>& abund) {
+        SALMON_TRACE_SCOPE("writeBootstrap");
+        if (bsSummary_) {
+            bsSummary_->add(abund);
+        }
+        if (bsColumns_ and !bsColumns_->add(abund)) {
+            logger_->error("could not add a replicate to the columnar bootstrap file");
+            return false;
+        }
+        if (!writeReplicates_) { return true; }
+        size_t elSize = sizeof(typename std::vector<T>::value_type);
+        if (bsWriter_) {
+            return bsWriter_->push(reinterpret_cast<const char*>(abund.data()),
+                                   elSize, abund.size());
+        }
 #if defined __APPLE__
             spin_lock::scoped_lock sl(writeMutex_);
 #else
@@ -259,7 +504,8 @@ bool GZipWriter::writeBootstrap(const std::vector<T>& abund) {
 #endif
 	    if (!bsStream_) {
 	      bsStream_.reset(new boost::iostreams::filtering_ostream);
-	      bsStream_->push(boost::iostreams::gzip_compressor(6));
+	      bsStream_->push(boost::iostreams::gzip_compressor(
+                      boost::iostreams::gzip_params(bsCompressionLevel_)));
 	      auto bsFilename = bsPath_ / "bootstraps.gz";
 	      bsStream_->push(
                   boost::iostreams::file_sink(bsFilename.string(),
@@ -268,14 +514,46 @@ bool GZipWriter::writeBootstrap(const std::vector<T>& abund) {
 
 	    boost::iostreams::filtering_ostream& ofile = *bsStream_;
 	    size_t num = abund.size();
-        size_t elSize = sizeof(typename std::vector<T>::value_type);
         ofile.write(reinterpret_cast<char*>(const_cast<T*>(abund.data())),
                     elSize * num);
+        if (!ofile.good()) {
+            logger_->error("could not write bootstrap {} to {}", numBootstrapsWritten_.load(),
+                           (bsPath_ / "bootstraps.gz").string());
+            return false;
+        }
         logger_->info("wrote {} bootstraps", numBootstrapsWritten_.load()+1);
         ++numBootstrapsWritten_;
         return true;
 }
 
+bool GZipWriter::finishBootstraps() {
+  if (bsWriter_ and !bsWriter_->finish()) {
+    logger_->error("could not write the replicates to {}", (bsPath_ / "bootstraps.gz").string());
+    return false;
+  }
+  if (bsSummary_) {
+    auto summaryPath = bsPath_ / "summary.tsv";
+    if (!bsSummary_->write(summaryPath, bsNames_)) {
+      logger_->error("could not write the summary of the replicates to {}", summaryPath.string());
+      return false;
+    }
+    logger_->info("wrote the summary of {} replicates to {}",
+                  bsSummary_->numSamples(), summaryPath.string());
+    bsSummary_.reset();
+  }
+  if (bsColumns_) {
+    auto columnsPath = bsPath_ / "bootstraps.cols";
+    if (!bsColumns_->write()) {
+      logger_->error("could not write the columnar replicates to {}", columnsPath.string());
+      return false;
+    }
+    logger_->info("wrote {} replicates (transcript-major) to {}",
+                  bsColumns_->numReplicates(), columnsPath.string());
+    bsColumns_.reset();
+  }
+  return true;
+}
+
 template
 bool GZipWriter::writeBootstrap<double>(const std::vector<double>& abund);
 
@@ -293,13 +571,16 @@ bool GZipWriter::writeEquivCounts<AlignmentLibrary<ReadPair>>(const SalmonOpts&
                                                  AlignmentLibrary<ReadPair>& readExp);
 template
 bool GZipWriter::writeAbundances<ReadExperiment>(const SalmonOpts& sopt,
-                                                 ReadExperiment& readExp);
+                                                 ReadExperiment& readExp,
+                                                 AsyncOutputWriter* async);
 template
 bool GZipWriter::writeAbundances<AlignmentLibrary<UnpairedRead>>(const SalmonOpts& sopt,
-                                                 AlignmentLibrary<UnpairedRead>& readExp);
+                                                 AlignmentLibrary<UnpairedRead>& readExp,
+                                                 AsyncOutputWriter* async);
 template
 bool GZipWriter::writeAbundances<AlignmentLibrary<ReadPair>>(const SalmonOpts& sopt,
-                                                 AlignmentLibrary<ReadPair>& readExp);
+                                                 AlignmentLibrary<ReadPair>& readExp,
+                                                 AsyncOutputWriter* async);
 
 template
 bool GZipWriter::writeMeta<ReadExperiment>(
@@ -307,15 +588,33 @@ bool GZipWriter::writeMeta<ReadExperiment>(
     const ReadExperiment& experiment,
     const std::string& tstring);
 
+template
+bool GZipWriter::writeMetaInfo<ReadExperiment>(
+    const SalmonOpts& opts,
+    const ReadExperiment& experiment,
+    const std::string& tstring);
+
 template
 bool GZipWriter::writeMeta<AlignmentLibrary<UnpairedRead>>(
     const SalmonOpts& opts,
     const AlignmentLibrary<UnpairedRead>& experiment,
     const std::string& tstring);
 
+template
+bool GZipWriter::writeMetaInfo<AlignmentLibrary<UnpairedRead>>(
+    const SalmonOpts& opts,
+    const AlignmentLibrary<UnpairedRead>& experiment,
+    const std::string& tstring);
+
 template
 bool GZipWriter::writeMeta<AlignmentLibrary<ReadPair>>(
     const SalmonOpts& opts,
     const AlignmentLibrary<ReadPair>& experiment,
     const std::string& tstring);
 
+template
+bool GZipWriter::writeMetaInfo<AlignmentLibrary<ReadPair>>(
+    const SalmonOpts& opts,
+    const AlignmentLibrary<ReadPair>& experiment,
+    const std::string& tstring);
+
@@ -50,7 +50,7 @@ int help(int argc, char* argv[]) {
     auto helpmsg = R"(
     ===============
 
-    Please invoke salmon with one of the following commands {index, quant, swim}.
+    Please invoke salmon with one of the following commands {index, index-warm, quant, cells, merge, infer, qc-pca, serve, swim}.
     For more information on the options for these particular methods, use the -h
     flag along with the method name.  For example:
 
@@ -82,6 +82,26 @@ int dualModeMessage() {
     to view the help for salmon's read-based mode, use the command
 
     salmon quant --help-reads
+
+    To quantify many samples against a single load of the index, list them
+    in a batch file (one "<output directory><TAB><quant arguments>" per line)
+    and use the command
+
+    salmon quant --batch <file> -i <index> [-p <threads>] [--batchJobs <n>]
+
+    To map the shards (e.g. lanes) of a sample separately, and quantify them
+    together, map each with salmon quant --mapOnly, combine their states with
+
+    salmon merge -o <merged> <shard output> [<shard output> ...]
+
+    and quantify the combined state with
+
+    salmon infer --state <merged> -i <index> -o <output>
+
+    For rough estimates (e.g. pre-screening), the k-mers of the reads can be
+    counted, rather than the reads mapped, with
+
+    salmon quant --kmerCount -i <index> -l <libtype> -r <reads> -o <output>
     )";
     std::cerr << "    Salmon v" << salmon::version << helpmsg << "\n";
     return 1;
@@ -110,6 +130,14 @@ int salmonSwim(int argc, char* argv[]) {
 int salmonIndex(int argc, char* argv[]);
 int salmonQuantify(int argc, char* argv[]);
 int salmonAlignmentQuantify(int argc, char* argv[]);
+int salmonServe(int argc, char* argv[]);
+int salmonQuantifyBatch(int argc, char* argv[]);
+int salmonQuantifyKmers(int argc, char* argv[]);
+int salmonMerge(int argc, char* argv[]);
+int salmonInfer(int argc, char* argv[]);
+int salmonCells(int argc, char* argv[]);
+int salmonQCPCA(int argc, char* argv[]);
+int salmonIndexWarm(int argc, char* argv[]);
 
 bool verbose = false;
 
@@ -126,7 +154,7 @@ int main( int argc, char* argv[] ) {
     po::options_description sfopts("Allowed Options");
     sfopts.add_options()
     ("version,v", "print version string")
-    ("no-version-check", "don't check with the server to see if this is the latest version")
+    ("no-version-check", "don't check with the server to see if this is the latest version (the check can also be disabled with the SALMON_NO_VERSION_CHECK environment variable, or \"no-version-check = true\" in ~/.salmonrc or /etc/salmonrc)")
     ("help,h", "produce help message")
     ;
 
@@ -159,16 +187,23 @@ int main( int argc, char* argv[] ) {
         std::exit(0);
     }
 
+    // The check runs alongside the command, and its result is printed at
+    // exit if it has arrived by then
     if (!vm.count("no-version-check")){
-      std::string versionMessage = getVersionMessage();
-      std::cerr << versionMessage;
+      salmon::versioncheck::startVersionCheck();
     }
 
     po::notify(vm);
 
     std::unordered_map<string, std::function<int(int, char*[])>> cmds({
       {"index", salmonIndex},
+      {"index-warm", salmonIndexWarm},
       {"quant", salmonQuantify},
+      {"cells", salmonCells},
+      {"qc-pca", salmonQCPCA},
+      {"merge", salmonMerge},
+      {"infer", salmonInfer},
+      {"serve", salmonServe},
       {"swim", salmonSwim}
     });
 
@@ -205,6 +240,21 @@ int main( int argc, char* argv[] ) {
             std::exit(0);
         }
 
+        // a batch of samples is quantified against a single load of the index
+        for (size_t i = 0; i < subCommandArgc; ++i) {
+            if (strcmp(argv2[i], "--batch") == 0 or
+                strncmp(argv2[i], "--batch=", 8) == 0) {
+                std::exit(salmonQuantifyBatch(subCommandArgc, argv2));
+            }
+        }
+
+        // k-mer counting skips the mapping (and alignments) altogether
+        for (size_t i = 0; i < subCommandArgc; ++i) {
+            if (strcmp(argv2[i], "--kmerCount") == 0) {
+                std::exit(salmonQuantifyKmers(subCommandArgc, argv2));
+            }
+        }
+
         // otherwise, detect and dispatch the correct mode
         bool useSalmonAlign{false};
         for (size_t i = 0; i < subCommandArgc; ++i) {
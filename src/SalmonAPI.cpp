@@ -0,0 +1,266 @@
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+
+#include "spdlog/spdlog.h"
+
+#include "ReadExperiment.hpp"
+#include "RunExit.hpp"
+#include "SalmonAPI.hpp"
+#include "SalmonIndex.hpp"
+#include "SalmonOpts.hpp"
+#include "SharedIndexJobs.hpp"
+
+int salmonQuantifyWithIndex(int argc, char *argv[], std::shared_ptr<SalmonIndex> sharedIndex,
+                            salmon::api::QuantResult* result);
+
+namespace salmon {
+namespace api {
+
+namespace {
+
+/**
+ * Streams a buffer into a named pipe (a FIFO, made with mkfifo in dir),
+ * whose path is given to salmon quant as a read file.  If the reader stops
+ * early (and closes its end), the write fails with EPIPE; SIGPIPE is blocked
+ * on the writing thread so that it doesn't take down the host process.
+ */
+class BufferPipe {
+    public:
+        BufferPipe(const std::string& buffer, const boost::filesystem::path& dir, size_t i)
+            : buffer_(buffer), path_((dir / ("reads_" + std::to_string(i) + ".fifo")).string()) {
+            if (::mkfifo(path_.c_str(), S_IRUSR | S_IWUSR) != 0) {
+                throw std::runtime_error("could not create the pipe " + path_ + ": " + std::strerror(errno));
+            }
+        }
+
+        ~BufferPipe() {
+            release();
+            ::unlink(path_.c_str());
+        }
+
+        const std::string& path() const { return path_; }
+
+        void start() {
+            writer_ = std::thread([this]() -> void {
+                sigset_t set;
+                sigemptyset(&set);
+                sigaddset(&set, SIGPIPE);
+                pthread_sigmask(SIG_BLOCK, &set, nullptr);
+                // Opening the write end without a reader fails (ENXIO) rather
+                // than blocks, so that a pipe salmon never opens can be
+                // released
+                int fd{-1};
+                while ((fd = ::open(path_.c_str(), O_WRONLY | O_NONBLOCK)) < 0) {
+                    if ((errno != ENXIO and errno != EINTR) or released_) { return; }
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+                ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+                size_t written{0};
+                while (written < buffer_.size()) {
+                    ssize_t n = ::write(fd, buffer_.data() + written, buffer_.size() - written);
+                    if (n < 0 and errno == EINTR) { continue; }
+                    if (n <= 0) { break; }
+                    written += n;
+                }
+                ::close(fd);
+            });
+        }
+
+        // Once salmon is done with the pipe (and has closed it), end the writer
+        void release() {
+            released_ = true;
+            if (writer_.joinable()) { writer_.join(); }
+        }
+
+    private:
+        const std::string& buffer_;
+        std::string path_;
+        std::atomic<bool> released_{false};
+        std::thread writer_;
+};
+
+bool isReadArgument(const std::string& a) {
+    for (const char* opt : {"--mates1", "--mates2", "--unmatedReads", "--index"}) {
+        size_t len = std::strlen(opt);
+        if (a == opt or (a.compare(0, len, opt) == 0 and a.size() > len and a[len] == '=')) { return true; }
+    }
+    return a == "-1" or a == "-2" or a == "-r" or a == "-i";
+}
+
+// The loggers of a run are registered by name; drop them so that the next
+// run can create its own
+void dropRunLoggers() {
+    for (const char* name : {"stderrLog", "fileLog", "jointLog"}) {
+        auto l = spdlog::get(name);
+        if (l) { l->flush(); }
+        spdlog::drop(name);
+    }
+}
+
+}
+
+Quantifier::Quantifier(const std::string& indexDir, bool verify) : indexDir_(indexDir) {
+    log_ = spdlog::get("apiLog");
+    if (!log_) {
+        auto consoleSink = std::make_shared<spdlog::sinks::stderr_sink_mt>();
+        log_ = spdlog::create("apiLog", {consoleSink});
+    }
+
+    std::string err;
+    index_ = salmon::utils::loadSharedIndex(indexDir_, verify, log_, err);
+    if (!index_) { throw std::runtime_error(err); }
+}
+
+Quantifier::~Quantifier() {}
+
+int Quantifier::run_(const std::vector<std::string>& args, QuantResult* result) {
+    std::vector<std::string> jobArgs{"salmon", "-i", indexDir_};
+    jobArgs.insert(jobArgs.end(), args.begin(), args.end());
+    std::vector<char*> jobArgv;
+    for (auto& a : jobArgs) { jobArgv.push_back(&a[0]); }
+    jobArgv.push_back(nullptr);
+
+    if (result) { *result = QuantResult(); }
+    // Errors of the run come back as its status, rather than ending the
+    // host process (see RunExit.hpp)
+    int ret{0};
+    salmon::utils::throwOnExit() = true;
+    try {
+        ret = salmonQuantifyWithIndex(static_cast<int>(jobArgs.size()), jobArgv.data(), index_, result);
+    } catch (salmon::utils::RunExit& e) {
+        ret = e.status;
+    } catch (...) {
+        salmon::utils::throwOnExit() = false;
+        dropRunLoggers();
+        throw;
+    }
+    salmon::utils::throwOnExit() = false;
+    dropRunLoggers();
+    return ret;
+}
+
+int Quantifier::run(const std::vector<std::string>& args) {
+    return run_(args, nullptr);
+}
+
+int Quantifier::quantify(const std::vector<std::string>& args, QuantResult& result) {
+    return run_(args, &result);
+}
+
+int Quantifier::quantify(const std::vector<std::string>& args, const ReadBuffers& reads,
+                         QuantResult& result) {
+    for (auto& a : args) {
+        if (isReadArgument(a)) {
+            log_->error("{} can't be given with the reads in memory", a);
+            return 1;
+        }
+    }
+    if (reads.mates1.size() != reads.mates2.size()) {
+        log_->error("there are {} buffers of #1 mates but {} of #2 mates",
+                    reads.mates1.size(), reads.mates2.size());
+        return 1;
+    }
+
+    namespace bfs = boost::filesystem;
+    boost::system::error_code ec;
+    bfs::path pipeDir = bfs::temp_directory_path(ec) / bfs::unique_path("salmon-reads-%%%%-%%%%-%%%%");
+    if (ec or !bfs::create_directory(pipeDir, ec)) {
+        log_->error("could not create a directory for the pipes of the reads: {}", ec.message());
+        return 1;
+    }
+
+    int ret{1};
+    {
+        std::vector<std::unique_ptr<BufferPipe>> pipes;
+        std::vector<std::string> jobArgs(args);
+        auto addReads = [&](const char* opt, const std::vector<std::string>& buffers) -> void {
+            if (buffers.empty()) { return; }
+            jobArgs.push_back(opt);
+            for (auto& b : buffers) {
+                pipes.emplace_back(new BufferPipe(b, pipeDir, pipes.size()));
+                jobArgs.push_back(pipes.back()->path());
+            }
+        };
+        try {
+            addReads("-1", reads.mates1);
+            addReads("-2", reads.mates2);
+            addReads("-r", reads.unmated);
+        } catch (std::runtime_error& e) {
+            log_->error("{}", e.what());
+            pipes.clear();
+            bfs::remove_all(pipeDir, ec);
+            return 1;
+        }
+
+        for (auto& p : pipes) { p->start(); }
+        ret = run_(jobArgs, &result);
+        // Releases any writer salmon didn't drain, and removes the pipes
+        pipes.clear();
+    }
+    bfs::remove_all(pipeDir, ec);
+    return ret;
+}
+
+namespace detail {
+
+void collectResults(const SalmonOpts& sopt, ReadExperiment& experiment, QuantResult& result) {
+    // As GZipWriter::writeAbundances
+    bool useScaledCounts = (!sopt.useQuasi and sopt.allowOrphans == false);
+    double numMappedFrags = experiment.upperBoundHits();
+    auto& transcripts = experiment.transcripts();
+
+    result.names.clear();
+    result.lengths.clear();
+    result.effectiveLengths.clear();
+    result.tpm.clear();
+    result.numReads.clear();
+    result.names.reserve(transcripts.size());
+    result.lengths.reserve(transcripts.size());
+    result.effectiveLengths.reserve(transcripts.size());
+    result.tpm.reserve(transcripts.size());
+    result.numReads.reserve(transcripts.size());
+
+    double tfracDenom{0.0};
+    for (auto& transcript : transcripts) {
+        double count = useScaledCounts ? (transcript.mass(false) * numMappedFrags) : transcript.sharedCount();
+        result.numReads.push_back(count);
+        tfracDenom += (count / numMappedFrags) / transcript.EffectiveLength;
+    }
+    double million = 1000000.0;
+    for (size_t i = 0; i < transcripts.size(); ++i) {
+        auto& transcript = transcripts[i];
+        double npm = result.numReads[i] / numMappedFrags;
+        result.names.push_back(transcript.RefName);
+        result.lengths.push_back(transcript.RefLength);
+        result.effectiveLengths.push_back(transcript.EffectiveLength);
+        result.tpm.push_back(((npm / transcript.EffectiveLength) / tfracDenom) * million);
+    }
+
+    auto& arena = experiment.equivalenceClassBuilder().eqArena();
+    result.eqClasses.offsets.assign(arena.offsets.begin(), arena.offsets.end());
+    result.eqClasses.labels.assign(arena.labels.begin(), arena.labels.end());
+    result.eqClasses.weights.assign(arena.weights.begin(), arena.weights.end());
+    result.eqClasses.counts.assign(arena.counts.begin(), arena.counts.end());
+
+    result.numObservedFragments = experiment.numObservedFragments();
+    result.numMappedFragments = experiment.numMappedFragments();
+}
+
+}
+
+} // namespace api
+} // namespace salmon
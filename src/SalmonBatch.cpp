@@ -0,0 +1,239 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+#include <boost/program_options/parsers.hpp>
+
+#include "spdlog/spdlog.h"
+#include "spdlog/details/format.h"
+
+#include "SalmonIndex.hpp"
+#include "SharedIndexJobs.hpp"
+
+namespace {
+
+/**
+ * A sample of the batch file: the directory to which its quantification
+ * is written, and the remaining arguments of its `salmon quant`.
+ */
+struct BatchSample {
+    std::string outputDir;
+    std::vector<std::string> args;
+    size_t lineNum;
+};
+
+/**
+ * The arguments that the batch driver, rather than a sample, provides.
+ */
+bool isReservedArgument(const std::string& a) {
+    for (const char* opt : {"--index", "--output", "--threads", "--alignments", "--batch", "--batchJobs"}) {
+        size_t len = std::strlen(opt);
+        if (a == opt or (a.compare(0, len, opt) == 0 and a.size() > len and a[len] == '=')) { return true; }
+    }
+    return a == "-i" or a == "-o" or a == "-p" or a == "-a" or a == "-j";
+}
+
+/**
+ * Read the samples of the batch file.  Each (non-empty) line that doesn't
+ * start with '#' holds the output directory of the sample, a tab, and the
+ * arguments of the sample's `salmon quant` (e.g. "-l IU -1 a_1.fq -2 a_2.fq"),
+ * without --index, --output or --threads.
+ */
+bool readBatchFile(const std::string& path, std::vector<BatchSample>& samples,
+                   std::shared_ptr<spdlog::logger>& log) {
+    namespace po = boost::program_options;
+    std::ifstream in(path);
+    if (!in.good()) {
+        log->error("could not open the batch file {}", path);
+        return false;
+    }
+    std::string line;
+    size_t lineNum{0};
+    bool ok{true};
+    while (std::getline(in, line)) {
+        ++lineNum;
+        if (!line.empty() and line.back() == '\r') { line.pop_back(); }
+        if (line.empty() or line[0] == '#') { continue; }
+        auto tab = line.find('\t');
+        if (tab == std::string::npos or tab == 0) {
+            log->error("{}:{}: expected <output directory><TAB><quant arguments>", path, lineNum);
+            ok = false;
+            continue;
+        }
+        BatchSample s;
+        s.outputDir = line.substr(0, tab);
+        s.args = po::split_unix(line.substr(tab + 1));
+        s.lineNum = lineNum;
+        for (auto& a : s.args) {
+            if (isReservedArgument(a)) {
+                log->error("{}:{}: a sample can't give {}; it is set by the batch", path, lineNum, a);
+                ok = false;
+            }
+        }
+        samples.push_back(s);
+    }
+    return ok;
+}
+
+}
+
+/**
+ * salmon quant --batch quantifies many samples with a single load of the
+ * index.  The samples are listed in the batch file (see readBatchFile);
+ * the arguments given on the command line alongside --batch, other than
+ * --index, --threads and --batchJobs, are given to every sample.
+ *
+ * As in salmon serve, each sample runs in a child process forked from the
+ * driver, so the samples share the driver's (read-only) copy of the index,
+ * and a sample that fails doesn't stop the others.  Up to --batchJobs
+ * samples run at once, and the --threads budget is divided between them.
+ * When more than one sample runs at once, the console output of each is
+ * written to batch.log in its output directory.
+ */
+int salmonQuantifyBatch(int argc, char* argv[]) {
+    using std::string;
+    namespace bfs = boost::filesystem;
+    namespace po = boost::program_options;
+
+    string batchStr;
+    string indexStr;
+    uint32_t numThreads{std::max(1u, std::thread::hardware_concurrency())};
+    uint32_t maxJobs{1};
+    bool verifyIndex{false};
+
+    po::options_description batchOpts("Batch Options");
+    batchOpts.add_options()
+    ("batch", po::value<string>(&batchStr)->required(), "The file listing the samples to quantify")
+    ("index,i", po::value<string>(&indexStr)->required(), "Salmon index against which to quantify every sample")
+    ("threads,p", po::value<uint32_t>(&numThreads)->default_value(numThreads),
+                            "The total number of threads, divided among the samples that run at once")
+    ("batchJobs,j", po::value<uint32_t>(&maxJobs)->default_value(1),
+                            "The maximum number of samples to quantify at once")
+    ("verifyIndex", po::bool_switch(&verifyIndex)->default_value(false),
+                            "Check the index against the checksums recorded when it was built before loading it")
+    ;
+
+    std::vector<string> commonArgs;
+    try {
+        po::variables_map vm;
+        auto parsed = po::command_line_parser(argc, argv).options(batchOpts).allow_unregistered().run();
+        po::store(parsed, vm);
+        po::notify(vm);
+        commonArgs = po::collect_unrecognized(parsed.options, po::include_positional);
+    } catch (po::error& e) {
+        std::cerr << "exception : [" << e.what() << "]. Exiting.\n";
+        std::cerr << batchOpts << std::endl;
+        std::exit(1);
+    }
+    if (maxJobs == 0) { maxJobs = 1; }
+    if (numThreads == 0) { numThreads = 1; }
+    uint32_t threadsPerJob = std::max(1u, numThreads / maxJobs);
+
+    auto consoleSink = std::make_shared<spdlog::sinks::stderr_sink_mt>();
+    auto log = spdlog::create("batchLog", {consoleSink});
+
+    for (auto& a : commonArgs) {
+        if (isReservedArgument(a)) {
+            log->error("{} can't be given to every sample of a batch", a);
+            std::exit(1);
+        }
+    }
+    std::vector<BatchSample> samples;
+    if (!readBatchFile(batchStr, samples, log)) { std::exit(1); }
+    if (samples.empty()) {
+        log->warn("the batch file {} lists no samples", batchStr);
+        return 0;
+    }
+
+    std::string loadErr;
+    auto index = salmon::utils::loadSharedIndex(indexStr, verifyIndex, log, loadErr);
+    if (!index) {
+        log->error("{}", loadErr);
+        std::exit(1);
+    }
+    log->info("quantifying {} samples against {} ({} at once, {} threads each)",
+              samples.size(), indexStr, maxJobs, threadsPerJob);
+
+    // The sample run by each running process, by its pid
+    std::unordered_map<pid_t, size_t> jobs;
+    std::vector<size_t> failed;
+    auto finishJob = [&](pid_t pid, int status) -> void {
+        auto it = jobs.find(pid);
+        if (it == jobs.end()) { return; }
+        auto& s = samples[it->second];
+        if (WIFEXITED(status) and WEXITSTATUS(status) == 0) {
+            log->info("finished sample {}", s.outputDir);
+        } else {
+            if (WIFEXITED(status)) {
+                log->error("sample {} (line {}) exited with status {}", s.outputDir, s.lineNum, WEXITSTATUS(status));
+            } else {
+                log->error("sample {} (line {}) was terminated by signal {}", s.outputDir, s.lineNum,
+                           WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+            }
+            failed.push_back(it->second);
+        }
+        jobs.erase(it);
+    };
+
+    for (size_t si = 0; si < samples.size(); ++si) {
+        while (jobs.size() >= maxJobs) {
+            int status{0};
+            pid_t pid = ::waitpid(-1, &status, 0);
+            if (pid > 0) { finishJob(pid, status); }
+        }
+
+        auto& s = samples[si];
+        std::vector<string> jobArgs{argv[0], "-i", indexStr, "-p", std::to_string(threadsPerJob)};
+        jobArgs.insert(jobArgs.end(), commonArgs.begin(), commonArgs.end());
+        jobArgs.insert(jobArgs.end(), s.args.begin(), s.args.end());
+        jobArgs.insert(jobArgs.end(), {"-o", s.outputDir});
+
+        std::fflush(stdout);
+        std::fflush(stderr);
+        pid_t pid = ::fork();
+        if (pid < 0) {
+            log->error("could not start sample {}: {}", s.outputDir, std::strerror(errno));
+            failed.push_back(si);
+        } else if (pid == 0) {
+            if (maxJobs > 1) {
+                boost::system::error_code ec;
+                bfs::create_directories(s.outputDir, ec);
+                auto logPath = (bfs::path(s.outputDir) / "batch.log").string();
+                int fd = ::open(logPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (fd >= 0) {
+                    ::dup2(fd, STDOUT_FILENO);
+                    ::dup2(fd, STDERR_FILENO);
+                    ::close(fd);
+                }
+            }
+            salmon::utils::runForkedQuantJob(jobArgs, index);
+        } else {
+            log->info("started sample {} ({} of {})", s.outputDir, si + 1, samples.size());
+            jobs[pid] = si;
+        }
+    }
+    while (!jobs.empty()) {
+        int status{0};
+        pid_t pid = ::waitpid(-1, &status, 0);
+        if (pid > 0) { finishJob(pid, status); }
+    }
+
+    log->info("{} of {} samples were quantified successfully",
+              samples.size() - failed.size(), samples.size());
+    return failed.empty() ? 0 : 1;
+}
@@ -0,0 +1,394 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+
+#include "tbb/parallel_for.h"
+#include "tbb/blocked_range.h"
+#include "tbb/task_scheduler_init.h"
+
+#include "spdlog/spdlog.h"
+
+#include "CellBarcodes.hpp"
+#include "CollapsedEMOptimizer.hpp"
+#include "Communicator.hpp"
+#include "EquivalenceClassArena.hpp"
+#include "IndexChecksums.hpp"
+#include "PairSequenceParser.hpp"
+#include "RapMapUtils.hpp"
+#include "SACollector.hpp"
+#include "SASearcher.hpp"
+#include "SalmonIndex.hpp"
+#include "SalmonIndexVersionInfo.hpp"
+#include "Transcript.hpp"
+
+namespace {
+
+using MateStatus = rapmap::utils::MateStatus;
+using QuasiAlignment = rapmap::utils::QuasiAlignment;
+using paired_parser = pair_sequence_parser<char**>;
+
+struct CellsOpts {
+    std::string indexDir;
+    std::vector<std::string> barcodeReads;
+    std::vector<std::string> cdnaReads;
+    std::string outputDir;
+    uint32_t numThreads{1};
+    salmon::cells::TagGeometry barcode;
+    salmon::cells::TagGeometry umi;
+    size_t maxReadOccs{200};
+    uint64_t minReadsPerCell{10};
+    uint32_t maxIter{10000};
+    bool useVBOpt{false};
+    double vbPrior{1e-3};
+};
+
+struct CellsCounters {
+    std::atomic<uint64_t> numFragments{0};
+    std::atomic<uint64_t> numNoBarcode{0};
+    std::atomic<uint64_t> numMapped{0};
+};
+
+/**
+ * Map the cDNA mates of the fragments from parser against qidx (and its
+ * extensions), adding each mapped fragment to the class of its cell in
+ * table.  The barcode mate is only parsed for its tags.
+ */
+template <typename RapMapIndexT>
+void mapCellReads(paired_parser* parser, SalmonIndex* sidx, RapMapIndexT* qidx,
+                  const CellsOpts& opts, salmon::cells::CellClassTable& table,
+                  CellsCounters& counters) {
+    struct ExtensionMapper {
+        ExtensionMapper(RapMapIndexT* idx, uint32_t offset) :
+            hitCollector(idx), saSearcher(idx), tidOffset(offset) {}
+        SACollector<RapMapIndexT> hitCollector;
+        SASearcher<RapMapIndexT> saSearcher;
+        uint32_t tidOffset;
+    };
+
+    SACollector<RapMapIndexT> hitCollector(qidx);
+    SASearcher<RapMapIndexT> saSearcher(qidx);
+    std::vector<std::unique_ptr<ExtensionMapper>> extMappers;
+    uint32_t offset = qidx->txpNames.size();
+    for (auto& ext : sidx->quasiExtensions(qidx)) {
+        extMappers.emplace_back(new ExtensionMapper(ext.get(), offset));
+        offset += ext->txpNames.size();
+    }
+
+    size_t minK = rapmap::utils::my_mer::k();
+    std::vector<QuasiAlignment> hits;
+    std::vector<QuasiAlignment> extHits;
+    std::vector<uint32_t> label;
+    uint64_t numFragments{0}, numNoBarcode{0}, numMapped{0};
+    while (true) {
+        typename paired_parser::job j(*parser);
+        if (j.is_empty()) { break; }
+        for (size_t i = 0; i < j->nb_filled; ++i) {
+            ++numFragments;
+            auto& bcRead = j->data[i].first.seq;
+            auto& read = j->data[i].second.seq;
+            uint64_t cell, umi;
+            if (!salmon::cells::encodeTag(bcRead, opts.barcode, cell) or
+                !salmon::cells::encodeTag(bcRead, opts.umi, umi)) {
+                ++numNoBarcode;
+                continue;
+            }
+            if (read.size() < minK) { continue; }
+
+            hits.clear();
+            hitCollector(read, hits, saSearcher, MateStatus::SINGLE_END, true);
+            if (hits.size() > opts.maxReadOccs) { continue; }
+            for (auto& m : extMappers) {
+                extHits.clear();
+                if (m->hitCollector(read, extHits, m->saSearcher, MateStatus::SINGLE_END, true)) {
+                    for (auto& h : extHits) {
+                        h.tid += m->tidOffset;
+                        hits.push_back(h);
+                    }
+                }
+            }
+            if (hits.empty() or hits.size() > opts.maxReadOccs) { continue; }
+
+            label.clear();
+            for (auto& h : hits) { label.push_back(h.tid); }
+            std::sort(label.begin(), label.end());
+            label.erase(std::unique(label.begin(), label.end()), label.end());
+            table.add(cell, label);
+            ++numMapped;
+        }
+    }
+    counters.numFragments += numFragments;
+    counters.numNoBarcode += numNoBarcode;
+    counters.numMapped += numMapped;
+}
+
+template <typename RapMapIndexT>
+std::vector<std::string> transcriptNames(SalmonIndex* sidx, RapMapIndexT* qidx) {
+    std::vector<std::string> names(qidx->txpNames.begin(), qidx->txpNames.end());
+    for (auto& ext : sidx->quasiExtensions(qidx)) {
+        names.insert(names.end(), ext->txpNames.begin(), ext->txpNames.end());
+    }
+    return names;
+}
+
+template <typename RapMapIndexT>
+void runMapping(SalmonIndex* sidx, RapMapIndexT* qidx, const CellsOpts& opts,
+                std::vector<salmon::cells::CellClassTable>& tables,
+                CellsCounters& counters, std::vector<std::string>& names) {
+    size_t numFiles = opts.barcodeReads.size() + opts.cdnaReads.size();
+    std::unique_ptr<char*[]> pairFileList(new char*[numFiles]);
+    for (size_t i = 0; i < opts.barcodeReads.size(); ++i) {
+        pairFileList[2*i] = const_cast<char*>(opts.barcodeReads[i].c_str());
+        pairFileList[2*i+1] = const_cast<char*>(opts.cdnaReads[i].c_str());
+    }
+    size_t maxReadGroup{5000};
+    size_t concurrentFile = std::max(size_t(1), std::min(opts.barcodeReads.size(), size_t(opts.numThreads)));
+    paired_parser parser(4 * opts.numThreads, maxReadGroup, concurrentFile,
+                         pairFileList.get(), pairFileList.get() + numFiles);
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < opts.numThreads; ++i) {
+        threads.emplace_back([&, i]() -> void {
+            mapCellReads(&parser, sidx, qidx, opts, tables[i], counters);
+        });
+    }
+    for (auto& t : threads) { t.join(); }
+    names = transcriptNames(sidx, qidx);
+}
+
+/**
+ * The equivalence classes of one cell, over the transcripts it has
+ * fragments on (renumbered from 0, in the order of the index).
+ */
+struct CellClasses {
+    uint64_t barcode{0};
+    uint64_t numFragments{0};
+    std::vector<std::pair<const std::vector<uint32_t>*, uint64_t>> classes;
+};
+
+/**
+ * Run the EM over the classes of cell, and append its (transcript,
+ * estimate) pairs with non-zero estimates to out.
+ */
+void quantifyCell(const CellClasses& cell, const CellsOpts& opts,
+                  std::vector<std::pair<uint32_t, double>>& out) {
+    std::vector<uint32_t> txps;
+    for (auto& c : cell.classes) { txps.insert(txps.end(), c.first->begin(), c.first->end()); }
+    std::sort(txps.begin(), txps.end());
+    txps.erase(std::unique(txps.begin(), txps.end()), txps.end());
+
+    EquivalenceClassArena arena;
+    std::vector<uint64_t> counts;
+    std::vector<uint32_t> local;
+    std::vector<double> uniform;
+    for (auto& c : cell.classes) {
+        local.clear();
+        for (auto t : *c.first) {
+            local.push_back(std::lower_bound(txps.begin(), txps.end(), t) - txps.begin());
+        }
+        uniform.assign(local.size(), 1.0 / local.size());
+        arena.addClass(local.begin(), local.end(), uniform.begin(), uniform.begin(), false, c.second);
+        counts.push_back(c.second);
+    }
+    arena.combinedWeights = arena.weights;
+
+    // Tagged protocols sequence one end of each transcript, so its length
+    // doesn't bear on the number of fragments it gets
+    std::vector<Transcript> transcripts;
+    transcripts.reserve(txps.size());
+    for (size_t i = 0; i < txps.size(); ++i) {
+        transcripts.emplace_back(i, "", 1);
+        transcripts.back().EffectiveLength = 1.0;
+    }
+    std::vector<double> alphas(txps.size(), static_cast<double>(cell.numFragments) / txps.size());
+    salmon::dist::LocalCommunicator comm;
+    salmon::optimizer::distributedEM(comm, arena, counts, transcripts, opts.useVBOpt, opts.vbPrior,
+                                     0.01, opts.maxIter, alphas);
+    for (size_t i = 0; i < txps.size(); ++i) {
+        if (alphas[i] > 0.0) { out.emplace_back(txps[i], alphas[i]); }
+    }
+}
+
+}
+
+/**
+ * salmon cells quantifies droplet-based single-cell libraries (one read
+ * holding the cell barcode and UMI, the other the cDNA) in one pass: the
+ * reads of all of the cells are mapped together, against one load of the
+ * index, into equivalence classes keyed by (cell, class), and the EM is
+ * then run for each cell, in parallel.
+ *
+ *     salmon cells -i index -1 R1.fq.gz -2 R2.fq.gz --barcode 1-16 --umi 17-26 -o out
+ *
+ * The estimates are written as a sparse matrix (cells by transcripts) in
+ * Matrix Market format, to quants_mat.mtx, with the barcodes of its rows
+ * in quants_mat_rows.txt and the transcripts of its columns in
+ * quants_mat_cols.txt.  Cells with fewer than --minReadsPerCell mapped
+ * fragments are left out.
+ */
+int salmonCells(int argc, char* argv[]) {
+    using std::string;
+    namespace bfs = boost::filesystem;
+    namespace po = boost::program_options;
+
+    CellsOpts opts;
+    string barcodeStr, umiStr;
+
+    po::options_description cellsOpts("salmon cells options");
+    cellsOpts.add_options()
+    ("help,h", "produce help message")
+    ("index,i", po::value<string>(&opts.indexDir)->required(), "Salmon (quasi) index")
+    ("mates1,1", po::value<std::vector<string>>(&opts.barcodeReads)->multitoken()->required(),
+                        "File(s) of the reads holding the cell barcodes and UMIs")
+    ("mates2,2", po::value<std::vector<string>>(&opts.cdnaReads)->multitoken()->required(),
+                        "File(s) of the cDNA reads")
+    ("output,o", po::value<string>(&opts.outputDir)->required(), "Output directory")
+    ("threads,p", po::value<uint32_t>(&opts.numThreads)->default_value(std::thread::hardware_concurrency()),
+                        "The number of threads to use concurrently")
+    ("barcode", po::value<string>(&barcodeStr)->default_value("1-16"),
+                        "The bases (START-END, 1-based) of the -1 reads that hold the cell barcode")
+    ("umi", po::value<string>(&umiStr)->default_value("17-26"),
+                        "The bases (START-END, 1-based) of the -1 reads that hold the UMI")
+    ("maxReadOcc,m", po::value<size_t>(&opts.maxReadOccs)->default_value(opts.maxReadOccs),
+                        "Reads \"mapping\" to more than this many places won't be considered")
+    ("minReadsPerCell", po::value<uint64_t>(&opts.minReadsPerCell)->default_value(opts.minReadsPerCell),
+                        "Cells (barcodes) with fewer mapped fragments than this aren't quantified")
+    ("maxIter", po::value<uint32_t>(&opts.maxIter)->default_value(opts.maxIter),
+                        "The largest number of iterations of the EM of each cell")
+    ("useVBOpt", po::bool_switch(&opts.useVBOpt)->default_value(false), "Use the variational Bayesian EM")
+    ("vbPrior", po::value<double>(&opts.vbPrior)->default_value(opts.vbPrior),
+                        "The prior (on each transcript) of the variational Bayesian EM")
+    ;
+
+    try {
+        po::variables_map vm;
+        po::store(po::command_line_parser(argc, argv).options(cellsOpts).run(), vm);
+        if (vm.count("help")) {
+            std::cout << "Usage: salmon cells -i <index> -1 <barcode reads> -2 <cDNA reads> -o <output>\n"
+                      << cellsOpts << std::endl;
+            return 1;
+        }
+        po::notify(vm);
+    } catch (po::error& e) {
+        std::cerr << "exception : [" << e.what() << "]. Exiting.\n";
+        std::cerr << cellsOpts << std::endl;
+        std::exit(1);
+    }
+
+    auto consoleSink = std::make_shared<spdlog::sinks::stderr_sink_mt>();
+    auto log = spdlog::create("cellsLog", {consoleSink});
+
+    string err;
+    if (!opts.barcode.parse(barcodeStr, err) or !opts.umi.parse(umiStr, err)) {
+        log->error("{}", err);
+        std::exit(1);
+    }
+    if (opts.barcode.overlaps(opts.umi)) {
+        log->error("the cell barcode ({}) and the UMI ({}) overlap", barcodeStr, umiStr);
+        std::exit(1);
+    }
+    if (opts.barcodeReads.size() != opts.cdnaReads.size()) {
+        log->error("The number of provided files for -1 and -2 must be the same!");
+        std::exit(1);
+    }
+    opts.numThreads = std::max(opts.numThreads, uint32_t(1));
+    tbb::task_scheduler_init tbbScheduler(opts.numThreads);
+
+    bfs::path indexDirectory(opts.indexDir);
+    SalmonIndexVersionInfo versionInfo;
+    versionInfo.load(indexDirectory / "versionInfo.json");
+    if (versionInfo.indexVersion() == 0) {
+        log->error("Error: The index version file {} doesn't seem to exist.  Please try re-building the salmon index.",
+                   (indexDirectory / "versionInfo.json").string());
+        std::exit(1);
+    }
+    if (versionInfo.indexType() != SalmonIndexType::QUASI) {
+        log->error("salmon cells requires a quasi index (salmon index --type quasi)");
+        std::exit(1);
+    }
+    std::unique_ptr<SalmonIndex> sidx(new SalmonIndex(log, versionInfo.indexType()));
+    sidx->load(indexDirectory);
+
+    // Mapping: one (cell, class) table per thread
+    std::vector<salmon::cells::CellClassTable> tables(opts.numThreads);
+    CellsCounters counters;
+    std::vector<string> names;
+    if (sidx->is64BitQuasi()) {
+        if (sidx->isPerfectHashQuasi()) {
+            runMapping(sidx.get(), sidx->quasiIndexPerfectHash64(), opts, tables, counters, names);
+        } else {
+            runMapping(sidx.get(), sidx->quasiIndex64(), opts, tables, counters, names);
+        }
+    } else {
+        if (sidx->isPerfectHashQuasi()) {
+            runMapping(sidx.get(), sidx->quasiIndexPerfectHash32(), opts, tables, counters, names);
+        } else {
+            runMapping(sidx.get(), sidx->quasiIndex32(), opts, tables, counters, names);
+        }
+    }
+    for (size_t i = 1; i < tables.size(); ++i) { tables[0].merge(tables[i]); }
+    auto& table = tables[0];
+    log->info("mapped {} of {} fragments ({} without a valid barcode or UMI) into {} (cell, class) pairs",
+              counters.numMapped.load(), counters.numFragments.load(), counters.numNoBarcode.load(), table.size());
+
+    // Group the classes by cell
+    std::unordered_map<uint64_t, size_t> cellIndex;
+    std::vector<CellClasses> cells;
+    for (auto& kv : table.counts()) {
+        auto it = cellIndex.find(kv.first.cell);
+        if (it == cellIndex.end()) {
+            it = cellIndex.emplace(kv.first.cell, cells.size()).first;
+            cells.emplace_back();
+            cells.back().barcode = kv.first.cell;
+        }
+        auto& c = cells[it->second];
+        c.classes.emplace_back(&kv.first.label, kv.second);
+        c.numFragments += kv.second;
+    }
+    size_t numBarcodes = cells.size();
+    cells.erase(std::remove_if(cells.begin(), cells.end(),
+                               [&opts](const CellClasses& c) { return c.numFragments < opts.minReadsPerCell; }),
+                cells.end());
+    std::sort(cells.begin(), cells.end(),
+              [](const CellClasses& a, const CellClasses& b) { return a.barcode < b.barcode; });
+    log->info("quantifying {} cells (of {} barcodes) with at least {} mapped fragments",
+              cells.size(), numBarcodes, opts.minReadsPerCell);
+
+    std::vector<std::vector<std::pair<uint32_t, double>>> estimates(cells.size());
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, cells.size(), 1),
+                      [&](const tbb::blocked_range<size_t>& r) -> void {
+        for (size_t i = r.begin(); i < r.end(); ++i) { quantifyCell(cells[i], opts, estimates[i]); }
+    });
+
+    bfs::path outputDirectory(opts.outputDir);
+    boost::system::error_code ec;
+    bfs::create_directories(outputDirectory, ec);
+    size_t numEntries{0};
+    for (auto& e : estimates) { numEntries += e.size(); }
+
+    std::ofstream mtx((outputDirectory / "quants_mat.mtx").string());
+    std::ofstream rows((outputDirectory / "quants_mat_rows.txt").string());
+    std::ofstream cols((outputDirectory / "quants_mat_cols.txt").string());
+    mtx << "%%MatrixMarket matrix coordinate real general\n";
+    mtx << cells.size() << ' ' << names.size() << ' ' << numEntries << '\n';
+    for (size_t i = 0; i < cells.size(); ++i) {
+        rows << salmon::cells::decodeTag(cells[i].barcode, opts.barcode.length()) << '\n';
+        for (auto& e : estimates[i]) { mtx << (i + 1) << ' ' << (e.first + 1) << ' ' << e.second << '\n'; }
+    }
+    for (auto& n : names) { cols << n << '\n'; }
+    if (!mtx.good() or !rows.good() or !cols.good()) {
+        log->error("could not write the estimates to {}", opts.outputDir);
+        std::exit(1);
+    }
+    log->info("wrote the estimates of {} cells to {}", cells.size(), opts.outputDir);
+    return 0;
+}
@@ -0,0 +1,216 @@
+/**
+ * salmon_distributed_em: the EM over an equivalence class dump
+ * (eq_classes.bin, written by salmon quant --dumpEq --dumpEqBinary, or
+ * by salmon_simulate) whose classes are partitioned across the ranks of
+ * an MPI job, for references too large for one node to hold all of the
+ * classes of.
+ *
+ *     mpirun -n 8 salmon_distributed_em --eqClasses eq_classes.bin --output quant.tsv
+ *
+ * The dump holds the auxiliary weights of the classes, but not the
+ * effective lengths of the transcripts; these are read from the quant.sf
+ * of the run that wrote it (or the truth.tsv of salmon_simulate), and the
+ * weights the EM uses are built from both, as CollapsedEMOptimizer does.
+ * Each rank reads the dump, and keeps every size-th class (starting with
+ * the rank-th), so that the ranks hold about the same number of classes
+ * and entries; the estimates are computed by
+ * salmon::optimizer::distributedEM, and the first rank writes them (the
+ * estimated number of fragments from each transcript).  Without MPI
+ * (-DENABLE_MPI=OFF) this runs as a single rank.
+ */
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+
+#include "spdlog/spdlog.h"
+
+#include "BinaryEquivalenceClasses.hpp"
+#include "CollapsedEMOptimizer.hpp"
+#include "Communicator.hpp"
+#include "EquivalenceClassArena.hpp"
+#include "SalmonUtils.hpp"
+#include "Transcript.hpp"
+
+namespace {
+
+struct DistributedEMOpts {
+    std::string eqClassesPath;
+    std::string outputPath;
+    std::string lengthsPath;
+    uint32_t maxIter{10000};
+    double relDiffTolerance{0.01};
+    bool useVBOpt{false};
+    double vbPrior{1e-3};
+};
+
+/**
+ * The file holding the effective lengths of the transcripts of the dump at
+ * eqClassesPath: the truth.tsv beside it (salmon_simulate), or the quant.sf
+ * of the quant directory whose aux directory holds it (salmon quant).
+ */
+std::string defaultLengthsPath(const std::string& eqClassesPath) {
+    namespace bfs = boost::filesystem;
+    bfs::path dir = bfs::path(eqClassesPath).parent_path();
+    if (bfs::exists(dir / "truth.tsv")) { return (dir / "truth.tsv").string(); }
+    return (dir.parent_path() / "quant.sf").string();
+}
+
+int run(salmon::dist::Communicator& comm, const DistributedEMOpts& opts) {
+    auto log = spdlog::get("distEMLog");
+    BinaryEqClassReader reader(opts.eqClassesPath);
+    if (!reader.good()) {
+        log->error("could not read the equivalence classes from {}", opts.eqClassesPath);
+        return 1;
+    }
+
+    // The effective length of each transcript of the dump, by name
+    std::string lengthsPath = opts.lengthsPath.empty() ? defaultLengthsPath(opts.eqClassesPath) : opts.lengthsPath;
+    std::unordered_map<std::string, double> lengthsByName;
+    std::string err;
+    if (!salmon::utils::readQuantColumn(lengthsPath, "EffectiveLength", lengthsByName, err)) {
+        log->error("could not read the effective lengths ({}); please pass --lengths", err);
+        return 1;
+    }
+    auto& names = reader.transcriptNames();
+    std::vector<double> effLens(names.size(), 1.0);
+    for (size_t i = 0; i < names.size(); ++i) {
+        auto it = lengthsByName.find(names[i]);
+        if (it == lengthsByName.end()) {
+            log->error("{} has no effective length for the transcript {}", lengthsPath, names[i]);
+            return 1;
+        }
+        // As the optimizer does, no effective length is taken to be below 1
+        effLens[i] = std::max(it->second, 1.0);
+    }
+
+    // This rank's classes
+    EquivalenceClassArena arena;
+    std::vector<uint64_t> counts;
+    std::vector<uint32_t> labels;
+    std::vector<float> weights;
+    std::vector<double> uniform;
+    uint64_t count{0};
+    uint64_t totalCount{0};
+    size_t classID{0};
+    size_t rank = comm.rank();
+    size_t size = comm.size();
+    while (reader.next(labels, weights, count)) {
+        if (classID++ % size != rank) { continue; }
+        if (weights.empty()) {
+            uniform.assign(labels.size(), 1.0 / labels.size());
+            arena.addClass(labels.begin(), labels.end(), uniform.begin(), uniform.begin(), false, count);
+        } else {
+            arena.addClass(labels.begin(), labels.end(), weights.begin(), weights.begin(), false, count);
+        }
+        counts.push_back(count);
+        totalCount += count;
+    }
+    if (!reader.good()) {
+        log->error("{} is truncated", opts.eqClassesPath);
+        return 1;
+    }
+    // The weights the EM uses: the auxiliary weight of each label over its
+    // effective length, normalized within the class (see CollapsedEMOptimizer::optimize)
+    for (size_t c = 0; c < arena.numClasses(); ++c) {
+        size_t start = arena.offsets[c];
+        size_t end = arena.offsets[c + 1];
+        double wsum{0.0};
+        for (size_t i = start; i < end; ++i) {
+            arena.combinedWeights[i] = arena.weights[i] / effLens[arena.labels[i]];
+            wsum += arena.combinedWeights[i];
+        }
+        double wnorm = (wsum > 0.0) ? 1.0 / wsum : 0.0;
+        for (size_t i = start; i < end; ++i) { arena.combinedWeights[i] *= wnorm; }
+    }
+    comm.allreduceSum(&totalCount, 1);
+
+    std::vector<Transcript> transcripts;
+    transcripts.reserve(names.size());
+    for (size_t i = 0; i < names.size(); ++i) {
+        transcripts.emplace_back(i, names[i].c_str(), 1);
+        transcripts.back().EffectiveLength = effLens[i];
+    }
+    if (rank == 0) {
+        log->info("{} transcripts, {} classes over {} ranks ({} on this one), {} fragments",
+                  names.size(), reader.numClasses(), size, arena.numClasses(), totalCount);
+    }
+
+    std::vector<double> alphas(names.size(), static_cast<double>(totalCount) / std::max(size_t(1), names.size()));
+    uint32_t numIter = salmon::optimizer::distributedEM(comm, arena, counts, transcripts, opts.useVBOpt,
+                                                        opts.vbPrior, opts.relDiffTolerance, opts.maxIter, alphas);
+    if (rank != 0) { return 0; }
+    log->info("finished after {} iterations", numIter);
+
+    std::ofstream out(opts.outputPath);
+    if (!out.good()) {
+        log->error("could not write the estimates to {}", opts.outputPath);
+        return 1;
+    }
+    out << "Name\tNumReads\n";
+    for (size_t i = 0; i < names.size(); ++i) { out << names[i] << '\t' << alphas[i] << '\n'; }
+    return out.good() ? 0 : 1;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    namespace po = boost::program_options;
+
+#ifdef SALMON_ENABLE_MPI
+    MPI_Init(&argc, &argv);
+#endif
+
+    DistributedEMOpts opts;
+    po::options_description desc("salmon_distributed_em options");
+    desc.add_options()
+    ("help,h", "Produce help message")
+    ("eqClasses", po::value<std::string>(&opts.eqClassesPath)->required(), "The eq_classes.bin to quantify")
+    ("output,o", po::value<std::string>(&opts.outputPath)->required(), "The file to which to write the estimates")
+    ("lengths", po::value<std::string>(&opts.lengthsPath), "A file with Name and EffectiveLength columns (the "
+                        "quant.sf of the run that wrote the dump, or the truth.tsv of salmon_simulate) holding the "
+                        "effective lengths of the transcripts; by default, the truth.tsv beside the dump or the "
+                        "quant.sf of its quant directory")
+    ("maxIter", po::value<uint32_t>(&opts.maxIter)->default_value(opts.maxIter),
+                        "The largest number of iterations of the EM")
+    ("tolerance", po::value<double>(&opts.relDiffTolerance)->default_value(opts.relDiffTolerance),
+                        "Stop once no estimate (of at least 0.01 fragments) changes, relatively, by more than this")
+    ("useVBOpt", po::bool_switch(&opts.useVBOpt)->default_value(false), "Use the variational Bayesian EM")
+    ("vbPrior", po::value<double>(&opts.vbPrior)->default_value(opts.vbPrior),
+                        "The prior (on each transcript) of the variational Bayesian EM")
+    ;
+
+    int ret{0};
+    po::variables_map vm;
+    try {
+        po::store(po::command_line_parser(argc, argv).options(desc).run(), vm);
+        if (vm.count("help")) {
+            std::cout << desc << std::endl;
+        } else {
+            po::notify(vm);
+            auto consoleSink = std::make_shared<spdlog::sinks::stderr_sink_mt>();
+            spdlog::create("distEMLog", {consoleSink});
+#ifdef SALMON_ENABLE_MPI
+            salmon::dist::MPICommunicator comm;
+#else
+            salmon::dist::LocalCommunicator comm;
+#endif
+            ret = run(comm, opts);
+        }
+    } catch (po::error& e) {
+        std::cerr << "exception : [" << e.what() << "]. Exiting.\n";
+        ret = 1;
+    }
+
+#ifdef SALMON_ENABLE_MPI
+    MPI_Finalize();
+#endif
+    return ret;
+}
@@ -0,0 +1,80 @@
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+
+#include "spdlog/spdlog.h"
+
+#include "IndexWarmup.hpp"
+
+/**
+ * salmon index-warm brings the files of an index into the page cache, so
+ * that the jobs started against it afterwards (e.g. many salmon quant runs
+ * on a freshly booted node) load it from memory:
+ *
+ *     salmon index-warm -i index -p 16
+ *
+ * It reports how long the warm-up took, and how much of the index was
+ * resident already, on stdout as a tab-separated line
+ *
+ *     <index>  <files>  <bytes>  <bytes already resident>  <seconds>
+ *
+ * so that a scheduler can pre-warm nodes and account for the time.
+ */
+int salmonIndexWarm(int argc, char* argv[]) {
+    using std::string;
+    namespace bfs = boost::filesystem;
+    namespace po = boost::program_options;
+
+    string indexStr;
+    uint32_t numThreads{std::max(std::thread::hardware_concurrency(), 1u)};
+
+    po::options_description warmOpts("salmon index-warm options");
+    warmOpts.add_options()
+    ("help,h", "produce help message")
+    ("index,i", po::value<string>(&indexStr)->required(), "The index to bring into the page cache")
+    ("threads,p", po::value<uint32_t>(&numThreads)->default_value(numThreads),
+                        "The number of threads touching the pages of the index")
+    ;
+
+    try {
+        po::variables_map vm;
+        po::store(po::command_line_parser(argc, argv).options(warmOpts).run(), vm);
+        if (vm.count("help")) {
+            std::cout << "Usage: salmon index-warm -i <index> [-p <threads>]\n" << warmOpts << std::endl;
+            return 1;
+        }
+        po::notify(vm);
+    } catch (po::error& e) {
+        std::cerr << "exception : [" << e.what() << "]. Exiting.\n";
+        std::cerr << warmOpts << std::endl;
+        std::exit(1);
+    }
+
+    auto consoleSink = std::make_shared<spdlog::sinks::stderr_sink_mt>();
+    auto log = spdlog::create("indexWarmLog", {consoleSink});
+
+    bfs::path indexDirectory(indexStr);
+    if (!bfs::is_directory(indexDirectory)) {
+        log->error("{} is not an index directory", indexStr);
+        std::exit(1);
+    }
+
+    salmon::utils::IndexWarmupStats stats;
+    string err;
+    if (!salmon::utils::warmIndexFiles(indexDirectory, numThreads, stats, err)) {
+        log->error("{}", err);
+        std::exit(1);
+    }
+    double mb = stats.numBytes / (1024.0 * 1024.0);
+    log->info("warmed {} files ({:.1f} MB, {:.1f} MB of which were resident already) in {:.2f} s ({:.1f} MB/s)",
+              stats.numFiles, mb, stats.numResidentBytes / (1024.0 * 1024.0), stats.seconds,
+              (stats.seconds > 0.0) ? mb / stats.seconds : 0.0);
+    std::cout << indexStr << '\t' << stats.numFiles << '\t' << stats.numBytes << '\t'
+              << stats.numResidentBytes << '\t' << stats.seconds << '\n';
+    return 0;
+}
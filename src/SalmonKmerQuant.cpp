@@ -0,0 +1,308 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+
+#include "tbb/task_scheduler_init.h"
+
+#include "spdlog/spdlog.h"
+
+#include "jellyfish/stream_manager.hpp"
+#include "jellyfish/whole_sequence_parser.hpp"
+
+#include "CollapsedEMOptimizer.hpp"
+#include "Communicator.hpp"
+#include "EquivalenceClassArena.hpp"
+#include "KmerClassTable.hpp"
+#include "SalmonIndex.hpp"
+#include "SalmonIndexVersionInfo.hpp"
+#include "SalmonUtils.hpp"
+#include "Transcript.hpp"
+
+namespace {
+
+struct KmerQuantOpts {
+    std::string indexDir;
+    std::vector<std::string> readFiles;
+    bool paired{false};
+    std::string outputDir;
+    std::string geneMap;
+    uint32_t numThreads{1};
+    uint32_t maxIter{10000};
+    bool useVBOpt{false};
+    double vbPrior{1e-3};
+};
+
+// The name, length and sequence of each transcript of the index (and its extensions)
+struct IndexTranscripts {
+    std::vector<std::string> names;
+    std::vector<std::pair<const char*, size_t>> seqs;
+};
+
+template <typename RapMapIndexT>
+void indexTranscripts(SalmonIndex* sidx, RapMapIndexT* qidx, IndexTranscripts& txps) {
+    auto add = [&txps](RapMapIndexT* idx) -> void {
+        for (size_t i = 0; i < idx->txpNames.size(); ++i) {
+            txps.names.push_back(idx->txpNames[i]);
+            txps.seqs.emplace_back(idx->seq.data() + idx->txpOffsets[i], idx->txpLens[i]);
+        }
+    };
+    add(qidx);
+    for (auto& ext : sidx->quasiExtensions(qidx)) { add(ext.get()); }
+}
+
+}
+
+/**
+ * salmon quant --kmerCount estimates abundances without mapping the reads:
+ * the k-mers of the transcripts are grouped into classes (the k-mers that
+ * occur in the same transcripts, see KmerClassTable), the k-mers of the
+ * reads are counted into those classes, and the EM is run over the classes
+ * as if they were equivalence classes of k-mers.  It's meant for rough
+ * numbers (pre-screening, contamination checks), for which it's much faster
+ * than mapping every read:
+ *
+ *     salmon quant --kmerCount -i index -l A -1 r1.fq.gz -2 r2.fq.gz -o out
+ *
+ * The k-mer counts of a transcript are turned into fragments by the mean
+ * number of counted k-mers per fragment, and its effective length is its
+ * number of k-mers.  The library type is accepted, but not used: k-mers are
+ * counted on both strands.
+ */
+int salmonQuantifyKmers(int argc, char* argv[]) {
+    using std::string;
+    namespace bfs = boost::filesystem;
+    namespace po = boost::program_options;
+
+    KmerQuantOpts opts;
+    std::vector<string> mates1, mates2, unmated;
+    string libType;
+    bool kmerCount{true};
+    opts.numThreads = std::max(std::thread::hardware_concurrency(), 1u);
+
+    po::options_description kmerOpts("salmon quant --kmerCount options");
+    kmerOpts.add_options()
+    ("help,h", "produce help message")
+    ("kmerCount", po::bool_switch(&kmerCount)->default_value(true),
+                        "Count the k-mers of the reads, rather than mapping them")
+    ("index,i", po::value<string>(&opts.indexDir)->required(), "Salmon (quasi) index")
+    ("libType,l", po::value<string>(&libType), "The library type (not used; k-mers are counted on both strands)")
+    ("unmatedReads,r", po::value<std::vector<string>>(&unmated)->multitoken(), "List of files containing unmated reads")
+    ("mates1,1", po::value<std::vector<string>>(&mates1)->multitoken(), "File containing the #1 mates")
+    ("mates2,2", po::value<std::vector<string>>(&mates2)->multitoken(), "File containing the #2 mates")
+    ("output,o", po::value<string>(&opts.outputDir)->required(), "Output quantification directory")
+    ("geneMap,g", po::value<string>(&opts.geneMap),
+                        "File containing a mapping of transcripts to genes, from which gene-level estimates "
+                        "(quant.genes.sf) are computed")
+    ("threads,p", po::value<uint32_t>(&opts.numThreads)->default_value(opts.numThreads),
+                        "The number of threads to use concurrently")
+    ("maxIter", po::value<uint32_t>(&opts.maxIter)->default_value(opts.maxIter),
+                        "The largest number of iterations of the EM")
+    ("useVBOpt", po::bool_switch(&opts.useVBOpt)->default_value(false), "Use the variational Bayesian EM")
+    ("vbPrior", po::value<double>(&opts.vbPrior)->default_value(opts.vbPrior),
+                        "The prior (on each transcript) of the variational Bayesian EM")
+    ;
+
+    try {
+        po::variables_map vm;
+        po::store(po::command_line_parser(argc, argv).options(kmerOpts).run(), vm);
+        if (vm.count("help")) {
+            std::cout << "Usage: salmon quant --kmerCount -i <index> -l <libtype> {-r <reads> | -1 <mates1> -2 <mates2>} -o <output>\n"
+                      << kmerOpts << std::endl;
+            return 1;
+        }
+        po::notify(vm);
+    } catch (po::error& e) {
+        std::cerr << "exception : [" << e.what() << "]. Exiting.\n";
+        std::cerr << kmerOpts << std::endl;
+        std::exit(1);
+    }
+
+    auto consoleSink = std::make_shared<spdlog::sinks::stderr_sink_mt>();
+    auto log = spdlog::create("kmerQuantLog", {consoleSink});
+
+    if (mates1.size() != mates2.size()) {
+        log->error("The number of provided files for -1 and -2 must be the same!");
+        std::exit(1);
+    }
+    if (!unmated.empty() and !mates1.empty()) {
+        log->error("--kmerCount quantifies either unmated (-r) or paired (-1/-2) reads, not both");
+        std::exit(1);
+    }
+    opts.paired = !mates1.empty();
+    opts.readFiles = opts.paired ? mates1 : unmated;
+    opts.readFiles.insert(opts.readFiles.end(), mates2.begin(), mates2.end());
+    if (opts.readFiles.empty()) {
+        log->error("no reads were given (-r, or -1 and -2)");
+        std::exit(1);
+    }
+    opts.numThreads = std::max(opts.numThreads, uint32_t(1));
+    tbb::task_scheduler_init tbbScheduler(opts.numThreads);
+
+    bfs::path indexDirectory(opts.indexDir);
+    SalmonIndexVersionInfo versionInfo;
+    versionInfo.load(indexDirectory / "versionInfo.json");
+    if (versionInfo.indexVersion() == 0 or versionInfo.indexType() != SalmonIndexType::QUASI) {
+        log->error("--kmerCount requires a quasi index (salmon index --type quasi)");
+        std::exit(1);
+    }
+    uint32_t k = versionInfo.auxKmerLength();
+    if (k == 0 or k > 31) {
+        log->error("--kmerCount needs k-mers of at most 31 bases (the index uses k = {})", k);
+        std::exit(1);
+    }
+    std::unique_ptr<SalmonIndex> sidx(new SalmonIndex(log, versionInfo.indexType()));
+    sidx->load(indexDirectory);
+    IndexTranscripts txps;
+    if (sidx->is64BitQuasi()) {
+        if (sidx->isPerfectHashQuasi()) {
+            indexTranscripts(sidx.get(), sidx->quasiIndexPerfectHash64(), txps);
+        } else {
+            indexTranscripts(sidx.get(), sidx->quasiIndex64(), txps);
+        }
+    } else {
+        if (sidx->isPerfectHashQuasi()) {
+            indexTranscripts(sidx.get(), sidx->quasiIndexPerfectHash32(), txps);
+        } else {
+            indexTranscripts(sidx.get(), sidx->quasiIndex32(), txps);
+        }
+    }
+    size_t numTxps = txps.names.size();
+
+    KmerClassTable table(k);
+    table.build(numTxps, [&txps](size_t i) { return txps.seqs[i]; });
+    log->info("grouped the {} distinct {}-mers of {} transcripts into {} classes",
+              table.numKmers(), k, numTxps, table.numClasses());
+
+    std::vector<uint32_t> lengths(numTxps);
+    for (size_t i = 0; i < numTxps; ++i) { lengths[i] = txps.seqs[i].second; }
+    // Only the names and lengths of the transcripts are needed from here on
+    txps.seqs.clear();
+    sidx.reset();
+
+    // Count the k-mers of the reads into their classes, one count vector per thread
+    using stream_manager = jellyfish::stream_manager<std::vector<string>::const_iterator>;
+    using single_parser = jellyfish::whole_sequence_parser<stream_manager>;
+    size_t maxReadGroup{5000};
+    size_t concurrentFile = std::max(size_t(1), std::min(opts.readFiles.size(), size_t(opts.numThreads)));
+    stream_manager streams(opts.readFiles.cbegin(), opts.readFiles.cend(), concurrentFile);
+    single_parser parser(4 * opts.numThreads, maxReadGroup, concurrentFile, streams);
+
+    std::vector<std::vector<uint64_t>> threadCounts(opts.numThreads);
+    std::atomic<uint64_t> numReads{0};
+    std::atomic<uint64_t> numReadsWithHits{0};
+    std::vector<std::thread> counters;
+    for (uint32_t t = 0; t < opts.numThreads; ++t) {
+        counters.emplace_back([&, t]() -> void {
+            auto& counts = threadCounts[t];
+            counts.assign(table.numClasses(), 0);
+            CanonicalKmerRoller roller(k);
+            uint64_t localReads{0}, localWithHits{0};
+            while (true) {
+                single_parser::job j(parser);
+                if (j.is_empty()) { break; }
+                for (size_t i = 0; i < j->nb_filled; ++i) {
+                    auto& seq = j->data[i].seq;
+                    ++localReads;
+                    bool hit{false};
+                    roller.reset();
+                    for (char c : seq) {
+                        roller.push(c);
+                        if (!roller.valid()) { continue; }
+                        uint32_t cls = table.classOf(roller.canonical());
+                        if (cls != KmerClassTable::noClass) {
+                            ++counts[cls];
+                            hit = true;
+                        }
+                    }
+                    if (hit) { ++localWithHits; }
+                }
+            }
+            numReads += localReads;
+            numReadsWithHits += localWithHits;
+        });
+    }
+    for (auto& t : counters) { t.join(); }
+    auto& classCounts = threadCounts[0];
+    for (size_t t = 1; t < threadCounts.size(); ++t) {
+        for (size_t c = 0; c < classCounts.size(); ++c) { classCounts[c] += threadCounts[t][c]; }
+        std::vector<uint64_t>().swap(threadCounts[t]);
+    }
+
+    // The classes with counts, as equivalence classes of k-mers; a k-mer of
+    // a class is drawn from each of its transcripts with probability
+    // 1 / (the number of k-mers of the transcript)
+    std::vector<Transcript> transcripts;
+    transcripts.reserve(numTxps);
+    for (size_t i = 0; i < numTxps; ++i) {
+        transcripts.emplace_back(i, "", lengths[i]);
+        transcripts.back().EffectiveLength = std::max(static_cast<double>(lengths[i]) - k + 1, 1.0);
+    }
+    EquivalenceClassArena arena;
+    std::vector<uint64_t> counts;
+    std::vector<double> weights;
+    uint64_t totalKmers{0};
+    for (size_t c = 0; c < classCounts.size(); ++c) {
+        if (classCounts[c] == 0) { continue; }
+        weights.clear();
+        for (auto it = table.labelsBegin(c); it != table.labelsEnd(c); ++it) {
+            weights.push_back(1.0 / transcripts[*it].EffectiveLength);
+        }
+        arena.addClass(table.labelsBegin(c), table.labelsEnd(c), weights.begin(), weights.begin(),
+                       false, classCounts[c]);
+        counts.push_back(classCounts[c]);
+        totalKmers += classCounts[c];
+    }
+    arena.combinedWeights = arena.weights;
+    uint64_t numFragments = opts.paired ? numReads / 2 : numReads.load();
+    uint64_t numFragmentsWithHits = opts.paired ? numReadsWithHits / 2 : numReadsWithHits.load();
+    log->info("counted {} k-mers of {} reads ({} with at least one transcript k-mer) into {} classes",
+              totalKmers, numReads.load(), numReadsWithHits.load(), counts.size());
+
+    std::vector<double> alphas(numTxps, (numTxps > 0) ? static_cast<double>(totalKmers) / numTxps : 0.0);
+    if (totalKmers > 0) {
+        salmon::dist::LocalCommunicator comm;
+        uint32_t numIter = salmon::optimizer::distributedEM(comm, arena, counts, transcripts, opts.useVBOpt,
+                                                            opts.vbPrior, 0.01, opts.maxIter, alphas);
+        log->info("the EM finished after {} iterations", numIter);
+    }
+
+    // k-mer counts -> fragments, and TPM from the k-mer rate of each transcript
+    double kmersPerFragment = (numFragmentsWithHits > 0) ?
+        static_cast<double>(totalKmers) / numFragmentsWithHits : 1.0;
+    double rateSum{0.0};
+    for (size_t i = 0; i < numTxps; ++i) { rateSum += alphas[i] / transcripts[i].EffectiveLength; }
+
+    bfs::path outputDirectory(opts.outputDir);
+    boost::system::error_code ec;
+    bfs::create_directories(outputDirectory, ec);
+    bfs::path quantPath = outputDirectory / "quant.sf";
+    {
+        std::ofstream out(quantPath.string());
+        out << "Name\tLength\tEffectiveLength\tTPM\tNumReads\n";
+        for (size_t i = 0; i < numTxps; ++i) {
+            double tpm = (rateSum > 0.0) ? 1e6 * (alphas[i] / transcripts[i].EffectiveLength) / rateSum : 0.0;
+            out << txps.names[i] << '\t' << lengths[i] << '\t' << transcripts[i].EffectiveLength << '\t'
+                << tpm << '\t' << alphas[i] / kmersPerFragment << '\n';
+        }
+        if (!out.good()) {
+            log->error("could not write the estimates to {}", quantPath.string());
+            std::exit(1);
+        }
+    }
+    if (!opts.geneMap.empty()) {
+        bfs::path geneMapPath(opts.geneMap);
+        salmon::utils::generateGeneLevelEstimates(geneMapPath, outputDirectory);
+    }
+    log->info("wrote the estimates for {} of {} fragments to {}", numFragmentsWithHits, numFragments,
+              quantPath.string());
+    return 0;
+}
@@ -0,0 +1,85 @@
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+
+#include "spdlog/spdlog.h"
+
+#include "ShardState.hpp"
+
+/**
+ * salmon merge combines the mapping states of the shards of a sample
+ * (each written by salmon quant --mapOnly, or by an earlier salmon merge)
+ * into one state, which salmon infer quantifies:
+ *
+ *     salmon quant --mapOnly -i index -l A -1 lane1_1.fq -2 lane1_2.fq -o lane1
+ *     salmon quant --mapOnly -i index -l A -1 lane2_1.fq -2 lane2_2.fq -o lane2
+ *     salmon merge -o sample lane1 lane2
+ *     salmon infer -i index --state sample -o sample_quant
+ *
+ * The shards must have been mapped against the same index, with the same
+ * --fldMax.  Since a merged state can be merged again, the shards can be
+ * combined as they arrive.
+ */
+int salmonMerge(int argc, char* argv[]) {
+    using std::string;
+    namespace bfs = boost::filesystem;
+    namespace po = boost::program_options;
+
+    string outputStr;
+    std::vector<string> shardStrs;
+
+    po::options_description mergeOpts("salmon merge options");
+    mergeOpts.add_options()
+    ("help,h", "produce help message")
+    ("output,o", po::value<string>(&outputStr)->required(), "The directory to which to write the merged state")
+    ("shards", po::value<std::vector<string>>(&shardStrs)->multitoken()->required(),
+                        "The states to merge (the output directories of salmon quant --mapOnly, or of salmon merge)")
+    ;
+    po::positional_options_description positional;
+    positional.add("shards", -1);
+
+    try {
+        po::variables_map vm;
+        po::store(po::command_line_parser(argc, argv).options(mergeOpts).positional(positional).run(), vm);
+        if (vm.count("help")) {
+            std::cout << "Usage: salmon merge -o <output> <shard> [<shard> ...]\n" << mergeOpts << std::endl;
+            return 1;
+        }
+        po::notify(vm);
+    } catch (po::error& e) {
+        std::cerr << "exception : [" << e.what() << "]. Exiting.\n";
+        std::cerr << mergeOpts << std::endl;
+        std::exit(1);
+    }
+
+    auto consoleSink = std::make_shared<spdlog::sinks::stderr_sink_mt>();
+    auto log = spdlog::create("mergeLog", {consoleSink});
+
+    salmon::shard::ShardMerger merger;
+    std::string err;
+    for (auto& s : shardStrs) {
+        auto dir = salmon::shard::stateDirectory(s);
+        if (!merger.add(dir, err)) {
+            log->error("could not merge {}: {}", s, err);
+            std::exit(1);
+        }
+        log->info("merged {} ({} classes so far)", dir.string(), merger.numClasses());
+    }
+
+    bfs::path outputDirectory(outputStr);
+    boost::system::error_code ec;
+    bfs::create_directories(outputDirectory, ec);
+    if (!merger.write(outputDirectory, err)) {
+        log->error("{}", err);
+        std::exit(1);
+    }
+    auto& stats = merger.stats();
+    log->info("wrote the state of {} shard(s) ({} fragments, {} mapped, {} equivalence classes) to {}",
+              stats.numShards, stats.numObservedFragments, stats.numAssignedFragments,
+              merger.numClasses(), outputStr);
+    return 0;
+}
@@ -0,0 +1,314 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+
+#include "tbb/parallel_for.h"
+#include "tbb/blocked_range.h"
+#include "tbb/task_scheduler_init.h"
+
+#include "spdlog/spdlog.h"
+
+#include "BinaryQuant.hpp"
+#include "StreamingPCA.hpp"
+
+namespace {
+
+namespace bfs = boost::filesystem;
+
+/**
+ * Reads one column of the abundances of a sample (its quant.bin, if it has
+ * one, or else its quant.sf), checking that its transcripts are those of
+ * the first sample, in the same order.
+ */
+class QuantColumnReader {
+    public:
+        QuantColumnReader(BinaryQuantHeader::Column column, bool logTransform) :
+            column_(column), logTransform_(logTransform) {}
+
+        // Read the transcript names of the first sample
+        bool init(const bfs::path& dir, std::string& err) {
+            bfs::path bin = dir / "quant.bin";
+            if (bfs::exists(bin)) {
+                BinaryQuantReader reader(bin);
+                if (!reader.good()) { err = bin.string() + " is not a valid binary quantification"; return false; }
+                names_.reserve(reader.numTranscripts());
+                for (size_t i = 0; i < reader.numTranscripts(); ++i) { names_.push_back(reader.name(i)); }
+                return true;
+            }
+            std::vector<double> ignored;
+            return readText_(dir / "quant.sf", names_, ignored, err);
+        }
+
+        size_t numTranscripts() const { return names_.size(); }
+        const std::vector<std::string>& names() const { return names_; }
+
+        // Read the (transformed) column of the sample in dir into row
+        bool read(const bfs::path& dir, Eigen::Ref<Eigen::RowVectorXd, 0, Eigen::InnerStride<>> row, std::string& err) const {
+            bfs::path bin = dir / "quant.bin";
+            std::vector<double> values;
+            if (bfs::exists(bin)) {
+                BinaryQuantReader reader(bin);
+                if (!reader.good()) { err = bin.string() + " is not a valid binary quantification"; return false; }
+                if (reader.numTranscripts() != names_.size()) {
+                    err = bin.string() + " has a different number of transcripts than the first sample";
+                    return false;
+                }
+                for (size_t i = 0; i < names_.size(); ++i) {
+                    if (reader.nameLength(i) != names_[i].size() or
+                        std::memcmp(reader.nameData(i), names_[i].data(), names_[i].size()) != 0) {
+                        err = bin.string() + " has transcript " + reader.name(i) + " where the first sample has " + names_[i];
+                        return false;
+                    }
+                }
+                const double* col = reader.column(column_);
+                values.assign(col, col + names_.size());
+            } else {
+                bfs::path sf = dir / "quant.sf";
+                std::vector<std::string> names;
+                if (!readText_(sf, names, values, err)) { return false; }
+                if (names != names_) {
+                    err = sf.string() + " does not list the transcripts of the first sample, in the same order";
+                    return false;
+                }
+            }
+            for (size_t i = 0; i < values.size(); ++i) {
+                row(i) = logTransform_ ? std::log1p(std::max(values[i], 0.0)) : values[i];
+            }
+            return true;
+        }
+
+    private:
+        // Read the names, and the values of column_, of the quant.sf at path
+        bool readText_(const bfs::path& path, std::vector<std::string>& names,
+                       std::vector<double>& values, std::string& err) const {
+            std::ifstream in(path.string());
+            if (!in.good()) { err = "could not open " + path.string(); return false; }
+            std::string line;
+            std::getline(in, line); // header
+            // Name, Length, EffectiveLength, TPM, NumReads
+            size_t field = (column_ == BinaryQuantHeader::TPM) ? 3 :
+                           (column_ == BinaryQuantHeader::NUM_READS) ? 4 :
+                           (column_ == BinaryQuantHeader::LENGTH) ? 1 : 2;
+            std::string name;
+            while (std::getline(in, line)) {
+                if (line.empty()) { continue; }
+                std::istringstream fields(line);
+                fields >> name;
+                double v{0.0};
+                for (size_t f = 1; f <= field; ++f) { fields >> v; }
+                if (fields.fail()) { err = path.string() + " has a malformed line: " + line; return false; }
+                names.push_back(name);
+                values.push_back(v);
+            }
+            return true;
+        }
+
+        BinaryQuantHeader::Column column_;
+        bool logTransform_;
+        std::vector<std::string> names_;
+};
+
+}
+
+/**
+ * salmon qc-pca computes the top principal components of the abundances of
+ * a cohort of samples (the output directories of salmon quant, read from
+ * their quant.bin when they have one, or else their quant.sf), for quality
+ * control:
+ *
+ *     salmon qc-pca -k 10 -o cohort_pca --samples sample_dirs.txt
+ *
+ * The samples are read in blocks, a few times over (see StreamingPCA), so
+ * the memory used grows with the number of components times the number of
+ * transcripts rather than with the number of samples.  All samples must
+ * have been quantified against the same transcripts.
+ */
+int salmonQCPCA(int argc, char* argv[]) {
+    using std::string;
+    namespace po = boost::program_options;
+
+    string outputStr;
+    string samplesFile;
+    std::vector<string> sampleStrs;
+    string valueStr;
+    uint32_t numComponents{10};
+    uint32_t oversampling{10};
+    uint32_t numPowerIterations{2};
+    size_t blockSize{256};
+    uint32_t numThreads{1};
+    bool noLog{false};
+    bool writeLoadings{false};
+
+    po::options_description pcaOpts("salmon qc-pca options");
+    pcaOpts.add_options()
+    ("help,h", "produce help message")
+    ("output,o", po::value<string>(&outputStr)->required(), "The directory to which to write the components")
+    ("samples", po::value<string>(&samplesFile), "A file listing the sample (quantification) directories, one per line")
+    ("sampleDirs", po::value<std::vector<string>>(&sampleStrs)->multitoken(), "The sample (quantification) directories")
+    ("value", po::value<string>(&valueStr)->default_value("TPM"), "The abundance to analyze (TPM or NumReads)")
+    ("noLog", po::bool_switch(&noLog)->default_value(false), "Use the abundances as they are, rather than log(1 + x)")
+    ("numComponents,k", po::value<uint32_t>(&numComponents)->default_value(10), "The number of components to compute")
+    ("oversampling", po::value<uint32_t>(&oversampling)->default_value(10),
+                        "The number of extra dimensions sampled beyond the number of components")
+    ("powerIterations", po::value<uint32_t>(&numPowerIterations)->default_value(2),
+                        "The number of power iterations (each an extra pass over the samples); more give more accurate "
+                        "components when the variances decay slowly")
+    ("blockSize", po::value<size_t>(&blockSize)->default_value(256), "The number of samples read at a time")
+    ("threads,p", po::value<uint32_t>(&numThreads)->default_value(1), "The number of threads reading samples")
+    ("loadings", po::bool_switch(&writeLoadings)->default_value(false),
+                        "Also write the loadings of the transcripts on the components (pca_loadings.tsv)")
+    ;
+    po::positional_options_description positional;
+    positional.add("sampleDirs", -1);
+
+    try {
+        po::variables_map vm;
+        po::store(po::command_line_parser(argc, argv).options(pcaOpts).positional(positional).run(), vm);
+        if (vm.count("help")) {
+            std::cout << "Usage: salmon qc-pca -o <output> [--samples <file>] [<sample> ...]\n" << pcaOpts << std::endl;
+            return 1;
+        }
+        po::notify(vm);
+    } catch (po::error& e) {
+        std::cerr << "exception : [" << e.what() << "]. Exiting.\n";
+        std::cerr << pcaOpts << std::endl;
+        std::exit(1);
+    }
+
+    auto consoleSink = std::make_shared<spdlog::sinks::stderr_sink_mt>();
+    auto log = spdlog::create("qcPCALog", {consoleSink});
+
+    BinaryQuantHeader::Column column;
+    if (valueStr == "TPM") {
+        column = BinaryQuantHeader::TPM;
+    } else if (valueStr == "NumReads") {
+        column = BinaryQuantHeader::NUM_READS;
+    } else {
+        log->error("--value must be TPM or NumReads (not {})", valueStr);
+        std::exit(1);
+    }
+
+    if (!samplesFile.empty()) {
+        std::ifstream in(samplesFile);
+        if (!in.good()) {
+            log->error("could not open {}", samplesFile);
+            std::exit(1);
+        }
+        string line;
+        while (std::getline(in, line)) {
+            if (!line.empty()) { sampleStrs.push_back(line); }
+        }
+    }
+    size_t n = sampleStrs.size();
+    if (n < 2) {
+        log->error("qc-pca needs at least 2 samples (got {})", n);
+        std::exit(1);
+    }
+
+    QuantColumnReader reader(column, !noLog);
+    string err;
+    if (!reader.init(sampleStrs.front(), err)) {
+        log->error("{}", err);
+        std::exit(1);
+    }
+    size_t m = reader.numTranscripts();
+    log->info("computing {} components of the {} of {} samples ({} transcripts)",
+              numComponents, valueStr, n, m);
+
+    tbb::task_scheduler_init tbbScheduler(numThreads);
+    size_t numPasses{0};
+    StreamingPCA::RowSource source = [&](size_t first, size_t b, Eigen::MatrixXd& block) -> bool {
+        if (first == 0) { ++numPasses; }
+        block.resize(b, m);
+        std::vector<string> errs(b);
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, b),
+            [&](const tbb::blocked_range<size_t>& r) {
+                for (size_t i = r.begin(); i != r.end(); ++i) {
+                    reader.read(sampleStrs[first + i], block.row(i), errs[i]);
+                }
+            });
+        for (auto& e : errs) {
+            if (!e.empty()) {
+                log->error("{}", e);
+                return false;
+            }
+        }
+        log->info("pass {}: read {} / {} samples", numPasses, first + b, n);
+        return true;
+    };
+
+    StreamingPCA pca(numComponents, oversampling, numPowerIterations);
+    if (!pca.fit(source, n, m, blockSize)) {
+        log->error("could not compute the components");
+        std::exit(1);
+    }
+
+    bfs::path outputDirectory(outputStr);
+    boost::system::error_code ec;
+    bfs::create_directories(outputDirectory, ec);
+    if (ec) {
+        log->error("could not create the output directory {}: {}", outputStr, ec.message());
+        return 1;
+    }
+    uint32_t k = pca.numComponents();
+    auto checkWritten = [&log](std::ofstream& out, const bfs::path& path) -> bool {
+        out.close();
+        if (!out.good()) {
+            log->error("could not write {}", path.string());
+            return false;
+        }
+        return true;
+    };
+
+    {
+        bfs::path scoresPath = outputDirectory / "pca_scores.tsv";
+        std::ofstream out(scoresPath.string());
+        out << "Sample";
+        for (uint32_t c = 0; c < k; ++c) { out << "\tPC" << c + 1; }
+        out << '\n';
+        for (size_t i = 0; i < n; ++i) {
+            out << sampleStrs[i];
+            for (uint32_t c = 0; c < k; ++c) { out << '\t' << pca.scores()(i, c); }
+            out << '\n';
+        }
+        if (!checkWritten(out, scoresPath)) { return 1; }
+    }
+    {
+        bfs::path variancePath = outputDirectory / "pca_variance.tsv";
+        std::ofstream out(variancePath.string());
+        out << "Component\tVariance\tFraction\n";
+        for (uint32_t c = 0; c < k; ++c) {
+            double v = pca.variances()(c);
+            out << "PC" << c + 1 << '\t' << v << '\t'
+                << ((pca.totalVariance() > 0.0) ? v / pca.totalVariance() : 0.0) << '\n';
+        }
+        if (!checkWritten(out, variancePath)) { return 1; }
+    }
+    if (writeLoadings) {
+        bfs::path loadingsPath = outputDirectory / "pca_loadings.tsv";
+        std::ofstream out(loadingsPath.string());
+        out << "Name";
+        for (uint32_t c = 0; c < k; ++c) { out << "\tPC" << c + 1; }
+        out << '\n';
+        for (size_t t = 0; t < m; ++t) {
+            out << reader.names()[t];
+            for (uint32_t c = 0; c < k; ++c) { out << '\t' << pca.components()(t, c); }
+            out << '\n';
+        }
+        if (!checkWritten(out, loadingsPath)) { return 1; }
+    }
+
+    double explained = pca.variances().sum();
+    log->info("wrote {} components (explaining {:.1f}% of the variance) to {}", k,
+              (pca.totalVariance() > 0.0) ? 100.0 * explained / pca.totalVariance() : 0.0, outputStr);
+    return 0;
+}
@@ -32,6 +32,7 @@
 #include <iterator>
 #include <mutex>
 #include <thread>
+#include <chrono>
 #include <sstream>
 #include <exception>
 #include <random>
@@ -85,6 +86,7 @@ extern "C" {
 #include "tbb/blocked_range.h"
 #include "tbb/task_scheduler_init.h"
 #include "tbb/partitioner.h"
+#include "tbb/task_group.h"
 
 // logger includes
 #include "spdlog/spdlog.h"
@@ -104,6 +106,7 @@ extern "C" {
 #include "ReadLibrary.hpp"
 #include "SalmonConfig.hpp"
 #include "IOUtils.hpp"
+#include "ProgressReporter.hpp"
 #include "SalmonIndex.hpp"
 
 #include "BWAUtils.hpp"
@@ -123,6 +126,19 @@ extern "C" {
 #include "SACollector.hpp"
 #include "GZipWriter.hpp"
 #include "GCBiasParams.hpp"
+#include "MappingCache.hpp"
+#include "PosteriorWriter.hpp"
+#include "RandomStreams.hpp"
+#include "MemoryPlacement.hpp"
+#include "IndexChecksums.hpp"
+#include "BootstrapCheckpoint.hpp"
+#include "MappingConvergenceMonitor.hpp"
+#include "ReadHitCache.hpp"
+#include "MateVerifier.hpp"
+#include "ReadTrimmer.hpp"
+#include "MemoryBudget.hpp"
+#include "ShardState.hpp"
+#include "SalmonAPI.hpp"
 //#include "TextBootstrapWriter.hpp"
 
 /****** QUASI MAPPING DECLARATIONS *********/
@@ -156,7 +172,173 @@ using AlnGroupVecRange = boost::iterator_range<typename AlnGroupVec<AlnT>::itera
  using AlnGroupQueue = tbb::concurrent_queue<AlignmentGroup<AlnT>*>;
 #endif
 
+#include "FragmentScratch.hpp"
+#include "InferencePipeline.hpp"
+#include "MappingSAMWriter.hpp"
+#include "UnmappedNameWriter.hpp"
+#include "MetricsServer.hpp"
+#include "AbundanceSnapshotWriter.hpp"
+#include "RunProfiler.hpp"
+#include "TraceEvents.hpp"
+#include "AllocationStats.hpp"
 #include "LightweightAlignmentDefs.hpp"
+#include "RunExit.hpp"
+
+/**
+ * The options that the scoring of the alignments of a fragment depends on
+ * (see scoreAlignmentGroup_), as the bits of a template parameter.
+ */
+enum AlignmentScoringFlags : uint32_t {
+    SCORE_REF_LENGTH = 1, // Use the reference (rather than effective) lengths
+    SCORE_FRAG_LENGTH = 2, // Include the fragment length probability
+    SCORE_START_POS = 4, // Include the fragment start position probability
+    SCORE_POS_WEIGHTS = 8, // Record the positional weights of the eq. classes
+    SCORE_READ_COMPAT = 16, // Include the library format compatibility probability
+    SCORE_UPDATE_COUNTS = 32, // Count the library formats and the transcripts' total counts
+    SCORE_LOCAL_UPDATES = 64 // Stage the total counts in the thread's transcript updates
+};
+
+/**
+ * Compute the (log) probability of each alignment of alnGroup, and record
+ * the non-zero ones in the scratch space's buffers (of the fragment's log
+ * probabilities and of its equivalence class label, auxiliary and
+ * positional weights).  The options are the bits of Flags, so that each
+ * combination of them, which is fixed for a mini-batch, gets its own loop
+ * without the per-alignment tests.
+ */
+template <uint32_t Flags, typename AlnT>
+void scoreAlignmentGroup_(
+        AlignmentGroup<AlnT>& alnGroup,
+        std::vector<Transcript>& transcripts,
+        bool initialRound,
+        CachedFragmentLengthPMF& fragLengthPMF,
+        const salmon::utils::AlignFormatProbs& formatProbs,
+        std::vector<FragmentStartPositionDistribution>& fragStartDists,
+        FragmentScratch& scratch,
+        bool& transcriptUnique) {
+    using salmon::math::LOG_0;
+    using salmon::math::LOG_1;
+
+    auto& txpIDs = scratch.txpIDs;
+    auto& auxProbs = scratch.auxProbs;
+    auto& posProbs = scratch.posProbs;
+    auto& logProbs = scratch.logProbs;
+    auto firstTranscriptID = alnGroup.alignments().front().transcriptID();
+    uint32_t prevTxpID{0};
+
+    // For each alignment of this read
+    for (auto& aln : alnGroup.alignments()) {
+        auto transcriptID = aln.transcriptID();
+        auto& transcript = transcripts[transcriptID];
+        transcriptUnique = transcriptUnique and (transcriptID == firstTranscriptID);
+
+        double refLength = transcript.RefLength > 0 ? transcript.RefLength : 1.0;
+        double coverage = aln.score();
+        double logFragCov = (coverage > 0) ? std::log(coverage) : LOG_1;
+
+        // The alignment probability is the product of a
+        // transcript-level term (based on abundance and) an
+        // alignment-level term.
+        double logRefLength = (Flags & SCORE_REF_LENGTH) ?
+            std::log(transcript.RefLength) : transcript.getCachedLogEffectiveLength();
+
+        double transcriptLogCount = transcript.mass(initialRound);
+
+        // If the transcript had a non-zero count (including pseudocount)
+        if (std::abs(transcriptLogCount) != LOG_0 ) {
+
+            // The probability of drawing a fragment of this length;
+            double logFragProb = LOG_1;
+            if ((Flags & SCORE_FRAG_LENGTH) and aln.fragLength() > 0) {
+                logFragProb = fragLengthPMF.pmf(static_cast<size_t>(aln.fragLength()));
+            }
+
+            // The probability that the fragments align to the given strands in the
+            // given orientations.
+            double logAlignCompatProb = (Flags & SCORE_READ_COMPAT) ?
+                formatProbs(aln.libFormat(), aln.fwd, aln.mateStatus) : LOG_1;
+
+            // Allow for a non-uniform fragment start position distribution
+            double startPosProb{-logRefLength};
+            double fragStartLogNumerator{salmon::math::LOG_1};
+            double fragStartLogDenominator{salmon::math::LOG_1};
+
+            if (Flags & SCORE_START_POS) {
+                auto hitPos = aln.hitPos();
+                if (hitPos < refLength) {
+                    auto& fragStartDist = fragStartDists[transcript.lengthClassIndex()];
+                    // Get the log(numerator) and log(denominator) for the fragment start position
+                    // probability.
+                    bool nonZeroProb = fragStartDist.logNumDenomMass(hitPos, refLength, logRefLength,
+                            fragStartLogNumerator, fragStartLogDenominator);
+                    // Set the overall probability.
+                    startPosProb = (nonZeroProb) ?
+                        fragStartLogNumerator - fragStartLogDenominator :
+                        salmon::math::LOG_0;
+                }
+            }
+
+            // Increment the count of this type of read that we've seen
+            if (Flags & SCORE_UPDATE_COUNTS) { scratch.libTypeCounts.observe(aln.libFormat()); }
+
+            // The total auxiliary probabilty is the product (sum in log-space) of
+            // The start position probability
+            // The fragment length probabilty
+            // The mapping score (coverage) probability
+            // The fragment compatibility probability
+            // The bias probability
+            double auxProb =  logFragProb + logFragCov +
+                              logAlignCompatProb;
+
+            aln.logProb = transcriptLogCount + auxProb + startPosProb;
+
+            // If this alignment had a zero probability, then skip it
+            if (std::abs(aln.logProb) == LOG_0) { continue; }
+
+            logProbs.push_back(aln.logProb);
+
+            if ((Flags & SCORE_UPDATE_COUNTS) and scratch.markObserved(transcriptID)) {
+                if (Flags & SCORE_LOCAL_UPDATES) {
+                    scratch.transcriptUpdates.addTotalCount(transcriptID, 1);
+                } else {
+                    transcripts[transcriptID].addTotalCount(1);
+                }
+            }
+            // EQCLASS
+            if (transcriptID < prevTxpID) { std::cerr << "[ERROR] Transcript IDs are not in sorted order; please report this bug on GitHub!\n"; }
+            prevTxpID = transcriptID;
+            txpIDs.push_back(transcriptID);
+            auxProbs.push_back(auxProb);
+
+            // If we're using the fragment start position distribution
+            // remember *the numerator* of (x / cdf(effLen / len)) where
+            // x = cdf(p+1 / len) - cdf(p / len)
+            if (Flags & SCORE_POS_WEIGHTS) { posProbs.push_back(std::exp(fragStartLogNumerator)); }
+        } else {
+            aln.logProb = LOG_0;
+        }
+    }
+}
+
+/**
+ * The instantiation of scoreAlignmentGroup_ for the (runtime) flags; the
+ * bits are peeled off from the highest.
+ */
+template <typename AlnT, int Bit, uint32_t Flags>
+struct AlignmentScoringKernel {
+    using Fn = decltype(&scoreAlignmentGroup_<0, AlnT>);
+    static Fn select(uint32_t flags) {
+        return (flags & (1u << Bit)) ?
+            AlignmentScoringKernel<AlnT, Bit - 1, Flags | (1u << Bit)>::select(flags) :
+            AlignmentScoringKernel<AlnT, Bit - 1, Flags>::select(flags);
+    }
+};
+
+template <typename AlnT, uint32_t Flags>
+struct AlignmentScoringKernel<AlnT, -1, Flags> {
+    using Fn = decltype(&scoreAlignmentGroup_<0, AlnT>);
+    static Fn select(uint32_t) { return &scoreAlignmentGroup_<Flags, AlnT>; }
+};
 
 template <typename AlnT>
 void processMiniBatch(
@@ -173,8 +355,13 @@ void processMiniBatch(
         std::atomic<uint64_t>& numAssignedFragments,
         std::default_random_engine& randEng,
         bool initialRound,
-        std::atomic<bool>& burnedIn
+        std::atomic<bool>& burnedIn,
+        FragmentScratch& scratch
         ) {
+    SALMON_TRACE_SCOPE("processMiniBatch");
+    SALMON_ALLOC_SCOPE("processMiniBatch");
+    HardwareCounters::Region hwRegion(salmonOpts.profiler ? salmonOpts.profiler->hardwareCounters() : nullptr,
+                                      "processMiniBatch");
 
     using salmon::math::LOG_0;
     using salmon::math::LOG_1;
@@ -189,7 +376,6 @@ void processMiniBatch(
     size_t localNumAssignedFragments{0};
     size_t priorNumAssignedFragments{numAssignedFragments};
     std::uniform_real_distribution<> uni(0.0, 1.0 + std::numeric_limits<double>::min());
-    std::vector<uint64_t> libTypeCounts(LibraryFormat::maxLibTypeID() + 1);
 
     std::vector<FragmentStartPositionDistribution>& fragStartDists =
         readExp.fragmentStartPositionDistributions();
@@ -206,10 +392,58 @@ void processMiniBatch(
     bool noFragLenFactor{salmonOpts.noFragLenFactor};
 
     const auto expectedLibraryFormat = readLib.format();
+    salmon::utils::AlignFormatProbs formatProbs(expectedLibraryFormat, salmonOpts.incompatPrior);
     uint64_t zeroProbFrags{0};
 
+    // The options that the scoring of the alignments depends on are fixed
+    // for the mini-batch, so its kernel is chosen once here (if another
+    // thread completes the burn-in meanwhile, this thread's next mini-batch
+    // sees it)
+    bool isBurnedIn = burnedIn;
+    uint32_t scoringFlags{0};
+    if (salmonOpts.noEffectiveLengthCorrection or !isBurnedIn) { scoringFlags |= SCORE_REF_LENGTH; }
+    if (isBurnedIn and useFragLengthDist and !noFragLenFactor) { scoringFlags |= SCORE_FRAG_LENGTH; }
+    if (useFSPD and isBurnedIn) { scoringFlags |= SCORE_START_POS; }
+    if (useFSPD) { scoringFlags |= SCORE_POS_WEIGHTS; }
+    if (useReadCompat) { scoringFlags |= SCORE_READ_COMPAT; }
+    if (updateCounts) { scoringFlags |= SCORE_UPDATE_COUNTS; }
+    if (salmonOpts.threadLocalTranscriptUpdates) { scoringFlags |= SCORE_LOCAL_UPDATES; }
+    auto scoreGroup = AlignmentScoringKernel<AlnT, 6, 0>::select(scoringFlags);
+
     //EQClass
     EquivalenceClassBuilder& eqBuilder = readExp.equivalenceClassBuilder();
+    // If requested, accumulate the equivalence classes for this mini-batch
+    // locally and merge them into the shared builder once at the end.
+    bool threadLocalEqClasses = salmonOpts.threadLocalEqClasses;
+    LocalEquivalenceClassBuilder& localEqBuilder = scratch.localEqBuilder;
+    // Likewise for the updates to the transcript masses and counts
+    bool threadLocalTranscriptUpdates = salmonOpts.threadLocalTranscriptUpdates;
+    LocalTranscriptUpdates& txpUpdates = scratch.transcriptUpdates;
+    // and the merges and updates of the transcript clusters
+    ClusterForest::LocalBatch clusterUpdates(clusterForest);
+    // Fragment lengths are staged per-thread and added to the shared
+    // distribution once all of the fragments in this mini-batch have
+    // been processed (the distribution is not consulted until burn-in).
+    LocalFragmentLengthDistribution& localFragLengthDist = scratch.localFragLengthDist;
+    // The fragment length probabilities are read from this thread's table
+    CachedFragmentLengthPMF& fragLengthPMF = scratch.fragLengthPMF;
+    if (useFragLengthDist) { fragLengthPMF.refresh(); }
+
+    // Re-usable (per-thread) equivalence class buffers
+    auto& txpIDs = scratch.txpIDs;
+    auto& auxProbs = scratch.auxProbs;
+    auto& posProbs = scratch.posProbs;
+    auto& logProbs = scratch.logProbs;
+    // The equivalence classes of the fragments with a single alignment
+    UniqueFragmentCounts& uniqueCounts = scratch.uniqueCounts;
+    // The strand and GC masses of this mini-batch's fragments are summed in
+    // linear space (all of its fragments share the forgetting mass, and a
+    // mini-batch's sums can't overflow), and added to the (log-space)
+    // observed masses once at the end of the mini-batch, rather than with a
+    // log-add per alignment
+    double batchFwd{0.0};
+    double batchRC{0.0};
+    std::vector<double> batchGCMass(gcBiasCorrect ? observedGCMass.size() : 0, 0.0);
 
     // Build reverse map from transcriptID => hit id
     using HitID = uint32_t;
@@ -221,6 +455,24 @@ void processMiniBatch(
     fmCalc.getLogMassAndTimestep(logForgettingMass, currentMinibatchTimestep);
 
     double startingCumulativeMass = fmCalc.cumulativeLogMassAt(firstTimestepOfRound);
+
+    // Credit a fragment unique to transcriptID to its cluster
+    auto updateUniqueCluster = [&](uint32_t transcriptID) -> void {
+        if (updateCounts) {
+            if (threadLocalTranscriptUpdates) {
+                txpUpdates.addUniqueCount(transcriptID, 1);
+            } else {
+                transcripts[transcriptID].addUniqueCount(1);
+            }
+        }
+        if (threadLocalTranscriptUpdates) {
+            clusterUpdates.updateCluster(transcriptID, 1, updateCounts);
+        } else {
+            clusterForest.updateCluster(transcriptID, 1.0, logForgettingMass, updateCounts);
+        }
+    };
+
+    auto assignStart = LocalStageTimings::now();
     int i{0};
     {
         // Iterate over each group of alignments (a group consists of all alignments reported
@@ -237,7 +489,7 @@ void processMiniBatch(
             bool transcriptUnique{true};
 
             auto firstTranscriptID = alnGroup.alignments().front().transcriptID();
-            std::unordered_set<size_t> observedTranscripts;
+            scratch.clear();
 
             // New incompat. handling.
             /**
@@ -261,137 +513,77 @@ void processMiniBatch(
             double auxDenomFinal = salmon::math::LOG_0;
             **/
 
-            std::vector<uint32_t> txpIDs;
-            std::vector<double> auxProbs;
-	        std::vector<double> posProbs;
             double auxDenom= salmon::math::LOG_0;
 
-            uint32_t numInGroup{0};
-            uint32_t prevTxpID{0};
+            // A fragment with a single alignment (most uniquely mapping
+            // fragments) has all of its mass on it; it is scored only to
+            // find whether it has a non-zero probability (and its
+            // positional weight), and needs neither the normalization nor
+            // a label of its own in the equivalence class table.
+            if (alnGroup.size() == 1) {
+                auto& aln = alnGroup.alignments().front();
+                scoreGroup(alnGroup, transcripts, initialRound, fragLengthPMF, formatProbs,
+                           fragStartDists, scratch, transcriptUnique);
+                if (logProbs.empty()) {
+                    ++zeroProbFrags;
+                    continue;
+                }
+                ++localNumAssignedFragments;
+                aln.logProb = LOG_1;
 
-            // For each alignment of this read
-            for (auto& aln : alnGroup.alignments()) {
-                auto transcriptID = aln.transcriptID();
-                auto& transcript = transcripts[transcriptID];
-                transcriptUnique = transcriptUnique and (transcriptID == firstTranscriptID);
-
-                double refLength = transcript.RefLength > 0 ? transcript.RefLength : 1.0;
-                double coverage = aln.score();
-                double logFragCov = (coverage > 0) ? std::log(coverage) : LOG_1;
-
-                // The alignment probability is the product of a
-                // transcript-level term (based on abundance and) an
-                // alignment-level term.
-                double logRefLength{salmon::math::LOG_0};
-                if (salmonOpts.noEffectiveLengthCorrection or !burnedIn) {
-                    logRefLength = std::log(transcript.RefLength);
-                } else {
-                    logRefLength = transcript.getCachedLogEffectiveLength();
+                if (!scratch.deferEqClasses) {
+                    uniqueCounts.add(firstTranscriptID, useFSPD ? posProbs.front() : 1.0);
                 }
+                if (scratch.eqClassesOnly) { continue; }
 
-                double transcriptLogCount = transcript.mass(initialRound);
+                auto& transcript = transcripts[firstTranscriptID];
+                if (threadLocalTranscriptUpdates) {
+                    txpUpdates.addMass(firstTranscriptID, 1.0);
+                } else {
+                    transcript.addMass(logForgettingMass);
+                }
 
-                // If the transcript had a non-zero count (including pseudocount)
-                if (std::abs(transcriptLogCount) != LOG_0 ) {
+                // Each adds a mass of 1 to its strand; these are summed,
+                // and added to the strand masses at the end of the mini-batch
+                if (aln.libFormat().type == ReadType::PAIRED_END) {
+                    if (aln.fwd) { batchFwd += 1.0; } else { batchRC += 1.0; }
+                } else if (aln.libFormat().type == ReadType::SINGLE_END) {
+                    if (aln.libFormat().strandedness == ReadStrandedness::S) { batchFwd += 1.0; } else { batchRC += 1.0; }
+                }
 
-                    // The probability of drawing a fragment of this length;
-                    double logFragProb = LOG_1;
-                    if (burnedIn and useFragLengthDist and aln.fragLength() > 0) {
-                        logFragProb = fragLengthDist.pmf(static_cast<size_t>(aln.fragLength()));
+                if (gcBiasCorrect and aln.libFormat().type == ReadType::PAIRED_END) {
+                    int32_t start = std::min(aln.pos, aln.matePos);
+                    int32_t stop = start + aln.fragLen - 1;
+                    if (start > 0 and stop < transcript.RefLength) {
+                        int32_t gcFrac = transcript.gcFrac(start, stop);
+                        batchGCMass[gcFrac] += 1.0;
                     }
+                }
 
-                    // TESTING
-                    if (noFragLenFactor) { logFragProb = LOG_1; }
-
-                    // TODO: Maybe take the fragment length distribution into account
-                    // for single-end fragments?
-
-                    // The probability that the fragments align to the given strands in the
-                    // given orientations.
-                    double logAlignCompatProb =
-                        (useReadCompat) ?
-                        (salmon::utils::logAlignFormatProb(
-                            aln.libFormat(),
-                            expectedLibraryFormat,
-                            static_cast<int32_t>(aln.pos),
-                            aln.fwd, aln.mateStatus, salmonOpts.incompatPrior)
-                         ) : LOG_1;
-
-                    /** New compat handling
-                    // True if the read is compatible with the
-                    // expected library type; false otherwise.
-                    bool compat = ignoreCompat;
-                    if (!compat) {
-                        if (aln.mateStatus == rapmap::utils::MateStatus::PAIRED_END_PAIRED) {
-                            compat = salmon::utils::compatibleHit(
-                                    expectedLibType, observedLibType);
-                        } else {
-                            int32_t pos = static_cast<int32_t>(aln.pos);
-                            compat = salmon::utils::compatibleHit(
-                                    expectedLibraryFormat, pos,
-                                    aln.fwd, aln.mateStatus);
-                        }
+                // The fragment is always sampled for training the models
+                if (!burnedIn) {
+                    double fragLength = aln.fragLength();
+                    if (useFragLengthDist and fragLength > 0.0) {
+                        localFragLengthDist.addVal(fragLength);
                     }
-                    **/
-
-                    // Allow for a non-uniform fragment start position distribution
-                    double startPosProb{-logRefLength};
-                    double fragStartLogNumerator{salmon::math::LOG_1};
-                    double fragStartLogDenominator{salmon::math::LOG_1};
-
-                    auto hitPos = aln.hitPos();
-                    if (useFSPD and burnedIn and hitPos < refLength) {
+                    if (useFSPD) {
                         auto& fragStartDist = fragStartDists[transcript.lengthClassIndex()];
-                        // Get the log(numerator) and log(denominator) for the fragment start position
-                        // probability.
-                        bool nonZeroProb = fragStartDist.logNumDenomMass(hitPos, refLength, logRefLength,
-                                fragStartLogNumerator, fragStartLogDenominator);
-                        // Set the overall probability.
-                        startPosProb = (nonZeroProb) ?
-                            fragStartLogNumerator - fragStartLogDenominator :
-                            salmon::math::LOG_0;
+                        fragStartDist.addVal(aln.hitPos(), transcript.RefLength, logForgettingMass);
                     }
+                }
 
-                    // Increment the count of this type of read that we've seen
-                    ++libTypeCounts[aln.libFormat().formatID()];
-
-                    // The total auxiliary probabilty is the product (sum in log-space) of
-                    // The start position probability
-                    // The fragment length probabilty
-                    // The mapping score (coverage) probability
-                    // The fragment compatibility probability
-                    // The bias probability
-                    double auxProb =  logFragProb + logFragCov +
-                                      logAlignCompatProb;
-
-                    aln.logProb = transcriptLogCount + auxProb + startPosProb;
-
-                    // If this alignment had a zero probability, then skip it
-                    if (std::abs(aln.logProb) == LOG_0) { continue; }
+                updateUniqueCluster(firstTranscriptID);
+                continue;
+            }
 
-                    sumOfAlignProbs = logAdd(sumOfAlignProbs, aln.logProb);
+            // Score each alignment of this read (with the kernel for this mini-batch's options)
+            scoreGroup(alnGroup, transcripts, initialRound, fragLengthPMF, formatProbs,
+                       fragStartDists, scratch, transcriptUnique);
 
-                    if (updateCounts and
-                        observedTranscripts.find(transcriptID) == observedTranscripts.end()) {
-                        transcripts[transcriptID].addTotalCount(1);
-                        observedTranscripts.insert(transcriptID);
-                    }
-                    // EQCLASS
-                    if (transcriptID < prevTxpID) { std::cerr << "[ERROR] Transcript IDs are not in sorted order; please report this bug on GitHub!\n"; }
-                    prevTxpID = transcriptID;
-                    txpIDs.push_back(transcriptID);
-                    auxProbs.push_back(auxProb);
-                    auxDenom = salmon::math::logAdd(auxDenom, auxProb);
-
-                    // If we're using the fragment start position distribution
-                    // remember *the numerator* of (x / cdf(effLen / len)) where
-                    // x = cdf(p+1 / len) - cdf(p / len)
-                    if (useFSPD) { posProbs.push_back(std::exp(fragStartLogNumerator)); }
-                } else {
-                    aln.logProb = LOG_0;
-
-                }
-            }
+            // Normalize over all of the (non-zero probability) alignments
+            // of this fragment at once.
+            sumOfAlignProbs = salmon::math::logSumExp(logProbs.data(), logProbs.size());
+            auxDenom = salmon::math::logSumExp(auxProbs.data(), auxProbs.size());
 
             // If this fragment has a zero probability,
             // go to the next one
@@ -408,38 +600,52 @@ void processMiniBatch(
                 p = std::exp(p - auxDenom);
                 auxProbSum += p;
             }
-            if (txpIDs.size() > 0) {
-               TranscriptGroup tg(txpIDs);
-               eqBuilder.addGroup(std::move(tg), auxProbs, posProbs);
+            if (txpIDs.size() > 0 and !scratch.deferEqClasses) {
+               auto addGroupStart = LocalStageTimings::now();
+               SALMON_ALLOC_SCOPE("addGroup");
+               const TranscriptGroup& tg = scratch.eqLabel();
+               if (threadLocalEqClasses) {
+                   localEqBuilder.addGroup(tg, auxProbs, posProbs);
+               } else {
+                   eqBuilder.addGroup(tg, auxProbs, posProbs);
+               }
+               scratch.timings.addGroupNs += LocalStageTimings::elapsedNs(addGroupStart);
             }
+            // A replayed fragment has already contributed everything else
+            if (scratch.eqClassesOnly) { continue; }
 
             // normalize the hits
             for (auto& aln : alnGroup.alignments()) {
                 if (std::abs(aln.logProb) == LOG_0) { continue; }
                 // Normalize the log-probability of this alignment
                 aln.logProb -= sumOfAlignProbs;
+                double prob = std::exp(aln.logProb);
                 // Get the transcript referenced in this alignment
                 auto transcriptID = aln.transcriptID();
                 auto& transcript = transcripts[transcriptID];
 
                 // Add the new mass to this transcript
-                double newMass = logForgettingMass + aln.logProb;
-                transcript.addMass( newMass );
+                if (threadLocalTranscriptUpdates) {
+                    txpUpdates.addMass(transcriptID, prob);
+                } else {
+                    double newMass = logForgettingMass + aln.logProb;
+                    transcript.addMass( newMass );
+                }
 
                 // Paired-end
                 if (aln.libFormat().type == ReadType::PAIRED_END) {
                     // TODO: Is this right for *all* library types?
                     if (aln.fwd) {
-                        obsFwd = salmon::math::logAdd(obsFwd, aln.logProb);
+                        batchFwd += prob;
                     } else {
-                        obsRC = salmon::math::logAdd(obsRC, aln.logProb);
+                        batchRC += prob;
                     }
                 } else if (aln.libFormat().type == ReadType::SINGLE_END) {
 		  // Single-end or orphan
                     if (aln.libFormat().strandedness == ReadStrandedness::S) {
-                        obsFwd = salmon::math::logAdd(obsFwd, aln.logProb);
+                        batchFwd += prob;
                     } else {
-                        obsRC = salmon::math::logAdd(obsRC, aln.logProb);
+                        batchRC += prob;
                     }
                 }
 
@@ -451,16 +657,16 @@ void processMiniBatch(
                     if (start > 0 and stop < transcript.RefLength) {
                         int32_t gcFrac = transcript.gcFrac(start, stop);
                         // Add this fragment's contribution
-                        observedGCMass[gcFrac] = salmon::math::logAdd(observedGCMass[gcFrac], aln.logProb + logForgettingMass);
+                        batchGCMass[gcFrac] += prob;
                     }
                 }
 		double r = uni(randEng);
-		if (!burnedIn and r < std::exp(aln.logProb)) {
+		if (!burnedIn and r < prob) {
 			//errMod.update(aln, transcript, aln.logProb, logForgettingMass);
 			double fragLength = aln.fragLength();
 			if (useFragLengthDist and fragLength > 0.0) {
 				//if (aln.fragType() == ReadType::PAIRED_END) {
-				fragLengthDist.addVal(fragLength, logForgettingMass);
+				localFragLengthDist.addVal(fragLength);
 			}
 			if (useFSPD) {
 				auto hitPos = aln.hitPos();
@@ -487,14 +693,12 @@ void processMiniBatch(
 
 	    // update the single target transcript
 	    if (transcriptUnique) {
-		if (updateCounts) {
-                    transcripts[firstTranscriptID].addUniqueCount(1);
-                }
-                clusterForest.updateCluster(
-                        firstTranscriptID,
-                        1.0,
-                        logForgettingMass, updateCounts);
-            } else { // or the appropriate clusters
+                updateUniqueCluster(firstTranscriptID);
+            } else if (threadLocalTranscriptUpdates) { // or the appropriate clusters
+                clusterUpdates.mergeClusters(alnGroup.alignments().begin(), alnGroup.alignments().end(),
+                                             [](const AlnT& aln) { return aln.transcriptID(); });
+                clusterUpdates.updateCluster(alnGroup.alignments().front().transcriptID(), 1, updateCounts);
+            } else {
                 clusterForest.mergeClusters<AlnT>(alnGroup.alignments().begin(), alnGroup.alignments().end());
                 clusterForest.updateCluster(
                         alnGroup.alignments().front().transcriptID(),
@@ -505,6 +709,32 @@ void processMiniBatch(
             } // end read group
         }// end timer
 
+        // Merge this mini-batch's equivalence classes into the shared builder
+        if (threadLocalEqClasses) {
+            SALMON_TRACE_SCOPE("addGroup flush");
+            SALMON_ALLOC_SCOPE("addGroup");
+            localEqBuilder.flush();
+        }
+        if (!uniqueCounts.empty()) {
+            SALMON_ALLOC_SCOPE("addGroup");
+            uniqueCounts.flush(eqBuilder, useFSPD);
+        }
+        // the strand and GC masses of the mini-batch,
+        if (batchFwd > 0.0) { obsFwd = salmon::math::logAdd(obsFwd, std::log(batchFwd)); }
+        if (batchRC > 0.0) { obsRC = salmon::math::logAdd(obsRC, std::log(batchRC)); }
+        for (size_t b = 0; b < batchGCMass.size(); ++b) {
+            if (batchGCMass[b] > 0.0) {
+                observedGCMass[b] = salmon::math::logAdd(observedGCMass[b], logForgettingMass + std::log(batchGCMass[b]));
+            }
+        }
+        // and the transcript updates into the transcripts,
+        if (threadLocalTranscriptUpdates) {
+            txpUpdates.flush(transcripts, logForgettingMass);
+            clusterUpdates.flush(logForgettingMass);
+        }
+        // and the fragment lengths into the shared distribution
+        localFragLengthDist.flush(logForgettingMass);
+
 	if (zeroProbFrags > 0) {
             log->warn("Minibatch contained {} "
                       "0 probability fragments", zeroProbFrags);
@@ -523,14 +753,119 @@ void processMiniBatch(
             // thread will set burnedIn to true.
             readExp.updateTranscriptLengthsAtomic(burnedIn);
         }
-        if (initialRound) {
-            readLib.updateLibTypeCounts(libTypeCounts);
-        }
+        scratch.timings.assignmentNs += LocalStageTimings::elapsedNs(assignStart);
+        ++scratch.timings.numMiniBatches;
 }
 
 
 /// START QUASI
 
+/**
+ * The capacity of each mapping thread's sample of bias k-mer contexts
+ * (see BiasSampleReservoir): twice the thread's share of the experiment's
+ * sample, but no more than the whole sample.
+ */
+inline size_t threadBiasSampleCapacity(ReadExperiment& readExp, SalmonOpts& salmonOpts) {
+    size_t total = readExp.biasSamples().capacity();
+    size_t numThreads = std::max(salmonOpts.numThreads, uint32_t(1));
+    return std::min(total, 2 * ((total + numThreads - 1) / numThreads) + 1024);
+}
+
+/**
+ * The state needed to map reads against one extension of the quasi index
+ * (see salmon index --extend); the transcripts of the extension are
+ * numbered from tidOffset.
+ */
+template <typename RapMapIndexT>
+struct QuasiExtensionMapper {
+    QuasiExtensionMapper(RapMapIndexT* idx, uint32_t offset) :
+        hitCollector(idx), saSearcher(idx), tidOffset(offset) {}
+
+    SACollector<RapMapIndexT> hitCollector;
+    SASearcher<RapMapIndexT> saSearcher;
+    uint32_t tidOffset;
+    std::vector<QuasiAlignment> hits;
+};
+
+template <typename RapMapIndexT>
+using QuasiExtensionMappers = std::vector<std::unique_ptr<QuasiExtensionMapper<RapMapIndexT>>>;
+
+template <typename RapMapIndexT>
+QuasiExtensionMappers<RapMapIndexT> makeQuasiExtensionMappers(ReadExperiment& readExp,
+                                                              RapMapIndexT* qidx) {
+    QuasiExtensionMappers<RapMapIndexT> mappers;
+    uint32_t offset = qidx->txpNames.size();
+    for (auto& ext : readExp.getIndex()->quasiExtensions(qidx)) {
+        mappers.emplace_back(new QuasiExtensionMapper<RapMapIndexT>(ext.get(), offset));
+        offset += ext->txpNames.size();
+    }
+    return mappers;
+}
+
+/**
+ * Append the hits of read against each of the extensions of the index to
+ * hits.  Since the transcripts of each extension are numbered after those
+ * of the index (and of the previous extensions), hits that were ordered by
+ * transcript remain so.  Returns true if any of the extensions had a hit.
+ */
+template <typename RapMapIndexT>
+bool collectExtensionHits(QuasiExtensionMappers<RapMapIndexT>& mappers,
+                          std::string& read,
+                          std::vector<QuasiAlignment>& hits,
+                          MateStatus mateStatus) {
+    bool anyHits{false};
+    for (auto& m : mappers) {
+        m->hits.clear();
+        if (m->hitCollector(read, m->hits, m->saSearcher, mateStatus, true)) {
+            anyHits = true;
+            for (auto& h : m->hits) {
+                h.tid += m->tidOffset;
+                hits.push_back(h);
+            }
+        }
+    }
+    return anyHits;
+}
+
+/**
+ * Collect the hits of read (against the index and its extensions) into
+ * hits, or, if the same sequence was mapped recently by this thread, copy
+ * them from its cache.  Returns true if there were any.
+ *
+ * If maxHits > 0, the read will be discarded if it has more than maxHits
+ * hits; once the index alone gives it that many, it isn't mapped against
+ * the extensions (which could only add to them).
+ */
+template <typename RapMapIndexT>
+bool collectReadHits(SACollector<RapMapIndexT>& hitCollector,
+                     SASearcher<RapMapIndexT>& saSearcher,
+                     QuasiExtensionMappers<RapMapIndexT>& extMappers,
+                     ReadHitCache<QuasiAlignment>* hitCache,
+                     std::string& read,
+                     std::vector<QuasiAlignment>& hits,
+                     MateStatus mateStatus,
+                     size_t maxHits = 0) {
+    bool found{false};
+    uint8_t status = static_cast<uint8_t>(mateStatus);
+    if (hitCache and hitCache->find(read, status, hits, found)) { return found; }
+    found = hitCollector(read, hits, saSearcher, mateStatus, true);
+    bool tooManyHits = (maxHits > 0 and hits.size() > maxHits);
+    if (!extMappers.empty() and !tooManyHits and
+        collectExtensionHits(extMappers, read, hits, mateStatus)) { found = true; }
+    if (hitCache) { hitCache->insert(read, status, hits, found); }
+    return found;
+}
+
+// A mini-batch of mapped fragments on its way from a mapping thread to the
+// inference threads (see InferencePipeline.hpp)
+struct QuasiMiniBatch {
+    explicit QuasiMiniBatch(size_t size) : hits(size) {}
+    AlnGroupVec<QuasiAlignment> hits;
+    size_t rangeSize{0};
+    bool deferEqClasses{false};
+};
+using QuasiInferencePipeline = InferencePipeline<QuasiMiniBatch>;
+
 // To use the parser in the following, we get "jobs" until none is
 // available. A job behaves like a pointer to the type
 // jellyfish::sequence_list (see whole_sequence_parser.hpp).
@@ -555,11 +890,13 @@ void processReadsQuasi(paired_parser* parser,
 	           std::mutex& iomutex,
                bool initialRound,
                std::atomic<bool>& burnedIn,
-               volatile bool& writeToCache) {
+               volatile bool& writeToCache,
+               MappingCacheWriter* cacheWriter,
+               QuasiInferencePipeline* pipeline) {
 
     	// ERROR
 	salmonOpts.jointLog->error("MEM-mapping cannot be used with the Quasi index --- please report this bug on GitHub");
-	std::exit(1);
+	salmon::utils::exitRun(1);
 }
 
 template <typename RapMapIndexT>
@@ -583,10 +920,12 @@ void processReadsQuasi(single_parser* parser,
 	           std::mutex& iomutex,
                bool initialRound,
                std::atomic<bool>& burnedIn,
-               volatile bool& writeToCache) {
+               volatile bool& writeToCache,
+               MappingCacheWriter* cacheWriter,
+               QuasiInferencePipeline* pipeline) {
     	// ERROR
 	salmonOpts.jointLog->error("MEM-mapping cannot be used with the Quasi index --- please report this bug on GitHub");
-	std::exit(1);
+	salmon::utils::exitRun(1);
 }
 
 template <typename RapMapIndexT>
@@ -610,20 +949,39 @@ void processReadsQuasi(paired_parser* parser,
 	           std::mutex& iomutex,
                bool initialRound,
                std::atomic<bool>& burnedIn,
-               volatile bool& writeToCache) {
+               volatile bool& writeToCache,
+               MappingCacheWriter* cacheWriter,
+               QuasiInferencePipeline* pipeline) {
   uint64_t count_fwd = 0, count_bwd = 0;
-  // Seed with a real random value, if available
-  std::random_device rd;
-
-  // Create a random uniform distribution
-  std::default_random_engine eng(rd());
+  // Each mapping thread has its own stream of random numbers (see
+  // RandomStreams.hpp)
+  uint64_t streamIndex = salmon::utils::nextMappingStreamIndex();
+  std::default_random_engine eng(salmon::utils::streamSeed(
+              salmonOpts, salmon::utils::RandomStream::MAPPING, 2 * streamIndex));
 
-  uint64_t prevObservedFrags{1};
   uint64_t leftHitCount{0};
   uint64_t hitListCount{0};
   salmon::utils::ShortFragStats shortFragStats;
 
   auto& readBias = readExp.readBias();
+  // This thread's sample of the k-mer contexts of its fragments, which is
+  // only collected during the first pass
+  bool sampleBias = initialRound and salmonOpts.biasCorrect;
+  BiasSampleReservoir biasSamples(sampleBias ? threadBiasSampleCapacity(readExp, salmonOpts) : 0,
+                                  (static_cast<uint64_t>(eng()) << 32) | streamIndex);
+
+  // Re-usable buffers for processing the fragments of each mini-batch
+  FragmentScratch scratch(readExp.equivalenceClassBuilder(), fragLengthDist, readExp.stageTimings());
+
+  // If we're pipelining, each mini-batch is assigned (in a TBB task) from
+  // its own buffer while the next mini-batch is being mapped.  At most one
+  // mini-batch per mapping thread is in flight at any time.
+  bool pipelineMiniBatches = salmonOpts.pipelineMiniBatches and (pipeline == nullptr);
+  AlnGroupVec<QuasiAlignment> assignVec(pipelineMiniBatches ? structureVec.size() : 0);
+  FragmentScratch assignScratch(readExp.equivalenceClassBuilder(), fragLengthDist, readExp.stageTimings());
+  std::default_random_engine assignEng(salmon::utils::streamSeed(
+              salmonOpts, salmon::utils::RandomStream::MAPPING, 2 * streamIndex + 1));
+  tbb::task_group assignTasks;
 
   auto expectedLibType = rl.format();
 
@@ -642,19 +1000,60 @@ void processReadsQuasi(paired_parser* parser,
   size_t readLenRight{0};
   SACollector<RapMapIndexT> hitCollector(qidx);
   SASearcher<RapMapIndexT> saSearcher(qidx);
+  auto extMappers = makeQuasiExtensionMappers(readExp, qidx);
   std::vector<QuasiAlignment> leftHits;
   std::vector<QuasiAlignment> rightHits;
   rapmap::utils::HitCounters hctr;
+  // If the mappings are being written (--writeMappings), this thread's records
+  std::unique_ptr<MappingSAMBuffer> samBuffer(
+          salmonOpts.mappingWriter ? new MappingSAMBuffer(salmonOpts.mappingWriter.get()) : nullptr);
+  // If the names of the unmapped fragments are being written (--writeUnmappedNames), this
+  // thread's names; they're only written in the first pass over the reads
+  std::unique_ptr<UnmappedNameBuffer> unmappedNames(
+          (initialRound and salmonOpts.unmappedNameWriter) ?
+          new UnmappedNameBuffer(salmonOpts.unmappedNameWriter.get()) : nullptr);
+  HardwareCounters* hwCounters = salmonOpts.profiler ? salmonOpts.profiler->hardwareCounters() : nullptr;
+  MappingConvergenceMonitor* monitor = salmonOpts.convergenceMonitor.get();
+  AbundanceSnapshotWriter* snapshots = salmonOpts.snapshotWriter.get();
+  // The hits of the reads this thread mapped most recently (--readHitCache)
+  std::unique_ptr<ReadHitCache<QuasiAlignment>> hitCache(
+          salmonOpts.readHitCacheSize > 0 ? new ReadHitCache<QuasiAlignment>(salmonOpts.readHitCacheSize) : nullptr);
+  // Checks the right mates against the hits of the left ones (--mateVerify)
+  std::unique_ptr<MateVerifier> mateVerifier(
+          salmonOpts.mateVerifyMaxHits > 0 ? new MateVerifier(minK, salmonOpts.fragLenDistMax) : nullptr);
+  // Trims the reads before they're mapped (--trimAdapters, --trimQuality, --trimPolyA)
+  ReadTrimmer* trimmer = salmonOpts.readTrimmer.get();
+  ReadTrimStats trimStats;
 
   while(true) {
+    auto parseStart = LocalStageTimings::now();
+    SALMON_TRACE_BEGIN(parseEvent, "parse job");
+    SALMON_ALLOC_BEGIN(parseScope, "parsing");
     typename paired_parser::job j(*parser); // Get a job from the parser: a bunch of reads (at most max_read_group)
+    SALMON_TRACE_END(parseEvent);
+    SALMON_ALLOC_END(parseScope);
+    scratch.timings.parseWaitNs += LocalStageTimings::elapsedNs(parseStart);
     if(j.is_empty()) break;           // If got nothing, quit
+    // Once mapping has stopped early, the rest of the input is only counted (or abandoned)
+    if (monitor and monitor->stopped()) {
+        if (!monitor->countSkipped()) { break; }
+        monitor->addSkipped(j->nb_filled);
+        continue;
+    }
+    auto mapStart = LocalStageTimings::now();
+    SALMON_TRACE_BEGIN(mapEvent, "map batch");
+    SALMON_ALLOC_BEGIN(mapScope, "mapping");
+    HardwareCounters::Region mapRegion(hwCounters, "mapping");
 
     rangeSize = j->nb_filled;
     if (rangeSize > structureVec.size()) {
         salmonOpts.jointLog->error("rangeSize = {}, but structureVec.size() = {} --- this shouldn't happen.\n"
                                    "Please report this bug on GitHub", rangeSize, structureVec.size());
-        std::exit(1);
+        salmon::utils::exitRun(1);
+    }
+
+    if (trimmer) {
+        for (size_t i = 0; i < j->nb_filled; ++i) { trimmer->trim(j->data[i], trimStats); }
     }
 
     for(size_t i = 0; i < j->nb_filled; ++i) { // For all the read in this batch
@@ -671,16 +1070,20 @@ void processReadsQuasi(paired_parser* parser,
         rightHits.clear();
 
         bool lh = tooShortLeft ? false :
-                   hitCollector(j->data[i].first.seq,
-                                leftHits, saSearcher,
-                                MateStatus::PAIRED_END_LEFT,
-                                true);
-
-        bool rh = tooShortRight ? false : 
-                   hitCollector(j->data[i].second.seq,
-                                rightHits, saSearcher,
-                                MateStatus::PAIRED_END_RIGHT,
-                                true);
+                   collectReadHits(hitCollector, saSearcher, extMappers, hitCache.get(),
+                                   j->data[i].first.seq, leftHits, MateStatus::PAIRED_END_LEFT);
+
+        // If the left mate hit only a few transcripts, the right one may
+        // only need to be checked against them
+        bool rh{false};
+        if (!tooShortRight) {
+            rh = mateVerifier and lh and leftHits.size() <= salmonOpts.mateVerifyMaxHits and
+                 mateVerifier->verify(leftHits, readLenLeft, j->data[i].second.seq, transcripts, rightHits);
+            if (!rh) {
+                rh = collectReadHits(hitCollector, saSearcher, extMappers, hitCache.get(),
+                                     j->data[i].second.seq, rightHits, MateStatus::PAIRED_END_RIGHT);
+            }
+        }
 
         // Consider a read as too short if both ends are too short
         if (tooShortLeft and tooShortRight) { 
@@ -705,7 +1108,11 @@ void processReadsQuasi(paired_parser* parser,
             }
 
             // If the read mapped to > maxReadOccs places, discard it
-            if (jointHits.size() > salmonOpts.maxReadOccs ) { jointHitGroup.clearAlignments(); }
+            if (tooManyHits or jointHits.size() > salmonOpts.maxReadOccs) {
+                ++shortFragStats.numTooManyHits;
+                tooManyHits = true;
+                jointHitGroup.clearAlignments();
+            }
         }
 
 
@@ -737,7 +1144,8 @@ void processReadsQuasi(paired_parser* parser,
 	    }
 	  }
 
-	  bool needBiasSample = salmonOpts.biasCorrect;
+	  // Only a fragment that would enter the bias sample needs its k-mer context
+	  bool needBiasSample = sampleBias and biasSamples.admit();
 
 	  for (auto& h : jointHits) {
 
@@ -746,9 +1154,8 @@ void processReadsQuasi(paired_parser* parser,
 	    auto dir = salmon::utils::boolToDirection(h.fwd);
 
 	    // If bias correction is turned on, and we haven't sampled a mapping
-	    // for this read yet, and we haven't collected the required number of
-	    // samples overall.
-        if(needBiasSample and salmonOpts.numBiasSamples > 0){
+	    // for this read yet (and it was admitted to the sample).
+        if(needBiasSample){
             // the "start" position is the leftmost position if
             // we hit the forward strand, and the leftmost
             // position + the read length if we hit the reverse complement
@@ -759,9 +1166,9 @@ void processReadsQuasi(paired_parser* parser,
                 const char* txpStart = t.Sequence();
                 const char* readStart = txpStart + startPos;
                 const char* txpEnd = txpStart + t.RefLength;
-                bool success = readBias.update(txpStart, readStart, txpEnd, dir);
-                if (success) {
-                    salmonOpts.numBiasSamples -= 1;
+                uint32_t kmer{0};
+                if (readBias.contextIndex(txpStart, readStart, txpEnd, dir, kmer)) {
+                    biasSamples.add(kmer);
                     needBiasSample = false;
                 }
             }
@@ -794,39 +1201,78 @@ void processReadsQuasi(paired_parser* parser,
         }
 	  }
 	} // If we have no mappings --- then there's nothing to do
+        if (samBuffer) { samBuffer->addPaired(j->data[i], jointHits, transcripts); }
+        if (unmappedNames and jointHits.empty()) {
+            unmappedNames->add(j->data[i].first.header,
+                               (tooShortLeft and tooShortRight) ? UnmappedNameWriter::tooShort :
+                               tooManyHits ? UnmappedNameWriter::tooManyHits : UnmappedNameWriter::unmapped);
+        }
 
         validHits += jointHits.size();
         localNumAssignedFragments += (jointHits.size() > 0);
         locRead++;
         ++numObservedFragments;
-        if (numObservedFragments % 500000 == 0) {
-    	    iomutex.lock();
-            const char RESET_COLOR[] = "\x1b[0m";
-            char green[] = "\x1b[30m";
-            green[3] = '0' + static_cast<char>(fmt::GREEN);
-            char red[] = "\x1b[30m";
-            red[3] = '0' + static_cast<char>(fmt::RED);
-            if (initialRound) {
-                fmt::print(stderr, "\033[A\r\r{}processed{} {} {}fragments{}\n", green, red, numObservedFragments, green, RESET_COLOR);
-                fmt::print(stderr, "hits: {}, hits per frag:  {}",
-                        validHits,
-                        validHits / static_cast<float>(prevObservedFrags));
-            } else {
-                fmt::print(stderr, "\r\r{}processed{} {} {}fragments{}", green, red, numObservedFragments, green, RESET_COLOR);
-            }
-    	    iomutex.unlock();
-        }
-
-
     } // end for i < j->nb_filled
 
-    prevObservedFrags = numObservedFragments;
-    AlnGroupVecRange<QuasiAlignment> hitLists = boost::make_iterator_range(structureVec.begin(), structureVec.begin() + rangeSize);
-    processMiniBatch<QuasiAlignment>(readExp, fmCalc,firstTimestepOfRound, rl, salmonOpts, hitLists, transcripts, clusterForest,
-                     fragLengthDist, observedGCParams, numAssignedFragments, eng, initialRound, burnedIn);
+    scratch.timings.mappingNs += LocalStageTimings::elapsedNs(mapStart);
+    SALMON_TRACE_END(mapEvent);
+    SALMON_ALLOC_END(mapScope);
+    mapRegion.end();
+    // Publish this job's timings, so the progress output can report how
+    // long the mapping threads have stalled on the parser
+    scratch.timings.flush();
+    // In single-pass mode, only the mini-batches assigned before burn-in
+    // are cached; their equivalence classes are added once the auxiliary
+    // models have been trained, when the cache is replayed.
+    // (With --onlineOnly, no fragment is added to them at all.)
+    bool deferEqClasses = salmonOpts.onlineOnly or
+                          ((cacheWriter != nullptr) and salmonOpts.singlePass and !burnedIn);
+    if (cacheWriter and (deferEqClasses or !salmonOpts.singlePass)) {
+        cacheWriter->writeMiniBatch(structureVec.begin(), structureVec.begin() + rangeSize, rangeSize,
+                                    [&j](size_t i) -> const std::string& { return j->data[i].first.header; });
+    }
+    if (pipeline) {
+        // Hand the mini-batch to the inference threads, and map the next
+        // one into a free buffer from the pool.
+        auto* batch = pipeline->acquire();
+        std::swap(structureVec, batch->hits);
+        batch->rangeSize = rangeSize;
+        batch->deferEqClasses = deferEqClasses;
+        pipeline->submit(batch);
+    } else if (pipelineMiniBatches) {
+        // Wait until the previous mini-batch has been assigned, and then
+        // hand this one off so that we can start mapping the next.
+        assignTasks.wait();
+        std::swap(structureVec, assignVec);
+        assignScratch.deferEqClasses = deferEqClasses;
+        assignTasks.run([&, rangeSize]() -> void {
+            AlnGroupVecRange<QuasiAlignment> hitLists = boost::make_iterator_range(assignVec.begin(), assignVec.begin() + rangeSize);
+            processMiniBatch<QuasiAlignment>(readExp, fmCalc,firstTimestepOfRound, rl, salmonOpts, hitLists, transcripts, clusterForest,
+                             fragLengthDist, observedGCParams, numAssignedFragments, assignEng, initialRound, burnedIn, assignScratch);
+        });
+    } else {
+        scratch.deferEqClasses = deferEqClasses;
+        AlnGroupVecRange<QuasiAlignment> hitLists = boost::make_iterator_range(structureVec.begin(), structureVec.begin() + rangeSize);
+        processMiniBatch<QuasiAlignment>(readExp, fmCalc,firstTimestepOfRound, rl, salmonOpts, hitLists, transcripts, clusterForest,
+                         fragLengthDist, observedGCParams, numAssignedFragments, eng, initialRound, burnedIn, scratch);
+    }
+    if (monitor) {
+        monitor->update(numObservedFragments, burnedIn, transcripts,
+                        readExp.equivalenceClassBuilder().numClasses());
+    }
+    if (snapshots) { snapshots->update(numObservedFragments); }
   }
-  
+  assignTasks.wait();
+  scratch.libTypeCounts.flush(rl);
+  assignScratch.libTypeCounts.flush(rl);
+  if (sampleBias) { readExp.biasSamples().merge(biasSamples); }
+
   readExp.updateShortFrags(shortFragStats);
+  if (trimmer) { trimmer->addStats(trimStats); }
+  if (hitCache) {
+      readExp.stageTimings().readHitCacheLookups += hitCache->numLookups();
+      readExp.stageTimings().readHitCacheHits += hitCache->numHits();
+  }
 }
 
 // SINGLE END
@@ -855,23 +1301,42 @@ void processReadsQuasi(single_parser* parser,
 	           std::mutex& iomutex,
                bool initialRound,
                std::atomic<bool>& burnedIn,
-               volatile bool& writeToCache) {
+               volatile bool& writeToCache,
+               MappingCacheWriter* cacheWriter,
+               QuasiInferencePipeline* pipeline) {
   uint64_t count_fwd = 0, count_bwd = 0;
-  // Seed with a real random value, if available
-  std::random_device rd;
+  // Each mapping thread has its own stream of random numbers (see
+  // RandomStreams.hpp)
+  uint64_t streamIndex = salmon::utils::nextMappingStreamIndex();
+  std::default_random_engine eng(salmon::utils::streamSeed(
+              salmonOpts, salmon::utils::RandomStream::MAPPING, 2 * streamIndex));
 
-  // Create a random uniform distribution
-  std::default_random_engine eng(rd());
-
-  uint64_t prevObservedFrags{1};
   uint64_t leftHitCount{0};
   uint64_t hitListCount{0};
   salmon::utils::ShortFragStats shortFragStats;
   bool tooShort{false};
 
   auto& readBias = readExp.readBias();
+  // This thread's sample of the k-mer contexts of its fragments, which is
+  // only collected during the first pass
+  bool sampleBias = initialRound and salmonOpts.biasCorrect;
+  BiasSampleReservoir biasSamples(sampleBias ? threadBiasSampleCapacity(readExp, salmonOpts) : 0,
+                                  (static_cast<uint64_t>(eng()) << 32) | streamIndex);
   const char* txomeStr = qidx->seq.c_str();
 
+  // Re-usable buffers for processing the fragments of each mini-batch
+  FragmentScratch scratch(readExp.equivalenceClassBuilder(), fragLengthDist, readExp.stageTimings());
+
+  // If we're pipelining, each mini-batch is assigned (in a TBB task) from
+  // its own buffer while the next mini-batch is being mapped.  At most one
+  // mini-batch per mapping thread is in flight at any time.
+  bool pipelineMiniBatches = salmonOpts.pipelineMiniBatches and (pipeline == nullptr);
+  AlnGroupVec<QuasiAlignment> assignVec(pipelineMiniBatches ? structureVec.size() : 0);
+  FragmentScratch assignScratch(readExp.equivalenceClassBuilder(), fragLengthDist, readExp.stageTimings());
+  std::default_random_engine assignEng(salmon::utils::streamSeed(
+              salmonOpts, salmon::utils::RandomStream::MAPPING, 2 * streamIndex + 1));
+  tbb::task_group assignTasks;
+
   auto expectedLibType = rl.format();
 
 
@@ -887,17 +1352,55 @@ void processReadsQuasi(single_parser* parser,
   size_t maxNumHits{salmonOpts.maxReadOccs};
   SACollector<RapMapIndexT> hitCollector(qidx);
   SASearcher<RapMapIndexT> saSearcher(qidx);
+  auto extMappers = makeQuasiExtensionMappers(readExp, qidx);
   rapmap::utils::HitCounters hctr;
+  // If the mappings are being written (--writeMappings), this thread's records
+  std::unique_ptr<MappingSAMBuffer> samBuffer(
+          salmonOpts.mappingWriter ? new MappingSAMBuffer(salmonOpts.mappingWriter.get()) : nullptr);
+  // If the names of the unmapped fragments are being written (--writeUnmappedNames), this
+  // thread's names; they're only written in the first pass over the reads
+  std::unique_ptr<UnmappedNameBuffer> unmappedNames(
+          (initialRound and salmonOpts.unmappedNameWriter) ?
+          new UnmappedNameBuffer(salmonOpts.unmappedNameWriter.get()) : nullptr);
+  HardwareCounters* hwCounters = salmonOpts.profiler ? salmonOpts.profiler->hardwareCounters() : nullptr;
+  MappingConvergenceMonitor* monitor = salmonOpts.convergenceMonitor.get();
+  AbundanceSnapshotWriter* snapshots = salmonOpts.snapshotWriter.get();
+  // The hits of the reads this thread mapped most recently (--readHitCache)
+  std::unique_ptr<ReadHitCache<QuasiAlignment>> hitCache(
+          salmonOpts.readHitCacheSize > 0 ? new ReadHitCache<QuasiAlignment>(salmonOpts.readHitCacheSize) : nullptr);
+  // Trims the reads before they're mapped (--trimAdapters, --trimQuality, --trimPolyA)
+  ReadTrimmer* trimmer = salmonOpts.readTrimmer.get();
+  ReadTrimStats trimStats;
 
   while(true) {
+    auto parseStart = LocalStageTimings::now();
+    SALMON_TRACE_BEGIN(parseEvent, "parse job");
+    SALMON_ALLOC_BEGIN(parseScope, "parsing");
     typename single_parser::job j(*parser); // Get a job from the parser: a bunch of read (at most max_read_group)
+    SALMON_TRACE_END(parseEvent);
+    SALMON_ALLOC_END(parseScope);
+    scratch.timings.parseWaitNs += LocalStageTimings::elapsedNs(parseStart);
     if(j.is_empty()) break;           // If got nothing, quit
+    // Once mapping has stopped early, the rest of the input is only counted (or abandoned)
+    if (monitor and monitor->stopped()) {
+        if (!monitor->countSkipped()) { break; }
+        monitor->addSkipped(j->nb_filled);
+        continue;
+    }
+    auto mapStart = LocalStageTimings::now();
+    SALMON_TRACE_BEGIN(mapEvent, "map batch");
+    SALMON_ALLOC_BEGIN(mapScope, "mapping");
+    HardwareCounters::Region mapRegion(hwCounters, "mapping");
 
     rangeSize = j->nb_filled;
     if (rangeSize > structureVec.size()) {
         salmonOpts.jointLog->error("rangeSize = {}, but structureVec.size() = {} --- this shouldn't happen.\n"
                                    "Please report this bug on GitHub", rangeSize, structureVec.size());
-        std::exit(1);
+        salmon::utils::exitRun(1);
+    }
+
+    if (trimmer) {
+        for (size_t i = 0; i < j->nb_filled; ++i) { trimmer->trim(j->data[i], trimStats); }
     }
 
     for(size_t i = 0; i < j->nb_filled; ++i) { // For all the read in this batch
@@ -910,10 +1413,8 @@ void processReadsQuasi(single_parser* parser,
         jointHitGroup.clearAlignments();
 
         bool lh = tooShort ? false :
-            hitCollector(j->data[i].seq,
-                         jointHits, saSearcher,
-                         MateStatus::SINGLE_END,
-                         true);
+            collectReadHits(hitCollector, saSearcher, extMappers, hitCache.get(),
+                            j->data[i].seq, jointHits, MateStatus::SINGLE_END, salmonOpts.maxReadOccs);
 
         // If the fragment was too short, record it
         if (tooShort) { 
@@ -926,9 +1427,14 @@ void processReadsQuasi(single_parser* parser,
         }
 
         // If the read mapped to > maxReadOccs places, discard it
-        if (jointHits.size() > salmonOpts.maxReadOccs ) { jointHitGroup.clearAlignments(); }
+        if (jointHits.size() > salmonOpts.maxReadOccs) {
+            ++shortFragStats.numTooManyHits;
+            tooManyHits = true;
+            jointHitGroup.clearAlignments();
+        }
 
-        bool needBiasSample = salmonOpts.biasCorrect;
+        // Only a fragment that would enter the bias sample needs its k-mer context
+        bool needBiasSample = sampleBias and !jointHits.empty() and biasSamples.admit();
 
         for (auto& h : jointHits) {
 
@@ -937,9 +1443,8 @@ void processReadsQuasi(single_parser* parser,
 	    auto dir = salmon::utils::boolToDirection(h.fwd);
 
 	    // If bias correction is turned on, and we haven't sampled a mapping
-	    // for this read yet, and we haven't collected the required number of
-	    // samples overall.
-        if(needBiasSample and salmonOpts.numBiasSamples > 0){
+	    // for this read yet (and it was admitted to the sample).
+        if(needBiasSample){
             // the "start" position is the leftmost position if
             // we hit the forward strand, and the leftmost
             // position + the read length if we hit the reverse complement
@@ -951,9 +1456,9 @@ void processReadsQuasi(single_parser* parser,
                 const char* txpStart = t.Sequence();
                 const char* readStart = txpStart + startPos;
                 const char* txpEnd = txpStart + t.RefLength;
-                bool success = readBias.update(txpStart, readStart, txpEnd, dir);
-                if (success) {
-                    salmonOpts.numBiasSamples -= 1;
+                uint32_t kmer{0};
+                if (readBias.contextIndex(txpStart, readStart, txpEnd, dir, kmer)) {
+                    biasSamples.add(kmer);
                     needBiasSample = false;
                 }
             }
@@ -970,41 +1475,255 @@ void processReadsQuasi(single_parser* parser,
                     break;
             }
         }
+        if (samBuffer) { samBuffer->addSingle(j->data[i], jointHits, transcripts); }
+        if (unmappedNames and jointHits.empty()) {
+            unmappedNames->add(j->data[i].header,
+                               tooShort ? UnmappedNameWriter::tooShort :
+                               tooManyHits ? UnmappedNameWriter::tooManyHits : UnmappedNameWriter::unmapped);
+        }
 
         validHits += jointHits.size();
         locRead++;
         ++numObservedFragments;
-        if (numObservedFragments % 500000 == 0) {
-    	    iomutex.lock();
-            const char RESET_COLOR[] = "\x1b[0m";
-            char green[] = "\x1b[30m";
-            green[3] = '0' + static_cast<char>(fmt::GREEN);
-            char red[] = "\x1b[30m";
-            red[3] = '0' + static_cast<char>(fmt::RED);
-            if (initialRound) {
-                fmt::print(stderr, "\033[A\r\r{}processed{} {} {}fragments{}\n", green, red, numObservedFragments, green, RESET_COLOR);
-                fmt::print(stderr, "hits: {}; hits per frag:  {}",
-                        validHits,
-                        validHits / static_cast<float>(prevObservedFrags));
-            } else {
-                fmt::print(stderr, "\r\r{}processed{} {} {}fragments{}", green, red, numObservedFragments, green, RESET_COLOR);
-            }
-    	    iomutex.unlock();
-        }
-
-
     } // end for i < j->nb_filled
 
-    prevObservedFrags = numObservedFragments;
-    AlnGroupVecRange<QuasiAlignment> hitLists = boost::make_iterator_range(structureVec.begin(), structureVec.begin() + rangeSize);
-    processMiniBatch<QuasiAlignment>(readExp, fmCalc,firstTimestepOfRound, rl, salmonOpts, hitLists, transcripts, clusterForest,
-                     fragLengthDist, observedGCParams, numAssignedFragments, eng, initialRound, burnedIn);
+    scratch.timings.mappingNs += LocalStageTimings::elapsedNs(mapStart);
+    SALMON_TRACE_END(mapEvent);
+    SALMON_ALLOC_END(mapScope);
+    mapRegion.end();
+    // Publish this job's timings, so the progress output can report how
+    // long the mapping threads have stalled on the parser
+    scratch.timings.flush();
+    // In single-pass mode, only the mini-batches assigned before burn-in
+    // are cached; their equivalence classes are added once the auxiliary
+    // models have been trained, when the cache is replayed.
+    // (With --onlineOnly, no fragment is added to them at all.)
+    bool deferEqClasses = salmonOpts.onlineOnly or
+                          ((cacheWriter != nullptr) and salmonOpts.singlePass and !burnedIn);
+    if (cacheWriter and (deferEqClasses or !salmonOpts.singlePass)) {
+        cacheWriter->writeMiniBatch(structureVec.begin(), structureVec.begin() + rangeSize, rangeSize,
+                                    [&j](size_t i) -> const std::string& { return j->data[i].header; });
+    }
+    if (pipeline) {
+        // Hand the mini-batch to the inference threads, and map the next
+        // one into a free buffer from the pool.
+        auto* batch = pipeline->acquire();
+        std::swap(structureVec, batch->hits);
+        batch->rangeSize = rangeSize;
+        batch->deferEqClasses = deferEqClasses;
+        pipeline->submit(batch);
+    } else if (pipelineMiniBatches) {
+        // Wait until the previous mini-batch has been assigned, and then
+        // hand this one off so that we can start mapping the next.
+        assignTasks.wait();
+        std::swap(structureVec, assignVec);
+        assignScratch.deferEqClasses = deferEqClasses;
+        assignTasks.run([&, rangeSize]() -> void {
+            AlnGroupVecRange<QuasiAlignment> hitLists = boost::make_iterator_range(assignVec.begin(), assignVec.begin() + rangeSize);
+            processMiniBatch<QuasiAlignment>(readExp, fmCalc,firstTimestepOfRound, rl, salmonOpts, hitLists, transcripts, clusterForest,
+                             fragLengthDist, observedGCParams, numAssignedFragments, assignEng, initialRound, burnedIn, assignScratch);
+        });
+    } else {
+        scratch.deferEqClasses = deferEqClasses;
+        AlnGroupVecRange<QuasiAlignment> hitLists = boost::make_iterator_range(structureVec.begin(), structureVec.begin() + rangeSize);
+        processMiniBatch<QuasiAlignment>(readExp, fmCalc,firstTimestepOfRound, rl, salmonOpts, hitLists, transcripts, clusterForest,
+                         fragLengthDist, observedGCParams, numAssignedFragments, eng, initialRound, burnedIn, scratch);
+    }
+    if (monitor) {
+        monitor->update(numObservedFragments, burnedIn, transcripts,
+                        readExp.equivalenceClassBuilder().numClasses());
+    }
+    if (snapshots) { snapshots->update(numObservedFragments); }
   }
+  assignTasks.wait();
+  scratch.libTypeCounts.flush(rl);
+  assignScratch.libTypeCounts.flush(rl);
+  if (sampleBias) { readExp.biasSamples().merge(biasSamples); }
   readExp.updateShortFrags(shortFragStats);
+  if (trimmer) { trimmer->addStats(trimStats); }
+  if (hitCache) {
+      readExp.stageTimings().readHitCacheLookups += hitCache->numLookups();
+      readExp.stageTimings().readHitCacheHits += hitCache->numHits();
+  }
 }
 
 /// DONE QUASI
 
+/**
+ * Re-process the mappings written to the mapping cache during the initial
+ * round, rather than re-mapping the reads.  Each thread replays the cache
+ * file that it wrote.
+ */
+void processCachedMappings(MappingCacheReader& cacheReader,
+                           ReadExperiment& readExp,
+                           ReadLibrary& rl,
+                           AlnGroupVec<QuasiAlignment>& structureVec,
+                           std::atomic<uint64_t>& numObservedFragments,
+                           std::atomic<uint64_t>& numAssignedFragments,
+                           std::vector<Transcript>& transcripts,
+                           ForgettingMassCalculator& fmCalc,
+                           ClusterForest& clusterForest,
+                           FragmentLengthDistribution& fragLengthDist,
+                           GCBiasParams& observedGCParams,
+                           SalmonOpts& salmonOpts,
+                           std::atomic<bool>& burnedIn,
+                           bool eqClassesOnly) {
+    std::default_random_engine eng(salmon::utils::streamSeed(
+                salmonOpts, salmon::utils::RandomStream::MAPPING,
+                2 * salmon::utils::nextMappingStreamIndex()));
+
+    FragmentScratch scratch(readExp.equivalenceClassBuilder(), fragLengthDist, readExp.stageTimings());
+    scratch.eqClassesOnly = eqClassesOnly;
+    uint64_t firstTimestepOfRound = fmCalc.getCurrentTimestep();
+    bool initialRound{false};
+
+    uint32_t numObserved{0};
+    uint32_t numMapped{0};
+    while (cacheReader.readMiniBatch(structureVec, numObserved, numMapped)) {
+        numObservedFragments += numObserved;
+        AlnGroupVecRange<QuasiAlignment> hitLists = boost::make_iterator_range(structureVec.begin(), structureVec.begin() + numMapped);
+        processMiniBatch<QuasiAlignment>(readExp, fmCalc, firstTimestepOfRound, rl, salmonOpts, hitLists, transcripts, clusterForest,
+                         fragLengthDist, observedGCParams, numAssignedFragments, eng, initialRound, burnedIn, scratch);
+    }
+}
+
+template <typename AlnT>
+void processCachedMappings(MappingCacheReader& cacheReader,
+                           ReadExperiment& readExp,
+                           ReadLibrary& rl,
+                           AlnGroupVec<AlnT>& structureVec,
+                           std::atomic<uint64_t>& numObservedFragments,
+                           std::atomic<uint64_t>& numAssignedFragments,
+                           std::vector<Transcript>& transcripts,
+                           ForgettingMassCalculator& fmCalc,
+                           ClusterForest& clusterForest,
+                           FragmentLengthDistribution& fragLengthDist,
+                           GCBiasParams& observedGCParams,
+                           SalmonOpts& salmonOpts,
+                           std::atomic<bool>& burnedIn,
+                           bool eqClassesOnly) {
+    // ERROR
+    salmonOpts.jointLog->error("The mapping cache can only be used with the Quasi index --- please report this bug on GitHub");
+    salmon::utils::exitRun(1);
+}
+
+/**
+ * Write the posterior probabilities with which each fragment in the mapping
+ * cache is assigned to its transcripts, given the abundances estimated by
+ * the optimizer (--writePosteriors).  The probability of a transcript is
+ * proportional to its abundance per unit of effective length times the
+ * probabilities of the fragment's length and library format there; the
+ * mappings of a fragment to the same transcript are summed.  The cache
+ * files are shared out among the threads, each of which compresses and
+ * writes its own blocks; each fragment is written with its name, which the
+ * mapping cache holds when --writePosteriors is given.
+ */
+bool writeFragmentPosteriors(ReadExperiment& readExp, SalmonOpts& salmonOpts,
+                             const boost::filesystem::path& path, uint32_t numThreads) {
+    auto& transcripts = readExp.transcripts();
+    PosteriorWriter writer(path);
+    if (!writer.good()) {
+        salmonOpts.jointLog->error("Could not open {} to write the fragment posteriors", path.string());
+        return false;
+    }
+    std::vector<std::string> names;
+    names.reserve(transcripts.size());
+    for (auto& t : transcripts) { names.push_back(t.RefName); }
+    writer.writeHeader(names);
+
+    std::vector<double> weights(transcripts.size(), 0.0);
+    for (size_t i = 0; i < transcripts.size(); ++i) {
+        double effLength = transcripts[i].EffectiveLength;
+        weights[i] = (effLength > 0.0) ? transcripts[i].sharedCount() / effLength : 0.0;
+    }
+    FragmentLengthDistribution* fragLengthDist = readExp.fragmentLengthDistribution();
+    bool useFragLengthDist = !salmonOpts.noFragLengthDist and fragLengthDist != nullptr;
+
+    // Every library has one cache file per mapping thread
+    std::vector<std::pair<boost::filesystem::path, ReadLibrary*>> cacheFiles;
+    for (auto& rl : readExp.readLibraries()) {
+        for (size_t i = 0; ; ++i) {
+            auto cachePath = salmon::utils::mappingCachePath(salmonOpts.outputDirectory,
+                                                             rl.readFilesAsString(), i);
+            if (!boost::filesystem::exists(cachePath)) { break; }
+            cacheFiles.emplace_back(cachePath, &rl);
+        }
+    }
+
+    std::atomic<size_t> nextFile{0};
+    std::atomic<uint64_t> numFragments{0};
+    std::atomic<bool> failed{false};
+    std::atomic<bool> missingNames{false};
+    auto threadFun = [&]() -> void {
+        PosteriorBlock block(&writer);
+        AlnGroupVec<QuasiAlignment> groups;
+        std::vector<uint32_t> tids;
+        std::vector<double> probs;
+        uint32_t numObserved{0};
+        uint32_t numMapped{0};
+        for (size_t f = nextFile++; f < cacheFiles.size(); f = nextFile++) {
+            MappingCacheReader cacheReader(cacheFiles[f].first);
+            if (!cacheReader.good()) {
+                failed = true;
+                return;
+            }
+            if (!cacheReader.hasNames()) {
+                missingNames = true;
+                return;
+            }
+            salmon::utils::AlignFormatProbs formatProbs(cacheFiles[f].second->format(), salmonOpts.incompatPrior);
+            while (cacheReader.readMiniBatch(groups, numObserved, numMapped)) {
+                for (uint32_t g = 0; g < numMapped; ++g) {
+                    auto& alns = groups[g].alignments();
+                    std::sort(alns.begin(), alns.end(),
+                              [](const QuasiAlignment& a, const QuasiAlignment& b) -> bool {
+                                  return a.tid < b.tid;
+                              });
+                    tids.clear();
+                    probs.clear();
+                    double total{0.0};
+                    for (auto& h : alns) {
+                        double logProb = formatProbs(h.format, h.fwd, h.mateStatus);
+                        if (useFragLengthDist and h.mateStatus == MateStatus::PAIRED_END_PAIRED and h.fragLen > 0) {
+                            logProb += fragLengthDist->pmf(h.fragLen);
+                        }
+                        double prob = weights[h.tid] * std::exp(logProb);
+                        if (!tids.empty() and tids.back() == h.tid) {
+                            probs.back() += prob;
+                        } else {
+                            tids.push_back(h.tid);
+                            probs.push_back(prob);
+                        }
+                        total += prob;
+                    }
+                    // A fragment all of whose transcripts have no abundance is written without any
+                    if (total > 0.0) {
+                        for (auto& p : probs) { p /= total; }
+                    }
+                    block.add(cacheReader.names()[g], tids, probs);
+                }
+                numFragments += numMapped;
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < std::max(numThreads, uint32_t(1)); ++i) { threads.emplace_back(threadFun); }
+    for (auto& t : threads) { t.join(); }
+    writer.close();
+
+    if (failed) {
+        salmonOpts.jointLog->error("Could not read the mapping cache to write the fragment posteriors");
+        return false;
+    }
+    if (missingNames) {
+        salmonOpts.jointLog->error("The mapping cache doesn't hold the names of the fragments, so their "
+                                   "posteriors can't be written --- please report this bug on GitHub");
+        return false;
+    }
+    salmonOpts.jointLog->info("wrote the posteriors of {} fragments to {}", numFragments.load(), path.string());
+    return true;
+}
+
 
 template <typename AlnT>
 void processReadLibrary(
@@ -1026,6 +1745,7 @@ void processReadLibrary(
         bool greedyChain,
         std::mutex& iomutex,
         size_t numThreads,
+        size_t firstThread,
         std::vector<AlnGroupVec<AlnT>>& structureVec,
         volatile bool& writeToCache){
 
@@ -1035,12 +1755,125 @@ void processReadLibrary(
             rl.checkValid();
 
             auto indexType = sidx->indexType();
+            // The number of jobs the parser fills ahead (sized by --maxMemory)
+            size_t numParserJobs = (salmonOpts.numParserJobs > 0) ? salmonOpts.numParserJobs : 4 * numThreads;
 
             std::unique_ptr<paired_parser> pairedParserPtr{nullptr};
             std::unique_ptr<single_parser> singleParserPtr{nullptr};
 
-            /** GC-fragment bias vectors --- each thread gets it's own **/
-            std::vector<GCBiasParams> observedGCParams(numThreads);
+            /** Inference threads --- if requested, the (quasi-)mapping threads only map **/
+            uint32_t numInferenceThreads =
+                (indexType == SalmonIndexType::QUASI) ? salmonOpts.numInferenceThreads : 0;
+            // When the libraries are processed concurrently, each gets its share of them
+            if (numInferenceThreads > 0 and numThreads < salmonOpts.numThreads) {
+                numInferenceThreads = std::max(uint32_t(1), static_cast<uint32_t>(
+                            (uint64_t(numInferenceThreads) * numThreads) / salmonOpts.numThreads));
+            }
+
+            /** GC-fragment bias vectors --- each thread (mapping or inference) gets it's own **/
+            std::vector<GCBiasParams> observedGCParams(numThreads + numInferenceThreads);
+
+            /** Mapping cache --- each thread writes (and later replays) its own file **/
+            bool useMappingCache = writeToCache and (indexType == SalmonIndexType::QUASI);
+            std::vector<std::unique_ptr<MappingCacheWriter>> cacheWriters(numThreads);
+            if (useMappingCache) {
+                auto cacheDir = salmonOpts.outputDirectory / "mapping_cache";
+                if (!initialRound) {
+                    // Replay the mappings from the initial round rather than
+                    // re-mapping the reads.
+                    for (size_t i = 0; i < numThreads; ++i) {
+                        auto threadFun = [&,i]() -> void {
+                            MappingCacheReader cacheReader(
+                                    salmon::utils::mappingCachePath(salmonOpts.outputDirectory,
+                                                                    rl.readFilesAsString(), i));
+                            if (!cacheReader.good()) {
+                                salmonOpts.jointLog->error("Could not open the mapping cache in {}",
+                                                           cacheDir.string());
+                                salmon::utils::exitRun(1);
+                            }
+                            processCachedMappings(cacheReader, readExp, rl, structureVec[firstThread + i],
+                                                  numObservedFragments, numAssignedFragments,
+                                                  transcripts, fmCalc, clusterForest, fragLengthDist,
+                                                  observedGCParams[i], salmonOpts, burnedIn, false);
+                        };
+                        threads.emplace_back(threadFun);
+                    }
+                    if (salmonOpts.pinThreads) { salmon::utils::pinThreads(threads, firstThread); }
+                    for (auto& t : threads) { t.join(); }
+                    return;
+                }
+
+                boost::filesystem::create_directories(cacheDir);
+                for (size_t i = 0; i < numThreads; ++i) {
+                    // The posteriors are written per fragment, so they need its name
+                    cacheWriters[i].reset(new MappingCacheWriter(
+                                salmon::utils::mappingCachePath(salmonOpts.outputDirectory,
+                                                                rl.readFilesAsString(), i),
+                                salmonOpts.writePosteriors));
+                    if (!cacheWriters[i]->good()) {
+                        salmonOpts.jointLog->error("Could not create the mapping cache in {}",
+                                                   cacheDir.string());
+                        salmon::utils::exitRun(1);
+                    }
+                }
+            }
+
+            // With --inferenceThreads, the mapping threads hand their
+            // mini-batches over to a separate set of threads that apply them
+            // to the abundances, the models and the equivalence classes.
+            // There are two buffers per mapping thread, so that each can fill
+            // one while the other waits to be (or is being) processed.
+            std::unique_ptr<QuasiInferencePipeline> pipeline{nullptr};
+            if (numInferenceThreads > 0) {
+                size_t batchSize = structureVec.front().size();
+                pipeline.reset(new QuasiInferencePipeline(
+                            2 * numThreads, [batchSize]() -> std::unique_ptr<QuasiMiniBatch> {
+                                return std::unique_ptr<QuasiMiniBatch>(new QuasiMiniBatch(batchSize));
+                            }));
+                uint64_t firstTimestepOfRound = fmCalc.getCurrentTimestep();
+                pipeline->start(numInferenceThreads, [&, firstTimestepOfRound](uint32_t w) -> void {
+                    uint64_t streamIndex = salmon::utils::nextMappingStreamIndex();
+                    std::default_random_engine eng(salmon::utils::streamSeed(
+                                salmonOpts, salmon::utils::RandomStream::MAPPING, 2 * streamIndex));
+                    FragmentScratch scratch(readExp.equivalenceClassBuilder(), fragLengthDist,
+                                            readExp.stageTimings());
+                    auto& gcParams = observedGCParams[numThreads + w];
+                    pipeline->consume([&](QuasiMiniBatch& batch) -> void {
+                        scratch.deferEqClasses = batch.deferEqClasses;
+                        AlnGroupVecRange<QuasiAlignment> hitLists =
+                            boost::make_iterator_range(batch.hits.begin(), batch.hits.begin() + batch.rangeSize);
+                        processMiniBatch<QuasiAlignment>(readExp, fmCalc, firstTimestepOfRound, rl, salmonOpts,
+                                                         hitLists, transcripts, clusterForest, fragLengthDist,
+                                                         gcParams, numAssignedFragments, eng, initialRound,
+                                                         burnedIn, scratch);
+                    });
+                    scratch.libTypeCounts.flush(rl);
+                });
+            }
+
+            // The progress of the mapping threads is printed from a reporter
+            // thread, rather than by the workers themselves
+            auto printProgress = [&](uint64_t n) -> void {
+                if (initialRound) {
+                    fmt::print(stderr, "\033[A\r\r{}processed{} {} {}fragments{}\n", ioutils::SET_GREEN,
+                               ioutils::SET_RED, n, ioutils::SET_GREEN, ioutils::RESET_COLOR);
+                    auto& timings = readExp.stageTimings();
+                    double mapAndWaitNs = timings.parseWaitNs + timings.mappingNs;
+                    fmt::print(stderr, "hits: {}, hits per frag:  {} [parser wait: {:.1f}% of mapping-thread time]",
+                            numValidHits.load(),
+                            numValidHits / static_cast<float>(n),
+                            mapAndWaitNs > 0 ? 100.0 * timings.parseWaitNs / mapAndWaitNs : 0.0);
+                } else {
+                    fmt::print(stderr, "\r\r{}processed{} {} {}fragments{}", ioutils::SET_GREEN,
+                               ioutils::SET_RED, n, ioutils::SET_GREEN, ioutils::RESET_COLOR);
+                }
+            };
+            // (Of the libraries processed concurrently, only those mapped by the first
+            // slice of the threads report it, so that the reports don't interleave)
+            std::unique_ptr<ProgressReporter> progress(
+                    (firstThread == 0) ?
+                    new ProgressReporter(numObservedFragments, 500000, std::chrono::milliseconds(1000),
+                                         printProgress) : nullptr);
 
             // If the read library is paired-end
             // ------ Paired-end --------
@@ -1050,7 +1883,7 @@ void processReadLibrary(
 		    if (rl.mates1().size() != rl.mates2().size()) {
 			    salmonOpts.jointLog->error("The number of provided files for "
 					    "-1 and -2 must be the same!");
-			    std::exit(1);
+			    salmon::utils::exitRun(1);
 		    }
 
 		    size_t numFiles = rl.mates1().size() + rl.mates2().size();
@@ -1061,10 +1894,20 @@ void processReadLibrary(
 		    }
 
 		    size_t maxReadGroup{miniBatchSize}; // Number of reads in each "job"
-		    size_t concurrentFile{2}; // Number of files to read simultaneously
+		    // Number of file pairs to read (and decompress) simultaneously; uncompressed
+		    // FASTQ files are mapped and split into ranges, which every thread may parse
+		    size_t concurrentFile = std::max(size_t(1), std::min(rl.mates1().size(), numThreads));
+		    if (salmonOpts.readaheadBytes == 0 and
+			paired_parser::all_mappable(pairFileList, pairFileList + numFiles)) {
+			    concurrentFile = numThreads;
+		    }
+		    // An unaligned BAM / CRAM (given as both -1 and -2) is decoded by
+		    // a quarter of the threads
+		    uint32_t decodeThreads = std::max(size_t(1), numThreads / 4);
 		    pairedParserPtr.reset(new
-				    paired_parser(4 * numThreads, maxReadGroup,
-					    concurrentFile, pairFileList, pairFileList+numFiles));
+				    paired_parser(numParserJobs, maxReadGroup,
+					    concurrentFile, pairFileList, pairFileList+numFiles, decodeThreads,
+					    salmonOpts.readaheadBytes, &readExp.stageTimings().ioWaitNs));
 
 		    switch (indexType) {
 			case SalmonIndexType::FMD:
@@ -1077,7 +1920,7 @@ void processReadLibrary(
 						pairedParserPtr.get(),
 						readExp,
 						rl,
-						structureVec[i],
+						structureVec[firstThread + i],
 						numObservedFragments,
 						numAssignedFragments,
 						numValidHits,
@@ -1114,7 +1957,7 @@ void processReadLibrary(
                                                                                   pairedParserPtr.get(),
                                                                                   readExp,
                                                                                   rl,
-                                                                                  structureVec[i],
+                                                                                  structureVec[firstThread + i],
                                                                                   numObservedFragments,
                                                                                   numAssignedFragments,
                                                                                   numValidHits,
@@ -1131,7 +1974,9 @@ void processReadLibrary(
                                                                                   iomutex,
                                                                                   initialRound,
                                                                                   burnedIn,
-                                                                                  writeToCache);
+                                                                                  writeToCache,
+                                                                          cacheWriters[i].get(),
+                                                                          pipeline.get());
                                     };
                                     threads.emplace_back(threadFun);
                                 } else { // Dense Hash
@@ -1140,7 +1985,7 @@ void processReadLibrary(
                                                                                                         pairedParserPtr.get(),
                                                                                                         readExp,
                                                                                                         rl,
-                                                                                                        structureVec[i],
+                                                                                                        structureVec[firstThread + i],
                                                                                                         numObservedFragments,
                                                                                                         numAssignedFragments,
                                                                                                         numValidHits,
@@ -1157,7 +2002,9 @@ void processReadLibrary(
                                                                                                         iomutex,
                                                                                                         initialRound,
                                                                                                         burnedIn,
-                                                                                                        writeToCache);
+                                                                                                        writeToCache,
+                                                                          cacheWriters[i].get(),
+                                                                          pipeline.get());
                                     };
                                     threads.emplace_back(threadFun);
                                 }
@@ -1168,7 +2015,7 @@ void processReadLibrary(
                                                                                   pairedParserPtr.get(),
                                                                                   readExp,
                                                                                   rl,
-                                                                                  structureVec[i],
+                                                                                  structureVec[firstThread + i],
                                                                                   numObservedFragments,
                                                                                   numAssignedFragments,
                                                                                   numValidHits,
@@ -1185,7 +2032,9 @@ void processReadLibrary(
                                                                                   iomutex,
                                                                                   initialRound,
                                                                                   burnedIn,
-                                                                                  writeToCache);
+                                                                                  writeToCache,
+                                                                          cacheWriters[i].get(),
+                                                                          pipeline.get());
                                     };
                                     threads.emplace_back(threadFun);
                                 } else { // Dense Hash
@@ -1194,7 +2043,7 @@ void processReadLibrary(
                                                                                                         pairedParserPtr.get(),
                                                                                                         readExp,
                                                                                                         rl,
-                                                                                                        structureVec[i],
+                                                                                                        structureVec[firstThread + i],
                                                                                                         numObservedFragments,
                                                                                                         numAssignedFragments,
                                                                                                         numValidHits,
@@ -1211,7 +2060,9 @@ void processReadLibrary(
                                                                                                         iomutex,
                                                                                                         initialRound,
                                                                                                         burnedIn,
-                                                                                                        writeToCache);
+                                                                                                        writeToCache,
+                                                                          cacheWriters[i].get(),
+                                                                          pipeline.get());
                                     };
                                     threads.emplace_back(threadFun);
                                 }
@@ -1223,12 +2074,22 @@ void processReadLibrary(
                     break;
 			    } // end switch
 		    }
+		    if (salmonOpts.pinThreads) { salmon::utils::pinThreads(threads, firstThread); }
 		    for(int i = 0; i < numThreads; ++i) { threads[i].join(); }
+		    if (pipeline) {
+		        pipeline->finish();
+		        salmonOpts.jointLog->info("The mapping threads waited for the inference threads {} times",
+		                                  pipeline->numStalls());
+		    }
+		    progress.reset();
 
 
             /** GC-fragment bias **/
             // Set the global distribution based on the sum of local
-            // distributions.
+            // distributions (of the libraries processed concurrently,
+            // one at a time).
+            static std::mutex gcMergeMutex;
+            std::lock_guard<std::mutex> gcMergeLock(gcMergeMutex);
             double gcFracFwd{0.0};
             double globalMass{salmon::math::LOG_0};
             double globalFwdMass{salmon::math::LOG_0};
@@ -1273,13 +2134,21 @@ void processReadLibrary(
             } // ------ Single-end --------
             else if (rl.format().type == ReadType::SINGLE_END) {
 
+                for (auto& f : rl.unmated()) {
+                    if (is_sam_read_file(f.c_str())) {
+                        salmonOpts.jointLog->error("{} is a BAM / CRAM file; only paired-end reads can be read "
+                                                   "from unaligned BAM / CRAM (pass it to both -1 and -2)", f);
+                        salmon::utils::exitRun(1);
+                    }
+                }
                 char* readFiles[] = { const_cast<char*>(rl.unmated().front().c_str()) };
                 size_t maxReadGroup{miniBatchSize}; // Number of files to read simultaneously
-                size_t concurrentFile{1}; // Number of reads in each "job"
+                // Number of files to read simultaneously
+                size_t concurrentFile = std::max(size_t(1), std::min(rl.unmated().size(), numThreads));
                 stream_manager streams( rl.unmated().begin(),
                         rl.unmated().end(), concurrentFile);
 
-                singleParserPtr.reset(new single_parser(4 * numThreads,
+                singleParserPtr.reset(new single_parser(numParserJobs,
                                       maxReadGroup,
                                       concurrentFile,
                                       streams));
@@ -1295,7 +2164,7 @@ void processReadLibrary(
                                             singleParserPtr.get(),
                                             readExp,
                                             rl,
-                                            structureVec[i],
+                                            structureVec[firstThread + i],
                                             numObservedFragments,
                                             numAssignedFragments,
                                             numValidHits,
@@ -1334,7 +2203,7 @@ void processReadLibrary(
                                                                                   pairedParserPtr.get(),
                                                                                   readExp,
                                                                                   rl,
-                                                                                  structureVec[i],
+                                                                                  structureVec[firstThread + i],
                                                                                   numObservedFragments,
                                                                                   numAssignedFragments,
                                                                                   numValidHits,
@@ -1351,7 +2220,9 @@ void processReadLibrary(
                                                                                   iomutex,
                                                                                   initialRound,
                                                                                   burnedIn,
-                                                                                  writeToCache);
+                                                                                  writeToCache,
+                                                                          cacheWriters[i].get(),
+                                                                          pipeline.get());
                                     };
                                     threads.emplace_back(threadFun);
                                 } else { // Dense Hash
@@ -1360,7 +2231,7 @@ void processReadLibrary(
                                                                                                         singleParserPtr.get(),
                                                                                                         readExp,
                                                                                                         rl,
-                                                                                                        structureVec[i],
+                                                                                                        structureVec[firstThread + i],
                                                                                                         numObservedFragments,
                                                                                                         numAssignedFragments,
                                                                                                         numValidHits,
@@ -1377,7 +2248,9 @@ void processReadLibrary(
                                                                                                         iomutex,
                                                                                                         initialRound,
                                                                                                         burnedIn,
-                                                                                                        writeToCache);
+                                                                                                        writeToCache,
+                                                                          cacheWriters[i].get(),
+                                                                          pipeline.get());
                                     };
                                     threads.emplace_back(threadFun);
                                 }
@@ -1388,7 +2261,7 @@ void processReadLibrary(
                                                                                   singleParserPtr.get(),
                                                                                   readExp,
                                                                                   rl,
-                                                                                  structureVec[i],
+                                                                                  structureVec[firstThread + i],
                                                                                   numObservedFragments,
                                                                                   numAssignedFragments,
                                                                                   numValidHits,
@@ -1405,7 +2278,9 @@ void processReadLibrary(
                                                                                   iomutex,
                                                                                   initialRound,
                                                                                   burnedIn,
-                                                                                  writeToCache);
+                                                                                  writeToCache,
+                                                                          cacheWriters[i].get(),
+                                                                          pipeline.get());
                                     };
                                     threads.emplace_back(threadFun);
                                 } else { // Dense Hash
@@ -1414,7 +2289,7 @@ void processReadLibrary(
                                                                                                         singleParserPtr.get(),
                                                                                                         readExp,
                                                                                                         rl,
-                                                                                                        structureVec[i],
+                                                                                                        structureVec[firstThread + i],
                                                                                                         numObservedFragments,
                                                                                                         numAssignedFragments,
                                                                                                         numValidHits,
@@ -1431,7 +2306,9 @@ void processReadLibrary(
                                                                                                         iomutex,
                                                                                                         initialRound,
                                                                                                         burnedIn,
-                                                                                                        writeToCache);
+                                                                                                        writeToCache,
+                                                                          cacheWriters[i].get(),
+                                                                          pipeline.get());
                                     };
                                     threads.emplace_back(threadFun);
                                 }
@@ -1442,8 +2319,52 @@ void processReadLibrary(
 		    } // End Quasi index
 		    break;
 		}
+                if (salmonOpts.pinThreads) { salmon::utils::pinThreads(threads, firstThread); }
                 for(int i = 0; i < numThreads; ++i) { threads[i].join(); }
+                if (pipeline) {
+                    pipeline->finish();
+                    salmonOpts.jointLog->info("The mapping threads waited for the inference threads {} times",
+                                              pipeline->numStalls());
+                }
+                progress.reset();
             } // ------ END Single-end --------
+
+            // In single-pass mode, the fragments assigned before burn-in were
+            // written to the mapping cache instead of to the equivalence
+            // classes.  Now that the auxiliary models have been trained,
+            // replay them, so that their conditional probabilities are
+            // computed as they would have been in a later pass.
+            if (useMappingCache and initialRound and salmonOpts.singlePass) {
+                for (auto& w : cacheWriters) { w.reset(); }
+                // If there were too few fragments to reach burn-in, use
+                // the models as they are
+                if (!burnedIn) { readExp.updateTranscriptLengthsAtomic(burnedIn); }
+
+                std::atomic<uint64_t> numReplayedObserved{0};
+                std::atomic<uint64_t> numReplayedAssigned{0};
+                threads.clear();
+                for (size_t i = 0; i < numThreads; ++i) {
+                    auto threadFun = [&,i]() -> void {
+                        MappingCacheReader cacheReader(
+                                salmon::utils::mappingCachePath(salmonOpts.outputDirectory,
+                                                                rl.readFilesAsString(), i));
+                        if (!cacheReader.good()) {
+                            salmonOpts.jointLog->error("Could not open the mapping cache in {}",
+                                                       (salmonOpts.outputDirectory / "mapping_cache").string());
+                            salmon::utils::exitRun(1);
+                        }
+                        processCachedMappings(cacheReader, readExp, rl, structureVec[firstThread + i],
+                                              numReplayedObserved, numReplayedAssigned,
+                                              transcripts, fmCalc, clusterForest, fragLengthDist,
+                                              observedGCParams[i], salmonOpts, burnedIn, true);
+                    };
+                    threads.emplace_back(threadFun);
+                }
+                if (salmonOpts.pinThreads) { salmon::utils::pinThreads(threads, firstThread); }
+                for (auto& t : threads) { t.join(); }
+                salmonOpts.jointLog->info("Added the {} fragments assigned before burn-in to the "
+                                          "equivalence classes", numReplayedAssigned.load());
+            }
 }
 
 
@@ -1476,6 +2397,20 @@ void quantifyLibrary(
     std::atomic<uint64_t> totalAssignedFragments{0};
     uint64_t prevNumAssignedFragments{0};
 
+    std::vector<salmon::metrics::Registry::Registration> metricRegistrations;
+    if (salmonOpts.metrics) {
+        auto& metrics = *salmonOpts.metrics;
+        metricRegistrations.push_back(metrics.sample("salmon_fragments_observed_total",
+                    [&numObservedFragments]() -> double { return numObservedFragments.load(); }));
+        metricRegistrations.push_back(metrics.sample("salmon_fragments_mapped_total",
+                    [&totalAssignedFragments]() -> double { return totalAssignedFragments.load(); }));
+        metricRegistrations.push_back(metrics.sample("salmon_mapping_rate",
+                    [&numObservedFragments, &totalAssignedFragments]() -> double {
+                        uint64_t n = numObservedFragments.load();
+                        return n > 0 ? static_cast<double>(totalAssignedFragments.load()) / n : 0.0;
+                    }));
+    }
+
     auto jointLog = spdlog::get("jointLog");
 
     ForgettingMassCalculator fmCalc(salmonOpts.forgettingFactor);
@@ -1485,23 +2420,61 @@ void quantifyLibrary(
     bool initialRound{true};
     uint32_t roundNum{0};
 
+    // Reads that come from a pipe or a FIFO can only be read once (which
+    // is all that --onlineOnly does anyway)
+    if (!salmonOpts.singlePass and !salmonOpts.onlineOnly) {
+        for (auto& rl : experiment.readLibraries()) {
+            if (!rl.isRegularFile()) {
+                jointLog->info("The reads [{}] are not in a regular file; quantifying them in a single pass",
+                               rl.readFilesAsString());
+                salmonOpts.singlePass = true;
+                break;
+            }
+        }
+    }
+
     std::mutex ffMutex;
     std::mutex ioMutex;
+    // Guards the per-library count of assigned fragments (see processReads)
+    std::mutex assignedCountMutex;
 
     size_t numPrevObservedFragments = 0;
 
     size_t maxReadGroup{miniBatchSize};
     uint32_t structCacheSize = numQuantThreads * maxReadGroup * 10;
 
+    // The mapping pass may stop before the end of the input
+    if (salmonOpts.stopOnConvergence or salmonOpts.maxFragments > 0) {
+        salmonOpts.convergenceMonitor.reset(new MappingConvergenceMonitor(
+                    salmonOpts.stopOnConvergence, salmonOpts.convergenceTolerance,
+                    salmonOpts.convergenceInterval, salmonOpts.maxFragments, salmonOpts.extrapolate));
+    }
+
+    // Snapshots of the abundances are written while the reads are mapped
+    if (salmonOpts.snapshotInterval > 0) {
+        salmonOpts.snapshotWriter.reset(new AbundanceSnapshotWriter(
+                    salmonOpts.outputDirectory / "quant_snapshot.sf", salmonOpts.snapshotInterval,
+                    salmonOpts.snapshotEMRounds, experiment.equivalenceClassBuilder(), refs, jointLog));
+    }
+
+    // This structure is a vector of vectors of alignment
+    // groups.  Each thread will get its own vector, so we
+    // allocate these up front, and reuse them (and the capacity
+    // that their groups have grown to) in every round.
+    std::vector<AlnGroupVec<AlnT>> groupVec;
+    for (size_t i = 0; i < numQuantThreads; ++i) {
+        groupVec.emplace_back(maxReadGroup);
+    }
+
     // EQCLASS
     bool terminate{false};
 
     while (numObservedFragments < numRequiredFragments and !terminate) {
         prevNumObservedFragments = numObservedFragments;
         if (!initialRound) {
-            bool didReset = (salmonOpts.disableMappingCache) ?
-                            (experiment.reset()) :
-                            (experiment.softReset());
+            bool didReset = (salmonOpts.useMappingCache) ?
+                            (experiment.softReset()) :
+                            (experiment.reset());
 
             if (!didReset) {
                 std::string errmsg = fmt::sprintf(
@@ -1512,8 +2485,8 @@ void quantifyLibrary(
                   "We observed only {} mapping fragments when we wanted at least {}.\n\n"
                   "Please consider re-running Salmon with these reads "
                   "as a regular file!\n"
-                  "NOTE: If you received this warning from salmon but did not "
-                  "disable the mapping cache (--disableMappingCache), then there \n"
+                  "NOTE: If you received this warning from salmon but did "
+                  "enable the mapping cache (--mappingCache), then there \n"
                   "was some other problem. Please make sure, e.g., that you have not "
                   "run out of disk space.\n"
                   "==========================\n\n",
@@ -1525,42 +2498,57 @@ void quantifyLibrary(
             numPrevObservedFragments = numObservedFragments;
         }
 
-        // This structure is a vector of vectors of alignment
-        // groups.  Each thread will get its own vector, so we
-        // allocate these up front to save time and allow
-        // reuse.
-        std::vector<AlnGroupVec<AlnT>> groupVec;
-        for (size_t i = 0; i < numQuantThreads; ++i) {
-            groupVec.emplace_back(maxReadGroup);
-        }
-
-
-        bool writeToCache = !salmonOpts.disableMappingCache;
+        bool writeToCache = salmonOpts.useMappingCache or salmonOpts.singlePass;
         auto processReadLibraryCallback =  [&](
                 ReadLibrary& rl, SalmonIndex* sidx,
                 std::vector<Transcript>& transcripts, ClusterForest& clusterForest,
                 FragmentLengthDistribution& fragLengthDist,
                 std::atomic<uint64_t>& numAssignedFragments,
-                size_t numQuantThreads, std::atomic<bool>& burnedIn) -> void  {
+                size_t numLibraryThreads, size_t firstThread, std::atomic<bool>& burnedIn) -> void  {
 
             processReadLibrary<AlnT>(experiment, rl, sidx, transcripts, clusterForest,
                     numObservedFragments, totalAssignedFragments, upperBoundHits,
                     initialRound, burnedIn, fmCalc, fragLengthDist,
                     memOptions, salmonOpts, coverageThresh, greedyChain,
-                    ioMutex, numQuantThreads,
+                    ioMutex, numLibraryThreads, firstThread,
                     groupVec, writeToCache);
 
-            numAssignedFragments = totalAssignedFragments - prevNumAssignedFragments;
-            prevNumAssignedFragments = totalAssignedFragments;
+            std::lock_guard<std::mutex> lock(assignedCountMutex);
+            uint64_t totalAssigned = totalAssignedFragments;
+            numAssignedFragments = totalAssigned - prevNumAssignedFragments;
+            prevNumAssignedFragments = totalAssigned;
         };
 
         // Process all of the reads
         fmt::print(stderr, "\n\n\n\n");
+        RunProfiler::Phase passPhase(salmonOpts.profiler.get(),
+                                     initialRound ? std::string("first pass") : fmt::format("pass {}", roundNum + 1));
+        auto processStart = std::chrono::steady_clock::now();
         experiment.processReads(numQuantThreads, salmonOpts, processReadLibraryCallback);
+        experiment.stageTimings().processReadsSeconds +=
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - processStart).count();
         experiment.setNumObservedFragments(numObservedFragments);
+        if (initialRound and salmonOpts.biasCorrect) {
+            auto numBiasSamples = experiment.trainReadBiasFromSamples();
+            jointLog->info("trained the sequence-specific bias model on a sample of {} fragments",
+                           numBiasSamples);
+        }
+
+        passPhase.end();
+
+        // The classes are about to be finished, so no more snapshots are taken
+        if (auto snapshots = salmonOpts.snapshotWriter.get()) {
+            snapshots->finish();
+            jointLog->info("wrote {} abundance snapshots while mapping ({} skipped while another was being taken)",
+                           snapshots->numWritten(), snapshots->numSkipped());
+            salmonOpts.snapshotWriter.reset();
+        }
 
         //EQCLASS
-        bool done = experiment.equivalenceClassBuilder().finish();
+        if (!salmonOpts.onlineOnly) {
+            RunProfiler::Phase finishPhase(salmonOpts.profiler.get(), "eq-class finish");
+            experiment.equivalenceClassBuilder().finish();
+        }
         // skip the extra online rounds
         terminate = true;
 
@@ -1585,6 +2573,33 @@ void quantifyLibrary(
     }
     fmt::print(stderr, "\n\n\n\n");
 
+    if (auto monitor = salmonOpts.convergenceMonitor.get()) {
+        if (monitor->stopped()) {
+            if (monitor->converged()) {
+                jointLog->info("stopped mapping after {} fragments, when the estimates had converged "
+                               "(distance {}, class growth {})", monitor->numFragmentsAtStop(),
+                               monitor->lastDistance(), monitor->lastClassGrowth());
+            } else {
+                jointLog->info("stopped mapping after {} fragments (--maxFragments)", monitor->numFragmentsAtStop());
+            }
+            if (monitor->countSkipped()) {
+                jointLog->info("{} fragments were read but not mapped; the estimates will be scaled by {}",
+                               monitor->numSkipped(), monitor->extrapolationFactor(numObservedFragments));
+            }
+        } else if (salmonOpts.stopOnConvergence) {
+            jointLog->info("the estimates had not converged by the end of the input "
+                           "(distance {}, class growth {})", monitor->lastDistance(), monitor->lastClassGrowth());
+        }
+    }
+
+    // The mapping cache is only needed while we are making passes over the reads
+    // (or, with --writePosteriors, until the posteriors have been written)
+    bool keepCache = salmonOpts.writePosteriors and !salmonOpts.singlePass;
+    if ((salmonOpts.useMappingCache or salmonOpts.singlePass) and !keepCache) {
+        boost::system::error_code ec;
+        boost::filesystem::remove_all(salmonOpts.outputDirectory / "mapping_cache", ec);
+    }
+
     // Report statistics about short fragments
     salmon::utils::ShortFragStats shortFragStats = experiment.getShortFragStats();
     if (shortFragStats.numTooShort > 0) {
@@ -1601,10 +2616,17 @@ void quantifyLibrary(
             // If *all* fragments were too short, then halt now
             if (shortFragStats.numTooShort == numObservedFragments) {
                 salmonOpts.jointLog->error("All fragments were too short to quasi-map.  I won't proceed.");
-                std::exit(1);  
+                salmon::utils::exitRun(1);  
             }
         } // end tooShortFrac > 0.0
     }
+    if (shortFragStats.numTooManyHits > 0) {
+        salmonOpts.jointLog->info("{} fragments ({}%) were discarded for mapping to more than {} places (--maxReadOcc)",
+                                  shortFragStats.numTooManyHits,
+                                  (numObservedFragments > 0) ?
+                                  100.0 * shortFragStats.numTooManyHits / numObservedFragments : 0.0,
+                                  salmonOpts.maxReadOccs);
+    }
 
 
     // If we didn't achieve burnin, then at least compute effective
@@ -1652,7 +2674,374 @@ void quantifyLibrary(
     jointLog->info("finished quantifyLibrary()");
 }
 
+/**
+ * Write the state of the mapping pass (see ShardState.hpp) to stateDir;
+ * the online estimates must already have been normalized.  With
+ * withEstimates, the (final) estimates of the optimizer are saved too.
+ */
+bool writeShardState(ReadExperiment& experiment, SalmonOpts& sopt,
+                     const boost::filesystem::path& stateDir, bool withEstimates = false) {
+    namespace bfs = boost::filesystem;
+    using salmon::shard::ShardStats;
+    auto jointLog = sopt.jointLog;
+
+    boost::system::error_code ec;
+    bfs::create_directories(stateDir, ec);
+
+    auto& transcripts = experiment.transcripts();
+    ShardStats stats;
+    stats.numObservedFragments = experiment.numObservedFragments();
+    stats.numAssignedFragments = experiment.numMappedFragments();
+    stats.upperBoundHits = experiment.upperBoundHits();
+    for (auto& rl : experiment.readLibraries()) {
+        stats.libFormats.push_back(rl.format().formatID());
+        std::vector<uint64_t> counts;
+        for (auto& c : rl.libTypeCounts()) { counts.push_back(c.load()); }
+        stats.libTypeCounts.push_back(counts);
+    }
+    auto fld = experiment.fragmentLengthDistribution();
+    stats.fldLogMasses = fld->logMasses();
+    stats.fldMinBin = fld->minBin();
+    // Without the pseudo-counts, so that the shards' counts add up
+    if (sopt.biasCorrect) {
+        for (auto& c : experiment.readBias().counts) {
+            uint32_t n = c.load();
+            stats.readBiasCounts.push_back((n > 0) ? n - 1 : 0);
+        }
+    }
+    if (sopt.gcBiasCorrect) {
+        for (auto m : experiment.observedGC()) {
+            stats.observedGC.push_back(std::max(0.0, m - ReadExperiment::observedGCPseudoMass()));
+        }
+        stats.gcFracFwd = experiment.gcFracFwd();
+    }
+    stats.projectedCounts.reserve(transcripts.size());
+    for (auto& t : transcripts) { stats.projectedCounts.push_back(t.projectedCounts); }
+    if (withEstimates) {
+        stats.estimatedCounts.reserve(transcripts.size());
+        for (auto& t : transcripts) { stats.estimatedCounts.push_back(t.sharedCount()); }
+    }
+
+    std::vector<std::string> names;
+    names.reserve(transcripts.size());
+    for (auto& t : transcripts) { names.push_back(t.RefName); }
+    BinaryEqClassWriter writer(names, true);
+    auto& eqArena = experiment.equivalenceClassBuilder().eqArena();
+    std::vector<uint32_t> labels;
+    for (size_t i = 0; i < eqArena.numClasses(); ++i) {
+        labels.assign(eqArena.labels.begin() + eqArena.offsets[i],
+                      eqArena.labels.begin() + eqArena.offsets[i + 1]);
+        writer.add(labels, eqArena.weights.begin() + eqArena.offsets[i], eqArena.counts[i]);
+    }
+    auto eqPath = stateDir / salmon::shard::eqClassesFileName;
+    if (!writer.write(eqPath)) {
+        jointLog->error("could not write the equivalence classes to {}", eqPath.string());
+        return false;
+    }
+    if (!salmon::shard::writeStats(stateDir, stats)) {
+        jointLog->error("could not write the statistics of the mapping pass to {}", stateDir.string());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Restore the state of a mapping pass (written by --mapOnly or salmon
+ * merge) from stateDir into experiment, in place of mapping the reads.
+ * Bias models that the state lacks are disabled.
+ */
+bool loadShardState(ReadExperiment& experiment, SalmonOpts& sopt,
+                    const boost::filesystem::path& stateDir) {
+    using salmon::shard::ShardStats;
+    auto jointLog = sopt.jointLog;
+
+    std::string err;
+    ShardStats stats;
+    if (!salmon::shard::readStats(stateDir, stats, err)) {
+        jointLog->error("{}", err);
+        return false;
+    }
+    auto eqPath = stateDir / salmon::shard::eqClassesFileName;
+    BinaryEqClassReader reader(eqPath);
+    if (!reader.good()) {
+        jointLog->error("could not read the equivalence classes from {}", eqPath.string());
+        return false;
+    }
+
+    auto& transcripts = experiment.transcripts();
+    auto& names = reader.transcriptNames();
+    bool sameIndex = (names.size() == transcripts.size() and
+                      stats.projectedCounts.size() == transcripts.size());
+    for (size_t i = 0; sameIndex and i < names.size(); ++i) {
+        sameIndex = (names[i] == transcripts[i].RefName);
+    }
+    if (!sameIndex) {
+        jointLog->error("the state in {} was not mapped against the index {}",
+                        stateDir.string(), sopt.indexDirectory.string());
+        return false;
+    }
+    auto fld = experiment.fragmentLengthDistribution();
+    if (stats.fldLogMasses.size() != fld->logMasses().size()) {
+        jointLog->error("the fragment length distribution of the state has a different maximum "
+                        "length; please use the --fldMax of the mapping runs");
+        return false;
+    }
+
+    for (size_t i = 0; i < stats.libFormats.size(); ++i) {
+        LibraryFormat fmt = LibraryFormat::formatFromID(stats.libFormats[i]);
+        experiment.readLibraries().emplace_back(fmt);
+        auto& counts = stats.libTypeCounts[i];
+        counts.resize(std::min(counts.size(), static_cast<size_t>(LibraryFormat::maxLibTypeID() + 1)));
+        experiment.readLibraries().back().updateLibTypeCounts(counts);
+    }
+
+    fld->addLogMasses(stats.fldLogMasses, stats.fldMinBin);
+    if (sopt.biasCorrect) {
+        auto& counts = experiment.readBias().counts;
+        if (stats.readBiasCounts.size() != counts.size()) {
+            jointLog->warn("The state has no sequence-specific bias counts (the shards were mapped "
+                           "without --biasCorrect); disabling sequence-specific bias correction");
+            sopt.biasCorrect = false;
+        } else {
+            for (size_t i = 0; i < counts.size(); ++i) { counts[i] += stats.readBiasCounts[i]; }
+        }
+    }
+    if (sopt.gcBiasCorrect) {
+        auto& gc = experiment.observedGC();
+        if (stats.observedGC.size() != gc.size() or stats.gcFracFwd < 0.0) {
+            jointLog->warn("The state has no fragment GC counts (the shards were mapped without "
+                           "--gcBiasCorrect); disabling fragment GC bias correction");
+            sopt.gcBiasCorrect = false;
+        } else {
+            for (size_t i = 0; i < gc.size(); ++i) { gc[i] += stats.observedGC[i]; }
+            experiment.setGCFracForward(stats.gcFracFwd);
+        }
+    }
+    if (sopt.useFSPD) {
+        jointLog->warn("The fragment start position distributions are not part of the mapping state; "
+                       "disabling --useFSPD");
+        sopt.useFSPD = false;
+    }
+
+    auto& eqBuilder = experiment.equivalenceClassBuilder();
+    std::vector<uint32_t> labels;
+    std::vector<float> weights;
+    std::vector<double> auxWeights;
+    std::vector<double> noPosWeights;
+    uint64_t count{0};
+    while (reader.next(labels, weights, count)) {
+        if (weights.empty()) {
+            auxWeights.assign(labels.size(), 1.0 / labels.size());
+        } else {
+            auxWeights.assign(weights.begin(), weights.end());
+        }
+        eqBuilder.addGroup(TranscriptGroup(labels), auxWeights, noPosWeights, count);
+    }
+    if (!reader.good()) {
+        jointLog->error("{} is truncated", eqPath.string());
+        return false;
+    }
+    eqBuilder.finish();
+
+    for (size_t i = 0; i < transcripts.size(); ++i) {
+        transcripts[i].projectedCounts = stats.projectedCounts[i];
+    }
+    experiment.numAssignedFragmentsAtomic() = stats.numAssignedFragments;
+    experiment.setNumObservedFragments(stats.numObservedFragments);
+    experiment.setUpperBoundHits(stats.upperBoundHits);
+    if (stats.numObservedFragments > 0) {
+        experiment.setEffectiveMappingRate(static_cast<double>(stats.numAssignedFragments) /
+                                           stats.numObservedFragments);
+    }
+    std::atomic<bool> haveEffectiveLengths{false};
+    experiment.updateTranscriptLengthsAtomic(haveEffectiveLengths);
+
+    jointLog->info("restored the mapping state of {} shard(s) from {}: {} fragments, "
+                   "{} mapped, in {} equivalence classes",
+                   stats.numShards, stateDir.string(), stats.numObservedFragments,
+                   stats.numAssignedFragments, reader.numClasses());
+    return true;
+}
+
+/**
+ * The first half of --extend, before the new reads are mapped: read the
+ * state in stateDir into stats, and add its equivalence classes to those
+ * of experiment, so that the classes of the new reads are merged into
+ * them as they're built.
+ */
+bool beginExtendingState(ReadExperiment& experiment, SalmonOpts& sopt,
+                         const boost::filesystem::path& stateDir,
+                         salmon::shard::ShardStats& stats) {
+    auto jointLog = sopt.jointLog;
+
+    std::string err;
+    if (!salmon::shard::readStats(stateDir, stats, err)) {
+        jointLog->error("{}", err);
+        return false;
+    }
+    auto eqPath = stateDir / salmon::shard::eqClassesFileName;
+    BinaryEqClassReader reader(eqPath);
+    if (!reader.good()) {
+        jointLog->error("could not read the equivalence classes from {}", eqPath.string());
+        return false;
+    }
+
+    auto& transcripts = experiment.transcripts();
+    auto& names = reader.transcriptNames();
+    bool sameIndex = (names.size() == transcripts.size() and
+                      stats.projectedCounts.size() == transcripts.size());
+    for (size_t i = 0; sameIndex and i < names.size(); ++i) {
+        sameIndex = (names[i] == transcripts[i].RefName);
+    }
+    if (!sameIndex) {
+        jointLog->error("the state in {} was not mapped against the index {}",
+                        stateDir.string(), sopt.indexDirectory.string());
+        return false;
+    }
+    if (stats.fldLogMasses.size() != experiment.fragmentLengthDistribution()->logMasses().size()) {
+        jointLog->error("the fragment length distribution of the state has a different maximum "
+                        "length; please use the --fldMax of the run that wrote it");
+        return false;
+    }
+
+    auto& eqBuilder = experiment.equivalenceClassBuilder();
+    std::vector<uint32_t> labels;
+    std::vector<float> weights;
+    std::vector<double> auxWeights;
+    std::vector<double> noPosWeights;
+    uint64_t count{0};
+    while (reader.next(labels, weights, count)) {
+        if (weights.empty()) {
+            auxWeights.assign(labels.size(), 1.0 / labels.size());
+        } else {
+            auxWeights.assign(weights.begin(), weights.end());
+        }
+        // addGroup takes the weights summed over the count fragments (as
+        // ShardMerger sums them), so that the class keeps its weight against
+        // the fragments of the new reads
+        for (auto& w : auxWeights) { w *= count; }
+        eqBuilder.addGroup(TranscriptGroup(labels), auxWeights, noPosWeights, count);
+    }
+    if (!reader.good()) {
+        jointLog->error("{} is truncated", eqPath.string());
+        return false;
+    }
+    jointLog->info("extending the state in {}: {} fragments, {} mapped, in {} equivalence classes",
+                   stateDir.string(), stats.numObservedFragments, stats.numAssignedFragments,
+                   reader.numClasses());
+    return true;
+}
+
+/**
+ * The second half of --extend, once the new reads have been mapped (and
+ * their online estimates normalized): add the other statistics of the
+ * state to those of the new reads, and start the optimizer from the
+ * estimates of the state (its online ones, if it has no others) plus the
+ * online estimates of the new reads.
+ */
+void finishExtendingState(ReadExperiment& experiment, SalmonOpts& sopt,
+                          const salmon::shard::ShardStats& stats) {
+    auto jointLog = sopt.jointLog;
+
+    uint64_t newAssigned = experiment.numMappedFragments();
+    uint64_t numObserved = experiment.numObservedFragments() + stats.numObservedFragments;
+    uint64_t numAssigned = newAssigned + stats.numAssignedFragments;
+    experiment.numAssignedFragmentsAtomic() = numAssigned;
+    experiment.setNumObservedFragments(numObserved);
+    experiment.setUpperBoundHits(experiment.upperBoundHits() + stats.upperBoundHits);
+    if (numObserved > 0) {
+        experiment.setEffectiveMappingRate(static_cast<double>(numAssigned) / numObserved);
+    }
+
+    // The library type counts go to the library of the same format (if any)
+    for (size_t i = 0; i < stats.libFormats.size(); ++i) {
+        auto& libs = experiment.readLibraries();
+        auto it = std::find_if(libs.begin(), libs.end(), [&stats, i](ReadLibrary& rl) -> bool {
+            return rl.format().formatID() == stats.libFormats[i];
+        });
+        if (it == libs.end()) {
+            jointLog->warn("the state has a library of a type that the new reads lack; "
+                           "its library type counts are dropped");
+            continue;
+        }
+        auto counts = stats.libTypeCounts[i];
+        counts.resize(std::min(counts.size(), static_cast<size_t>(LibraryFormat::maxLibTypeID() + 1)));
+        it->updateLibTypeCounts(counts);
+    }
+
+    experiment.fragmentLengthDistribution()->addLogMasses(stats.fldLogMasses, stats.fldMinBin);
+    if (sopt.biasCorrect) {
+        auto& counts = experiment.readBias().counts;
+        if (stats.readBiasCounts.size() == counts.size()) {
+            for (size_t i = 0; i < counts.size(); ++i) { counts[i] += stats.readBiasCounts[i]; }
+        } else {
+            jointLog->warn("The state has no sequence-specific bias counts; the bias is modeled "
+                           "from the new reads alone");
+        }
+    }
+    if (sopt.gcBiasCorrect) {
+        auto& gc = experiment.observedGC();
+        if (stats.observedGC.size() == gc.size() and stats.gcFracFwd >= 0.0) {
+            for (size_t i = 0; i < gc.size(); ++i) { gc[i] += stats.observedGC[i]; }
+            if (numAssigned > 0) {
+                experiment.setGCFracForward((experiment.gcFracFwd() * newAssigned +
+                                             stats.gcFracFwd * stats.numAssignedFragments) / numAssigned);
+            }
+        } else {
+            jointLog->warn("The state has no fragment GC counts; the fragment GC bias is modeled "
+                           "from the new reads alone");
+        }
+    }
+    std::atomic<bool> haveEffectiveLengths{false};
+    experiment.updateTranscriptLengthsAtomic(haveEffectiveLengths);
+
+    auto& start = stats.estimatedCounts.empty() ? stats.projectedCounts : stats.estimatedCounts;
+    auto& transcripts = experiment.transcripts();
+    for (size_t i = 0; i < transcripts.size(); ++i) {
+        transcripts[i].projectedCounts += start[i];
+    }
+}
+
+int salmonQuantifyWithIndex(int argc, char *argv[], std::shared_ptr<SalmonIndex> sharedIndex,
+                            salmon::api::QuantResult* apiResult);
+
+int salmonQuantifyWithIndex(int argc, char *argv[], std::shared_ptr<SalmonIndex> sharedIndex) {
+    return salmonQuantifyWithIndex(argc, argv, sharedIndex, nullptr);
+}
+
 int salmonQuantify(int argc, char *argv[]) {
+    return salmonQuantifyWithIndex(argc, argv, nullptr);
+}
+
+/**
+ * salmon infer: as salmon quant --state <dir>, i.e. estimate the abundances
+ * from a mapping state rather than from reads.
+ */
+int salmonInfer(int argc, char *argv[]) {
+    bool haveState{false};
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--state") == 0 or std::strncmp(argv[i], "--state=", 8) == 0) {
+            haveState = true;
+        }
+    }
+    if (!haveState) {
+        std::cerr << "Usage: salmon infer --state <state directory> -i <index> -o <output> [quant options]\n"
+                  << "where the state was written by salmon quant --mapOnly, or salmon merge.\n"
+                  << "See salmon quant --help-reads for the options.\n";
+        return 1;
+    }
+    return salmonQuantifyWithIndex(argc, argv, nullptr);
+}
+
+/**
+ * As salmonQuantify, but quantify against sharedIndex, if it is provided,
+ * rather than loading the index named by --index (see salmon serve).  If
+ * apiResult is provided (see salmon::api::Quantifier), the abundances, the
+ * equivalence classes and any replicates are returned there rather than
+ * written to quant.sf and bootstraps.gz.
+ */
+int salmonQuantifyWithIndex(int argc, char *argv[], std::shared_ptr<SalmonIndex> sharedIndex,
+                            salmon::api::QuantResult* apiResult) {
     using std::cerr;
     using std::vector;
     using std::string;
@@ -1670,6 +3059,9 @@ int salmonQuantify(int argc, char *argv[]) {
     sopt.numThreads = std::thread::hardware_concurrency();
 
     double coverageThresh;
+    std::string maxMemoryStr;
+    std::string eqClassSpillStr;
+    std::string readaheadStr;
     vector<string> unmatedReadFiles;
     vector<string> mate1ReadFiles;
     vector<string> mate2ReadFiles;
@@ -1680,11 +3072,12 @@ int salmonQuantify(int argc, char *argv[]) {
     ("version,v", "print version string")
     ("help,h", "produce help message")
     ("index,i", po::value<string>()->required(), "Salmon index")
-    ("libType,l", po::value<std::string>()->required(), "Format string describing the library type")
+    ("libType,l", po::value<std::string>(), "Format string describing the library type (required unless --state is given)")
     ("unmatedReads,r", po::value<vector<string>>(&unmatedReadFiles)->multitoken(),
      "List of files containing unmated reads of (e.g. single-end reads)")
     ("mates1,1", po::value<vector<string>>(&mate1ReadFiles)->multitoken(),
-        "File containing the #1 mates")
+        "File containing the #1 mates (or an unaligned BAM / CRAM file, holding both mates, which is then "
+        "given to --mates2 as well)")
     ("mates2,2", po::value<vector<string>>(&mate2ReadFiles)->multitoken(),
         "File containing the #2 mates")
     ("allowOrphans", po::bool_switch(&(sopt.allowOrphans))->default_value(false), "Consider orphaned reads as valid hits when "
@@ -1709,6 +3102,11 @@ int salmonQuantify(int argc, char *argv[]) {
                                         "Enabling this option may improve sensitivity (the number of reads having sufficient coverage), but will "
                                         "typically slow down quantification by ~40%.  Consider enabling this option if you find the mapping rate to "
                                         "be significantly lower than expected.")
+    ("smemBatch", po::value<uint32_t>(&(sopt.smemBatchWidth))->default_value(0), "(FMD index only) Find the "
+                                        "SMEMs of this many reads (e.g. 32) at once, advancing their searches in turn and "
+                                        "prefetching the BWT occurrence blocks that each will read next, so that the search "
+                                        "is bound by memory bandwidth rather than latency.  The SMEMs are the same as those "
+                                        "found one read at a time (the default, 0).")
     ("coverage,c", po::value<double>(&coverageThresh)->default_value(0.70), "required coverage of read by union of SMEMs to consider it a \"hit\".")
     ("output,o", po::value<std::string>()->required(), "Output quantification file.")
     ("geneMap,g", po::value<string>(), "File containing a mapping of transcripts to genes.  If this file is provided "
@@ -1722,23 +3120,160 @@ int salmonQuantify(int argc, char *argv[]) {
     //("optChain", po::bool_switch(&optChain)->default_value(false), "Chain MEMs optimally rather than greedily")
 
     sopt.noRichEqClasses = false;
-    // mapping cache has been deprecated
-    sopt.disableMappingCache = true;
 
     po::options_description advanced("\n"
 		    		     "advanced options");
     advanced.add_options()
-    /*
-    ("disableMappingCache", po::bool_switch(&(sopt.disableMappingCache))->default_value(false), "Setting this option disables the creation and use "
-                                        "of the \"mapping cache\" file.  The mapping cache can speed up quantification significantly for smaller read "
-                                        "libraries (i.e. where the number of mapped fragments is less than the required number of observations). However, "
-                                        "for very large read libraries, the mapping cache is unnecessary, and disabling it may allow salmon to more effectively "
-                                        "make use of a very large number of threads.")
-    */
     ("auxDir", po::value<std::string>(&(sopt.auxDir))->default_value("aux"), "The sub-directory of the quantification directory where auxiliary information "
      			"e.g. bootstraps, bias parameters, etc. will be written.")
     ("dumpEq", po::bool_switch(&(sopt.dumpEq))->default_value(false), "Dump the equivalence class counts "
              "that were computed during quasi-mapping")
+    ("dumpEqBinary", po::bool_switch(&(sopt.dumpEqBinary))->default_value(false), "With --dumpEq, write the "
+             "equivalence classes (with their labels, weights and counts) to aux/eq_classes.bin, in the compact "
+             "binary layout of BinaryEquivalenceClasses.hpp, rather than to aux/eq_classes.txt")
+    ("eqLabelDict", po::value<std::string>(&(sopt.eqLabelDictPath))->default_value(""), "With --dumpEq, "
+             "give each equivalence class label an id in the (shared, append-only) label dictionary at this path, "
+             "adding the labels it doesn't have yet, and write the classes, with the ids of their labels rather "
+             "than the labels themselves, to aux/eq_class_ids.bin.  The samples quantified against an index may "
+             "all share its dictionary (even when run concurrently), so that their classes are merged by label id.")
+    ("mapOnly", po::bool_switch(&(sopt.mapOnly))->default_value(false), "Only map the reads (which may be "
+             "one shard, e.g. one lane, of a sample): write the equivalence classes and the other statistics of "
+             "the mapping pass to <output>/shard, rather than estimating the abundances.  The states of the shards "
+             "of a sample are combined by salmon merge, and quantified by salmon infer.")
+    ("onlineOnly", po::bool_switch(&(sopt.onlineOnly))->default_value(false), "Report the online estimates "
+             "of the (single) mapping pass, without building the equivalence classes or running the offline "
+             "optimization.  This is much faster, and uses much less memory, than the default, but the estimates "
+             "are less accurate, and the effective lengths are not bias-corrected; meant for triage and quick looks. "
+             "Cannot be combined with --dumpEq, --mapOnly, --state, --checkpoint, --saveState, --numBootstraps or "
+             "--numGibbsSamples.")
+    ("geneLevelOnly", po::bool_switch(&(sopt.geneLevelOnly))->default_value(false), "Estimate the abundances "
+             "of genes rather than of transcripts (requires --geneMap): the label of each equivalence class is "
+             "replaced by the genes of its transcripts as the fragments are added, which merges the classes over the "
+             "same genes, and the EM runs over the (far fewer) genes, the effective length of each gene being the mean "
+             "of those of its transcripts, weighted by their online estimates.  quant.genes.sf holds the estimates; "
+             "in quant.sf, each gene's estimate is split among its transcripts by their online estimates.  Cannot be "
+             "combined with --dumpEq, --mapOnly, --onlineOnly, --state, --checkpoint, --resume, --saveState, "
+             "--extend, --numBootstraps or --numGibbsSamples.")
+    ("state", po::value<std::string>(&(sopt.inferStatePath)), "Estimate the abundances from the mapping state "
+             "(written by --mapOnly or salmon merge) in this directory, rather than mapping reads; the index "
+             "must be the one against which the reads were mapped.  This is what salmon infer does.")
+    ("saveState", po::bool_switch(&(sopt.saveState))->default_value(false), "Write the state of the run "
+             "(the equivalence classes, the fragment length distribution, the bias and library type counts and the "
+             "estimates) to <output>/shard, so that reads added to the sample later can be quantified with it "
+             "(--extend) without mapping these again.")
+    ("extend", po::value<std::string>(&(sopt.extendStatePath)), "Map only the given (new) reads of a sample, "
+             "add them to the state of the earlier run(s) in this directory (written by --saveState, --mapOnly or "
+             "salmon merge), and quantify all of them, starting the optimizer from the earlier estimates.  The index "
+             "and --fldMax must be those of the earlier run(s).  Implies --saveState, so that the sample can be "
+             "extended again.")
+    ("checkpoint", po::bool_switch(&(sopt.checkpoint))->default_value(false), "Write the state of the mapping "
+             "pass, once it's done, and each bootstrap replicate, as it's drawn, to <output>/checkpoint, so "
+             "that an interrupted run can be resumed (with --resume) without mapping the reads or drawing "
+             "those replicates again.  The checkpoint is removed once the run completes.")
+    ("resume", po::bool_switch(&(sopt.resume))->default_value(false), "Resume an interrupted run from its "
+             "checkpoint (see --checkpoint): it must be given the same command line (and --seed) as the run "
+             "it resumes.  Without a checkpoint, the run starts from the beginning.")
+    ("asyncOutput", po::bool_switch(&(sopt.asyncOutput))->default_value(false), "Write the equivalence "
+             "classes (with --dumpEq) while the optimizer runs, and quant.sf while the bootstrap (or Gibbs) "
+             "replicates are drawn, on a background thread, rather than before them.")
+    ("profile", po::bool_switch(&(sopt.profile))->default_value(false), "Record the wall-clock time, CPU time "
+             "and peak memory (RSS) of each phase of the run (loading the index, each pass over the reads, the "
+             "optimizer, bootstrapping, writing the output), and write them to aux/profile.json.")
+    ("perfCounters", po::bool_switch(&(sopt.perfCounters))->default_value(false), "Also record the hardware "
+             "performance counters (cycles, instructions, last-level cache and dTLB misses; Linux perf_event) of each "
+             "phase and each thread, and of the mapping and mini-batch processing of the worker threads, in "
+             "aux/profile.json.  Implies --profile.")
+    ("metricsPort", po::value<uint32_t>(&(sopt.metricsPort))->default_value(0), "Serve the live metrics "
+             "of the run (fragments observed and mapped, the mapping rate, queue depths, the current phase, the "
+             "EM iteration and its max rel diff, the memory (RSS) and the bootstraps completed) over HTTP, in the "
+             "Prometheus text format, at /metrics on this port.  0 disables the endpoint.")
+    ("metricsAddress", po::value<std::string>(&(sopt.metricsAddress))->default_value("127.0.0.1"), "The "
+             "address on which --metricsPort listens (e.g. 0.0.0.0 for every interface).")
+    ("threadLocalEqClasses", po::bool_switch(&(sopt.threadLocalEqClasses))->default_value(false), "Have each "
+             "quantification thread accumulate equivalence classes in its own table, and merge these into the "
+             "shared table once per mini-batch.  This reduces contention on the shared table when using many threads.")
+    ("threadLocalTranscriptUpdates", po::bool_switch(&(sopt.threadLocalTranscriptUpdates))->default_value(false),
+             "Have each quantification thread sum its updates to the transcript masses and counts of the online "
+             "phase (and to the transcript clusters) privately, and apply them once per mini-batch.  This avoids the contention on highly expressed "
+             "transcripts, but the fragments of a mini-batch no longer see each other's updates.")
+    ("pipelineMiniBatches", po::bool_switch(&(sopt.pipelineMiniBatches))->default_value(false), "Assign the "
+             "fragments of each mini-batch in a separate (work-stealing) task, so that each mapping thread can begin "
+             "mapping its next mini-batch immediately.  This overlaps the mapping and assignment of fragments, and "
+             "lets idle threads pick up the assignment of slow mini-batches.")
+    ("inferenceThreads", po::value<uint32_t>(&(sopt.numInferenceThreads))->default_value(0), "The number of "
+             "threads (in addition to --threads) dedicated to the online inference.  The mapping threads then only map, "
+             "and pass their mini-batches through a bounded queue to these threads, which update the abundances, the "
+             "auxiliary models and the equivalence classes.  Only applies to the quasi-index; takes precedence over "
+             "--pipelineMiniBatches.")
+    ("hugePages", po::bool_switch(&(sopt.hugePages))->default_value(false), "Ask the kernel to back the "
+             "largest arrays of the index and the equivalence classes with transparent huge pages, which reduces "
+             "the TLB misses of their random accesses.")
+    ("releaseIndex", po::bool_switch(&(sopt.releaseIndex))->default_value(false), "Free the index as soon as "
+             "the fragments have been mapped, rather than keeping it through the optimization, bootstrapping and "
+             "Gibbs sampling, which only need the equivalence classes (and, with --seqBias, the transcript "
+             "sequences, which are copied out of it first).")
+    ("maxMemory", po::value<std::string>(&maxMemoryStr), "A budget for the memory of the run, in bytes (or with a "
+             "K, M, G or T suffix, e.g. 16G).  The buffers of the parser, the equivalence class map and the caches of "
+             "fragments are sized to fit it, alongside the index, rather than from their defaults, and the planned "
+             "allocation is reported.")
+    ("readahead", po::value<std::string>(&readaheadStr), "Read each input file (reads, or alignments) this many "
+             "bytes (or with a K, M, G or T suffix, e.g. 256M) ahead of its parser, on a separate I/O thread, so that "
+             "the latency spikes of network storage (NFS, Lustre) don't stall the parsing.  The time the parsers still "
+             "spend waiting for the storage is reported in aux/meta_info.json.")
+    ("eqClassSpill", po::value<std::string>(&eqClassSpillStr), "Spill the equivalence classes to disk (in the "
+             "output directory) whenever their table takes about this many bytes (or with a K, M, G or T suffix, "
+             "e.g. 8G), and merge them back once the fragments have been assigned.  This bounds the memory of the "
+             "table for references with a huge number of distinct classes (e.g. metagenomic ones).")
+    ("eqClassMergeTolerance", po::value<double>(&(sopt.eqClassMergeTolerance))->default_value(0.0), "Before the "
+             "optimization, merge the rich equivalence classes whose (normalized) weights are within this L1 "
+             "distance of each other, e.g. 0.01; the label of a merged class is the union of those of its classes, "
+             "and its weights their count-weighted mean.  This shrinks the classes the EM, the bootstraps and the "
+             "Gibbs sampler iterate over, at a controlled cost in accuracy; a middle ground between the rich classes "
+             "and none.  0 (the default) merges none.")
+    ("minEqClassCount", po::value<uint64_t>(&(sopt.minEqClassCount))->default_value(0), "Before the "
+             "optimization, fold each equivalence class of fewer fragments than this into its nearest neighbour "
+             "(the most similar class with the same highest-weight transcript), if it has one.  0 (the default) "
+             "folds none.")
+    ("numaInterleave", po::bool_switch(&(sopt.numaInterleave))->default_value(false), "Interleave the memory "
+             "allocated by salmon (in particular the index) across all of the NUMA nodes, rather than placing it "
+             "on the node of the thread that loads it.  This balances the cross-socket traffic of the mapping "
+             "threads on multi-socket machines.")
+    ("concurrentLibraries", po::bool_switch(&(sopt.concurrentLibraries))->default_value(false), "When "
+             "there are several read libraries (e.g. single-end and paired-end lanes of a sample), map up to "
+             "--threads of them at once, each with its own share of the threads, rather than one after another "
+             "with all of them; a share that finishes its library moves on to the next (the largest first).  "
+             "This keeps the threads busy when there are many small libraries.")
+    ("pinThreads", po::bool_switch(&(sopt.pinThreads))->default_value(false), "Pin each of the mapping "
+             "threads, and each worker thread of the task arena shared by the EM, Gibbs sampler and bootstraps, "
+             "to its own CPU.")
+    ("verifyIndex", po::bool_switch(&(sopt.verifyIndex))->default_value(false), "Check each component of "
+             "the index against the checksum recorded when the index was built, and exit if any is missing or "
+             "corrupt, before loading the index.")
+    ("shmIndex", po::value<std::string>(&(sopt.shmIndex)), "Load the (FMD) index into the named POSIX "
+             "shared-memory segment (e.g. gencode; /dev/shm/salmon.gencode), or file (a path, e.g. on a hugetlbfs "
+             "mount, for huge pages), unless another salmon process on the machine already has, and attach to it "
+             "read-only, so that the index is read once per machine rather than once per run or container.  The "
+             "segment is kept after the run, for the next one; it's checked against the version of the index, and a "
+             "stale one is replaced once no process uses it.  Requires an index built with this version of salmon.")
+    ("mappingCache", po::bool_switch(&(sopt.useMappingCache))->default_value(false), "Write the quasi-mappings "
+             "of each fragment to a binary \"mapping cache\" in the output directory during the first pass over the reads, "
+             "and replay them, rather than re-mapping the reads, in any subsequent pass.  The cache is removed once "
+             "quantification has finished.")
+    ("writeMappings", po::value<std::string>(&(sopt.mappingOutputPath))->default_value(""), "Write the "
+             "quasi-mappings of the reads, as SAM records, to the given file (\"-\" for stdout).  Each mapping "
+             "thread formats its records in its own buffer, and writes them out in large blocks.")
+    ("writePosteriors", po::bool_switch(&(sopt.writePosteriors))->default_value(false), "Once the abundances "
+             "have been estimated, write the posterior probability with which each mapped fragment is assigned to "
+             "each of its transcripts to aux/posteriors.gz (in a compact binary format, described in "
+             "include/PosteriorWriter.hpp).  This keeps the mapping cache until the posteriors have been written.")
+    ("writeUnmappedNames", po::bool_switch(&(sopt.writeUnmappedNames))->default_value(false), "Write the names "
+             "of the fragments that weren't mapped to aux/unmapped_names.gz, each followed by the reason: u (no "
+             "mapping was found), m (more than --maxReadOccs mappings) or s (too short to be mapped).  The names "
+             "are written only during the first pass over the reads.")
+    ("singlePass", po::bool_switch(&(sopt.singlePass))->default_value(false), "Quantify the reads in a single pass, "
+             "without ever re-reading the input (this is enabled automatically when the reads come from a pipe or "
+             "a FIFO).  The fragments mapped before the auxiliary models are trained are kept in the mapping cache, "
+             "and are added to the equivalence classes, with the trained models, at the end of the pass.")
     ("gcSizeSamp", po::value<std::uint32_t>(&(sopt.gcSampFactor))->default_value(1), "The value by which to down-sample transcripts when representing the "
                 "GC content.  Larger values will reduce memory usage, but may decrease the fidelity of bias modeling results.")
     ("gcSpeedSamp", po::value<std::uint32_t>(&(sopt.pdfSampFactor))->default_value(1), "The value at which the fragment length PMF is down-sampled "
@@ -1747,6 +3282,20 @@ int salmonQuantify(int argc, char *argv[]) {
      "assigned.  When this flag is set, if the intersection of the quasi-mappings for the left and right "
      "is empty, then all mappings for the left and all mappings for the right read are reported as orphaned "
      "quasi-mappings")
+    ("trimAdapters", po::value<std::vector<std::string>>(&(sopt.trimAdapters))->multitoken(), "Trim these 3' "
+     "adapters (sequences, or illumina, nextera or smallrna) from the reads before mapping them, rather than "
+     "trimming them with a separate tool first.  A read is cut where it starts to match an adapter (over at "
+     "least 3 bases, with at most 1 mismatch per 10).")
+    ("trimQuality", po::value<uint32_t>(&(sopt.trimQuality))->default_value(0), "Cut the reads at the first window "
+     "of --trimWindow bases whose mean (phred) quality is below this, before mapping them.  0 disables this.")
+    ("trimWindow", po::value<uint32_t>(&(sopt.trimWindow))->default_value(4), "The width of the windows of "
+     "--trimQuality.")
+    ("trimPolyA", po::value<uint32_t>(&(sopt.trimPolyA))->default_value(0), "Trim poly-A tails (and poly-T heads) "
+     "at least this long from the reads before mapping them.  0 disables this.")
+    ("mateVerify", po::value<uint32_t>(&(sopt.mateVerifyMaxHits))->default_value(0), "(paired-end reads only) If the "
+     "left mate of a pair hits at most this many transcripts, check the right mate directly against their "
+     "sequence (near the left mate's hits), rather than searching the index for it; it's searched for as usual "
+     "unless it's found near every one of them.  0 disables this.")
     ("fldMax" , po::value<size_t>(&(sopt.fragLenDistMax))->default_value(1000), "The maximum fragment length to consider when building the empirical "
      											      "distribution")
     ("fldMean", po::value<size_t>(&(sopt.fragLenDistPriorMean))->default_value(200), "The mean used in the fragment length distribution prior")
@@ -1773,7 +3322,8 @@ int salmonQuantify(int argc, char *argv[]) {
                         "If this option is enabled, then bias correction will be allowed to estimate effective lengths "
                         "shorter than the approximate mean fragment length")
     ("numBiasSamples", po::value<int32_t>(&numBiasSamples)->default_value(1000000),
-            "Number of fragment mappings to use when learning the sequence-specific bias model.")
+            "Number of fragment mappings to use when learning the sequence-specific bias model.  These are "
+            "sampled uniformly at random from all of the mapped fragments of the first pass over the reads.")
     ("numAuxModelSamples", po::value<uint32_t>(&(sopt.numBurninFrags))->default_value(5000000), "The first <numAuxModelSamples> are used to train the "
      			"auxiliary model parameters (e.g. fragment length distribution, bias, etc.).  After ther first <numAuxModelSamples> observations "
 			"the auxiliary model parameters will be assumed to have converged and will be fixed.")
@@ -1785,6 +3335,35 @@ int salmonQuantify(int argc, char *argv[]) {
                                         "[Deprecated]: The minimum number of observations (mapped reads) that must be observed before "
                                         "the inference procedure will terminate.  If fewer mapped reads exist in the "
                                         "input file, then it will be read through multiple times.")
+    ("stopOnConvergence", po::bool_switch(&(sopt.stopOnConvergence))->default_value(false), "Stop mapping "
+                                        "once the online abundance estimates and the equivalence classes have converged: when, "
+                                        "for 3 consecutive checks (every --convergenceInterval fragments, after burn-in), the "
+                                        "estimates have moved by less than --convergenceTol (in total variation distance) and the "
+                                        "number of equivalence classes has grown by less than that fraction.")
+    ("convergenceTol", po::value<double>(&(sopt.convergenceTolerance))->default_value(1e-3),
+                                        "The tolerance of --stopOnConvergence")
+    ("convergenceInterval", po::value<uint64_t>(&(sopt.convergenceInterval))->default_value(1000000),
+                                        "The number of fragments between the checks of --stopOnConvergence")
+    ("maxFragments", po::value<uint64_t>(&(sopt.maxFragments))->default_value(0), "Map at most this many "
+                                        "fragments (the first ones of the input), e.g. to quantify a subsample of a very deep "
+                                        "library; 0 maps them all.")
+    ("extrapolate", po::bool_switch(&(sopt.extrapolate))->default_value(false), "If mapping stops early "
+                                        "(--stopOnConvergence or --maxFragments), read (but don't map) the rest of the input, and "
+                                        "scale the estimated counts (and the bootstrap replicates) to the number of fragments "
+                                        "in the whole input.  Otherwise, the rest of the input is not read.")
+    ("snapshotInterval", po::value<uint64_t>(&(sopt.snapshotInterval))->default_value(0), "While the "
+                                        "reads are being mapped (with the quasi-index), write a snapshot of the abundance "
+                                        "estimates to quant_snapshot.sf in the output directory every <snapshotInterval> "
+                                        "fragments, e.g. to follow a real-time sequencing run.  Each snapshot is a short EM "
+                                        "over the equivalence classes observed so far, started from the online estimates, "
+                                        "and replaces the previous one atomically; mapping carries on meanwhile.  0 disables "
+                                        "the snapshots.")
+    ("snapshotEMRounds", po::value<uint32_t>(&(sopt.snapshotEMRounds))->default_value(100), "The most rounds "
+                                        "of the EM run for each snapshot of --snapshotInterval.")
+    ("readHitCache", po::value<uint32_t>(&(sopt.readHitCacheSize))->default_value(0), "Have each mapping "
+                                        "thread cache the hits of the last <readHitCache> read sequences it mapped, so that "
+                                        "duplicates of them (of which e.g. amplicon, low-input and 3' tag libraries have many) "
+                                        "are not mapped again; each duplicate still counts as a fragment.  0 disables the cache.")
     ("splitWidth,s", po::value<int>(&(memOptions->split_width))->default_value(0), "If (S)MEM occurs fewer than this many times, search for smaller, contained MEMs. "
                                         "The default value will not split (S)MEMs, a higher value will result in more MEMs being explore and, thus, will "
                                         "result in increased running time.")
@@ -1792,10 +3371,113 @@ int salmonQuantify(int argc, char *argv[]) {
                                         "boundary between two transcripts.  This can improve the  fragment hit-rate, but is usually not necessary.")
     ("useVBOpt", po::bool_switch(&(sopt.useVBOpt))->default_value(false), "Use the Variational Bayesian EM rather than the "
      			"traditional EM algorithm for optimization in the batch passes.")
+    ("useSQUAREM", po::bool_switch(&(sopt.useSQUAREM))->default_value(false), "Accelerate the traditional EM "
+                           "algorithm (in the batch passes and bootstraps) with SQUAREM. Each round extrapolates from two EM "
+                           "updates, and typically requires several times fewer rounds to converge. This has no effect with --useVBOpt.")
+    ("threadLocalEMBuffers", po::bool_switch(&(sopt.threadLocalEMBuffers))->default_value(false), "Have each "
+                           "thread of the batch (EM / VBEM) optimizer accumulate its updates in its own dense buffer, rather than "
+                           "atomically updating the shared abundance vector.  This reduces contention with many threads, at the cost of "
+                           "one abundance vector of memory per thread.")
+    ("deterministic", po::bool_switch(&(sopt.deterministic))->default_value(false), "Make the offline "
+                           "estimates independent of the number of threads, bit for bit: the updates of the (EM / VBEM) "
+                           "optimizer are summed per transcript in a fixed order, the bootstrap replicates are written in "
+                           "order, and the Gibbs samples are drawn from a single chain (unless --numGibbsChains is given) "
+                           "split into a fixed number of blocks.  The mapping pass still depends on the order in which "
+                           "the threads process the fragments (its online estimates and models are updated as it goes); "
+                           "to compare runs bit for bit, estimate them from the same mapping state (--state).")
+    ("componentEM", po::bool_switch(&(sopt.componentEM))->default_value(false), "Split the equivalence classes "
+                           "into the connected components of the graph in which transcripts sharing a class are adjacent, and run "
+                           "the traditional EM on each component independently (and in parallel), with its own convergence test. "
+                           "Components that converge quickly stop early, rather than waiting on the slowest. This has no effect with "
+                           "--useVBOpt, and takes precedence over --useSQUAREM.")
+    ("activeSetEM", po::bool_switch(&(sopt.activeSetEM))->default_value(false), "Have the traditional "
+                           "EM (in the batch passes) freeze the transcripts whose abundance falls below 1e-8, and leave them out of "
+                           "the equivalence classes it iterates over; every 20th round (and each round after the effective lengths "
+                           "are recomputed) visits all of them again, so frozen transcripts can recover.  This has no effect "
+                           "with --useVBOpt or --componentEM.")
+    ("mixedPrecisionEM", po::bool_switch(&(sopt.mixedPrecisionEM))->default_value(false), "Have the batch (EM / "
+                           "VBEM) optimizer and the bootstraps read the equivalence class weights in single precision, while "
+                           "still accumulating the abundances in double precision.  This roughly halves the memory traffic of "
+                           "each round, at the cost of a small loss of precision in the weights.")
+    ("gpu", po::bool_switch(&(sopt.useGPU))->default_value(false), "Run the rounds of the batch (EM / VBEM) "
+                           "optimizer, and the EM of the bootstrap replicates (many replicates at a time), on a CUDA device.  "
+                           "This requires salmon to have been built with -DENABLE_CUDA=ON; otherwise, or if no device is found, "
+                           "the optimizer runs on the CPU.  It has no effect with --useSQUAREM, --componentEM or --activeSetEM.")
+    ("initFromQuant", po::value<std::string>(&(sopt.initialAbundanceFile))->default_value(""), "A quant.sf file "
+                           "written by a previous run of salmon quant (e.g. on the same sample, with slightly different options). "
+                           "The estimated read counts of this file are used, rather than the online estimates, as the starting point "
+                           "of the batch (EM / VBEM) optimizer.  Transcripts are matched by name; those not present in the file start "
+                           "from their online estimates.")
+    ("bootstrapFromPointEstimate", po::bool_switch(&(sopt.bootstrapFromPointEstimate))->default_value(false), "Start the "
+                           "optimization of each bootstrap replicate from the point estimate, rather than from a uniform "
+                           "abundance vector.  This typically requires far fewer rounds per replicate.")
+    ("biasUpdateTolerance", po::value<double>(&(sopt.biasUpdateTolerance))->default_value(0.0), "When the effective "
+                           "lengths are re-computed for bias correction, the expected bias of the transcriptome is updated "
+                           "incrementally from the previous round.  Transcripts whose weight (abundance / effective length) has "
+                           "changed by a relative amount of at most this tolerance are not re-scanned, and keep their previous "
+                           "contribution.  The default of 0 gives the same result as a full re-computation.")
+    ("asyncBiasUpdate", po::bool_switch(&(sopt.asyncBiasUpdate))->default_value(false), "Recompute the "
+                           "bias-corrected effective lengths in the background, from a snapshot of the abundances, while the "
+                           "EM / VBEM rounds continue; the new lengths are swapped in between two rounds once they're ready, "
+                           "so the rounds never wait for them.  After the first recomputation (at round 50), the next starts "
+                           "once the abundances have moved by more than 1% (in total variation) from the last snapshot, or "
+                           "at rounds 500 and 1000 at the latest.  The estimates then depend on the timing of the updates; "
+                           "this is ignored with --deterministic, --componentEM and --gpu.")
+    ("seed", po::value<uint64_t>(&(sopt.seed)), "Seed the random number generators used for sampling, bootstrapping "
+     "and the online assignment of fragments.  Each bootstrap replicate and Gibbs chain draws from its own stream derived "
+     "from this seed, so, given the same input, these are reproducible; the bootstrap replicates are written in the order "
+     "of their streams, however the threads finish them.  By default, the generators are seeded randomly.")
     ("numGibbsSamples", po::value<uint32_t>(&(sopt.numGibbsSamples))->default_value(0), "Number of Gibbs sampling rounds to "
      "perform.")
+    ("numGibbsChains", po::value<uint32_t>(&(sopt.numGibbsChains))->default_value(0), "The number of independent "
+     "Gibbs chains, each with its own state and random number stream, from which the samples are drawn.  The chains run in "
+     "parallel, and their samples are interleaved in the output.  The default (0) runs one chain per thread.  With "
+     "fewer chains than threads, each round of a chain is also split over the connected components of the "
+     "equivalence classes, which are sampled in parallel.")
+    ("gibbsBurnin", po::value<uint32_t>(&(sopt.gibbsBurnin))->default_value(0), "The number of rounds of each Gibbs "
+     "chain that are discarded before its first sample is recorded.")
+    ("thinningFactor", po::value<uint32_t>(&(sopt.gibbsThinningFactor))->default_value(1), "The number of rounds of "
+     "each Gibbs chain that are performed per recorded sample (by default, every round is recorded, as before).")
     ("numBootstraps", po::value<uint32_t>(&(sopt.numBootstraps))->default_value(0), "Number of bootstrap samples to generate. Note: "
-      "This is mutually exclusive with Gibbs sampling.");
+      "This is mutually exclusive with Gibbs sampling.  With --adaptiveBootstraps, this is the most that are drawn.")
+    ("adaptiveBootstraps", po::bool_switch(&(sopt.adaptiveBootstraps))->default_value(false), "Stop drawing "
+                           "bootstrap replicates once the variances of the expressed transcripts have settled: after "
+                           "--minBootstraps replicates, the variances are compared every 10 replicates, and no more are drawn "
+                           "once their total relative change is below --bootstrapVarianceTolerance.  The number drawn is "
+                           "recorded (as num_bootstraps) in aux/meta_info.json.")
+    ("minBootstraps", po::value<uint32_t>(&(sopt.minBootstraps))->default_value(20), "The fewest bootstrap "
+                           "replicates drawn with --adaptiveBootstraps.")
+    ("bootstrapVarianceTolerance", po::value<double>(&(sopt.bootstrapVarianceTolerance))->default_value(0.05), "With "
+                           "--adaptiveBootstraps, the relative change in the variances of the expressed transcripts between "
+                           "checks below which no more replicates are drawn.")
+    ("bootstrapBatchSize", po::value<uint32_t>(&(sopt.bootstrapBatchSize))->default_value(1), "The number of "
+                           "bootstrap replicates that each thread optimizes together.  Each round of the EM then visits every "
+                           "equivalence class once for all of the replicates of the batch, rather than once per replicate.  This "
+                           "applies to the traditional EM only (i.e. not with --useVBOpt or --useSQUAREM).")
+    ("numBootstrapWriters", po::value<uint32_t>(&(sopt.numBootstrapWriters))->default_value(0), "The number of "
+                           "threads that compress the bootstrap (or Gibbs) replicates.  Each replicate is compressed "
+                           "separately, and the results are concatenated (in order) into a single gzip file, so that the "
+                           "sampling threads don't wait on one another to write their replicates.  With the default (0), the "
+                           "replicates are compressed, one at a time, by the threads that draw them.")
+    ("bootstrapCompressionLevel", po::value<int>(&(sopt.bootstrapCompressionLevel))->default_value(6), "The gzip "
+                           "compression level (1 = fastest, 9 = smallest) of the bootstrap (or Gibbs) replicates.")
+    ("summarizeSamples", po::bool_switch(&(sopt.summarizeSamples))->default_value(false), "Accumulate the mean, "
+                           "variance and quantiles (2.5%, 25%, 50%, 75% and 97.5%) of each transcript over the bootstrap "
+                           "(or Gibbs) replicates as they are drawn, and write them to aux/bootstrap/summary.tsv.")
+    ("noSampleReplicates", po::bool_switch(&(sopt.noSampleReplicates))->default_value(false), "With "
+                           "--summarizeSamples and / or --columnarBootstraps, don't write aux/bootstrap/bootstraps.gz.")
+    ("columnarBootstraps", po::bool_switch(&(sopt.columnarBootstraps))->default_value(false), "Also write the "
+                           "bootstrap (or Gibbs) replicates to aux/bootstrap/bootstraps.cols, in which the replicates of each "
+                           "transcript are stored together, in independently-compressed chunks of transcripts, so that the "
+                           "replicates of any subset of the transcripts can be read efficiently (see ColumnarBootstraps.hpp).  "
+                           "The replicates are held in memory until they have all been drawn.")
+    ("binaryQuant", po::bool_switch(&(sopt.binaryQuant))->default_value(false), "Also write the abundances "
+                           "to quant.bin, a binary, columnar copy of quant.sf that can be memory-mapped rather than "
+                           "parsed (see BinaryQuant.hpp).")
+    ("expandDuplicates", po::bool_switch(&(sopt.expandDuplicates))->default_value(false), "If the index was "
+                           "built with --collapseDuplicates, also list in quant.sf the transcripts left out of it for "
+                           "duplicating the sequence of another; the abundance of each retained transcript is split "
+                           "evenly between it and its duplicates.  Otherwise, only the retained transcript is listed.");
 
     po::options_description testing("\n"
             "testing options");
@@ -1832,11 +3514,89 @@ transcript abundance from RNA-seq reads
 )";
             std::cout << hstring << std::endl;
             std::cout << visible << std::endl;
-            std::exit(1);
+            salmon::utils::exitRun(1);
         }
 
         po::notify(vm);
+        sopt.haveSeed = (vm.count("seed") > 0);
 
+        // The library type is recorded in a mapping state
+        bool inferFromState = !sopt.inferStatePath.empty();
+        if (!inferFromState and !vm.count("libType")) {
+            throw po::required_option("libType");
+        }
+        if (inferFromState and sopt.mapOnly) {
+            std::cerr << "--mapOnly and --state cannot be given together\n";
+            salmon::utils::exitRun(1);
+        }
+
+        if (!sopt.extendStatePath.empty()) {
+            if (inferFromState or sopt.mapOnly or sopt.onlineOnly or sopt.resume) {
+                std::cerr << "--extend cannot be combined with --state, --mapOnly, --onlineOnly or --resume\n";
+                salmon::utils::exitRun(1);
+            }
+            sopt.saveState = true;
+        }
+
+        // The online estimates need neither the equivalence classes nor a
+        // second look at the reads
+        if (sopt.onlineOnly) {
+            if (sopt.dumpEq or sopt.mapOnly or inferFromState or sopt.checkpoint or sopt.saveState or
+                sopt.numBootstraps > 0 or sopt.numGibbsSamples > 0) {
+                std::cerr << "--onlineOnly cannot be combined with --dumpEq, --mapOnly, --state, --checkpoint, "
+                          << "--saveState, --numBootstraps or --numGibbsSamples\n";
+                salmon::utils::exitRun(1);
+            }
+            sopt.useMappingCache = false;
+            sopt.singlePass = false;
+        }
+
+        // The classes of the gene-level EM are only good for it
+        if (sopt.geneLevelOnly) {
+            if (!vm.count("geneMap")) {
+                std::cerr << "--geneLevelOnly requires --geneMap\n";
+                salmon::utils::exitRun(1);
+            }
+            if (sopt.dumpEq or sopt.mapOnly or sopt.onlineOnly or inferFromState or sopt.checkpoint or
+                sopt.resume or sopt.saveState or sopt.numBootstraps > 0 or sopt.numGibbsSamples > 0 or apiResult) {
+                std::cerr << "--geneLevelOnly cannot be combined with --dumpEq, --mapOnly, --onlineOnly, --state, "
+                          << "--checkpoint, --resume, --saveState, --extend, --numBootstraps or --numGibbsSamples\n";
+                salmon::utils::exitRun(1);
+            }
+        }
+
+        // The posteriors are computed by replaying the mapping cache once the abundances are known
+        if (sopt.writePosteriors) {
+            if (sopt.onlineOnly or sopt.geneLevelOnly or sopt.singlePass or sopt.mapOnly or inferFromState) {
+                std::cerr << "--writePosteriors cannot be combined with --onlineOnly, --geneLevelOnly, "
+                          << "--singlePass, --mapOnly or --state\n";
+                salmon::utils::exitRun(1);
+            }
+            sopt.useMappingCache = true;
+        }
+
+        // The snapshots are estimated from the transcript-level classes held in memory
+        if (sopt.snapshotInterval > 0 and (sopt.geneLevelOnly or !eqClassSpillStr.empty() or inferFromState)) {
+            std::cerr << "--snapshotInterval cannot be combined with --geneLevelOnly, --eqClassSpill or --state\n";
+            salmon::utils::exitRun(1);
+        }
+
+        if (!sopt.trimAdapters.empty() or sopt.trimQuality > 0 or sopt.trimPolyA > 0) {
+            sopt.readTrimmer.reset(new ReadTrimmer(sopt.trimAdapters, sopt.trimQuality,
+                                                   sopt.trimWindow, sopt.trimPolyA));
+        }
+        if (sopt.perfCounters) { sopt.profile = true; }
+        if (sopt.metricsPort > 65535) {
+            std::cerr << "--metricsPort must be a TCP port (at most 65535)\n";
+            salmon::utils::exitRun(1);
+        }
+        // The metrics report the current phase of the profiler
+        if (sopt.profile or sopt.metricsPort > 0) { sopt.profiler.reset(new RunProfiler()); }
+        if (sopt.perfCounters and !sopt.profiler->enableHardwareCounters()) {
+            fmt::print(stderr, "Warning: the hardware performance counters are not available "
+                       "(see /proc/sys/kernel/perf_event_paranoid); --perfCounters is ignored.\n");
+            sopt.perfCounters = false;
+        }
 
 
         std::stringstream commentStream;
@@ -1872,7 +3632,7 @@ transcript abundance from RNA-seq reads
             if (!bfs::exists(geneMapPath)) {
                 std::cerr << "Could not find transcript <=> gene map file " << geneMapPath << "\n";
                 std::cerr << "Exiting now: please either omit the \'geneMap\' option or provide a valid file\n";
-                std::exit(1);
+                salmon::utils::exitRun(1);
             }
         }
 
@@ -1882,12 +3642,22 @@ transcript abundance from RNA-seq reads
         if (!(bfs::exists(outputDirectory) and bfs::is_directory(outputDirectory))) {
             std::cerr << "Couldn't create output directory " << outputDirectory << "\n";
             std::cerr << "exiting\n";
-            std::exit(1);
+            salmon::utils::exitRun(1);
         }
 
         bfs::path indexDirectory(vm["index"].as<string>());
         bfs::path logDirectory = outputDirectory / "logs";
 
+        // With --resume, a checkpointed mapping pass is restored like a
+        // mapping state (--state)
+        bfs::path checkpointDir = outputDirectory / "checkpoint";
+        bool resumedMapping{false};
+        if (sopt.resume and !inferFromState and
+            bfs::exists(checkpointDir / "mapping" / salmon::shard::statsFileName)) {
+            sopt.inferStatePath = (checkpointDir / "mapping").string();
+            inferFromState = resumedMapping = true;
+        }
+
         sopt.indexDirectory = indexDirectory;
         sopt.outputDirectory = outputDirectory;
 
@@ -1896,7 +3666,7 @@ transcript abundance from RNA-seq reads
         if (!(bfs::exists(logDirectory) and bfs::is_directory(logDirectory))) {
             std::cerr << "Couldn't create log directory " << logDirectory << "\n";
             std::cerr << "exiting\n";
-            std::exit(1);
+            salmon::utils::exitRun(1);
         }
         std::cerr << "Logs will be written to " << logDirectory.string() << "\n";
 
@@ -1914,12 +3684,41 @@ transcript abundance from RNA-seq reads
         sopt.jointLog = jointLog;
         sopt.fileLog = fileLog;
 
+        // Serve the live metrics of the run, if requested, for as long as it runs
+        std::unique_ptr<salmon::metrics::Server> metricsServer;
+        if (sopt.metricsPort > 0) {
+            sopt.metrics = std::make_shared<salmon::metrics::Registry>(sopt.profiler);
+            try {
+                metricsServer.reset(new salmon::metrics::Server(sopt.metrics, sopt.metricsAddress,
+                                                                static_cast<uint16_t>(sopt.metricsPort)));
+                jointLog->info("serving the metrics of the run at http://{}:{}/metrics",
+                               sopt.metricsAddress, metricsServer->port());
+            } catch (std::exception& e) {
+                jointLog->warn("could not serve the metrics on {}:{} ({}); continuing without them",
+                               sopt.metricsAddress, sopt.metricsPort, e.what());
+            }
+        }
+        if (resumedMapping) {
+            jointLog->info("resuming from the checkpointed mapping pass in {}", sopt.inferStatePath);
+        }
+
         // Verify that no inconsistent options were provided
         if (sopt.numGibbsSamples > 0 and sopt.numBootstraps > 0) {
             jointLog->error("You cannot perform both Gibbs sampling and bootstrapping. "
                             "Please choose one.");
             jointLog->flush();
-            std::exit(1);
+            salmon::utils::exitRun(1);
+        }
+        if (sopt.adaptiveBootstraps) {
+            if (sopt.numBootstraps == 0) {
+                jointLog->warn("--adaptiveBootstraps has no effect without --numBootstraps");
+                sopt.adaptiveBootstraps = false;
+            } else if (sopt.minBootstraps > sopt.numBootstraps) {
+                jointLog->warn("--minBootstraps ({}) exceeds --numBootstraps; drawing {} bootstraps",
+                               sopt.minBootstraps, sopt.numBootstraps);
+                sopt.adaptiveBootstraps = false;
+            }
+            sopt.maxBootstraps = sopt.numBootstraps;
         }
 
         {
@@ -1927,7 +3726,7 @@ transcript abundance from RNA-seq reads
                 jointLog->info() << "Error: You cannot enable --noFragLengthDist without "
                                  << "also enabling --noEffectiveLengthCorrection; exiting!\n";
                 jointLog->flush();
-                std::exit(1);
+                salmon::utils::exitRun(1);
             }
         }
 
@@ -1951,14 +3750,73 @@ transcript abundance from RNA-seq reads
 
         jointLog->info() << "parsing read library format";
 
-        vector<ReadLibrary> readLibraries = salmon::utils::extractReadLibraries(orderedOptions);
+        // With --state, the libraries (and their counts) are those of the state
+        vector<ReadLibrary> readLibraries;
+        if (!inferFromState) {
+            readLibraries = salmon::utils::extractReadLibraries(orderedOptions);
+        }
 
         SalmonIndexVersionInfo versionInfo;
         boost::filesystem::path versionPath = indexDirectory / "versionInfo.json";
         versionInfo.load(versionPath);
         auto idxType = versionInfo.indexType();
 
-        ReadExperiment experiment(readLibraries, indexDirectory, sopt);
+        // A shared (already loaded) index was verified by its owner
+        if (sopt.verifyIndex and !sharedIndex and
+            !salmon::utils::IndexChecksums::verify(indexDirectory, jointLog)) {
+            jointLog->error("The index {} failed verification; please rebuild it", indexDirectory.string());
+            salmon::utils::exitRun(1);
+        }
+
+        if (!sopt.shmIndex.empty() and idxType != SalmonIndexType::FMD) {
+            jointLog->warn("--shmIndex only applies to the FMD index (the quasi index is deserialized "
+                           "into the heap by RapMap); ignoring it");
+            sopt.shmIndex.clear();
+        }
+
+        if (sopt.numaInterleave and !salmon::utils::interleaveMemoryAcrossNodes()) {
+            jointLog->warn("Could not interleave memory across the NUMA nodes; using the default placement");
+        }
+
+        if (!maxMemoryStr.empty()) {
+            if (!MemoryBudget::parseBytes(maxMemoryStr, sopt.maxMemory) or sopt.maxMemory == 0) {
+                jointLog->error("--maxMemory must be a (non-zero) number of bytes, optionally with a "
+                                "K, M, G or T suffix, not {}", maxMemoryStr);
+                salmon::utils::exitRun(1);
+            }
+            auto memPlan = MemoryBudget::plan(sopt.maxMemory, MemoryBudget::indexBytes(indexDirectory),
+                                              sopt.numThreads, 2 * miniBatchSize, sopt.mappingCacheMemoryLimit);
+            sopt.numParserJobs = memPlan.numParserJobs;
+            sopt.eqClassReserve = memPlan.eqClassReserve;
+            MemoryBudget::report(memPlan, sopt.maxMemory, jointLog.get());
+        }
+
+        if (!readaheadStr.empty()) {
+            if (!MemoryBudget::parseBytes(readaheadStr, sopt.readaheadBytes) or sopt.readaheadBytes == 0) {
+                jointLog->error("--readahead must be a (non-zero) number of bytes, optionally with a "
+                                "K, M, G or T suffix, not {}", readaheadStr);
+                salmon::utils::exitRun(1);
+            }
+        }
+
+        if (!eqClassSpillStr.empty()) {
+            uint64_t spillBytes{0};
+            if (!MemoryBudget::parseBytes(eqClassSpillStr, spillBytes) or spillBytes == 0) {
+                jointLog->error("--eqClassSpill must be a (non-zero) number of bytes, optionally with a "
+                                "K, M, G or T suffix, not {}", eqClassSpillStr);
+                salmon::utils::exitRun(1);
+            }
+            sopt.eqClassSpillClasses = std::max(spillBytes / MemoryBudget::bytesPerEqClass, uint64_t(1));
+        }
+        if (sopt.eqClassMergeTolerance < 0.0 or sopt.eqClassMergeTolerance > 2.0) {
+            jointLog->error("--eqClassMergeTolerance must be an L1 distance between 0 and 2, not {}",
+                            sopt.eqClassMergeTolerance);
+            salmon::utils::exitRun(1);
+        }
+
+        RunProfiler::Phase loadPhase(sopt.profiler.get(), "index load");
+        ReadExperiment experiment(readLibraries, indexDirectory, sopt, sharedIndex);
+        loadPhase.end();
 
         // Parameter validation
         // If we're allowing orphans, make sure that the read libraries are paired-end.
@@ -1969,7 +3827,7 @@ transcript abundance from RNA-seq reads
                 if (!rl.isPairedEnd()) {
                     jointLog->error("You cannot specify the --allowOrphans argument "
                                     "for single-end libraries; exiting!");
-                    std::exit(1);
+                    salmon::utils::exitRun(1);
                 }
             }
         }
@@ -1982,12 +3840,62 @@ transcript abundance from RNA-seq reads
 
         auto indexType = experiment.getIndex()->indexType();
 
+        // With --extend, the state that the new reads are added to
+        salmon::shard::ShardStats extendedStats;
+
+        // With --geneLevelOnly, the classes are collapsed to genes as they're built
+        std::vector<std::string> geneNames;
+        std::vector<uint32_t> geneIDs;
+        if (sopt.geneLevelOnly) {
+            geneIDs = salmon::utils::transcriptGeneIDs(geneMapPath, experiment.transcripts(), geneNames);
+            experiment.equivalenceClassBuilder().projectToGenes(geneIDs);
+            jointLog->info("collapsing the equivalence classes of {} transcripts to {} genes",
+                           geneIDs.size(), geneNames.size());
+        }
+
+        if (sopt.writeUnmappedNames and !inferFromState) {
+            bfs::create_directories(outputDirectory / sopt.auxDir);
+            bfs::path unmappedNamesPath = outputDirectory / sopt.auxDir / "unmapped_names.gz";
+            sopt.unmappedNameWriter.reset(new UnmappedNameWriter(unmappedNamesPath));
+            if (!sopt.unmappedNameWriter->good()) {
+                jointLog->error("Could not open {} to write the names of the unmapped fragments",
+                                unmappedNamesPath.string());
+                salmon::utils::exitRun(1);
+            }
+        }
+
+        RunProfiler::Phase quantPhase(sopt.profiler.get(), "quantify reads");
         switch (indexType) {
             case SalmonIndexType::FMD:
                 {
+                    if (sopt.mapOnly or inferFromState or sopt.checkpoint or sopt.resume or
+                        sopt.saveState or sopt.writePosteriors) {
+                        jointLog->error("--mapOnly, --state (salmon infer), --checkpoint, --resume, --saveState, "
+                                        "--extend and --writePosteriors require a quasi-index");
+                        salmon::utils::exitRun(1);
+                    }
                     /** Currently no seq-specific bias correction with
                      *  FMD index.
                      */
+                    if (sopt.stopOnConvergence or sopt.maxFragments > 0) {
+                        sopt.stopOnConvergence = false;
+                        sopt.maxFragments = 0;
+                        jointLog->warn("--stopOnConvergence and --maxFragments require the quasi-index; "
+                                       "mapping all of the fragments");
+                    }
+                    if (sopt.snapshotInterval > 0) {
+                        sopt.snapshotInterval = 0;
+                        jointLog->warn("--snapshotInterval requires the quasi-index; no snapshots will be written");
+                    }
+                    {
+                        auto idx = experiment.getIndex();
+                        if (idx->hasAuxKmerIndex() and
+                            static_cast<int>(idx->auxIndex().k()) > memOptions->min_seed_len) {
+                            jointLog->warn("The auxiliary k-mers of the index (k = {}) are longer than the "
+                                           "minimum seed length ({}); seeding without them",
+                                           idx->auxIndex().k(), memOptions->min_seed_len);
+                        }
+                    }
                     if (sopt.biasCorrect or sopt.gcBiasCorrect) {
                         sopt.biasCorrect = false;
                         sopt.gcBiasCorrect = false;
@@ -2000,9 +3908,13 @@ transcript abundance from RNA-seq reads
                 break;
             case SalmonIndexType::QUASI:
                 {
+                    if (inferFromState and
+                        !loadShardState(experiment, sopt, salmon::shard::stateDirectory(sopt.inferStatePath))) {
+                        salmon::utils::exitRun(1);
+                    }
                     // We can only do fragment GC bias correction, for the time being, with paired-end reads
                     if (sopt.gcBiasCorrect) {
-                        for (auto& rl : readLibraries) {
+                        for (auto& rl : experiment.readLibraries()) {
                             if (rl.format().type != ReadType::PAIRED_END) {
                                 jointLog->warn("Fragment GC bias correction is currently only "
                                         "implemented for paired-end libraries.  Disabling "
@@ -2013,11 +3925,50 @@ transcript abundance from RNA-seq reads
                     }
                     sopt.allowOrphans = true;
                     sopt.useQuasi = true;
+                    if (inferFromState) { break; }
+                    if (!sopt.extendStatePath.empty() and
+                        !beginExtendingState(experiment, sopt, salmon::shard::stateDirectory(sopt.extendStatePath),
+                                             extendedStats)) {
+                        salmon::utils::exitRun(1);
+                    }
+                    if (!sopt.mappingOutputPath.empty()) {
+                        sopt.mappingWriter.reset(new MappingSAMWriter(sopt.mappingOutputPath));
+                        if (!sopt.mappingWriter->good()) {
+                            jointLog->error("Could not open {} to write the mappings", sopt.mappingOutputPath);
+                            salmon::utils::exitRun(1);
+                        }
+                        std::string commandLine;
+                        for (int i = 0; i < argc; ++i) {
+                            commandLine += (i > 0) ? " " : "";
+                            commandLine += argv[i];
+                        }
+                        sopt.mappingWriter->writeHeader(experiment.transcripts(), commandLine);
+                    }
                      quantifyLibrary<QuasiAlignment>(experiment, greedyChain, memOptions, sopt, coverageThresh,
                                                      sopt.numThreads);
+                    if (sopt.mappingWriter) {
+                        sopt.mappingWriter->flush();
+                        sopt.mappingWriter.reset();
+                    }
                 }
                 break;
         }
+        quantPhase.end();
+        if (sopt.unmappedNameWriter) {
+            sopt.unmappedNameWriter->finish();
+            jointLog->info("wrote the names of {} unmapped fragments", sopt.unmappedNameWriter->numNames());
+            sopt.unmappedNameWriter.reset();
+        }
+        if (sopt.profiler and sopt.readaheadBytes > 0) {
+            sopt.profiler->setValue("io_wait_sec", experiment.stageTimings().ioWaitNs * 1e-9);
+        }
+
+        if (sopt.readTrimmer) {
+            auto trimStats = sopt.readTrimmer->stats();
+            jointLog->info("trimmed {} of {} reads: {} bases of low quality, {} of adapter, {} of poly-A/T",
+                           trimStats.numTrimmed, trimStats.numReads, trimStats.qualityBases,
+                           trimStats.adapterBases, trimStats.polyABases);
+        }
 
         // Write out information about the command / run
         {
@@ -2034,12 +3985,46 @@ transcript abundance from RNA-seq reads
             }
         }
 
+        // With --mapOnly, the state of the mapping pass is the output
+        if (sopt.mapOnly) {
+            salmon::utils::normalizeAlphas(sopt, experiment);
+            bfs::path stateDir = outputDirectory / "shard";
+            if (!writeShardState(experiment, sopt, stateDir)) { return 1; }
+            bfs::path libCountFilePath = outputDirectory / "libFormatCounts.txt";
+            experiment.summarizeLibraryTypeCounts(libCountFilePath);
+            jointLog->info("wrote the mapping state to {}; combine it with those of the other "
+                           "shards with salmon merge, and quantify them with salmon infer",
+                           stateDir.string());
+            return 0;
+        }
+
+        // The classes are merged before anything (the dump included) reads them
+        if (!sopt.onlineOnly and (sopt.eqClassMergeTolerance > 0.0 or sopt.minEqClassCount > 0)) {
+            experiment.equivalenceClassBuilder().mergeSimilarClasses(sopt.eqClassMergeTolerance,
+                                                                     sopt.minEqClassCount);
+        }
+
         GZipWriter gzw(outputDirectory, jointLog);
+        // If requested, the output that doesn't feed the subsequent steps is
+        // written on this thread while they run.
+        std::unique_ptr<AsyncOutputWriter> asyncWriter{nullptr};
+        if (sopt.asyncOutput) {
+            asyncWriter.reset(new AsyncOutputWriter(jointLog));
+            // Create the directories up-front, rather than from the tasks
+            bfs::create_directories(outputDirectory / sopt.auxDir);
+        }
 
         // If we are dumping the equivalence classes, then
         // do it here.
         if (sopt.dumpEq) {
-            gzw.writeEquivCounts(sopt, experiment);
+            if (asyncWriter) {
+                // The optimizer reads the arena, not the classes themselves
+                asyncWriter->submit("eq_classes", [&gzw, &sopt, &experiment]() -> bool {
+                        return gzw.writeEquivCounts(sopt, experiment);
+                    });
+            } else {
+                gzw.writeEquivCounts(sopt, experiment);
+            }
         }
 
         // Now that the streaming pass is complete, we have
@@ -2049,18 +4034,84 @@ transcript abundance from RNA-seq reads
         // NOTE: A side-effect of calling the optimizer is that
         // the `EffectiveLength` field of each transcript is
         // set to its final value.
-        CollapsedEMOptimizer optimizer;
-        jointLog->info("Starting optimizer");
-    	salmon::utils::normalizeAlphas(sopt, experiment);
-        bool optSuccess = optimizer.optimize(experiment, sopt, 0.01, 10000);
-
-        if (!optSuccess) {
-            jointLog->error("The optimization algorithm failed. This is likely the result of "
-                    "bad input (or a bug). If you cannot track down the cause, please "
-                    "report this issue on GitHub.");
-            return 1;
+        if (sopt.releaseIndex) {
+            size_t seqBytes = experiment.releaseIndex(sopt);
+            jointLog->info("released the index (keeping {} bytes of transcript sequence)", seqBytes);
+        }
+
+        if (sopt.onlineOnly) {
+            // The estimates are the (projected) online masses, with the
+            // effective lengths of the final fragment length distribution
+            salmon::utils::normalizeAlphas(sopt, experiment);
+            double totalCount{0.0};
+            for (auto& t : experiment.transcripts()) {
+                t.EffectiveLength = sopt.noEffectiveLengthCorrection ?
+                    t.RefLength : std::exp(t.getCachedLogEffectiveLength());
+                totalCount += t.projectedCounts;
+            }
+            for (auto& t : experiment.transcripts()) {
+                t.setSharedCount(t.projectedCounts);
+                t.setMass((totalCount > 0.0) ? t.projectedCounts / totalCount : 0.0);
+            }
+            jointLog->info("reporting the online estimates (--onlineOnly)");
+        } else {
+            CollapsedEMOptimizer optimizer;
+            jointLog->info("Starting optimizer");
+            RunProfiler::Phase optPhase(sopt.profiler.get(), "optimize");
+            // A mapping state holds the (summed) online estimates
+            if (!inferFromState) {
+                salmon::utils::normalizeAlphas(sopt, experiment);
+                if (!sopt.extendStatePath.empty()) { finishExtendingState(experiment, sopt, extendedStats); }
+                if (sopt.checkpoint and
+                    !writeShardState(experiment, sopt, checkpointDir / "mapping")) {
+                    jointLog->warn("could not checkpoint the mapping pass; continuing without it");
+                }
+            }
+            bool optSuccess = sopt.geneLevelOnly ?
+                optimizer.optimizeGenes(experiment, sopt, geneIDs, geneNames, 0.01, 10000) :
+                optimizer.optimize(experiment, sopt, 0.01, 10000);
+            optPhase.end();
+
+            if (!optSuccess) {
+                jointLog->error("The optimization algorithm failed. This is likely the result of "
+                        "bad input (or a bug). If you cannot track down the cause, please "
+                        "report this issue on GitHub.");
+                return 1;
+            }
+            jointLog->info("Finished optimizer");
+        }
+
+        if (sopt.writePosteriors) {
+            // Reads from a pipe are quantified in a single pass, whose cache
+            // holds only the fragments mapped before the burn-in
+            if (sopt.singlePass) {
+                jointLog->warn("the reads were quantified in a single pass, so the mapping cache doesn't "
+                               "hold all of the fragments; not writing their posteriors");
+            } else {
+                bfs::create_directories(outputDirectory / sopt.auxDir);
+                writeFragmentPosteriors(experiment, sopt, outputDirectory / sopt.auxDir / "posteriors.gz",
+                                        sopt.numThreads);
+            }
+            boost::system::error_code ec;
+            bfs::remove_all(outputDirectory / "mapping_cache", ec);
+        }
+
+        if (sopt.saveState) {
+            bfs::path stateDir = outputDirectory / "shard";
+            if (writeShardState(experiment, sopt, stateDir, true)) {
+                jointLog->info("saved the state of the run to {}", stateDir.string());
+            } else {
+                jointLog->warn("could not save the state of the run; it can't be extended");
+            }
+        }
+
+        // With --extrapolate, the counts estimated from the mapped fragments
+        // are scaled to the depth of the whole input (the TPMs are unchanged)
+        double countScale = sopt.convergenceMonitor ?
+            sopt.convergenceMonitor->extrapolationFactor(experiment.numObservedFragments()) : 1.0;
+        if (countScale != 1.0) {
+            for (auto& t : experiment.transcripts()) { t.setSharedCount(t.sharedCount() * countScale); }
         }
-        jointLog->info("Finished optimizer");
 
         free(memOptions);
         size_t tnum{0};
@@ -2070,18 +4121,38 @@ transcript abundance from RNA-seq reads
         bfs::path estFilePath = outputDirectory / "quant.sf";
 
         // Write the main results
-        gzw.writeAbundances(sopt, experiment);
+        RunProfiler::Phase writePhase(sopt.profiler.get(), "write quantification");
+        if (apiResult) {
+            salmon::api::detail::collectResults(sopt, experiment, *apiResult);
+        } else {
+            gzw.writeAbundances(sopt, experiment, asyncWriter.get());
+        }
         // Write meta-information about the run
         gzw.writeMeta(sopt, experiment, runStartTime);
+        writePhase.end();
 
+        // The replicates may be drawn by several threads at once
+        std::mutex apiResultMutex;
         if (sopt.numGibbsSamples > 0) {
 
             jointLog->info("Starting Gibbs Sampler");
+            RunProfiler::Phase gibbsPhase(sopt.profiler.get(), "gibbs sampling");
             CollapsedGibbsSampler sampler;
             // The function we'll use as a callback to write samples
             std::function<bool(const std::vector<int>&)> bsWriter =
-                [&gzw](const std::vector<int>& alphas) -> bool {
-                    return gzw.writeBootstrap(alphas);
+                [&gzw, countScale, apiResult, &apiResultMutex](const std::vector<int>& alphas) -> bool {
+                    if (apiResult) {
+                        std::lock_guard<std::mutex> lock(apiResultMutex);
+                        apiResult->bootstraps.emplace_back(alphas.begin(), alphas.end());
+                        for (auto& a : apiResult->bootstraps.back()) { a = std::round(a * countScale); }
+                        return true;
+                    }
+                    if (countScale == 1.0) { return gzw.writeBootstrap(alphas); }
+                    std::vector<int> scaled(alphas.size());
+                    for (size_t i = 0; i < alphas.size(); ++i) {
+                        scaled[i] = static_cast<int>(std::round(alphas[i] * countScale));
+                    }
+                    return gzw.writeBootstrap(scaled);
                 };
 
             bool sampleSuccess = sampler.sample(experiment, sopt,
@@ -2096,15 +4167,46 @@ transcript abundance from RNA-seq reads
             jointLog->info("Finished Gibbs Sampler");
         } else if (sopt.numBootstraps > 0) {
             // The function we'll use as a callback to write samples
+            // The replicates are scaled like the point estimates, so that they
+            // keep the (relative) variance of the mapped fragments
             std::function<bool(const std::vector<double>&)> bsWriter =
-                [&gzw](const std::vector<double>& alphas) -> bool {
-                    return gzw.writeBootstrap(alphas);
+                [&gzw, countScale, apiResult, &apiResultMutex](const std::vector<double>& alphas) -> bool {
+                    if (apiResult) {
+                        std::lock_guard<std::mutex> lock(apiResultMutex);
+                        apiResult->bootstraps.emplace_back(alphas);
+                        for (auto& a : apiResult->bootstraps.back()) { a *= countScale; }
+                        return true;
+                    }
+                    if (countScale == 1.0) { return gzw.writeBootstrap(alphas); }
+                    std::vector<double> scaled(alphas);
+                    for (auto& a : scaled) { a *= countScale; }
+                    return gzw.writeBootstrap(scaled);
                 };
 
+            // Replicates recorded by an interrupted run are restored rather
+            // than drawn again
+            if (sopt.checkpoint or sopt.resume) {
+                sopt.bootstrapCheckpoint.reset(new BootstrapCheckpoint(
+                    checkpointDir / "bootstraps.bin", experiment.transcripts().size(), sopt.numBootstraps));
+                if (sopt.resume) {
+                    size_t numRestored = sopt.bootstrapCheckpoint->restore(bsWriter);
+                    if (numRestored > 0) {
+                        jointLog->info("restored {} bootstrap replicates from the checkpoint", numRestored);
+                    }
+                }
+                boost::system::error_code ec;
+                bfs::create_directories(checkpointDir, ec);
+                if (!sopt.bootstrapCheckpoint->open()) {
+                    jointLog->warn("could not checkpoint the bootstrap replicates; continuing without it");
+                }
+            }
+
             jointLog->info("Staring Bootstrapping");
+            RunProfiler::Phase bootstrapPhase(sopt.profiler.get(), "bootstraps");
             bool bootstrapSuccess = optimizer.gatherBootstraps(
                     experiment, sopt,
                     bsWriter, 0.01, 10000);
+            bootstrapPhase.end();
             jointLog->info("Finished Bootstrapping");
             if (!bootstrapSuccess) {
                 jointLog->error("Encountered error during bootstrapping.\n"
@@ -2112,6 +4214,25 @@ transcript abundance from RNA-seq reads
                         "Please file a bug report on GitHub.\n");
                 return 1;
             }
+            sopt.bootstrapCheckpoint.reset();
+            // The meta information records the number of adaptive bootstraps drawn
+            if (sopt.adaptiveBootstraps) { gzw.writeMetaInfo(sopt, experiment, runStartTime); }
+        }
+        // The run is complete, so its checkpoint is no longer needed
+        if ((sopt.checkpoint or sopt.resume) and bfs::exists(checkpointDir)) {
+            boost::system::error_code ec;
+            bfs::remove_all(checkpointDir, ec);
+        }
+        RunProfiler::Phase outputPhase(sopt.profiler.get(), "finish output");
+        if (!apiResult and (sopt.numGibbsSamples > 0 or sopt.numBootstraps > 0)) {
+            if (!gzw.finishBootstraps()) {
+                jointLog->error("Some of the bootstrap output could not be written; please check the log");
+                return 1;
+            }
+        }
+        if (asyncWriter and !asyncWriter->finish()) {
+            jointLog->error("Some of the output could not be written; please check the log");
+            return 1;
         }
 
 
@@ -2123,7 +4244,7 @@ transcript abundance from RNA-seq reads
                            "output directory for experimental parameter "
                            "estimates [{}]. exiting.", ioutils::SET_RED,
                            ioutils::RESET_COLOR, paramsDir);
-                std::exit(-1);
+                salmon::utils::exitRun(-1);
             }
         }
 
@@ -2143,25 +4264,50 @@ transcript abundance from RNA-seq reads
         if (vm.count("geneMap")) {
             try {
                 salmon::utils::generateGeneLevelEstimates(geneMapPath,
-                                                          outputDirectory);
+                                                          outputDirectory,
+                                                          experiment.transcripts(),
+                                                          experiment.upperBoundHits());
             } catch (std::invalid_argument& e) {
                 fmt::print(stderr, "Error: [{}] when trying to compute gene-level "\
                                    "estimates. The gene-level file(s) may not exist",
                                    e.what());
             }
         }
+        outputPhase.end();
+
+        if (sopt.profile) {
+            bfs::path profilePath = outputDirectory / sopt.auxDir / "profile.json";
+            bfs::create_directories(profilePath.parent_path());
+            if (!sopt.profiler->write(profilePath)) {
+                jointLog->warn("Could not write the run profile to {}", profilePath.string());
+            }
+        }
+        if (SALMON_TRACE_ENABLED) {
+            bfs::path tracePath = outputDirectory / sopt.auxDir / "trace.json";
+            bfs::create_directories(tracePath.parent_path());
+            if (!salmon::trace::writeTrace(tracePath.string())) {
+                jointLog->warn("Could not write the trace to {}", tracePath.string());
+            }
+        }
+        if (SALMON_ALLOC_STATS_ENABLED) {
+            bfs::path statsPath = outputDirectory / sopt.auxDir / "alloc_stats.json";
+            bfs::create_directories(statsPath.parent_path());
+            if (!salmon::alloc::writeStats(statsPath.string())) {
+                jointLog->warn("Could not write the allocation counts to {}", statsPath.string());
+            }
+        }
 
     } catch (po::error &e) {
         std::cerr << "Exception : [" << e.what() << "]. Exiting.\n";
-        std::exit(1);
+        salmon::utils::exitRun(1);
     } catch (const spdlog::spdlog_ex& ex) {
         std::cerr << "logger failed with : [" << ex.what() << "]. Exiting.\n";
-        std::exit(1);
+        salmon::utils::exitRun(1);
     } catch (std::exception& e) {
         std::cerr << "Exception : [" << e.what() << "]\n";
         std::cerr << argv[0] << " quant was invoked improperly.\n";
         std::cerr << "For usage information, try " << argv[0] << " quant --help\nExiting.\n";
-        std::exit(1);
+        salmon::utils::exitRun(1);
     }
 
 
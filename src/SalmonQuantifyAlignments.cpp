@@ -28,6 +28,7 @@ extern "C" {
 #include <thread>
 #include <memory>
 #include <condition_variable>
+#include <cstring>
 
 #include <tbb/concurrent_queue.h>
 
@@ -41,14 +42,17 @@ extern "C" {
 #include "ClusterForest.hpp"
 #include "AlignmentLibrary.hpp"
 #include "MiniBatchInfo.hpp"
+#include "AlignmentCache.hpp"
 #include "BAMQueue.hpp"
 #include "SalmonMath.hpp"
 #include "FASTAParser.hpp"
 #include "LibraryFormat.hpp"
 #include "Transcript.hpp"
 #include "ReadPair.hpp"
+#include "UnpairedRead.hpp"
 #include "ErrorModel.hpp"
 #include "AlignmentModel.hpp"
+#include "LocalTranscriptUpdates.hpp"
 #include "ForgettingMassCalculator.hpp"
 #include "FragmentLengthDistribution.hpp"
 #include "TranscriptCluster.hpp"
@@ -57,12 +61,20 @@ extern "C" {
 #include "SalmonOpts.hpp"
 #include "NullFragmentFilter.hpp"
 #include "Sampler.hpp"
+#include "RandomStreams.hpp"
 #include "spdlog/spdlog.h"
 #include "EquivalenceClassBuilder.hpp"
 #include "CollapsedEMOptimizer.hpp"
 #include "CollapsedGibbsSampler.hpp"
 #include "GZipWriter.hpp"
+#include "MemoryPlacement.hpp"
+#include "MetricsServer.hpp"
+#include "RunProfiler.hpp"
+#include "TraceEvents.hpp"
+#include "AllocationStats.hpp"
+#include "QuantThreadController.hpp"
 #include "TextBootstrapWriter.hpp"
+#include "MemoryBudget.hpp"
 
 namespace bfs = boost::filesystem;
 using salmon::math::LOG_0;
@@ -95,6 +107,25 @@ void scaleBy(std::vector<T>& vec, T scale) {
     std::for_each(vec.begin(), vec.end(), [scale](T& ele)->void { ele *= scale; });
 }
 
+// The record of a fragment that carries its tags
+inline bam_seq_t* taggedRecord_(ReadPair* f) { return f->read1 ? f->read1 : f->read2; }
+inline bam_seq_t* taggedRecord_(UnpairedRead* f) { return f->read; }
+
+/**
+ * The UMI of the fragment of aln, from the (string) tag umiTag of its
+ * record (see --umiTag); false if it has no such tag, or the tag isn't a
+ * valid UMI.
+ */
+template <typename FragT>
+inline bool fragmentUMI(FragT* aln, char* umiTag, uint64_t& umi) {
+    bam_seq_t* b = taggedRecord_(aln);
+    if (b == nullptr) { return false; }
+    char* tag = bam_aux_find(b, umiTag);
+    if (tag == nullptr or *tag != 'Z') { return false; }
+    const char* s = tag + 1;
+    return UMIDeduplicator::encode(s, std::strlen(s), umi);
+}
+
 /*
  * Tries _numTries_ times to get work from _workQueue_.  It returns
  * true immediately if it was able to find work, and false otherwise.
@@ -121,6 +152,7 @@ void processMiniBatch(AlignmentLibrary<FragT>& alnLib,
                       uint64_t firstTimestepOfRound,
                       MiniBatchQueue<AlignmentGroup<FragT*>>& workQueue,
                       MiniBatchQueue<AlignmentGroup<FragT*>>* processedCache,
+                      AlignmentCache<FragT>* compactCache,
                       std::condition_variable& workAvailable,
                       std::mutex& cvmutex,
                       volatile bool& doneParsing,
@@ -128,22 +160,28 @@ void processMiniBatch(AlignmentLibrary<FragT>& alnLib,
                       SalmonOpts& salmonOpts,
                       std::atomic<bool>& burnedIn,
                       bool initialRound,
-                      std::atomic<size_t>& processedReads) {
+                      std::atomic<size_t>& processedReads,
+                      QuantThreadController* threadController,
+                      uint32_t workerIndex) {
 
-    // Seed with a real random value, if available
-    std::random_device rd;
     auto& log = salmonOpts.jointLog;
 
     // Whether or not we are using "banking"
     bool useMassBanking = (!initialRound and salmonOpts.useMassBanking);
     bool useReadCompat = salmonOpts.incompatPrior != salmon::math::LOG_0;
 
-    // Create a random uniform distribution
-    std::default_random_engine eng(rd());
+    // Each worker has its own stream of random numbers (see RandomStreams.hpp)
+    std::default_random_engine eng(salmon::utils::streamSeed(
+                salmonOpts, salmon::utils::RandomStream::MAPPING,
+                salmon::utils::nextMappingStreamIndex()));
     std::uniform_real_distribution<> uni(0.0, 1.0 + std::numeric_limits<double>::min());
 
     //EQClass
     EquivalenceClassBuilder& eqBuilder = alnLib.equivalenceClassBuilder();
+    // If requested, accumulate equivalence classes locally and merge them
+    // into the shared builder at the end of each mini-batch.
+    bool threadLocalEqClasses = salmonOpts.threadLocalEqClasses;
+    LocalEquivalenceClassBuilder localEqBuilder(eqBuilder);
     auto& readBias = alnLib.readBias();
 
     using salmon::math::LOG_0;
@@ -160,13 +198,32 @@ void processMiniBatch(AlignmentLibrary<FragT>& alnLib,
 
     auto& fragLengthDist = *(alnLib.fragmentLengthDistribution());
     auto& alnMod = alnLib.alignmentModel();
+    // If requested, stage this thread's updates to the alignment model and
+    // merge them into the shared model at the end of each mini-batch.
+    std::unique_ptr<AlignmentModel::Stage> alnModStage{nullptr};
+    if (salmonOpts.threadLocalModelUpdates) { alnModStage.reset(new AlignmentModel::Stage(alnMod)); }
+    // and likewise for the updates to the transcript masses and counts
+    bool threadLocalTranscriptUpdates = salmonOpts.threadLocalTranscriptUpdates;
+    LocalTranscriptUpdates txpUpdates(threadLocalTranscriptUpdates ? refs.size() : 0);
+    ClusterForest::LocalBatch clusterUpdates(clusterForest);
 
     bool useFSPD{salmonOpts.useFSPD};
     bool useFragLengthDist{!salmonOpts.noFragLengthDist};
     bool noFragLenFactor{salmonOpts.noFragLenFactor};
+    double errorModelSampleRate{salmonOpts.errorModelSampleRate};
+    // The tag holding the UMIs, if the classes count molecules (--umiTag)
+    bool deduplicateUMIs = eqBuilder.deduplicatesUMIs();
+    char umiTag[3] = {0, 0, 0};
+    if (deduplicateUMIs) { std::copy(salmonOpts.umiTag.begin(), salmonOpts.umiTag.begin() + 2, umiTag); }
+    // The fragment length probabilities are read from this thread's table
+    CachedFragmentLengthPMF fragLengthPMF(fragLengthDist);
+    // and the observed fragment lengths are added to the shared distribution
+    // (kernel and all) once per mini-batch
+    LocalFragmentLengthDistribution localFragLengthDist(fragLengthDist);
 
     double startingCumulativeMass = fmCalc.cumulativeLogMassAt(firstTimestepOfRound);
     const auto expectedLibraryFormat = alnLib.format();
+    salmon::utils::AlignFormatProbs formatProbs(expectedLibraryFormat, salmonOpts.incompatPrior);
     uint32_t numBurninFrags{salmonOpts.numBurninFrags};
 
     bool useAuxParams = (processedReads > salmonOpts.numPreBurninFrags);
@@ -179,9 +236,13 @@ void processMiniBatch(AlignmentLibrary<FragT>& alnLib,
     while (!doneParsing or !workQueue.empty()) {
         uint32_t zeroProbFrags{0};
 
+        // If the pool is being rebalanced, this worker may be parked
+        if (threadController != nullptr) { threadController->waitUntilActive(workerIndex); }
+
         // Try up to numTries times to get work from the queue before
         // giving up and waiting on the condition variable
     	constexpr uint32_t numTries = 100;
+        auto waitStart = LocalStageTimings::now();
         bool foundWork = tryToGetWork(workQueue, miniBatch, numTries);
 
         // If work wasn't immediately available, then wait for it using
@@ -190,11 +251,17 @@ void processMiniBatch(AlignmentLibrary<FragT>& alnLib,
             std::unique_lock<std::mutex> l(cvmutex);
             workAvailable.wait(l, [&miniBatch, &workQueue, &doneParsing]() { return workQueue.try_pop(miniBatch) or doneParsing; });
         }
+        alnLib.stageTimings().workerWaitNs += LocalStageTimings::elapsedNs(waitStart);
 
 	    // If we actually got some work
         if (miniBatch != nullptr) {
+            SALMON_TRACE_SCOPE("processMiniBatch");
+            SALMON_ALLOC_SCOPE("processMiniBatch");
+            HardwareCounters::Region hwRegion(salmonOpts.profiler ? salmonOpts.profiler->hardwareCounters() : nullptr,
+                                              "processMiniBatch");
 
             useAuxParams = (processedReads > salmonOpts.numPreBurninFrags);
+            if (useFragLengthDist) { fragLengthPMF.refresh(); }
             ++activeBatches;
             size_t batchReads{0};
 
@@ -232,6 +299,12 @@ void processMiniBatch(AlignmentLibrary<FragT>& alnLib,
                     bool transcriptUnique{true};
                     auto firstTranscriptID = alnGroup->alignments().front()->transcriptID();
                     std::unordered_set<size_t> observedTranscripts;
+                    // The likelihood of the only alignment of a fragment cancels in
+                    // the normalization (and evaluating it doesn't train the model),
+                    // so the CIGAR string of such an alignment isn't walked; only
+                    // the check for an alignment past the end of its transcript
+                    // (which drops the fragment) is kept
+                    bool singleAlignment = (alnGroup->alignments().size() == 1);
 
                     for (auto& aln : alnGroup->alignments()) {
                         auto transcriptID = aln->transcriptID();
@@ -254,7 +327,7 @@ void processMiniBatch(AlignmentLibrary<FragT>& alnLib,
                             }
                             */
                             if(aln->isPaired() and aln->fragLen() > 0) {
-                                logFragProb = fragLengthDist.pmf(static_cast<size_t>(aln->fragLen()));
+                                logFragProb = fragLengthPMF.pmf(static_cast<size_t>(aln->fragLen()));
                             }
                         }
 
@@ -280,19 +353,18 @@ void processMiniBatch(AlignmentLibrary<FragT>& alnLib,
                         // given orientations.
                         double logAlignCompatProb =
                             (useReadCompat) ?
-                            (salmon::utils::logAlignFormatProb(
-                                  aln->libFormat(),
-                                  expectedLibraryFormat,
-                                  aln->pos(),
-                                  aln->fwd(), aln->mateStatus(), salmonOpts.incompatPrior)
-                            ) : LOG_1;
+                            formatProbs(aln->libFormat(), aln->fwd(), aln->mateStatus()) : LOG_1;
 
                         // Adjustment to the likelihood due to the
                         // error model
                         double errLike = salmon::math::LOG_1;
                         //if (burnedIn and salmonOpts.useErrorModel) {
                         if (useAuxParams and salmonOpts.useErrorModel) {
-                            errLike = alnMod.logLikelihood(*aln, transcript);
+                            if (!singleAlignment) {
+                                errLike = alnMod.logLikelihood(*aln, transcript);
+                            } else if (!alnMod.startsWithinTranscript(*aln, transcript)) {
+                                errLike = salmon::math::LOG_0;
+                            }
                         }
 
 			// Allow for a non-uniform fragment start position distribution
@@ -334,7 +406,11 @@ void processMiniBatch(AlignmentLibrary<FragT>& alnLib,
                             sumOfAlignProbs = logAdd(sumOfAlignProbs, aln->logProb);
                             if (updateCounts and
                                     observedTranscripts.find(transcriptID) == observedTranscripts.end()) {
-                                refs[transcriptID].addTotalCount(1);
+                                if (threadLocalTranscriptUpdates) {
+                                    txpUpdates.addTotalCount(transcriptID, 1);
+                                } else {
+                                    refs[transcriptID].addTotalCount(1);
+                                }
                                 observedTranscripts.insert(transcriptID);
                             }
                             // EQCLASS
@@ -367,8 +443,18 @@ void processMiniBatch(AlignmentLibrary<FragT>& alnLib,
                     }
 
                     if (txpIDs.size() > 0) {
+                        SALMON_ALLOC_SCOPE("addGroup");
                         TranscriptGroup tg(txpIDs);
-                        eqBuilder.addGroup(std::move(tg), auxProbs, posProbs);
+                        if (deduplicateUMIs) {
+                            uint64_t umi{0};
+                            bool hasUMI = fragmentUMI(alnGroup->alignments().front(), umiTag, umi);
+                            eqBuilder.addUMI(tg, hasUMI, umi);
+                        }
+                        if (threadLocalEqClasses) {
+                            localEqBuilder.addGroup(std::move(tg), auxProbs, posProbs);
+                        } else {
+                            eqBuilder.addGroup(std::move(tg), auxProbs, posProbs);
+                        }
                     }
 
 
@@ -383,15 +469,20 @@ void processMiniBatch(AlignmentLibrary<FragT>& alnLib,
                         auto transcriptID = aln->transcriptID();
                         auto& transcript = refs[transcriptID];
 
-                        double newMass = logForgettingMass + aln->logProb;
-                        transcript.addMass(newMass);
-                        transcript.setLastTimestepUpdated(currentMinibatchTimestep);
+                        double prob = std::exp(aln->logProb);
+                        if (threadLocalTranscriptUpdates) {
+                            txpUpdates.addMass(transcriptID, prob);
+                        } else {
+                            double newMass = logForgettingMass + aln->logProb;
+                            transcript.addMass(newMass);
+                            transcript.setLastTimestepUpdated(currentMinibatchTimestep);
+                        }
 
                         /**
                          * Update the auxiliary models.
                          **/
                         double r = uni(eng);
-                        if (!burnedIn and r < std::exp(aln->logProb)) {
+                        if (!burnedIn and r < prob) {
                             /**
                              * Update the bias sequence-specific bias model
                              **/
@@ -419,14 +510,17 @@ void processMiniBatch(AlignmentLibrary<FragT>& alnLib,
                                 }
                             }
 
-                            // Update the error model
-                            if (salmonOpts.useErrorModel) {
-                                alnMod.update(*aln, transcript, LOG_1, logForgettingMass);
+                            // Update the error model (with only a sample of the
+                            // single-alignment fragments, if requested)
+                            bool sampleErrorModel = !singleAlignment or errorModelSampleRate >= 1.0 or
+                                uni(eng) < errorModelSampleRate;
+                            if (salmonOpts.useErrorModel and sampleErrorModel) {
+                                alnMod.update(*aln, transcript, LOG_1, logForgettingMass, alnModStage.get());
                             }
                             // Update the fragment length distribution
                             if (aln->isPaired() and !salmonOpts.noFragLengthDist) {
                                 double fragLength = aln->fragLen();
-                                fragLengthDist.addVal(fragLength, logForgettingMass);
+                                localFragLengthDist.addVal(fragLength);
                             }
                             // Update the fragment start position distribution
                             if (useFSPD) {
@@ -443,11 +537,24 @@ void processMiniBatch(AlignmentLibrary<FragT>& alnLib,
                     // update the single target transcript
                     if (transcriptUnique) {
                         if (updateCounts) {
-                            refs[firstTranscriptID].addUniqueCount(1);
+                            if (threadLocalTranscriptUpdates) {
+                                txpUpdates.addUniqueCount(firstTranscriptID, 1);
+                            } else {
+                                refs[firstTranscriptID].addUniqueCount(1);
+                            }
                         }
-                        clusterForest.updateCluster(firstTranscriptID, 1,
-                                                    logForgettingMass, updateCounts);
-                    } else { // or the appropriate clusters
+                        if (threadLocalTranscriptUpdates) {
+                            clusterUpdates.updateCluster(firstTranscriptID, 1, updateCounts);
+                        } else {
+                            clusterForest.updateCluster(firstTranscriptID, 1,
+                                                        logForgettingMass, updateCounts);
+                        }
+                    } else if (threadLocalTranscriptUpdates) { // or the appropriate clusters
+                        clusterUpdates.mergeClusters(alnGroup->alignments().begin(), alnGroup->alignments().end(),
+                                                     [](const FragT* aln) { return aln->transcriptID(); });
+                        clusterUpdates.updateCluster(alnGroup->alignments().front()->transcriptID(),
+                                                     1, updateCounts);
+                    } else {
                         // ughh . . . C++ still has some very rough edges
                         clusterForest.template mergeClusters<FragT>(alnGroup->alignments().begin(),
                                                            alnGroup->alignments().end());
@@ -459,6 +566,19 @@ void processMiniBatch(AlignmentLibrary<FragT>& alnLib,
                 } // end read group
             }// end timer
 
+            // Merge this mini-batch's equivalence classes into the shared builder
+            if (threadLocalEqClasses) {
+                SALMON_TRACE_SCOPE("addGroup flush");
+                SALMON_ALLOC_SCOPE("addGroup");
+                localEqBuilder.flush();
+            }
+            if (alnModStage) { alnModStage->flush(); }
+            localFragLengthDist.flush(logForgettingMass);
+            if (threadLocalTranscriptUpdates) {
+                txpUpdates.flush(refs, logForgettingMass, currentMinibatchTimestep);
+                clusterUpdates.flush(logForgettingMass);
+            }
+
             double individualTotal = LOG_0;
             {
                 /*
@@ -503,8 +623,12 @@ void processMiniBatch(AlignmentLibrary<FragT>& alnLib,
 
             // If we're not keeping around a cache, then
             // reclaim the memory for these fragments and alignments
-            // and delete the mini batch.
+            // and delete the mini batch (after packing it into the
+            // compact cache, if we're building one).
             if (processedCache == nullptr) {
+                if (compactCache != nullptr and !compactCache->add(alignmentGroups)) {
+                    log->warn("Failed to write to the alignment cache spill file");
+                }
                 miniBatch->release(fragmentQueue, alignmentGroupQueue);
                 delete miniBatch;
             } else {
@@ -522,7 +646,6 @@ void processMiniBatch(AlignmentLibrary<FragT>& alnLib,
                         fspd.update();
                     }
                 }
-                fragLengthDist.cacheCMF();
                 // NOTE: only one thread should succeed here, and that
                 // thread will set burnedIn to true
                 alnLib.updateTranscriptLengthsAtomic(burnedIn);
@@ -558,6 +681,9 @@ bool quantifyLibrary(
     MiniBatchQueue<AlignmentGroup<FragT*>>* workQueuePtr{&workQueue};
     MiniBatchQueue<AlignmentGroup<FragT*>> processedCache;
     MiniBatchQueue<AlignmentGroup<FragT*>>* processedCachePtr{nullptr};
+    // Used instead of processedCache when there are too many fragments to
+    // keep in memory (see AlignmentCache.hpp)
+    std::unique_ptr<AlignmentCache<FragT>> compactCache{nullptr};
 
     ForgettingMassCalculator fmCalc(salmonOpts.forgettingFactor);
 
@@ -570,11 +696,31 @@ bool quantifyLibrary(
     std::atomic<size_t> totalProcessedReads{0};
     bool initialRound{true};
     bool haveCache{false};
+    bool haveCompactCache{false};
     bool doReset{true};
     size_t maxCacheSize{salmonOpts.mappingCacheMemoryLimit};
 
     NullFragmentFilter<FragT>* nff = nullptr;
     bool terminate{false};
+    uint32_t passNum{0};
+
+    // A streamed input (e.g. an aligner's output piped in) can't be read
+    // again, so, if the alignments will be needed again (to sample them,
+    // --sampleOut), they're packed into the compact cache (spilling to disk
+    // past alignmentCacheMemoryBytes) as the first pass processes them, and
+    // read back from it
+    bool streamed = alnLib.isStreamed();
+    if (streamed and salmonOpts.sampleOutput) {
+        if (salmonOpts.noCompactAlignmentCache) {
+            salmonOpts.jointLog->warn("The alignments are streamed, and --noCompactAlignmentCache was given, "
+                                      "so they can't be read again to be sampled");
+        } else {
+            compactCache.reset(new AlignmentCache<FragT>(
+                        salmonOpts.outputDirectory / "alignment_cache.bin",
+                        salmonOpts.alignmentCacheMemoryBytes));
+            salmonOpts.jointLog->info("The alignments are streamed; caching them as they are read");
+        }
+    }
 
     // Give ourselves some space
     fmt::print(stderr, "\n\n\n\n");
@@ -590,10 +736,19 @@ bool quantifyLibrary(
                 std::swap(workQueuePtr, processedCachePtr);
                 doReset = false;
                 fmt::print(stderr, "\n\n");
+            } else if (haveCompactCache) {
+                doReset = false;
+                fmt::print(stderr, "\n\n");
             } else if (numToCache <= maxCacheSize) {
                 processedCachePtr = &processedCache;
                 doReset = true;
                 fmt::print(stderr, "\n");
+            } else if (!salmonOpts.noCompactAlignmentCache) {
+                compactCache.reset(new AlignmentCache<FragT>(
+                            salmonOpts.outputDirectory / "alignment_cache.bin",
+                            salmonOpts.alignmentCacheMemoryBytes));
+                doReset = true;
+                fmt::print(stderr, "\n");
             }
 
             if (doReset and
@@ -616,12 +771,25 @@ bool quantifyLibrary(
             }
         }
 
+        ++passNum;
+        RunProfiler::Phase passPhase(salmonOpts.profiler.get(),
+                                     initialRound ? std::string("first pass") : fmt::format("pass {}", passNum));
         volatile bool doneParsing{false};
         std::condition_variable workAvailable;
         std::mutex cvmutex;
         std::vector<std::thread> workers;
         std::atomic<size_t> activeBatches{0};
-        auto currentQuantThreads = (haveCache) ?
+        // When the input is parsed in this round, and the threads are
+        // rebalanced, start a worker for every thread and let the
+        // controller decide how many of them are active
+        std::unique_ptr<QuantThreadController> threadController{nullptr};
+        bool parsingRound = !(haveCache or haveCompactCache);
+        if (parsingRound and salmonOpts.adaptiveThreads) {
+            threadController.reset(new QuantThreadController(
+                        1, salmonOpts.numQuantThreads + salmonOpts.numParseThreads,
+                        salmonOpts.numQuantThreads));
+        }
+        auto currentQuantThreads = (!parsingRound or threadController) ?
                                    salmonOpts.numQuantThreads + salmonOpts.numParseThreads :
                                    salmonOpts.numQuantThreads;
 
@@ -637,15 +805,36 @@ bool quantifyLibrary(
                     firstTimestepOfRound,
                     std::ref(*workQueuePtr),
                     processedCachePtr,
+                    (haveCompactCache) ? nullptr : compactCache.get(),
                     std::ref(workAvailable), std::ref(cvmutex),
                     std::ref(doneParsing), std::ref(activeBatches),
                     std::ref(salmonOpts),
                     std::ref(burnedIn),
                     initialRound,
-                    std::ref(totalProcessedReads));
+                    std::ref(totalProcessedReads),
+                    threadController.get(), i);
         }
 
-        if (!haveCache) {
+        if (haveCompactCache) {
+            bool replayed = compactCache->replay(alnLib.fragmentQueue(), alnLib.alignmentGroupQueue(),
+                [&](std::vector<AlignmentGroup<FragT*>*>* alignments) -> void {
+                    ++batchNum;
+                    double logForgettingMass = 0.0;
+                    MiniBatchInfo<AlignmentGroup<FragT*>>* mbi =
+                        new MiniBatchInfo<AlignmentGroup<FragT*>>(batchNum, alignments, logForgettingMass);
+                    workQueuePtr->push(mbi);
+                    {
+                        std::unique_lock<std::mutex> l(cvmutex);
+                        workAvailable.notify_one();
+                    }
+                });
+            if (!replayed) {
+                salmonOpts.jointLog->warn("Could not read back the alignment cache; "
+                                          "this round is incomplete");
+                terminate = true;
+            }
+            fmt::print(stderr, "\n");
+        } else if (!haveCache) {
             size_t numProc{0};
 
             BAMQueue<FragT>& bq = alnLib.getAlignmentGroupQueue();
@@ -672,10 +861,38 @@ bool quantifyLibrary(
                     alignments->reserve(miniBatchSize);
                 }
 
+                // Sample the occupancy of the queues, to tell whether the
+                // run is bound by the parser or by the quantification threads
+                if (numProc % 4096 == 0) {
+                    bq.sampleQueueDepths();
+                    size_t numWaitingBatches = workQueuePtr->unsafe_size();
+                    alnLib.stageTimings().workQueueDepth.sample(numWaitingBatches);
+                    // and move threads to whichever side is the bottleneck
+                    if (threadController) { threadController->update(numWaitingBatches); }
+                    if (salmonOpts.metrics) {
+                        auto& metrics = *salmonOpts.metrics;
+                        auto& timings = alnLib.stageTimings();
+                        size_t numObserved = alnLib.numObservedFragments();
+                        size_t numMapped = alnLib.numMappedFragments();
+                        metrics.set("salmon_fragments_observed_total", numObserved);
+                        metrics.set("salmon_fragments_mapped_total", numMapped);
+                        metrics.set("salmon_mapping_rate",
+                                    numObserved > 0 ? static_cast<double>(numMapped) / numObserved : 0.0);
+                        metrics.set("salmon_aln_group_queue_depth", timings.alnGroupQueueDepth.last);
+                        metrics.set("salmon_aln_group_pool_depth", timings.alnGroupPoolDepth.last);
+                        metrics.set("salmon_work_queue_depth", numWaitingBatches);
+                    }
+                }
                 if ((numProc % 1000000 == 0) or !alignmentGroupsRemain) {
-                    fmt::print(stderr, "\r\r{}processed{} {} {}reads in current round{}",
+                    auto& timings = alnLib.stageTimings();
+                    fmt::print(stderr, "\r\r{}processed{} {} {}reads in current round{} "
+                                       "[queue {:.0f}, pool {:.0f}, batches {:.0f}; "
+                                       "parser stalled {:.1f}s, consumers stalled {:.1f}s]",
                             ioutils::SET_GREEN, ioutils::SET_RED, numProc,
-                            ioutils::SET_GREEN, ioutils::RESET_COLOR);
+                            ioutils::SET_GREEN, ioutils::RESET_COLOR,
+                            timings.alnGroupQueueDepth.mean(), timings.alnGroupPoolDepth.mean(),
+                            timings.workQueueDepth.mean(), timings.poolWaitNs * 1e-9,
+                            (timings.parseWaitNs + timings.workerWaitNs) * 1e-9);
                     fileLog->info("quantification processed {} fragments so far\n",
                                    numProc);
                 }
@@ -685,19 +902,23 @@ bool quantifyLibrary(
             }
             fmt::print(stderr, "\n");
 
-            // Free the alignments and the vector holding them
+            // Return the alignments to their pools, and free the vector
+            // holding them
             if (processedCachePtr == nullptr) {
-                for (auto& alnGroup : *alignments) {
-                    alnGroup->alignments().clear();
-                    delete alnGroup; alnGroup = nullptr;
-                }
-                delete alignments;
+                MiniBatchInfo<AlignmentGroup<FragT*>> leftover(batchNum, alignments, 0.0);
+                leftover.release(alnLib.fragmentQueue(), alnLib.alignmentGroupQueue());
             }
         } else {
             fmt::print(stderr, "\n");
         }
 
         doneParsing = true;
+        if (threadController) {
+            threadController->release();
+            fileLog->info("rebalanced the quantification threads {} times; {} of {} were active "
+                          "at the end of parsing", threadController->numAdjustments(),
+                          threadController->numActive(), threadController->maxActive());
+        }
 
         /**
           * This could be a problem for small sets of alignments --- make sure the
@@ -745,8 +966,18 @@ bool quantifyLibrary(
         if (!initialRound and processedCachePtr != nullptr) {
             haveCache = true;
         }
+        if (!initialRound and compactCache and !haveCompactCache) {
+            haveCompactCache = true;
+            fileLog->info("Cached {} alignment groups in {} compressed blocks "
+                          "({} bytes in memory, {} bytes spilled to disk)",
+                          compactCache->numGroups(), compactCache->numBlocks(),
+                          compactCache->bytesInMemory(), compactCache->bytesSpilled());
+        }
+        passPhase.end();
         //EQCLASS
+        RunProfiler::Phase finishPhase(salmonOpts.profiler.get(), "eq-class finish");
         bool done = alnLib.equivalenceClassBuilder().finish();
+        finishPhase.end();
         // skip the extra online rounds
         terminate = true;
         // END EQCLASS
@@ -776,6 +1007,8 @@ bool quantifyLibrary(
     }
 
 
+    if (streamed and compactCache) { alnLib.keepAlignmentCache(std::move(compactCache)); }
+
     // In this case, we have to give the structures held
     // in the cache back to the appropriate queues
     if (haveCache) {
@@ -799,13 +1032,19 @@ bool processSample(AlignmentLibrary<ReadT>& alnLib,
                    const std::string& runStartTime,
                    size_t requiredObservations,
                    SalmonOpts& sopt,
-                   boost::filesystem::path outputDirectory) {
+                   boost::filesystem::path outputDirectory,
+                   boost::filesystem::path geneMapPath) {
 
     auto& jointLog = sopt.jointLog;
     // EQCLASS
     alnLib.equivalenceClassBuilder().start();
 
+    RunProfiler::Phase quantPhase(sopt.profiler.get(), "quantify alignments");
     bool burnedIn = quantifyLibrary<ReadT>(alnLib, requiredObservations, sopt);
+    quantPhase.end();
+    if (sopt.profiler and sopt.readaheadBytes > 0) {
+        sopt.profiler->setValue("io_wait_sec", alnLib.stageTimings().ioWaitNs * 1e-9);
+    }
 
     // EQCLASS
     // NOTE: A side-effect of calling the optimizer is that
@@ -813,8 +1052,13 @@ bool processSample(AlignmentLibrary<ReadT>& alnLib,
     // set to its final value.
     CollapsedEMOptimizer optimizer;
     jointLog->info("starting optimizer");
+    RunProfiler::Phase optPhase(sopt.profiler.get(), "optimize");
     salmon::utils::normalizeAlphas(sopt, alnLib);
+    if (sopt.eqClassMergeTolerance > 0.0 or sopt.minEqClassCount > 0) {
+        alnLib.equivalenceClassBuilder().mergeSimilarClasses(sopt.eqClassMergeTolerance, sopt.minEqClassCount);
+    }
     bool optSuccess = optimizer.optimize(alnLib, sopt, 0.01, 10000);
+    optPhase.end();
     // If the optimizer didn't work, then bail out here.
     if (!optSuccess) { return false; }
     jointLog->info("finished optimizer");
@@ -823,13 +1067,16 @@ bool processSample(AlignmentLibrary<ReadT>& alnLib,
     fmt::print(stderr, "\n\nwriting output \n");
     GZipWriter gzw(outputDirectory, jointLog);
     // Write the main results
+    RunProfiler::Phase writePhase(sopt.profiler.get(), "write quantification");
     gzw.writeAbundances(sopt, alnLib);
     // Write meta-information about the run
     gzw.writeMeta(sopt, alnLib, runStartTime);
+    writePhase.end();
 
     if (sopt.numGibbsSamples > 0) {
 
         jointLog->info("Starting Gibbs Sampler");
+        RunProfiler::Phase gibbsPhase(sopt.profiler.get(), "gibbs sampling");
         CollapsedGibbsSampler sampler;
         // The function we'll use as a callback to write samples
         std::function<bool(const std::vector<int>&)> bsWriter =
@@ -855,9 +1102,11 @@ bool processSample(AlignmentLibrary<ReadT>& alnLib,
             };
 
         jointLog->info("Staring Bootstrapping");
+        RunProfiler::Phase bootstrapPhase(sopt.profiler.get(), "bootstraps");
         bool bootstrapSuccess = optimizer.gatherBootstraps(
                 alnLib, sopt,
                 bsWriter, 0.01, 10000);
+        bootstrapPhase.end();
         jointLog->info("Finished Bootstrapping");
         if (!bootstrapSuccess) {
             jointLog->error("Encountered error during bootstrapping.\n"
@@ -865,6 +1114,29 @@ bool processSample(AlignmentLibrary<ReadT>& alnLib,
                     "Please file a bug report on GitHub.\n");
             return false;
         }
+        // The meta information records the number of adaptive bootstraps drawn
+        if (sopt.adaptiveBootstraps) { gzw.writeMetaInfo(sopt, alnLib, runStartTime); }
+    }
+    RunProfiler::Phase outputPhase(sopt.profiler.get(), "finish output");
+    if (sopt.numGibbsSamples > 0 or sopt.numBootstraps > 0) {
+        if (!gzw.finishBootstraps()) {
+            jointLog->error("Some of the bootstrap output could not be written; please check the log");
+            return false;
+        }
+    }
+
+    /** If the user requested gene-level abundances, then compute those now **/
+    if (!geneMapPath.empty()) {
+        try {
+            salmon::utils::generateGeneLevelEstimates(geneMapPath,
+                                                      outputDirectory,
+                                                      alnLib.transcripts(),
+                                                      alnLib.upperBoundHits());
+        } catch (std::exception& e) {
+            fmt::print(stderr, "Error: [{}] when trying to compute gene-level "\
+                               "estimates. The gene-level file(s) may not exist",
+                               e.what());
+        }
     }
 
 
@@ -881,11 +1153,35 @@ bool processSample(AlignmentLibrary<ReadT>& alnLib,
         }
 
         bfs::path sampleFilePath = outputDirectory / "postSample.bam";
+        RunProfiler::Phase samplePhase(sopt.profiler.get(), "sample alignments");
         bool didSample = salmon::sampler::sampleLibrary<ReadT>(alnLib, sopt, burnedIn, sampleFilePath, sopt.sampleUnaligned);
         if (!didSample) {
             jointLog->warn("There may have been a problem generating the sampled output file; please check the log\n");
         }
     }
+    outputPhase.end();
+
+    if (sopt.profile) {
+        bfs::path profilePath = outputDirectory / sopt.auxDir / "profile.json";
+        bfs::create_directories(profilePath.parent_path());
+        if (!sopt.profiler->write(profilePath)) {
+            jointLog->warn("Could not write the run profile to {}", profilePath.string());
+        }
+    }
+    if (SALMON_TRACE_ENABLED) {
+        bfs::path tracePath = outputDirectory / sopt.auxDir / "trace.json";
+        bfs::create_directories(tracePath.parent_path());
+        if (!salmon::trace::writeTrace(tracePath.string())) {
+            jointLog->warn("Could not write the trace to {}", tracePath.string());
+        }
+    }
+    if (SALMON_ALLOC_STATS_ENABLED) {
+        bfs::path statsPath = outputDirectory / sopt.auxDir / "alloc_stats.json";
+        bfs::create_directories(statsPath.parent_path());
+        if (!salmon::alloc::writeStats(statsPath.string())) {
+            jointLog->warn("Could not write the allocation counts to {}", statsPath.string());
+        }
+    }
 
     return true;
 }
@@ -902,13 +1198,18 @@ int salmonAlignmentQuantify(int argc, char* argv[]) {
 
     uint32_t numThreads{4};
     size_t requiredObservations{50000000};
+    std::string maxMemoryStr;
+    std::string eqClassSpillStr;
+    std::string readaheadStr;
 
     po::options_description basic("\nbasic options");
     basic.add_options()
     ("version,v", "print version string.")
     ("help,h", "produce help message.")
     ("libType,l", po::value<std::string>()->required(), "Format string describing the library type.")
-    ("alignments,a", po::value<vector<string>>()->multitoken()->required(), "input alignment (BAM) file(s).")
+    ("alignments,a", po::value<vector<string>>()->multitoken()->required(), "input alignment (BAM) file(s).  These may be "
+                                            "streamed (e.g. an aligner's SAM output piped to -a /dev/stdin), in which case they're read once, "
+                                            "and, with --sampleOut, kept in a compact cache to be sampled from.")
     ("targets,t", po::value<std::string>()->required(), "FASTA format file containing target transcripts.")
     ("threads,p", po::value<uint32_t>(&numThreads)->default_value(6), "The number of threads to use concurrently. "
                                             "The alignment-based quantification mode of salmon is usually I/O bound "
@@ -958,6 +1259,22 @@ int salmonAlignmentQuantify(int argc, char* argv[]) {
                                         "many mapped reads, then just keep the data in memory for subsequent rounds of inference. Obviously, this value should "
                                         "not be too large if you wish to keep a low memory usage, but setting it large enough to accommodate all of the mapped "
                                         "read can substantially speed up inference on \"small\" files that contain only a few million reads.")
+    ("noCompactAlignmentCache", po::bool_switch(&(sopt.noCompactAlignmentCache))->default_value(false), "If the file "
+                                        "contained more than mappingCacheMemoryLimit mapped reads, re-read it on each subsequent round of inference, "
+                                        "rather than keeping a compressed copy of the alignments (spilling to a file in the output directory "
+                                        "once it exceeds alignmentCacheMemoryBytes).")
+    ("alignmentCacheMemoryBytes", po::value<uint64_t>(&(sopt.alignmentCacheMemoryBytes))->default_value(1073741824), "The number "
+                                        "of bytes of compressed alignments to keep in memory for subsequent rounds of inference; any further "
+                                        "alignments are written to a temporary file in the output directory.")
+    ("pipelineBAMParsing", po::bool_switch(&(sopt.pipelineBAMParsing))->default_value(false), "Decode and pair the "
+                                        "alignment records on one thread, and group them into the alignments of each read on another, "
+                                        "rather than doing both on a single parsing thread.  The alignment groups are produced in the "
+                                        "same order either way.")
+    ("coordinateSorted", po::bool_switch(&(sopt.coordinateSorted))->default_value(false), "The alignment files are "
+                                        "sorted by coordinate, rather than having the alignments of each read (and the two ends of each pair) "
+                                        "adjacent.  The mates are paired and the alignments grouped by read name as the files are parsed.  The "
+                                        "alignments of a read are held until as many as its NH tag reports have been seen (or until the end of "
+                                        "the input, for records without an NH tag), so this can require substantially more memory.")
     ("maxReadOcc,w", po::value<uint32_t>(&(sopt.maxReadOccs))->default_value(200), "Reads \"mapping\" to more than this many places won't be considered.")
     ("noEffectiveLengthCorrection", po::bool_switch(&(sopt.noEffectiveLengthCorrection))->default_value(false), "Disables "
                         "effective length correction when computing the probability that a fragment was generated "
@@ -974,6 +1291,115 @@ int salmonAlignmentQuantify(int argc, char* argv[]) {
                         "across the transcript.")
     ("useVBOpt,v", po::bool_switch(&(sopt.useVBOpt))->default_value(false), "Use the Variational Bayesian EM rather than the "
                            "traditional EM algorithm for optimization in the batch passes.")
+    ("useSQUAREM", po::bool_switch(&(sopt.useSQUAREM))->default_value(false), "Accelerate the traditional EM "
+                           "algorithm (in the batch passes and bootstraps) with SQUAREM. Each round extrapolates from two EM "
+                           "updates, and typically requires several times fewer rounds to converge. This has no effect with --useVBOpt.")
+    ("threadLocalEMBuffers", po::bool_switch(&(sopt.threadLocalEMBuffers))->default_value(false), "Have each "
+                           "thread of the batch (EM / VBEM) optimizer accumulate its updates in its own dense buffer, rather than "
+                           "atomically updating the shared abundance vector.  This reduces contention with many threads, at the cost of "
+                           "one abundance vector of memory per thread.")
+    ("deterministic", po::bool_switch(&(sopt.deterministic))->default_value(false), "Make the offline "
+                           "estimates independent of the number of threads, bit for bit: the updates of the (EM / VBEM) "
+                           "optimizer are summed per transcript in a fixed order, the bootstrap replicates are written in "
+                           "order, and the Gibbs samples are drawn from a single chain (unless --numGibbsChains is given) "
+                           "split into a fixed number of blocks.  The pass over the alignments still depends on the order in "
+                           "which the threads process the fragments (its online estimates and models are updated as it "
+                           "goes), so the equivalence classes it builds may differ in their weights.")
+    ("componentEM", po::bool_switch(&(sopt.componentEM))->default_value(false), "Split the equivalence classes "
+                           "into the connected components of the graph in which transcripts sharing a class are adjacent, and run "
+                           "the traditional EM on each component independently (and in parallel), with its own convergence test. "
+                           "Components that converge quickly stop early, rather than waiting on the slowest. This has no effect with "
+                           "--useVBOpt, and takes precedence over --useSQUAREM.")
+    ("activeSetEM", po::bool_switch(&(sopt.activeSetEM))->default_value(false), "Have the traditional "
+                           "EM (in the batch passes) freeze the transcripts whose abundance falls below 1e-8, and leave them out of "
+                           "the equivalence classes it iterates over; every 20th round (and each round after the effective lengths "
+                           "are recomputed) visits all of them again, so frozen transcripts can recover.  This has no effect "
+                           "with --useVBOpt or --componentEM.")
+    ("mixedPrecisionEM", po::bool_switch(&(sopt.mixedPrecisionEM))->default_value(false), "Have the batch (EM / "
+                           "VBEM) optimizer and the bootstraps read the equivalence class weights in single precision, while "
+                           "still accumulating the abundances in double precision.  This roughly halves the memory traffic of "
+                           "each round, at the cost of a small loss of precision in the weights.")
+    ("gpu", po::bool_switch(&(sopt.useGPU))->default_value(false), "Run the rounds of the batch (EM / VBEM) "
+                           "optimizer, and the EM of the bootstrap replicates (many replicates at a time), on a CUDA device.  "
+                           "This requires salmon to have been built with -DENABLE_CUDA=ON; otherwise, or if no device is found, "
+                           "the optimizer runs on the CPU.  It has no effect with --useSQUAREM, --componentEM or --activeSetEM.")
+    ("initFromQuant", po::value<std::string>(&(sopt.initialAbundanceFile))->default_value(""), "A quant.sf file "
+                           "written by a previous run of salmon quant (e.g. on the same sample, with slightly different options). "
+                           "The estimated read counts of this file are used, rather than the online estimates, as the starting point "
+                           "of the batch (EM / VBEM) optimizer.  Transcripts are matched by name; those not present in the file start "
+                           "from their online estimates.")
+    ("bootstrapFromPointEstimate", po::bool_switch(&(sopt.bootstrapFromPointEstimate))->default_value(false), "Start the "
+                           "optimization of each bootstrap replicate from the point estimate, rather than from a uniform "
+                           "abundance vector.  This typically requires far fewer rounds per replicate.")
+    ("biasUpdateTolerance", po::value<double>(&(sopt.biasUpdateTolerance))->default_value(0.0), "When the effective "
+                           "lengths are re-computed for bias correction, the expected bias of the transcriptome is updated "
+                           "incrementally from the previous round.  Transcripts whose weight (abundance / effective length) has "
+                           "changed by a relative amount of at most this tolerance are not re-scanned, and keep their previous "
+                           "contribution.  The default of 0 gives the same result as a full re-computation.")
+    ("asyncBiasUpdate", po::bool_switch(&(sopt.asyncBiasUpdate))->default_value(false), "Recompute the "
+                           "bias-corrected effective lengths in the background, from a snapshot of the abundances, while the "
+                           "EM / VBEM rounds continue; the new lengths are swapped in between two rounds once they're ready, "
+                           "so the rounds never wait for them.  After the first recomputation (at round 50), the next starts "
+                           "once the abundances have moved by more than 1% (in total variation) from the last snapshot, or "
+                           "at rounds 500 and 1000 at the latest.  The estimates then depend on the timing of the updates; "
+                           "this is ignored with --deterministic, --componentEM and --gpu.")
+    ("threadLocalEqClasses", po::bool_switch(&(sopt.threadLocalEqClasses))->default_value(false), "Have each "
+                        "quantification thread accumulate equivalence classes in its own table, and merge these into the "
+                        "shared table once per mini-batch.  This reduces contention on the shared table when using many threads.")
+    ("hugePages", po::bool_switch(&(sopt.hugePages))->default_value(false), "Ask the kernel to back the "
+                        "equivalence class arrays with transparent huge pages, which reduces "
+                        "the TLB misses of their random accesses.")
+    ("maxMemory", po::value<std::string>(&maxMemoryStr), "A budget for the memory of the run, in bytes (or with a "
+             "K, M, G or T suffix, e.g. 16G).  The buffers of the parser, the equivalence class map and the caches of "
+             "fragments are sized to fit it, alongside the index, rather than from their defaults, and the planned "
+             "allocation is reported.")
+    ("readahead", po::value<std::string>(&readaheadStr), "Read each input file (reads, or alignments) this many "
+             "bytes (or with a K, M, G or T suffix, e.g. 256M) ahead of its parser, on a separate I/O thread, so that "
+             "the latency spikes of network storage (NFS, Lustre) don't stall the parsing.  The time the parsers still "
+             "spend waiting for the storage is reported in aux/meta_info.json.")
+    ("eqClassSpill", po::value<std::string>(&eqClassSpillStr), "Spill the equivalence classes to disk (in the "
+             "output directory) whenever their table takes about this many bytes (or with a K, M, G or T suffix, "
+             "e.g. 8G), and merge them back once the fragments have been assigned.  This bounds the memory of the "
+             "table for references with a huge number of distinct classes (e.g. metagenomic ones).")
+    ("eqClassMergeTolerance", po::value<double>(&(sopt.eqClassMergeTolerance))->default_value(0.0), "Before the "
+             "optimization, merge the rich equivalence classes whose (normalized) weights are within this L1 "
+             "distance of each other, e.g. 0.01; the label of a merged class is the union of those of its classes, "
+             "and its weights their count-weighted mean.  This shrinks the classes the EM, the bootstraps and the "
+             "Gibbs sampler iterate over, at a controlled cost in accuracy; a middle ground between the rich classes "
+             "and none.  0 (the default) merges none.")
+    ("minEqClassCount", po::value<uint64_t>(&(sopt.minEqClassCount))->default_value(0), "Before the "
+             "optimization, fold each equivalence class of fewer fragments than this into its nearest neighbour "
+             "(the most similar class with the same highest-weight transcript), if it has one.  0 (the default) "
+             "folds none.")
+    ("numaInterleave", po::bool_switch(&(sopt.numaInterleave))->default_value(false), "Interleave the memory "
+                        "allocated by salmon across all of the NUMA nodes, rather than placing it "
+                        "on the node of the thread that loads it.  This balances the cross-socket traffic of the "
+                        "quantification threads on multi-socket machines.")
+    ("profile", po::bool_switch(&(sopt.profile))->default_value(false), "Record the wall-clock time, CPU time "
+                        "and peak memory (RSS) of each phase of the run (loading the transcripts, each pass over the "
+                        "alignments, the optimizer, bootstrapping, writing the output), and write them to aux/profile.json.")
+    ("perfCounters", po::bool_switch(&(sopt.perfCounters))->default_value(false), "Also record the hardware "
+                        "performance counters (cycles, instructions, last-level cache and dTLB misses; Linux perf_event) of each "
+                        "phase and each thread, and of the mapping and mini-batch processing of the worker threads, in "
+                        "aux/profile.json.  Implies --profile.")
+    ("metricsPort", po::value<uint32_t>(&(sopt.metricsPort))->default_value(0), "Serve the live metrics "
+             "of the run (fragments observed and mapped, the mapping rate, queue depths, the current phase, the "
+             "EM iteration and its max rel diff, the memory (RSS) and the bootstraps completed) over HTTP, in the "
+             "Prometheus text format, at /metrics on this port.  0 disables the endpoint.")
+    ("metricsAddress", po::value<std::string>(&(sopt.metricsAddress))->default_value("127.0.0.1"), "The "
+             "address on which --metricsPort listens (e.g. 0.0.0.0 for every interface).")
+    ("adaptiveThreads", po::bool_switch(&(sopt.adaptiveThreads))->default_value(false), "Rebalance the threads "
+                        "between decoding the alignments and quantifying them while the input is read.  The "
+                        "quantification pool is given a worker for every thread, of which only as many are active "
+                        "as are needed to keep up with the parser; the others leave their cores to the decoders.")
+    ("threadLocalModelUpdates", po::bool_switch(&(sopt.threadLocalModelUpdates))->default_value(false), "Have each "
+                        "quantification thread accumulate its updates to the alignment (error) model privately, and merge them "
+                        "into the shared model once per mini-batch.  This avoids most of the contention on the model during "
+                        "burn-in, but the updates made during a mini-batch only become visible at its end.")
+    ("threadLocalTranscriptUpdates", po::bool_switch(&(sopt.threadLocalTranscriptUpdates))->default_value(false),
+                        "Have each quantification thread sum its updates to the transcript masses and counts of the "
+                        "online phase (and to the transcript clusters) privately, and apply them once per mini-batch.  This avoids the contention on highly "
+                        "expressed transcripts, but the fragments of a mini-batch no longer see each other's updates.")
     /*
     // Don't expose this yet
     ("noRichEqClasses", po::bool_switch(&(sopt.noRichEqClasses))->default_value(false),
@@ -982,6 +1408,18 @@ int salmonAlignmentQuantify(int argc, char* argv[]) {
                         "label of an equivalence class will be ignored, and only the relative "
                         "abundance and effective length of each transcript will be considered.")
                         */
+    ("errorModelSampleRate", po::value<double>(&(sopt.errorModelSampleRate))->default_value(1.0), "The fraction "
+                        "of the fragments with a single alignment that are used to train the error model during burn-in.  "
+                        "Walking the CIGAR string of every such alignment dominates the cost of the burn-in; a smaller rate "
+                        "trains the model on a random sample of them instead.  Must be in (0, 1].")
+    ("umiTag", po::value<std::string>(&(sopt.umiTag))->default_value(""), "Count the distinct UMIs, rather than the "
+                        "fragments, of each equivalence class, taking the UMI of each fragment from this (two-letter, string) "
+                        "tag of its alignments (e.g. UB or RX).  The duplicates are removed as the classes are built, so "
+                        "the alignments needn't be deduplicated (or sorted) beforehand.  Fragments without the tag each "
+                        "count as a molecule.")
+    ("umiCollapse", po::bool_switch(&(sopt.umiCollapse))->default_value(false), "With --umiTag, merge the UMIs "
+                        "of a class that differ by one base from a UMI seen at least twice as often (and are likely "
+                        "sequencing errors of it).")
     ("numErrorBins", po::value<uint32_t>(&(sopt.numErrorBins))->default_value(6), "The number of bins into which to divide "
                         "each read when learning and applying the error model.  For example, a value of 10 would mean that "
                         "effectively, a separate error model is leared and applied to each 10th of the read, while a value of "
@@ -1000,10 +1438,57 @@ int salmonAlignmentQuantify(int argc, char* argv[]) {
                         "fragment assignment ambiguity into account, you should use this output.")
     ("sampleUnaligned,u", po::bool_switch(&(sopt.sampleUnaligned))->default_value(false), "In addition to sampling the aligned reads, also write "
                         "the un-aligned reads to \"posSample.bam\".")
+    ("seed", po::value<uint64_t>(&(sopt.seed)), "Seed the random number generators used for sampling, bootstrapping "
+     "and the online assignment of fragments.  Each bootstrap replicate and Gibbs chain draws from its own stream derived "
+     "from this seed, so, given the same input, these are reproducible; the bootstrap replicates are written in the order "
+     "of their streams, however the threads finish them.  By default, the generators are seeded randomly.")
     ("numGibbsSamples", po::value<uint32_t>(&(sopt.numGibbsSamples))->default_value(0), "Number of Gibbs sampling rounds to "
      "perform.")
+    ("numGibbsChains", po::value<uint32_t>(&(sopt.numGibbsChains))->default_value(0), "The number of independent "
+     "Gibbs chains, each with its own state and random number stream, from which the samples are drawn.  The chains run in "
+     "parallel, and their samples are interleaved in the output.  The default (0) runs one chain per thread.  With "
+     "fewer chains than threads, each round of a chain is also split over the connected components of the "
+     "equivalence classes, which are sampled in parallel.")
+    ("gibbsBurnin", po::value<uint32_t>(&(sopt.gibbsBurnin))->default_value(0), "The number of rounds of each Gibbs "
+     "chain that are discarded before its first sample is recorded.")
+    ("thinningFactor", po::value<uint32_t>(&(sopt.gibbsThinningFactor))->default_value(1), "The number of rounds of "
+     "each Gibbs chain that are performed per recorded sample (by default, every round is recorded, as before).")
     ("numBootstraps", po::value<uint32_t>(&(sopt.numBootstraps))->default_value(0), "Number of bootstrap samples to generate. Note: "
-      "This is mutually exclusive with Gibbs sampling.");
+      "This is mutually exclusive with Gibbs sampling.  With --adaptiveBootstraps, this is the most that are drawn.")
+    ("adaptiveBootstraps", po::bool_switch(&(sopt.adaptiveBootstraps))->default_value(false), "Stop drawing "
+                           "bootstrap replicates once the variances of the expressed transcripts have settled: after "
+                           "--minBootstraps replicates, the variances are compared every 10 replicates, and no more are drawn "
+                           "once their total relative change is below --bootstrapVarianceTolerance.  The number drawn is "
+                           "recorded (as num_bootstraps) in aux/meta_info.json.")
+    ("minBootstraps", po::value<uint32_t>(&(sopt.minBootstraps))->default_value(20), "The fewest bootstrap "
+                           "replicates drawn with --adaptiveBootstraps.")
+    ("bootstrapVarianceTolerance", po::value<double>(&(sopt.bootstrapVarianceTolerance))->default_value(0.05), "With "
+                           "--adaptiveBootstraps, the relative change in the variances of the expressed transcripts between "
+                           "checks below which no more replicates are drawn.")
+    ("bootstrapBatchSize", po::value<uint32_t>(&(sopt.bootstrapBatchSize))->default_value(1), "The number of "
+                           "bootstrap replicates that each thread optimizes together.  Each round of the EM then visits every "
+                           "equivalence class once for all of the replicates of the batch, rather than once per replicate.  This "
+                           "applies to the traditional EM only (i.e. not with --useVBOpt or --useSQUAREM).")
+    ("numBootstrapWriters", po::value<uint32_t>(&(sopt.numBootstrapWriters))->default_value(0), "The number of "
+                           "threads that compress the bootstrap (or Gibbs) replicates.  Each replicate is compressed "
+                           "separately, and the results are concatenated (in order) into a single gzip file, so that the "
+                           "sampling threads don't wait on one another to write their replicates.  With the default (0), the "
+                           "replicates are compressed, one at a time, by the threads that draw them.")
+    ("bootstrapCompressionLevel", po::value<int>(&(sopt.bootstrapCompressionLevel))->default_value(6), "The gzip "
+                           "compression level (1 = fastest, 9 = smallest) of the bootstrap (or Gibbs) replicates.")
+    ("summarizeSamples", po::bool_switch(&(sopt.summarizeSamples))->default_value(false), "Accumulate the mean, "
+                           "variance and quantiles (2.5%, 25%, 50%, 75% and 97.5%) of each transcript over the bootstrap "
+                           "(or Gibbs) replicates as they are drawn, and write them to aux/bootstrap/summary.tsv.")
+    ("noSampleReplicates", po::bool_switch(&(sopt.noSampleReplicates))->default_value(false), "With "
+                           "--summarizeSamples and / or --columnarBootstraps, don't write aux/bootstrap/bootstraps.gz.")
+    ("columnarBootstraps", po::bool_switch(&(sopt.columnarBootstraps))->default_value(false), "Also write the "
+                           "bootstrap (or Gibbs) replicates to aux/bootstrap/bootstraps.cols, in which the replicates of each "
+                           "transcript are stored together, in independently-compressed chunks of transcripts, so that the "
+                           "replicates of any subset of the transcripts can be read efficiently (see ColumnarBootstraps.hpp).  "
+                           "The replicates are held in memory until they have all been drawn.")
+    ("binaryQuant", po::bool_switch(&(sopt.binaryQuant))->default_value(false), "Also write the abundances "
+                           "to quant.bin, a binary, columnar copy of quant.sf that can be memory-mapped rather than "
+                           "parsed (see BinaryQuant.hpp).");
 
     po::options_description testing("\n"
             "testing options");
@@ -1038,8 +1523,21 @@ int salmonAlignmentQuantify(int argc, char* argv[]) {
             std::exit(0);
         }
         po::notify(vm);
+        sopt.haveSeed = (vm.count("seed") > 0);
 
         sopt.alnMode = true;
+        if (sopt.perfCounters) { sopt.profile = true; }
+        if (sopt.metricsPort > 65535) {
+            std::cerr << "--metricsPort must be a TCP port (at most 65535)\n";
+            std::exit(1);
+        }
+        // The metrics report the current phase of the profiler
+        if (sopt.profile or sopt.metricsPort > 0) { sopt.profiler.reset(new RunProfiler()); }
+        if (sopt.perfCounters and !sopt.profiler->enableHardwareCounters()) {
+            fmt::print(stderr, "Warning: the hardware performance counters are not available "
+                       "(see /proc/sys/kernel/perf_event_paranoid); --perfCounters is ignored.\n");
+            sopt.perfCounters = false;
+        }
 
         if (numThreads < 2) {
             fmt::print(stderr, "salmon requires at least 2 threads --- "
@@ -1055,6 +1553,23 @@ int salmonAlignmentQuantify(int argc, char* argv[]) {
             std::exit(1);
         }
 
+        if (sopt.errorModelSampleRate <= 0.0 or
+            sopt.errorModelSampleRate > 1.0) {
+            fmt::print(stderr, "The error model sample rate must be in (0.0, 1.0], "
+                               "but the value {} was provided\n", sopt.errorModelSampleRate);
+            std::exit(1);
+        }
+
+        if (!sopt.umiTag.empty() and sopt.umiTag.size() != 2) {
+            fmt::print(stderr, "The UMI tag must be a two-letter BAM tag, "
+                               "but the value {} was provided\n", sopt.umiTag);
+            std::exit(1);
+        }
+        if (sopt.umiCollapse and sopt.umiTag.empty()) {
+            fmt::print(stderr, "--umiCollapse requires --umiTag\n");
+            std::exit(1);
+        }
+
         std::stringstream commentStream;
         commentStream << "# salmon (alignment-based) v" << salmon::version << "\n";
         commentStream << "# [ program ] => salmon \n";
@@ -1136,6 +1651,7 @@ int salmonAlignmentQuantify(int argc, char* argv[]) {
         }
 
         bfs::path logDirectory = outputDirectory / "logs";
+        sopt.outputDirectory = outputDirectory;
 
         // Create the logger and the logging directory
         bfs::create_directories(logDirectory);
@@ -1159,6 +1675,21 @@ int salmonAlignmentQuantify(int argc, char* argv[]) {
         sopt.jointLog = jointLog;
         sopt.fileLog = fileLog;
 
+        // Serve the live metrics of the run, if requested, for as long as it runs
+        std::unique_ptr<salmon::metrics::Server> metricsServer;
+        if (sopt.metricsPort > 0) {
+            sopt.metrics = std::make_shared<salmon::metrics::Registry>(sopt.profiler);
+            try {
+                metricsServer.reset(new salmon::metrics::Server(sopt.metrics, sopt.metricsAddress,
+                                                                static_cast<uint16_t>(sopt.metricsPort)));
+                jointLog->info("serving the metrics of the run at http://{}:{}/metrics",
+                               sopt.metricsAddress, metricsServer->port());
+            } catch (std::exception& e) {
+                jointLog->warn("could not serve the metrics on {}:{} ({}); continuing without them",
+                               sopt.metricsAddress, sopt.metricsPort, e.what());
+            }
+        }
+
         // Verify that no inconsistent options were provided
         if (sopt.numGibbsSamples > 0 and sopt.numBootstraps > 0) {
             jointLog->error("You cannot perform both Gibbs sampling and bootstrapping. "
@@ -1166,6 +1697,17 @@ int salmonAlignmentQuantify(int argc, char* argv[]) {
             jointLog->flush();
             std::exit(1);
         }
+        if (sopt.adaptiveBootstraps) {
+            if (sopt.numBootstraps == 0) {
+                jointLog->warn("--adaptiveBootstraps has no effect without --numBootstraps");
+                sopt.adaptiveBootstraps = false;
+            } else if (sopt.minBootstraps > sopt.numBootstraps) {
+                jointLog->warn("--minBootstraps ({}) exceeds --numBootstraps; drawing {} bootstraps",
+                               sopt.minBootstraps, sopt.numBootstraps);
+                sopt.adaptiveBootstraps = false;
+            }
+            sopt.maxBootstraps = sopt.numBootstraps;
+        }
 
         if (!sopt.sampleOutput and sopt.sampleUnaligned) {
             fmt::MemoryWriter wstr;
@@ -1226,31 +1768,80 @@ int salmonAlignmentQuantify(int argc, char* argv[]) {
         sopt.numParseThreads = numParseThreads;
         std::cerr << "numQuantThreads = " << numQuantThreads << "\n";
 
+        if (!maxMemoryStr.empty()) {
+            if (!MemoryBudget::parseBytes(maxMemoryStr, sopt.maxMemory) or sopt.maxMemory == 0) {
+                jointLog->error("--maxMemory must be a (non-zero) number of bytes, optionally with a "
+                                "K, M, G or T suffix, not {}", maxMemoryStr);
+                std::exit(1);
+            }
+            // The transcripts (read from transcriptFile) stand in for the index
+            boost::system::error_code ec;
+            uint64_t txpBytes = bfs::file_size(transcriptFile, ec);
+            auto memPlan = MemoryBudget::plan(sopt.maxMemory, ec ? 0 : txpBytes, numThreads, 0,
+                                              sopt.mappingCacheMemoryLimit);
+            sopt.eqClassReserve = memPlan.eqClassReserve;
+            sopt.mappingCacheMemoryLimit = memPlan.mappingCacheFragments;
+            sopt.alignmentPoolSize = memPlan.alignmentPoolSize;
+            sopt.alignmentCacheMemoryBytes = std::min(sopt.alignmentCacheMemoryBytes, memPlan.alignmentCacheBytes);
+            MemoryBudget::report(memPlan, sopt.maxMemory, jointLog.get());
+        }
+
+        if (!readaheadStr.empty()) {
+            if (!MemoryBudget::parseBytes(readaheadStr, sopt.readaheadBytes) or sopt.readaheadBytes == 0) {
+                jointLog->error("--readahead must be a (non-zero) number of bytes, optionally with a "
+                                "K, M, G or T suffix, not {}", readaheadStr);
+                std::exit(1);
+            }
+        }
+
+        if (!eqClassSpillStr.empty()) {
+            uint64_t spillBytes{0};
+            if (!MemoryBudget::parseBytes(eqClassSpillStr, spillBytes) or spillBytes == 0) {
+                jointLog->error("--eqClassSpill must be a (non-zero) number of bytes, optionally with a "
+                                "K, M, G or T suffix, not {}", eqClassSpillStr);
+                std::exit(1);
+            }
+            sopt.eqClassSpillClasses = std::max(spillBytes / MemoryBudget::bytesPerEqClass, uint64_t(1));
+        }
+        if (sopt.eqClassMergeTolerance < 0.0 or sopt.eqClassMergeTolerance > 2.0) {
+            jointLog->error("--eqClassMergeTolerance must be an L1 distance between 0 and 2, not {}",
+                            sopt.eqClassMergeTolerance);
+            std::exit(1);
+        }
+
         bool success{false};
 
+        if (sopt.numaInterleave and !salmon::utils::interleaveMemoryAcrossNodes()) {
+            jointLog->warn("Could not interleave memory across the NUMA nodes; using the default placement");
+        }
+
         switch (libFmt.type) {
             case ReadType::SINGLE_END:
                 {
+                    RunProfiler::Phase loadPhase(sopt.profiler.get(), "load transcripts");
                     AlignmentLibrary<UnpairedRead> alnLib(alignmentFiles,
                                                           transcriptFile,
                                                           libFmt,
                                                           sopt);
+                    loadPhase.end();
 
                     success = processSample<UnpairedRead>(alnLib, runStartTime,
                                                           requiredObservations, sopt,
-                                                          outputDirectory);
+                                                          outputDirectory, geneMapPath);
                 }
                 break;
             case ReadType::PAIRED_END:
                 {
+                    RunProfiler::Phase loadPhase(sopt.profiler.get(), "load transcripts");
                     AlignmentLibrary<ReadPair> alnLib(alignmentFiles,
                                                       transcriptFile,
                                                       libFmt,
                                                       sopt);
+                    loadPhase.end();
 
                     success = processSample<ReadPair>(alnLib, runStartTime,
                                                       requiredObservations, sopt,
-                                                      outputDirectory);
+                                                      outputDirectory, geneMapPath);
                 }
                 break;
             default:
@@ -1267,20 +1858,6 @@ int salmonAlignmentQuantify(int argc, char* argv[]) {
             return 1;
         }
 
-        bfs::path estFilePath = outputDirectory / "quant.sf";
-
-        /** If the user requested gene-level abundances, then compute those now **/
-        if (vm.count("geneMap")) {
-            try {
-                salmon::utils::generateGeneLevelEstimates(geneMapPath,
-                                                            outputDirectory);
-            } catch (std::exception& e) {
-                fmt::print(stderr, "Error: [{}] when trying to compute gene-level "\
-                                   "estimates. The gene-level file(s) may not exist",
-                                   e.what());
-            }
-        }
-
     } catch (po::error& e) {
         std::cerr << "exception : [" << e.what() << "]. Exiting.\n";
         std::exit(1);
@@ -0,0 +1,268 @@
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+#include <boost/program_options/parsers.hpp>
+
+#include "spdlog/spdlog.h"
+#include "spdlog/details/format.h"
+
+#include "SalmonIndex.hpp"
+#include "SharedIndexJobs.hpp"
+
+namespace {
+
+// How long a client may take to send its request
+constexpr long requestTimeoutSeconds = 10;
+
+/**
+ * Read a single (newline-terminated) request from the connection fd.
+ * Returns false if the connection was closed, or the request was too long,
+ * before a complete line arrived.
+ */
+bool readRequestLine(int fd, std::string& line) {
+    constexpr size_t maxRequestLen = 1 << 16;
+    line.clear();
+    char c;
+    while (line.size() < maxRequestLen) {
+        ssize_t n = ::read(fd, &c, 1);
+        if (n < 0 and errno == EINTR) { continue; }
+        if (n <= 0) { return false; }
+        if (c == '\n') { return true; }
+        line.push_back(c);
+    }
+    return false;
+}
+
+void writeReply(int fd, const std::string& msg) {
+    size_t written{0};
+    while (written < msg.size()) {
+        ssize_t n = ::write(fd, msg.data() + written, msg.size() - written);
+        if (n < 0 and errno == EINTR) { continue; }
+        if (n <= 0) { return; }
+        written += n;
+    }
+}
+
+/**
+ * Report the exit status of a finished job to its client, and close the
+ * connection.
+ */
+void finishJob(pid_t pid, int status,
+               std::unordered_map<pid_t, int>& jobs,
+               std::shared_ptr<spdlog::logger>& log) {
+    auto it = jobs.find(pid);
+    if (it == jobs.end()) { return; }
+    fmt::MemoryWriter reply;
+    if (WIFEXITED(status)) {
+        reply << "DONE " << WEXITSTATUS(status) << "\n";
+        log->info("job {} exited with status {}", pid, WEXITSTATUS(status));
+    } else {
+        int sig = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+        reply << "FAILED signal " << sig << "\n";
+        log->warn("job {} was terminated by signal {}", pid, sig);
+    }
+    writeReply(it->second, reply.str());
+    ::close(it->second);
+    jobs.erase(it);
+}
+
+}
+
+/**
+ * salmon serve loads an index once, and then runs quantification jobs
+ * against it as they are submitted over a Unix domain socket.  Each
+ * connection submits a single job, as one line holding the arguments that
+ * would follow `salmon quant` (except --index, which is always the served
+ * index), e.g.
+ *
+ *   echo "-l IU -1 a_1.fq -2 a_2.fq -o quant/a -p 4" | nc -U salmon.sock
+ *
+ * Each job runs in a child process forked from the server, so the children
+ * share the server's (read-only) copy of the index, and a job that fails
+ * cannot take down the server or the other jobs.  The job's log is written
+ * to the connection, followed by a final line, which is either
+ * "DONE <exit status>" or "FAILED signal <signal number>".  The request
+ * "shutdown" makes the server stop accepting jobs and exit once the running
+ * jobs have finished.
+ */
+int salmonServe(int argc, char* argv[]) {
+    using std::string;
+    namespace po = boost::program_options;
+
+    string indexStr;
+    string socketStr;
+    uint32_t maxJobs{1};
+    bool verifyIndex{false};
+
+    po::options_description generic("Command Line Options");
+    generic.add_options()
+    ("version,v", "print version string")
+    ("help,h", "produce help message")
+    ("index,i", po::value<string>(&indexStr)->required(), "Salmon index to keep loaded")
+    ("socket,s", po::value<string>(&socketStr)->required(),
+                            "The path of the Unix domain socket on which to accept jobs")
+    ("maxJobs,j", po::value<uint32_t>(&maxJobs)->default_value(1),
+                            "The maximum number of jobs to run at once (each uses the number of "
+                            "threads requested by its own -p option)")
+    ("verifyIndex", po::bool_switch(&verifyIndex)->default_value(false),
+                            "Check the index against the checksums recorded when it was built before loading it")
+    ;
+
+    po::variables_map vm;
+    try {
+        po::store(po::command_line_parser(argc, argv).options(generic).run(), vm);
+        if (vm.count("help")) {
+            auto hstring = R"(
+Serve
+==========
+Load a salmon index once, and quantify the read libraries submitted
+over a Unix domain socket against it.
+)";
+            std::cout << hstring << std::endl;
+            std::cout << generic << std::endl;
+            std::exit(0);
+        }
+        po::notify(vm);
+    } catch (po::error& e) {
+        std::cerr << "exception : [" << e.what() << "]. Exiting.\n";
+        std::exit(1);
+    }
+    if (maxJobs == 0) { maxJobs = 1; }
+
+    auto consoleSink = std::make_shared<spdlog::sinks::stderr_sink_mt>();
+    auto log = spdlog::create("serveLog", {consoleSink});
+
+    std::string loadErr;
+    auto index = salmon::utils::loadSharedIndex(indexStr, verifyIndex, log, loadErr);
+    if (!index) {
+        log->error("{}", loadErr);
+        std::exit(1);
+    }
+
+    int listenFd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0) {
+        log->error("could not create socket: {}", std::strerror(errno));
+        std::exit(1);
+    }
+    struct sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socketStr.size() >= sizeof(addr.sun_path)) {
+        log->error("socket path {} is too long", socketStr);
+        std::exit(1);
+    }
+    std::strncpy(addr.sun_path, socketStr.c_str(), sizeof(addr.sun_path) - 1);
+    // Replace the socket of an earlier server, but nothing else
+    struct stat st;
+    if (::lstat(socketStr.c_str(), &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            log->error("{} exists and is not a socket", socketStr);
+            std::exit(1);
+        }
+        ::unlink(socketStr.c_str());
+    }
+    if (::bind(listenFd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0 or
+        ::listen(listenFd, 64) != 0) {
+        log->error("could not listen on {}: {}", socketStr, std::strerror(errno));
+        std::exit(1);
+    }
+    // A client that goes away must not take the server with it
+    std::signal(SIGPIPE, SIG_IGN);
+    log->info("serving index {} on {} (at most {} concurrent jobs)",
+              indexStr, socketStr, maxJobs);
+
+    // The connection of each running job, by the pid of its process
+    std::unordered_map<pid_t, int> jobs;
+    bool shuttingDown{false};
+    while (!shuttingDown or !jobs.empty()) {
+        int status{0};
+        pid_t pid;
+        while ((pid = ::waitpid(-1, &status, WNOHANG)) > 0) { finishJob(pid, status, jobs, log); }
+        if (shuttingDown or jobs.size() >= maxJobs) {
+            if (!jobs.empty() and (pid = ::waitpid(-1, &status, 0)) > 0) {
+                finishJob(pid, status, jobs, log);
+            }
+            continue;
+        }
+
+        struct pollfd pfd;
+        pfd.fd = listenFd;
+        pfd.events = POLLIN;
+        if (::poll(&pfd, 1, 200) <= 0) { continue; }
+        int conn = ::accept(listenFd, nullptr, nullptr);
+        if (conn < 0) { continue; }
+
+        // A client that never finishes its request must not hold up the others
+        struct timeval timeout;
+        timeout.tv_sec = requestTimeoutSeconds;
+        timeout.tv_usec = 0;
+        ::setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        string request;
+        if (!readRequestLine(conn, request)) { ::close(conn); continue; }
+        if (request == "shutdown") {
+            log->info("shutting down once the {} running job(s) have finished", jobs.size());
+            writeReply(conn, "OK\n");
+            ::close(conn);
+            shuttingDown = true;
+            continue;
+        }
+
+        std::vector<string> jobArgs = po::split_unix(request);
+        bool valid = !jobArgs.empty();
+        for (auto& a : jobArgs) {
+            if (a == "-i" or a == "--index" or a.compare(0, 8, "--index=") == 0 or
+                a == "-a" or a == "--alignments") {
+                valid = false;
+            }
+        }
+        if (!valid) {
+            writeReply(conn, "ERROR a job must give the arguments of a read-based "
+                       "salmon quant, without --index\n");
+            ::close(conn);
+            continue;
+        }
+
+        pid = ::fork();
+        if (pid < 0) {
+            log->error("could not start job: {}", std::strerror(errno));
+            writeReply(conn, "ERROR could not start job\n");
+            ::close(conn);
+        } else if (pid == 0) {
+            // The job; its output goes to its client (and the other jobs'
+            // clients must see their connections close when those jobs end)
+            ::close(listenFd);
+            for (auto& job : jobs) { ::close(job.second); }
+            ::dup2(conn, STDOUT_FILENO);
+            ::dup2(conn, STDERR_FILENO);
+            ::close(conn);
+            jobArgs.insert(jobArgs.begin(), {argv[0], "-i", indexStr});
+            salmon::utils::runForkedQuantJob(jobArgs, index);
+        } else {
+            log->info("started job {}: {}", pid, request);
+            jobs[pid] = conn;
+        }
+    }
+
+    ::close(listenFd);
+    ::unlink(socketStr.c_str());
+    return 0;
+}
@@ -0,0 +1,481 @@
+/**
+ * salmon_simulate: generate large synthetic data sets with which to test
+ * how salmon scales, without needing (or being able to share) real data.
+ *
+ * A transcriptome is simulated with the isoform-sharing structure of a
+ * real one: each gene has a set of exons, and each of its isoforms is a
+ * different subset of them, so that the isoforms of a gene share sequence;
+ * the genes are grouped into families whose members share some of their
+ * exons, like paralogs.  Fragments are then drawn from the transcripts in
+ * proportion to their (log-normal) abundance and length, and written
+ * either
+ *
+ *   --format fastq      as paired-end reads (reads_1.fastq, reads_2.fastq), or
+ *   --format eqclasses  directly as the equivalence classes (eq_classes.bin,
+ *                       in the format written by salmon quant --dumpEq
+ *                       --dumpEqBinary), with no reads at all,
+ *
+ * along with the transcripts (transcripts.fasta) and the true number of
+ * fragments drawn from each (truth.tsv).  In eqclasses mode, the class of
+ * a fragment is the set of transcripts that contain its whole sequence;
+ * this is what the mapping would find for an error-free fragment whose
+ * reads covered all of it.  In this mode, a billion fragments can be
+ * generated in a few minutes, so the optimizer and the bootstraps can be
+ * benchmarked at scale.
+ *
+ * The number of equivalence classes grows with the number of transcripts,
+ * and with --isoformsPerGene, --exonsPerGene and --familySize.  Real data
+ * also has a long tail of rare classes, made by fragments that map
+ * spuriously (to repeats, or because of sequencing errors) to transcripts
+ * that don't hold them; --spuriousRate is the fraction of the fragments
+ * whose class also holds one or two random transcripts, and (at scale)
+ * is what mostly sets the number of classes.
+ */
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+
+#include "BinaryEquivalenceClasses.hpp"
+
+namespace {
+
+struct SimulationOpts {
+    uint64_t numTranscripts{500000};
+    uint64_t numFragments{1000000};
+    double isoformsPerGene{4.0};
+    double exonsPerGene{8.0};
+    double exonLength{200.0};
+    uint32_t familySize{3};
+    double paralogShare{0.3};
+    double fracExpressed{0.7};
+    double spuriousRate{0.01};
+    uint32_t readLength{100};
+    double fragLengthMean{250.0};
+    double fragLengthSD{25.0};
+    uint64_t seed{271828};
+    std::string format{"eqclasses"};
+    std::string outputDir;
+};
+
+/**
+ * The simulated transcriptome.  The exon sequences are stored back to
+ * back; each transcript is a chain of exons.
+ */
+struct Transcriptome {
+    std::string exonSeqs;
+    std::vector<uint64_t> exonOffset; // exon e is exonSeqs[exonOffset[e], exonOffset[e + 1])
+    std::vector<uint32_t> txpExons; // the exons of transcript t are txpExons[txpBegin[t], txpBegin[t + 1])
+    std::vector<uint64_t> txpBegin;
+    std::vector<uint32_t> txpExonStart; // the start of each exon within its transcript
+    std::vector<uint32_t> txpLength;
+    std::vector<uint32_t> txpFamily;
+    std::vector<uint32_t> familyBegin; // the transcripts of family f are [familyBegin[f], familyBegin[f + 1])
+
+    size_t numTranscripts() const { return txpLength.size(); }
+    uint32_t exonLength(uint32_t e) const { return exonOffset[e + 1] - exonOffset[e]; }
+
+    std::string name(size_t t) const { return "SIMT" + std::to_string(t); }
+
+    // Append the sequence of [start, start + len) of transcript t to out
+    void sequence(size_t t, uint32_t start, uint32_t len, std::string& out) const {
+        out.clear();
+        uint64_t b = txpBegin[t], e = txpBegin[t + 1];
+        auto it = std::upper_bound(txpExonStart.begin() + b, txpExonStart.begin() + e, start);
+        for (uint64_t i = (it - txpExonStart.begin()) - 1; i < e and out.size() < len; ++i) {
+            uint32_t exon = txpExons[i];
+            uint32_t offset = (out.empty()) ? start - txpExonStart[i] : 0;
+            uint32_t take = std::min<uint32_t>(exonLength(exon) - offset, len - out.size());
+            out.append(exonSeqs, exonOffset[exon] + offset, take);
+        }
+    }
+};
+
+Transcriptome simulateTranscriptome(const SimulationOpts& opts, std::mt19937_64& gen) {
+    Transcriptome tome;
+    std::geometric_distribution<uint32_t> extraExons(1.0 / opts.exonsPerGene);
+    std::geometric_distribution<uint32_t> extraIsoforms(1.0 / opts.isoformsPerGene);
+    std::normal_distribution<double> exonLen(opts.exonLength, opts.exonLength / 3.0);
+    std::uniform_real_distribution<double> u01(0.0, 1.0);
+    std::uniform_int_distribution<int> base(0, 3);
+    const char bases[] = "ACGT";
+
+    tome.exonOffset.push_back(0);
+    tome.txpBegin.push_back(0);
+    // The exons of the genes of the current family
+    std::vector<uint32_t> familyExons;
+    uint32_t genesInFamily{0};
+    tome.familyBegin.push_back(0);
+
+    std::vector<uint32_t> geneExons;
+    std::vector<uint32_t> chain;
+    while (tome.numTranscripts() < opts.numTranscripts) {
+        if (genesInFamily == opts.familySize) {
+            familyExons.clear();
+            genesInFamily = 0;
+            tome.familyBegin.push_back(tome.numTranscripts());
+        }
+        // The exons of this gene: new sequences, or (with probability
+        // paralogShare) copies of the exons of an earlier gene of its family
+        uint32_t numExons = std::min<uint32_t>(1 + extraExons(gen), 255);
+        geneExons.clear();
+        for (uint32_t i = 0; i < numExons; ++i) {
+            if (!familyExons.empty() and u01(gen) < opts.paralogShare) {
+                std::uniform_int_distribution<size_t> pick(0, familyExons.size() - 1);
+                geneExons.push_back(familyExons[pick(gen)]);
+            } else {
+                uint32_t len = static_cast<uint32_t>(std::max(50.0, exonLen(gen)));
+                for (uint32_t j = 0; j < len; ++j) { tome.exonSeqs.push_back(bases[base(gen)]); }
+                tome.exonOffset.push_back(tome.exonSeqs.size());
+                geneExons.push_back(tome.exonOffset.size() - 2);
+            }
+        }
+        std::uniform_int_distribution<size_t> pickExon(0, geneExons.size() - 1);
+        // Each isoform is a (non-empty) subset of the gene's exons, in order
+        uint32_t numIsoforms = std::min<uint64_t>(1 + extraIsoforms(gen), opts.numTranscripts - tome.numTranscripts());
+        for (uint32_t iso = 0; iso < numIsoforms; ++iso) {
+            chain.clear();
+            for (auto e : geneExons) {
+                if (iso == 0 or u01(gen) < 0.7) { chain.push_back(e); }
+            }
+            if (chain.empty()) { chain.push_back(geneExons[pickExon(gen)]); }
+            uint32_t len{0};
+            for (auto e : chain) {
+                tome.txpExons.push_back(e);
+                tome.txpExonStart.push_back(len);
+                len += tome.exonLength(e);
+            }
+            tome.txpBegin.push_back(tome.txpExons.size());
+            tome.txpLength.push_back(len);
+            tome.txpFamily.push_back(tome.familyBegin.size() - 1);
+        }
+        familyExons.insert(familyExons.end(), geneExons.begin(), geneExons.end());
+        ++genesInFamily;
+    }
+    tome.familyBegin.push_back(tome.numTranscripts());
+    return tome;
+}
+
+/**
+ * Samples the transcript of each fragment, in O(1), from a fixed
+ * distribution (Walker's alias method).
+ */
+class AliasSampler {
+    public:
+        explicit AliasSampler(const std::vector<double>& weights) :
+            prob_(weights.size()), alias_(weights.size()), pick_(0, weights.size() - 1) {
+            double total{0.0};
+            for (auto w : weights) { total += w; }
+            size_t n = weights.size();
+            std::vector<double> scaled(n);
+            std::vector<uint32_t> small, large;
+            for (size_t i = 0; i < n; ++i) {
+                scaled[i] = weights[i] * n / total;
+                (scaled[i] < 1.0 ? small : large).push_back(i);
+            }
+            while (!small.empty() and !large.empty()) {
+                uint32_t s = small.back(); small.pop_back();
+                uint32_t l = large.back();
+                prob_[s] = scaled[s];
+                alias_[s] = l;
+                scaled[l] -= (1.0 - scaled[s]);
+                if (scaled[l] < 1.0) { large.pop_back(); small.push_back(l); }
+            }
+            for (auto i : large) { prob_[i] = 1.0; alias_[i] = i; }
+            for (auto i : small) { prob_[i] = 1.0; alias_[i] = i; }
+        }
+
+        template <typename GenT>
+        inline uint32_t operator()(GenT& gen) {
+            uint32_t i = pick_(gen);
+            return (u01_(gen) < prob_[i]) ? i : alias_[i];
+        }
+
+    private:
+        std::vector<double> prob_;
+        std::vector<uint32_t> alias_;
+        std::uniform_int_distribution<uint32_t> pick_;
+        std::uniform_real_distribution<double> u01_{0.0, 1.0};
+};
+
+struct LabelHash {
+    size_t operator()(const std::vector<uint32_t>& v) const {
+        uint64_t h{1469598103934665603ULL};
+        for (auto x : v) { h = (h ^ x) * 1099511628211ULL; }
+        return h;
+    }
+};
+
+/**
+ * The equivalence classes of the fragments.  The class of a fragment
+ * depends only on its transcript and the first and last exons (of that
+ * transcript) that it overlaps, so it is computed once for each such
+ * triple and cached.
+ */
+class EqClassCounter {
+    public:
+        EqClassCounter(const Transcriptome& tome, double spuriousRate) :
+            tome_(tome), spuriousRate_(spuriousRate), pickTranscript_(0, tome.numTranscripts() - 1) {}
+
+        template <typename GenT>
+        void add(uint32_t t, uint32_t start, uint32_t len, GenT& gen) {
+            uint64_t b = tome_.txpBegin[t], e = tome_.txpBegin[t + 1];
+            auto startIt = tome_.txpExonStart.begin();
+            uint32_t first = (std::upper_bound(startIt + b, startIt + e, start) - startIt) - 1 - b;
+            uint32_t last = (std::upper_bound(startIt + b, startIt + e, start + len - 1) - startIt) - 1 - b;
+            uint64_t key = (static_cast<uint64_t>(t) << 16) | (first << 8) | last;
+            auto it = cache_.find(key);
+            uint32_t classID;
+            if (it == cache_.end()) {
+                classID = classOf_(t, b + first, b + last);
+                cache_.emplace(key, classID);
+            } else {
+                classID = it->second;
+            }
+            if (spuriousRate_ > 0.0 and u01_(gen) < spuriousRate_) {
+                label_ = labels_[classID];
+                uint32_t numSpurious = (u01_(gen) < 0.5) ? 1 : 2;
+                for (uint32_t i = 0; i < numSpurious; ++i) { label_.push_back(pickTranscript_(gen)); }
+                std::sort(label_.begin(), label_.end());
+                label_.erase(std::unique(label_.begin(), label_.end()), label_.end());
+                classID = classOfLabel_();
+            }
+            ++counts_[classID];
+        }
+
+        // The number of classes that hold at least one fragment
+        size_t numClasses() const {
+            return std::count_if(counts_.begin(), counts_.end(), [](uint64_t c) { return c > 0; });
+        }
+
+        bool write(const boost::filesystem::path& path) {
+            std::vector<std::string> names;
+            for (size_t t = 0; t < tome_.numTranscripts(); ++t) { names.push_back(tome_.name(t)); }
+            BinaryEqClassWriter writer(names, true);
+            std::vector<double> weights;
+            for (size_t c = 0; c < labels_.size(); ++c) {
+                if (counts_[c] == 0) { continue; }
+                // The fragments are error-free, so their auxiliary weights are
+                // equal; the effective lengths are applied, from truth.tsv, by
+                // the consumer, as they are for the dumps of salmon quant
+                weights.assign(labels_[c].size(), 1.0 / labels_[c].size());
+                writer.add(labels_[c], weights.begin(), counts_[c]);
+            }
+            return writer.write(path);
+        }
+
+    private:
+        // The transcripts of the family of t that contain the chain of exons [first, last] of t
+        uint32_t classOf_(uint32_t t, uint64_t first, uint64_t last) {
+            uint32_t f = tome_.txpFamily[t];
+            uint64_t chainLen = last - first + 1;
+            auto chainBegin = tome_.txpExons.begin() + first;
+            label_.clear();
+            for (uint32_t o = tome_.familyBegin[f]; o < tome_.familyBegin[f + 1]; ++o) {
+                auto ob = tome_.txpExons.begin() + tome_.txpBegin[o];
+                auto oe = tome_.txpExons.begin() + tome_.txpBegin[o + 1];
+                if (std::search(ob, oe, chainBegin, chainBegin + chainLen) != oe) { label_.push_back(o); }
+            }
+            return classOfLabel_();
+        }
+
+        // The id of the class whose label is label_
+        uint32_t classOfLabel_() {
+            auto it = classIDs_.find(label_);
+            if (it != classIDs_.end()) { return it->second; }
+            uint32_t id = labels_.size();
+            classIDs_.emplace(label_, id);
+            labels_.push_back(label_);
+            counts_.push_back(0);
+            return id;
+        }
+
+        const Transcriptome& tome_;
+        double spuriousRate_;
+        std::uniform_int_distribution<uint32_t> pickTranscript_;
+        std::uniform_real_distribution<double> u01_{0.0, 1.0};
+        std::unordered_map<uint64_t, uint32_t> cache_;
+        std::unordered_map<std::vector<uint32_t>, uint32_t, LabelHash> classIDs_;
+        std::vector<std::vector<uint32_t>> labels_;
+        std::vector<uint64_t> counts_;
+        std::vector<uint32_t> label_;
+};
+
+void reverseComplement(const std::string& s, std::string& rc) {
+    rc.resize(s.size());
+    for (size_t i = 0; i < s.size(); ++i) {
+        char c = s[s.size() - 1 - i];
+        rc[i] = (c == 'A') ? 'T' : (c == 'C') ? 'G' : (c == 'G') ? 'C' : 'A';
+    }
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    namespace po = boost::program_options;
+    namespace bfs = boost::filesystem;
+
+    SimulationOpts opts;
+    po::options_description desc("salmon_simulate options");
+    desc.add_options()
+    ("help,h", "Produce help message")
+    ("output,o", po::value<std::string>(&opts.outputDir)->required(), "The directory to which the data set is written")
+    ("format", po::value<std::string>(&opts.format)->default_value(opts.format),
+                        "What to write for the fragments: \"fastq\" (paired-end reads) or \"eqclasses\" (eq_classes.bin)")
+    ("numTranscripts", po::value<uint64_t>(&opts.numTranscripts)->default_value(opts.numTranscripts), "The number of transcripts")
+    ("numFragments", po::value<uint64_t>(&opts.numFragments)->default_value(opts.numFragments), "The number of fragments")
+    ("isoformsPerGene", po::value<double>(&opts.isoformsPerGene)->default_value(opts.isoformsPerGene),
+                        "The mean number of isoforms of a gene")
+    ("exonsPerGene", po::value<double>(&opts.exonsPerGene)->default_value(opts.exonsPerGene),
+                        "The mean number of exons of a gene")
+    ("exonLength", po::value<double>(&opts.exonLength)->default_value(opts.exonLength), "The mean length of an exon")
+    ("familySize", po::value<uint32_t>(&opts.familySize)->default_value(opts.familySize),
+                        "The number of genes of a (paralogous) family")
+    ("paralogShare", po::value<double>(&opts.paralogShare)->default_value(opts.paralogShare),
+                        "The probability that an exon of a gene is shared with an earlier gene of its family")
+    ("fracExpressed", po::value<double>(&opts.fracExpressed)->default_value(opts.fracExpressed),
+                        "The fraction of the transcripts that are expressed")
+    ("spuriousRate", po::value<double>(&opts.spuriousRate)->default_value(opts.spuriousRate),
+                        "The fraction of the fragments whose equivalence class also holds one or two "
+                        "random transcripts (eqclasses)")
+    ("readLength", po::value<uint32_t>(&opts.readLength)->default_value(opts.readLength), "The length of each read (fastq)")
+    ("fragLengthMean", po::value<double>(&opts.fragLengthMean)->default_value(opts.fragLengthMean), "The mean fragment length")
+    ("fragLengthSD", po::value<double>(&opts.fragLengthSD)->default_value(opts.fragLengthSD),
+                        "The standard deviation of the fragment length")
+    ("seed", po::value<uint64_t>(&opts.seed)->default_value(opts.seed), "The seed of the simulation")
+    ;
+
+    try {
+        po::variables_map vm;
+        po::store(po::command_line_parser(argc, argv).options(desc).run(), vm);
+        if (vm.count("help")) {
+            std::cout << desc << std::endl;
+            return 0;
+        }
+        po::notify(vm);
+    } catch (po::error& e) {
+        std::cerr << "exception : [" << e.what() << "]. Exiting.\n";
+        std::exit(1);
+    }
+    bool writeFastq = (opts.format == "fastq");
+    if (!writeFastq and opts.format != "eqclasses") {
+        std::cerr << "--format must be \"fastq\" or \"eqclasses\", not \"" << opts.format << "\"\n";
+        std::exit(1);
+    }
+    if (opts.numTranscripts == 0 or opts.numTranscripts > (1ULL << 32) or opts.familySize == 0 or
+        opts.isoformsPerGene < 1.0 or opts.exonsPerGene < 1.0) {
+        std::cerr << "--numTranscripts must be in [1, 2^32), and --familySize, --isoformsPerGene "
+                     "and --exonsPerGene must be at least 1\n";
+        std::exit(1);
+    }
+
+    bfs::path outDir(opts.outputDir);
+    boost::system::error_code ec;
+    bfs::create_directories(outDir, ec);
+
+    std::mt19937_64 gen(opts.seed);
+    std::cerr << "simulating " << opts.numTranscripts << " transcripts\n";
+    auto tome = simulateTranscriptome(opts, gen);
+    size_t numTxps = tome.numTranscripts();
+
+    {
+        std::ofstream fa((outDir / "transcripts.fasta").string());
+        std::string seq;
+        for (size_t t = 0; t < numTxps; ++t) {
+            tome.sequence(t, 0, tome.txpLength[t], seq);
+            fa << '>' << tome.name(t) << '\n';
+            for (size_t i = 0; i < seq.size(); i += 70) { fa.write(seq.data() + i, std::min<size_t>(70, seq.size() - i)) << '\n'; }
+        }
+        if (!fa.good()) {
+            std::cerr << "could not write " << (outDir / "transcripts.fasta").string() << '\n';
+            std::exit(1);
+        }
+    }
+
+    // The abundance of each transcript; the fragments are drawn in
+    // proportion to abundance * effective length
+    std::lognormal_distribution<double> abundance(0.0, 2.0);
+    std::uniform_real_distribution<double> u01(0.0, 1.0);
+    std::vector<double> effLengths(numTxps), fragWeights(numTxps);
+    uint32_t minFragLength = writeFastq ? opts.readLength : 1;
+    for (size_t t = 0; t < numTxps; ++t) {
+        effLengths[t] = std::max(1.0, tome.txpLength[t] - opts.fragLengthMean + 1.0);
+        bool expressed = (u01(gen) < opts.fracExpressed) and tome.txpLength[t] >= minFragLength;
+        fragWeights[t] = expressed ? abundance(gen) * effLengths[t] : 0.0;
+    }
+    if (std::all_of(fragWeights.begin(), fragWeights.end(), [](double w) { return w == 0.0; })) {
+        std::cerr << "none of the transcripts is expressed; try a larger --fracExpressed\n";
+        std::exit(1);
+    }
+    AliasSampler pickTranscript(fragWeights);
+    std::normal_distribution<double> fragLength(opts.fragLengthMean, opts.fragLengthSD);
+
+    std::vector<uint64_t> trueCounts(numTxps, 0);
+    std::unique_ptr<EqClassCounter> eqCounter(writeFastq ? nullptr : new EqClassCounter(tome, opts.spuriousRate));
+    std::ofstream r1, r2;
+    if (writeFastq) {
+        r1.open((outDir / "reads_1.fastq").string());
+        r2.open((outDir / "reads_2.fastq").string());
+    }
+    std::string frag, left, right, qual(opts.readLength, 'I');
+
+    std::cerr << "simulating " << opts.numFragments << " fragments\n";
+    for (uint64_t f = 0; f < opts.numFragments; ++f) {
+        uint32_t t = pickTranscript(gen);
+        uint32_t txpLen = tome.txpLength[t];
+        double l = std::round(fragLength(gen));
+        uint32_t len = static_cast<uint32_t>(std::min<double>(txpLen, std::max<double>(minFragLength, l)));
+        std::uniform_int_distribution<uint32_t> pickStart(0, txpLen - len);
+        uint32_t start = pickStart(gen);
+        ++trueCounts[t];
+
+        if (eqCounter) {
+            eqCounter->add(t, start, len, gen);
+        } else {
+            // An (unstranded, IU) pair: the left read from the forward
+            // strand and the right from the reverse, or vice versa
+            tome.sequence(t, start, len, frag);
+            left.assign(frag, 0, opts.readLength);
+            reverseComplement(frag.substr(len - opts.readLength), right);
+            if (u01(gen) < 0.5) { std::swap(left, right); }
+            r1 << "@sim" << f << "/1\n" << left << "\n+\n" << qual << '\n';
+            r2 << "@sim" << f << "/2\n" << right << "\n+\n" << qual << '\n';
+        }
+        if ((f + 1) % 10000000 == 0) { std::cerr << "\r" << (f + 1) << " fragments"; }
+    }
+    if (opts.numFragments >= 10000000) { std::cerr << '\n'; }
+
+    if (writeFastq) {
+        if (!r1.good() or !r2.good()) {
+            std::cerr << "could not write the reads\n";
+            std::exit(1);
+        }
+    } else {
+        std::cerr << "writing " << eqCounter->numClasses() << " equivalence classes\n";
+        if (!eqCounter->write(outDir / "eq_classes.bin")) {
+            std::cerr << "could not write " << (outDir / "eq_classes.bin").string() << '\n';
+            std::exit(1);
+        }
+    }
+
+    std::ofstream truth((outDir / "truth.tsv").string());
+    truth << "Name\tLength\tEffectiveLength\tNumReads\n";
+    for (size_t t = 0; t < numTxps; ++t) {
+        truth << tome.name(t) << '\t' << tome.txpLength[t] << '\t' << effLengths[t] << '\t' << trueCounts[t] << '\n';
+    }
+    if (!truth.good()) {
+        std::cerr << "could not write " << (outDir / "truth.tsv").string() << '\n';
+        std::exit(1);
+    }
+    std::cerr << "wrote the data set to " << outDir.string() << '\n';
+    return 0;
+}
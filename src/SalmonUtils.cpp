@@ -1,5 +1,8 @@
 #include <boost/thread/thread.hpp>
 #include <boost/filesystem.hpp>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
 #include <algorithm>
 #include <iostream>
 #include <tuple>
@@ -8,8 +11,10 @@
 #include <vector>
 #include <fstream>
 #include <random>
+#include <cstring>
 #include <boost/filesystem.hpp>
 #include <boost/range/join.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
 
 #include "tbb/combinable.h"
 #include "tbb/parallel_for.h"
@@ -21,6 +26,10 @@
 #include "SalmonMath.hpp"
 #include "LibraryFormat.hpp"
 #include "ReadExperiment.hpp"
+#include "RollingKmerIndex.hpp"
+#include "TranscriptBiasTables.hpp"
+#include "BinaryQuant.hpp"
+#include "ParallelTextWriter.hpp"
 
 #include "spdlog/spdlog.h"
 
@@ -31,6 +40,7 @@
 #include "jellyfish/mer_dna.hpp"
 
 #include "TranscriptGeneMap.hpp"
+#include "TranscriptNameIndex.hpp"
 #include "GenomicFeature.hpp"
 
 namespace salmon {
@@ -251,6 +261,9 @@ namespace utils {
             tfracDenom += (transcript.projectedCounts / numMappedFrags) / refLength;
         }
 
+        std::unique_ptr<BinaryQuantWriter> binaryOutput{nullptr};
+        if (sopt.binaryQuant) { binaryOutput.reset(new BinaryQuantWriter(transcripts_.size())); }
+
         double million = 1000000.0;
         // Now posterior has the transcript fraction
         for (auto& transcript : transcripts_) {
@@ -265,8 +278,18 @@ namespace utils {
             fmt::print(output.get(), "{}\t{}\t{}\t{}\t{}\n",
                     transcript.RefName, transcript.RefLength, effLength,
                     tpm, count);
+            if (binaryOutput) {
+                binaryOutput->add(transcript.RefName, transcript.RefLength, effLength, tpm, count);
+            }
         }
 
+        if (binaryOutput) {
+            auto binaryPath = fname;
+            binaryPath.replace_extension(".bin");
+            if (!binaryOutput->write(binaryPath)) {
+                sopt.jointLog->error("could not write the binary abundances to {}", binaryPath.string());
+            }
+        }
     }
 
     template <typename ExpLib>
@@ -811,27 +834,113 @@ bool overlap( const S<T> &a, const S<T> &b ) {
 }
 
 
-TranscriptGeneMap transcriptGeneMapFromGTF(const std::string& fname, std::string key) {
+/**
+ * Extract the (transcript_id, key) attribute pairs of every record of the
+ * GTF file fname that has both.  Only the attribute column is examined,
+ * and the file (which is memory-mapped) is scanned in parallel, in chunks
+ * of whole lines.  Returns false if the file can't be read.
+ */
+static bool scanGTFAttributes(const std::string& fname, const std::string& key,
+                              std::vector<std::pair<std::string, std::string>>& pairs) {
+    boost::iostreams::mapped_file_source file;
+    try {
+        file.open(fname);
+    } catch (std::exception&) {
+        return false;
+    }
+    if (!file.is_open()) { return false; }
+    const char* data = file.data();
+    size_t size = file.size();
+
+    // The value of the attribute name in the attribute column [b, e), which
+    // is either quoted or runs up to the next ';'
+    auto attribute = [](const char* b, const char* e, const std::string& name,
+                        std::string& value) -> bool {
+        const char* p = b;
+        while (p < e) {
+            while (p < e and (*p == ' ' or *p == ';')) { ++p; }
+            const char* nameEnd = p;
+            while (nameEnd < e and *nameEnd != ' ' and *nameEnd != ';') { ++nameEnd; }
+            const char* v = nameEnd;
+            while (v < e and *v == ' ') { ++v; }
+            const char* valueEnd{nullptr};
+            if (v < e and *v == '"') {
+                ++v;
+                valueEnd = static_cast<const char*>(std::memchr(v, '"', e - v));
+                if (!valueEnd) { valueEnd = e; }
+            } else {
+                valueEnd = v;
+                while (valueEnd < e and *valueEnd != ';') { ++valueEnd; }
+            }
+            if (static_cast<size_t>(nameEnd - p) == name.size() and
+                std::equal(name.begin(), name.end(), p)) {
+                value.assign(v, valueEnd);
+                return true;
+            }
+            p = valueEnd;
+            while (p < e and *p != ';') { ++p; }
+        }
+        return false;
+    };
 
-    using std::unordered_set;
-    using std::unordered_map;
-    using std::vector;
-    using std::tuple;
-    using std::string;
-    using std::get;
+    constexpr size_t chunkSize = 1 << 22;
+    size_t numChunks = (size + chunkSize - 1) / chunkSize;
+    std::vector<std::vector<std::pair<std::string, std::string>>> chunkPairs(numChunks);
+    const std::string transcriptKey("transcript_id");
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, numChunks, 1),
+        [&](const tbb::blocked_range<size_t>& r) -> void {
+            std::string transcript;
+            std::string value;
+            for (size_t c = r.begin(); c < r.end(); ++c) {
+                // Each chunk handles the lines that start within it
+                const char* p = data + c * chunkSize;
+                const char* chunkEnd = data + std::min(size, (c + 1) * chunkSize);
+                const char* fileEnd = data + size;
+                if (c > 0 and *(p - 1) != '\n') {
+                    p = static_cast<const char*>(std::memchr(p, '\n', fileEnd - p));
+                    p = p ? p + 1 : fileEnd;
+                }
+                auto& out = chunkPairs[c];
+                while (p < chunkEnd) {
+                    const char* lineEnd = static_cast<const char*>(std::memchr(p, '\n', fileEnd - p));
+                    if (!lineEnd) { lineEnd = fileEnd; }
+                    if (*p != '#') {
+                        // The attributes are the 9th (tab-separated) column
+                        const char* attrs = p;
+                        for (int col = 0; col < 8 and attrs; ++col) {
+                            attrs = static_cast<const char*>(std::memchr(attrs, '\t', lineEnd - attrs));
+                            if (attrs) { ++attrs; }
+                        }
+                        if (attrs and attribute(attrs, lineEnd, transcriptKey, transcript) and
+                            attribute(attrs, lineEnd, key, value)) {
+                            out.emplace_back(transcript, value);
+                        }
+                    }
+                    p = lineEnd + 1;
+                }
+            }
+        });
+
+    size_t numPairs{0};
+    for (auto& cp : chunkPairs) { numPairs += cp.size(); }
+    pairs.reserve(numPairs);
+    for (auto& cp : chunkPairs) {
+        std::move(cp.begin(), cp.end(), std::back_inserter(pairs));
+    }
+    return true;
+}
 
+/**
+ * Extract the (transcript_id, key) pairs of the transcripts of fname
+ * with the gff library (which also handles GFF3).
+ */
+static void readGFFAttributes(const std::string& fname, const std::string& key,
+                              std::vector<std::pair<std::string, std::string>>& pairs) {
     // Use GffReader to read the file
     GffReader reader(const_cast<char*>(fname.c_str()));
     // Remember the optional attributes
     reader.readAll(true);
 
-    struct TranscriptKeyPair {
-        const char* transcript_id;
-        const char* key;
-        TranscriptKeyPair(const char* t, const char* k) :
-            transcript_id(t), key(k) {}
-    };
-
     // The user can group transcripts by gene_id, gene_name, or
     // an optinal attribute that they provide as a string.
     enum class TranscriptKey { GENE_ID, GENE_NAME, DYNAMIC };
@@ -849,7 +958,6 @@ TranscriptGeneMap transcriptGeneMapFromGTF(const std::string& fname, std::string
     // Iterate over all transcript features and build the
     // transcript <-> key vector.
     auto nfeat = reader.gflst.Count();
-    std::vector<TranscriptKeyPair> feats;
     for (int i=0; i < nfeat; ++i) {
         auto f = reader.gflst[i];
         if (f->isTranscript()) {
@@ -865,9 +973,100 @@ TranscriptGeneMap transcriptGeneMapFromGTF(const std::string& fname, std::string
                     keyStr = f->getAttr(key.c_str());
                     break;
             }
-            feats.emplace_back(f->getID(), keyStr);
+            pairs.emplace_back(f->getID(), keyStr);
         }
     }
+}
+
+/**
+ * The transcript to gene maps built from GTF files are cached (as
+ * <gtf>.<key>.t2g), along with the path, size and modification time of
+ * the GTF from which they were built, so that later runs with the same
+ * annotation can load the map rather than re-scan the GTF.
+ */
+static boost::filesystem::path geneMapCachePath(const std::string& fname, const std::string& key) {
+    return boost::filesystem::path(fname + "." + key + ".t2g");
+}
+
+struct GeneMapCacheKey {
+    static constexpr uint32_t currentVersion = 1;
+    uint32_t version{currentVersion};
+    std::string gtfPath;
+    uint64_t gtfSize{0};
+    int64_t gtfModTime{0};
+    std::string key;
+
+    GeneMapCacheKey() {}
+    GeneMapCacheKey(const std::string& fname, const std::string& keyIn) : key(keyIn) {
+        namespace bfs = boost::filesystem;
+        boost::system::error_code ec;
+        gtfPath = bfs::absolute(fname).string();
+        gtfSize = bfs::file_size(fname, ec);
+        gtfModTime = static_cast<int64_t>(bfs::last_write_time(fname, ec));
+    }
+
+    bool operator==(const GeneMapCacheKey& o) const {
+        return version == o.version and gtfPath == o.gtfPath and gtfSize == o.gtfSize and
+               gtfModTime == o.gtfModTime and key == o.key;
+    }
+
+    template <typename Archive>
+    void serialize(Archive& ar) { ar(version, gtfPath, gtfSize, gtfModTime, key); }
+};
+
+static bool loadCachedGeneMap(const std::string& fname, const std::string& key,
+                              TranscriptGeneMap& tgm) {
+    auto cachePath = geneMapCachePath(fname, key);
+    if (!boost::filesystem::exists(cachePath)) { return false; }
+    try {
+        std::ifstream ifs(cachePath.string(), std::ios::binary);
+        cereal::BinaryInputArchive iarchive(ifs);
+        GeneMapCacheKey stored;
+        iarchive(stored);
+        if (!(stored == GeneMapCacheKey(fname, key))) { return false; }
+        iarchive(tgm);
+    } catch (std::exception&) {
+        return false;
+    }
+    return true;
+}
+
+static void writeCachedGeneMap(const std::string& fname, const std::string& key,
+                               TranscriptGeneMap& tgm) {
+    namespace bfs = boost::filesystem;
+    auto cachePath = geneMapCachePath(fname, key);
+    bfs::path tmpPath(cachePath.string() + ".tmp");
+    {
+        std::ofstream ofs(tmpPath.string(), std::ios::binary);
+        if (!ofs.good()) { return; }
+        cereal::BinaryOutputArchive oarchive(ofs);
+        GeneMapCacheKey cacheKey(fname, key);
+        oarchive(cacheKey, tgm);
+    }
+    boost::system::error_code ec;
+    bfs::rename(tmpPath, cachePath, ec);
+    if (ec) { bfs::remove(tmpPath, ec); }
+}
+
+TranscriptGeneMap transcriptGeneMapFromGTF(const std::string& fname, std::string key) {
+
+    using std::unordered_map;
+    using std::string;
+
+    TranscriptGeneMap cachedMap;
+    if (loadCachedGeneMap(fname, key, cachedMap)) {
+        std::cerr << "Loaded the transcript to gene map of " << fname << " from "
+                  << geneMapCachePath(fname, key).string() << "\n";
+        return cachedMap;
+    }
+
+    // The (transcript, key) pair of each record.  If the fast scan finds
+    // none (e.g. the file is GFF3 rather than GTF), use the gff library
+    std::vector<std::pair<string, string>> feats;
+    if (!scanGTFAttributes(fname, key, feats) or feats.empty()) {
+        feats.clear();
+        readGFFAttributes(fname, key, feats);
+    }
 
     // Given the transcript <-> key vector, build the
     // TranscriptGeneMap.
@@ -876,29 +1075,26 @@ TranscriptGeneMap transcriptGeneMapFromGTF(const std::string& fname, std::string
     NameVector transcriptNames;
     NameVector geneNames;
 
-    // holds the mapping from transcript ID to gene ID
-    IndexVector t2gUnordered;
     // holds the set of gene IDs
     unordered_map<string, size_t> geneNameToID;
 
-    // To read the input and assign ids
-    size_t transcriptCounter = 0;
+    // To assign ids
     size_t geneCounter = 0;
-    string transcript;
-    string gene;
 
-    std::sort( feats.begin(), feats.end(),
-    []( const TranscriptKeyPair & a, const TranscriptKeyPair & b) -> bool {
-        return std::strcmp(a.transcript_id, b.transcript_id) < 0;
+    // The records of a transcript keep their order in the file, so each
+    // transcript takes the key of its first record
+    std::stable_sort( feats.begin(), feats.end(),
+    []( const std::pair<string, string>& a, const std::pair<string, string>& b) -> bool {
+        return a.first < b.first;
     } );
 
-    std::string currentTranscript = "";
+    bool first{true};
     for ( auto & feat : feats ) {
 
-        std::string gene(feat.key);
-        std::string transcript(feat.transcript_id);
+        const string& transcript = feat.first;
+        const string& gene = feat.second;
 
-        if ( transcript != currentTranscript ) {
+        if ( first or transcript != transcriptNames.back() ) {
             auto geneIt = geneNameToID.find(gene);
             size_t geneID = 0;
 
@@ -915,14 +1111,14 @@ TranscriptGeneMap transcriptGeneMapFromGTF(const std::string& fname, std::string
 
             transcriptNames.push_back(transcript);
             t2g.push_back(geneID);
-
-            //++transcriptID;
-            currentTranscript = transcript;
+            first = false;
         }
 
     }
 
-    return TranscriptGeneMap(transcriptNames, geneNames, t2g);
+    TranscriptGeneMap tgm(transcriptNames, geneNames, t2g);
+    writeCachedGeneMap(fname, key, tgm);
+    return tgm;
 
 }
 
@@ -1094,7 +1290,8 @@ std::vector<std::string> split(const std::string& str, int delimiter(int) = ::is
     return result;
 }
 
-std::vector<int32_t> samplesFromLogPMF(FragmentLengthDistribution* fld, int32_t numSamples) {
+std::vector<int32_t> samplesFromLogPMF(FragmentLengthDistribution* fld, int32_t numSamples,
+                                       uint32_t seed) {
     std::vector<double> logPMF;
     size_t minVal;
     size_t maxVal;
@@ -1115,8 +1312,7 @@ std::vector<int32_t> samplesFromLogPMF(FragmentLengthDistribution* fld, int32_t
     }
 
     // generate samples
-    std::random_device rd;
-    std::mt19937 gen(rd());
+    std::mt19937 gen(seed);
     std::discrete_distribution<int32_t> dist(pmf.begin(), pmf.end());
 
     std::vector<int32_t> samples(pmf.size());
@@ -1134,14 +1330,18 @@ std::vector<int32_t> samplesFromLogPMF(FragmentLengthDistribution* fld, int32_t
  * based on the one taken in Kallisto, and seems to work well given its 
  * low computational requirements.  Here, we also consider fragment-GC bias
  * which uses a novel method extending the idea of adjusting the effective
- * lengths.
+ * lengths.  If `cache` is provided, the expected bias distributions are
+ * updated incrementally from those of the previous call (see
+ * EffectiveLengthCache).
  */
 template <typename AbundanceVecT, typename ReadExpT>
 Eigen::VectorXd updateEffectiveLengths(
         SalmonOpts& sopt,
         ReadExpT& readExp,
         Eigen::VectorXd& effLensIn,
-        AbundanceVecT& alphas) {
+        AbundanceVecT& alphas,
+        EffectiveLengthCache* cache,
+        ExpectedBiasDists* expectedOut) {
 
     using std::vector;
     using BlockedIndexRange =  tbb::blocked_range<size_t>;
@@ -1170,17 +1370,25 @@ Eigen::VectorXd updateEffectiveLengths(
     int32_t K = static_cast<int32_t>(readBias.getK());
     double readNormFactor = static_cast<double>(readBias.totalCount());
 
-    // The *expected* biases from sequence-specific effects
-    auto& transcriptKmerDist = readExp.expectedSeqBias();
+    // The indices of the k-mers of a transcript, read from the tables
+    // precomputed when the index was built, if it has them
+    auto kmerIndicesOf = [K](const Transcript& txp, const char* tseq, int32_t refLen,
+                             std::vector<uint32_t>& fw, std::vector<uint32_t>& rc) -> void {
+        if (txp.biasKmers()) {
+            TranscriptBiasTables::indicesOf(txp.biasKmers(), refLen, K, fw, rc);
+        } else {
+            RollingKmerIndex::indicesOf(tseq, refLen, K, fw, rc);
+        }
+    };
 
-    // Reset the transcript (normalized) counts
-    transcriptKmerDist.clear();
-    transcriptKmerDist.resize(constExprPow(4, K), 0.0);
+    // The *expected* biases from sequence-specific effects (stored in
+    // readExp, or expectedOut, once computed)
+    std::vector<double> transcriptKmerDist(constExprPow(4, K), 0.0);
 
     FragmentLengthDistribution& fld = *(readExp.fragmentLengthDistribution());
 
     // The *expected* biases from GC effects
-    auto& transcriptGCDist = readExp.expectedGCBias();
+    std::vector<double> transcriptGCDist(101, 0.0);
     auto& gcCounts = readExp.observedGC();
     double readGCNormFactor = 0.0;
     int32_t fldLow{0};
@@ -1189,9 +1397,6 @@ Eigen::VectorXd updateEffectiveLengths(
     std::vector<double> cdf(fld.maxVal()+1, 0.0);
     std::vector<double> pdf(fld.maxVal()+1, 0.0);
     {
-        transcriptGCDist.clear();
-        transcriptGCDist.resize(101, 0.0);
-
         bool lb{false};
         bool ub{false};
         for (size_t i = 0; i <= fld.maxVal(); ++i) {
@@ -1214,11 +1419,50 @@ Eigen::VectorXd updateEffectiveLengths(
         }
     }
     
+    // The fragment lengths considered by the GC bias model, and the
+    // probability mass that each of them represents (each covers gcSamp
+    // lengths of the fragment length distribution).
+    std::vector<double> gcFragLens;
+    std::vector<double> gcFragMass;
+    if (gcBiasCorrect) {
+        size_t sp = static_cast<size_t>((fldLow > 0) ? fldLow - 1 : 0);
+        double prevFLMass = cdf[sp];
+        for (int32_t fl = fldLow; fl <= fldHigh; fl += gcSamp) {
+            if (fl > 0) {
+                gcFragLens.push_back(static_cast<double>(fl));
+                gcFragMass.push_back(cdf[fl] - prevFLMass);
+            }
+            prevFLMass = cdf[fl];
+        }
+    }
+    int32_t gcFragLenLow = (fldLow > 0) ? fldLow : static_cast<int32_t>(gcSamp);
+    int32_t numGCFragLens = static_cast<int32_t>(gcFragLens.size());
+
     // Make this const so there are no shenanigans
     const auto& transcripts = readExp.transcripts();
 
-    // The effective lengths adjusted for bias
-    Eigen::VectorXd effLensOut(effLensIn.size());
+    if (cache and cache->weights.size() != transcripts.size()) {
+        cache->weights.assign(transcripts.size(), 0.0);
+        cache->expectSeq.assign(constExprPow(4, 6), 0.0);
+        cache->expectGC.assign(101, 0.0);
+    }
+
+    // The transcripts that can contribute to the expected distributions, or
+    // have their effective lengths corrected: those with non-trivial
+    // expression, and (when updating) those whose previous contribution must
+    // be withdrawn.  Usually a small fraction of the transcriptome is
+    // expressed, so the loops below run over this set rather than over
+    // every transcript (which also balances the work among the threads).
+    std::vector<uint32_t> activeTxps;
+    for (size_t i = 0; i < transcripts.size(); ++i) {
+        if (alphas[i] >= minAlpha or (cache and cache->weights[i] != 0.0)) {
+            activeTxps.push_back(i);
+        }
+    }
+
+    // The effective lengths adjusted for bias; the effective lengths of the
+    // inactive transcripts are left as they were
+    Eigen::VectorXd effLensOut = effLensIn;
 
     // How much to cut off
     int32_t trunc = K;
@@ -1247,14 +1491,22 @@ Eigen::VectorXd updateEffectiveLengths(
      */
     tbb::combinable<CombineableBiasParams> expectedDist;
 
-    tbb::parallel_for(BlockedIndexRange(size_t(0), size_t(transcripts.size())),
-            [&]( const BlockedIndexRange& range) -> void {
+    // Add the expected bias terms of the active transcripts in range to local
+    auto accumulateExpected = [&](const BlockedIndexRange& range, CombineableBiasParams& local) -> void {
 
-            auto& expectSeq = expectedDist.local().expectSeq;
-            auto& expectGC = expectedDist.local().expectGC;
+            auto& expectSeq = local.expectSeq;
+            auto& expectGC = local.expectGC;
+            // The cumulative GC counts of the current transcript, and
+            // the GC bins of the fragments starting at a position
+            std::vector<double> gcCounts;
+            std::vector<int32_t> gcBins(numGCFragLens, 0);
+            // The indices of the k-mers of the current transcript
+            std::vector<uint32_t> kmersFW;
+            std::vector<uint32_t> kmersRC;
 
-            // For each index in the equivalence class vector
-            for (auto it : boost::irange(range.begin(), range.end())) {
+            // For each active transcript
+            for (auto ai : boost::irange(range.begin(), range.end())) {
+                auto it = activeTxps[ai];
 
                 // Get the transcript
                 auto& txp = transcripts[it];
@@ -1267,21 +1519,32 @@ Eigen::VectorXd updateEffectiveLengths(
                 // The difference between the actual and effective length
                 int32_t unprocessedLen = std::max(0, refLen - elen);
 
-                // Skip transcripts with trivial expression or that are too
-                // short
-                if (alphas[it] < minAlpha or unprocessedLen <= 0) {
+                // Transcripts with trivial expression or that are too
+                // short contribute nothing
+                double weight = (alphas[it] < minAlpha or unprocessedLen <= 0) ?
+                    0.0 : (alphas[it]/effLensIn(it));
+
+                // If we are updating the previous distributions, this
+                // transcript only contributes the change in its weight
+                if (cache) {
+                    double prevWeight = cache->weights[it];
+                    double diff = weight - prevWeight;
+                    if (std::abs(diff) <= cache->relTolerance * std::max(weight, prevWeight)) {
+                        continue;
+                    }
+                    cache->weights[it] = weight;
+                    weight = diff;
+                } else if (weight == 0.0) {
                     continue;
                 }
 
-                // Otherwise, proceed giving this transcript the following weight
-                double weight = (alphas[it]/effLensIn(it));
-
                 // This transcript's sequence
                 const char* tseq = txp.Sequence();
+                if (gcBiasCorrect) { txp.fillGCCounts(gcCounts); }
+                if (seqBiasCorrect) { kmerIndicesOf(txp, tseq, refLen, kmersFW, kmersRC); }
 
                 // From the start of the transcript up until the last valid
                 // kmer.
-                bool firstKmer{true};
                 uint32_t idxFW{0};
                 uint32_t idxRC{0};
 
@@ -1295,12 +1558,8 @@ Eigen::VectorXd updateEffectiveLengths(
                         // fragment start until 3 bases after the fragment start (6 bases in total)
                         // the fragment start position is actually the k-mer start position + 2.
                         fragStartPos = kmerStartPos + 2;
-                        int32_t kmerEndPos = kmerStartPos + K - 1; // -1 because pos is *inclusive*
-                        idxFW = firstKmer ? indexForKmer(tseq, K, Direction::FORWARD) :
-                            nextKmerIndex(idxFW, tseq[kmerEndPos], K, Direction::FORWARD);
-                        idxRC = firstKmer ? indexForKmer(tseq, K, Direction::REVERSE_COMPLEMENT) :
-                            nextKmerIndex(idxRC, tseq[kmerEndPos], K, Direction::REVERSE_COMPLEMENT);
-                        firstKmer = false;
+                        idxFW = kmersFW[kmerStartPos];
+                        idxRC = kmersRC[kmerStartPos];
 
                         int32_t maxFragLenFW = refLen - fragStartPos;
                         int32_t maxFragLenRC = fragStartPos + 1;
@@ -1314,32 +1573,61 @@ Eigen::VectorXd updateEffectiveLengths(
 
                     // fragment-GC bias
                     if (gcBiasCorrect) {
-                        size_t sp = static_cast<size_t>((fldLow > 0) ? fldLow - 1 : 0);
-                        double prevFLMass = cdf[sp];
                         int32_t fragStart = fragStartPos;
-                        for (int32_t fl = fldLow; fl <= fldHigh; fl += gcSamp) {
-                            int32_t fragEnd = fragStart + fl - 1;
-                            if (fragEnd < refLen) {
-                                // The GC fraction for this putative fragment
-                                auto gcFrac = txp.gcFrac(fragStart, fragEnd);
-                                expectGC[gcFrac] += weight * (cdf[fl] - prevFLMass);
-                                prevFLMass = cdf[fl];
-                            } else { break; } // no more valid positions
-                        } // end: for each fragment length
+                        // The fragments [fragStart, fragStart + fl - 1] that fit
+                        // on the transcript
+                        int32_t maxFragLen = refLen - fragStart;
+                        int32_t numFrags = (maxFragLen < gcFragLenLow) ? 0 :
+                            std::min(numGCFragLens, (maxFragLen - gcFragLenLow) / static_cast<int32_t>(gcSamp) + 1);
+                        // The GC fraction of each putative fragment (computed as
+                        // by Transcript::gcFrac), and then its contribution
+                        if (numFrags > 0) {
+                            double cs = gcCounts[fragStart];
+                            const double* ce = gcCounts.data() + fragStart + gcFragLenLow - 1;
+                            for (int32_t j = 0; j < numFrags; ++j) {
+                                gcBins[j] = std::lrint((100.0 * (ce[j * gcSamp] - cs)) / gcFragLens[j]);
+                            }
+                            for (int32_t j = 0; j < numFrags; ++j) {
+                                expectGC[gcBins[j]] += weight * gcFragMass[j];
+                            }
+                        }
                     } // end: fragment GC bias
                 } // end: for every fragment start position 
             } // end for each transcript
-
-        }// end tbb for function
-        );
-
-    /**
-     * The local bias terms from each thread can be combined
-     * via simple summation.  Here, we combine the locally-computed
-     * bias terms.
-     */
-    auto combinedBiasParams = expectedDist.combine(
-	    [](const CombineableBiasParams& p1,
+        };
+
+    CombineableBiasParams combinedBiasParams;
+    if (sopt.deterministic) {
+        // A fixed number of blocks of transcripts, each with its own terms,
+        // which are summed in order, so that the sums don't depend on the
+        // number of threads
+        const size_t numBlocks = std::min(activeTxps.size(), size_t(64));
+        std::vector<CombineableBiasParams> blockDists(numBlocks);
+        tbb::parallel_for(BlockedIndexRange(size_t(0), numBlocks, 1),
+                [&](const BlockedIndexRange& blocks) -> void {
+                for (auto b : boost::irange(blocks.begin(), blocks.end())) {
+                    accumulateExpected(BlockedIndexRange((b * activeTxps.size()) / numBlocks,
+                                                         ((b + 1) * activeTxps.size()) / numBlocks),
+                                       blockDists[b]);
+                }
+        });
+        for (auto& d : blockDists) {
+            for (size_t i = 0; i < d.expectSeq.size(); ++i) { combinedBiasParams.expectSeq[i] += d.expectSeq[i]; }
+            for (size_t i = 0; i < d.expectGC.size(); ++i) { combinedBiasParams.expectGC[i] += d.expectGC[i]; }
+        }
+    } else {
+        tbb::parallel_for(BlockedIndexRange(size_t(0), activeTxps.size()),
+                [&](const BlockedIndexRange& range) -> void {
+                accumulateExpected(range, expectedDist.local());
+        });
+
+        /**
+         * The local bias terms from each thread can be combined
+         * via simple summation.  Here, we combine the locally-computed
+         * bias terms.
+         */
+        combinedBiasParams = expectedDist.combine(
+            [](const CombineableBiasParams& p1,
                const CombineableBiasParams& p2) -> CombineableBiasParams {
                CombineableBiasParams p;
                for (size_t i = 0; i < p1.expectSeq.size(); ++i) {
@@ -1350,9 +1638,22 @@ Eigen::VectorXd updateEffectiveLengths(
                }
                return p;
             });
+    }
 
-    transcriptKmerDist = combinedBiasParams.expectSeq;
-    transcriptGCDist = combinedBiasParams.expectGC;
+    if (cache) {
+        // Add the changes to the previous distributions
+        for (size_t i = 0; i < cache->expectSeq.size(); ++i) {
+            cache->expectSeq[i] = std::max(0.0, cache->expectSeq[i] + combinedBiasParams.expectSeq[i]);
+        }
+        for (size_t i = 0; i < cache->expectGC.size(); ++i) {
+            cache->expectGC[i] = std::max(0.0, cache->expectGC[i] + combinedBiasParams.expectGC[i]);
+        }
+        transcriptKmerDist = cache->expectSeq;
+        transcriptGCDist = cache->expectGC;
+    } else {
+        transcriptKmerDist = combinedBiasParams.expectSeq;
+        transcriptGCDist = combinedBiasParams.expectGC;
+    }
 
     // Compute appropriate priors and normalization factors
     double txomeGCNormFactor = 0.0;
@@ -1385,11 +1686,12 @@ Eigen::VectorXd updateEffectiveLengths(
     /**
      * Compute the effective lengths of each transcript (in parallel)
      */
-    tbb::parallel_for(BlockedIndexRange(size_t(0), size_t(transcripts.size())),
+    tbb::parallel_for(BlockedIndexRange(size_t(0), activeTxps.size()),
             [&]( const BlockedIndexRange& range) -> void {
 
-            // For each index in the equivalence class vector
-            for (auto it : boost::irange(range.begin(), range.end())) {
+            // For each active transcript
+            for (auto ai : boost::irange(range.begin(), range.end())) {
+                auto it = activeTxps[ai];
 
                 // Now, compute the effective length of each transcript using
                 // the bias distributions
@@ -1414,24 +1716,22 @@ Eigen::VectorXd updateEffectiveLengths(
                     Eigen::VectorXd gcFactors(refLen);
                     gcFactors.setZero();
 
-                    bool firstKmer{true};
                     uint32_t idxFW{0};
                     uint32_t idxRC{0};
                     // This transcript's sequence
                     const char* tseq = txp.Sequence();
+                    std::vector<uint32_t> kmersFW;
+                    std::vector<uint32_t> kmersRC;
+                    if (seqBiasCorrect) { kmerIndicesOf(txp, tseq, refLen, kmersFW, kmersRC); }
 
                     // First in the 5' -> 3' direction
                     for (int32_t kmerStartPos = 0; kmerStartPos < refLen - trunc; ++kmerStartPos) {
                         int32_t fragStart = kmerStartPos;
                         // seq-specific bias 
                         if (seqBiasCorrect) {
-                            int32_t kmerEndPos = kmerStartPos + K - 1; // -1 because pos is *inclusive*
                             fragStart = kmerStartPos + 2;
-			    idxFW = firstKmer ? indexForKmer(tseq, K, Direction::FORWARD) :
-			      nextKmerIndex(idxFW, tseq[kmerEndPos], K, Direction::FORWARD);
-			    idxRC = firstKmer ? indexForKmer(tseq, K, Direction::REVERSE_COMPLEMENT) :
-			      nextKmerIndex(idxRC, tseq[kmerEndPos], K, Direction::REVERSE_COMPLEMENT);
-			    firstKmer = false;
+                            idxFW = kmersFW[kmerStartPos];
+                            idxRC = kmersRC[kmerStartPos];
 
 			    int32_t maxFragLenFW = refLen - fragStart;
                             int32_t maxFragLenRC = fragStart + 1; 
@@ -1498,6 +1798,14 @@ Eigen::VectorXd updateEffectiveLengths(
         }
     } // end parallel_for lambda
     );
+
+    if (expectedOut) {
+        expectedOut->seq = std::move(transcriptKmerDist);
+        expectedOut->gc = std::move(transcriptGCDist);
+    } else {
+        readExp.expectedSeqBias() = std::move(transcriptKmerDist);
+        readExp.expectedGCBias() = std::move(transcriptGCDist);
+    }
     return effLensOut;
 }
 
@@ -1555,14 +1863,22 @@ void aggregateEstimatesToGeneLevel(TranscriptGeneMap& tgm, boost::filesystem::pa
   cerr << "Aggregating expressions to gene level . . .";
   boost::filesystem::path outputFilePath(inputPath);
   outputFilePath.replace_extension(".genes.sf");
-  ofstream outFile(outputFilePath.string());
+  ParallelTextWriter outFile(outputFilePath);
 
   // preserve any comments in the output
+  fmt::MemoryWriter header;
   for (auto& c : comments) {
-    outFile << c << '\n';
+    header << c << '\n';
   }
+  outFile.write(header.str());
 
-  for (auto& kv : geneExps) {
+  // The genes are formatted (in parallel) in the order of the map
+  std::vector<const std::pair<const string, vector<ExpressionRecord>>*> genes;
+  genes.reserve(geneExps.size());
+  for (auto& kv : geneExps) { genes.push_back(&kv); }
+
+  outFile.writeRows(genes.size(), [&genes, minTPM](size_t gi, fmt::MemoryWriter& w) -> void {
+    auto& kv = *genes[gi];
     auto& gn = kv.first;
 
     double geneLength = kv.second.front().length;
@@ -1601,23 +1917,153 @@ void aggregateEstimatesToGeneLevel(TranscriptGeneMap& tgm, boost::filesystem::pa
     // Otherwise, if the gene wasn't expressed, the length
     // is reported as the longest transcript length.
 
-    outFile << gn << '\t' << geneLength << '\t' << geneEffLength;
+    w << gn << '\t' << geneLength << '\t' << geneEffLength;
     for (size_t i = 0; i < NE; ++i) {
-      outFile << '\t' << expVals[i];
+      w << '\t' << expVals[i];
     }
-    outFile << '\n';
-  }
+    w << '\n';
+  });
 
-  outFile.close();
+  if (!outFile.close()) {
+    cerr << "\ncould not write " << outputFilePath.string() << '\n';
+  }
   cerr << " done\n";
   //====================== From GeneSum =====================
 }
 
-void generateGeneLevelEstimates(boost::filesystem::path& geneMapPath,
-                                boost::filesystem::path& estDir) {
-    namespace bfs = boost::filesystem;
-    std::cerr << "Computing gene-level abundance estimates\n";
-    bfs::path gtfExtension(".gtf");
+bool readQuantColumn(const boost::filesystem::path& quantFile, const std::string& column,
+                     std::unordered_map<std::string, double>& values, std::string& err) {
+    std::ifstream expFile(quantFile.string());
+    if (!expFile.is_open()) {
+        err = "could not open " + quantFile.string();
+        return false;
+    }
+
+    std::string l;
+    int32_t col{-1};
+    size_t lineNo{0};
+    while (std::getline(expFile, l)) {
+        ++lineNo;
+        auto toks = split(l);
+        if (toks.empty() or toks.front().front() == '#') { continue; }
+        // The first non-comment line is the header
+        if (col < 0) {
+            auto it = std::find(toks.begin(), toks.end(), column);
+            if (it == toks.end()) {
+                err = quantFile.string() + " has no " + column + " column";
+                return false;
+            }
+            col = std::distance(toks.begin(), it);
+            continue;
+        }
+        if (static_cast<int32_t>(toks.size()) > col) {
+            const char* field = toks[col].c_str();
+            char* end{nullptr};
+            errno = 0;
+            double v = std::strtod(field, &end);
+            if (end == field or *end != '\0' or errno == ERANGE or !std::isfinite(v)) {
+                err = quantFile.string() + ":" + std::to_string(lineNo) + ": invalid " + column +
+                      " [" + toks[col] + "]";
+                return false;
+            }
+            values[toks.front()] = v;
+        }
+    }
+    if (col < 0) {
+        err = quantFile.string() + " has no header";
+        return false;
+    }
+    return true;
+}
+
+bool readNumReads(const boost::filesystem::path& quantFile,
+                  std::unordered_map<std::string, double>& numReads, std::string& err) {
+    return readQuantColumn(quantFile, "NumReads", numReads, err);
+}
+
+void aggregateEstimatesToGeneLevel(TranscriptGeneMap& tgm,
+                                   const std::vector<Transcript>& transcripts,
+                                   double numMappedFrags,
+                                   const boost::filesystem::path& outputPath) {
+  constexpr double minTPM = std::numeric_limits<double>::denorm_min();
+
+  // The gene of each transcript; transcripts that aren't in the map are
+  // their own genes, which are numbered after those of the map
+  size_t numMapGenes = tgm.numGenes();
+  std::vector<uint32_t> geneIDs(transcripts.size());
+  std::vector<std::string> extraGeneNames;
+  auto mapNames = TranscriptNameIndex::fromNames(tgm.transcriptNames());
+  for (size_t i = 0; i < transcripts.size(); ++i) {
+    auto& name = transcripts[i].RefName;
+    auto tid = mapNames.find(name);
+    if (tid != TranscriptNameIndex::INVALID) {
+      geneIDs[i] = tgm.gene(tid);
+    } else {
+      std::cerr << "WARNING: couldn't find transcript named ["
+                << name << "]; returning transcript "
+                << " as it's own gene\n";
+      geneIDs[i] = numMapGenes + extraGeneNames.size();
+      extraGeneNames.push_back(name);
+    }
+  }
+
+  // The TPM of each transcript, as computed for quant.sf
+  double tfracDenom{0.0};
+  for (auto& transcript : transcripts) {
+    tfracDenom += (transcript.projectedCounts / numMappedFrags) / transcript.EffectiveLength;
+  }
+
+  size_t numGenes = numMapGenes + extraGeneNames.size();
+  std::vector<uint32_t> numTxps(numGenes, 0);
+  std::vector<double> tpm(numGenes, 0.0);
+  std::vector<double> count(numGenes, 0.0);
+  // The TPM-weighted, and the unweighted, sums of the lengths
+  std::vector<double> weightedLength(numGenes, 0.0);
+  std::vector<double> weightedEffLength(numGenes, 0.0);
+  std::vector<double> length(numGenes, 0.0);
+  std::vector<double> effLength(numGenes, 0.0);
+  for (size_t i = 0; i < transcripts.size(); ++i) {
+    auto& transcript = transcripts[i];
+    auto g = geneIDs[i];
+    double el = transcript.EffectiveLength;
+    double t = ((transcript.projectedCounts / numMappedFrags) / el) / tfracDenom * 1000000.0;
+    ++numTxps[g];
+    tpm[g] += t;
+    count[g] += transcript.projectedCounts;
+    weightedLength[g] += t * transcript.RefLength;
+    weightedEffLength[g] += t * el;
+    length[g] += transcript.RefLength;
+    effLength[g] += el;
+  }
+
+  std::ofstream outFile(outputPath.string());
+  outFile << "Name\tLength\tEffectiveLength\tTPM\tNumReads\n";
+  for (size_t g = 0; g < numGenes; ++g) {
+    if (numTxps[g] == 0) { continue; }
+    // The lengths of an expressed gene are the TPM-weighted means of those
+    // of its transcripts; otherwise, they are the plain means
+    double geneLength{0.0};
+    double geneEffLength{0.0};
+    if (tpm[g] > minTPM) {
+      geneLength = weightedLength[g] / tpm[g];
+      geneEffLength = weightedEffLength[g] / tpm[g];
+    } else {
+      geneLength = length[g] / numTxps[g];
+      geneEffLength = effLength[g] / numTxps[g];
+    }
+    const std::string& gn = (g < numMapGenes) ? tgm.nameFromGeneID(g) : extraGeneNames[g - numMapGenes];
+    outFile << gn << '\t' << geneLength << '\t' << geneEffLength
+            << '\t' << tpm[g] << '\t' << count[g] << '\n';
+  }
+  outFile.close();
+}
+
+/**
+ * Read the transcript to gene map from a GTF file or from a simple
+ * (two-column) map file, depending on its extension.
+ */
+static TranscriptGeneMap loadTranscriptGeneMap(boost::filesystem::path& geneMapPath) {
+    boost::filesystem::path gtfExtension(".gtf");
     auto extension = geneMapPath.extension();
 
     TranscriptGeneMap tranGeneMap;
@@ -1633,6 +2079,49 @@ void generateGeneLevelEstimates(boost::filesystem::path& geneMapPath,
 
     std::cerr << "There were " << tranGeneMap.numTranscripts() << " transcripts mapping to "
         << tranGeneMap.numGenes() << " genes\n";
+    return tranGeneMap;
+}
+
+void generateGeneLevelEstimates(boost::filesystem::path& geneMapPath,
+                                boost::filesystem::path& estDir,
+                                const std::vector<Transcript>& transcripts,
+                                double numMappedFrags) {
+    std::cerr << "Computing gene-level abundance estimates\n";
+    TranscriptGeneMap tranGeneMap = loadTranscriptGeneMap(geneMapPath);
+    salmon::utils::aggregateEstimatesToGeneLevel(tranGeneMap, transcripts, numMappedFrags,
+                                                 estDir / "quant.genes.sf");
+}
+
+std::vector<uint32_t> transcriptGeneIDs(boost::filesystem::path& geneMapPath,
+                                        const std::vector<Transcript>& transcripts,
+                                        std::vector<std::string>& geneNames) {
+    TranscriptGeneMap tranGeneMap = loadTranscriptGeneMap(geneMapPath);
+    auto mapNames = TranscriptNameIndex::fromNames(tranGeneMap.transcriptNames());
+    std::unordered_map<std::string, uint32_t> geneIndex;
+    std::vector<uint32_t> geneIDs(transcripts.size());
+    geneNames.clear();
+    size_t numMissing{0};
+    for (size_t i = 0; i < transcripts.size(); ++i) {
+        auto& name = transcripts[i].RefName;
+        auto tid = mapNames.find(name);
+        if (tid == TranscriptNameIndex::INVALID) { ++numMissing; }
+        std::string gene = (tid != TranscriptNameIndex::INVALID) ? tranGeneMap.geneName(tid) : name;
+        auto it = geneIndex.emplace(gene, static_cast<uint32_t>(geneNames.size()));
+        if (it.second) { geneNames.push_back(gene); }
+        geneIDs[i] = it.first->second;
+    }
+    if (numMissing > 0) {
+        std::cerr << "WARNING: " << numMissing << " transcripts were not in the gene map; "
+                  << "each is its own gene\n";
+    }
+    return geneIDs;
+}
+
+void generateGeneLevelEstimates(boost::filesystem::path& geneMapPath,
+                                boost::filesystem::path& estDir) {
+    namespace bfs = boost::filesystem;
+    std::cerr << "Computing gene-level abundance estimates\n";
+    TranscriptGeneMap tranGeneMap = loadTranscriptGeneMap(geneMapPath);
 
     bfs::path estFilePath = estDir / "quant.sf";
     if (!bfs::exists(estFilePath)) {
@@ -1724,36 +2213,48 @@ template Eigen::VectorXd salmon::utils::updateEffectiveLengths<std::vector<tbb::
                 SalmonOpts& sopt,
                 ReadExperiment& readExp,
                 Eigen::VectorXd& effLensIn,
-                std::vector<tbb::atomic<double>>& alphas);
+                std::vector<tbb::atomic<double>>& alphas,
+                salmon::utils::EffectiveLengthCache* cache,
+                salmon::utils::ExpectedBiasDists* expectedOut);
 
 template Eigen::VectorXd salmon::utils::updateEffectiveLengths<std::vector<double>, ReadExperiment>(
                 SalmonOpts& sopt,
                 ReadExperiment& readExp,
                 Eigen::VectorXd& effLensIn,
-                std::vector<double>& alphas);
+                std::vector<double>& alphas,
+                salmon::utils::EffectiveLengthCache* cache,
+                salmon::utils::ExpectedBiasDists* expectedOut);
 
 template Eigen::VectorXd salmon::utils::updateEffectiveLengths<std::vector<tbb::atomic<double>>, AlignmentLibrary<ReadPair>>(
                 SalmonOpts& sopt,
                 AlignmentLibrary<ReadPair>& readExp,
                 Eigen::VectorXd& effLensIn,
-                std::vector<tbb::atomic<double>>& alphas);
+                std::vector<tbb::atomic<double>>& alphas,
+                salmon::utils::EffectiveLengthCache* cache,
+                salmon::utils::ExpectedBiasDists* expectedOut);
 
 template Eigen::VectorXd salmon::utils::updateEffectiveLengths<std::vector<double>, AlignmentLibrary<ReadPair>>(
                 SalmonOpts& sopt,
                 AlignmentLibrary<ReadPair>& readExp,
                 Eigen::VectorXd& effLensIn,
-                std::vector<double>& alphas);
+                std::vector<double>& alphas,
+                salmon::utils::EffectiveLengthCache* cache,
+                salmon::utils::ExpectedBiasDists* expectedOut);
 
 template Eigen::VectorXd salmon::utils::updateEffectiveLengths<std::vector<tbb::atomic<double>>, AlignmentLibrary<UnpairedRead>>(
                 SalmonOpts& sopt,
                 AlignmentLibrary<UnpairedRead>& readExp,
                 Eigen::VectorXd& effLensIn,
-                std::vector<tbb::atomic<double>>& alphas);
+                std::vector<tbb::atomic<double>>& alphas,
+                salmon::utils::EffectiveLengthCache* cache,
+                salmon::utils::ExpectedBiasDists* expectedOut);
 
 template Eigen::VectorXd salmon::utils::updateEffectiveLengths<std::vector<double>, AlignmentLibrary<UnpairedRead>>(
                 SalmonOpts& sopt,
                 AlignmentLibrary<UnpairedRead>& readExp,
                 Eigen::VectorXd& effLensIn,
-                std::vector<double>& alphas);
+                std::vector<double>& alphas,
+                salmon::utils::EffectiveLengthCache* cache,
+                salmon::utils::ExpectedBiasDists* expectedOut);
 
 
@@ -9,6 +9,34 @@
 #include "Transcript.hpp"
 
 
+/**
+ * Call f(i, base) for each base of the window of 2 * (windowSize / 2) + 1
+ * bases centered at pos, where i is the base's index in the window, counted
+ * from the left end of the window if fwd and from its right end otherwise
+ * (the bases are not complemented).  Windows of at most 32 bases that lie
+ * within the transcript are extracted from the packed reference in one go.
+ */
+template <typename CallbackT>
+static inline void forEachWindowBase(Transcript& ref, int32_t pos, uint32_t windowSize,
+                                      bool fwd, CallbackT f) {
+    int32_t halfWindow = windowSize >> 1;
+    int32_t first = pos - halfWindow;
+    int32_t last = pos + halfWindow;
+    int32_t w = last - first + 1;
+    if (w <= 32 and first >= 0 and last < static_cast<int32_t>(ref.RefLength)) {
+        // base (first + j) is held in bits [2 * (w - 1 - j), 2 * (w - j))
+        uint64_t kmer = ref.kmerAt(first, w);
+        for (int32_t i = 0; i < w; ++i) {
+            int32_t shift = fwd ? 2 * (w - 1 - i) : 2 * i;
+            f(i, static_cast<uint8_t>((kmer >> shift) & 0x3));
+        }
+    } else {
+        for (int32_t i = 0; i < w; ++i) {
+            f(i, ref.twoBitBaseAt(fwd ? (first + i) : (last - i)));
+        }
+    }
+}
+
 SequenceBiasModel::SequenceBiasModel(double alpha, uint32_t windowSize) :
     // Let's try a 0th order model first
     biasLeftForeground_(AtomicMatrix<double>(windowSize, numBases(), alpha)),
@@ -45,23 +73,9 @@ bool SequenceBiasModel::update(Transcript& ref,
     if (pos < halfWindow) { return false; }
     if (pos + halfWindow >= txpLen) { return false; }
 
-    int32_t start, stop, inc;
-    salmon::stringtools::strand readStrand = salmon::stringtools::strand::forward;
-    if (fwd) {
-        start = pos - halfWindow;
-        stop = pos + halfWindow;
-        for (int p = start; p <= stop; ++p) {
-            size_t currRefBase = salmon::stringtools::samToTwoBit[ref.baseAt(p, readStrand)];
-            sequenceProfile.increment(p - start, currRefBase, mass+prob);
-        }
-    } else {
-        start = pos + halfWindow;
-        stop = pos - halfWindow;
-        for (int p = start; p >= stop; --p) {
-            size_t currRefBase = salmon::stringtools::samToTwoBit[ref.baseAt(p, readStrand)];
-            sequenceProfile.increment(start - p, currRefBase, mass+prob);
-        }
-    }
+    forEachWindowBase(ref, pos, windowSize_, fwd, [&](int32_t i, uint8_t base) -> void {
+        sequenceProfile.increment(i, base, mass+prob);
+    });
     return true;
 }
 
@@ -140,26 +154,10 @@ double SequenceBiasModel::seqProb(Transcript& ref,
                                   int32_t pos,
                                   bool isFwd,
                                   AtomicMatrix<double>& profile) {
-    int32_t halfWindow = windowSize_ >> 1;
-    salmon::stringtools::strand readStrand = salmon::stringtools::strand::forward;
-    int32_t start, stop;
     double prob = salmon::math::LOG_1;
-
-    if (isFwd) {
-        start = pos - halfWindow;
-        stop = pos + halfWindow;
-        for (int p = start; p <= stop; ++p) {
-            size_t currRefBase = salmon::stringtools::samToTwoBit[ref.baseAt(p, readStrand)];
-            prob += profile(p - start, currRefBase);
-        }
-    } else {
-        start = pos + halfWindow;
-        stop = pos - halfWindow;
-        for (int p = start; p >= stop; --p) {
-            size_t currRefBase = salmon::stringtools::samToTwoBit[ref.baseAt(p, readStrand)];
-            prob += profile(start - p, currRefBase);
-        }
-    }
+    forEachWindowBase(ref, pos, windowSize_, isFwd, [&](int32_t i, uint8_t base) -> void {
+        prob += profile(i, base);
+    });
 
     return prob;
 }
@@ -0,0 +1,56 @@
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+#include "spdlog/spdlog.h"
+
+#include "IndexChecksums.hpp"
+#include "RunExit.hpp"
+#include "SalmonIndex.hpp"
+#include "SalmonIndexVersionInfo.hpp"
+#include "SharedIndexJobs.hpp"
+
+namespace salmon {
+namespace utils {
+
+std::shared_ptr<SalmonIndex> loadSharedIndex(const boost::filesystem::path& indexDir, bool verify,
+                                             std::shared_ptr<spdlog::logger>& log, std::string& err) {
+    SalmonIndexVersionInfo versionInfo;
+    versionInfo.load(indexDir / "versionInfo.json");
+    if (versionInfo.indexVersion() == 0) {
+        err = "The index version file " + (indexDir / "versionInfo.json").string() +
+              " doesn't seem to exist.  Please try re-building the salmon index.";
+        return nullptr;
+    }
+    // The check hashes with threads of its own, so nothing of it is left
+    // running when the jobs are forked
+    if (verify and !IndexChecksums::verify(indexDir, log)) {
+        err = "The index " + indexDir.string() + " failed verification; please rebuild it";
+        return nullptr;
+    }
+    std::shared_ptr<SalmonIndex> index(new SalmonIndex(log, versionInfo.indexType()));
+    index->load(indexDir);
+    return index;
+}
+
+void runForkedQuantJob(std::vector<std::string> jobArgs, std::shared_ptr<SalmonIndex> index) {
+    std::vector<char*> jobArgv;
+    for (auto& a : jobArgs) { jobArgv.push_back(&a[0]); }
+    jobArgv.push_back(nullptr);
+    // An error of the job must end only the job, without the parent's atexit
+    // handlers (e.g. the wait for its version check); see RunExit.hpp
+    int ret{0};
+    throwOnExit() = true;
+    try {
+        ret = salmonQuantifyWithIndex(static_cast<int>(jobArgs.size()), jobArgv.data(), index);
+    } catch (RunExit& e) {
+        ret = e.status;
+    }
+    std::cout.flush();
+    std::fflush(stdout);
+    std::fflush(stderr);
+    std::_Exit(ret);
+}
+
+}
+}
@@ -0,0 +1,262 @@
+#include "SimdDispatch.hpp"
+#include "SortedIntersection.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+
+#if defined(__x86_64__) and (defined(__GNUC__) or defined(__clang__))
+#define SALMON_SIMD_X86 1
+#include <immintrin.h>
+// The AVX2 and AVX-512 variants are compiled for their target with
+// __attribute__((target)), which can only use the intrinsics of an
+// instruction set that the command line doesn't enable from g++ 4.9 on; the
+// AVX-512 intrinsics (and the "avx512f" feature of __builtin_cpu_supports)
+// need g++ 5 or clang 3.8 (Apple's clang 8).  Older compilers, which
+// CMakeLists.txt still accepts, get the SSE2 variant only.
+#if defined(__clang__)
+#if defined(__apple_build_version__)
+#define SALMON_CLANG_AT_LEAST_3_8 (__clang_major__ >= 8)
+#else
+#define SALMON_CLANG_AT_LEAST_3_8 (__clang_major__ > 3 or (__clang_major__ == 3 and __clang_minor__ >= 8))
+#endif
+#if SALMON_CLANG_AT_LEAST_3_8
+#define SALMON_SIMD_AVX2 1
+#define SALMON_SIMD_AVX512 1
+#endif
+#else
+#if __GNUC__ > 4 or (__GNUC__ == 4 and __GNUC_MINOR__ >= 9)
+#define SALMON_SIMD_AVX2 1
+#endif
+#if __GNUC__ >= 5
+#define SALMON_SIMD_AVX512 1
+#endif
+#endif
+#elif defined(__aarch64__)
+#define SALMON_SIMD_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace salmon {
+namespace simd {
+
+namespace {
+
+// Merge a[i, iEnd) against b[j, jEnd), as the scalar two-pointer intersection does
+inline void mergeBlocks_(const uint32_t* a, size_t& i, size_t iEnd, const uint32_t* b, size_t& j, size_t jEnd,
+                         uint32_t* indexA, uint32_t* indexB, size_t& numMatches) {
+    while (i < iEnd and j < jEnd) {
+        if (a[i] < b[j]) {
+            ++i;
+        } else if (b[j] < a[i]) {
+            ++j;
+        } else {
+            indexA[numMatches] = static_cast<uint32_t>(i);
+            indexB[numMatches] = static_cast<uint32_t>(j);
+            ++numMatches;
+            ++i;
+            ++j;
+        }
+    }
+}
+
+size_t intersectSortedScalar_(const uint32_t* a, size_t na, const uint32_t* b, size_t nb,
+                              uint32_t* indexA, uint32_t* indexB) {
+    size_t i{0};
+    size_t j{0};
+    size_t numMatches{0};
+    mergeBlocks_(a, i, na, b, j, nb, indexA, indexB, numMatches);
+    return numMatches;
+}
+
+#if defined(SALMON_SIMD_X86)
+// SSE2 is part of x86-64, so this is the header's (baseline) intersection
+size_t intersectSortedSSE2_(const uint32_t* a, size_t na, const uint32_t* b, size_t nb,
+                            uint32_t* indexA, uint32_t* indexB) {
+    size_t numMatches{0};
+    salmon::utils::intersectSorted(a, na, b, nb, [&](size_t i, size_t j) -> void {
+        indexA[numMatches] = static_cast<uint32_t>(i);
+        indexB[numMatches] = static_cast<uint32_t>(j);
+        ++numMatches;
+    });
+    return numMatches;
+}
+
+#if defined(SALMON_SIMD_AVX2)
+// As the SSE2 intersection, comparing 8 ids against 8
+__attribute__((target("avx2")))
+size_t intersectSortedAVX2_(const uint32_t* a, size_t na, const uint32_t* b, size_t nb,
+                            uint32_t* indexA, uint32_t* indexB) {
+    size_t i{0};
+    size_t j{0};
+    size_t numMatches{0};
+    const __m256i rotate = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 0);
+    while (i + 8 <= na and j + 8 <= nb) {
+        __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + j));
+        __m256i eq = _mm256_cmpeq_epi32(va, vb);
+        for (int r = 1; r < 8; ++r) {
+            vb = _mm256_permutevar8x32_epi32(vb, rotate);
+            eq = _mm256_or_si256(eq, _mm256_cmpeq_epi32(va, vb));
+        }
+        if (_mm256_testz_si256(eq, eq)) {
+            if (a[i + 7] < b[j + 7]) { i += 8; } else { j += 8; }
+            continue;
+        }
+        mergeBlocks_(a, i, i + 8, b, j, j + 8, indexA, indexB, numMatches);
+    }
+    mergeBlocks_(a, i, na, b, j, nb, indexA, indexB, numMatches);
+    return numMatches;
+}
+#endif // SALMON_SIMD_AVX2
+
+#if defined(SALMON_SIMD_AVX512)
+// As the SSE2 intersection, comparing 16 ids against 16
+__attribute__((target("avx512f")))
+size_t intersectSortedAVX512_(const uint32_t* a, size_t na, const uint32_t* b, size_t nb,
+                              uint32_t* indexA, uint32_t* indexB) {
+    size_t i{0};
+    size_t j{0};
+    size_t numMatches{0};
+    const __m512i rotate = _mm512_setr_epi32(1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 0);
+    while (i + 16 <= na and j + 16 <= nb) {
+        __m512i va = _mm512_loadu_si512(reinterpret_cast<const void*>(a + i));
+        __m512i vb = _mm512_loadu_si512(reinterpret_cast<const void*>(b + j));
+        __mmask16 eq = _mm512_cmpeq_epi32_mask(va, vb);
+        for (int r = 1; r < 16; ++r) {
+            // (the unmasked form passes GCC an undefined source, which it warns about)
+            vb = _mm512_mask_permutexvar_epi32(vb, 0xFFFF, rotate, vb);
+            eq = static_cast<__mmask16>(eq | _mm512_cmpeq_epi32_mask(va, vb));
+        }
+        if (eq == 0) {
+            if (a[i + 15] < b[j + 15]) { i += 16; } else { j += 16; }
+            continue;
+        }
+        mergeBlocks_(a, i, i + 16, b, j, j + 16, indexA, indexB, numMatches);
+    }
+    mergeBlocks_(a, i, na, b, j, nb, indexA, indexB, numMatches);
+    return numMatches;
+}
+#endif // SALMON_SIMD_AVX512
+#endif // SALMON_SIMD_X86
+
+#if defined(SALMON_SIMD_NEON)
+// As the SSE2 intersection, with NEON's 4 lanes (NEON is part of AArch64)
+size_t intersectSortedNEON_(const uint32_t* a, size_t na, const uint32_t* b, size_t nb,
+                            uint32_t* indexA, uint32_t* indexB) {
+    size_t i{0};
+    size_t j{0};
+    size_t numMatches{0};
+    while (i + 4 <= na and j + 4 <= nb) {
+        uint32x4_t va = vld1q_u32(a + i);
+        uint32x4_t vb = vld1q_u32(b + j);
+        uint32x4_t eq = vceqq_u32(va, vb);
+        vb = vextq_u32(vb, vb, 1);
+        eq = vorrq_u32(eq, vceqq_u32(va, vb));
+        vb = vextq_u32(vb, vb, 1);
+        eq = vorrq_u32(eq, vceqq_u32(va, vb));
+        vb = vextq_u32(vb, vb, 1);
+        eq = vorrq_u32(eq, vceqq_u32(va, vb));
+        if (vmaxvq_u32(eq) == 0) {
+            if (a[i + 3] < b[j + 3]) { i += 4; } else { j += 4; }
+            continue;
+        }
+        mergeBlocks_(a, i, i + 4, b, j, j + 4, indexA, indexB, numMatches);
+    }
+    mergeBlocks_(a, i, na, b, j, nb, indexA, indexB, numMatches);
+    return numMatches;
+}
+#endif // SALMON_SIMD_NEON
+
+// The cap on the instruction set given by SALMON_SIMD, if any
+bool requestedInstructionSet_(InstructionSet& isa) {
+    const char* env = std::getenv("SALMON_SIMD");
+    if (env == nullptr) { return false; }
+    for (auto s : {InstructionSet::SCALAR, InstructionSet::SSE2, InstructionSet::AVX2,
+                   InstructionSet::AVX512, InstructionSet::NEON}) {
+        if (std::strcmp(env, instructionSetName(s)) == 0) {
+            isa = s;
+            return true;
+        }
+    }
+    return false;
+}
+
+} // namespace
+
+const char* instructionSetName(InstructionSet isa) {
+    switch (isa) {
+        case InstructionSet::SCALAR: return "scalar";
+        case InstructionSet::SSE2: return "sse2";
+        case InstructionSet::AVX2: return "avx2";
+        case InstructionSet::AVX512: return "avx512";
+        case InstructionSet::NEON: return "neon";
+    }
+    return "scalar";
+}
+
+const CpuFeatures& cpuFeatures() {
+    static const CpuFeatures features = []() -> CpuFeatures {
+        CpuFeatures f;
+#if defined(SALMON_SIMD_X86)
+        __builtin_cpu_init();
+        f.sse2 = __builtin_cpu_supports("sse2");
+        f.avx2 = __builtin_cpu_supports("avx2");
+#if defined(SALMON_SIMD_AVX512)
+        f.avx512f = __builtin_cpu_supports("avx512f");
+#endif
+#elif defined(SALMON_SIMD_NEON)
+        f.neon = true;
+#endif
+        return f;
+    }();
+    return features;
+}
+
+Kernels kernelsFor(InstructionSet isa) {
+    const CpuFeatures& f = cpuFeatures();
+    Kernels k;
+    k.isa = InstructionSet::SCALAR;
+    k.intersectSorted = intersectSortedScalar_;
+#if defined(SALMON_SIMD_X86)
+    if (isa == InstructionSet::NEON) { isa = InstructionSet::AVX512; }
+    if (isa >= InstructionSet::SSE2 and f.sse2) {
+        k.isa = InstructionSet::SSE2;
+        k.intersectSorted = intersectSortedSSE2_;
+    }
+#if defined(SALMON_SIMD_AVX2)
+    if (isa >= InstructionSet::AVX2 and f.avx2) {
+        k.isa = InstructionSet::AVX2;
+        k.intersectSorted = intersectSortedAVX2_;
+    }
+#endif
+#if defined(SALMON_SIMD_AVX512)
+    if (isa >= InstructionSet::AVX512 and f.avx512f) {
+        k.isa = InstructionSet::AVX512;
+        k.intersectSorted = intersectSortedAVX512_;
+    }
+#endif
+#elif defined(SALMON_SIMD_NEON)
+    if (isa != InstructionSet::SCALAR and f.neon) {
+        k.isa = InstructionSet::NEON;
+        k.intersectSorted = intersectSortedNEON_;
+    }
+#else
+    (void) isa;
+    (void) f;
+#endif
+    return k;
+}
+
+const Kernels& kernels() {
+    static const Kernels bound = []() -> Kernels {
+        // Without a cap, any instruction set (up to the last) may be chosen
+        InstructionSet isa{InstructionSet::NEON};
+        requestedInstructionSet_(isa);
+        return kernelsFor(isa);
+    }();
+    return bound;
+}
+
+} // namespace simd
+} // namespace salmon
@@ -7,14 +7,14 @@
 
 TranscriptGroup::TranscriptGroup() : hash(0) {}
 
-TranscriptGroup::TranscriptGroup(std::vector<uint32_t> txpsIn) : txps(txpsIn),
+TranscriptGroup::TranscriptGroup(const std::vector<uint32_t>& txpsIn) : txps(txpsIn),
     valid(true) {
         size_t seed{0};
         hash = XXH64(static_cast<void*>(txps.data()), txps.size() * sizeof(uint32_t), seed);
     }
 
 TranscriptGroup::TranscriptGroup(
-        std::vector<uint32_t> txpsIn,
+        const std::vector<uint32_t>& txpsIn,
 	    size_t hashIn) : txps(txpsIn), hash(hashIn), valid(true) {}
 
 TranscriptGroup::TranscriptGroup(const TranscriptGroup& other){
@@ -38,6 +38,13 @@ TranscriptGroup::TranscriptGroup(TranscriptGroup&& other) {
 
 void TranscriptGroup::setValid(bool b) const { valid = b; }
 
+void TranscriptGroup::assign(const std::vector<uint32_t>& txpsIn) {
+    txps.assign(txpsIn.begin(), txpsIn.end());
+    size_t seed{0};
+    hash = XXH64(static_cast<void*>(txps.data()), txps.size() * sizeof(uint32_t), seed);
+    valid = true;
+}
+
 TranscriptGroup& TranscriptGroup::operator=(TranscriptGroup&& other) {
     txps = std::move(other.txps);
     hash = other.hash;
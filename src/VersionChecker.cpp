@@ -8,6 +8,14 @@
 // file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
 //
 
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <fstream>
+#include <thread>
+
+#include <boost/algorithm/string.hpp>
+
 #include "VersionChecker.hpp"
 #include "SalmonConfig.hpp"
 
@@ -165,14 +173,13 @@ void VersionChecker::handle_read_content(const boost::system::error_code& err) {
   }
 }
 
-std::string getVersionMessage() {
+std::string getVersionMessage(boost::asio::io_service& io_service) {
   std::string baseSite{"combine-lab.github.io"};
   std::string path{"/salmon/version_info/"};
   path += salmon::version;
 
   std::stringstream ss;
   try {
-    boost::asio::io_service io_service;
     VersionChecker c(io_service, baseSite, path);
     io_service.run();
     ss << "Version Info: " << c.message();
@@ -184,3 +191,130 @@ std::string getVersionMessage() {
 
   return ss.str();
 }
+
+std::string getVersionMessage() {
+  boost::asio::io_service io_service;
+  return getVersionMessage(io_service);
+}
+
+namespace salmon {
+namespace versioncheck {
+
+namespace {
+
+// The result of the check, shared with the thread making it
+struct CheckState {
+  std::mutex mutex;
+  std::condition_variable finishedCond;
+  // The io_service of the check while it runs, so that it can be stopped
+  boost::asio::io_service* io{nullptr};
+  std::string message;
+  bool done{false};
+  bool finished{false};
+  bool stopping{false};
+  bool reported{false};
+  std::thread checker;
+};
+
+std::shared_ptr<CheckState>& checkState() {
+  static std::shared_ptr<CheckState> state{nullptr};
+  return state;
+}
+
+// How long the exit waits for a stopped check to wind down
+constexpr std::chrono::seconds stopWait{2};
+
+/**
+ * At exit, stop the check if it's still running and join its thread, so
+ * that it isn't left running into the static destructors; the result is
+ * printed if it arrived in time.  Stopping the io_service ends the check at
+ * once, except for a name lookup in progress, which asio can't interrupt;
+ * the wait for that is bounded, and a thread still in it is left detached
+ * (it touches nothing of ours by then).
+ */
+void reportVersionCheck() {
+  auto& state = checkState();
+  if (!state) { return; }
+  std::unique_lock<std::mutex> lock(state->mutex);
+  if (state->reported) { return; }
+  state->reported = true;
+  state->stopping = true;
+  if (state->io) { state->io->stop(); }
+  bool finished = state->finishedCond.wait_for(lock, stopWait, [&state]() { return state->finished; });
+  if (state->done) { std::cerr << state->message; }
+  lock.unlock();
+  if (finished) {
+    state->checker.join();
+  } else {
+    state->checker.detach();
+  }
+}
+
+bool configDisablesCheck(const std::string& path) {
+  std::ifstream config(path);
+  std::string line;
+  while (config and std::getline(config, line)) {
+    auto comment = line.find('#');
+    if (comment != std::string::npos) { line.erase(comment); }
+    std::vector<std::string> kv;
+    boost::split(kv, line, boost::is_any_of("="));
+    if (kv.size() != 2) { continue; }
+    boost::trim(kv[0]);
+    boost::trim(kv[1]);
+    if (kv[0] == "no-version-check") {
+      return (kv[1] == "true" or kv[1] == "1" or kv[1] == "yes");
+    }
+  }
+  return false;
+}
+
+} // anonymous namespace
+
+bool versionCheckDisabled() {
+  const char* env = std::getenv("SALMON_NO_VERSION_CHECK");
+  if (env != nullptr and std::string(env) != "" and std::string(env) != "0") {
+    return true;
+  }
+  // The first config file that exists is the one that's used
+  std::vector<std::string> configs;
+  const char* configEnv = std::getenv("SALMON_CONFIG");
+  if (configEnv != nullptr) { configs.emplace_back(configEnv); }
+  const char* home = std::getenv("HOME");
+  if (home != nullptr) { configs.emplace_back(std::string(home) + "/.salmonrc"); }
+  configs.emplace_back("/etc/salmonrc");
+  for (auto& c : configs) {
+    if (std::ifstream(c)) { return configDisablesCheck(c); }
+  }
+  return false;
+}
+
+void startVersionCheck() {
+  if (versionCheckDisabled() or checkState()) { return; }
+  auto state = std::make_shared<CheckState>();
+  checkState() = state;
+  std::atexit(reportVersionCheck);
+  state->checker = std::thread([state]() {
+      {
+        boost::asio::io_service io_service;
+        {
+          std::lock_guard<std::mutex> lock(state->mutex);
+          if (state->stopping) { io_service.stop(); }
+          state->io = &io_service;
+        }
+        std::string message = getVersionMessage(io_service);
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->io = nullptr;
+        // A stopped check has no result worth printing
+        if (!state->stopping) {
+          state->message = message;
+          state->done = true;
+        }
+      }
+      std::lock_guard<std::mutex> lock(state->mutex);
+      state->finished = true;
+      state->finishedCond.notify_all();
+    });
+}
+
+} // namespace versioncheck
+} // namespace salmon
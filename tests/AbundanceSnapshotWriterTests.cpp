@@ -0,0 +1,110 @@
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/filesystem.hpp>
+#include "AbundanceSnapshotWriter.hpp"
+
+namespace abundance_snapshot_writer_test {
+
+struct Row {
+    std::string name;
+    uint32_t length;
+    double tpm;
+    double numReads;
+};
+
+// The rows of a snapshot, after its header
+inline std::vector<Row> readSnapshot(const boost::filesystem::path& path) {
+    std::ifstream in(path.string());
+    std::string header;
+    std::getline(in, header);
+    REQUIRE(header == "Name\tLength\tEffectiveLength\tTPM\tNumReads");
+    std::vector<Row> rows;
+    Row r;
+    double effLen;
+    while (in >> r.name >> r.length >> effLen >> r.tpm >> r.numReads) { rows.push_back(r); }
+    return rows;
+}
+
+inline void addClass(EquivalenceClassBuilder& builder, std::vector<uint32_t> txps, uint64_t count) {
+    std::vector<double> weights(txps.size(), 1.0), posWeights(txps.size(), 1.0);
+    TranscriptGroup g(txps);
+    for (uint64_t i = 0; i < count; ++i) { builder.addGroup(g, weights, posWeights); }
+}
+
+}
+
+SCENARIO("Snapshots of the abundances are written while the fragments are mapped") {
+    using namespace abundance_snapshot_writer_test;
+    GIVEN("Classes observed so far, over transcripts some of which have no mass yet") {
+        auto path = boost::filesystem::temp_directory_path() /
+                    boost::filesystem::unique_path("salmon-snapshot-%%%%-%%%%.sf");
+        auto logger = std::make_shared<spdlog::logger>("snapshotTestLog",
+                                                       std::make_shared<spdlog::sinks::stderr_sink_mt>());
+        std::vector<Transcript> transcripts;
+        transcripts.emplace_back(0, "txpA", 1000);
+        transcripts.emplace_back(1, "txpB", 2000);
+        transcripts.emplace_back(2, "txpC", 500);
+        transcripts[0].addMass(std::log(3.0));
+        transcripts[1].addMass(std::log(1.0));
+
+        EquivalenceClassBuilder builder(logger, 16);
+        builder.start();
+        addClass(builder, {0}, 30);
+        addClass(builder, {1}, 10);
+        addClass(builder, {2}, 5);
+        addClass(builder, {0, 1}, 20);
+        addClass(builder, {1, 2}, 4);
+
+        WHEN("the mapping threads cross the interval") {
+            uint64_t numWritten{0};
+            {
+                AbundanceSnapshotWriter writer(path, 100, 1000, builder, transcripts, logger);
+                writer.update(50);
+                writer.update(120);
+                // wait (for at most 10s) for the snapshot thread
+                for (size_t i = 0; i < 1000 and writer.numWritten() == 0; ++i) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                }
+                writer.finish();
+                numWritten = writer.numWritten();
+            }
+            THEN("a complete snapshot of the estimates is written in place") {
+                REQUIRE(numWritten == 1);
+                REQUIRE(!boost::filesystem::exists(path.string() + ".tmp"));
+                auto rows = readSnapshot(path);
+                REQUIRE(rows.size() == 3);
+                REQUIRE(rows[0].name == "txpA");
+                REQUIRE(rows[1].length == 2000);
+                REQUIRE(rows[0].numReads > 30.0);
+                REQUIRE(rows[1].numReads > 10.0);
+                REQUIRE(rows[2].numReads > 5.0);
+                double numReads{0.0}, tpm{0.0};
+                for (auto& r : rows) {
+                    REQUIRE(std::isfinite(r.tpm));
+                    numReads += r.numReads;
+                    tpm += r.tpm;
+                }
+                REQUIRE(numReads == Approx(69.0));
+                REQUIRE(tpm == Approx(1e6));
+            }
+        }
+        WHEN("the mapping threads don't reach the interval") {
+            uint64_t numWritten{0};
+            {
+                AbundanceSnapshotWriter writer(path, 100, 1000, builder, transcripts, logger);
+                writer.update(99);
+                writer.finish();
+                numWritten = writer.numWritten();
+            }
+            THEN("no snapshot is written") {
+                REQUIRE(numWritten == 0);
+                REQUIRE(!boost::filesystem::exists(path));
+            }
+        }
+        boost::filesystem::remove(path);
+    }
+}
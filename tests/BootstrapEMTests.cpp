@@ -0,0 +1,75 @@
+#include <random>
+#include <vector>
+#include "BootstrapEMUpdate.hpp"
+#include "EMTestArena.hpp"
+
+SCENARIO("The batched bootstrap EM update matches the update of each replicate alone") {
+    using em_test::numTxps;
+    GIVEN("An arena of single- and multi-transcript classes and R replicates of counts") {
+        const size_t R = 4;
+        std::mt19937 gen(7);
+        std::uniform_real_distribution<double> weightDist(0.05, 1.0);
+        std::uniform_int_distribution<uint64_t> countDist(0, 20);
+
+        EquivalenceClassArena arena = em_test::testArena(gen, []() -> uint64_t { return 1; });
+        const size_t numClasses = arena.numClasses();
+
+        // counts[eqID * R + r]; one class goes unsampled in every replicate,
+        // and some in only a few
+        std::vector<uint64_t> counts(numClasses * R);
+        for (auto& c : counts) { c = countDist(gen); }
+        for (size_t r = 0; r < R; ++r) { counts[2 * R + r] = 0; }
+        counts[4 * R + 1] = 0;
+
+        std::vector<double> alpha(numTxps * R);
+        for (auto& a : alpha) { a = weightDist(gen) * 10.0; }
+
+        salmon::optimizer::SingletonClasses batchSplit(arena, false);
+        batchSplit.setCounts(arena, counts.data(), numTxps, R);
+
+        auto checkRounds = [&](const EquivalenceClassArena& ar, bool singlePrecision) {
+            std::vector<double> batchIn(alpha), batchOut(numTxps * R), denoms(R);
+            std::vector<std::vector<double>> soloIn(R, std::vector<double>(numTxps));
+            std::vector<std::vector<uint64_t>> soloCounts(R, std::vector<uint64_t>(numClasses));
+            std::vector<salmon::optimizer::SingletonClasses> soloSplits;
+            for (size_t r = 0; r < R; ++r) {
+                for (size_t t = 0; t < numTxps; ++t) { soloIn[r][t] = alpha[t * R + r]; }
+                for (size_t c = 0; c < numClasses; ++c) { soloCounts[r][c] = counts[c * R + r]; }
+                soloSplits.emplace_back(ar, false);
+                soloSplits.back().setCounts(ar, soloCounts[r].data(), numTxps);
+            }
+
+            for (size_t round = 0; round < 5; ++round) {
+                std::fill(batchOut.begin(), batchOut.end(), 0.0);
+                if (singlePrecision) {
+                    salmon::optimizer::batchEMUpdate_(ar, ar.singlePrecisionWeights.data(), counts,
+                                                      batchSplit, R, batchIn, batchOut, denoms);
+                } else {
+                    salmon::optimizer::batchEMUpdate_(ar, ar.combinedWeights.data(), counts,
+                                                      batchSplit, R, batchIn, batchOut, denoms);
+                }
+                for (size_t r = 0; r < R; ++r) {
+                    std::vector<double> soloOut(numTxps, 0.0);
+                    salmon::optimizer::EMUpdate_(ar, soloCounts[r], soloSplits[r], soloIn[r], soloOut);
+                    for (size_t t = 0; t < numTxps; ++t) {
+                        REQUIRE(batchOut[t * R + r] == soloOut[t]);
+                    }
+                    soloIn[r].swap(soloOut);
+                }
+                batchIn.swap(batchOut);
+            }
+        };
+
+        WHEN("the weights are read at double precision") {
+            THEN("every round agrees exactly, replicate by replicate") {
+                checkRounds(arena, false);
+            }
+        }
+        WHEN("the weights are read at single precision") {
+            arena.storeSinglePrecisionWeights();
+            THEN("every round agrees exactly, replicate by replicate") {
+                checkRounds(arena, true);
+            }
+        }
+    }
+}
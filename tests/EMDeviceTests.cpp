@@ -0,0 +1,90 @@
+#include <random>
+#include <string>
+#include <vector>
+#include "BootstrapEMUpdate.hpp"
+#include "EMDevice.hpp"
+#include "EMTestArena.hpp"
+
+namespace em_device_test {
+
+// Run the CPU EM rounds from, ..., to - 1 on alphas, with the counts of arena
+inline void cpuRounds(const EquivalenceClassArena& arena, size_t from, size_t to, std::vector<double>& alphas) {
+    salmon::optimizer::SingletonClasses split(arena, false);
+    split.setCounts(arena, arena.counts.data(), alphas.size());
+    std::vector<double> next(alphas.size());
+    for (size_t round = from; round < to; ++round) {
+        std::fill(next.begin(), next.end(), 0.0);
+        salmon::optimizer::EMUpdate_(arena, arena.counts, split, alphas, next);
+        alphas.swap(next);
+    }
+}
+
+}
+
+SCENARIO("The device EM runs the rounds that the CPU EM runs") {
+    using namespace em_device_test;
+    using em_test::numTxps;
+    const size_t numRounds = 20;
+    std::mt19937 gen(5);
+    std::uniform_int_distribution<uint64_t> countDist(0, 50);
+
+    std::string reason;
+    if (!salmon::gpu::EMDevice::available(reason)) {
+        GIVEN("No CUDA device (or a build without CUDA)") {
+            EquivalenceClassArena arena = em_test::testArena(gen, [&]() -> uint64_t { return 1 + countDist(gen); });
+            THEN("the reason is given") {
+                REQUIRE(!reason.empty());
+            }
+            WHEN("the rounds handed to the device continue on the CPU from the round it returns") {
+                std::vector<double> fallback(numTxps, 1.0), cpu(numTxps, 1.0);
+                salmon::gpu::EMDevice dev(arena, numTxps, false);
+                double maxRelDiff{0.0};
+                size_t next = dev.optimize(false, 0.0, 0, numRounds, numRounds, 0.0, 0.0, fallback, maxRelDiff);
+                cpuRounds(arena, next, numRounds, fallback);
+                cpuRounds(arena, 0, numRounds, cpu);
+                THEN("the abundances are those of the CPU EM") {
+                    REQUIRE(next == 0);
+                    for (size_t t = 0; t < numTxps; ++t) { REQUIRE(fallback[t] == cpu[t]); }
+                }
+            }
+        }
+        return;
+    }
+
+    GIVEN("An arena of single- and multi-transcript classes") {
+        const size_t R = 3;
+        EquivalenceClassArena arena = em_test::testArena(gen, [&]() -> uint64_t { return 1 + countDist(gen); });
+        const size_t numClasses = arena.numClasses();
+
+        WHEN("EM rounds run on the device and on the CPU") {
+            std::vector<double> device(numTxps, 1.0), cpu(numTxps, 1.0);
+            salmon::gpu::EMDevice dev(arena, numTxps, false);
+            double maxRelDiff{0.0};
+            REQUIRE(dev.optimize(false, 0.0, 0, numRounds, numRounds, 0.0, 0.0, device, maxRelDiff) == numRounds);
+            cpuRounds(arena, 0, numRounds, cpu);
+            THEN("the abundances agree") {
+                for (size_t t = 0; t < numTxps; ++t) { REQUIRE(device[t] == Approx(cpu[t])); }
+            }
+        }
+
+        WHEN("a batch of replicates runs on the device and on the CPU") {
+            std::vector<uint64_t> counts(numClasses * R);
+            for (auto& c : counts) { c = countDist(gen); }
+            std::vector<double> device(numTxps * R, 1.0), cpu(numTxps * R, 1.0), next(numTxps * R), denoms(R);
+            salmon::gpu::EMDevice dev(arena, numTxps, false);
+            dev.optimizeBatch(counts.data(), R, numRounds, numRounds, 0.0, 0.0, device);
+
+            salmon::optimizer::SingletonClasses split(arena, false);
+            split.setCounts(arena, counts.data(), numTxps, R);
+            for (size_t round = 0; round < numRounds; ++round) {
+                std::fill(next.begin(), next.end(), 0.0);
+                salmon::optimizer::batchEMUpdate_(arena, arena.combinedWeights.data(), counts, split, R,
+                                                  cpu, next, denoms);
+                cpu.swap(next);
+            }
+            THEN("the abundances of every replicate agree") {
+                for (size_t j = 0; j < numTxps * R; ++j) { REQUIRE(device[j] == Approx(cpu[j])); }
+            }
+        }
+    }
+}
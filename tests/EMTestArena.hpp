@@ -0,0 +1,35 @@
+#ifndef __EM_TEST_ARENA_HPP__
+#define __EM_TEST_ARENA_HPP__
+
+#include <random>
+#include <vector>
+#include "EquivalenceClassArena.hpp"
+
+namespace em_test {
+
+// The number of transcripts of the classes of testArena
+constexpr size_t numTxps = 6;
+
+/**
+ * An arena of single- and multi-transcript classes over numTxps
+ * transcripts, whose weights (also its combined weights) are drawn from
+ * gen, and the count of each class from countOf, after its weights.
+ */
+template <typename CountFn>
+EquivalenceClassArena testArena(std::mt19937& gen, CountFn countOf) {
+    std::vector<std::vector<uint32_t>> labels{
+        {0}, {0, 1}, {1, 2, 3}, {3}, {2, 4}, {4, 5}, {0, 3, 5}, {5}, {1, 4}};
+    std::uniform_real_distribution<double> weightDist(0.05, 1.0);
+    EquivalenceClassArena arena;
+    for (auto& l : labels) {
+        std::vector<double> w(l.size());
+        for (auto& x : w) { x = weightDist(gen); }
+        arena.addClass(l.begin(), l.end(), w.begin(), w.begin(), false, countOf());
+    }
+    arena.combinedWeights = arena.weights;
+    return arena;
+}
+
+}
+
+#endif // __EM_TEST_ARENA_HPP__
@@ -0,0 +1,79 @@
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <boost/filesystem.hpp>
+#include "EqLabelDictionary.hpp"
+
+SCENARIO("Dictionaries opened on the same file agree on the ids of labels") {
+    GIVEN("Two dictionaries on one (new) file") {
+        auto path = boost::filesystem::temp_directory_path() /
+                    boost::filesystem::unique_path("salmon-eq-labels-%%%%-%%%%.bin");
+        const uint64_t numTxps = 100;
+        std::vector<uint32_t> l1{1, 2, 3}, l2{4}, l3{2, 7, 9, 11}, l4{5, 6};
+        std::string err;
+        EqLabelDictionary a, b;
+        REQUIRE(a.open(path, numTxps, err));
+        REQUIRE(b.open(path, numTxps, err));
+        const uint64_t noId = EqLabelDictionary::noId();
+
+        WHEN("each adds labels, some of which the other has added") {
+            std::vector<uint64_t> idsA, idsB, idsA2;
+            REQUIRE(a.intern(std::vector<const std::vector<uint32_t>*>{&l1, &l2}, idsA, err));
+            REQUIRE(a.numAdded() == 2);
+            REQUIRE(b.intern(std::vector<const std::vector<uint32_t>*>{&l2, &l3}, idsB, err));
+            REQUIRE(b.numAdded() == 1);
+            REQUIRE(a.intern(std::vector<const std::vector<uint32_t>*>{&l3, &l4, &l1}, idsA2, err));
+            REQUIRE(a.numAdded() == 1);
+
+            THEN("a label has the same id in both, and each label is stored once") {
+                REQUIRE(idsA[0] != noId);
+                REQUIRE(idsA[1] != idsA[0]);
+                REQUIRE(idsB[0] == idsA[1]);
+                REQUIRE(idsA2[0] == idsB[1]);
+                REQUIRE(idsA2[2] == idsA[0]);
+                REQUIRE(a.size() == 4);
+                REQUIRE(a.label(idsA[0]) == l1);
+                REQUIRE(a.label(idsA[1]) == l2);
+                REQUIRE(a.label(idsB[1]) == l3);
+                REQUIRE(a.label(idsA2[1]) == l4);
+                REQUIRE(b.label(idsB[0]) == l2);
+                REQUIRE(b.label(idsB[1]) == l3);
+            }
+            AND_WHEN("the file is reopened") {
+                EqLabelDictionary c;
+                REQUIRE(c.open(path, numTxps, err));
+                std::vector<uint64_t> idsC;
+                REQUIRE(c.intern(std::vector<const std::vector<uint32_t>*>{&l4, &l3, &l2, &l1}, idsC, err));
+                THEN("every label keeps its id") {
+                    REQUIRE(c.size() == 4);
+                    REQUIRE(c.numAdded() == 0);
+                    REQUIRE(idsC == (std::vector<uint64_t>{idsA2[1], idsB[1], idsA[1], idsA[0]}));
+                }
+            }
+            AND_WHEN("a process dies part of the way through appending a record") {
+                std::FILE* f = std::fopen(path.string().c_str(), "ab");
+                uint32_t partial[3] = {10, 1, 2};
+                std::fwrite(partial, sizeof(uint32_t), 3, f);
+                std::fclose(f);
+                auto sizeBefore = boost::filesystem::file_size(path);
+
+                THEN("the partial record is dropped, and the next label takes its place") {
+                    std::vector<uint32_t> l5{42, 43, 44};
+                    std::vector<uint64_t> ids;
+                    REQUIRE(b.intern(std::vector<const std::vector<uint32_t>*>{&l5}, ids, err));
+                    REQUIRE(ids[0] == sizeBefore - 3 * sizeof(uint32_t));
+                    REQUIRE(b.label(ids[0]) == l5);
+                    REQUIRE(boost::filesystem::file_size(path) == sizeBefore + sizeof(uint32_t));
+                    REQUIRE(b.size() == 5);
+                }
+            }
+        }
+        WHEN("the file is opened for an index of a different size") {
+            EqLabelDictionary d;
+            THEN("it is refused") {
+                REQUIRE(!d.open(path, numTxps + 1, err));
+            }
+        }
+        boost::filesystem::remove(path);
+    }
+}
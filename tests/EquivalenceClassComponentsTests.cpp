@@ -0,0 +1,92 @@
+#include <algorithm>
+#include <random>
+#include <set>
+#include <vector>
+#include "EquivalenceClassComponents.hpp"
+
+namespace eq_class_components_test {
+
+inline void add(EquivalenceClassArena& a, std::vector<uint32_t> label) {
+    std::vector<double> weights(label.size(), 1.0);
+    a.addClass(label.begin(), label.end(), weights.begin(), weights.begin(), false, 1);
+}
+
+inline std::vector<uint32_t> classesOf(const EqClassComponents& comps, size_t c) {
+    return std::vector<uint32_t>(comps.classes.begin() + comps.classOffsets[c],
+                                 comps.classes.begin() + comps.classOffsets[c + 1]);
+}
+
+inline std::vector<uint32_t> txpsOf(const EqClassComponents& comps, size_t c) {
+    return std::vector<uint32_t>(comps.txps.begin() + comps.txpOffsets[c],
+                                 comps.txps.begin() + comps.txpOffsets[c + 1]);
+}
+
+}
+
+SCENARIO("Transcripts that share classes are in the same component") {
+    using namespace eq_class_components_test;
+    GIVEN("Classes over three groups of transcripts, an invalid class, and an unseen transcript") {
+        EquivalenceClassArena arena;
+        add(arena, {0, 1});
+        add(arena, {3});
+        add(arena, {4, 5});
+        add(arena, {1, 2});
+        add(arena, {5, 6, 7});
+        add(arena, {8, 9});
+        arena.valid[5] = 0;
+
+        WHEN("the components are built") {
+            auto comps = buildEqClassComponents(arena, 11);
+            THEN("each component holds its classes and transcripts, largest first") {
+                REQUIRE(comps.numComponents() == 3);
+                REQUIRE(classesOf(comps, 0) == (std::vector<uint32_t>{2, 4}));
+                REQUIRE(txpsOf(comps, 0) == (std::vector<uint32_t>{4, 5, 6, 7}));
+                REQUIRE(classesOf(comps, 1) == (std::vector<uint32_t>{0, 3}));
+                REQUIRE(txpsOf(comps, 1) == (std::vector<uint32_t>{0, 1, 2}));
+                REQUIRE(classesOf(comps, 2) == (std::vector<uint32_t>{1}));
+                REQUIRE(txpsOf(comps, 2) == (std::vector<uint32_t>{3}));
+            }
+        }
+    }
+    GIVEN("Many random classes") {
+        const size_t numTxps = 500;
+        std::mt19937 gen(23);
+        std::uniform_int_distribution<uint32_t> txp(0, numTxps - 1), len(1, 3);
+        EquivalenceClassArena arena;
+        for (size_t i = 0; i < 300; ++i) {
+            std::set<uint32_t> label;
+            for (size_t n = len(gen); label.size() < n;) { label.insert(txp(gen)); }
+            add(arena, std::vector<uint32_t>(label.begin(), label.end()));
+        }
+
+        WHEN("the components are built") {
+            auto comps = buildEqClassComponents(arena, numTxps);
+            THEN("every class is in the component of all of its transcripts, once") {
+                std::vector<size_t> componentOf(numTxps, comps.numComponents());
+                bool disjoint{true};
+                for (size_t c = 0; c < comps.numComponents(); ++c) {
+                    for (auto t : txpsOf(comps, c)) {
+                        disjoint = disjoint and componentOf[t] == comps.numComponents();
+                        componentOf[t] = c;
+                    }
+                }
+                REQUIRE(disjoint);
+                std::vector<size_t> size(comps.numComponents(), 0);
+                size_t numClasses{0};
+                bool inComponent{true};
+                for (size_t c = 0; c < comps.numComponents(); ++c) {
+                    for (auto eqID : classesOf(comps, c)) {
+                        ++numClasses;
+                        size[c] += arena.classSize(eqID);
+                        for (size_t i = arena.offsets[eqID]; i < arena.offsets[eqID + 1]; ++i) {
+                            inComponent = inComponent and componentOf[arena.labels[i]] == c;
+                        }
+                    }
+                }
+                REQUIRE(inComponent);
+                REQUIRE(numClasses == arena.numClasses());
+                REQUIRE(std::is_sorted(size.rbegin(), size.rend()));
+            }
+        }
+    }
+}
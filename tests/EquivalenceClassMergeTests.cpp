@@ -0,0 +1,94 @@
+#include <map>
+#include <vector>
+#include "EquivalenceClassMerge.hpp"
+
+namespace eq_class_merge_test {
+
+struct Class {
+    std::vector<double> weights;
+    std::vector<double> posWeights;
+    uint64_t count;
+};
+
+// A class's label, and whether it has positional weights
+using Key = std::pair<std::vector<uint32_t>, bool>;
+
+// The classes of an arena, by key
+inline std::map<Key, Class> classesOf(const EquivalenceClassArena& a) {
+    std::map<Key, Class> classes;
+    for (size_t i = 0; i < a.numClasses(); ++i) {
+        auto b = a.offsets[i], e = a.offsets[i + 1];
+        Key key(std::vector<uint32_t>(a.labels.begin() + b, a.labels.begin() + e), a.hasPosWeights[i] == 1);
+        REQUIRE(classes.count(key) == 0);
+        classes[key] = Class{std::vector<double>(a.weights.begin() + b, a.weights.begin() + e),
+                             std::vector<double>(a.posWeights.begin() + b, a.posWeights.begin() + e),
+                             a.counts[i]};
+    }
+    return classes;
+}
+
+inline void add(EquivalenceClassArena& a, std::vector<uint32_t> label, std::vector<double> weights,
+                uint64_t count, bool positional = false) {
+    a.addClass(label.begin(), label.end(), weights.begin(), weights.begin(), positional, count);
+}
+
+}
+
+SCENARIO("Rich equivalence classes with nearly the same weights are merged") {
+    using namespace eq_class_merge_test;
+    GIVEN("Classes that differ only by a transcript of little weight, and classes that don't") {
+        const double tolerance = 0.05;
+        EquivalenceClassArena in;
+        add(in, {0, 1}, {0.9, 0.1}, 10);
+        // within 0.04 of the first, through a transcript below the tolerance
+        add(in, {0, 1, 2}, {0.9, 0.08, 0.02}, 5);
+        // the same core, but far from the first
+        add(in, {0, 1, 4}, {0.5, 0.46, 0.04}, 4);
+        add(in, {3}, {1.0}, 7);
+        // weights like the first's, but positional
+        add(in, {0, 5}, {0.9, 0.1}, 3, true);
+
+        const Key near{{0, 1}, false}, merged{{0, 1, 2}, false}, far{{0, 1, 4}, false}, other{{3}, false},
+            positional{{0, 5}, true}, folded{{0, 1, 2, 4}, false};
+
+        WHEN("they are merged") {
+            auto out = classesOf(salmon::eqclass::ClassMerger(tolerance, 0).merge(in));
+            THEN("the near classes become one, with the union of their labels and their mean weights") {
+                REQUIRE(out.size() == 4);
+                REQUIRE(out.count(merged) == 1);
+                auto& c = out[merged];
+                REQUIRE(c.count == 15);
+                REQUIRE(c.weights[0] == Approx(0.9));
+                REQUIRE(c.weights[1] == Approx((1.0 + 0.4) / 15));
+                REQUIRE(c.weights[2] == Approx(0.1 / 15));
+            }
+            THEN("the far class, the other class, and the positional class are kept") {
+                REQUIRE(out[far].count == 4);
+                REQUIRE(out[far].weights[0] == Approx(0.5));
+                REQUIRE(out[other].count == 7);
+                REQUIRE(out[positional].count == 3);
+            }
+        }
+        WHEN("rare clusters are folded into the nearest with the same dominant transcript") {
+            auto out = classesOf(salmon::eqclass::ClassMerger(tolerance, 5).merge(in));
+            THEN("only the positional class, alone of its kind, stays rare") {
+                REQUIRE(out.size() == 3);
+                REQUIRE(out.count(folded) == 1);
+                auto& c = out[folded];
+                REQUIRE(c.count == 19);
+                REQUIRE(c.weights[0] == Approx((9.0 + 4.5 + 2.0) / 19));
+                REQUIRE(out[other].count == 7);
+                REQUIRE(out[positional].count == 3);
+                REQUIRE(out[positional].posWeights[0] == Approx(0.9));
+            }
+        }
+        WHEN("the tolerance is 0") {
+            auto out = classesOf(salmon::eqclass::ClassMerger(0.0, 0).merge(in));
+            THEN("no classes are merged") {
+                REQUIRE(out.size() == 5);
+                REQUIRE(out[merged].count == 5);
+                REQUIRE(out[near].count == 10);
+            }
+        }
+    }
+}
@@ -0,0 +1,86 @@
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "FragmentLengthDistribution.hpp"
+#include "SalmonMath.hpp"
+
+namespace fragment_length_distribution_test {
+
+// A (logged) probability in linear space; LOG_0 is +inf
+inline double linear(double logP) {
+    return (std::abs(logP) == salmon::math::LOG_0) ? 0.0 : std::exp(logP);
+}
+
+// The cmf of every length, summed directly from the pmf
+inline std::vector<double> directCMF(const FragmentLengthDistribution& fld) {
+    std::vector<double> cdf(fld.maxVal() + 1);
+    double cum{0.0};
+    for (size_t i = 0; i <= fld.maxVal(); ++i) {
+        cum += linear(fld.pmf(i));
+        cdf[i] = cum;
+    }
+    return cdf;
+}
+
+// Every length's cmf, from the tree and from the vector, is the direct one
+inline bool matchesDirectCMF(const FragmentLengthDistribution& fld) {
+    auto direct = directCMF(fld);
+    auto all = fld.cmf();
+    bool matched{all.size() == direct.size()};
+    for (size_t i = 0; matched and i < direct.size(); ++i) {
+        matched = linear(fld.cmf(i)) == Approx(direct[i]).epsilon(1e-9) and
+                  linear(all[i]) == Approx(direct[i]).epsilon(1e-9);
+    }
+    return matched;
+}
+
+}
+
+SCENARIO("The cmf read from the Fenwick tree is that of the histogram") {
+    using namespace fragment_length_distribution_test;
+    const size_t maxLen = 1000;
+    std::mt19937 gen(3);
+    std::normal_distribution<double> lenDist(250.0, 40.0);
+    auto randomLen = [&]() -> size_t { return std::min(maxLen, static_cast<size_t>(std::abs(lenDist(gen)))); };
+
+    for (size_t priorMu : {size_t(0), size_t(200)}) {
+        GIVEN("A distribution with a " + std::string(priorMu ? "Gaussian" : "uniform") + " prior") {
+            FragmentLengthDistribution fld(1.0, maxLen, priorMu, 50, 4, 0.5);
+            THEN("the cmf of the prior is the sum of its pmf") {
+                REQUIRE(matchesDirectCMF(fld));
+                REQUIRE(std::exp(fld.cmf(maxLen)) == Approx(1.0));
+            }
+            WHEN("lengths are added one at a time and in batches") {
+                for (size_t i = 0; i < 500; ++i) { fld.addVal(randomLen(), std::log(1.0 + i % 7)); }
+                std::vector<size_t> lens;
+                std::vector<uint32_t> counts(maxLen + 1, 0);
+                for (size_t i = 0; i < 300; ++i) {
+                    size_t l = randomLen();
+                    if (counts[l]++ == 0) { lens.push_back(l); }
+                }
+                std::vector<double> binMass;
+                fld.addVals(lens, counts, std::log(2.0), binMass);
+                THEN("the cmf is still the sum of the pmf") {
+                    REQUIRE(matchesDirectCMF(fld));
+                    REQUIRE(std::exp(fld.cmf(2 * maxLen)) == Approx(1.0));
+                }
+            }
+            WHEN("lengths are added from several threads at once") {
+                const size_t numThreads = 4;
+                std::vector<std::thread> threads;
+                for (size_t t = 0; t < numThreads; ++t) {
+                    threads.emplace_back([&fld, t, maxLen]() -> void {
+                        for (size_t i = 0; i < 2000; ++i) { fld.addVal((t * 131 + i * 17) % maxLen, 0.0); }
+                    });
+                }
+                for (auto& t : threads) { t.join(); }
+                THEN("no mass is lost from the tree") {
+                    REQUIRE(matchesDirectCMF(fld));
+                }
+            }
+        }
+    }
+}
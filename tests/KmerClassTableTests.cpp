@@ -0,0 +1,97 @@
+#include <algorithm>
+#include <map>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+#include "KmerClassTable.hpp"
+
+namespace kmer_class_table_test {
+
+// The 2-bit code of s[0, k), computed directly
+inline uint64_t codeOf(const std::string& s) {
+    uint64_t c{0};
+    for (char b : s) { c = (c << 2) | RollingKmerIndex::encode(b); }
+    return c;
+}
+
+inline std::string reverseComplement(const std::string& s) {
+    std::string rc(s.rbegin(), s.rend());
+    for (auto& b : rc) {
+        switch (b) {
+            case 'A': b = 'T'; break;
+            case 'C': b = 'G'; break;
+            case 'G': b = 'C'; break;
+            case 'T': b = 'A'; break;
+        }
+    }
+    return rc;
+}
+
+inline uint64_t canonicalOf(const std::string& kmer) {
+    return std::min(codeOf(kmer), codeOf(reverseComplement(kmer)));
+}
+
+}
+
+SCENARIO("The k-mer class table groups the k-mers by the transcripts that hold them") {
+    using namespace kmer_class_table_test;
+    GIVEN("Random transcripts that share segments, some with an N") {
+        const uint32_t k = 7;
+        std::mt19937 gen(11);
+        const char bases[] = "ACGT";
+        std::uniform_int_distribution<int> base(0, 3);
+        auto randomSeq = [&](size_t len) -> std::string {
+            std::string s(len, 'A');
+            for (auto& b : s) { b = bases[base(gen)]; }
+            return s;
+        };
+        std::string shared = randomSeq(40);
+        std::vector<std::string> txps{
+            randomSeq(200) + shared, shared + randomSeq(150), reverseComplement(shared) + randomSeq(60),
+            randomSeq(90) + "N" + randomSeq(90), randomSeq(5), randomSeq(300)};
+
+        // Every canonical k-mer, with the transcripts that hold it
+        std::map<uint64_t, std::set<uint32_t>> expected;
+        for (uint32_t t = 0; t < txps.size(); ++t) {
+            for (size_t i = 0; i + k <= txps[t].size(); ++i) {
+                std::string kmer = txps[t].substr(i, k);
+                if (kmer.find('N') != std::string::npos) { continue; }
+                expected[canonicalOf(kmer)].insert(t);
+            }
+        }
+
+        // (copied, as Catch takes the operands of a comparison by reference)
+        const uint32_t noClass = KmerClassTable::noClass;
+
+        WHEN("the table is built") {
+            KmerClassTable table(k);
+            table.build(txps.size(), [&txps](size_t i) -> std::pair<const char*, size_t> {
+                return std::make_pair(txps[i].data(), txps[i].size());
+            });
+
+            THEN("each k-mer's class holds exactly the transcripts that have the k-mer") {
+                REQUIRE(table.numKmers() == expected.size());
+                std::set<std::set<uint32_t>> labels;
+                for (auto& kv : expected) {
+                    uint32_t c = table.classOf(kv.first);
+                    REQUIRE(c != noClass);
+                    std::set<uint32_t> label(table.labelsBegin(c), table.labelsEnd(c));
+                    REQUIRE(label == kv.second);
+                    REQUIRE(std::is_sorted(table.labelsBegin(c), table.labelsEnd(c)));
+                    labels.insert(kv.second);
+                }
+                REQUIRE(table.numClasses() == labels.size());
+            }
+            THEN("a k-mer of no transcript has no class") {
+                size_t numAbsent{0};
+                while (numAbsent < 50) {
+                    uint64_t kmer = canonicalOf(randomSeq(k));
+                    if (expected.count(kmer)) { continue; }
+                    REQUIRE(table.classOf(kmer) == noClass);
+                    ++numAbsent;
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,84 @@
+#include <random>
+#include <vector>
+#include <boost/filesystem.hpp>
+#include "KmerIntervalMap.hpp"
+
+SCENARIO("The mapped k-mer interval table answers lookups as the cereal map does") {
+    GIVEN("A map from random k-mers to intervals, saved both ways") {
+        const uint32_t k = 11;
+        auto savedK = JFMer::k();
+        KmerIntervalMap built;
+        built.setK(k);
+
+        std::mt19937 gen(3);
+        std::uniform_int_distribution<uint32_t> base(0, 3);
+        std::uniform_int_distribution<uint64_t> pos(0, 1000000);
+        auto randomKmer = [&]() -> std::vector<uint8_t> {
+            std::vector<uint8_t> s(k);
+            for (auto& b : s) { b = static_cast<uint8_t>(base(gen)); }
+            return s;
+        };
+        std::vector<std::vector<uint8_t>> present, absent;
+        for (size_t i = 0; i < 1000; ++i) {
+            auto s = randomKmer();
+            KmerKey key(s.data(), k);
+            if (built.hasKmer(key)) { continue; }
+            bwtintv_t& intv = built[key];
+            intv.x[0] = pos(gen);
+            intv.x[1] = pos(gen);
+            intv.x[2] = 1 + (i % 17);
+            intv.info = i;
+            present.push_back(s);
+        }
+        while (absent.size() < 200) {
+            auto s = randomKmer();
+            KmerKey key(s.data(), k);
+            if (!built.hasKmer(key)) { absent.push_back(s); }
+        }
+
+        auto dir = boost::filesystem::temp_directory_path() /
+                   boost::filesystem::unique_path("salmon-kmer-intervals-%%%%-%%%%");
+        boost::filesystem::create_directories(dir);
+        built.save(dir / "aux.map");
+        REQUIRE(built.saveMapped(dir / "aux.tbl"));
+
+        WHEN("one map is loaded from the cereal file and another maps the table") {
+            KmerIntervalMap loaded, mapped;
+            loaded.load(dir / "aux.map");
+            REQUIRE(mapped.loadMapped(dir / "aux.tbl"));
+
+            THEN("they hold the same k-mers, with the same intervals") {
+                REQUIRE(mapped.isMapped());
+                REQUIRE(!loaded.isMapped());
+                REQUIRE(mapped.size() == present.size());
+                REQUIRE(loaded.size() == present.size());
+                for (auto& s : present) {
+                    KmerKey key(s.data(), k);
+                    const bwtintv_t* a = loaded.lookup(key);
+                    const bwtintv_t* b = mapped.lookup(key);
+                    REQUIRE(a != nullptr);
+                    REQUIRE(b != nullptr);
+                    REQUIRE(a->x[0] == b->x[0]);
+                    REQUIRE(a->x[1] == b->x[1]);
+                    REQUIRE(a->x[2] == b->x[2]);
+                    REQUIRE(a->info == b->info);
+                }
+                for (auto& s : absent) {
+                    KmerKey key(s.data(), k);
+                    REQUIRE(!loaded.hasKmer(key));
+                    REQUIRE(!mapped.hasKmer(key));
+                }
+            }
+        }
+        WHEN("the table is mapped for a different k") {
+            KmerIntervalMap other;
+            other.setK(k + 2);
+            THEN("it is refused") {
+                REQUIRE(!other.loadMapped(dir / "aux.tbl"));
+                REQUIRE(!other.isMapped());
+            }
+        }
+        boost::filesystem::remove_all(dir);
+        JFMer::k(savedK);
+    }
+}
@@ -0,0 +1,127 @@
+#include <fstream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <boost/filesystem.hpp>
+#include "MappedFastqReader.hpp"
+
+namespace mapped_fastq_reader_test {
+
+struct Record {
+    std::string header;
+    std::string seq;
+    std::string qual;
+};
+
+// numReads pairs of reads of varying length, some of whose qualities start with '@'
+inline std::vector<std::pair<Record, Record>> makePairs(size_t numReads) {
+    std::mt19937 gen(13);
+    std::uniform_int_distribution<int> base(0, 3), len(20, 90), qual(33, 73);
+    const char bases[] = "ACGT";
+    auto read = [&](const std::string& name) -> Record {
+        Record r;
+        r.header = name;
+        size_t n = len(gen);
+        for (size_t i = 0; i < n; ++i) {
+            r.seq += bases[base(gen)];
+            r.qual += static_cast<char>(qual(gen));
+        }
+        if (n % 3 == 0) { r.qual[0] = '@'; }
+        return r;
+    };
+    std::vector<std::pair<Record, Record>> pairs;
+    for (size_t i = 0; i < numReads; ++i) {
+        std::string name = "read" + std::to_string(i);
+        pairs.emplace_back(read(name + "/1"), read(name + "/2"));
+    }
+    return pairs;
+}
+
+inline void writeFastq(const boost::filesystem::path& path, const std::vector<Record>& recs, bool finalNewline = true) {
+    std::ofstream out(path.string(), std::ios::binary);
+    for (size_t i = 0; i < recs.size(); ++i) {
+        out << '@' << recs[i].header << '\n' << recs[i].seq << "\n+\n" << recs[i].qual;
+        if (finalNewline or i + 1 < recs.size()) { out << '\n'; }
+    }
+}
+
+}
+
+SCENARIO("Mapped paired FASTQ files are parsed in ranges of whole, paired records") {
+    using namespace mapped_fastq_reader_test;
+    GIVEN("Two mates' files of many reads") {
+        auto dir = boost::filesystem::temp_directory_path() /
+                   boost::filesystem::unique_path("salmon-mapped-fastq-%%%%-%%%%");
+        boost::filesystem::create_directories(dir);
+        auto f1 = dir / "r1.fq", f2 = dir / "r2.fq";
+        const size_t numReads = 500;
+        auto pairs = makePairs(numReads);
+        std::vector<Record> mates1, mates2;
+        for (auto& p : pairs) {
+            mates1.push_back(p.first);
+            mates2.push_back(p.second);
+        }
+
+        for (bool finalNewline : {true, false}) {
+            WHEN("they are split into small ranges, " +
+                 std::string(finalNewline ? "ending with a newline" : "without a final newline")) {
+                writeFastq(f1, mates1, finalNewline);
+                writeFastq(f2, mates2, finalNewline);
+                REQUIRE(salmon::io::MappedFastqPairReader::isMappable(f1.string().c_str()));
+                salmon::io::MappedFastqPairReader reader({{f1.string(), f2.string()}}, 1000);
+
+                THEN("the ranges hold every pair once, in order, with its mate") {
+                    REQUIRE(reader.ok());
+                    REQUIRE(reader.numRanges() > 10);
+                    salmon::io::MappedFastqPairReader::Range r;
+                    Record rec1, rec2;
+                    size_t i{0};
+                    bool matched{true};
+                    while (reader.nextRange(r)) {
+                        const char* p1 = r.begin1;
+                        const char* p2 = r.begin2;
+                        while (p1 < r.end1) {
+                            REQUIRE(p2 < r.end2);
+                            salmon::io::MappedFastqPairReader::parseRecord(p1, r.end1, rec1);
+                            salmon::io::MappedFastqPairReader::parseRecord(p2, r.end2, rec2);
+                            REQUIRE(i < numReads);
+                            matched = matched and rec1.header == mates1[i].header and rec1.seq == mates1[i].seq and
+                                      rec1.qual == mates1[i].qual and rec2.header == mates2[i].header and
+                                      rec2.seq == mates2[i].seq and rec2.qual == mates2[i].qual;
+                            ++i;
+                        }
+                        REQUIRE(p2 == r.end2);
+                    }
+                    REQUIRE(matched);
+                    REQUIRE(i == numReads);
+                }
+            }
+        }
+        WHEN("the mates' files hold different numbers of reads") {
+            writeFastq(f1, mates1);
+            writeFastq(f2, std::vector<Record>(mates2.begin(), mates2.end() - 1));
+            THEN("the reader refuses them") {
+                REQUIRE_THROWS_AS(salmon::io::MappedFastqPairReader({{f1.string(), f2.string()}}, 1000),
+                                  const std::runtime_error&);
+            }
+        }
+        WHEN("a record is wrapped over several lines") {
+            writeFastq(f1, mates1);
+            writeFastq(f2, mates2);
+            {
+                std::ofstream out(f1.string(), std::ios::binary | std::ios::app);
+                out << "@wrapped/1\nACGT\nACGT\n+\nIIII\nIIII\n";
+            }
+            {
+                std::ofstream out(f2.string(), std::ios::binary | std::ios::app);
+                out << "@wrapped/2\nACGTACGT\n+\nIIIIIIII\n";
+            }
+            salmon::io::MappedFastqPairReader reader({{f1.string(), f2.string()}}, 1000);
+            THEN("the files are left to the stream parser") {
+                REQUIRE(!reader.ok());
+            }
+        }
+        boost::filesystem::remove_all(dir);
+    }
+}
@@ -0,0 +1,160 @@
+#include <string>
+#include <vector>
+#include <boost/filesystem.hpp>
+#include "MappingCache.hpp"
+
+namespace mapping_cache_test {
+
+// The mate status of a mapping, numbered as RapMap numbers it
+enum class MateStatus : uint8_t { SINGLE_END = 0, PAIRED_END_LEFT = 1, PAIRED_END_RIGHT = 2, PAIRED_END_PAIRED = 3 };
+
+// The fields of a quasi-mapping that PackedHit stores
+struct Hit {
+    uint32_t tid{0};
+    int32_t pos{0};
+    int32_t matePos{0};
+    uint32_t fragLen{0};
+    bool fwd{false};
+    bool mateIsFwd{false};
+    bool isPaired{false};
+    MateStatus mateStatus{MateStatus::SINGLE_END};
+    LibraryFormat format{ReadType::SINGLE_END, ReadOrientation::NONE, ReadStrandedness::U};
+};
+
+struct Group {
+    std::vector<Hit>& alignments() { return alns; }
+    void clearAlignments() { alns.clear(); }
+    std::vector<Hit> alns;
+};
+
+inline Hit makeHit(uint32_t tid, int32_t pos, int32_t matePos, uint32_t fragLen, bool fwd, bool mateIsFwd,
+                   MateStatus status, LibraryFormat format) {
+    Hit h;
+    h.tid = tid;
+    h.pos = pos;
+    h.matePos = matePos;
+    h.fragLen = fragLen;
+    h.fwd = fwd;
+    h.mateIsFwd = mateIsFwd;
+    h.isPaired = (status == MateStatus::PAIRED_END_PAIRED);
+    h.mateStatus = status;
+    h.format = format;
+    return h;
+}
+
+inline bool sameHit(const Hit& a, const Hit& b) {
+    return a.tid == b.tid and a.pos == b.pos and a.matePos == b.matePos and a.fragLen == b.fragLen and
+           a.fwd == b.fwd and a.mateIsFwd == b.mateIsFwd and a.isPaired == b.isPaired and
+           a.mateStatus == b.mateStatus and a.format == b.format;
+}
+
+}
+
+SCENARIO("Mappings survive packing into a PackedHit") {
+    using namespace mapping_cache_test;
+    GIVEN("Mappings with every mate status, strand and library format") {
+        std::vector<LibraryFormat> formats{
+            LibraryFormat(ReadType::SINGLE_END, ReadOrientation::NONE, ReadStrandedness::U),
+            LibraryFormat(ReadType::SINGLE_END, ReadOrientation::NONE, ReadStrandedness::SA),
+            LibraryFormat(ReadType::PAIRED_END, ReadOrientation::TOWARD, ReadStrandedness::SA),
+            LibraryFormat(ReadType::PAIRED_END, ReadOrientation::AWAY, ReadStrandedness::AS),
+            LibraryFormat(ReadType::PAIRED_END, ReadOrientation::SAME, ReadStrandedness::U)};
+        std::vector<MateStatus> statuses{MateStatus::SINGLE_END, MateStatus::PAIRED_END_LEFT,
+                                         MateStatus::PAIRED_END_RIGHT, MateStatus::PAIRED_END_PAIRED};
+        std::vector<Hit> hits;
+        uint32_t tid{0};
+        for (auto& f : formats) {
+            for (auto s : statuses) {
+                hits.push_back(makeHit(tid, -17 + tid, 4000 + tid, 250 + tid, tid % 2 == 0, tid % 3 == 0, s, f));
+                ++tid;
+            }
+        }
+        hits.push_back(makeHit(0xFFFFFFFE, -2147483647, 2147483647, 0xFFFF, true, true,
+                               MateStatus::PAIRED_END_PAIRED, formats[2]));
+
+        WHEN("each is packed and unpacked") {
+            THEN("every field comes back unchanged") {
+                for (auto& h : hits) {
+                    Hit back;
+                    PackedHit::pack(h).unpack(back);
+                    REQUIRE(sameHit(h, back));
+                }
+            }
+        }
+        WHEN("the fragment length is longer than 16 bits can hold") {
+            Hit h = hits.front();
+            h.fragLen = 100000;
+            Hit back;
+            PackedHit::pack(h).unpack(back);
+            THEN("it saturates at 0xFFFF") {
+                REQUIRE(back.fragLen == 0xFFFF);
+            }
+        }
+    }
+}
+
+SCENARIO("The mapping cache reads back the mini-batches that were written") {
+    using namespace mapping_cache_test;
+    GIVEN("Two mini-batches, with some fragments that didn't map") {
+        LibraryFormat pe(ReadType::PAIRED_END, ReadOrientation::TOWARD, ReadStrandedness::U);
+        std::vector<std::vector<Group>> batches(2);
+        batches[0].resize(4);
+        auto paired = [&pe](uint32_t tid, int32_t pos, int32_t matePos, uint32_t fragLen) {
+            return makeHit(tid, pos, matePos, fragLen, true, false, MateStatus::PAIRED_END_PAIRED, pe);
+        };
+        batches[0][0].alns.push_back(paired(1, 10, 200, 300));
+        batches[0][0].alns.push_back(paired(2, 15, 205, 300));
+        batches[0][2].alns.push_back(makeHit(7, 0, 0, 0, false, false, MateStatus::PAIRED_END_LEFT, pe));
+        batches[0][3].alns.push_back(makeHit(3, 99, 400, 311, false, true, MateStatus::PAIRED_END_PAIRED, pe));
+        batches[1].resize(2);
+        batches[1][1].alns.push_back(paired(5, 1, 180, 250));
+        batches[1][1].alns.push_back(paired(6, 2, 181, 250));
+        batches[1][1].alns.push_back(paired(8, 3, 182, 250));
+        std::vector<std::vector<std::string>> headers{
+            {"frag0/1 extra", "frag1/1", "frag2\tdesc", "frag3/2"}, {"frag4", "frag5/1"}};
+        std::vector<std::vector<std::string>> expectedNames{{"frag0", "frag2", "frag3"}, {"frag5"}};
+        std::vector<uint32_t> numObserved{4, 2};
+
+        auto path = boost::filesystem::temp_directory_path() /
+                    boost::filesystem::unique_path("salmon-mapping-cache-%%%%-%%%%.bin");
+
+        for (bool withNames : {false, true}) {
+            WHEN("they are written " + std::string(withNames ? "with" : "without") + " the fragment names") {
+                {
+                    MappingCacheWriter writer(path, withNames);
+                    for (size_t b = 0; b < batches.size(); ++b) {
+                        auto& hs = headers[b];
+                        writer.writeMiniBatch(batches[b].begin(), batches[b].end(), numObserved[b],
+                                              [&hs](size_t i) -> std::string { return hs[i]; });
+                    }
+                    REQUIRE(writer.good());
+                    writer.close();
+                }
+                MappingCacheReader reader(path);
+
+                THEN("each mini-batch holds the mapped fragments in order, and then the cache is exhausted") {
+                    REQUIRE(reader.hasNames() == withNames);
+                    std::vector<Group> groups;
+                    uint32_t observed{0}, mapped{0};
+                    for (size_t b = 0; b < batches.size(); ++b) {
+                        REQUIRE(reader.readMiniBatch(groups, observed, mapped));
+                        REQUIRE(observed == numObserved[b]);
+                        REQUIRE(mapped == expectedNames[b].size());
+                        size_t g{0};
+                        for (auto& expected : batches[b]) {
+                            if (expected.alns.empty()) { continue; }
+                            REQUIRE(groups[g].alns.size() == expected.alns.size());
+                            for (size_t j = 0; j < expected.alns.size(); ++j) {
+                                REQUIRE(sameHit(groups[g].alns[j], expected.alns[j]));
+                            }
+                            ++g;
+                        }
+                        if (withNames) { REQUIRE(reader.names() == expectedNames[b]); }
+                    }
+                    REQUIRE(!reader.readMiniBatch(groups, observed, mapped));
+                }
+                boost::filesystem::remove(path);
+            }
+        }
+    }
+}
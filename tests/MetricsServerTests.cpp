@@ -0,0 +1,99 @@
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <boost/asio.hpp>
+#include "MetricsServer.hpp"
+
+namespace metrics_server_test {
+
+// The line of the rendered metrics that gives name's value ("" if there's none)
+inline std::string sampleLine(const std::string& rendered, const std::string& name) {
+    std::istringstream in(rendered);
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.compare(0, name.size() + 1, name + " ") == 0) { return line; }
+    }
+    return std::string();
+}
+
+// The whole reply of the server on port to a request of method for target
+inline std::string request(uint16_t port, const std::string& method, const std::string& target) {
+    using boost::asio::ip::tcp;
+    boost::asio::io_service io;
+    tcp::socket socket(io);
+    socket.connect(tcp::endpoint(boost::asio::ip::address::from_string("127.0.0.1"), port));
+    std::string req = method + " " + target + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    boost::asio::write(socket, boost::asio::buffer(req));
+    boost::asio::streambuf reply;
+    boost::system::error_code err;
+    boost::asio::read(socket, reply, boost::asio::transfer_all(), err);
+    return std::string(boost::asio::buffers_begin(reply.data()), boost::asio::buffers_end(reply.data()));
+}
+
+}
+
+SCENARIO("The metrics are rendered in the Prometheus text format") {
+    using namespace metrics_server_test;
+    GIVEN("A registry of set, added and sampled metrics, during a phase of the run") {
+        auto profiler = std::make_shared<RunProfiler>();
+        salmon::metrics::Registry registry(profiler);
+        RunProfiler::Phase mapping(profiler.get(), "mapping");
+        RunProfiler::Phase batch(profiler.get(), "batch");
+        registry.set("salmon_em_iteration", 12);
+        registry.add("salmon_bootstraps_completed_total", 2);
+        registry.add("salmon_bootstraps_completed_total", 3);
+        registry.set("salmon_em_max_rel_diff", std::numeric_limits<double>::infinity());
+        std::atomic<uint64_t> observed{100};
+        auto registration = registry.sample("salmon_fragments_observed_total",
+                                            [&observed]() -> double { return observed.load(); });
+
+        WHEN("the metrics are rendered") {
+            observed = 250;
+            auto rendered = registry.render();
+            THEN("each metric has its type and value, and the phase is that of the profiler") {
+                REQUIRE(sampleLine(rendered, "salmon_em_iteration") == "salmon_em_iteration 12");
+                REQUIRE(sampleLine(rendered, "salmon_bootstraps_completed_total") ==
+                        "salmon_bootstraps_completed_total 5");
+                REQUIRE(sampleLine(rendered, "salmon_em_max_rel_diff") == "salmon_em_max_rel_diff +Inf");
+                REQUIRE(sampleLine(rendered, "salmon_fragments_observed_total") ==
+                        "salmon_fragments_observed_total 250");
+                REQUIRE(rendered.find("# TYPE salmon_fragments_observed_total counter\n") != std::string::npos);
+                REQUIRE(rendered.find("# TYPE salmon_em_iteration gauge\n") != std::string::npos);
+                REQUIRE(rendered.find("salmon_phase{phase=\"mapping/batch\"} 1\n") != std::string::npos);
+            }
+        }
+        WHEN("the registration of a sampled metric is dropped") {
+            observed = 300;
+            registration.reset();
+            observed = 400;
+            THEN("the metric keeps its last sampled value") {
+                REQUIRE(sampleLine(registry.render(), "salmon_fragments_observed_total") ==
+                        "salmon_fragments_observed_total 300");
+            }
+        }
+    }
+}
+
+SCENARIO("The metrics are served over HTTP") {
+    using namespace metrics_server_test;
+    GIVEN("A server on a port of its choosing") {
+        auto registry = std::make_shared<salmon::metrics::Registry>(nullptr);
+        registry->set("salmon_em_iteration", 7);
+        salmon::metrics::Server server(registry, "127.0.0.1", 0);
+        REQUIRE(server.port() != 0);
+
+        THEN("GET /metrics is answered with the rendered metrics") {
+            auto reply = request(server.port(), "GET", "/metrics?x=1");
+            REQUIRE(reply.compare(0, 15, "HTTP/1.1 200 OK") == 0);
+            REQUIRE(reply.find("\r\n\r\n# HELP ") != std::string::npos);
+            REQUIRE(reply.find("\nsalmon_em_iteration 7\n") != std::string::npos);
+            REQUIRE(reply.find("salmon_phase{phase=\"\"} 1\n") != std::string::npos);
+        }
+        THEN("other targets and methods are refused") {
+            REQUIRE(request(server.port(), "GET", "/").compare(0, 22, "HTTP/1.1 404 Not Found") == 0);
+            REQUIRE(request(server.port(), "POST", "/metrics").compare(0, 21, "HTTP/1.1 405 Method N") == 0);
+        }
+    }
+}
@@ -0,0 +1,79 @@
+#include <algorithm>
+#include <vector>
+#include "MultinomialSampler.hpp"
+
+SCENARIO("Multinomial samples have the multinomial moments") {
+    GIVEN("Five categories, and a sampler with a fixed seed") {
+        std::vector<double> probs{0.1, 0.2, 0.3, 0.15, 0.25};
+        const uint32_t k = probs.size();
+        const size_t numSamples = 20000;
+        MultinomialSampler sampler(42u);
+
+        // Draw numSamples samples of n trials, returning the totals drawn
+        // and filling in the mean and variance of each category's count
+        auto draw = [&](uint32_t n, std::vector<double>& means, std::vector<double>& vars) {
+            std::vector<uint64_t> sample(k);
+            std::vector<double> sum(k, 0.0), sumSq(k, 0.0);
+            std::vector<uint64_t> totals;
+            for (size_t s = 0; s < numSamples; ++s) {
+                sampler(sample.begin(), n, k, probs.begin());
+                uint64_t total{0};
+                for (uint32_t i = 0; i < k; ++i) {
+                    sum[i] += sample[i];
+                    sumSq[i] += static_cast<double>(sample[i]) * sample[i];
+                    total += sample[i];
+                }
+                totals.push_back(total);
+            }
+            means.resize(k);
+            vars.resize(k);
+            for (uint32_t i = 0; i < k; ++i) {
+                means[i] = sum[i] / numSamples;
+                vars[i] = (sumSq[i] - numSamples * means[i] * means[i]) / (numSamples - 1);
+            }
+            return totals;
+        };
+
+        auto checkMoments = [&](uint32_t n, const std::vector<double>& means, const std::vector<double>& vars) {
+            for (uint32_t i = 0; i < k; ++i) {
+                REQUIRE(means[i] == Approx(n * probs[i]).epsilon(0.03));
+                REQUIRE(vars[i] == Approx(n * probs[i] * (1.0 - probs[i])).epsilon(0.06));
+            }
+        };
+
+        WHEN("there are few trials per category (each trial drawn from the cumulative distribution)") {
+            const uint32_t n = 10;
+            std::vector<double> means, vars;
+            auto totals = draw(n, means, vars);
+            THEN("every sample has n trials, and the counts have mean np and variance np(1 - p)") {
+                REQUIRE(static_cast<size_t>(std::count(totals.begin(), totals.end(), n)) == numSamples);
+                checkMoments(n, means, vars);
+            }
+        }
+
+        WHEN("there are many trials per category (drawn as conditional binomials)") {
+            const uint32_t n = 1000;
+            std::vector<double> means, vars;
+            auto totals = draw(n, means, vars);
+            THEN("every sample has n trials, and the counts have mean np and variance np(1 - p)") {
+                REQUIRE(static_cast<size_t>(std::count(totals.begin(), totals.end(), n)) == numSamples);
+                checkMoments(n, means, vars);
+            }
+        }
+
+        WHEN("the probabilities sum to less than 1, with many trials per category") {
+            for (auto& p : probs) { p *= 0.8; }
+            const uint32_t n = 1000;
+            std::vector<double> means, vars;
+            auto totals = draw(n, means, vars);
+            THEN("the trials of the missing mass are discarded") {
+                double meanTotal{0.0};
+                for (auto t : totals) { meanTotal += t; }
+                REQUIRE(*std::max_element(totals.begin(), totals.end()) <= n);
+                meanTotal /= numSamples;
+                REQUIRE(meanTotal == Approx(0.8 * n).epsilon(0.01));
+                checkMoments(n, means, vars);
+            }
+        }
+    }
+}
@@ -0,0 +1,56 @@
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <boost/filesystem.hpp>
+#include "ParallelTextWriter.hpp"
+
+namespace parallel_text_writer_test {
+
+// A row of varying length, as quant.sf's are
+inline void formatRow(size_t i, fmt::MemoryWriter& w) {
+    w.write("txp{}\t{}\t{:.4f}\t{}\n", i, 100 + (i * 7919) % 5000, i * 0.37, std::string(i % 13, 'x'));
+}
+
+inline std::string serialRows(const std::string& header, size_t numRows) {
+    fmt::MemoryWriter w;
+    w << header;
+    for (size_t i = 0; i < numRows; ++i) { formatRow(i, w); }
+    return w.str();
+}
+
+inline std::string readFile(const boost::filesystem::path& path) {
+    std::ifstream in(path.string(), std::ios::binary);
+    std::ostringstream s;
+    s << in.rdbuf();
+    return s.str();
+}
+
+}
+
+SCENARIO("The parallel text writer writes exactly what formatting the rows in turn gives") {
+    using namespace parallel_text_writer_test;
+    GIVEN("A header, and row counts that end within the first chunk, the first wave and a later wave") {
+        auto path = boost::filesystem::temp_directory_path() /
+                    boost::filesystem::unique_path("salmon-parallel-text-%%%%-%%%%.txt");
+        const std::string header = "Name\tLength\tTPM\tNote\n";
+        const size_t waveRows = ParallelTextWriter::chunkRows() * ParallelTextWriter::chunksPerWave();
+
+        for (size_t numRows : {size_t(0), size_t(5), 3 * ParallelTextWriter::chunkRows() + 11, waveRows + 7}) {
+            WHEN("the file has " + std::to_string(numRows) + " rows") {
+                {
+                    ParallelTextWriter out(path);
+                    out.write(header);
+                    out.writeRows(numRows, [](size_t i, fmt::MemoryWriter& w) -> void { formatRow(i, w); });
+                    REQUIRE(out.close());
+                }
+                THEN("it is byte for byte the serial output") {
+                    std::string written = readFile(path);
+                    std::string expected = serialRows(header, numRows);
+                    REQUIRE(written.size() == expected.size());
+                    REQUIRE(written == expected);
+                }
+                boost::filesystem::remove(path);
+            }
+        }
+    }
+}
@@ -0,0 +1,131 @@
+#include <sstream>
+#include <string>
+#include <vector>
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/copy.hpp>
+#include <boost/iostreams/device/file.hpp>
+#include "PosteriorWriter.hpp"
+
+namespace posterior_writer_test {
+
+// Reads the fields of a decompressed posteriors file in order
+struct Cursor {
+    explicit Cursor(const std::string& s) : bytes(s) {}
+
+    template <typename T>
+    T fixed() {
+        T v;
+        std::memcpy(&v, bytes.data() + pos, sizeof(T));
+        pos += sizeof(T);
+        return v;
+    }
+
+    uint64_t varint() {
+        uint64_t v{0};
+        for (uint32_t shift = 0;; shift += 7) {
+            uint8_t b = static_cast<uint8_t>(bytes[pos++]);
+            v |= static_cast<uint64_t>(b & 0x7F) << shift;
+            if (!(b & 0x80)) { break; }
+        }
+        return v;
+    }
+
+    std::string str(size_t n) {
+        std::string s = bytes.substr(pos, n);
+        pos += n;
+        return s;
+    }
+
+    const std::string& bytes;
+    size_t pos{0};
+};
+
+inline std::string readDecompressed(const boost::filesystem::path& path) {
+    boost::iostreams::filtering_istream in;
+    in.push(boost::iostreams::gzip_decompressor());
+    in.push(boost::iostreams::file_source(path.string(), std::ios_base::in | std::ios_base::binary));
+    std::ostringstream out;
+    boost::iostreams::copy(in, out);
+    return out.str();
+}
+
+}
+
+SCENARIO("The posteriors file has the documented layout") {
+    using namespace posterior_writer_test;
+    GIVEN("A header and two blocks of fragments") {
+        auto path = boost::filesystem::temp_directory_path() /
+                    boost::filesystem::unique_path("salmon-posteriors-%%%%-%%%%.gz");
+        std::vector<std::string> txpNames{"txA", "txB", "a-longer-transcript-name"};
+        // A name longer than 127 bytes, and a transcript gap of more than
+        // 127, take varints of two bytes
+        std::string longName(200, 'r');
+        // (copied, since Catch takes the operands of a comparison by reference)
+        const uint32_t version = PosteriorWriter::version;
+        const uint16_t probScale = PosteriorWriter::probScale;
+        {
+            PosteriorWriter writer(path);
+            writer.writeHeader(txpNames);
+            {
+                PosteriorBlock block(&writer);
+                block.add("frag1", {2}, {1.0});
+                block.add(longName, {5, 300, 301}, {0.5, 0.5 - 1e-6, 1e-6});
+            }
+            {
+                PosteriorBlock block(&writer);
+                block.add("frag3", {0, 1}, {0.25, 0.75});
+            }
+            REQUIRE(writer.good());
+            writer.close();
+        }
+
+        WHEN("the file is decompressed") {
+            std::string bytes = readDecompressed(path);
+            Cursor c(bytes);
+
+            THEN("the header names the transcripts") {
+                REQUIRE(c.str(8) == std::string(PosteriorWriter::magic(), 8));
+                REQUIRE(c.fixed<uint32_t>() == version);
+                REQUIRE(c.fixed<uint32_t>() == txpNames.size());
+                for (auto& n : txpNames) {
+                    uint32_t len = c.fixed<uint32_t>();
+                    REQUIRE(c.str(len) == n);
+                }
+
+                AND_THEN("each fragment has its name, its delta-coded transcripts and quantised probabilities") {
+                    REQUIRE(c.fixed<uint32_t>() == 2);
+                    // frag1: every byte of the record
+                    REQUIRE(bytes.substr(c.pos, 10) == std::string("\x05" "frag1" "\x01" "\x02" "\xFF\xFF", 10));
+                    REQUIRE(c.varint() == 5);
+                    REQUIRE(c.str(5) == "frag1");
+                    REQUIRE(c.varint() == 1);
+                    REQUIRE(c.varint() == 2);
+                    REQUIRE(c.fixed<uint16_t>() == probScale);
+
+                    // The long name's length is the two-byte varint 0xC8 0x01
+                    REQUIRE(static_cast<uint8_t>(bytes[c.pos]) == 0xC8);
+                    REQUIRE(static_cast<uint8_t>(bytes[c.pos + 1]) == 0x01);
+                    REQUIRE(c.varint() == longName.size());
+                    REQUIRE(c.str(longName.size()) == longName);
+                    // the probability of transcript 301 rounds to 0, so it is left out
+                    REQUIRE(c.varint() == 2);
+                    REQUIRE(c.varint() == 5);
+                    REQUIRE(c.fixed<uint16_t>() == 32768);
+                    REQUIRE(c.varint() == 295);
+                    REQUIRE(c.fixed<uint16_t>() == 32767);
+
+                    REQUIRE(c.fixed<uint32_t>() == 1);
+                    REQUIRE(c.varint() == 5);
+                    REQUIRE(c.str(5) == "frag3");
+                    REQUIRE(c.varint() == 2);
+                    REQUIRE(c.varint() == 0);
+                    REQUIRE(c.fixed<uint16_t>() == 16384);
+                    REQUIRE(c.varint() == 1);
+                    REQUIRE(c.fixed<uint16_t>() == 49151);
+                    REQUIRE(c.pos == bytes.size());
+                }
+            }
+        }
+        boost::filesystem::remove(path);
+    }
+}
@@ -0,0 +1,81 @@
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <boost/filesystem.hpp>
+#include "ReadaheadFile.hpp"
+
+namespace readahead_file_test {
+
+inline std::string randomBytes(size_t n) {
+    std::mt19937 gen(17);
+    std::uniform_int_distribution<int> byte(0, 255);
+    std::string s(n, '\0');
+    for (auto& c : s) { c = static_cast<char>(byte(gen)); }
+    return s;
+}
+
+inline void writeFile(const boost::filesystem::path& path, const std::string& bytes) {
+    std::ofstream out(path.string(), std::ios::binary);
+    out.write(bytes.data(), bytes.size());
+}
+
+}
+
+SCENARIO("A file read ahead gives its bytes in order") {
+    using namespace readahead_file_test;
+    GIVEN("Files that are empty, a whole number of blocks, and longer than the ring") {
+        const size_t blockBytes = 4096;
+        auto path = boost::filesystem::temp_directory_path() /
+                    boost::filesystem::unique_path("salmon-readahead-%%%%-%%%%.bin");
+
+        for (size_t size : {size_t(0), size_t(10), 2 * blockBytes, 37 * blockBytes + 123}) {
+            WHEN("a file of " + std::to_string(size) + " bytes is read in pieces of odd sizes") {
+                std::string bytes = randomBytes(size);
+                writeFile(path, bytes);
+                std::atomic<uint64_t> waitNs{0};
+                std::string read;
+                {
+                    ReadaheadFile file(path.string(), 3 * blockBytes, &waitNs, blockBytes);
+                    std::vector<char> buf(1000);
+                    std::streamsize n;
+                    size_t piece{0};
+                    while ((n = file.read(buf.data(), 1 + (piece++ * 397) % buf.size())) > 0) {
+                        read.append(buf.data(), n);
+                    }
+                    REQUIRE(n == -1);
+                }
+                THEN("the bytes are those of the file") {
+                    REQUIRE(read.size() == bytes.size());
+                    REQUIRE(read == bytes);
+                }
+            }
+        }
+        WHEN("the reader stops before the end of the file") {
+            writeFile(path, randomBytes(64 * blockBytes));
+            char buf[100];
+            THEN("the file can be destroyed while the ring is full") {
+                ReadaheadFile file(path.string(), 2 * blockBytes, nullptr, blockBytes);
+                REQUIRE(file.read(buf, sizeof(buf)) == static_cast<std::streamsize>(sizeof(buf)));
+            }
+        }
+        WHEN("the file is read through a pipe") {
+            std::string bytes = randomBytes(21 * blockBytes + 5);
+            writeFile(path, bytes);
+            std::string read;
+            {
+                ReadaheadPipe pipe(path.string(), 4 * blockBytes, nullptr);
+                {
+                    std::ifstream in(pipe.path(), std::ios::binary);
+                    std::ostringstream s;
+                    s << in.rdbuf();
+                    read = s.str();
+                }
+            }
+            THEN("the reader of the pipe gets the bytes of the file") {
+                REQUIRE(read == bytes);
+            }
+        }
+        boost::filesystem::remove(path);
+    }
+}
@@ -0,0 +1,38 @@
+#include "SalmonMath.hpp"
+
+SCENARIO("logSumExp agrees with folding the values with logAdd") {
+    std::vector<double> vals{-3.5, -0.25, -12.0, -1.0, -700.0, -0.25};
+    GIVEN("The log-space values of a single fragment's alignments") {
+        double expected = salmon::math::LOG_0;
+        for (auto v : vals) { expected = salmon::math::logAdd(expected, v); }
+        WHEN("they are summed with logSumExp") {
+            double result = salmon::math::logSumExp(vals.data(), vals.size());
+            THEN("the result is " + std::to_string(expected)) {
+                REQUIRE(result == Approx(expected));
+            }
+        }
+    }
+    GIVEN("No values") {
+        THEN("the sum is LOG_0") {
+            REQUIRE(salmon::math::logSumExp(vals.data(), 0) == salmon::math::LOG_0);
+        }
+    }
+}
+
+SCENARIO("digamma and expDigamma agree with their direct evaluation") {
+    // Reference values of psi(x) (to 15 significant digits)
+    std::vector<std::pair<double, double>> refVals{
+        {0.01, -100.560885457869}, {0.5, -1.96351002602142},
+        {1.0, -0.577215664901533}, {7.5, 1.94675748424609},
+        {1000.0, 6.90725519564881}};
+    GIVEN("Arguments spanning small and large abundances") {
+        for (auto& rv : refVals) {
+            double x = rv.first;
+            THEN("digamma(" + std::to_string(x) + ") is " + std::to_string(rv.second)) {
+                REQUIRE(salmon::math::digamma(x) == Approx(rv.second).epsilon(1e-12));
+                REQUIRE(salmon::math::expDigamma(x) ==
+                        Approx(std::exp(rv.second)).epsilon(1e-10));
+            }
+        }
+    }
+}
@@ -0,0 +1,138 @@
+#include <cstdint>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <boost/filesystem.hpp>
+#include "SharedIndexSegment.hpp"
+
+namespace shared_index_segment_test {
+
+inline std::string randomBytes(size_t n, uint32_t seed) {
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int> byte(0, 255);
+    std::string s(n, '\0');
+    for (auto& c : s) { c = static_cast<char>(byte(gen)); }
+    return s;
+}
+
+inline void writeFile(const boost::filesystem::path& path, const std::string& bytes) {
+    std::ofstream out(path.string(), std::ios::binary);
+    out.write(bytes.data(), bytes.size());
+}
+
+// The contents of component in seg, as a string
+inline std::string contentsOf(const SharedIndexSegment& seg, const std::string& component) {
+    size_t size{0};
+    const char* p = seg.find(component, size);
+    return p ? std::string(p, size) : std::string("<missing>");
+}
+
+// Whether each component in seg holds its bytes, at a page-aligned address
+inline bool holds(const SharedIndexSegment& seg, const std::vector<std::string>& components,
+                  const std::vector<std::string>& bytes) {
+    bool ok{true};
+    for (size_t i = 0; i < components.size(); ++i) {
+        size_t size{0};
+        const char* p = seg.find(components[i], size);
+        ok = ok and p != nullptr and reinterpret_cast<uintptr_t>(p) % 4096 == 0 and
+             contentsOf(seg, components[i]) == bytes[i];
+    }
+    return ok;
+}
+
+// Whether the lock of the segment called name exists
+inline bool lockExists(const std::string& name) {
+    std::string lock = (name[0] == '/') ? name + ".lock" : "/dev/shm/salmon." + name + ".lock";
+    return boost::filesystem::exists(lock);
+}
+
+// Remove the segment called name, and its lock
+inline void removeSegment(const std::string& name) {
+    if (name[0] == '/') {
+        ::unlink(name.c_str());
+        ::unlink((name + ".lock").c_str());
+    } else {
+        ::shm_unlink(("/salmon." + name).c_str());
+        ::shm_unlink(("/salmon." + name + ".lock").c_str());
+    }
+}
+
+}
+
+SCENARIO("The components of an index are shared through a segment") {
+    using namespace shared_index_segment_test;
+    GIVEN("An index of several components") {
+        auto dir = boost::filesystem::temp_directory_path() /
+                   boost::filesystem::unique_path("salmon-shared-index-%%%%-%%%%");
+        boost::filesystem::create_directories(dir);
+        std::vector<std::string> components{"bwt.bin", "sa.bin", "empty.bin"};
+        std::vector<std::string> bytes{randomBytes(10000, 1), randomBytes(13, 2), std::string()};
+        for (size_t i = 0; i < components.size(); ++i) { writeFile(dir / components[i], bytes[i]); }
+
+        std::string unique = boost::filesystem::unique_path("test-%%%%-%%%%-%%%%").string();
+        for (std::string name : {(dir / "segment").string(), unique}) {
+            WHEN("processes attach to the " + std::string(name[0] == '/' ? "file-backed" : "shared-memory") +
+                 " segment") {
+                std::string err;
+                SharedIndexSegment first, second;
+                REQUIRE(first.attach(name, dir, components, err));
+                REQUIRE(second.attach(name, dir, components, err));
+
+                THEN("the first loads the components, and the others find them loaded") {
+                    REQUIRE(first.loadedHere());
+                    REQUIRE(!second.loadedHere());
+                    REQUIRE(holds(first, components, bytes));
+                    REQUIRE(holds(second, components, bytes));
+                    REQUIRE(contentsOf(first, "other.bin") == "<missing>");
+                }
+                THEN("a segment of another version of the index is replaced only once it's unused") {
+                    bytes[1] = randomBytes(17, 3);
+                    writeFile(dir / components[1], bytes[1]);
+                    SharedIndexSegment third;
+                    REQUIRE(!third.attach(name, dir, components, err));
+                    REQUIRE(!err.empty());
+                    first.detach();
+                    second.detach();
+                    err.clear();
+                    REQUIRE(third.attach(name, dir, components, err));
+                    REQUIRE(third.loadedHere());
+                    REQUIRE(holds(third, components, bytes));
+                }
+                THEN("the lock is removed by the last process to detach") {
+                    REQUIRE(lockExists(name));
+                    first.detach();
+                    REQUIRE(lockExists(name));
+                    second.detach();
+                    REQUIRE(!lockExists(name));
+                    SharedIndexSegment third;
+                    REQUIRE(third.attach(name, dir, components, err));
+                    REQUIRE(!third.loadedHere());
+                    REQUIRE(holds(third, components, bytes));
+                }
+                THEN("a segment of another user is refused") {
+                    // only root can give the segment away
+                    if (::geteuid() == 0 and name[0] == '/') {
+                        REQUIRE(::chown(name.c_str(), 1, static_cast<gid_t>(-1)) == 0);
+                        SharedIndexSegment other;
+                        REQUIRE(!other.attach(name, dir, components, err));
+                        REQUIRE(!err.empty());
+                        REQUIRE(!other.attached());
+                    }
+                }
+                THEN("a missing component is refused") {
+                    SharedIndexSegment other;
+                    REQUIRE(!other.attach(name, dir, {"bwt.bin", "missing.bin"}, err));
+                    REQUIRE(!err.empty());
+                    REQUIRE(!other.attached());
+                }
+                first.detach();
+                second.detach();
+                removeSegment(name);
+            }
+        }
+        boost::filesystem::remove_all(dir);
+    }
+}
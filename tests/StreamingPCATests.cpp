@@ -0,0 +1,51 @@
+#include <cmath>
+#include "StreamingPCA.hpp"
+
+SCENARIO("The streaming PCA recovers a known decomposition") {
+    GIVEN("A 4 x 3 matrix with large column means, whose centered part is U S V^T") {
+        // U has orthonormal columns, each orthogonal to the ones vector (so
+        // that U S V^T is centered), and S = diag(4, 2)
+        Eigen::MatrixXd U(4, 2);
+        U << 0.5, 0.5,
+             0.5, -0.5,
+             -0.5, 0.5,
+             -0.5, -0.5;
+        Eigen::Vector2d S(4.0, 2.0);
+        Eigen::MatrixXd V(3, 2);
+        V << 1.0 / std::sqrt(2.0), 0.0,
+             1.0 / std::sqrt(2.0), 0.0,
+             0.0, 1.0;
+        Eigen::RowVector3d means(1.0e8, 2.0e8, 3.0e8);
+        Eigen::MatrixXd X = U * S.asDiagonal() * V.transpose();
+        X.rowwise() += means;
+
+        StreamingPCA::RowSource source = [&X](size_t first, size_t b, Eigen::MatrixXd& block) -> bool {
+            block = X.middleRows(first, b);
+            return true;
+        };
+
+        WHEN("two components are computed, a row at a time") {
+            StreamingPCA pca(2);
+            REQUIRE(pca.fit(source, 4, 3, 1));
+
+            THEN("the variances are the squared singular values over n - 1") {
+                REQUIRE(pca.numComponents() == 2);
+                REQUIRE(pca.variances()(0) == Approx(16.0 / 3.0));
+                REQUIRE(pca.variances()(1) == Approx(4.0 / 3.0));
+            }
+            THEN("the total variance is computed without cancellation") {
+                REQUIRE(pca.totalVariance() == Approx(20.0 / 3.0));
+            }
+            THEN("the components are the right singular vectors, up to sign") {
+                for (int c = 0; c < 2; ++c) {
+                    double dot = pca.components().col(c).dot(V.col(c));
+                    REQUIRE(std::abs(dot) == Approx(1.0));
+                    Eigen::VectorXd expectedScores = U.col(c) * S(c) * ((dot > 0.0) ? 1.0 : -1.0);
+                    for (int i = 0; i < 4; ++i) {
+                        REQUIRE(pca.scores()(i, c) == Approx(expectedScores(i)));
+                    }
+                }
+            }
+        }
+    }
+}
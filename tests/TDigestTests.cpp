@@ -0,0 +1,45 @@
+#include <random>
+#include "TDigest.hpp"
+#include "SampleSummary.hpp"
+
+SCENARIO("The t-digest estimates the quantiles of a stream of values") {
+    GIVEN("The values 0, 1, ..., 9999 in a random order") {
+        std::vector<double> vals(10000);
+        for (size_t i = 0; i < vals.size(); ++i) { vals[i] = static_cast<double>(i); }
+        std::mt19937 gen(17);
+        std::shuffle(vals.begin(), vals.end(), gen);
+
+        TDigest digest;
+        for (auto v : vals) { digest.add(v); }
+        WHEN("the quantiles are estimated") {
+            THEN("they are close to the true quantiles") {
+                REQUIRE(digest.quantile(0.5) == Approx(5000.0).epsilon(0.02));
+                REQUIRE(digest.quantile(0.025) == Approx(250.0).epsilon(0.1));
+                REQUIRE(digest.quantile(0.975) == Approx(9750.0).epsilon(0.02));
+            }
+            THEN("the extremes are exact") {
+                REQUIRE(digest.quantile(0.0) == 0.0);
+                REQUIRE(digest.quantile(1.0) == 9999.0);
+            }
+            THEN("the digest is much smaller than the stream") {
+                REQUIRE(digest.numCentroids() < 200);
+            }
+        }
+    }
+}
+
+SCENARIO("The sample summary accumulates the mean and variance of each transcript") {
+    GIVEN("Three replicates of two transcripts") {
+        SampleSummary summary(2);
+        summary.add(std::vector<double>{1.0, 10.0});
+        summary.add(std::vector<double>{2.0, 10.0});
+        summary.add(std::vector<double>{3.0, 10.0});
+        THEN("the mean and variance agree with the direct computation") {
+            REQUIRE(summary.numSamples() == 3);
+            REQUIRE(summary.mean(0) == Approx(2.0));
+            REQUIRE(summary.variance(0) == Approx(1.0));
+            REQUIRE(summary.mean(1) == Approx(10.0));
+            REQUIRE(summary.variance(1) == Approx(0.0));
+        }
+    }
+}
@@ -0,0 +1,48 @@
+#include <string>
+#include <vector>
+#include <boost/filesystem.hpp>
+#include "TranscriptBiasTables.hpp"
+
+SCENARIO("The k-mer indices read from the bias tables match those computed from the sequences") {
+    GIVEN("Transcripts with mixed case, non-ACGT bases, and some shorter than k") {
+        std::vector<std::string> txps{
+            "ACGTACGTTTGCAGGCATCGATCGGGCTTAAACGT",
+            "acgtNacgtGGCCuuAACCGGTTACGTRACGTACGATCGA",
+            "GATTACA",
+            "CG",
+            "",
+            "TTTTTTTTTTGGGGGGGGGGCCCCCCCCCCAAAAAAAAAA"};
+        std::vector<const char*> seqs;
+        std::vector<uint32_t> lens;
+        for (auto& t : txps) {
+            seqs.push_back(t.data());
+            lens.push_back(t.size());
+        }
+        auto dir = boost::filesystem::temp_directory_path() /
+                   boost::filesystem::unique_path("salmon-bias-tables-%%%%-%%%%");
+        boost::filesystem::create_directories(dir);
+
+        for (uint32_t k = 1; k <= TranscriptBiasTables::maxK; ++k) {
+            WHEN("the tables are written and mapped for k = " + std::to_string(k)) {
+                std::string err;
+                REQUIRE(TranscriptBiasTables::write(dir, k, seqs, lens, err));
+                TranscriptBiasTables tables;
+                REQUIRE(tables.open(dir, err));
+                REQUIRE(tables.k() == k);
+                REQUIRE(tables.numTranscripts() == txps.size());
+
+                THEN("indicesOf gives what RollingKmerIndex::indicesOf gives for every transcript") {
+                    std::vector<uint32_t> fw, rc, expectedFw, expectedRc;
+                    for (size_t t = 0; t < txps.size(); ++t) {
+                        REQUIRE(tables.length(t) == lens[t]);
+                        TranscriptBiasTables::indicesOf(tables.kmers(t), lens[t], k, fw, rc);
+                        RollingKmerIndex::indicesOf(seqs[t], lens[t], k, expectedFw, expectedRc);
+                        REQUIRE(fw == expectedFw);
+                        REQUIRE(rc == expectedRc);
+                    }
+                }
+            }
+        }
+        boost::filesystem::remove_all(dir);
+    }
+}
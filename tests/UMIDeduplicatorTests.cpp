@@ -0,0 +1,95 @@
+#include <string>
+#include <thread>
+#include <vector>
+#include "UMIDeduplicator.hpp"
+
+namespace umi_deduplicator_test {
+
+inline uint64_t code(const std::string& umi) {
+    uint64_t c{0};
+    UMIDeduplicator::encode(umi.data(), umi.size(), c);
+    return c;
+}
+
+// Record count fragments of the class labelHash with the UMI umi
+inline void addMany(UMIDeduplicator& d, uint64_t labelHash, const std::string& umi, size_t count) {
+    for (size_t i = 0; i < count; ++i) { d.add(labelHash, true, code(umi)); }
+}
+
+}
+
+SCENARIO("UMIs are packed with their length") {
+    using namespace umi_deduplicator_test;
+    GIVEN("UMIs of different lengths and bases") {
+        uint64_t c{0};
+        THEN("only UMIs of A, C, G and T, of 1 to maxUMILength bases, are packed") {
+            REQUIRE(UMIDeduplicator::encode("ACGT", 4, c));
+            REQUIRE(!UMIDeduplicator::encode("ACNT", 4, c));
+            REQUIRE(!UMIDeduplicator::encode("", 0, c));
+            std::string longest(UMIDeduplicator::maxUMILength, 'G');
+            REQUIRE(UMIDeduplicator::encode(longest.data(), longest.size(), c));
+            std::string tooLong(UMIDeduplicator::maxUMILength + 1, 'G');
+            REQUIRE(!UMIDeduplicator::encode(tooLong.data(), tooLong.size(), c));
+        }
+        THEN("case doesn't matter, and UMIs of all A that differ in length differ") {
+            REQUIRE(code("acgt") == code("ACGT"));
+            REQUIRE(code("A") != code("AA"));
+            REQUIRE(code("AAAA") != code("AAAC"));
+        }
+    }
+}
+
+SCENARIO("The molecules of a class are its distinct UMIs") {
+    using namespace umi_deduplicator_test;
+    GIVEN("A class of duplicated UMIs, one UMI a single error away from another, and untagged fragments") {
+        const uint64_t label = 12345;
+        const uint64_t other = 777;
+        UMIDeduplicator exact(false, 8), directional(true, 8);
+        for (auto* d : {&exact, &directional}) {
+            addMany(*d, label, "AAAA", 10);
+            // one substitution from AAAA, and seen far less often
+            addMany(*d, label, "AAAC", 2);
+            // one substitution from AAAC
+            addMany(*d, label, "AACC", 1);
+            addMany(*d, label, "GGGG", 1);
+            d->add(label, false, 0);
+            d->add(label, false, 0);
+            // as often as TTTT, so not an error of it
+            addMany(*d, other, "TTTT", 3);
+            addMany(*d, other, "TTTA", 3);
+        }
+
+        THEN("each distinct UMI is a molecule, as is each untagged fragment") {
+            REQUIRE(exact.numMolecules(label, 16) == 6);
+            REQUIRE(exact.numMolecules(other, 6) == 2);
+        }
+        THEN("collapsing single errors merges a UMI into one seen about twice as often") {
+            REQUIRE(directional.numMolecules(label, 16) == 4);
+            REQUIRE(directional.numMolecules(other, 6) == 2);
+        }
+        THEN("a class without recorded fragments keeps its fragment count") {
+            REQUIRE(exact.numMolecules(99, 5) == 5);
+            REQUIRE(directional.numMolecules(99, 5) == 5);
+        }
+    }
+    GIVEN("Fragments recorded from several threads at once") {
+        UMIDeduplicator d(false, 4);
+        const size_t numThreads = 4;
+        const uint64_t numLabels = 64;
+        std::vector<std::string> umis{"ACGTAC", "ACGTAA", "TTGCAC", "GGGCCC", "CATCAT"};
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < numThreads; ++t) {
+            threads.emplace_back([&d, &umis, numLabels]() -> void {
+                for (uint64_t l = 0; l < numLabels; ++l) {
+                    for (size_t u = 0; u <= l % umis.size(); ++u) { addMany(d, l, umis[u], 3); }
+                }
+            });
+        }
+        for (auto& t : threads) { t.join(); }
+        THEN("every class has the molecules it would have had from one thread") {
+            for (uint64_t l = 0; l < numLabels; ++l) {
+                REQUIRE(d.numMolecules(l, 0) == 1 + l % umis.size());
+            }
+        }
+    }
+}
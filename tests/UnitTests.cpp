@@ -1,4 +1,5 @@
 #define CATCH_CONFIG_MAIN  // This tells Catch to provide a main() - only do this in one cpp file
+#define CATCH_CONFIG_COUNTER  // Names test cases by __COUNTER__: the tests below share this one file
 #include <unordered_map>
 #include <iostream>
 #include "catch.hpp"
@@ -9,3 +10,26 @@ bool verbose=false; // Apparently, we *need* this (OSX)
 
 #include "LibraryTypeTests.cpp"
 #include "KmerHistTests.cpp"
+#include "SalmonMathTests.cpp"
+#include "TDigestTests.cpp"
+#include "StreamingPCATests.cpp"
+#include "BootstrapEMTests.cpp"
+#include "MultinomialSamplerTests.cpp"
+#include "TranscriptBiasTablesTests.cpp"
+#include "MappingCacheTests.cpp"
+#include "PosteriorWriterTests.cpp"
+#include "EqLabelDictionaryTests.cpp"
+#include "KmerIntervalMapTests.cpp"
+#include "ParallelTextWriterTests.cpp"
+#include "UMIDeduplicatorTests.cpp"
+#include "KmerClassTableTests.cpp"
+#include "EMDeviceTests.cpp"
+#include "MappedFastqReaderTests.cpp"
+#include "ReadaheadFileTests.cpp"
+#include "EquivalenceClassMergeTests.cpp"
+#include "FragmentLengthDistributionTests.cpp"
+#include "EquivalenceClassComponentsTests.cpp"
+#include "MetricsServerTests.cpp"
+#include "UnmappedNameWriterTests.cpp"
+#include "AbundanceSnapshotWriterTests.cpp"
+#include "SharedIndexSegmentTests.cpp"
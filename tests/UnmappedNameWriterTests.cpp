@@ -0,0 +1,91 @@
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include "UnmappedNameWriter.hpp"
+
+namespace unmapped_name_writer_test {
+
+// The lines of the (possibly multi-member) gzipped file at path
+inline std::vector<std::string> gzipLines(const boost::filesystem::path& path) {
+    std::ifstream file(path.string(), std::ios::binary);
+    boost::iostreams::filtering_istream in;
+    in.push(boost::iostreams::gzip_decompressor());
+    in.push(file);
+    std::vector<std::string> lines;
+    std::string line;
+    while (std::getline(in, line)) { lines.push_back(line); }
+    return lines;
+}
+
+}
+
+SCENARIO("The names of unmapped fragments are written from many threads") {
+    using namespace unmapped_name_writer_test;
+    GIVEN("Mapping threads that each leave more than a block of names unmapped") {
+        auto path = boost::filesystem::temp_directory_path() /
+                    boost::filesystem::unique_path("salmon-unmapped-%%%%-%%%%.gz");
+        const size_t numThreads = 4;
+        const size_t namesPerThread = 40000;
+        const char reasons[] = {UnmappedNameWriter::unmapped, UnmappedNameWriter::tooManyHits,
+                                UnmappedNameWriter::tooShort};
+        // Each thread's names, with suffixes and comments that aren't written
+        auto header = [](size_t t, size_t i) -> std::string {
+            std::string name = "thread" + std::to_string(t) + ".read" + std::to_string(i);
+            switch (i % 4) {
+                case 0: return name;
+                case 1: return name + "/1";
+                case 2: return name + "/2 length=100";
+                default: return name + "\tcomment";
+            }
+        };
+
+        WHEN("the threads add their names and the writer finishes") {
+            uint64_t numNames{0};
+            {
+                UnmappedNameWriter writer(path);
+                REQUIRE(writer.good());
+                std::vector<std::thread> threads;
+                for (size_t t = 0; t < numThreads; ++t) {
+                    threads.emplace_back([&, t]() -> void {
+                        UnmappedNameBuffer buf(&writer);
+                        for (size_t i = 0; i < namesPerThread; ++i) { buf.add(header(t, i), reasons[i % 3]); }
+                    });
+                }
+                for (auto& t : threads) { t.join(); }
+                writer.finish();
+                numNames = writer.numNames();
+            }
+
+            THEN("the file holds every name, without its suffix, and its reason") {
+                REQUIRE(numNames == numThreads * namesPerThread);
+                auto lines = gzipLines(path);
+                REQUIRE(lines.size() == numThreads * namesPerThread);
+                std::vector<std::string> expected;
+                for (size_t t = 0; t < numThreads; ++t) {
+                    for (size_t i = 0; i < namesPerThread; ++i) {
+                        expected.push_back("thread" + std::to_string(t) + ".read" + std::to_string(i) + " " +
+                                           reasons[i % 3]);
+                    }
+                }
+                std::sort(lines.begin(), lines.end());
+                std::sort(expected.begin(), expected.end());
+                REQUIRE(lines == expected);
+            }
+        }
+        WHEN("no fragment is left unmapped") {
+            {
+                UnmappedNameWriter writer(path);
+                UnmappedNameBuffer buf(&writer);
+            }
+            THEN("the file is empty") {
+                REQUIRE(boost::filesystem::file_size(path) == 0);
+            }
+        }
+        boost::filesystem::remove(path);
+    }
+}